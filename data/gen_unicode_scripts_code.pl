@@ -14,31 +14,96 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-# Generate unicode_sciript_data.h from Unicode Scripts.txt
+# Generate unicode_script_map.h from Unicode Scripts.txt
 #
-# usage: ./gen_unicode_Scripts_code.pl < scripts > unicode_script_data.h
+# usage: ./gen_unicode_scripts_code.pl < Scripts.txt > unicode_script_map.h
 #
-print "#ifndef UNICODE_SCRIPT_DATA_H_\n";
-print "#define UNICODE_SCRIPT_DATA_H_\n";
-print "namespace sentencepiece {\n";
-print "namespace unicode_script {\n";
-print "namespace {\n";
-print "void InitTable(std::unordered_map<char32, ScriptType> *smap) {\n";
-print "  CHECK_NOTNULL(smap)->clear();\n";
+# The scripts are emitted as a two-level table. The codepoints are split
+# into blocks of 2^$block_shift, identical blocks are stored once, and
+# kScriptBlockIndex maps each block of codepoints to its stored block.
 
+use strict;
+
+my $block_shift = 7;
+my $block_size = 1 << $block_shift;
+
+my @script;
 while (<>) {
   chomp;
   if (/^([0-9A-F]+)\s+;\s+(\S+)\s+\#/) {
-    printf("  (*smap)[0x%s] = U_%s;\n", $1, $2);
+    $script[hex($1)] = $2;
   } elsif (/^([0-9A-F]+)\.\.([0-9A-F]+)\s+;\s+(\S+)\s+\#/) {
-    printf("  for (char32 c = 0x%s; c <= 0x%s; ++c)\n", $1, $2);
-    printf("    (*smap)[c] = U_%s;\n", $3);
-  } else {
-    next;
+    for my $c (hex($1) .. hex($2)) {
+      $script[$c] = $3;
+    }
+  }
+}
+
+my $num_blocks = int(($#script + $block_size) / $block_size);
+my $table_size = $num_blocks * $block_size;
+my (@index, @blocks, %block_id);
+for my $b (0 .. $num_blocks - 1) {
+  my @block = map { $script[$_] // 'Common' }
+      ($b * $block_size .. ($b + 1) * $block_size - 1);
+  my $key = join(',', @block);
+  unless (exists $block_id{$key}) {
+    $block_id{$key} = scalar(@blocks) / $block_size;
+    push(@blocks, @block);
   }
+  push(@index, $block_id{$key});
 }
+my $index_type = scalar(@blocks) / $block_size <= 256 ? 'uint8' : 'uint16';
+
+# Prints the values comma-separated, filling lines up to 80 columns.
+sub print_values {
+  my $line = '   ';
+  for my $value (@_) {
+    if (length($line) + length($value) + 2 > 80) {
+      print "$line\n";
+      $line = '   ';
+    }
+    $line .= " $value,";
+  }
+  print "$line\n";
+}
+
+print <<'EOS';
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Generated by data/gen_unicode_scripts_code.pl. Do not edit.
 
-print "}\n";
+#ifndef UNICODE_SCRIPT_DATA_H_
+#define UNICODE_SCRIPT_DATA_H_
+namespace sentencepiece {
+namespace unicode_script {
+namespace {
+// The script of codepoint c < kScriptTableSize is
+// kScriptBlocks[(kScriptBlockIndex[c >> kScriptBlockShift]
+//                << kScriptBlockShift) | (c & kScriptBlockMask)].
+// Codepoints from kScriptTableSize on are U_Common.
+EOS
+printf("constexpr int kScriptBlockShift = %d;\n", $block_shift);
+printf("constexpr char32 kScriptBlockMask = 0x%X;\n", $block_size - 1);
+printf("constexpr char32 kScriptTableSize = 0x%X;\n", $table_size);
+print "\n";
+printf("constexpr %s kScriptBlockIndex[] = {\n", $index_type);
+print_values(@index);
+print "};\n\n";
+print "constexpr uint8 kScriptBlocks[] = {\n";
+print_values(map { "U_$_" } @blocks);
+print "};\n";
 print "}  // namespace\n";
 print "}  // namespace unicode_script\n";
 print "}  // namespace sentencepiece\n";
@@ -58,19 +58,26 @@ def is_sentencepiece_installed():
     return False
 
 
+def get_libs_private(pc_file):
+  """Returns the system libraries the static libraries are linked with."""
+  with open(pc_file) as f:
+    for line in f:
+      if line.startswith('Libs.private:'):
+        return line[len('Libs.private:'):].split()
+  return []
+
+
 def get_cflags_and_libs(root):
   cflags = ['-std=c++17', '-I' + os.path.join(root, 'include')]
   libs = []
-  if os.path.exists(os.path.join(root, 'lib/pkgconfig/sentencepiece.pc')):
-    libs = [
-        os.path.join(root, 'lib/libsentencepiece.a'),
-        os.path.join(root, 'lib/libsentencepiece_train.a'),
-    ]
-  elif os.path.exists(os.path.join(root, 'lib64/pkgconfig/sentencepiece.pc')):
-    libs = [
-        os.path.join(root, 'lib64/libsentencepiece.a'),
-        os.path.join(root, 'lib64/libsentencepiece_train.a'),
-    ]
+  for libdir in ['lib', 'lib64']:
+    pc_file = os.path.join(root, libdir, 'pkgconfig/sentencepiece.pc')
+    if os.path.exists(pc_file):
+      libs = [
+          os.path.join(root, libdir, 'libsentencepiece.a'),
+          os.path.join(root, libdir, 'libsentencepiece_train.a'),
+      ] + get_libs_private(pc_file)
+      break
   return cflags, libs
 
 
@@ -194,6 +201,7 @@ setup(
     py_modules=[
         'sentencepiece/__init__',
         'sentencepiece/_version',
+        'sentencepiece/benchmark',
         'sentencepiece/sentencepiece_model_pb2',
         'sentencepiece/sentencepiece_pb2',
     ],
@@ -154,13 +154,17 @@ class ImmutableSentencePieceText(object):
 
       def __getitem__(self, index):
         if isinstance(index, slice):
-          return [self.proto._pieces(i) for i in range(self.len)][index.start:index.stop:index.step]
+          return [self.proto._pieces(i) for i in range(*index.indices(self.len))]
         if index < 0:
           index = index + self.len
         if index < 0 or index >= self.len:
           raise IndexError('piece index is out of range')
         return self.proto._pieces(index)
 
+      def __iter__(self):
+        for i in range(self.len):
+          yield self.proto._pieces(i)
+
       def __str__(self):
         return '\n'.join(['pieces {{\n{}}}'.format(str(x)) for x in self])
 
@@ -214,13 +218,17 @@ class ImmutableNBestSentencePieceText(object):
 
       def __getitem__(self, index):
         if isinstance(index, slice):
-          return [self.proto._nbests(i) for i in range(self.len)][index.start:index.stop:index.step]
+          return [self.proto._nbests(i) for i in range(*index.indices(self.len))]
         if index < 0:
           index = index + self.len
         if index < 0 or index >= self.len:
           raise IndexError('nbests index is out of range')
         return self.proto._nbests(index)
 
+      def __iter__(self):
+        for i in range(self.len):
+          yield self.proto._nbests(i)
+
       def __str__(self):
         return '\n'.join(['nbests {{\n{}}}'.format(str(x)) for x in self])
 
@@ -312,6 +320,9 @@ class SentencePieceProcessor(object):
     def serialized_model_proto(self):
         return _sentencepiece.SentencePieceProcessor_serialized_model_proto(self)
 
+    def model_file(self):
+        return _sentencepiece.SentencePieceProcessor_model_file(self)
+
     def LoadFromFile(self, arg):
         return _sentencepiece.SentencePieceProcessor_LoadFromFile(self, arg)
 
@@ -330,6 +341,18 @@ class SentencePieceProcessor(object):
     def _EncodeAsIdsBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
         return _sentencepiece.SentencePieceProcessor__EncodeAsIdsBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
 
+    def _EncodeAsIdsFlatBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsFlatBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
+    def _NarrowIds(self, ids):
+        return _sentencepiece.SentencePieceProcessor__NarrowIds(self, ids)
+
+    def _EncodeCorpus(self, ins, add_bos, add_eos, reverse):
+        return _sentencepiece.SentencePieceProcessor__EncodeCorpus(self, ins, add_bos, add_eos, reverse)
+
+    def _EncodeAsIdsPaddedBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece, max_length, pad_to_max_length, pad_to_multiple_of, pad_left, truncate_left, pad_id):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsPaddedBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece, max_length, pad_to_max_length, pad_to_multiple_of, pad_left, truncate_left, pad_id)
+
     def _EncodeAsPiecesBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
         return _sentencepiece.SentencePieceProcessor__EncodeAsPiecesBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
 
@@ -339,6 +362,18 @@ class SentencePieceProcessor(object):
     def _EncodeAsImmutableProtoBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
         return _sentencepiece.SentencePieceProcessor__EncodeAsImmutableProtoBatch(self, ins, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
 
+    def _EncodeAsIdsFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
+    def _EncodeAsIdsFlatFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsFlatFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
+    def _EncodeAsPiecesFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsPiecesFromBuffer(self, data, offsets, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
+    def _EncodeArrow(self, validity, offset, offsets, data, large_offsets, add_bos, add_eos, reverse):
+        return _sentencepiece.SentencePieceProcessor__EncodeArrow(self, validity, offset, offsets, data, large_offsets, add_bos, add_eos, reverse)
+
     def _DecodeIds(self, ids):
         return _sentencepiece.SentencePieceProcessor__DecodeIds(self, ids)
 
@@ -405,18 +440,30 @@ class SentencePieceProcessor(object):
     def _SampleEncodeAndScoreAsImmutableProto(self, text, num_samples, alpha, wor, include_best, add_bos, add_eos, reverse, emit_unk_piece):
         return _sentencepiece.SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto(self, text, num_samples, alpha, wor, include_best, add_bos, add_eos, reverse, emit_unk_piece)
 
+    def _SampleEncodeManyAsIdsBatch(self, ins, num_threads, num_samples, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__SampleEncodeManyAsIdsBatch(self, ins, num_threads, num_samples, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
+    def _SampleEncodeManyAsPiecesBatch(self, ins, num_threads, num_samples, alpha, add_bos, add_eos, reverse, emit_unk_piece):
+        return _sentencepiece.SentencePieceProcessor__SampleEncodeManyAsPiecesBatch(self, ins, num_threads, num_samples, alpha, add_bos, add_eos, reverse, emit_unk_piece)
+
     def _Normalize(self, text):
         return _sentencepiece.SentencePieceProcessor__Normalize(self, text)
 
     def _NormalizeWithOffsets(self, text):
         return _sentencepiece.SentencePieceProcessor__NormalizeWithOffsets(self, text)
 
+    def _NormalizeBatch(self, ins, with_offsets):
+        return _sentencepiece.SentencePieceProcessor__NormalizeBatch(self, ins, with_offsets)
+
     def _CalculateEntropy(self, text, alpha):
         return _sentencepiece.SentencePieceProcessor__CalculateEntropy(self, text, alpha)
 
     def _CalculateEntropyBatch(self, ins, alpha, num_threads):
         return _sentencepiece.SentencePieceProcessor__CalculateEntropyBatch(self, ins, alpha, num_threads)
 
+    def _CalculateEntropyAndExpectedCountsBatch(self, ins, alpha):
+        return _sentencepiece.SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch(self, ins, alpha)
+
     def _OverrideNormalizerSpec(self, args):
         return _sentencepiece.SentencePieceProcessor__OverrideNormalizerSpec(self, args)
 
@@ -468,6 +515,20 @@ class SentencePieceProcessor(object):
         self.Load(model_file=model_file, model_proto=model_proto)
 
 
+    def _IdArray(self, ids, dtype):
+      """Returns the int32 ids in the bytes `ids` as a memoryview of `dtype`."""
+      name = dtype if dtype is None or isinstance(dtype, str) else getattr(
+          dtype, 'name', getattr(dtype, '__name__', None))
+      if name is None or name == 'int32':
+        return memoryview(ids).cast('i')
+      if name == 'uint16':
+        return memoryview(self._NarrowIds(ids)).cast('H')
+      if name == 'uint32':
+        # The ids are not negative, so they are the same bytes.
+        return memoryview(ids).cast('I')
+      raise RuntimeError('unknown dtype={}'.format(dtype))
+
+
     def Encode(self,
                input,
                out_type=None,
@@ -478,12 +539,18 @@ class SentencePieceProcessor(object):
                enable_sampling=None,
                nbest_size=None,
                alpha=None,
-               num_threads=None):
+               num_threads=None,
+               dtype=None):
       """Encode text input to segmented ids or tokens.
 
         Args:
         input: input string. accepsts list of string.
-        out_type: output type. int or str.
+        out_type: output type. int, str or 'array'. 'array' returns the ids
+                  as an int32 memoryview, and for a list input a pair of
+                  the ids of all the inputs and an int64 memoryview of
+                  len(input) + 1 offsets, where the ids of input[i] are
+                  ids[offsets[i]:offsets[i + 1]]. numpy.asarray() wraps them
+                  without a copy.
         add_bos: Add <s> to the result (Default = false)
         add_eos: Add </s> to the result (Default = false) <s>/</s> is added after
                  reversing (if enabled).
@@ -498,6 +565,9 @@ class SentencePieceProcessor(object):
         alpha: Soothing parameter for unigram sampling, and merge probability for
                BPE-dropout (probablity 'p' in BPE-dropout paper).
         num_threads: the number of threads used in the batch processing (Default = -1).
+        dtype: type of the 'array' ids: 'int32' (default), 'uint16', which
+               halves the memory of the vocabularies of up to 65536 pieces, or
+               'uint32'. A numpy dtype is also accepted.
       """
 
       if out_type is None:
@@ -538,6 +608,10 @@ class SentencePieceProcessor(object):
         if out_type is str:
           return self._EncodeAsPiecesBatch(input, num_threads, enable_sampling, nbest_size,
                                            alpha, add_bos, add_eos, reverse, emit_unk_piece)
+        if out_type == 'array':
+          ids, offsets = self._EncodeAsIdsFlatBatch(input, num_threads, enable_sampling, nbest_size,
+                                                    alpha, add_bos, add_eos, reverse, emit_unk_piece)
+          return self._IdArray(ids, dtype), memoryview(offsets).cast('q')
         if out_type == 'serialized_proto' or out_type == 'proto':
           return self._EncodeAsSerializedProtoBatch(input, num_threads, enable_sampling, nbest_size,
                                                     alpha, add_bos, add_eos, reverse, emit_unk_piece)
@@ -551,6 +625,10 @@ class SentencePieceProcessor(object):
       if out_type is str:
         return self._EncodeAsPieces(input, enable_sampling, nbest_size,
                                     alpha, add_bos, add_eos, reverse, emit_unk_piece)
+      if out_type == 'array':
+        ids, _ = self._EncodeAsIdsFlatBatch([input], 1, enable_sampling, nbest_size,
+                                            alpha, add_bos, add_eos, reverse, emit_unk_piece)
+        return self._IdArray(ids, dtype)
       if out_type == 'serialized_proto' or out_type == 'proto':
         return self._EncodeAsSerializedProto(input, enable_sampling, nbest_size,
                                              alpha, add_bos, add_eos, reverse, emit_unk_piece)
@@ -578,6 +656,275 @@ class SentencePieceProcessor(object):
       return self.Encode(input=input, out_type='immutable_proto', **kwargs)
 
 
+    def EncodePadded(self,
+                     input,
+                     max_length=None,
+                     padding='longest',
+                     pad_to_multiple_of=None,
+                     padding_side='right',
+                     truncation_side='right',
+                     pad_id=None,
+                     add_bos=None,
+                     add_eos=None,
+                     reverse=None,
+                     emit_unk_piece=None,
+                     enable_sampling=None,
+                     nbest_size=None,
+                     alpha=None,
+                     num_threads=None):
+      """Encode a list of strings into a padded [len(input), width] matrix of ids.
+
+        Args:
+        input: list of strings.
+        max_length: the ids longer than max_length, including <s> and </s>,
+                    are truncated (Default = no truncation).
+        padding: 'longest' pads to the longest ids, 'max_length' to max_length.
+        pad_to_multiple_of: rounds the width up to a multiple of it.
+        padding_side: 'right' or 'left'.
+        truncation_side: 'right' drops the last ids, 'left' the first ones.
+        pad_id: id of the padding (Default = pad_id()).
+        The other arguments are the same as in Encode().
+
+        Returns:
+        A pair of int32 memoryviews of shape [len(input), width]: the ids and the
+        attention mask, which is 1 at the ids and 0 at the padding. numpy.asarray()
+        wraps them without a copy. The memoryviews are 1-D when they are empty.
+      """
+
+      if add_bos is None:
+        add_bos = self._add_bos
+      if add_eos is None:
+        add_eos = self._add_eos
+      if reverse is None:
+        reverse = self._reverse
+      if emit_unk_piece is None:
+        emit_unk_piece = self._emit_unk_piece
+      if enable_sampling is None:
+        enable_sampling = self._enable_sampling
+      if nbest_size is None:
+        nbest_size = self._nbest_size
+      if alpha is None:
+        alpha = self._alpha
+      if num_threads is None:
+        num_threads = self._num_threads
+      if pad_id is None:
+        pad_id = self.pad_id()
+
+      if type(input) is not list:
+        raise RuntimeError('input must be a list of strings')
+      if pad_id < 0:
+        raise RuntimeError('pad_id is not defined in the model; pass pad_id')
+      if padding not in ('longest', 'max_length'):
+        raise RuntimeError('unknown padding={}'.format(padding))
+      if padding == 'max_length' and max_length is None:
+        raise RuntimeError('padding="max_length" requires max_length')
+      if padding_side not in ('right', 'left'):
+        raise RuntimeError('unknown padding_side={}'.format(padding_side))
+      if truncation_side not in ('right', 'left'):
+        raise RuntimeError('unknown truncation_side={}'.format(truncation_side))
+      if max_length is not None and (max_length <= 0 or max_length < int(add_bos) + int(add_eos)):
+        raise RuntimeError('max_length must be positive and hold <s> and </s>')
+      if max_length is None:
+        max_length = 0
+      if pad_to_multiple_of is None:
+        pad_to_multiple_of = 0
+
+      ids, mask, rows, width = self._EncodeAsIdsPaddedBatch(
+          input, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse,
+          emit_unk_piece, max_length, padding == 'max_length', pad_to_multiple_of,
+          padding_side == 'left', truncation_side == 'left', pad_id)
+      if rows * width == 0:
+        return memoryview(ids).cast('i'), memoryview(mask).cast('i')
+      return memoryview(ids).cast('i', [rows, width]), memoryview(mask).cast('i', [rows, width])
+
+
+    def EncodeCorpus(self, input, add_bos=None, add_eos=None, reverse=None, with_stats=False):
+      """Encode a large list of strings into ids on all the hardware threads.
+
+        The inputs are handed out to the workers longest first, and the short
+        ones in groups, so that a few long documents do not delay the end of the
+        call. The ids are returned in the order of input.
+
+        Args:
+        input: list of strings.
+        with_stats: also returns a dict of the per-worker 'num_inputs',
+                    'num_bytes', 'busy_seconds' and 'utilization' lists, and
+                    the 'elapsed_seconds' of the call.
+        The other arguments are the same as in Encode(). Sampling is not
+        supported.
+      """
+
+      if add_bos is None:
+        add_bos = self._add_bos
+      if add_eos is None:
+        add_eos = self._add_eos
+      if reverse is None:
+        reverse = self._reverse
+
+      if type(input) is not list:
+        raise RuntimeError('input must be a list of strings')
+
+      ids, stats = self._EncodeCorpus(input, add_bos, add_eos, reverse)
+      if not with_stats:
+        return ids
+      elapsed = stats['elapsed_seconds']
+      stats['utilization'] = [busy / elapsed if elapsed > 0 else 0.0
+                              for busy in stats['busy_seconds']]
+      return ids, stats
+
+
+    def EncodeFromBuffer(self,
+                         data,
+                         offsets,
+                         out_type=None,
+                         add_bos=None,
+                         add_eos=None,
+                         reverse=None,
+                         emit_unk_piece=None,
+                         enable_sampling=None,
+                         nbest_size=None,
+                         alpha=None,
+                         num_threads=None,
+                         dtype=None):
+      """Encode the sentences stored in one buffer, without a Python object per sentence.
+
+        Args:
+        data: UTF-8 sentences in a bytes-like object, e.g., bytes, memoryview or
+              the data buffer of an Arrow string array.
+        offsets: len(sentences) + 1 int32 or int64 offsets in a buffer, e.g.,
+                 array.array, memoryview or numpy array. The i-th sentence is
+                 data[offsets[i]:offsets[i + 1]].
+        out_type: output type. int, str or 'array' as in Encode().
+        dtype: type of the 'array' ids as in Encode().
+        The other arguments are the same as in Encode().
+      """
+
+      if out_type is None:
+        out_type = self._out_type
+      if add_bos is None:
+        add_bos = self._add_bos
+      if add_eos is None:
+        add_eos = self._add_eos
+      if reverse is None:
+        reverse = self._reverse
+      if emit_unk_piece is None:
+        emit_unk_piece = self._emit_unk_piece
+      if enable_sampling is None:
+        enable_sampling = self._enable_sampling
+      if nbest_size is None:
+        nbest_size = self._nbest_size
+      if alpha is None:
+        alpha = self._alpha
+      if num_threads is None:
+        num_threads = self._num_threads
+
+      if num_threads is None or type(num_threads) is not int:
+        raise RuntimeError('num_threads must be int')
+
+      if out_type is int:
+        return self._EncodeAsIdsFromBuffer(data, offsets, num_threads, enable_sampling, nbest_size,
+                                           alpha, add_bos, add_eos, reverse, emit_unk_piece)
+      if out_type is str:
+        return self._EncodeAsPiecesFromBuffer(data, offsets, num_threads, enable_sampling, nbest_size,
+                                              alpha, add_bos, add_eos, reverse, emit_unk_piece)
+      if out_type == 'array':
+        ids, offsets = self._EncodeAsIdsFlatFromBuffer(data, offsets, num_threads, enable_sampling,
+                                                       nbest_size, alpha, add_bos, add_eos, reverse,
+                                                       emit_unk_piece)
+        return self._IdArray(ids, dtype), memoryview(offsets).cast('q')
+
+      raise RuntimeError('unknown out_type={}'.format(out_type))
+
+
+    def EncodeArrowBuffers(self,
+                           validity,
+                           offsets,
+                           data,
+                           offset=0,
+                           length=None,
+                           large_offsets=False,
+                           add_bos=None,
+                           add_eos=None,
+                           reverse=None):
+      """Encode an Arrow string array given by its buffers into the buffers of a list<int32> array.
+
+        Args:
+        validity: validity bitmap of the array, or None when there are no nulls.
+                  A null string gives an empty list.
+        offsets: int32 offsets (int64 when large_offsets is True) into data.
+        data: UTF-8 strings of the array.
+        offset: offset of the array into the buffers.
+        length: number of strings. All the strings after offset by default.
+        large_offsets: True for the large_string type.
+        The other arguments are the same as in Encode(). Sampling is not
+        supported. The encoding runs on the worker threads of the processor.
+
+        Returns:
+        int32 memoryview of the ids and the memoryview of the length + 1 offsets
+        of the lists, whose type is the same as the offsets of the input.
+      """
+
+      if add_bos is None:
+        add_bos = self._add_bos
+      if add_eos is None:
+        add_eos = self._add_eos
+      if reverse is None:
+        reverse = self._reverse
+
+      width = 8 if large_offsets else 4
+      offsets = memoryview(offsets).cast('B')
+      if length is None:
+        length = len(offsets) // width - offset - 1
+      if offset < 0 or length < 0:
+        raise RuntimeError('offset and length must be non-negative')
+
+      # Slices the buffers at the byte of the validity bitmap holding offset.
+      start = offset - offset % 8
+      offsets = offsets[start * width:(offset + length + 1) * width]
+      if validity is None:
+        validity = b''
+      else:
+        validity = memoryview(validity).cast('B')[start // 8:]
+      if data is None:
+        data = b''
+
+      values, offsets = self._EncodeArrow(validity, offset % 8, offsets, data, large_offsets,
+                                          add_bos, add_eos, reverse)
+      return memoryview(values).cast('i'), memoryview(offsets).cast('q' if large_offsets else 'i')
+
+
+    def EncodeArrow(self, array, add_bos=None, add_eos=None, reverse=None):
+      """Encode a pyarrow string or large_string array into a list<int32> array.
+
+        A pyarrow.ChunkedArray gives a ChunkedArray. Null strings give null lists.
+        The strings are read in place; see EncodeArrowBuffers().
+      """
+
+      import pyarrow
+
+      large_offsets = pyarrow.types.is_large_string(array.type)
+      if not large_offsets and not pyarrow.types.is_string(array.type):
+        raise TypeError('array must be of string or large_string type')
+      list_type = pyarrow.large_list(pyarrow.int32()) if large_offsets else pyarrow.list_(
+          pyarrow.int32())
+
+      if isinstance(array, pyarrow.ChunkedArray):
+        return pyarrow.chunked_array(
+            [self.EncodeArrow(chunk, add_bos, add_eos, reverse) for chunk in array.chunks],
+            type=list_type)
+
+      validity, offsets, data = array.buffers()
+      values, offsets = self.EncodeArrowBuffers(validity, offsets, data, array.offset, len(array),
+                                                large_offsets, add_bos, add_eos, reverse)
+      values = pyarrow.Array.from_buffers(pyarrow.int32(), len(values),
+                                          [None, pyarrow.py_buffer(values)])
+      # The bitmap of is_valid() starts at the first string of the array.
+      validity = array.is_valid().buffers()[1] if array.null_count else None
+      return pyarrow.Array.from_buffers(list_type, len(array),
+                                        [validity, pyarrow.py_buffer(offsets)],
+                                        children=[values])
+
+
     def SampleEncodeAsPieces(self, input, nbest_size=None, alpha=None, **kwargs):
       return self.Encode(input=input, nbest_size=nbest_size, alpha=alpha,
                          out_type=str, enable_sampling=True, **kwargs)
@@ -773,6 +1120,67 @@ class SentencePieceProcessor(object):
                                        out_type='immutable_proto', **kwargs)
 
 
+    def SampleEncodeMany(self,
+                         input,
+                         num_samples,
+                         alpha=None,
+                         out_type=None,
+                         add_bos=None,
+                         add_eos=None,
+                         reverse=None,
+                         emit_unk_piece=None,
+                         num_threads=None):
+      """Samples num_samples segmentations of the input at once.
+
+        The unigram model builds the lattice of a sentence once and draws all
+        its samples from it, which is faster than calling Encode() with
+        enable_sampling=True and nbest_size=-1 num_samples times.
+
+        Args:
+        input: input string. accepsts list of string.
+        num_samples: the number of samples of each input.
+        alpha: inverse temperature for unigram, and merge probability for
+               BPE-dropout (Default = the alpha of the processor or 1.0).
+        out_type: output type. int or str.
+        num_threads: the number of threads used in the batch processing.
+        The other arguments are the same as in Encode().
+
+        Returns:
+        a list of num_samples samples, or a list of them per input string.
+      """
+
+      if out_type is None:
+        out_type = self._out_type
+      if add_bos is None:
+        add_bos = self._add_bos
+      if add_eos is None:
+        add_eos = self._add_eos
+      if reverse is None:
+        reverse = self._reverse
+      if emit_unk_piece is None:
+        emit_unk_piece = self._emit_unk_piece
+      if alpha is None:
+        alpha = 1. if self._alpha is None else self._alpha
+      if num_threads is None:
+        num_threads = self._num_threads
+
+      if type(num_samples) is not int or num_samples < 0:
+        raise RuntimeError('num_samples must be a non-negative int')
+
+      inputs = input if type(input) is list else [input]
+      if out_type is int:
+        samples = self._SampleEncodeManyAsIdsBatch(inputs, num_threads, num_samples, alpha,
+                                                   add_bos, add_eos, reverse, emit_unk_piece)
+      elif out_type is str:
+        samples = self._SampleEncodeManyAsPiecesBatch(inputs, num_threads, num_samples, alpha,
+                                                      add_bos, add_eos, reverse, emit_unk_piece)
+      else:
+        raise RuntimeError('unknown out_type')
+
+      outputs = [samples[i * num_samples:(i + 1) * num_samples] for i in range(len(inputs))]
+      return outputs if type(input) is list else outputs[0]
+
+
     def Decode(self, input, out_type=str, num_threads=None):
       """Decode processed id or token sequences.
 
@@ -892,8 +1300,24 @@ class SentencePieceProcessor(object):
       return self.Decode(input=input, out_type=out_type, **kwargs)
 
 
-    def CalculateEntropy(self, input, alpha, num_threads=None):
-      """Calculate sentence entropy"""
+    def CalculateEntropy(self, input, alpha, num_threads=None,
+                         with_expected_counts=False):
+      """Calculate sentence entropy.
+
+        With with_expected_counts=True, also returns the expected count of each
+        piece in the segmentations, in the same distribution as the entropy, as
+        a dict from the piece id to the count. A list input is processed on the
+        worker pool of this processor, and returns a list of entropies and a
+        list of dicts.
+      """
+      if with_expected_counts:
+        inputs = input if type(input) is list else [input]
+        entropies, counts = self._CalculateEntropyAndExpectedCountsBatch(
+            inputs, alpha)
+        if type(input) is list:
+          return entropies, counts
+        return entropies[0], counts[0]
+
       if type(input) is list:
         if num_threads is None:
           num_threads = self._num_threads
@@ -914,6 +1338,28 @@ class SentencePieceProcessor(object):
         return [_normalize(x) for x in input]
       return _normalize(input)
 
+    def NormalizeBatch(self, input, with_offsets=None):
+      """Normalizes a list of str on the worker pool into one buffer.
+
+      Returns the UTF-8 normalizations in one bytes object `text` and an int64
+      memoryview of len(input) + 1 `offsets`, where the normalization of
+      input[i] is text[offsets[i]:offsets[i + 1]]. With `with_offsets`, also
+      returns the byte alignments to the UTF-8 inputs as runs, an int64
+      memoryview of (norm, orig, identity) triples, where the run j is
+      runs[3 * j:3 * j + 3], and an int64 memoryview of len(input) + 1
+      `run_offsets`, where the runs of input[i] are the runs from
+      run_offsets[i] to run_offsets[i + 1]. The normalized bytes from norm up
+      to the next run (or up to the normalization length + 1) come from the
+      input byte orig, plus their distance from norm when identity is 1.
+      """
+      text, offsets, runs, run_offsets = self._NormalizeBatch(
+          input, bool(with_offsets))
+      offsets = memoryview(offsets).cast('q')
+      if not with_offsets:
+        return text, offsets
+      return (text, offsets, memoryview(runs).cast('q'),
+              memoryview(run_offsets).cast('q'))
+
     def OverrideNormalizerSpec(self, **kwargs):
       new_kwargs = {}
       for key, value in kwargs.items():
@@ -929,6 +1375,27 @@ class SentencePieceProcessor(object):
       return self.GetPieceSize()
 
 
+    def GetModelHandle(self):
+      """Returns a picklable ModelHandle of the model file and the options.
+
+      The handle pickles the path instead of the serialized model proto, so
+      that the workers of a multiprocessing loader load the file themselves.
+      """
+      model_file = self.model_file()
+      if not model_file:
+        raise RuntimeError('The model was not loaded from a model file.')
+      return ModelHandle(model_file,
+                         out_type=self._out_type,
+                         add_bos=self._add_bos,
+                         add_eos=self._add_eos,
+                         reverse=self._reverse,
+                         emit_unk_piece=self._emit_unk_piece,
+                         enable_sampling=self._enable_sampling,
+                         nbest_size=self._nbest_size,
+                         alpha=self._alpha,
+                         num_threads=self._num_threads)
+
+
     def __getstate__(self):
       return self.serialized_model_proto()
 
@@ -964,6 +1431,12 @@ class SentencePieceProcessor(object):
 # Register SentencePieceProcessor in _sentencepiece:
 _sentencepiece.SentencePieceProcessor_swigregister(SentencePieceProcessor)
 
+def ConfigureThreadPools(num_threads, cpus):
+    return _sentencepiece.ConfigureThreadPools(num_threads, cpus)
+
+def GetDefaultNumThreads():
+    return _sentencepiece.GetDefaultNumThreads()
+
 def SetRandomGeneratorSeed(seed):
     return _sentencepiece.SetRandomGeneratorSeed(seed)
 
@@ -1164,6 +1637,31 @@ def _add_snake_case(classname):
     setattr(classname, k, v)
 
 
+class ModelHandle(object):
+  """Picklable reference to a SentencePieceProcessor loaded from a file.
+
+  Pickling a SentencePieceProcessor copies its serialized model proto. The
+  handle holds the path of the model file and the options instead, and Get()
+  loads the file once per process, e.g. in each worker of a multiprocessing
+  data loader, where the pages of a mapped fast model are shared.
+  """
+
+  _processors = {}
+
+  def __init__(self, model_file, **options):
+    self.model_file = model_file
+    self.options = options
+
+  def Get(self):
+    """Returns the processor of this handle, loaded once per process."""
+    key = (os.getpid(), self.model_file, tuple(sorted(self.options.items())))
+    sp = ModelHandle._processors.get(key)
+    if sp is None:
+      sp = SentencePieceProcessor(model_file=self.model_file, **self.options)
+      ModelHandle._processors[key] = sp
+    return sp
+
+
 def _batchnize(classname, name):
   """Enables batch request for the method classname.name."""
   func = getattr(classname, name, None)
@@ -1198,8 +1696,11 @@ for m in [
 _add_snake_case(SentencePieceProcessor)
 _add_snake_case(SentencePieceTrainer)
 _add_snake_case(SentencePieceNormalizer)
+_add_snake_case(ModelHandle)
 set_random_generator_seed = SetRandomGeneratorSeed
 set_min_log_level = SetMinLogLevel
+configure_thread_pools = ConfigureThreadPools
+get_default_num_threads = GetDefaultNumThreads
 
 from ._version import __version__
 
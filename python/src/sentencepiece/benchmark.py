@@ -0,0 +1,243 @@
+# Copyright 2018 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.!
+
+"""Benchmarks of the Python wrapper of SentencePieceProcessor.
+
+Measures the throughput of the single and the batch Encode()/Decode(), the
+scaling of Encode() over Python threads, which share the GIL, and breaks the
+time of a batch down into the C++ encoding, the conversion of the input and
+the output between Python objects and C++, RewriteIds() (add_bos, add_eos
+and reverse) and the argument defaulting of Encode():
+
+  % python -m sentencepiece.benchmark --model=m.model --input=corpus.txt
+
+The breakdown is computed from differences of the times of the public
+methods and of the SWIG methods under them, so that a change of the wrapper
+shows up in its row:
+
+  c++             _EncodeAsIdsFlatFromBuffer(): no Python object per
+                  sentence, in or out.
+  input           _EncodeAsIdsFlatBatch() - c++: the list of str.
+  output          _EncodeAsIdsBatch() - _EncodeAsIdsFlatBatch(): the list
+                  of lists of int.
+  arguments       Encode(list) - _EncodeAsIdsBatch().
+
+RewriteIds() is timed apart, as the batch with add_bos, add_eos and reverse
+minus the batch without them.
+"""
+
+import argparse
+import array
+import sys
+import threading
+import time
+
+import sentencepiece as spm
+
+
+def _Time(func, min_seconds, rounds=3):
+  """Returns the seconds of one call of func(), the best of `rounds`."""
+  best = None
+  for _ in range(rounds):
+    calls = 0
+    start = time.perf_counter()
+    while True:
+      func()
+      calls += 1
+      elapsed = time.perf_counter() - start
+      if elapsed >= min_seconds:
+        break
+    if best is None or elapsed / calls < best:
+      best = elapsed / calls
+  return best
+
+
+def _Buffer(lines):
+  """Returns the UTF-8 `lines` in one buffer and their int64 offsets."""
+  encoded = [line.encode('utf-8') for line in lines]
+  offsets = array.array('q', [0])
+  for line in encoded:
+    offsets.append(offsets[-1] + len(line))
+  return b''.join(encoded), offsets
+
+
+def _EncodeArgs(sp, add_bos=None, add_eos=None, reverse=None):
+  """Returns the sampling and the rewrite arguments of the SWIG methods."""
+  return (sp._enable_sampling, sp._nbest_size, sp._alpha,
+          sp._add_bos if add_bos is None else add_bos,
+          sp._add_eos if add_eos is None else add_eos,
+          sp._reverse if reverse is None else reverse, sp._emit_unk_piece)
+
+
+def EncodeTimes(sp, lines, min_seconds=0.2):
+  """Returns a dict of the seconds of encoding `lines` in the ways above."""
+  args = _EncodeArgs(sp)
+  rewrite_args = _EncodeArgs(sp, add_bos=True, add_eos=True, reverse=True)
+  num_threads = sp._num_threads
+  data, offsets = _Buffer(lines)
+
+  def _Single():
+    for line in lines:
+      sp.Encode(line)
+
+  def _SingleSwig():
+    for line in lines:
+      sp._EncodeAsIds(line, *args)
+
+  times = {
+      'single': _Time(_Single, min_seconds),
+      'single_swig': _Time(_SingleSwig, min_seconds),
+      'batch': _Time(lambda: sp.Encode(lines), min_seconds),
+      'batch_swig': _Time(
+          lambda: sp._EncodeAsIdsBatch(lines, num_threads, *args),
+          min_seconds),
+      'batch_rewrite_swig': _Time(
+          lambda: sp._EncodeAsIdsBatch(lines, num_threads, *rewrite_args),
+          min_seconds),
+      'batch_flat': _Time(
+          lambda: sp._EncodeAsIdsFlatBatch(lines, num_threads, *args),
+          min_seconds),
+      'buffer_flat': _Time(
+          lambda: sp._EncodeAsIdsFlatFromBuffer(data, offsets, num_threads,
+                                                *args), min_seconds),
+  }
+  return times
+
+
+def EncodeBreakdown(times):
+  """Returns the (component, seconds) of a batch from EncodeTimes()."""
+  return [
+      ('c++', times['buffer_flat']),
+      ('input', times['batch_flat'] - times['buffer_flat']),
+      ('output', times['batch_swig'] - times['batch_flat']),
+      ('arguments', times['batch'] - times['batch_swig']),
+  ]
+
+
+def DecodeTimes(sp, lines, min_seconds=0.2):
+  """Returns a dict of the seconds of decoding the ids of `lines`."""
+  ids = sp.Encode(lines, out_type=int)
+  num_threads = sp._num_threads
+
+  def _Single():
+    for v in ids:
+      sp.Decode(v)
+
+  def _SingleSwig():
+    for v in ids:
+      sp._DecodeIds(v)
+
+  return {
+      'single': _Time(_Single, min_seconds),
+      'single_swig': _Time(_SingleSwig, min_seconds),
+      'batch': _Time(lambda: sp.Decode(ids), min_seconds),
+      'batch_swig': _Time(lambda: sp._DecodeIdsBatch(ids, num_threads),
+                          min_seconds),
+  }
+
+
+def ThreadTimes(sp, lines, python_threads, batch=False, min_seconds=0.2):
+  """Returns {n: seconds} of encoding `lines` split over n Python threads.
+
+  Each thread encodes its share one sentence at a time, or with `batch` in
+  one Encode() of one C++ thread. The C++ encoding runs without the GIL, so
+  the time which does not go down with n is the time under the GIL.
+  """
+  times = {}
+  for n in python_threads:
+    shares = [lines[i::n] for i in range(n)]
+
+    def _Run(share):
+      if batch:
+        sp.Encode(share, num_threads=1)
+      else:
+        for line in share:
+          sp.Encode(line)
+
+    def _Threads():
+      threads = [threading.Thread(target=_Run, args=(s,)) for s in shares]
+      for t in threads:
+        t.start()
+      for t in threads:
+        t.join()
+
+    times[n] = _Time(_Threads, min_seconds)
+  return times
+
+
+def _PrintRow(name, seconds, lines, num_bytes):
+  print('{:<28} {:>10.3f} {:>12.0f} {:>8.2f} {:>10.3f}'.format(
+      name, seconds * 1e3, len(lines) / seconds, num_bytes / seconds / 1e6,
+      seconds / len(lines) * 1e6))
+
+
+def Run(sp, lines, python_threads=(1, 2, 4), min_seconds=0.2):
+  """Prints the benchmarks of `sp` on `lines`."""
+  num_bytes = sum(len(line.encode('utf-8')) for line in lines)
+  print('{} sentences, {} bytes'.format(len(lines), num_bytes))
+  print('{:<28} {:>10} {:>12} {:>8} {:>10}'.format('benchmark', 'ms',
+                                                   'sentences/s', 'MB/s',
+                                                   'us/sentence'))
+
+  encode = EncodeTimes(sp, lines, min_seconds)
+  for name in ['single', 'single_swig', 'batch', 'batch_swig', 'batch_flat',
+               'buffer_flat']:
+    _PrintRow('encode ' + name, encode[name], lines, num_bytes)
+  decode = DecodeTimes(sp, lines, min_seconds)
+  for name in ['single', 'single_swig', 'batch', 'batch_swig']:
+    _PrintRow('decode ' + name, decode[name], lines, num_bytes)
+  for batch in [False, True]:
+    times = ThreadTimes(sp, lines, python_threads, batch, min_seconds)
+    for n in python_threads:
+      _PrintRow('encode {} x{} threads'.format('batch' if batch else 'single',
+                                               n), times[n], lines, num_bytes)
+
+  print()
+  print('encode batch breakdown')
+  for name, seconds in EncodeBreakdown(encode):
+    print('  {:<14} {:>10.3f} ms {:>6.1f}%'.format(
+        name, seconds * 1e3, 100.0 * seconds / encode['batch']))
+  print('  {:<14} {:>10.3f} ms with add_bos, add_eos and reverse'.format(
+      'rewrite_ids',
+      (encode['batch_rewrite_swig'] - encode['batch_swig']) * 1e3))
+  print('  {:<14} {:>10.3f} us per single Encode()'.format(
+      'call', (encode['single'] - encode['batch']) / len(lines) * 1e6))
+
+
+def main(argv=None):
+  parser = argparse.ArgumentParser(
+      description='Benchmarks the Python wrapper of SentencePieceProcessor.')
+  parser.add_argument('--model', required=True, help='model file')
+  parser.add_argument('--input', required=True,
+                      help='UTF-8 text file, one sentence per line')
+  parser.add_argument('--max_lines', type=int, default=10000,
+                      help='number of the lines of --input to encode')
+  parser.add_argument('--python_threads', default='1,2,4',
+                      help='comma separated numbers of Python threads')
+  parser.add_argument('--num_threads', type=int, default=-1,
+                      help='C++ threads of the batch methods')
+  parser.add_argument('--min_seconds', type=float, default=0.2,
+                      help='minimum time of a measurement')
+  args = parser.parse_args(argv)
+
+  with open(args.input, encoding='utf-8') as f:
+    lines = [line.rstrip('\n') for _, line in zip(range(args.max_lines), f)]
+  sp = spm.SentencePieceProcessor(model_file=args.model,
+                                  num_threads=args.num_threads)
+  Run(sp, lines, [int(n) for n in args.python_threads.split(',')],
+      args.min_seconds)
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -9,6 +9,7 @@
 #include <functional>
 #include <limits>
 #include <cmath>
+#include <cstdint>
 #include <thread>
 #include <vector>
 #include <sentencepiece_processor.h>
@@ -67,6 +68,17 @@ PyObject* MakePyOutputBytes(const sentencepiece::util::bytes& output) {
   return PyBytes_FromStringAndSize(output.data(), output.size());
 }
 
+// Releases the GIL in the scope, so that the other Python threads run
+// while the C++ code does.
+class ScopedGILRelease {
+ public:
+  ScopedGILRelease() : state_(PyEval_SaveThread()) {}
+  ~ScopedGILRelease() { PyEval_RestoreThread(state_); }
+
+ private:
+  PyThreadState *state_ = nullptr;
+};
+
 int ToSwigError(sentencepiece::util::StatusCode code) {
   switch (code) {
     case sentencepiece::util::StatusCode::kNotFound:
@@ -81,60 +93,6 @@ int ToSwigError(sentencepiece::util::StatusCode code) {
   return SWIG_RuntimeError;
 }
 
-class PySentenceIterator : public sentencepiece::SentenceIterator {
-  public:
-  PySentenceIterator(PyObject *iter) : iter_(iter) {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
-  }
-
-  ~PySentenceIterator() {
-   // Py_XDECREF(iter_);
-  }
-
-  bool done() const override {
-    return item_ == nullptr;
-  }
-
-  void Next() override {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
-  }
-
-  const std::string &value() const override {
-    return value_;
-  }
-
-  sentencepiece::util::Status status() const override {
-    return status_;
-  }
-
-  private:
-   void CopyValue() {
-     if (item_ == nullptr) return;
-     const PyInputString ustring(item_);
-     if (ustring.IsAvalable()) {
-       const char *data = ustring.data();
-       size_t size = ustring.size();
-       while (size > 0) {
-         if (data[size - 1] == '\r' || data[size - 1] == '\n')
-           --size;
-         else
-           break;
-       }
-       value_.assign(data, size);
-     } else {
-       status_ = sentencepiece::util::Status(sentencepiece::util::StatusCode::kInternal,
-                                             "Not a string.");
-     }
-     Py_XDECREF(item_);
-   }
-   PyObject *iter_ = nullptr;
-   PyObject *item_ = nullptr;
-   std::string value_;
-   sentencepiece::util::Status status_;
-};
-
 inline void RewriteIds(const sentencepiece::SentencePieceProcessor &sp,
                        std::vector<int> *ids,
                        bool add_bos, bool add_eos, bool reverse, bool emit_unk_piece) {
@@ -207,83 +165,561 @@ inline void ConvertToUnicodeSpans(sentencepiece::ImmutableNBestSentencePieceText
   proto->ConvertToUnicodeSpans();
 }
 
-class ThreadPool {
+inline sentencepiece::EncodeOptions MakeEncodeOptions(bool add_bos, bool add_eos,
+                                                     bool reverse, bool emit_unk_piece) {
+  sentencepiece::EncodeOptions options;
+  options.add_bos = add_bos;
+  options.add_eos = add_eos;
+  options.reverse = reverse;
+  options.emit_unk_piece = emit_unk_piece;
+  return options;
+}
+
+// Encodes `text` into `out` with `options`. The ids and pieces are written
+// once in their final order by the C++ encoder, and the spans of the protos
+// are counted in Unicode characters by it as well. The protos reject the
+// other options. An error gives an empty result as in EncodeAsIds().
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              std::vector<int> *out,
+                              sentencepiece::EncodeContext *context) {
+  if (!sp.Encode(text, options, out, context).ok()) out->clear();
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              std::vector<std::string> *out,
+                              sentencepiece::EncodeContext *context) {
+  if (!sp.Encode(text, options, out, context).ok()) out->clear();
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              sentencepiece::util::bytes *out,
+                              sentencepiece::EncodeContext *context) {
+  *out = sp.EncodeAsSerializedProto(text);
+  RewriteIds(sp, out, options.add_bos, options.add_eos, options.reverse,
+             options.emit_unk_piece);
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              sentencepiece::ImmutableSentencePieceText *out,
+                              sentencepiece::EncodeContext *context) {
+  RewriteIds(sp, out, options.add_bos, options.add_eos, options.reverse,
+             options.emit_unk_piece);
+  // The encoder counts the spans in Unicode characters.
+  sentencepiece::EncodeOptions spans;
+  spans.unicode_spans = true;
+  if (!sp.Encode(text, spans, out->mutable_proto(), context).ok()) {
+    *out = sentencepiece::ImmutableSentencePieceText();
+  }
+}
+
+template <typename T>
+inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
+  if (*num_threads < 0) {
+    *num_threads = sentencepiece::GetDefaultNumThreads();
+  }
+  *num_threads = std::max<int>(1,
+                               std::min<int>({*num_threads,
+                                     static_cast<int>(ins.size()), 256}));
+}
+
+// Contiguous buffer of an object supporting the buffer protocol, e.g.,
+// bytes, bytearray, memoryview, array.array or a numpy array. The object
+// cannot be resized while the view is alive.
+class PyBufferView {
  public:
-  explicit ThreadPool(size_t request_size) :
-    request_size_(request_size) {}
+  explicit PyBufferView(PyObject *obj) {
+    ok_ = PyObject_GetBuffer(obj, &view_, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0;
+  }
+  ~PyBufferView() {
+    if (ok_) PyBuffer_Release(&view_);
+  }
 
-  virtual ~ThreadPool() {
-    for (auto &task : tasks_) {
-      task.join();
+  bool ok() const { return ok_; }
+  const char *data() const { return static_cast<const char *>(view_.buf); }
+  size_t size() const { return view_.len; }
+  size_t itemsize() const { return view_.itemsize; }
+  char format() const {
+    // Skips the byte order, e.g., '<q'.
+    const char *format = view_.format == nullptr ? "B" : view_.format;
+    if (*format == '@' || *format == '=' || *format == '<' ||
+        *format == '>' || *format == '!') ++format;
+    return *format;
+  }
+
+ private:
+  Py_buffer view_;
+  bool ok_ = false;
+};
+
+template <typename T>
+inline void SplitBufferAt(const PyBufferView &data,
+                          const PyBufferView &offsets,
+                          std::vector<absl::string_view> *ins) {
+  const T *begin = reinterpret_cast<const T *>(offsets.data());
+  const size_t size = offsets.size() / sizeof(T);
+  ins->resize(size > 0 ? size - 1 : 0);
+  for (size_t i = 0; i < ins->size(); ++i) {
+    // A negative offset is larger than the data once converted.
+    const uint64_t start = static_cast<uint64_t>(begin[i]);
+    const uint64_t end = static_cast<uint64_t>(begin[i + 1]);
+    if (start > end || end > data.size()) {
+      throw sentencepiece::util::Status(
+          sentencepiece::util::StatusCode::kOutOfRange,
+          "offsets are out of range of the data.");
     }
+    (*ins)[i] = absl::string_view(data.data() + start, end - start);
   }
+}
 
-  void Schedule(std::function<void()> closure) {
-    static constexpr size_t kMinThreadSize = 2;
-    if (request_size_ < kMinThreadSize) {
-      closure();
-    } else {
-      tasks_.emplace_back(closure);
+// Splits `data` into the sentences data[offsets[i], offsets[i + 1]).
+// `offsets` holds 32-bit or 64-bit integers, e.g., the offsets of an Arrow
+// string array.
+inline std::vector<absl::string_view> SplitBuffer(
+    const PyBufferView &data, const PyBufferView &offsets) {
+  std::vector<absl::string_view> ins;
+  const char format = offsets.format();
+  const bool is_signed = format == 'i' || format == 'l' || format == 'q' ||
+                         format == 'n';
+  const bool is_unsigned = format == 'I' || format == 'L' || format == 'Q' ||
+                           format == 'N';
+  if (!is_signed && !is_unsigned) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "offsets must be an array of integers.");
+  }
+  if (offsets.itemsize() == 4) {
+    is_signed ? SplitBufferAt<int32_t>(data, offsets, &ins)
+              : SplitBufferAt<uint32_t>(data, offsets, &ins);
+  } else if (offsets.itemsize() == 8) {
+    is_signed ? SplitBufferAt<int64_t>(data, offsets, &ins)
+              : SplitBufferAt<uint64_t>(data, offsets, &ins);
+  } else {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "offsets must be 32-bit or 64-bit integers.");
+  }
+  return ins;
+}
+
+// Iterates over the sentences of a Python iterator. Each item of the
+// iterator is a sentence (str or bytes), a list or tuple of sentences, or a
+// (data, offsets) pair of buffers holding the sentences
+// data[offsets[i], offsets[i + 1]), so that a generator can yield a batch of
+// sentences per call instead of one.
+class PySentenceIterator : public sentencepiece::SentenceIterator {
+  public:
+  PySentenceIterator(PyObject *iter) : iter_(iter) {
+    Fetch();
+  }
+
+  ~PySentenceIterator() {
+   // Py_XDECREF(iter_);
+  }
+
+  bool done() const override {
+    return index_ >= size_;
+  }
+
+  void Next() override {
+    if (++index_ >= size_) Fetch();
+  }
+
+  const std::string &value() const override {
+    return batch_[index_];
+  }
+
+  sentencepiece::util::Status status() const override {
+    return status_;
+  }
+
+  private:
+   // Replaces the batch with the sentences of the next non-empty item. The
+   // batch is empty at the end and after an error.
+   void Fetch() {
+     index_ = 0;
+     size_ = 0;
+     while (size_ == 0 && status_.ok()) {
+       PyObject *item = PyIter_Next(iter_);
+       if (item == nullptr) return;
+       AddItem(item);
+       Py_DECREF(item);
+     }
+     if (!status_.ok()) size_ = 0;
+   }
+
+   void AddItem(PyObject *item) {
+     const PyInputString ustring(item);
+     if (ustring.IsAvalable()) {
+       Add(ustring.data(), ustring.size());
+       return;
+     }
+     if (PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 2 &&
+         !PyInputString(PyTuple_GET_ITEM(item, 1)).IsAvalable()) {
+       const PyBufferView data(PyTuple_GET_ITEM(item, 0));
+       const PyBufferView offsets(PyTuple_GET_ITEM(item, 1));
+       if (!data.ok() || !offsets.ok()) {
+         PyErr_Clear();
+         SetError("data and offsets must support the buffer protocol.");
+         return;
+       }
+       try {
+         for (const auto &sentence : SplitBuffer(data, offsets)) {
+           Add(sentence.data(), sentence.size());
+         }
+       } catch (const sentencepiece::util::Status &status) {
+         status_ = status;
+       }
+       return;
+     }
+     if (PyList_Check(item) || PyTuple_Check(item)) {
+       const Py_ssize_t size = PySequence_Fast_GET_SIZE(item);
+       PyObject **items = PySequence_Fast_ITEMS(item);
+       for (Py_ssize_t i = 0; i < size; ++i) {
+         const PyInputString sentence(items[i]);
+         if (!sentence.IsAvalable()) {
+           SetError("Not a string.");
+           return;
+         }
+         Add(sentence.data(), sentence.size());
+       }
+       return;
+     }
+     SetError("Not a string.");
+   }
+
+   // Appends a sentence without its trailing line breaks.
+   void Add(const char *data, size_t size) {
+     while (size > 0) {
+       if (data[size - 1] == '\r' || data[size - 1] == '\n')
+         --size;
+       else
+         break;
+     }
+     if (size_ == batch_.size()) batch_.emplace_back();
+     batch_[size_++].assign(data, size);
+   }
+
+   void SetError(const char *message) {
+     status_ = sentencepiece::util::Status(
+         sentencepiece::util::StatusCode::kInternal, message);
+   }
+
+   PyObject *iter_ = nullptr;
+   // The sentences of the current item, reused across the items.
+   std::vector<std::string> batch_;
+   size_t size_ = 0;
+   size_t index_ = 0;
+   sentencepiece::util::Status status_;
+};
+
+// Ids of a batch in one buffer. The ids of the i-th input are
+// ids[offsets[i], offsets[i + 1]).
+struct FlatIds {
+  std::vector<int32_t> ids;
+  std::vector<int64_t> offsets;
+};
+
+inline FlatIds FlattenIds(const std::vector<std::vector<int>> &idss) {
+  FlatIds flat;
+  flat.offsets.resize(idss.size() + 1, 0);
+  for (size_t i = 0; i < idss.size(); ++i) {
+    flat.offsets[i + 1] = flat.offsets[i] + idss[i].size();
+  }
+  flat.ids.reserve(flat.offsets.back());
+  for (const auto &ids : idss) {
+    flat.ids.insert(flat.ids.end(), ids.begin(), ids.end());
+  }
+  return flat;
+}
+
+// The int32 ids in the bytes of a buffer narrowed to uint16.
+struct NarrowIds {
+  std::vector<uint16_t> ids;
+};
+
+inline NarrowIds NarrowIdBuffer(const PyBufferView &ids, int piece_size) {
+  if (ids.size() % sizeof(int32_t) != 0) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "ids must be 32-bit integers.");
+  }
+  if (piece_size > 0x10000) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "The ids of the vocabulary do not fit in uint16.");
+  }
+  NarrowIds narrow;
+  narrow.ids.resize(ids.size() / sizeof(int32_t));
+  const char *data = ids.data();
+  for (size_t i = 0; i < narrow.ids.size(); ++i) {
+    int32_t id = 0;
+    std::memcpy(&id, data + i * sizeof(id), sizeof(id));
+    narrow.ids[i] = static_cast<uint16_t>(id);
+  }
+  return narrow;
+}
+
+// Buffers of an Arrow list<int32> array: the int32 values and the int32
+// or int64 offsets.
+struct ArrowIds {
+  std::vector<int32_t> values;
+  std::string offsets;
+};
+
+// Encodes the strings of the Arrow string array given by its buffers. The
+// first `offset` strings of the buffers are skipped. `validity` is empty
+// when there are no nulls.
+template <typename Offset>
+inline ArrowIds EncodeArrowBuffers(
+    const sentencepiece::SentencePieceProcessor &sp,
+    const PyBufferView &validity, int offset, const PyBufferView &offsets,
+    const PyBufferView &data, bool add_bos, bool add_eos, bool reverse) {
+  const size_t num_offsets = offsets.size() / sizeof(Offset);
+  if (offset < 0 || num_offsets < static_cast<size_t>(offset) + 1) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "offset is out of range of the offsets.");
+  }
+  sentencepiece::ArrowStringArray<Offset> input;
+  input.length = num_offsets - offset - 1;
+  input.offset = offset;
+  input.offsets = reinterpret_cast<const Offset *>(offsets.data());
+  input.data = data.data();
+  if (validity.size() > 0) {
+    if (validity.size() * 8 < num_offsets - 1) {
+      throw sentencepiece::util::Status(
+          sentencepiece::util::StatusCode::kOutOfRange,
+          "validity is shorter than the offsets.");
     }
+    input.validity = reinterpret_cast<const uint8_t *>(validity.data());
   }
+  // EncodeArrow() checks that the offsets are increasing from zero or more.
+  if (static_cast<uint64_t>(input.offsets[num_offsets - 1]) > data.size()) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "offsets are out of range of the data.");
+  }
+
+  sentencepiece::ArrowListArray<Offset> output;
+  const auto status = sp.EncodeArrow(input, &output);
+  if (!status.ok()) throw status;
+
+  ArrowIds result;
+  if (add_bos || add_eos || reverse) {
+    std::vector<int> ids;
+    std::vector<Offset> rewritten = {0};
+    for (size_t i = 0; i + 1 < output.offsets.size(); ++i) {
+      const size_t bit = offset + i;
+      if (input.validity == nullptr ||
+          (input.validity[bit / 8] >> (bit % 8)) & 1) {
+        ids.assign(output.values.begin() + output.offsets[i],
+                   output.values.begin() + output.offsets[i + 1]);
+        RewriteIds(sp, &ids, add_bos, add_eos, reverse, false);
+        result.values.insert(result.values.end(), ids.begin(), ids.end());
+      }
+      rewritten.push_back(result.values.size());
+    }
+    output.offsets.swap(rewritten);
+  } else {
+    result.values.swap(output.values);
+  }
+  result.offsets.assign(reinterpret_cast<const char *>(output.offsets.data()),
+                        output.offsets.size() * sizeof(Offset));
+  return result;
+}
 
- private:
-  size_t request_size_ = 0;
-  std::vector<std::thread> tasks_;
+// Ids of a batch in a [rows, width] matrix. The ids of the i-th input are
+// in the row ids[i * width, (i + 1) * width), whose other elements are the
+// padding. mask is 1 at the ids and 0 at the padding.
+struct PaddedIds {
+  std::vector<int32_t> ids;
+  std::vector<int32_t> mask;
+  size_t rows = 0;
+  size_t width = 0;
+};
+
+// Truncates the ids to `max_length` including <s> and </s>, unless
+// `max_length` is 0, and pads them with `pad_id` to the longest ids, or to
+// `max_length` when `pad_to_max_length` is true. The width is rounded up to
+// a multiple of `pad_to_multiple_of` when it is larger than 1. The rows are
+// written by the worker threads.
+inline PaddedIds PadIds(const sentencepiece::SentencePieceProcessor &sp,
+                        const std::vector<std::vector<int>> &idss,
+                        bool add_bos, bool add_eos, int max_length,
+                        bool pad_to_max_length, int pad_to_multiple_of,
+                        bool pad_left, bool truncate_left, int pad_id,
+                        int num_threads) {
+  const size_t num_specials = (add_bos ? 1 : 0) + (add_eos ? 1 : 0);
+  size_t max_size = std::numeric_limits<size_t>::max();
+  if (max_length > 0) {
+    max_size = std::max<size_t>(max_length, num_specials) - num_specials;
+  }
+  PaddedIds padded;
+  padded.rows = idss.size();
+  for (const auto &ids : idss) {
+    padded.width =
+        std::max(padded.width, std::min(ids.size(), max_size) + num_specials);
+  }
+  if (pad_to_max_length && max_length > 0) {
+    padded.width = std::max<size_t>(padded.width, max_length);
+  }
+  if (pad_to_multiple_of > 1) {
+    padded.width = (padded.width + pad_to_multiple_of - 1) /
+                   pad_to_multiple_of * pad_to_multiple_of;
+  }
+
+  padded.ids.resize(padded.rows * padded.width);
+  padded.mask.resize(padded.rows * padded.width);
+  sentencepiece::RunOnSharedThreadPool(
+      padded.rows, num_threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const auto &ids = idss[i];
+          const size_t size = std::min(ids.size(), max_size);
+          const size_t length = size + num_specials;
+          int32_t *row = padded.ids.data() + i * padded.width;
+          int32_t *mask = padded.mask.data() + i * padded.width;
+          std::fill(row, row + padded.width, pad_id);
+          std::fill(mask, mask + padded.width, 0);
+          int32_t *out = row + (pad_left ? padded.width - length : 0);
+          std::fill(mask + (out - row), mask + (out - row) + length, 1);
+          if (add_bos) *out++ = sp.bos_id();
+          const auto first =
+              ids.begin() + (truncate_left ? ids.size() - size : 0);
+          out = std::copy(first, first + size, out);
+          if (add_eos) *out++ = sp.eos_id();
+        }
+      });
+  return padded;
+}
+
+// Ids of EncodeCorpus() and its statistics.
+struct CorpusIds {
+  std::vector<std::vector<int>> ids;
+  sentencepiece::CorpusEncodeStats stats;
 };
 
+// Entropies of CalculateEntropyBatch() and the expected piece counts.
+struct EntropyResults {
+  std::vector<float> entropies;
+  std::vector<std::vector<std::pair<int, float>>> expected_counts;
+};
+
+inline PyObject *MakePyNumber(size_t value) { return PyLong_FromSize_t(value); }
+inline PyObject *MakePyNumber(double value) { return PyFloat_FromDouble(value); }
+
 template <typename T>
-inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
-  if (*num_threads < 0) {
-    *num_threads = std::thread::hardware_concurrency();
+inline PyObject *MakePyList(const std::vector<T> &values) {
+  PyObject *list = PyList_New(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    PyList_SET_ITEM(list, i, MakePyNumber(values[i]));
   }
-  *num_threads = std::max<int>(1,
-                               std::min<int>({*num_threads,
-                                     static_cast<int>(ins.size()), 256}));
+  return list;
+}
+
+PyObject* MakePyOutputBuffer(const void *data, size_t size) {
+  return PyBytes_FromStringAndSize(static_cast<const char *>(data), size);
+}
+
+// Returns the bytes of `values` as int64, e.g. of size_t offsets.
+PyObject *MakePyInt64Buffer(const std::vector<size_t> &values) {
+  const std::vector<int64_t> buffer(values.begin(), values.end());
+  return MakePyOutputBuffer(buffer.data(), buffer.size() * sizeof(int64_t));
+}
+
+// Returns the bytes of the text, the int64 text offsets, the alignment runs
+// as int64 (norm, orig, identity) triples and the int64 run offsets of
+// `batch`.
+PyObject *MakePyNormalizedBatch(const sentencepiece::NormalizedBatch &batch) {
+  std::vector<int64_t> runs;
+  runs.reserve(3 * batch.runs.size());
+  for (const auto &run : batch.runs) {
+    runs.push_back(run.norm);
+    runs.push_back(run.orig);
+    runs.push_back(run.identity);
+  }
+  PyObject *result = PyTuple_New(4);
+  PyTuple_SET_ITEM(result, 0,
+                   MakePyOutputBuffer(batch.text.data(), batch.text.size()));
+  PyTuple_SET_ITEM(result, 1, MakePyInt64Buffer(batch.text_offsets));
+  PyTuple_SET_ITEM(result, 2,
+                   MakePyOutputBuffer(runs.data(),
+                                      runs.size() * sizeof(int64_t)));
+  PyTuple_SET_ITEM(result, 3, MakePyInt64Buffer(batch.run_offsets));
+  return result;
 }
 
 #define DEFINE_ENCODE_BATCH_FUNC_IMPL(FuncName, InType, OutType)        \
   std::vector<OutType> outs(ins.size());                                \
   InitNumThreads(ins, &num_threads);                                    \
-  {                                                                     \
-    ThreadPool pool(ins.size());                                        \
-    std::atomic<size_t> index = 0;                                      \
-    for (int n = 0;  n < num_threads; ++n) {                            \
-      pool.Schedule([&]() {                                             \
-          size_t i = 0;                                                 \
-          while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) { \
-            auto out = enable_sampling ?                                \
-                       self->Sample##FuncName(ins[i],                   \
-                                              nbest_size, alpha) :      \
-                       self->FuncName(ins[i]);                          \
-            RewriteIds(*self, &out, add_bos, add_eos, reverse,          \
+  const auto options = MakeEncodeOptions(add_bos, add_eos, reverse,     \
+                                         emit_unk_piece);               \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        sentencepiece::EncodeContext context;                           \
+        for (size_t i = begin; i < end; ++i) {                          \
+          if (enable_sampling) {                                        \
+            outs[i] = self->Sample##FuncName(ins[i], nbest_size, alpha); \
+            RewriteIds(*self, &outs[i], add_bos, add_eos, reverse,      \
+                       emit_unk_piece);                                 \
+            ConvertToUnicodeSpans(&outs[i]);                            \
+          } else {                                                      \
+            EncodeWithOptions(*self, ins[i], options, &outs[i],         \
+                              &context);                                \
+          }                                                             \
+        }                                                               \
+      });                                                               \
+  return outs;
+
+// The samples of ins[i] are outs[i * num_samples, (i + 1) * num_samples).
+#define DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(OutType)              \
+  if (num_samples < 0) {                                                \
+    throw sentencepiece::util::Status(                                  \
+        sentencepiece::util::StatusCode::kInvalidArgument,              \
+        "num_samples must be >= 0");                                    \
+  }                                                                     \
+  std::vector<OutType> outs(ins.size() * num_samples);                  \
+  std::vector<sentencepiece::util::Status> statuses(ins.size());        \
+  InitNumThreads(ins, &num_threads);                                    \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        for (size_t i = begin; i < end; ++i) {                          \
+          std::vector<OutType> samples;                                 \
+          statuses[i] = self->SampleEncodeMany(ins[i], num_samples,     \
+                                               alpha, &samples);        \
+          for (size_t j = 0; j < samples.size(); ++j) {                 \
+            RewriteIds(*self, &samples[j], add_bos, add_eos, reverse,   \
                        emit_unk_piece);                                 \
-            ConvertToUnicodeSpans(&out);                                \
-            outs[i] = std::move(out);                                   \
+            outs[i * num_samples + j] = std::move(samples[j]);          \
           }                                                             \
-        });                                                             \
-    }                                                                   \
+        }                                                               \
+      });                                                               \
+  /* The workers cannot throw. */                                       \
+  for (const auto &status : statuses) {                                 \
+    if (!status.ok()) throw status;                                     \
   }                                                                     \
   return outs;
 
 #define DEFINE_DECODE_BATCH_FUNC_IMPL(FuncName, InType, OutType)        \
+  /* The ids are checked here, as the workers cannot throw. */          \
+  for (const auto &in : ins) CheckIds(in, self->GetPieceSize());        \
   std::vector<OutType> outs(ins.size());                                \
   InitNumThreads(ins, &num_threads);                                    \
-  {                                                                     \
-    std::atomic<size_t> index = 0;                                      \
-    ThreadPool pool(ins.size());                                        \
-    for (int n = 0;  n < num_threads; ++n) {                            \
-      pool.Schedule([&]() {                                             \
-          size_t i = 0;                                                 \
-          while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) { \
-            CheckIds(ins[i], self->GetPieceSize());                     \
-            auto out = self->FuncName(ins[i]);                          \
-            ConvertToUnicodeSpans(&out);                                \
-            outs[i] = std::move(out);                                   \
-          }                                                             \
-        });                                                             \
-    }                                                                   \
-  }                                                                     \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        for (size_t i = begin; i < end; ++i) {                          \
+          auto out = self->FuncName(ins[i]);                            \
+          ConvertToUnicodeSpans(&out);                                  \
+          outs[i] = std::move(out);                                     \
+        }                                                               \
+      });                                                               \
   return outs;
 
 }  // namespace
@@ -299,10 +735,79 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   }
 }
 
+// The same as above, but the GIL is released while the C++ code runs. The
+// arguments are already converted to C++ values, whose strings are kept
+// alive by the argument tuple or by the typemaps below, and the results are
+// converted to Python objects after the GIL is taken again.
+%define %release_gil(Method)
+%exception Method {
+  try {
+    {
+      ScopedGILRelease release;
+      $action
+    }
+    ReleaseResultObject(resultobj);
+  }
+  catch (const sentencepiece::util::Status &status) {
+    SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+  }
+}
+%enddef
+
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIds)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsPieces)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsSerializedProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsImmutableProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIdsBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIdsFlatBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIdsPaddedBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeCorpus)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsPiecesBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsSerializedProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsImmutableProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIdsFromBuffer)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsIdsFlatFromBuffer)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeAsPiecesFromBuffer)
+%release_gil(sentencepiece::SentencePieceProcessor::_EncodeArrow)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIds)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsBytes)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePieces)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsSerializedProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePiecesAsSerializedProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsImmutableProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePiecesAsImmutableProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsBytesBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsSerializedProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodeIdsAsImmutableProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePiecesBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePiecesAsSerializedProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_DecodePiecesAsImmutableProtoBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_NBestEncodeAsIds)
+%release_gil(sentencepiece::SentencePieceProcessor::_NBestEncodeAsPieces)
+%release_gil(sentencepiece::SentencePieceProcessor::_NBestEncodeAsSerializedProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_NBestEncodeAsImmutableProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeAndScoreAsIds)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeAndScoreAsPieces)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeAndScoreAsSerializedProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeAndScoreAsImmutableProto)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeManyAsIdsBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_SampleEncodeManyAsPiecesBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_Normalize)
+%release_gil(sentencepiece::SentencePieceProcessor::_NormalizeWithOffsets)
+%release_gil(sentencepiece::SentencePieceProcessor::_NormalizeBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_CalculateEntropy)
+%release_gil(sentencepiece::SentencePieceProcessor::_CalculateEntropyBatch)
+%release_gil(sentencepiece::SentencePieceProcessor::_CalculateEntropyAndExpectedCountsBatch)
+%release_gil(sentencepiece::SentencePieceNormalizer::_Normalize)
+%release_gil(sentencepiece::SentencePieceNormalizer::_NormalizeWithOffsets)
+
 %apply unsigned int { uint32_t }
 
 %ignore sentencepiece::util::Status;
 %ignore sentencepiece::util::StatusCode;
+%ignore sentencepiece::EncodeContext;
+%ignore sentencepiece::EncodeOptions;
 %ignore absl::string_view;
 %ignore std::string_view;
 %ignore sentencepiece::SentencePieceText;
@@ -346,9 +851,36 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
 %ignore sentencepiece::SentencePieceProcessor::SampleEncodeAndScoreAsImmutableProto;
 %ignore sentencepiece::SentencePieceProcessor::DecodePiecesAsImmutableProto;
 %ignore sentencepiece::SentencePieceProcessor::DecodeIdsAsImmutableProto;
+%ignore sentencepiece::SentencePieceProcessor::EncodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::SetNumThreads;
+%ignore sentencepiece::SentencePieceProcessor::SetParallelEncodeThreshold;
+%ignore sentencepiece::SentencePieceProcessor::SetMaxSegmentLength;
+%ignore sentencepiece::SentencePieceProcessor::GetNumSegmentedInputs;
+%ignore sentencepiece::SentencePieceProcessor::GetWordCacheStats;
+%ignore sentencepiece::SentencePieceProcessor::GetMetrics;
+%ignore sentencepiece::SentencePieceProcessor::ResetMetrics;
+%ignore sentencepiece::SentencePieceProcessor::GetMemoryUsage;
+%ignore sentencepiece::SentencePieceProcessor::SetSlimLoad;
+%ignore sentencepiece::MemoryUsage;
+%ignore sentencepiece::ProcessorMetrics;
+%ignore sentencepiece::StreamingDecoder;
+%ignore sentencepiece::AsyncEncoder;
+%ignore sentencepiece::ProcessorHandle;
+%ignore sentencepiece::SentencePieceProcessor::EncodeAsync;
+%ignore sentencepiece::SentenceBatchIterator;
+%ignore sentencepiece::PrefetchingSentenceIterator;
+%ignore sentencepiece::SentencePieceProcessor::DecodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::EncodeArrow;
+%ignore sentencepiece::SentencePieceProcessor::EncodeCorpus;
+%ignore sentencepiece::SentencePieceProcessor::CalculateEntropyBatch;
+%ignore sentencepiece::CorpusEncodeStats;
+%ignore sentencepiece::ArrowStringArray;
+%ignore sentencepiece::ArrowListArray;
 
 %ignore sentencepiece::SentencePieceProcessor::Normalize;
 %ignore sentencepiece::SentencePieceProcessor::NormalizeWithOffsets;
+%ignore sentencepiece::SentencePieceProcessor::NormalizeBatch;
+%ignore sentencepiece::NormalizedBatch;
 
 %ignore sentencepiece::SentencePieceProcessor::model_proto;
 %ignore sentencepiece::SentencePieceProcessor::mutable_normalizer_spec;
@@ -389,10 +921,16 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                 int nbest_size, float alpha,
                                 bool add_bos, bool add_eos, bool reverse,
                                 bool emit_unk_piece) const {
-    auto ids = enable_sampling ?
-               $self->SampleEncodeAsIds(text, nbest_size, alpha) :
-               $self->EncodeAsIds(text);
-    RewriteIds(*$self, &ids, add_bos, add_eos, reverse, emit_unk_piece);
+    std::vector<int> ids;
+    if (enable_sampling) {
+      ids = $self->SampleEncodeAsIds(text, nbest_size, alpha);
+      RewriteIds(*$self, &ids, add_bos, add_eos, reverse, emit_unk_piece);
+    } else {
+      sentencepiece::EncodeContext context;
+      EncodeWithOptions(*$self, text,
+                        MakeEncodeOptions(add_bos, add_eos, reverse, emit_unk_piece),
+                        &ids, &context);
+    }
     return ids;
   }
 
@@ -401,10 +939,16 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                            int nbest_size, float alpha,
                                            bool add_bos, bool add_eos, bool reverse,
                                            bool emit_unk_piece) const {
-    auto pieces = enable_sampling ?
-                  $self->SampleEncodeAsPieces(text, nbest_size, alpha) :
-                  $self->EncodeAsPieces(text);
-    RewriteIds(*$self, &pieces, add_bos, add_eos, reverse, emit_unk_piece);
+    std::vector<std::string> pieces;
+    if (enable_sampling) {
+      pieces = $self->SampleEncodeAsPieces(text, nbest_size, alpha);
+      RewriteIds(*$self, &pieces, add_bos, add_eos, reverse, emit_unk_piece);
+    } else {
+      sentencepiece::EncodeContext context;
+      EncodeWithOptions(*$self, text,
+                        MakeEncodeOptions(add_bos, add_eos, reverse, emit_unk_piece),
+                        &pieces, &context);
+    }
     return pieces;
   }
 
@@ -426,10 +970,19 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                               int nbest_size, float alpha,
                               bool add_bos, bool add_eos, bool reverse,
                               bool emit_unk_piece) const {
-    auto proto = enable_sampling ?
-                 $self->SampleEncodeAsImmutableProto(text, nbest_size, alpha) :
-                 $self->EncodeAsImmutableProto(text);
-    proto.ConvertToUnicodeSpans();
+    sentencepiece::ImmutableSentencePieceText proto;
+    if (enable_sampling) {
+      proto = $self->SampleEncodeAsImmutableProto(text, nbest_size, alpha);
+      proto.ConvertToUnicodeSpans();
+    } else {
+      // The encoder counts the spans in Unicode characters.
+      sentencepiece::EncodeOptions options;
+      options.unicode_spans = true;
+      sentencepiece::EncodeContext context;
+      const auto status =
+          $self->Encode(text, options, proto.mutable_proto(), &context);
+      if (!status.ok()) throw status;
+    }
     RewriteIds(*$self, &proto, add_bos, add_eos, reverse, emit_unk_piece);
     return proto;
   }
@@ -445,6 +998,56 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                   absl::string_view, std::vector<int>);
   }
 
+  FlatIds _EncodeAsIdsFlatBatch(
+      const std::vector<absl::string_view> &ins, int num_threads,
+      bool enable_sampling, int nbest_size, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    const auto idss = [&]() {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }();
+    return FlattenIds(idss);
+  }
+
+  NarrowIds _NarrowIds(const PyBufferView &ids) const {
+    return NarrowIdBuffer(ids, $self->GetPieceSize());
+  }
+
+  CorpusIds _EncodeCorpus(const std::vector<absl::string_view> &ins,
+                          bool add_bos, bool add_eos, bool reverse) const {
+    CorpusIds corpus;
+    const auto status = $self->EncodeCorpus(ins, &corpus.ids, &corpus.stats);
+    if (!status.ok()) throw status;
+    if (add_bos || add_eos || reverse) {
+      sentencepiece::RunOnSharedThreadPool(
+          corpus.ids.size(), -1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+              RewriteIds(*$self, &corpus.ids[i], add_bos, add_eos, reverse,
+                         false);
+            }
+          });
+    }
+    return corpus;
+  }
+
+  PaddedIds _EncodeAsIdsPaddedBatch(
+      const std::vector<absl::string_view> &ins, int num_threads,
+      bool enable_sampling, int nbest_size, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece, int max_length, bool pad_to_max_length,
+      int pad_to_multiple_of, bool pad_left, bool truncate_left,
+      int pad_id) const {
+    // <s> and </s> are added by PadIds() after the truncation.
+    const auto idss = [&](bool add_bos, bool add_eos) {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }(false, false);
+    return PadIds(*$self, idss, add_bos, add_eos, max_length,
+                  pad_to_max_length, pad_to_multiple_of, pad_left,
+                  truncate_left, pad_id, num_threads);
+  }
+
   std::vector<std::vector<std::string>> _EncodeAsPiecesBatch(
       const std::vector<absl::string_view> &ins, int num_threads,
       bool enable_sampling, int nbest_size, float alpha,
@@ -475,6 +1078,52 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                   sentencepiece::ImmutableSentencePieceText);
   }
 
+  /////////////////////////////////////////////////////////////////////////////
+  // EncodeAs* (Batch request in one buffer)
+  std::vector<std::vector<int>> _EncodeAsIdsFromBuffer(
+      const PyBufferView &data, const PyBufferView &offsets, int num_threads,
+      bool enable_sampling, int nbest_size, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    const auto ins = SplitBuffer(data, offsets);
+    DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                  absl::string_view, std::vector<int>);
+  }
+
+  FlatIds _EncodeAsIdsFlatFromBuffer(
+      const PyBufferView &data, const PyBufferView &offsets, int num_threads,
+      bool enable_sampling, int nbest_size, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    const auto ins = SplitBuffer(data, offsets);
+    const auto idss = [&]() {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }();
+    return FlattenIds(idss);
+  }
+
+  std::vector<std::vector<std::string>> _EncodeAsPiecesFromBuffer(
+      const PyBufferView &data, const PyBufferView &offsets, int num_threads,
+      bool enable_sampling, int nbest_size, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    const auto ins = SplitBuffer(data, offsets);
+    DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsPieces,
+                                  absl::string_view, std::vector<std::string>);
+  }
+
+  ArrowIds _EncodeArrow(
+      const PyBufferView &validity, int offset, const PyBufferView &offsets,
+      const PyBufferView &data, bool large_offsets,
+      bool add_bos, bool add_eos, bool reverse) const {
+    return large_offsets
+        ? EncodeArrowBuffers<int64_t>(*$self, validity, offset, offsets, data,
+                                      add_bos, add_eos, reverse)
+        : EncodeArrowBuffers<int32_t>(*$self, validity, offset, offsets, data,
+                                      add_bos, add_eos, reverse);
+  }
+
   /////////////////////////////////////////////////////////////////////////////
   // DecodeAs* (Single request)
   std::string _DecodeIds(const std::vector<int> &ids) const {
@@ -667,6 +1316,24 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     return proto;
   }
 
+  /////////////////////////////////////////////////////////////////////////////
+  // SampleEncodeMany (Batch request)
+  std::vector<std::vector<int>> _SampleEncodeManyAsIdsBatch(
+      const std::vector<absl::string_view> &ins, int num_threads,
+      int num_samples, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(std::vector<int>);
+  }
+
+  std::vector<std::vector<std::string>> _SampleEncodeManyAsPiecesBatch(
+      const std::vector<absl::string_view> &ins, int num_threads,
+      int num_samples, float alpha,
+      bool add_bos, bool add_eos, bool reverse,
+      bool emit_unk_piece) const {
+    DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(std::vector<std::string>);
+  }
+
   // Normalize
   std::string _Normalize(absl::string_view text) {
     return $self->Normalize(text);
@@ -678,6 +1345,14 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     return result;
   }
 
+  sentencepiece::NormalizedBatch _NormalizeBatch(
+      const std::vector<absl::string_view> &ins, bool with_offsets) const {
+    sentencepiece::NormalizedBatch batch;
+    const auto status = $self->NormalizeBatch(ins, with_offsets, &batch);
+    if (!status.ok()) throw status;
+    return batch;
+  }
+
   // Calculate Entropy
   float _CalculateEntropy(absl::string_view text, float alpha)  {
     return $self->CalculateEntropy(text, alpha);
@@ -687,21 +1362,24 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                             float alpha, int num_threads)  {
     std::vector<float> outs(ins.size());
     InitNumThreads(ins, &num_threads);
-    {
-      ThreadPool pool(ins.size());
-      std::atomic<size_t> index = 0;
-      for (int n = 0;  n < num_threads; ++n) {
-        pool.Schedule([&]() {
-           size_t i = 0;
-           while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) {
-             outs[i] = self->CalculateEntropy(ins[i], alpha);
-           }
-         });
-      }
-    }
+    sentencepiece::RunOnSharedThreadPool(
+        ins.size(), num_threads, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            outs[i] = self->CalculateEntropy(ins[i], alpha);
+          }
+        });
     return outs;
   }
 
+  EntropyResults _CalculateEntropyAndExpectedCountsBatch(
+      const std::vector<absl::string_view> &ins, float alpha) const {
+    EntropyResults results;
+    const auto status = $self->CalculateEntropyBatch(
+        ins, alpha, &results.entropies, &results.expected_counts);
+    if (!status.ok()) throw status;
+    return results;
+  }
+
   // override normalizer_spec
   sentencepiece::util::Status _OverrideNormalizerSpec(
       const std::unordered_map<std::string, std::string> &args) {
@@ -764,6 +1442,20 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
       self.Load(model_file=model_file, model_proto=model_proto)
 
 
+  def _IdArray(self, ids, dtype):
+    """Returns the int32 ids in the bytes `ids` as a memoryview of `dtype`."""
+    name = dtype if dtype is None or isinstance(dtype, str) else getattr(
+        dtype, 'name', getattr(dtype, '__name__', None))
+    if name is None or name == 'int32':
+      return memoryview(ids).cast('i')
+    if name == 'uint16':
+      return memoryview(self._NarrowIds(ids)).cast('H')
+    if name == 'uint32':
+      # The ids are not negative, so they are the same bytes.
+      return memoryview(ids).cast('I')
+    raise RuntimeError('unknown dtype={}'.format(dtype))
+
+
   def Encode(self,
              input,
              out_type=None,
@@ -774,12 +1466,18 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
              enable_sampling=None,
              nbest_size=None,
              alpha=None,
-             num_threads=None):
+             num_threads=None,
+             dtype=None):
     """Encode text input to segmented ids or tokens.
 
       Args:
       input: input string. accepsts list of string.
-      out_type: output type. int or str.
+      out_type: output type. int, str or 'array'. 'array' returns the ids
+                as an int32 memoryview, and for a list input a pair of
+                the ids of all the inputs and an int64 memoryview of
+                len(input) + 1 offsets, where the ids of input[i] are
+                ids[offsets[i]:offsets[i + 1]]. numpy.asarray() wraps them
+                without a copy.
       add_bos: Add <s> to the result (Default = false)
       add_eos: Add </s> to the result (Default = false) <s>/</s> is added after
                reversing (if enabled).
@@ -794,6 +1492,9 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
       alpha: Soothing parameter for unigram sampling, and merge probability for
              BPE-dropout (probablity 'p' in BPE-dropout paper).
       num_threads: the number of threads used in the batch processing (Default = -1).
+      dtype: type of the 'array' ids: 'int32' (default), 'uint16', which
+             halves the memory of the vocabularies of up to 65536 pieces, or
+             'uint32'. A numpy dtype is also accepted.
     """
 
     if out_type is None:
@@ -834,6 +1535,10 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
       if out_type is str:
         return self._EncodeAsPiecesBatch(input, num_threads, enable_sampling, nbest_size,
                                          alpha, add_bos, add_eos, reverse, emit_unk_piece)
+      if out_type == 'array':
+        ids, offsets = self._EncodeAsIdsFlatBatch(input, num_threads, enable_sampling, nbest_size,
+                                                  alpha, add_bos, add_eos, reverse, emit_unk_piece)
+        return self._IdArray(ids, dtype), memoryview(offsets).cast('q')
       if out_type == 'serialized_proto' or out_type == 'proto':
         return self._EncodeAsSerializedProtoBatch(input, num_threads, enable_sampling, nbest_size,
                                                   alpha, add_bos, add_eos, reverse, emit_unk_piece)
@@ -847,6 +1552,10 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     if out_type is str:
       return self._EncodeAsPieces(input, enable_sampling, nbest_size,
                                   alpha, add_bos, add_eos, reverse, emit_unk_piece)
+    if out_type == 'array':
+      ids, _ = self._EncodeAsIdsFlatBatch([input], 1, enable_sampling, nbest_size,
+                                          alpha, add_bos, add_eos, reverse, emit_unk_piece)
+      return self._IdArray(ids, dtype)
     if out_type == 'serialized_proto' or out_type == 'proto':
       return self._EncodeAsSerializedProto(input, enable_sampling, nbest_size,
                                            alpha, add_bos, add_eos, reverse, emit_unk_piece)
@@ -874,6 +1583,275 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     return self.Encode(input=input, out_type='immutable_proto', **kwargs)
 
 
+  def EncodePadded(self,
+                   input,
+                   max_length=None,
+                   padding='longest',
+                   pad_to_multiple_of=None,
+                   padding_side='right',
+                   truncation_side='right',
+                   pad_id=None,
+                   add_bos=None,
+                   add_eos=None,
+                   reverse=None,
+                   emit_unk_piece=None,
+                   enable_sampling=None,
+                   nbest_size=None,
+                   alpha=None,
+                   num_threads=None):
+    """Encode a list of strings into a padded [len(input), width] matrix of ids.
+
+      Args:
+      input: list of strings.
+      max_length: the ids longer than max_length, including <s> and </s>,
+                  are truncated (Default = no truncation).
+      padding: 'longest' pads to the longest ids, 'max_length' to max_length.
+      pad_to_multiple_of: rounds the width up to a multiple of it.
+      padding_side: 'right' or 'left'.
+      truncation_side: 'right' drops the last ids, 'left' the first ones.
+      pad_id: id of the padding (Default = pad_id()).
+      The other arguments are the same as in Encode().
+
+      Returns:
+      A pair of int32 memoryviews of shape [len(input), width]: the ids and the
+      attention mask, which is 1 at the ids and 0 at the padding. numpy.asarray()
+      wraps them without a copy. The memoryviews are 1-D when they are empty.
+    """
+
+    if add_bos is None:
+      add_bos = self._add_bos
+    if add_eos is None:
+      add_eos = self._add_eos
+    if reverse is None:
+      reverse = self._reverse
+    if emit_unk_piece is None:
+      emit_unk_piece = self._emit_unk_piece
+    if enable_sampling is None:
+      enable_sampling = self._enable_sampling
+    if nbest_size is None:
+      nbest_size = self._nbest_size
+    if alpha is None:
+      alpha = self._alpha
+    if num_threads is None:
+      num_threads = self._num_threads
+    if pad_id is None:
+      pad_id = self.pad_id()
+
+    if type(input) is not list:
+      raise RuntimeError('input must be a list of strings')
+    if pad_id < 0:
+      raise RuntimeError('pad_id is not defined in the model; pass pad_id')
+    if padding not in ('longest', 'max_length'):
+      raise RuntimeError('unknown padding={}'.format(padding))
+    if padding == 'max_length' and max_length is None:
+      raise RuntimeError('padding="max_length" requires max_length')
+    if padding_side not in ('right', 'left'):
+      raise RuntimeError('unknown padding_side={}'.format(padding_side))
+    if truncation_side not in ('right', 'left'):
+      raise RuntimeError('unknown truncation_side={}'.format(truncation_side))
+    if max_length is not None and (max_length <= 0 or max_length < int(add_bos) + int(add_eos)):
+      raise RuntimeError('max_length must be positive and hold <s> and </s>')
+    if max_length is None:
+      max_length = 0
+    if pad_to_multiple_of is None:
+      pad_to_multiple_of = 0
+
+    ids, mask, rows, width = self._EncodeAsIdsPaddedBatch(
+        input, num_threads, enable_sampling, nbest_size, alpha, add_bos, add_eos, reverse,
+        emit_unk_piece, max_length, padding == 'max_length', pad_to_multiple_of,
+        padding_side == 'left', truncation_side == 'left', pad_id)
+    if rows * width == 0:
+      return memoryview(ids).cast('i'), memoryview(mask).cast('i')
+    return memoryview(ids).cast('i', [rows, width]), memoryview(mask).cast('i', [rows, width])
+
+
+  def EncodeCorpus(self, input, add_bos=None, add_eos=None, reverse=None, with_stats=False):
+    """Encode a large list of strings into ids on all the hardware threads.
+
+      The inputs are handed out to the workers longest first, and the short
+      ones in groups, so that a few long documents do not delay the end of the
+      call. The ids are returned in the order of input.
+
+      Args:
+      input: list of strings.
+      with_stats: also returns a dict of the per-worker 'num_inputs',
+                  'num_bytes', 'busy_seconds' and 'utilization' lists, and
+                  the 'elapsed_seconds' of the call.
+      The other arguments are the same as in Encode(). Sampling is not
+      supported.
+    """
+
+    if add_bos is None:
+      add_bos = self._add_bos
+    if add_eos is None:
+      add_eos = self._add_eos
+    if reverse is None:
+      reverse = self._reverse
+
+    if type(input) is not list:
+      raise RuntimeError('input must be a list of strings')
+
+    ids, stats = self._EncodeCorpus(input, add_bos, add_eos, reverse)
+    if not with_stats:
+      return ids
+    elapsed = stats['elapsed_seconds']
+    stats['utilization'] = [busy / elapsed if elapsed > 0 else 0.0
+                            for busy in stats['busy_seconds']]
+    return ids, stats
+
+
+  def EncodeFromBuffer(self,
+                       data,
+                       offsets,
+                       out_type=None,
+                       add_bos=None,
+                       add_eos=None,
+                       reverse=None,
+                       emit_unk_piece=None,
+                       enable_sampling=None,
+                       nbest_size=None,
+                       alpha=None,
+                       num_threads=None,
+                       dtype=None):
+    """Encode the sentences stored in one buffer, without a Python object per sentence.
+
+      Args:
+      data: UTF-8 sentences in a bytes-like object, e.g., bytes, memoryview or
+            the data buffer of an Arrow string array.
+      offsets: len(sentences) + 1 int32 or int64 offsets in a buffer, e.g.,
+               array.array, memoryview or numpy array. The i-th sentence is
+               data[offsets[i]:offsets[i + 1]].
+      out_type: output type. int, str or 'array' as in Encode().
+      dtype: type of the 'array' ids as in Encode().
+      The other arguments are the same as in Encode().
+    """
+
+    if out_type is None:
+      out_type = self._out_type
+    if add_bos is None:
+      add_bos = self._add_bos
+    if add_eos is None:
+      add_eos = self._add_eos
+    if reverse is None:
+      reverse = self._reverse
+    if emit_unk_piece is None:
+      emit_unk_piece = self._emit_unk_piece
+    if enable_sampling is None:
+      enable_sampling = self._enable_sampling
+    if nbest_size is None:
+      nbest_size = self._nbest_size
+    if alpha is None:
+      alpha = self._alpha
+    if num_threads is None:
+      num_threads = self._num_threads
+
+    if num_threads is None or type(num_threads) is not int:
+      raise RuntimeError('num_threads must be int')
+
+    if out_type is int:
+      return self._EncodeAsIdsFromBuffer(data, offsets, num_threads, enable_sampling, nbest_size,
+                                         alpha, add_bos, add_eos, reverse, emit_unk_piece)
+    if out_type is str:
+      return self._EncodeAsPiecesFromBuffer(data, offsets, num_threads, enable_sampling, nbest_size,
+                                            alpha, add_bos, add_eos, reverse, emit_unk_piece)
+    if out_type == 'array':
+      ids, offsets = self._EncodeAsIdsFlatFromBuffer(data, offsets, num_threads, enable_sampling,
+                                                     nbest_size, alpha, add_bos, add_eos, reverse,
+                                                     emit_unk_piece)
+      return self._IdArray(ids, dtype), memoryview(offsets).cast('q')
+
+    raise RuntimeError('unknown out_type={}'.format(out_type))
+
+
+  def EncodeArrowBuffers(self,
+                         validity,
+                         offsets,
+                         data,
+                         offset=0,
+                         length=None,
+                         large_offsets=False,
+                         add_bos=None,
+                         add_eos=None,
+                         reverse=None):
+    """Encode an Arrow string array given by its buffers into the buffers of a list<int32> array.
+
+      Args:
+      validity: validity bitmap of the array, or None when there are no nulls.
+                A null string gives an empty list.
+      offsets: int32 offsets (int64 when large_offsets is True) into data.
+      data: UTF-8 strings of the array.
+      offset: offset of the array into the buffers.
+      length: number of strings. All the strings after offset by default.
+      large_offsets: True for the large_string type.
+      The other arguments are the same as in Encode(). Sampling is not
+      supported. The encoding runs on the worker threads of the processor.
+
+      Returns:
+      int32 memoryview of the ids and the memoryview of the length + 1 offsets
+      of the lists, whose type is the same as the offsets of the input.
+    """
+
+    if add_bos is None:
+      add_bos = self._add_bos
+    if add_eos is None:
+      add_eos = self._add_eos
+    if reverse is None:
+      reverse = self._reverse
+
+    width = 8 if large_offsets else 4
+    offsets = memoryview(offsets).cast('B')
+    if length is None:
+      length = len(offsets) // width - offset - 1
+    if offset < 0 or length < 0:
+      raise RuntimeError('offset and length must be non-negative')
+
+    # Slices the buffers at the byte of the validity bitmap holding offset.
+    start = offset - offset % 8
+    offsets = offsets[start * width:(offset + length + 1) * width]
+    if validity is None:
+      validity = b''
+    else:
+      validity = memoryview(validity).cast('B')[start // 8:]
+    if data is None:
+      data = b''
+
+    values, offsets = self._EncodeArrow(validity, offset % 8, offsets, data, large_offsets,
+                                        add_bos, add_eos, reverse)
+    return memoryview(values).cast('i'), memoryview(offsets).cast('q' if large_offsets else 'i')
+
+
+  def EncodeArrow(self, array, add_bos=None, add_eos=None, reverse=None):
+    """Encode a pyarrow string or large_string array into a list<int32> array.
+
+      A pyarrow.ChunkedArray gives a ChunkedArray. Null strings give null lists.
+      The strings are read in place; see EncodeArrowBuffers().
+    """
+
+    import pyarrow
+
+    large_offsets = pyarrow.types.is_large_string(array.type)
+    if not large_offsets and not pyarrow.types.is_string(array.type):
+      raise TypeError('array must be of string or large_string type')
+    list_type = pyarrow.large_list(pyarrow.int32()) if large_offsets else pyarrow.list_(
+        pyarrow.int32())
+
+    if isinstance(array, pyarrow.ChunkedArray):
+      return pyarrow.chunked_array(
+          [self.EncodeArrow(chunk, add_bos, add_eos, reverse) for chunk in array.chunks],
+          type=list_type)
+
+    validity, offsets, data = array.buffers()
+    values, offsets = self.EncodeArrowBuffers(validity, offsets, data, array.offset, len(array),
+                                              large_offsets, add_bos, add_eos, reverse)
+    values = pyarrow.Array.from_buffers(pyarrow.int32(), len(values),
+                                        [None, pyarrow.py_buffer(values)])
+    # The bitmap of is_valid() starts at the first string of the array.
+    validity = array.is_valid().buffers()[1] if array.null_count else None
+    return pyarrow.Array.from_buffers(list_type, len(array),
+                                      [validity, pyarrow.py_buffer(offsets)],
+                                      children=[values])
+
+
   def SampleEncodeAsPieces(self, input, nbest_size=None, alpha=None, **kwargs):
     return self.Encode(input=input, nbest_size=nbest_size, alpha=alpha,
                        out_type=str, enable_sampling=True, **kwargs)
@@ -1069,6 +2047,67 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
                                      out_type='immutable_proto', **kwargs)
 
 
+  def SampleEncodeMany(self,
+                       input,
+                       num_samples,
+                       alpha=None,
+                       out_type=None,
+                       add_bos=None,
+                       add_eos=None,
+                       reverse=None,
+                       emit_unk_piece=None,
+                       num_threads=None):
+    """Samples num_samples segmentations of the input at once.
+
+      The unigram model builds the lattice of a sentence once and draws all
+      its samples from it, which is faster than calling Encode() with
+      enable_sampling=True and nbest_size=-1 num_samples times.
+
+      Args:
+      input: input string. accepsts list of string.
+      num_samples: the number of samples of each input.
+      alpha: inverse temperature for unigram, and merge probability for
+             BPE-dropout (Default = the alpha of the processor or 1.0).
+      out_type: output type. int or str.
+      num_threads: the number of threads used in the batch processing.
+      The other arguments are the same as in Encode().
+
+      Returns:
+      a list of num_samples samples, or a list of them per input string.
+    """
+
+    if out_type is None:
+      out_type = self._out_type
+    if add_bos is None:
+      add_bos = self._add_bos
+    if add_eos is None:
+      add_eos = self._add_eos
+    if reverse is None:
+      reverse = self._reverse
+    if emit_unk_piece is None:
+      emit_unk_piece = self._emit_unk_piece
+    if alpha is None:
+      alpha = 1. if self._alpha is None else self._alpha
+    if num_threads is None:
+      num_threads = self._num_threads
+
+    if type(num_samples) is not int or num_samples < 0:
+      raise RuntimeError('num_samples must be a non-negative int')
+
+    inputs = input if type(input) is list else [input]
+    if out_type is int:
+      samples = self._SampleEncodeManyAsIdsBatch(inputs, num_threads, num_samples, alpha,
+                                                 add_bos, add_eos, reverse, emit_unk_piece)
+    elif out_type is str:
+      samples = self._SampleEncodeManyAsPiecesBatch(inputs, num_threads, num_samples, alpha,
+                                                    add_bos, add_eos, reverse, emit_unk_piece)
+    else:
+      raise RuntimeError('unknown out_type')
+
+    outputs = [samples[i * num_samples:(i + 1) * num_samples] for i in range(len(inputs))]
+    return outputs if type(input) is list else outputs[0]
+
+
   def Decode(self, input, out_type=str, num_threads=None):
     """Decode processed id or token sequences.
 
@@ -1188,8 +2227,24 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     return self.Decode(input=input, out_type=out_type, **kwargs)
 
 
-  def CalculateEntropy(self, input, alpha, num_threads=None):
-    """Calculate sentence entropy"""
+  def CalculateEntropy(self, input, alpha, num_threads=None,
+                       with_expected_counts=False):
+    """Calculate sentence entropy.
+
+      With with_expected_counts=True, also returns the expected count of each
+      piece in the segmentations, in the same distribution as the entropy, as
+      a dict from the piece id to the count. A list input is processed on the
+      worker pool of this processor, and returns a list of entropies and a
+      list of dicts.
+    """
+    if with_expected_counts:
+      inputs = input if type(input) is list else [input]
+      entropies, counts = self._CalculateEntropyAndExpectedCountsBatch(
+          inputs, alpha)
+      if type(input) is list:
+        return entropies, counts
+      return entropies[0], counts[0]
+
     if type(input) is list:
       if num_threads is None:
         num_threads = self._num_threads
@@ -1210,6 +2265,28 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
       return [_normalize(x) for x in input]
     return _normalize(input)
 
+  def NormalizeBatch(self, input, with_offsets=None):
+    """Normalizes a list of str on the worker pool into one buffer.
+
+    Returns the UTF-8 normalizations in one bytes object `text` and an int64
+    memoryview of len(input) + 1 `offsets`, where the normalization of
+    input[i] is text[offsets[i]:offsets[i + 1]]. With `with_offsets`, also
+    returns the byte alignments to the UTF-8 inputs as runs, an int64
+    memoryview of (norm, orig, identity) triples, where the run j is
+    runs[3 * j:3 * j + 3], and an int64 memoryview of len(input) + 1
+    `run_offsets`, where the runs of input[i] are the runs from
+    run_offsets[i] to run_offsets[i + 1]. The normalized bytes from norm up
+    to the next run (or up to the normalization length + 1) come from the
+    input byte orig, plus their distance from norm when identity is 1.
+    """
+    text, offsets, runs, run_offsets = self._NormalizeBatch(
+        input, bool(with_offsets))
+    offsets = memoryview(offsets).cast('q')
+    if not with_offsets:
+      return text, offsets
+    return (text, offsets, memoryview(runs).cast('q'),
+            memoryview(run_offsets).cast('q'))
+
   def OverrideNormalizerSpec(self, **kwargs):
     new_kwargs = {}
     for key, value in kwargs.items():
@@ -1225,6 +2302,27 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
     return self.GetPieceSize()
 
 
+  def GetModelHandle(self):
+    """Returns a picklable ModelHandle of the model file and the options.
+
+    The handle pickles the path instead of the serialized model proto, so
+    that the workers of a multiprocessing loader load the file themselves.
+    """
+    model_file = self.model_file()
+    if not model_file:
+      raise RuntimeError('The model was not loaded from a model file.')
+    return ModelHandle(model_file,
+                       out_type=self._out_type,
+                       add_bos=self._add_bos,
+                       add_eos=self._add_eos,
+                       reverse=self._reverse,
+                       emit_unk_piece=self._emit_unk_piece,
+                       enable_sampling=self._enable_sampling,
+                       nbest_size=self._nbest_size,
+                       alpha=self._alpha,
+                       num_threads=self._num_threads)
+
+
   def __getstate__(self):
     return self.serialized_model_proto()
 
@@ -1502,13 +2600,17 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
 
       def __getitem__(self, index):
         if isinstance(index, slice):
-          return [self.proto._pieces(i) for i in range(self.len)][index.start:index.stop:index.step]
+          return [self.proto._pieces(i) for i in range(*index.indices(self.len))]
         if index < 0:
           index = index + self.len
         if index < 0 or index >= self.len:
           raise IndexError('piece index is out of range')
         return self.proto._pieces(index)
 
+      def __iter__(self):
+        for i in range(self.len):
+          yield self.proto._pieces(i)
+
       def __str__(self):
         return '\n'.join(['pieces {{\n{}}}'.format(str(x)) for x in self])
 
@@ -1549,13 +2651,17 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
 
       def __getitem__(self, index):
         if isinstance(index, slice):
-          return [self.proto._nbests(i) for i in range(self.len)][index.start:index.stop:index.step]
+          return [self.proto._nbests(i) for i in range(*index.indices(self.len))]
         if index < 0:
           index = index + self.len
         if index < 0 or index >= self.len:
           raise IndexError('nbests index is out of range')
         return self.proto._nbests(index)
 
+      def __iter__(self):
+        for i in range(self.len):
+          yield self.proto._nbests(i)
+
       def __str__(self):
         return '\n'.join(['nbests {{\n{}}}'.format(str(x)) for x in self])
 
@@ -1603,6 +2709,97 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   }
 }
 
+// A pair of the list of the ids and the dict of the statistics.
+%typemap(out) CorpusIds {
+  PyObject *ids = PyList_New($1.ids.size());
+  for (size_t i = 0; i < $1.ids.size(); ++i) {
+    PyObject *obj = PyList_New($1.ids[i].size());
+    for (size_t j = 0; j < $1.ids[i].size(); ++j) {
+      PyList_SET_ITEM(obj, j, PyInt_FromLong(static_cast<long>($1.ids[i][j])));
+    }
+    PyList_SET_ITEM(ids, i, obj);
+  }
+  PyObject *stats = PyDict_New();
+  const std::pair<const char *, PyObject *> items[] = {
+      {"num_inputs", MakePyList($1.stats.num_inputs)},
+      {"num_bytes", MakePyList($1.stats.num_bytes)},
+      {"busy_seconds", MakePyList($1.stats.busy_seconds)},
+      {"elapsed_seconds", MakePyNumber($1.stats.elapsed_seconds)}};
+  for (const auto &item : items) {
+    PyDict_SetItemString(stats, item.first, item.second);
+    Py_DECREF(item.second);
+  }
+  $result = PyTuple_Pack(2, ids, stats);
+  Py_DECREF(ids);
+  Py_DECREF(stats);
+}
+
+// A pair of the list of the entropies and the list of {id: count} dicts.
+%typemap(out) EntropyResults {
+  PyObject *entropies = MakePyList($1.entropies);
+  PyObject *counts = PyList_New($1.expected_counts.size());
+  for (size_t i = 0; i < $1.expected_counts.size(); ++i) {
+    PyObject *dict = PyDict_New();
+    for (const auto &count : $1.expected_counts[i]) {
+      PyObject *key = PyInt_FromLong(static_cast<long>(count.first));
+      PyObject *value = PyFloat_FromDouble(static_cast<double>(count.second));
+      PyDict_SetItem(dict, key, value);
+      Py_DECREF(key);
+      Py_DECREF(value);
+    }
+    PyList_SET_ITEM(counts, i, dict);
+  }
+  $result = PyTuple_Pack(2, entropies, counts);
+  Py_DECREF(entropies);
+  Py_DECREF(counts);
+}
+
+// Two bytes objects holding the int32 ids and the int64 offsets.
+%typemap(out) FlatIds {
+  $result = PyTuple_New(2);
+  PyTuple_SET_ITEM($result, 0,
+                   MakePyOutputBuffer($1.ids.data(),
+                                      $1.ids.size() * sizeof(int32_t)));
+  PyTuple_SET_ITEM($result, 1,
+                   MakePyOutputBuffer($1.offsets.data(),
+                                      $1.offsets.size() * sizeof(int64_t)));
+}
+
+// Bytes objects holding the normalizations, the alignment runs and their
+// offsets.
+%typemap(out) sentencepiece::NormalizedBatch {
+  $result = MakePyNormalizedBatch($1);
+}
+
+// A bytes object holding the uint16 ids.
+%typemap(out) NarrowIds {
+  $result = MakePyOutputBuffer($1.ids.data(),
+                               $1.ids.size() * sizeof(uint16_t));
+}
+
+// Two bytes objects holding the ids and the mask, and the shape.
+%typemap(out) PaddedIds {
+  $result = PyTuple_New(4);
+  PyTuple_SET_ITEM($result, 0,
+                   MakePyOutputBuffer($1.ids.data(),
+                                      $1.ids.size() * sizeof(int32_t)));
+  PyTuple_SET_ITEM($result, 1,
+                   MakePyOutputBuffer($1.mask.data(),
+                                      $1.mask.size() * sizeof(int32_t)));
+  PyTuple_SET_ITEM($result, 2, PyLong_FromSize_t($1.rows));
+  PyTuple_SET_ITEM($result, 3, PyLong_FromSize_t($1.width));
+}
+
+// Two bytes objects holding the values and the offsets.
+%typemap(out) ArrowIds {
+  $result = PyTuple_New(2);
+  PyTuple_SET_ITEM($result, 0,
+                   MakePyOutputBuffer($1.values.data(),
+                                      $1.values.size() * sizeof(int32_t)));
+  PyTuple_SET_ITEM($result, 1,
+                   MakePyOutputBuffer($1.offsets.data(), $1.offsets.size()));
+}
+
 %typemap(out) std::vector<std::string> {
   PyObject *input_type = resultobj;
   $result = PyList_New($1.size());
@@ -1677,13 +2874,16 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   $1 = ustring.str();
 }
 
-%typemap(in) const std::vector<absl::string_view>& {
+// The tuple of the items keeps the strings alive while the GIL is
+// released, even if the list is modified by another thread.
+%typemap(in) const std::vector<absl::string_view>& (PyObject *items = nullptr) {
   std::vector<absl::string_view> *out = nullptr;
   if (PyList_Check($input)) {
-    const size_t size = PyList_Size($input);
+    items = PyList_AsTuple($input);
+    const size_t size = PyTuple_GET_SIZE(items);
     out = new std::vector<absl::string_view>(size);
     for (size_t i = 0; i < size; ++i) {
-      const PyInputString ustring(PyList_GetItem($input, i));
+      const PyInputString ustring(PyTuple_GET_ITEM(items, i));
       if (ustring.IsAvalable()) {
         (*out)[i] = ustring.str();
       } else {
@@ -1699,6 +2899,12 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   $1 = out;
 }
 
+%typemap(in) const PyBufferView & {
+  $1 = new PyBufferView($input);
+  // PyObject_GetBuffer() sets the error.
+  if (!$1->ok()) SWIG_fail;
+}
+
 %typemap(in) const std::vector<int>& {
   std::vector<int> *out = nullptr;
   if (PyList_Check($input)) {
@@ -1720,18 +2926,21 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   $1 = out;
 }
 
-%typemap(in) const std::vector<std::vector<absl::string_view>>& {
+%typemap(in) const std::vector<std::vector<absl::string_view>>& (PyObject *items = nullptr) {
   std::vector<std::vector<absl::string_view>> *out = nullptr;
   if (PyList_Check($input)) {
     const size_t size = PyList_Size($input);
+    items = PyTuple_New(size);
     out = new std::vector<std::vector<absl::string_view>>(size);
     for (size_t i = 0; i < size; ++i) {
       PyObject *o = PyList_GetItem($input, i);
       if (PyList_Check(o)) {
-        const size_t size2 = PyList_Size(o);
+        PyObject *o2 = PyList_AsTuple(o);
+        PyTuple_SET_ITEM(items, i, o2);
+        const size_t size2 = PyTuple_GET_SIZE(o2);
         (*out)[i].resize(size2);
         for (size_t j = 0; j < size2; ++j) {
-          const PyInputString ustring(PyList_GetItem(o, j));
+          const PyInputString ustring(PyTuple_GET_ITEM(o2, j));
           if (ustring.IsAvalable()) {
             (*out)[i][j] = ustring.str();
           } else {
@@ -1872,6 +3081,12 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
 }
 
 %typemap(freearg) const std::vector<absl::string_view>& {
+  Py_XDECREF(items$argnum);
+  delete $1;
+}
+
+%typemap(freearg) const std::vector<std::vector<absl::string_view>>& {
+  Py_XDECREF(items$argnum);
   delete $1;
 }
 
@@ -1879,6 +3094,10 @@ inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
   delete $1;
 }
 
+%typemap(freearg) const PyBufferView & {
+  delete $1;
+}
+
 %typemap(freearg) const std::vector<int>& {
   delete $1;
 }
@@ -1937,6 +3156,31 @@ def _add_snake_case(classname):
     setattr(classname, k, v)
 
 
+class ModelHandle(object):
+  """Picklable reference to a SentencePieceProcessor loaded from a file.
+
+  Pickling a SentencePieceProcessor copies its serialized model proto. The
+  handle holds the path of the model file and the options instead, and Get()
+  loads the file once per process, e.g. in each worker of a multiprocessing
+  data loader, where the pages of a mapped fast model are shared.
+  """
+
+  _processors = {}
+
+  def __init__(self, model_file, **options):
+    self.model_file = model_file
+    self.options = options
+
+  def Get(self):
+    """Returns the processor of this handle, loaded once per process."""
+    key = (os.getpid(), self.model_file, tuple(sorted(self.options.items())))
+    sp = ModelHandle._processors.get(key)
+    if sp is None:
+      sp = SentencePieceProcessor(model_file=self.model_file, **self.options)
+      ModelHandle._processors[key] = sp
+    return sp
+
+
 def _batchnize(classname, name):
   """Enables batch request for the method classname.name."""
   func = getattr(classname, name, None)
@@ -1971,8 +3215,11 @@ for m in [
 _add_snake_case(SentencePieceProcessor)
 _add_snake_case(SentencePieceTrainer)
 _add_snake_case(SentencePieceNormalizer)
+_add_snake_case(ModelHandle)
 set_random_generator_seed = SetRandomGeneratorSeed
 set_min_log_level = SetMinLogLevel
+configure_thread_pools = ConfigureThreadPools
+get_default_num_threads = GetDefaultNumThreads
 
 from ._version import __version__
 
@@ -3152,6 +3152,7 @@ namespace swig {
 #include <functional>
 #include <limits>
 #include <cmath>
+#include <cstdint>
 #include <thread>
 #include <vector>
 #include <sentencepiece_processor.h>
@@ -3210,6 +3211,17 @@ PyObject* MakePyOutputBytes(const sentencepiece::util::bytes& output) {
   return PyBytes_FromStringAndSize(output.data(), output.size());
 }
 
+// Releases the GIL in the scope, so that the other Python threads run
+// while the C++ code does.
+class ScopedGILRelease {
+ public:
+  ScopedGILRelease() : state_(PyEval_SaveThread()) {}
+  ~ScopedGILRelease() { PyEval_RestoreThread(state_); }
+
+ private:
+  PyThreadState *state_ = nullptr;
+};
+
 int ToSwigError(sentencepiece::util::StatusCode code) {
   switch (code) {
     case sentencepiece::util::StatusCode::kNotFound:
@@ -3224,60 +3236,6 @@ int ToSwigError(sentencepiece::util::StatusCode code) {
   return SWIG_RuntimeError;
 }
 
-class PySentenceIterator : public sentencepiece::SentenceIterator {
-  public:
-  PySentenceIterator(PyObject *iter) : iter_(iter) {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
-  }
-
-  ~PySentenceIterator() {
-   // Py_XDECREF(iter_);
-  }
-
-  bool done() const override {
-    return item_ == nullptr;
-  }
-
-  void Next() override {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
-  }
-
-  const std::string &value() const override {
-    return value_;
-  }
-
-  sentencepiece::util::Status status() const override {
-    return status_;
-  }
-
-  private:
-   void CopyValue() {
-     if (item_ == nullptr) return;
-     const PyInputString ustring(item_);
-     if (ustring.IsAvalable()) {
-       const char *data = ustring.data();
-       size_t size = ustring.size();
-       while (size > 0) {
-         if (data[size - 1] == '\r' || data[size - 1] == '\n')
-           --size;
-         else
-           break;
-       }
-       value_.assign(data, size);
-     } else {
-       status_ = sentencepiece::util::Status(sentencepiece::util::StatusCode::kInternal,
-                                             "Not a string.");
-     }
-     Py_XDECREF(item_);
-   }
-   PyObject *iter_ = nullptr;
-   PyObject *item_ = nullptr;
-   std::string value_;
-   sentencepiece::util::Status status_;
-};
-
 inline void RewriteIds(const sentencepiece::SentencePieceProcessor &sp,
                        std::vector<int> *ids,
                        bool add_bos, bool add_eos, bool reverse, bool emit_unk_piece) {
@@ -3350,83 +3308,561 @@ inline void ConvertToUnicodeSpans(sentencepiece::ImmutableNBestSentencePieceText
   proto->ConvertToUnicodeSpans();
 }
 
-class ThreadPool {
+inline sentencepiece::EncodeOptions MakeEncodeOptions(bool add_bos, bool add_eos,
+                                                     bool reverse, bool emit_unk_piece) {
+  sentencepiece::EncodeOptions options;
+  options.add_bos = add_bos;
+  options.add_eos = add_eos;
+  options.reverse = reverse;
+  options.emit_unk_piece = emit_unk_piece;
+  return options;
+}
+
+// Encodes `text` into `out` with `options`. The ids and pieces are written
+// once in their final order by the C++ encoder, and the spans of the protos
+// are counted in Unicode characters by it as well. The protos reject the
+// other options. An error gives an empty result as in EncodeAsIds().
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              std::vector<int> *out,
+                              sentencepiece::EncodeContext *context) {
+  if (!sp.Encode(text, options, out, context).ok()) out->clear();
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              std::vector<std::string> *out,
+                              sentencepiece::EncodeContext *context) {
+  if (!sp.Encode(text, options, out, context).ok()) out->clear();
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              sentencepiece::util::bytes *out,
+                              sentencepiece::EncodeContext *context) {
+  *out = sp.EncodeAsSerializedProto(text);
+  RewriteIds(sp, out, options.add_bos, options.add_eos, options.reverse,
+             options.emit_unk_piece);
+}
+
+inline void EncodeWithOptions(const sentencepiece::SentencePieceProcessor &sp,
+                              absl::string_view text,
+                              const sentencepiece::EncodeOptions &options,
+                              sentencepiece::ImmutableSentencePieceText *out,
+                              sentencepiece::EncodeContext *context) {
+  RewriteIds(sp, out, options.add_bos, options.add_eos, options.reverse,
+             options.emit_unk_piece);
+  // The encoder counts the spans in Unicode characters.
+  sentencepiece::EncodeOptions spans;
+  spans.unicode_spans = true;
+  if (!sp.Encode(text, spans, out->mutable_proto(), context).ok()) {
+    *out = sentencepiece::ImmutableSentencePieceText();
+  }
+}
+
+template <typename T>
+inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
+  if (*num_threads < 0) {
+    *num_threads = sentencepiece::GetDefaultNumThreads();
+  }
+  *num_threads = std::max<int>(1,
+                               std::min<int>({*num_threads,
+                                     static_cast<int>(ins.size()), 256}));
+}
+
+// Contiguous buffer of an object supporting the buffer protocol, e.g.,
+// bytes, bytearray, memoryview, array.array or a numpy array. The object
+// cannot be resized while the view is alive.
+class PyBufferView {
  public:
-  explicit ThreadPool(size_t request_size) :
-    request_size_(request_size) {}
+  explicit PyBufferView(PyObject *obj) {
+    ok_ = PyObject_GetBuffer(obj, &view_, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0;
+  }
+  ~PyBufferView() {
+    if (ok_) PyBuffer_Release(&view_);
+  }
+
+  bool ok() const { return ok_; }
+  const char *data() const { return static_cast<const char *>(view_.buf); }
+  size_t size() const { return view_.len; }
+  size_t itemsize() const { return view_.itemsize; }
+  char format() const {
+    // Skips the byte order, e.g., '<q'.
+    const char *format = view_.format == nullptr ? "B" : view_.format;
+    if (*format == '@' || *format == '=' || *format == '<' ||
+        *format == '>' || *format == '!') ++format;
+    return *format;
+  }
+
+ private:
+  Py_buffer view_;
+  bool ok_ = false;
+};
 
-  virtual ~ThreadPool() {
-    for (auto &task : tasks_) {
-      task.join();
+template <typename T>
+inline void SplitBufferAt(const PyBufferView &data,
+                          const PyBufferView &offsets,
+                          std::vector<absl::string_view> *ins) {
+  const T *begin = reinterpret_cast<const T *>(offsets.data());
+  const size_t size = offsets.size() / sizeof(T);
+  ins->resize(size > 0 ? size - 1 : 0);
+  for (size_t i = 0; i < ins->size(); ++i) {
+    // A negative offset is larger than the data once converted.
+    const uint64_t start = static_cast<uint64_t>(begin[i]);
+    const uint64_t end = static_cast<uint64_t>(begin[i + 1]);
+    if (start > end || end > data.size()) {
+      throw sentencepiece::util::Status(
+          sentencepiece::util::StatusCode::kOutOfRange,
+          "offsets are out of range of the data.");
     }
+    (*ins)[i] = absl::string_view(data.data() + start, end - start);
   }
+}
 
-  void Schedule(std::function<void()> closure) {
-    static constexpr size_t kMinThreadSize = 2;
-    if (request_size_ < kMinThreadSize) {
-      closure();
-    } else {
-      tasks_.emplace_back(closure);
+// Splits `data` into the sentences data[offsets[i], offsets[i + 1]).
+// `offsets` holds 32-bit or 64-bit integers, e.g., the offsets of an Arrow
+// string array.
+inline std::vector<absl::string_view> SplitBuffer(
+    const PyBufferView &data, const PyBufferView &offsets) {
+  std::vector<absl::string_view> ins;
+  const char format = offsets.format();
+  const bool is_signed = format == 'i' || format == 'l' || format == 'q' ||
+                         format == 'n';
+  const bool is_unsigned = format == 'I' || format == 'L' || format == 'Q' ||
+                           format == 'N';
+  if (!is_signed && !is_unsigned) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "offsets must be an array of integers.");
+  }
+  if (offsets.itemsize() == 4) {
+    is_signed ? SplitBufferAt<int32_t>(data, offsets, &ins)
+              : SplitBufferAt<uint32_t>(data, offsets, &ins);
+  } else if (offsets.itemsize() == 8) {
+    is_signed ? SplitBufferAt<int64_t>(data, offsets, &ins)
+              : SplitBufferAt<uint64_t>(data, offsets, &ins);
+  } else {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "offsets must be 32-bit or 64-bit integers.");
+  }
+  return ins;
+}
+
+// Iterates over the sentences of a Python iterator. Each item of the
+// iterator is a sentence (str or bytes), a list or tuple of sentences, or a
+// (data, offsets) pair of buffers holding the sentences
+// data[offsets[i], offsets[i + 1]), so that a generator can yield a batch of
+// sentences per call instead of one.
+class PySentenceIterator : public sentencepiece::SentenceIterator {
+  public:
+  PySentenceIterator(PyObject *iter) : iter_(iter) {
+    Fetch();
+  }
+
+  ~PySentenceIterator() {
+   // Py_XDECREF(iter_);
+  }
+
+  bool done() const override {
+    return index_ >= size_;
+  }
+
+  void Next() override {
+    if (++index_ >= size_) Fetch();
+  }
+
+  const std::string &value() const override {
+    return batch_[index_];
+  }
+
+  sentencepiece::util::Status status() const override {
+    return status_;
+  }
+
+  private:
+   // Replaces the batch with the sentences of the next non-empty item. The
+   // batch is empty at the end and after an error.
+   void Fetch() {
+     index_ = 0;
+     size_ = 0;
+     while (size_ == 0 && status_.ok()) {
+       PyObject *item = PyIter_Next(iter_);
+       if (item == nullptr) return;
+       AddItem(item);
+       Py_DECREF(item);
+     }
+     if (!status_.ok()) size_ = 0;
+   }
+
+   void AddItem(PyObject *item) {
+     const PyInputString ustring(item);
+     if (ustring.IsAvalable()) {
+       Add(ustring.data(), ustring.size());
+       return;
+     }
+     if (PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 2 &&
+         !PyInputString(PyTuple_GET_ITEM(item, 1)).IsAvalable()) {
+       const PyBufferView data(PyTuple_GET_ITEM(item, 0));
+       const PyBufferView offsets(PyTuple_GET_ITEM(item, 1));
+       if (!data.ok() || !offsets.ok()) {
+         PyErr_Clear();
+         SetError("data and offsets must support the buffer protocol.");
+         return;
+       }
+       try {
+         for (const auto &sentence : SplitBuffer(data, offsets)) {
+           Add(sentence.data(), sentence.size());
+         }
+       } catch (const sentencepiece::util::Status &status) {
+         status_ = status;
+       }
+       return;
+     }
+     if (PyList_Check(item) || PyTuple_Check(item)) {
+       const Py_ssize_t size = PySequence_Fast_GET_SIZE(item);
+       PyObject **items = PySequence_Fast_ITEMS(item);
+       for (Py_ssize_t i = 0; i < size; ++i) {
+         const PyInputString sentence(items[i]);
+         if (!sentence.IsAvalable()) {
+           SetError("Not a string.");
+           return;
+         }
+         Add(sentence.data(), sentence.size());
+       }
+       return;
+     }
+     SetError("Not a string.");
+   }
+
+   // Appends a sentence without its trailing line breaks.
+   void Add(const char *data, size_t size) {
+     while (size > 0) {
+       if (data[size - 1] == '\r' || data[size - 1] == '\n')
+         --size;
+       else
+         break;
+     }
+     if (size_ == batch_.size()) batch_.emplace_back();
+     batch_[size_++].assign(data, size);
+   }
+
+   void SetError(const char *message) {
+     status_ = sentencepiece::util::Status(
+         sentencepiece::util::StatusCode::kInternal, message);
+   }
+
+   PyObject *iter_ = nullptr;
+   // The sentences of the current item, reused across the items.
+   std::vector<std::string> batch_;
+   size_t size_ = 0;
+   size_t index_ = 0;
+   sentencepiece::util::Status status_;
+};
+
+// Ids of a batch in one buffer. The ids of the i-th input are
+// ids[offsets[i], offsets[i + 1]).
+struct FlatIds {
+  std::vector<int32_t> ids;
+  std::vector<int64_t> offsets;
+};
+
+inline FlatIds FlattenIds(const std::vector<std::vector<int>> &idss) {
+  FlatIds flat;
+  flat.offsets.resize(idss.size() + 1, 0);
+  for (size_t i = 0; i < idss.size(); ++i) {
+    flat.offsets[i + 1] = flat.offsets[i] + idss[i].size();
+  }
+  flat.ids.reserve(flat.offsets.back());
+  for (const auto &ids : idss) {
+    flat.ids.insert(flat.ids.end(), ids.begin(), ids.end());
+  }
+  return flat;
+}
+
+// The int32 ids in the bytes of a buffer narrowed to uint16.
+struct NarrowIds {
+  std::vector<uint16_t> ids;
+};
+
+inline NarrowIds NarrowIdBuffer(const PyBufferView &ids, int piece_size) {
+  if (ids.size() % sizeof(int32_t) != 0) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kInvalidArgument,
+        "ids must be 32-bit integers.");
+  }
+  if (piece_size > 0x10000) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "The ids of the vocabulary do not fit in uint16.");
+  }
+  NarrowIds narrow;
+  narrow.ids.resize(ids.size() / sizeof(int32_t));
+  const char *data = ids.data();
+  for (size_t i = 0; i < narrow.ids.size(); ++i) {
+    int32_t id = 0;
+    std::memcpy(&id, data + i * sizeof(id), sizeof(id));
+    narrow.ids[i] = static_cast<uint16_t>(id);
+  }
+  return narrow;
+}
+
+// Buffers of an Arrow list<int32> array: the int32 values and the int32
+// or int64 offsets.
+struct ArrowIds {
+  std::vector<int32_t> values;
+  std::string offsets;
+};
+
+// Encodes the strings of the Arrow string array given by its buffers. The
+// first `offset` strings of the buffers are skipped. `validity` is empty
+// when there are no nulls.
+template <typename Offset>
+inline ArrowIds EncodeArrowBuffers(
+    const sentencepiece::SentencePieceProcessor &sp,
+    const PyBufferView &validity, int offset, const PyBufferView &offsets,
+    const PyBufferView &data, bool add_bos, bool add_eos, bool reverse) {
+  const size_t num_offsets = offsets.size() / sizeof(Offset);
+  if (offset < 0 || num_offsets < static_cast<size_t>(offset) + 1) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "offset is out of range of the offsets.");
+  }
+  sentencepiece::ArrowStringArray<Offset> input;
+  input.length = num_offsets - offset - 1;
+  input.offset = offset;
+  input.offsets = reinterpret_cast<const Offset *>(offsets.data());
+  input.data = data.data();
+  if (validity.size() > 0) {
+    if (validity.size() * 8 < num_offsets - 1) {
+      throw sentencepiece::util::Status(
+          sentencepiece::util::StatusCode::kOutOfRange,
+          "validity is shorter than the offsets.");
+    }
+    input.validity = reinterpret_cast<const uint8_t *>(validity.data());
+  }
+  // EncodeArrow() checks that the offsets are increasing from zero or more.
+  if (static_cast<uint64_t>(input.offsets[num_offsets - 1]) > data.size()) {
+    throw sentencepiece::util::Status(
+        sentencepiece::util::StatusCode::kOutOfRange,
+        "offsets are out of range of the data.");
+  }
+
+  sentencepiece::ArrowListArray<Offset> output;
+  const auto status = sp.EncodeArrow(input, &output);
+  if (!status.ok()) throw status;
+
+  ArrowIds result;
+  if (add_bos || add_eos || reverse) {
+    std::vector<int> ids;
+    std::vector<Offset> rewritten = {0};
+    for (size_t i = 0; i + 1 < output.offsets.size(); ++i) {
+      const size_t bit = offset + i;
+      if (input.validity == nullptr ||
+          (input.validity[bit / 8] >> (bit % 8)) & 1) {
+        ids.assign(output.values.begin() + output.offsets[i],
+                   output.values.begin() + output.offsets[i + 1]);
+        RewriteIds(sp, &ids, add_bos, add_eos, reverse, false);
+        result.values.insert(result.values.end(), ids.begin(), ids.end());
+      }
+      rewritten.push_back(result.values.size());
     }
+    output.offsets.swap(rewritten);
+  } else {
+    result.values.swap(output.values);
   }
+  result.offsets.assign(reinterpret_cast<const char *>(output.offsets.data()),
+                        output.offsets.size() * sizeof(Offset));
+  return result;
+}
 
- private:
-  size_t request_size_ = 0;
-  std::vector<std::thread> tasks_;
+// Ids of a batch in a [rows, width] matrix. The ids of the i-th input are
+// in the row ids[i * width, (i + 1) * width), whose other elements are the
+// padding. mask is 1 at the ids and 0 at the padding.
+struct PaddedIds {
+  std::vector<int32_t> ids;
+  std::vector<int32_t> mask;
+  size_t rows = 0;
+  size_t width = 0;
+};
+
+// Truncates the ids to `max_length` including <s> and </s>, unless
+// `max_length` is 0, and pads them with `pad_id` to the longest ids, or to
+// `max_length` when `pad_to_max_length` is true. The width is rounded up to
+// a multiple of `pad_to_multiple_of` when it is larger than 1. The rows are
+// written by the worker threads.
+inline PaddedIds PadIds(const sentencepiece::SentencePieceProcessor &sp,
+                        const std::vector<std::vector<int>> &idss,
+                        bool add_bos, bool add_eos, int max_length,
+                        bool pad_to_max_length, int pad_to_multiple_of,
+                        bool pad_left, bool truncate_left, int pad_id,
+                        int num_threads) {
+  const size_t num_specials = (add_bos ? 1 : 0) + (add_eos ? 1 : 0);
+  size_t max_size = std::numeric_limits<size_t>::max();
+  if (max_length > 0) {
+    max_size = std::max<size_t>(max_length, num_specials) - num_specials;
+  }
+  PaddedIds padded;
+  padded.rows = idss.size();
+  for (const auto &ids : idss) {
+    padded.width =
+        std::max(padded.width, std::min(ids.size(), max_size) + num_specials);
+  }
+  if (pad_to_max_length && max_length > 0) {
+    padded.width = std::max<size_t>(padded.width, max_length);
+  }
+  if (pad_to_multiple_of > 1) {
+    padded.width = (padded.width + pad_to_multiple_of - 1) /
+                   pad_to_multiple_of * pad_to_multiple_of;
+  }
+
+  padded.ids.resize(padded.rows * padded.width);
+  padded.mask.resize(padded.rows * padded.width);
+  sentencepiece::RunOnSharedThreadPool(
+      padded.rows, num_threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          const auto &ids = idss[i];
+          const size_t size = std::min(ids.size(), max_size);
+          const size_t length = size + num_specials;
+          int32_t *row = padded.ids.data() + i * padded.width;
+          int32_t *mask = padded.mask.data() + i * padded.width;
+          std::fill(row, row + padded.width, pad_id);
+          std::fill(mask, mask + padded.width, 0);
+          int32_t *out = row + (pad_left ? padded.width - length : 0);
+          std::fill(mask + (out - row), mask + (out - row) + length, 1);
+          if (add_bos) *out++ = sp.bos_id();
+          const auto first =
+              ids.begin() + (truncate_left ? ids.size() - size : 0);
+          out = std::copy(first, first + size, out);
+          if (add_eos) *out++ = sp.eos_id();
+        }
+      });
+  return padded;
+}
+
+// Ids of EncodeCorpus() and its statistics.
+struct CorpusIds {
+  std::vector<std::vector<int>> ids;
+  sentencepiece::CorpusEncodeStats stats;
 };
 
+// Entropies of CalculateEntropyBatch() and the expected piece counts.
+struct EntropyResults {
+  std::vector<float> entropies;
+  std::vector<std::vector<std::pair<int, float>>> expected_counts;
+};
+
+inline PyObject *MakePyNumber(size_t value) { return PyLong_FromSize_t(value); }
+inline PyObject *MakePyNumber(double value) { return PyFloat_FromDouble(value); }
+
 template <typename T>
-inline void InitNumThreads(const std::vector<T> &ins, int *num_threads) {
-  if (*num_threads < 0) {
-    *num_threads = std::thread::hardware_concurrency();
-  }
-  *num_threads = std::max<int>(1,
-                               std::min<int>({*num_threads,
-                                     static_cast<int>(ins.size()), 256}));
+inline PyObject *MakePyList(const std::vector<T> &values) {
+  PyObject *list = PyList_New(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    PyList_SET_ITEM(list, i, MakePyNumber(values[i]));
+  }
+  return list;
+}
+
+PyObject* MakePyOutputBuffer(const void *data, size_t size) {
+  return PyBytes_FromStringAndSize(static_cast<const char *>(data), size);
+}
+
+// Returns the bytes of `values` as int64, e.g. of size_t offsets.
+PyObject *MakePyInt64Buffer(const std::vector<size_t> &values) {
+  const std::vector<int64_t> buffer(values.begin(), values.end());
+  return MakePyOutputBuffer(buffer.data(), buffer.size() * sizeof(int64_t));
+}
+
+// Returns the bytes of the text, the int64 text offsets, the alignment runs
+// as int64 (norm, orig, identity) triples and the int64 run offsets of
+// `batch`.
+PyObject *MakePyNormalizedBatch(const sentencepiece::NormalizedBatch &batch) {
+  std::vector<int64_t> runs;
+  runs.reserve(3 * batch.runs.size());
+  for (const auto &run : batch.runs) {
+    runs.push_back(run.norm);
+    runs.push_back(run.orig);
+    runs.push_back(run.identity);
+  }
+  PyObject *result = PyTuple_New(4);
+  PyTuple_SET_ITEM(result, 0,
+                   MakePyOutputBuffer(batch.text.data(), batch.text.size()));
+  PyTuple_SET_ITEM(result, 1, MakePyInt64Buffer(batch.text_offsets));
+  PyTuple_SET_ITEM(result, 2,
+                   MakePyOutputBuffer(runs.data(),
+                                      runs.size() * sizeof(int64_t)));
+  PyTuple_SET_ITEM(result, 3, MakePyInt64Buffer(batch.run_offsets));
+  return result;
 }
 
 #define DEFINE_ENCODE_BATCH_FUNC_IMPL(FuncName, InType, OutType)        \
   std::vector<OutType> outs(ins.size());                                \
   InitNumThreads(ins, &num_threads);                                    \
-  {                                                                     \
-    ThreadPool pool(ins.size());                                        \
-    std::atomic<size_t> index = 0;                                      \
-    for (int n = 0;  n < num_threads; ++n) {                            \
-      pool.Schedule([&]() {                                             \
-          size_t i = 0;                                                 \
-          while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) { \
-            auto out = enable_sampling ?                                \
-                       self->Sample##FuncName(ins[i],                   \
-                                              nbest_size, alpha) :      \
-                       self->FuncName(ins[i]);                          \
-            RewriteIds(*self, &out, add_bos, add_eos, reverse,          \
+  const auto options = MakeEncodeOptions(add_bos, add_eos, reverse,     \
+                                         emit_unk_piece);               \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        sentencepiece::EncodeContext context;                           \
+        for (size_t i = begin; i < end; ++i) {                          \
+          if (enable_sampling) {                                        \
+            outs[i] = self->Sample##FuncName(ins[i], nbest_size, alpha); \
+            RewriteIds(*self, &outs[i], add_bos, add_eos, reverse,      \
+                       emit_unk_piece);                                 \
+            ConvertToUnicodeSpans(&outs[i]);                            \
+          } else {                                                      \
+            EncodeWithOptions(*self, ins[i], options, &outs[i],         \
+                              &context);                                \
+          }                                                             \
+        }                                                               \
+      });                                                               \
+  return outs;
+
+// The samples of ins[i] are outs[i * num_samples, (i + 1) * num_samples).
+#define DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(OutType)              \
+  if (num_samples < 0) {                                                \
+    throw sentencepiece::util::Status(                                  \
+        sentencepiece::util::StatusCode::kInvalidArgument,              \
+        "num_samples must be >= 0");                                    \
+  }                                                                     \
+  std::vector<OutType> outs(ins.size() * num_samples);                  \
+  std::vector<sentencepiece::util::Status> statuses(ins.size());        \
+  InitNumThreads(ins, &num_threads);                                    \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        for (size_t i = begin; i < end; ++i) {                          \
+          std::vector<OutType> samples;                                 \
+          statuses[i] = self->SampleEncodeMany(ins[i], num_samples,     \
+                                               alpha, &samples);        \
+          for (size_t j = 0; j < samples.size(); ++j) {                 \
+            RewriteIds(*self, &samples[j], add_bos, add_eos, reverse,   \
                        emit_unk_piece);                                 \
-            ConvertToUnicodeSpans(&out);                                \
-            outs[i] = std::move(out);                                   \
+            outs[i * num_samples + j] = std::move(samples[j]);          \
           }                                                             \
-        });                                                             \
-    }                                                                   \
+        }                                                               \
+      });                                                               \
+  /* The workers cannot throw. */                                       \
+  for (const auto &status : statuses) {                                 \
+    if (!status.ok()) throw status;                                     \
   }                                                                     \
   return outs;
 
 #define DEFINE_DECODE_BATCH_FUNC_IMPL(FuncName, InType, OutType)        \
+  /* The ids are checked here, as the workers cannot throw. */          \
+  for (const auto &in : ins) CheckIds(in, self->GetPieceSize());        \
   std::vector<OutType> outs(ins.size());                                \
   InitNumThreads(ins, &num_threads);                                    \
-  {                                                                     \
-    std::atomic<size_t> index = 0;                                      \
-    ThreadPool pool(ins.size());                                        \
-    for (int n = 0;  n < num_threads; ++n) {                            \
-      pool.Schedule([&]() {                                             \
-          size_t i = 0;                                                 \
-          while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) { \
-            CheckIds(ins[i], self->GetPieceSize());                     \
-            auto out = self->FuncName(ins[i]);                          \
-            ConvertToUnicodeSpans(&out);                                \
-            outs[i] = std::move(out);                                   \
-          }                                                             \
-        });                                                             \
-    }                                                                   \
-  }                                                                     \
+  sentencepiece::RunOnSharedThreadPool(                                 \
+      ins.size(), num_threads, [&](size_t begin, size_t end) {          \
+        for (size_t i = begin; i < end; ++i) {                          \
+          auto out = self->FuncName(ins[i]);                            \
+          ConvertToUnicodeSpans(&out);                                  \
+          outs[i] = std::move(out);                                     \
+        }                                                               \
+      });                                                               \
   return outs;
 
 }  // namespace
@@ -3863,17 +4299,29 @@ SWIG_AsVal_bool (PyObject *obj, bool *val)
 }
 
 SWIGINTERN std::vector< int > sentencepiece_SentencePieceProcessor__EncodeAsIds(sentencepiece::SentencePieceProcessor const *self,absl::string_view text,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
-    auto ids = enable_sampling ?
-               self->SampleEncodeAsIds(text, nbest_size, alpha) :
-               self->EncodeAsIds(text);
-    RewriteIds(*self, &ids, add_bos, add_eos, reverse, emit_unk_piece);
+    std::vector<int> ids;
+    if (enable_sampling) {
+      ids = self->SampleEncodeAsIds(text, nbest_size, alpha);
+      RewriteIds(*self, &ids, add_bos, add_eos, reverse, emit_unk_piece);
+    } else {
+      sentencepiece::EncodeContext context;
+      EncodeWithOptions(*self, text,
+                        MakeEncodeOptions(add_bos, add_eos, reverse, emit_unk_piece),
+                        &ids, &context);
+    }
     return ids;
   }
 SWIGINTERN std::vector< std::string > sentencepiece_SentencePieceProcessor__EncodeAsPieces(sentencepiece::SentencePieceProcessor const *self,absl::string_view text,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
-    auto pieces = enable_sampling ?
-                  self->SampleEncodeAsPieces(text, nbest_size, alpha) :
-                  self->EncodeAsPieces(text);
-    RewriteIds(*self, &pieces, add_bos, add_eos, reverse, emit_unk_piece);
+    std::vector<std::string> pieces;
+    if (enable_sampling) {
+      pieces = self->SampleEncodeAsPieces(text, nbest_size, alpha);
+      RewriteIds(*self, &pieces, add_bos, add_eos, reverse, emit_unk_piece);
+    } else {
+      sentencepiece::EncodeContext context;
+      EncodeWithOptions(*self, text,
+                        MakeEncodeOptions(add_bos, add_eos, reverse, emit_unk_piece),
+                        &pieces, &context);
+    }
     return pieces;
   }
 SWIGINTERN sentencepiece::util::bytes sentencepiece_SentencePieceProcessor__EncodeAsSerializedProto(sentencepiece::SentencePieceProcessor const *self,absl::string_view text,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
@@ -3884,10 +4332,19 @@ SWIGINTERN sentencepiece::util::bytes sentencepiece_SentencePieceProcessor__Enco
     return proto;
   }
 SWIGINTERN sentencepiece::ImmutableSentencePieceText sentencepiece_SentencePieceProcessor__EncodeAsImmutableProto(sentencepiece::SentencePieceProcessor const *self,absl::string_view text,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
-    auto proto = enable_sampling ?
-                 self->SampleEncodeAsImmutableProto(text, nbest_size, alpha) :
-                 self->EncodeAsImmutableProto(text);
-    proto.ConvertToUnicodeSpans();
+    sentencepiece::ImmutableSentencePieceText proto;
+    if (enable_sampling) {
+      proto = self->SampleEncodeAsImmutableProto(text, nbest_size, alpha);
+      proto.ConvertToUnicodeSpans();
+    } else {
+      // The encoder counts the spans in Unicode characters.
+      sentencepiece::EncodeOptions options;
+      options.unicode_spans = true;
+      sentencepiece::EncodeContext context;
+      const auto status =
+          self->Encode(text, options, proto.mutable_proto(), &context);
+      if (!status.ok()) throw status;
+    }
     RewriteIds(*self, &proto, add_bos, add_eos, reverse, emit_unk_piece);
     return proto;
   }
@@ -3895,6 +4352,41 @@ SWIGINTERN std::vector< std::vector< int > > sentencepiece_SentencePieceProcesso
     DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
                                   absl::string_view, std::vector<int>);
   }
+SWIGINTERN FlatIds sentencepiece_SentencePieceProcessor__EncodeAsIdsFlatBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    const auto idss = [&]() {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }();
+    return FlattenIds(idss);
+  }
+SWIGINTERN NarrowIds sentencepiece_SentencePieceProcessor__NarrowIds(sentencepiece::SentencePieceProcessor const *self,PyBufferView const &ids){
+    return NarrowIdBuffer(ids, self->GetPieceSize());
+  }
+SWIGINTERN CorpusIds sentencepiece_SentencePieceProcessor__EncodeCorpus(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,bool add_bos,bool add_eos,bool reverse){
+    CorpusIds corpus;
+    const auto status = self->EncodeCorpus(ins, &corpus.ids, &corpus.stats);
+    if (!status.ok()) throw status;
+    if (add_bos || add_eos || reverse) {
+      sentencepiece::RunOnSharedThreadPool(
+          corpus.ids.size(), -1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+              RewriteIds(*self, &corpus.ids[i], add_bos, add_eos, reverse,
+                         false);
+            }
+          });
+    }
+    return corpus;
+  }
+SWIGINTERN PaddedIds sentencepiece_SentencePieceProcessor__EncodeAsIdsPaddedBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece,int max_length,bool pad_to_max_length,int pad_to_multiple_of,bool pad_left,bool truncate_left,int pad_id){
+    // <s> and </s> are added by PadIds() after the truncation.
+    const auto idss = [&](bool add_bos, bool add_eos) {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }(false, false);
+    return PadIds(*self, idss, add_bos, add_eos, max_length,
+                  pad_to_max_length, pad_to_multiple_of, pad_left,
+                  truncate_left, pad_id, num_threads);
+  }
 SWIGINTERN std::vector< std::vector< std::string > > sentencepiece_SentencePieceProcessor__EncodeAsPiecesBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
     DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsPieces,
                                   absl::string_view, std::vector<std::string>);
@@ -3909,6 +4401,31 @@ SWIGINTERN std::vector< sentencepiece::ImmutableSentencePieceText > sentencepiec
                                   absl::string_view,
                                   sentencepiece::ImmutableSentencePieceText);
   }
+SWIGINTERN std::vector< std::vector< int > > sentencepiece_SentencePieceProcessor__EncodeAsIdsFromBuffer(sentencepiece::SentencePieceProcessor const *self,PyBufferView const &data,PyBufferView const &offsets,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    const auto ins = SplitBuffer(data, offsets);
+    DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                  absl::string_view, std::vector<int>);
+  }
+SWIGINTERN FlatIds sentencepiece_SentencePieceProcessor__EncodeAsIdsFlatFromBuffer(sentencepiece::SentencePieceProcessor const *self,PyBufferView const &data,PyBufferView const &offsets,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    const auto ins = SplitBuffer(data, offsets);
+    const auto idss = [&]() {
+      DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsIds,
+                                    absl::string_view, std::vector<int>);
+    }();
+    return FlattenIds(idss);
+  }
+SWIGINTERN std::vector< std::vector< std::string > > sentencepiece_SentencePieceProcessor__EncodeAsPiecesFromBuffer(sentencepiece::SentencePieceProcessor const *self,PyBufferView const &data,PyBufferView const &offsets,int num_threads,bool enable_sampling,int nbest_size,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    const auto ins = SplitBuffer(data, offsets);
+    DEFINE_ENCODE_BATCH_FUNC_IMPL(EncodeAsPieces,
+                                  absl::string_view, std::vector<std::string>);
+  }
+SWIGINTERN ArrowIds sentencepiece_SentencePieceProcessor__EncodeArrow(sentencepiece::SentencePieceProcessor const *self,PyBufferView const &validity,int offset,PyBufferView const &offsets,PyBufferView const &data,bool large_offsets,bool add_bos,bool add_eos,bool reverse){
+    return large_offsets
+        ? EncodeArrowBuffers<int64_t>(*self, validity, offset, offsets, data,
+                                      add_bos, add_eos, reverse)
+        : EncodeArrowBuffers<int32_t>(*self, validity, offset, offsets, data,
+                                      add_bos, add_eos, reverse);
+  }
 SWIGINTERN std::string sentencepiece_SentencePieceProcessor__DecodeIds(sentencepiece::SentencePieceProcessor const *self,std::vector< int > const &ids){
     CheckIds(ids, self->GetPieceSize());
     return self->DecodeIds(ids);
@@ -4021,6 +4538,12 @@ SWIGINTERN sentencepiece::ImmutableNBestSentencePieceText sentencepiece_Sentence
     proto.ConvertToUnicodeSpans();
     return proto;
   }
+SWIGINTERN std::vector< std::vector< int > > sentencepiece_SentencePieceProcessor__SampleEncodeManyAsIdsBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,int num_threads,int num_samples,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(std::vector<int>);
+  }
+SWIGINTERN std::vector< std::vector< std::string > > sentencepiece_SentencePieceProcessor__SampleEncodeManyAsPiecesBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,int num_threads,int num_samples,float alpha,bool add_bos,bool add_eos,bool reverse,bool emit_unk_piece){
+    DEFINE_SAMPLE_ENCODE_MANY_BATCH_FUNC_IMPL(std::vector<std::string>);
+  }
 SWIGINTERN std::string sentencepiece_SentencePieceProcessor__Normalize(sentencepiece::SentencePieceProcessor *self,absl::string_view text){
     return self->Normalize(text);
   }
@@ -4029,26 +4552,33 @@ SWIGINTERN std::pair< std::string,std::vector< size_t > > sentencepiece_Sentence
     self->Normalize(text, &result.first, &result.second).IgnoreError();
     return result;
   }
+SWIGINTERN sentencepiece::NormalizedBatch sentencepiece_SentencePieceProcessor__NormalizeBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,bool with_offsets){
+    sentencepiece::NormalizedBatch batch;
+    const auto status = self->NormalizeBatch(ins, with_offsets, &batch);
+    if (!status.ok()) throw status;
+    return batch;
+  }
 SWIGINTERN float sentencepiece_SentencePieceProcessor__CalculateEntropy(sentencepiece::SentencePieceProcessor *self,absl::string_view text,float alpha){
     return self->CalculateEntropy(text, alpha);
   }
 SWIGINTERN std::vector< float > sentencepiece_SentencePieceProcessor__CalculateEntropyBatch(sentencepiece::SentencePieceProcessor *self,std::vector< absl::string_view > const &ins,float alpha,int num_threads){
     std::vector<float> outs(ins.size());
     InitNumThreads(ins, &num_threads);
-    {
-      ThreadPool pool(ins.size());
-      std::atomic<size_t> index = 0;
-      for (int n = 0;  n < num_threads; ++n) {
-        pool.Schedule([&]() {
-           size_t i = 0;
-           while ((i = std::atomic_fetch_add(&index, 1)) < outs.size()) {
-             outs[i] = self->CalculateEntropy(ins[i], alpha);
-           }
-         });
-      }
-    }
+    sentencepiece::RunOnSharedThreadPool(
+        ins.size(), num_threads, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            outs[i] = self->CalculateEntropy(ins[i], alpha);
+          }
+        });
     return outs;
   }
+SWIGINTERN EntropyResults sentencepiece_SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &ins,float alpha){
+    EntropyResults results;
+    const auto status = self->CalculateEntropyBatch(
+        ins, alpha, &results.entropies, &results.expected_counts);
+    if (!status.ok()) throw status;
+    return results;
+  }
 SWIGINTERN sentencepiece::util::Status sentencepiece_SentencePieceProcessor__OverrideNormalizerSpec(sentencepiece::SentencePieceProcessor *self,std::unordered_map< std::string,std::string > const &args){
     sentencepiece::util::Status status;
     for (const auto &[key, value] : args) {
@@ -5079,6 +5609,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor_SetVocabulary(PyObject *self,
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
@@ -5093,10 +5624,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor_SetVocabulary(PyObject *self,
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -5127,11 +5659,13 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor_SetVocabulary(PyObject *self,
     resultobj = SWIG_From_bool((&result)->ok());
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
@@ -5854,6 +6388,40 @@ fail:
 }
 
 
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor_model_file(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[1] ;
+  std::string *result = 0 ;
+  
+  if (!args) SWIG_fail;
+  swig_obj[0] = args;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_model_file" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    try {
+      result = (std::string *) &((sentencepiece::SentencePieceProcessor const *)arg1)->model_file();
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    PyObject *input_type = resultobj;
+    resultobj = MakePyOutputString(*result, input_type);
+  }
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
 SWIGINTERN PyObject *_wrap_SentencePieceProcessor_LoadFromFile(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
@@ -5981,7 +6549,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIds(PyObject *self, P
   arg9 = static_cast< bool >(val9);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6082,7 +6653,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPieces(PyObject *self
   arg9 = static_cast< bool >(val9);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6184,7 +6758,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProto(PyObj
   arg9 = static_cast< bool >(val9);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6282,7 +6859,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProto(PyObje
   arg9 = static_cast< bool >(val9);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6300,6 +6880,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsBatch(PyObject *se
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   bool arg4 ;
   int arg5 ;
@@ -6338,10 +6919,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsBatch(PyObject *se
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -6398,7 +6980,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsBatch(PyObject *se
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6416,21 +7001,24 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsBatch(PyObject *se
     }
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesBatch(PyObject *self, PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsFlatBatch(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   bool arg4 ;
   int arg5 ;
@@ -6458,21 +7046,22 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesBatch(PyObject
   bool val10 ;
   int ecode10 = 0 ;
   PyObject *swig_obj[10] ;
-  std::vector< std::vector< std::string > > result;
+  FlatIds result;
   
-  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsPiecesBatch", 10, 10, swig_obj)) SWIG_fail;
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsFlatBatch", 10, 10, swig_obj)) SWIG_fail;
   res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
   if (!SWIG_IsOK(res1)) {
-    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
   }
   arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -6489,47 +7078,50 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesBatch(PyObject
   }
   ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
   if (!SWIG_IsOK(ecode3)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "3"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "3"" of type '" "int""'");
   } 
   arg3 = static_cast< int >(val3);
   ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
   if (!SWIG_IsOK(ecode4)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "4"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "4"" of type '" "bool""'");
   } 
   arg4 = static_cast< bool >(val4);
   ecode5 = SWIG_AsVal_int(swig_obj[4], &val5);
   if (!SWIG_IsOK(ecode5)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "5"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "5"" of type '" "int""'");
   } 
   arg5 = static_cast< int >(val5);
   ecode6 = SWIG_AsVal_float(swig_obj[5], &val6);
   if (!SWIG_IsOK(ecode6)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "6"" of type '" "float""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "6"" of type '" "float""'");
   } 
   arg6 = static_cast< float >(val6);
   ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
   if (!SWIG_IsOK(ecode7)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "7"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "7"" of type '" "bool""'");
   } 
   arg7 = static_cast< bool >(val7);
   ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
   if (!SWIG_IsOK(ecode8)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "8"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "8"" of type '" "bool""'");
   } 
   arg8 = static_cast< bool >(val8);
   ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
   if (!SWIG_IsOK(ecode9)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "9"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "9"" of type '" "bool""'");
   } 
   arg9 = static_cast< bool >(val9);
   ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
   if (!SWIG_IsOK(ecode10)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "10"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatBatch" "', argument " "10"" of type '" "bool""'");
   } 
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsPiecesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIdsFlatBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6537,33 +7129,190 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesBatch(PyObject
     }
   }
   {
-    PyObject *input_type = resultobj;
-    resultobj = PyList_New((&result)->size());
-    for (size_t i = 0; i < (&result)->size(); ++i) {
-      PyObject *obj = PyList_New(result[i].size());
-      for (size_t j = 0; j < result[i].size(); ++j) {
-        PyList_SET_ITEM(obj, j, MakePyOutputString(result[i][j], input_type));
-      }
-      PyList_SET_ITEM(resultobj, i, obj);
-    }
+    resultobj = PyTuple_New(2);
+    PyTuple_SET_ITEM(resultobj, 0,
+      MakePyOutputBuffer((&result)->ids.data(),
+        (&result)->ids.size() * sizeof(int32_t)));
+    PyTuple_SET_ITEM(resultobj, 1,
+      MakePyOutputBuffer((&result)->offsets.data(),
+        (&result)->offsets.size() * sizeof(int64_t)));
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(PyObject *self, PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NarrowIds(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
-  std::vector< absl::string_view > *arg2 = 0 ;
-  int arg3 ;
+  PyBufferView *arg2 = 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[2] ;
+  NarrowIds result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__NarrowIds", 2, 2, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__NarrowIds" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    arg2 = new PyBufferView(swig_obj[1]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg2->ok()) SWIG_fail;
+  }
+  {
+    try {
+      result = sentencepiece_SentencePieceProcessor__NarrowIds((sentencepiece::SentencePieceProcessor const *)arg1,(PyBufferView const &)*arg2);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = MakePyOutputBuffer((&result)->ids.data(),
+      (&result)->ids.size() * sizeof(uint16_t));
+  }
+  {
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeCorpus(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  bool arg3 ;
+  bool arg4 ;
+  bool arg5 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  bool val3 ;
+  int ecode3 = 0 ;
+  bool val4 ;
+  int ecode4 = 0 ;
+  bool val5 ;
+  int ecode5 = 0 ;
+  PyObject *swig_obj[5] ;
+  CorpusIds result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeCorpus", 5, 5, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeCorpus" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_bool(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeCorpus" "', argument " "3"" of type '" "bool""'");
+  } 
+  arg3 = static_cast< bool >(val3);
+  ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeCorpus" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg4 = static_cast< bool >(val4);
+  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeCorpus" "', argument " "5"" of type '" "bool""'");
+  } 
+  arg5 = static_cast< bool >(val5);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeCorpus((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    PyObject *ids = PyList_New((&result)->ids.size());
+    for (size_t i = 0; i < (&result)->ids.size(); ++i) {
+      PyObject *obj = PyList_New((&result)->ids[i].size());
+      for (size_t j = 0; j < (&result)->ids[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, PyInt_FromLong(static_cast<long>((&result)->ids[i][j])));
+      }
+      PyList_SET_ITEM(ids, i, obj);
+    }
+    PyObject *stats = PyDict_New();
+    const std::pair<const char *, PyObject *> items[] = {
+        {"num_inputs", MakePyList((&result)->stats.num_inputs)},
+        {"num_bytes", MakePyList((&result)->stats.num_bytes)},
+        {"busy_seconds", MakePyList((&result)->stats.busy_seconds)},
+        {"elapsed_seconds", MakePyNumber((&result)->stats.elapsed_seconds)}};
+    for (const auto &item : items) {
+      PyDict_SetItemString(stats, item.first, item.second);
+      Py_DECREF(item.second);
+    }
+    resultobj = PyTuple_Pack(2, ids, stats);
+    Py_DECREF(ids);
+    Py_DECREF(stats);
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsPaddedBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  int arg3 ;
   bool arg4 ;
   int arg5 ;
   float arg6 ;
@@ -6571,6 +7320,12 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(
   bool arg8 ;
   bool arg9 ;
   bool arg10 ;
+  int arg11 ;
+  bool arg12 ;
+  int arg13 ;
+  bool arg14 ;
+  bool arg15 ;
+  int arg16 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   int val3 ;
@@ -6589,22 +7344,35 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(
   int ecode9 = 0 ;
   bool val10 ;
   int ecode10 = 0 ;
-  PyObject *swig_obj[10] ;
-  BytesArray result;
-  
-  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsSerializedProtoBatch", 10, 10, swig_obj)) SWIG_fail;
+  int val11 ;
+  int ecode11 = 0 ;
+  bool val12 ;
+  int ecode12 = 0 ;
+  int val13 ;
+  int ecode13 = 0 ;
+  bool val14 ;
+  int ecode14 = 0 ;
+  bool val15 ;
+  int ecode15 = 0 ;
+  int val16 ;
+  int ecode16 = 0 ;
+  PyObject *swig_obj[16] ;
+  PaddedIds result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsPaddedBatch", 16, 16, swig_obj)) SWIG_fail;
   res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
   if (!SWIG_IsOK(res1)) {
-    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
   }
   arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -6621,47 +7389,80 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(
   }
   ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
   if (!SWIG_IsOK(ecode3)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "3"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "3"" of type '" "int""'");
   } 
   arg3 = static_cast< int >(val3);
   ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
   if (!SWIG_IsOK(ecode4)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "4"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "4"" of type '" "bool""'");
   } 
   arg4 = static_cast< bool >(val4);
   ecode5 = SWIG_AsVal_int(swig_obj[4], &val5);
   if (!SWIG_IsOK(ecode5)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "5"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "5"" of type '" "int""'");
   } 
   arg5 = static_cast< int >(val5);
   ecode6 = SWIG_AsVal_float(swig_obj[5], &val6);
   if (!SWIG_IsOK(ecode6)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "6"" of type '" "float""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "6"" of type '" "float""'");
   } 
   arg6 = static_cast< float >(val6);
   ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
   if (!SWIG_IsOK(ecode7)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "7"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "7"" of type '" "bool""'");
   } 
   arg7 = static_cast< bool >(val7);
   ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
   if (!SWIG_IsOK(ecode8)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "8"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "8"" of type '" "bool""'");
   } 
   arg8 = static_cast< bool >(val8);
   ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
   if (!SWIG_IsOK(ecode9)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "9"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "9"" of type '" "bool""'");
   } 
   arg9 = static_cast< bool >(val9);
   ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
   if (!SWIG_IsOK(ecode10)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "10"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "10"" of type '" "bool""'");
   } 
   arg10 = static_cast< bool >(val10);
+  ecode11 = SWIG_AsVal_int(swig_obj[10], &val11);
+  if (!SWIG_IsOK(ecode11)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode11), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "11"" of type '" "int""'");
+  } 
+  arg11 = static_cast< int >(val11);
+  ecode12 = SWIG_AsVal_bool(swig_obj[11], &val12);
+  if (!SWIG_IsOK(ecode12)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode12), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "12"" of type '" "bool""'");
+  } 
+  arg12 = static_cast< bool >(val12);
+  ecode13 = SWIG_AsVal_int(swig_obj[12], &val13);
+  if (!SWIG_IsOK(ecode13)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode13), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "13"" of type '" "int""'");
+  } 
+  arg13 = static_cast< int >(val13);
+  ecode14 = SWIG_AsVal_bool(swig_obj[13], &val14);
+  if (!SWIG_IsOK(ecode14)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode14), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "14"" of type '" "bool""'");
+  } 
+  arg14 = static_cast< bool >(val14);
+  ecode15 = SWIG_AsVal_bool(swig_obj[14], &val15);
+  if (!SWIG_IsOK(ecode15)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode15), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "15"" of type '" "bool""'");
+  } 
+  arg15 = static_cast< bool >(val15);
+  ecode16 = SWIG_AsVal_int(swig_obj[15], &val16);
+  if (!SWIG_IsOK(ecode16)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode16), "in method '" "SentencePieceProcessor__EncodeAsIdsPaddedBatch" "', argument " "16"" of type '" "int""'");
+  } 
+  arg16 = static_cast< int >(val16);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIdsPaddedBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10,arg11,arg12,arg13,arg14,arg15,arg16);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6669,27 +7470,35 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(
     }
   }
   {
-    resultobj = PyList_New((&result)->size());
-    for (size_t i = 0; i < (&result)->size(); ++i) {
-      PyList_SET_ITEM(resultobj, i, MakePyOutputBytes(result[i]));
-    }
+    resultobj = PyTuple_New(4);
+    PyTuple_SET_ITEM(resultobj, 0,
+      MakePyOutputBuffer((&result)->ids.data(),
+        (&result)->ids.size() * sizeof(int32_t)));
+    PyTuple_SET_ITEM(resultobj, 1,
+      MakePyOutputBuffer((&result)->mask.data(),
+        (&result)->mask.size() * sizeof(int32_t)));
+    PyTuple_SET_ITEM(resultobj, 2, PyLong_FromSize_t((&result)->rows));
+    PyTuple_SET_ITEM(resultobj, 3, PyLong_FromSize_t((&result)->width));
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch(PyObject *self, PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesBatch(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   bool arg4 ;
   int arg5 ;
@@ -6717,21 +7526,22 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch(P
   bool val10 ;
   int ecode10 = 0 ;
   PyObject *swig_obj[10] ;
-  SwigValueWrapper< std::vector< sentencepiece::ImmutableSentencePieceText > > result;
+  std::vector< std::vector< std::string > > result;
   
-  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsImmutableProtoBatch", 10, 10, swig_obj)) SWIG_fail;
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsPiecesBatch", 10, 10, swig_obj)) SWIG_fail;
   res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
   if (!SWIG_IsOK(res1)) {
-    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
   }
   arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -6748,47 +7558,50 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch(P
   }
   ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
   if (!SWIG_IsOK(ecode3)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "3"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "3"" of type '" "int""'");
   } 
   arg3 = static_cast< int >(val3);
   ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
   if (!SWIG_IsOK(ecode4)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "4"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "4"" of type '" "bool""'");
   } 
   arg4 = static_cast< bool >(val4);
   ecode5 = SWIG_AsVal_int(swig_obj[4], &val5);
   if (!SWIG_IsOK(ecode5)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "5"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "5"" of type '" "int""'");
   } 
   arg5 = static_cast< int >(val5);
   ecode6 = SWIG_AsVal_float(swig_obj[5], &val6);
   if (!SWIG_IsOK(ecode6)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "6"" of type '" "float""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "6"" of type '" "float""'");
   } 
   arg6 = static_cast< float >(val6);
   ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
   if (!SWIG_IsOK(ecode7)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "7"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "7"" of type '" "bool""'");
   } 
   arg7 = static_cast< bool >(val7);
   ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
   if (!SWIG_IsOK(ecode8)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "8"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "8"" of type '" "bool""'");
   } 
   arg8 = static_cast< bool >(val8);
   ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
   if (!SWIG_IsOK(ecode9)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "9"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "9"" of type '" "bool""'");
   } 
   arg9 = static_cast< bool >(val9);
   ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
   if (!SWIG_IsOK(ecode10)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "10"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsPiecesBatch" "', argument " "10"" of type '" "bool""'");
   } 
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__EncodeAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsPiecesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6796,24 +7609,805 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch(P
     }
   }
   {
+    PyObject *input_type = resultobj;
     resultobj = PyList_New((&result)->size());
     for (size_t i = 0; i < (&result)->size(); ++i) {
-      PyObject *obj = SWIG_NewPointerObj(new sentencepiece::ImmutableSentencePieceText((&result)->at(i)), SWIGTYPE_p_sentencepiece__ImmutableSentencePieceText, SWIG_POINTER_OWN | 0);
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, MakePyOutputString(result[i][j], input_type));
+      }
       PyList_SET_ITEM(resultobj, i, obj);
     }
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
 }
 
 
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  int arg3 ;
+  bool arg4 ;
+  int arg5 ;
+  float arg6 ;
+  bool arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  bool arg10 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  bool val4 ;
+  int ecode4 = 0 ;
+  int val5 ;
+  int ecode5 = 0 ;
+  float val6 ;
+  int ecode6 = 0 ;
+  bool val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  bool val10 ;
+  int ecode10 = 0 ;
+  PyObject *swig_obj[10] ;
+  BytesArray result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsSerializedProtoBatch", 10, 10, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "3"" of type '" "int""'");
+  } 
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg4 = static_cast< bool >(val4);
+  ecode5 = SWIG_AsVal_int(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "5"" of type '" "int""'");
+  } 
+  arg5 = static_cast< int >(val5);
+  ecode6 = SWIG_AsVal_float(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "6"" of type '" "float""'");
+  } 
+  arg6 = static_cast< float >(val6);
+  ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg7 = static_cast< bool >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsSerializedProtoBatch" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyList_SET_ITEM(resultobj, i, MakePyOutputBytes(result[i]));
+    }
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  int arg3 ;
+  bool arg4 ;
+  int arg5 ;
+  float arg6 ;
+  bool arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  bool arg10 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  bool val4 ;
+  int ecode4 = 0 ;
+  int val5 ;
+  int ecode5 = 0 ;
+  float val6 ;
+  int ecode6 = 0 ;
+  bool val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  bool val10 ;
+  int ecode10 = 0 ;
+  PyObject *swig_obj[10] ;
+  SwigValueWrapper< std::vector< sentencepiece::ImmutableSentencePieceText > > result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsImmutableProtoBatch", 10, 10, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "3"" of type '" "int""'");
+  } 
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_bool(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg4 = static_cast< bool >(val4);
+  ecode5 = SWIG_AsVal_int(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "5"" of type '" "int""'");
+  } 
+  arg5 = static_cast< int >(val5);
+  ecode6 = SWIG_AsVal_float(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "6"" of type '" "float""'");
+  } 
+  arg6 = static_cast< float >(val6);
+  ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg7 = static_cast< bool >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsImmutableProtoBatch" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = SWIG_NewPointerObj(new sentencepiece::ImmutableSentencePieceText((&result)->at(i)), SWIGTYPE_p_sentencepiece__ImmutableSentencePieceText, SWIG_POINTER_OWN | 0);
+      PyList_SET_ITEM(resultobj, i, obj);
+    }
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsFromBuffer(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyBufferView *arg2 = 0 ;
+  PyBufferView *arg3 = 0 ;
+  int arg4 ;
+  bool arg5 ;
+  int arg6 ;
+  float arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  bool arg10 ;
+  bool arg11 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  bool val5 ;
+  int ecode5 = 0 ;
+  int val6 ;
+  int ecode6 = 0 ;
+  float val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  bool val10 ;
+  int ecode10 = 0 ;
+  bool val11 ;
+  int ecode11 = 0 ;
+  PyObject *swig_obj[11] ;
+  std::vector< std::vector< int > > result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsFromBuffer", 11, 11, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    arg2 = new PyBufferView(swig_obj[1]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg2->ok()) SWIG_fail;
+  }
+  {
+    arg3 = new PyBufferView(swig_obj[2]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg3->ok()) SWIG_fail;
+  }
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "3"" of type '" "int""'");
+  } 
+  arg4 = static_cast< int >(val4);
+  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg5 = static_cast< bool >(val5);
+  ecode6 = SWIG_AsVal_int(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "5"" of type '" "int""'");
+  } 
+  arg6 = static_cast< int >(val6);
+  ecode7 = SWIG_AsVal_float(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "6"" of type '" "float""'");
+  } 
+  arg7 = static_cast< float >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  ecode11 = SWIG_AsVal_bool(swig_obj[10], &val11);
+  if (!SWIG_IsOK(ecode11)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode11), "in method '" "SentencePieceProcessor__EncodeAsIdsFromBuffer" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg11 = static_cast< bool >(val11);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIdsFromBuffer((sentencepiece::SentencePieceProcessor const *)arg1,(PyBufferView const &)*arg2,(PyBufferView const &)*arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10,arg11);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, PyInt_FromLong(static_cast<long>(result[i][j])));
+      }
+      PyList_SET_ITEM(resultobj, i, obj);
+    }
+  }
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsFlatFromBuffer(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyBufferView *arg2 = 0 ;
+  PyBufferView *arg3 = 0 ;
+  int arg4 ;
+  bool arg5 ;
+  int arg6 ;
+  float arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  bool arg10 ;
+  bool arg11 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  bool val5 ;
+  int ecode5 = 0 ;
+  int val6 ;
+  int ecode6 = 0 ;
+  float val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  bool val10 ;
+  int ecode10 = 0 ;
+  bool val11 ;
+  int ecode11 = 0 ;
+  PyObject *swig_obj[11] ;
+  FlatIds result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer", 11, 11, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    arg2 = new PyBufferView(swig_obj[1]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg2->ok()) SWIG_fail;
+  }
+  {
+    arg3 = new PyBufferView(swig_obj[2]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg3->ok()) SWIG_fail;
+  }
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "3"" of type '" "int""'");
+  } 
+  arg4 = static_cast< int >(val4);
+  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg5 = static_cast< bool >(val5);
+  ecode6 = SWIG_AsVal_int(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "5"" of type '" "int""'");
+  } 
+  arg6 = static_cast< int >(val6);
+  ecode7 = SWIG_AsVal_float(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "6"" of type '" "float""'");
+  } 
+  arg7 = static_cast< float >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  ecode11 = SWIG_AsVal_bool(swig_obj[10], &val11);
+  if (!SWIG_IsOK(ecode11)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode11), "in method '" "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg11 = static_cast< bool >(val11);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsIdsFlatFromBuffer((sentencepiece::SentencePieceProcessor const *)arg1,(PyBufferView const &)*arg2,(PyBufferView const &)*arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10,arg11);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyTuple_New(2);
+    PyTuple_SET_ITEM(resultobj, 0,
+      MakePyOutputBuffer((&result)->ids.data(),
+        (&result)->ids.size() * sizeof(int32_t)));
+    PyTuple_SET_ITEM(resultobj, 1,
+      MakePyOutputBuffer((&result)->offsets.data(),
+        (&result)->offsets.size() * sizeof(int64_t)));
+  }
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesFromBuffer(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyBufferView *arg2 = 0 ;
+  PyBufferView *arg3 = 0 ;
+  int arg4 ;
+  bool arg5 ;
+  int arg6 ;
+  float arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  bool arg10 ;
+  bool arg11 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  bool val5 ;
+  int ecode5 = 0 ;
+  int val6 ;
+  int ecode6 = 0 ;
+  float val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  bool val10 ;
+  int ecode10 = 0 ;
+  bool val11 ;
+  int ecode11 = 0 ;
+  PyObject *swig_obj[11] ;
+  std::vector< std::vector< std::string > > result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsPiecesFromBuffer", 11, 11, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    arg2 = new PyBufferView(swig_obj[1]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg2->ok()) SWIG_fail;
+  }
+  {
+    arg3 = new PyBufferView(swig_obj[2]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg3->ok()) SWIG_fail;
+  }
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "3"" of type '" "int""'");
+  } 
+  arg4 = static_cast< int >(val4);
+  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "4"" of type '" "bool""'");
+  } 
+  arg5 = static_cast< bool >(val5);
+  ecode6 = SWIG_AsVal_int(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "5"" of type '" "int""'");
+  } 
+  arg6 = static_cast< int >(val6);
+  ecode7 = SWIG_AsVal_float(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "6"" of type '" "float""'");
+  } 
+  arg7 = static_cast< float >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  ecode11 = SWIG_AsVal_bool(swig_obj[10], &val11);
+  if (!SWIG_IsOK(ecode11)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode11), "in method '" "SentencePieceProcessor__EncodeAsPiecesFromBuffer" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg11 = static_cast< bool >(val11);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeAsPiecesFromBuffer((sentencepiece::SentencePieceProcessor const *)arg1,(PyBufferView const &)*arg2,(PyBufferView const &)*arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10,arg11);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    PyObject *input_type = resultobj;
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, MakePyOutputString(result[i][j], input_type));
+      }
+      PyList_SET_ITEM(resultobj, i, obj);
+    }
+  }
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  {
+    delete arg3;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeArrow(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyBufferView *arg2 = 0 ;
+  int arg3 ;
+  PyBufferView *arg4 = 0 ;
+  PyBufferView *arg5 = 0 ;
+  bool arg6 ;
+  bool arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  bool val6 ;
+  int ecode6 = 0 ;
+  bool val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  PyObject *swig_obj[9] ;
+  ArrowIds result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeArrow", 9, 9, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    arg2 = new PyBufferView(swig_obj[1]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg2->ok()) SWIG_fail;
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "3"" of type '" "int""'");
+  } 
+  arg3 = static_cast< int >(val3);
+  {
+    arg4 = new PyBufferView(swig_obj[3]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg4->ok()) SWIG_fail;
+  }
+  {
+    arg5 = new PyBufferView(swig_obj[4]);
+    // PyObject_GetBuffer() sets the error.
+    if (!arg5->ok()) SWIG_fail;
+  }
+  ecode6 = SWIG_AsVal_bool(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "6"" of type '" "bool""'");
+  } 
+  arg6 = static_cast< bool >(val6);
+  ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg7 = static_cast< bool >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__EncodeArrow" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__EncodeArrow((sentencepiece::SentencePieceProcessor const *)arg1,(PyBufferView const &)*arg2,arg3,(PyBufferView const &)*arg4,(PyBufferView const &)*arg5,arg6,arg7,arg8,arg9);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyTuple_New(2);
+    PyTuple_SET_ITEM(resultobj, 0,
+      MakePyOutputBuffer((&result)->values.data(),
+        (&result)->values.size() * sizeof(int32_t)));
+    PyTuple_SET_ITEM(resultobj, 1,
+      MakePyOutputBuffer((&result)->offsets.data(), (&result)->offsets.size()));
+  }
+  {
+    delete arg2;
+  }
+  {
+    delete arg4;
+  }
+  {
+    delete arg5;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  {
+    delete arg4;
+  }
+  {
+    delete arg5;
+  }
+  return NULL;
+}
+
+
 SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIds(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
@@ -6851,7 +8445,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIds(PyObject *self, PyO
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIds((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIds((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6911,7 +8508,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsBytes(PyObject *se
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsBytes((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsBytes((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6937,6 +8537,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePieces(PyObject *self,
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
@@ -6951,10 +8552,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePieces(PyObject *self,
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -6971,7 +8573,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePieces(PyObject *self,
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePieces((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePieces((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -6983,11 +8588,13 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePieces(PyObject *self,
     resultobj = MakePyOutputString(result, input_type);
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
@@ -7031,7 +8638,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsSerializedProto(Py
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7057,6 +8667,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
@@ -7071,10 +8682,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -7091,7 +8703,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePiecesAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePiecesAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7102,11 +8717,13 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
     resultobj = MakePyOutputBytes(result);
   }
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
@@ -7150,7 +8767,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsImmutableProto(PyO
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7174,6 +8794,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProto(
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
@@ -7188,10 +8809,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProto(
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -7208,7 +8830,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProto(
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePiecesAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePiecesAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7217,11 +8842,13 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProto(
   }
   resultobj = SWIG_NewPointerObj((new sentencepiece::ImmutableSentencePieceText(result)), SWIGTYPE_p_sentencepiece__ImmutableSentencePieceText, SWIG_POINTER_OWN |  0 );
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
@@ -7283,7 +8910,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsBatch(PyObject *self
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7364,7 +8994,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsBytesBatch(PyObjec
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsBytesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsBytesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7444,7 +9077,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsSerializedProtoBat
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7524,7 +9160,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsAsImmutableProtoBatc
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodeIdsAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodeIdsAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< int > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7554,6 +9193,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesBatch(PyObject *s
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< std::vector< absl::string_view > > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
@@ -7572,14 +9212,17 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesBatch(PyObject *s
     std::vector<std::vector<absl::string_view>> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
       const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyTuple_New(size);
       out = new std::vector<std::vector<absl::string_view>>(size);
       for (size_t i = 0; i < size; ++i) {
         PyObject *o = PyList_GetItem(swig_obj[1], i);
         if (PyList_Check(o)) {
-          const size_t size2 = PyList_Size(o);
+          PyObject *o2 = PyList_AsTuple(o);
+          PyTuple_SET_ITEM(items2, i, o2);
+          const size_t size2 = PyTuple_GET_SIZE(o2);
           (*out)[i].resize(size2);
           for (size_t j = 0; j < size2; ++j) {
-            const PyInputString ustring(PyList_GetItem(o, j));
+            const PyInputString ustring(PyTuple_GET_ITEM(o2, j));
             if (ustring.IsAvalable()) {
               (*out)[i][j] = ustring.str();
             } else {
@@ -7606,7 +9249,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesBatch(PyObject *s
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePiecesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePiecesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7620,8 +9266,16 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesBatch(PyObject *s
       PyList_SET_ITEM(resultobj, i, MakePyOutputString(result[i], input_type));
     }
   }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return resultobj;
 fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return NULL;
 }
 
@@ -7630,6 +9284,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< std::vector< absl::string_view > > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
@@ -7648,14 +9303,17 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
     std::vector<std::vector<absl::string_view>> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
       const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyTuple_New(size);
       out = new std::vector<std::vector<absl::string_view>>(size);
       for (size_t i = 0; i < size; ++i) {
         PyObject *o = PyList_GetItem(swig_obj[1], i);
         if (PyList_Check(o)) {
-          const size_t size2 = PyList_Size(o);
+          PyObject *o2 = PyList_AsTuple(o);
+          PyTuple_SET_ITEM(items2, i, o2);
+          const size_t size2 = PyTuple_GET_SIZE(o2);
           (*out)[i].resize(size2);
           for (size_t j = 0; j < size2; ++j) {
-            const PyInputString ustring(PyList_GetItem(o, j));
+            const PyInputString ustring(PyTuple_GET_ITEM(o2, j));
             if (ustring.IsAvalable()) {
               (*out)[i][j] = ustring.str();
             } else {
@@ -7682,7 +9340,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePiecesAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePiecesAsSerializedProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7695,8 +9356,16 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsSerializedProto
       PyList_SET_ITEM(resultobj, i, MakePyOutputBytes(result[i]));
     }
   }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return resultobj;
 fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return NULL;
 }
 
@@ -7705,6 +9374,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProtoB
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< std::vector< absl::string_view > > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   int arg3 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
@@ -7723,14 +9393,17 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProtoB
     std::vector<std::vector<absl::string_view>> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
       const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyTuple_New(size);
       out = new std::vector<std::vector<absl::string_view>>(size);
       for (size_t i = 0; i < size; ++i) {
         PyObject *o = PyList_GetItem(swig_obj[1], i);
         if (PyList_Check(o)) {
-          const size_t size2 = PyList_Size(o);
+          PyObject *o2 = PyList_AsTuple(o);
+          PyTuple_SET_ITEM(items2, i, o2);
+          const size_t size2 = PyTuple_GET_SIZE(o2);
           (*out)[i].resize(size2);
           for (size_t j = 0; j < size2; ++j) {
-            const PyInputString ustring(PyList_GetItem(o, j));
+            const PyInputString ustring(PyTuple_GET_ITEM(o2, j));
             if (ustring.IsAvalable()) {
               (*out)[i][j] = ustring.str();
             } else {
@@ -7757,7 +9430,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProtoB
   arg3 = static_cast< int >(val3);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__DecodePiecesAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__DecodePiecesAsImmutableProtoBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< std::vector< absl::string_view > > const &)*arg2,arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7771,8 +9447,16 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodePiecesAsImmutableProtoB
       PyList_SET_ITEM(resultobj, i, obj);
     }
   }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return resultobj;
 fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return NULL;
 }
 
@@ -7843,7 +9527,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NBestEncodeAsIds(PyObject *se
   arg7 = static_cast< bool >(val7);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__NBestEncodeAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NBestEncodeAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -7932,7 +9619,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NBestEncodeAsPieces(PyObject
   arg7 = static_cast< bool >(val7);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__NBestEncodeAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NBestEncodeAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8022,7 +9712,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NBestEncodeAsSerializedProto(
   arg7 = static_cast< bool >(val7);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__NBestEncodeAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NBestEncodeAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8104,7 +9797,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NBestEncodeAsImmutableProto(P
   arg7 = static_cast< bool >(val7);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__NBestEncodeAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NBestEncodeAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8208,7 +9904,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeAndScoreAsIds(PyO
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsIds((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8321,7 +10020,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeAndScoreAsPieces(
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsPieces((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8435,7 +10137,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeAndScoreAsSeriali
   arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsSerializedProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8496,61 +10201,325 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeAndScoreAsImmutab
       PyErr_SetString(PyExc_TypeError, "not a string");
       SWIG_fail;
     }
-    resultobj = ustring.input_type();
-    arg2 = ustring.str();
+    resultobj = ustring.input_type();
+    arg2 = ustring.str();
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "3"" of type '" "int""'");
+  } 
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_float(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "4"" of type '" "float""'");
+  } 
+  arg4 = static_cast< float >(val4);
+  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "5"" of type '" "bool""'");
+  } 
+  arg5 = static_cast< bool >(val5);
+  ecode6 = SWIG_AsVal_bool(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "6"" of type '" "bool""'");
+  } 
+  arg6 = static_cast< bool >(val6);
+  ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg7 = static_cast< bool >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
+  if (!SWIG_IsOK(ecode10)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "10"" of type '" "bool""'");
+  } 
+  arg10 = static_cast< bool >(val10);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = SWIG_NewPointerObj((new sentencepiece::ImmutableNBestSentencePieceText(result)), SWIGTYPE_p_sentencepiece__ImmutableNBestSentencePieceText, SWIG_POINTER_OWN |  0 );
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeManyAsIdsBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  int arg3 ;
+  int arg4 ;
+  float arg5 ;
+  bool arg6 ;
+  bool arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  float val5 ;
+  int ecode5 = 0 ;
+  bool val6 ;
+  int ecode6 = 0 ;
+  bool val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  PyObject *swig_obj[9] ;
+  std::vector< std::vector< int > > result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__SampleEncodeManyAsIdsBatch", 9, 9, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "3"" of type '" "int""'");
+  } 
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "4"" of type '" "int""'");
+  } 
+  arg4 = static_cast< int >(val4);
+  ecode5 = SWIG_AsVal_float(swig_obj[4], &val5);
+  if (!SWIG_IsOK(ecode5)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "5"" of type '" "float""'");
+  } 
+  arg5 = static_cast< float >(val5);
+  ecode6 = SWIG_AsVal_bool(swig_obj[5], &val6);
+  if (!SWIG_IsOK(ecode6)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "6"" of type '" "bool""'");
+  } 
+  arg6 = static_cast< bool >(val6);
+  ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
+  if (!SWIG_IsOK(ecode7)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "7"" of type '" "bool""'");
+  } 
+  arg7 = static_cast< bool >(val7);
+  ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
+  if (!SWIG_IsOK(ecode8)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "8"" of type '" "bool""'");
+  } 
+  arg8 = static_cast< bool >(val8);
+  ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
+  if (!SWIG_IsOK(ecode9)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__SampleEncodeManyAsIdsBatch" "', argument " "9"" of type '" "bool""'");
+  } 
+  arg9 = static_cast< bool >(val9);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeManyAsIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, PyInt_FromLong(static_cast<long>(result[i][j])));
+      }
+      PyList_SET_ITEM(resultobj, i, obj);
+    }
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeManyAsPiecesBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  int arg3 ;
+  int arg4 ;
+  float arg5 ;
+  bool arg6 ;
+  bool arg7 ;
+  bool arg8 ;
+  bool arg9 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  float val5 ;
+  int ecode5 = 0 ;
+  bool val6 ;
+  int ecode6 = 0 ;
+  bool val7 ;
+  int ecode7 = 0 ;
+  bool val8 ;
+  int ecode8 = 0 ;
+  bool val9 ;
+  int ecode9 = 0 ;
+  PyObject *swig_obj[9] ;
+  std::vector< std::vector< std::string > > result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch", 9, 9, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
   }
   ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
   if (!SWIG_IsOK(ecode3)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "3"" of type '" "int""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "3"" of type '" "int""'");
   } 
   arg3 = static_cast< int >(val3);
-  ecode4 = SWIG_AsVal_float(swig_obj[3], &val4);
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
   if (!SWIG_IsOK(ecode4)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "4"" of type '" "float""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "4"" of type '" "int""'");
   } 
-  arg4 = static_cast< float >(val4);
-  ecode5 = SWIG_AsVal_bool(swig_obj[4], &val5);
+  arg4 = static_cast< int >(val4);
+  ecode5 = SWIG_AsVal_float(swig_obj[4], &val5);
   if (!SWIG_IsOK(ecode5)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "5"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode5), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "5"" of type '" "float""'");
   } 
-  arg5 = static_cast< bool >(val5);
+  arg5 = static_cast< float >(val5);
   ecode6 = SWIG_AsVal_bool(swig_obj[5], &val6);
   if (!SWIG_IsOK(ecode6)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "6"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode6), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "6"" of type '" "bool""'");
   } 
   arg6 = static_cast< bool >(val6);
   ecode7 = SWIG_AsVal_bool(swig_obj[6], &val7);
   if (!SWIG_IsOK(ecode7)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "7"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode7), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "7"" of type '" "bool""'");
   } 
   arg7 = static_cast< bool >(val7);
   ecode8 = SWIG_AsVal_bool(swig_obj[7], &val8);
   if (!SWIG_IsOK(ecode8)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "8"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode8), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "8"" of type '" "bool""'");
   } 
   arg8 = static_cast< bool >(val8);
   ecode9 = SWIG_AsVal_bool(swig_obj[8], &val9);
   if (!SWIG_IsOK(ecode9)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "9"" of type '" "bool""'");
+    SWIG_exception_fail(SWIG_ArgError(ecode9), "in method '" "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch" "', argument " "9"" of type '" "bool""'");
   } 
   arg9 = static_cast< bool >(val9);
-  ecode10 = SWIG_AsVal_bool(swig_obj[9], &val10);
-  if (!SWIG_IsOK(ecode10)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode10), "in method '" "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto" "', argument " "10"" of type '" "bool""'");
-  } 
-  arg10 = static_cast< bool >(val10);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto((sentencepiece::SentencePieceProcessor const *)arg1,SWIG_STD_MOVE(arg2),arg3,arg4,arg5,arg6,arg7,arg8,arg9,arg10);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__SampleEncodeManyAsPiecesBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4,arg5,arg6,arg7,arg8,arg9);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
       SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
     }
   }
-  resultobj = SWIG_NewPointerObj((new sentencepiece::ImmutableNBestSentencePieceText(result)), SWIGTYPE_p_sentencepiece__ImmutableNBestSentencePieceText, SWIG_POINTER_OWN |  0 );
+  {
+    PyObject *input_type = resultobj;
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SET_ITEM(obj, j, MakePyOutputString(result[i][j], input_type));
+      }
+      PyList_SET_ITEM(resultobj, i, obj);
+    }
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return resultobj;
 fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
   return NULL;
 }
 
@@ -8581,7 +10550,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__Normalize(PyObject *self, PyO
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__Normalize(arg1,SWIG_STD_MOVE(arg2));
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__Normalize(arg1,SWIG_STD_MOVE(arg2));
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8624,7 +10596,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NormalizeWithOffsets(PyObject
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__NormalizeWithOffsets(arg1,SWIG_STD_MOVE(arg2));
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NormalizeWithOffsets(arg1,SWIG_STD_MOVE(arg2));
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8648,6 +10623,81 @@ fail:
 }
 
 
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NormalizeBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  bool arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  bool val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  sentencepiece::NormalizedBatch result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__NormalizeBatch", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__NormalizeBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_bool(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__NormalizeBatch" "', argument " "3"" of type '" "bool""'");
+  } 
+  arg3 = static_cast< bool >(val3);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__NormalizeBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = MakePyNormalizedBatch(result);
+  }
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
 SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropy(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
@@ -8682,7 +10732,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropy(PyObject *se
   arg3 = static_cast< float >(val3);
   {
     try {
-      result = (float)sentencepiece_SentencePieceProcessor__CalculateEntropy(arg1,SWIG_STD_MOVE(arg2),arg3);
+      {
+        ScopedGILRelease release;
+        result = (float)sentencepiece_SentencePieceProcessor__CalculateEntropy(arg1,SWIG_STD_MOVE(arg2),arg3);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8700,6 +10753,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropyBatch(PyObjec
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
   float arg3 ;
   int arg4 ;
   void *argp1 = 0 ;
@@ -8720,10 +10774,11 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropyBatch(PyObjec
   {
     std::vector<absl::string_view> *out = nullptr;
     if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
       out = new std::vector<absl::string_view>(size);
       for (size_t i = 0; i < size; ++i) {
-        const PyInputString ustring(PyList_GetItem(swig_obj[1], i));
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
         if (ustring.IsAvalable()) {
           (*out)[i] = ustring.str();
         } else {
@@ -8750,7 +10805,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropyBatch(PyObjec
   arg4 = static_cast< int >(val4);
   {
     try {
-      result = sentencepiece_SentencePieceProcessor__CalculateEntropyBatch(arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4);
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__CalculateEntropyBatch(arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4);
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -8764,11 +10822,103 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropyBatch(PyObjec
     }
   }
   {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    Py_XDECREF(items2);
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  PyObject *items2 = nullptr ;
+  float arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  float val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  EntropyResults result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<absl::string_view> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      items2 = PyList_AsTuple(swig_obj[1]);
+      const size_t size = PyTuple_GET_SIZE(items2);
+      out = new std::vector<absl::string_view>(size);
+      for (size_t i = 0; i < size; ++i) {
+        const PyInputString ustring(PyTuple_GET_ITEM(items2, i));
+        if (ustring.IsAvalable()) {
+          (*out)[i] = ustring.str();
+        } else {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          SWIG_fail;
+        }
+        resultobj = ustring.input_type();
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  ecode3 = SWIG_AsVal_float(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch" "', argument " "3"" of type '" "float""'");
+  } 
+  arg3 = static_cast< float >(val3);
+  {
+    try {
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3);
+      }
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    PyObject *entropies = MakePyList((&result)->entropies);
+    PyObject *counts = PyList_New((&result)->expected_counts.size());
+    for (size_t i = 0; i < (&result)->expected_counts.size(); ++i) {
+      PyObject *dict = PyDict_New();
+      for (const auto &count : (&result)->expected_counts[i]) {
+        PyObject *key = PyInt_FromLong(static_cast<long>(count.first));
+        PyObject *value = PyFloat_FromDouble(static_cast<double>(count.second));
+        PyDict_SetItem(dict, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+      }
+      PyList_SET_ITEM(counts, i, dict);
+    }
+    resultobj = PyTuple_Pack(2, entropies, counts);
+    Py_DECREF(entropies);
+    Py_DECREF(counts);
+  }
+  {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return resultobj;
 fail:
   {
+    Py_XDECREF(items2);
     delete arg2;
   }
   return NULL;
@@ -8852,6 +11002,89 @@ SWIGINTERN PyObject *SentencePieceProcessor_swiginit(PyObject *SWIGUNUSEDPARM(se
   return SWIG_Python_InitShadowInstance(args);
 }
 
+SWIGINTERN PyObject *_wrap_ConfigureThreadPools(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  int arg1 ;
+  std::vector< int > *arg2 = 0 ;
+  int val1 ;
+  int ecode1 = 0 ;
+  PyObject *swig_obj[2] ;
+  sentencepiece::util::Status result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "ConfigureThreadPools", 2, 2, swig_obj)) SWIG_fail;
+  ecode1 = SWIG_AsVal_int(swig_obj[0], &val1);
+  if (!SWIG_IsOK(ecode1)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode1), "in method '" "ConfigureThreadPools" "', argument " "1"" of type '" "int""'");
+  } 
+  arg1 = static_cast< int >(val1);
+  {
+    std::vector<int> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      const size_t size = PyList_Size(swig_obj[1]);
+      out = new std::vector<int>(size);
+      for (size_t i = 0; i < size; ++i) {
+        PyObject *o = PyList_GetItem(swig_obj[1], i);
+        if (PyInt_Check(o)) {
+          (*out)[i] = static_cast<int>(PyInt_AsLong(o));
+        } else {
+          PyErr_SetString(PyExc_TypeError,"list must contain integers");
+          SWIG_fail;
+        }
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError,"not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  {
+    try {
+      result = sentencepiece::ConfigureThreadPools(arg1,(std::vector< int > const &)*arg2);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    if (!(&result)->ok()) {
+      SWIG_exception(ToSwigError((&result)->code()), (&result)->ToString().c_str());
+    }
+    resultobj = SWIG_From_bool((&result)->ok());
+  }
+  {
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_GetDefaultNumThreads(PyObject *self, PyObject *args) {
+  PyObject *resultobj = 0;
+  int result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "GetDefaultNumThreads", 0, 0, 0)) SWIG_fail;
+  {
+    try {
+      result = (int)sentencepiece::GetDefaultNumThreads();
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = SWIG_From_int(static_cast< int >(result));
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
 SWIGINTERN PyObject *_wrap_SetRandomGeneratorSeed(PyObject *self, PyObject *args) {
   PyObject *resultobj = 0;
   unsigned int arg1 ;
@@ -9492,7 +11725,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceNormalizer__Normalize(PyObject *self, Py
   }
   {
     try {
-      result = sentencepiece_SentencePieceNormalizer__Normalize(arg1,SWIG_STD_MOVE(arg2));
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceNormalizer__Normalize(arg1,SWIG_STD_MOVE(arg2));
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -9535,7 +11771,10 @@ SWIGINTERN PyObject *_wrap_SentencePieceNormalizer__NormalizeWithOffsets(PyObjec
   }
   {
     try {
-      result = sentencepiece_SentencePieceNormalizer__NormalizeWithOffsets(arg1,SWIG_STD_MOVE(arg2));
+      {
+        ScopedGILRelease release;
+        result = sentencepiece_SentencePieceNormalizer__NormalizeWithOffsets(arg1,SWIG_STD_MOVE(arg2));
+      }
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -9668,15 +11907,24 @@ static PyMethodDef SwigMethods[] = {
 	 { "SentencePieceProcessor_eos_id", _wrap_SentencePieceProcessor_eos_id, METH_O, NULL},
 	 { "SentencePieceProcessor_pad_id", _wrap_SentencePieceProcessor_pad_id, METH_O, NULL},
 	 { "SentencePieceProcessor_serialized_model_proto", _wrap_SentencePieceProcessor_serialized_model_proto, METH_O, NULL},
+	 { "SentencePieceProcessor_model_file", _wrap_SentencePieceProcessor_model_file, METH_O, NULL},
 	 { "SentencePieceProcessor_LoadFromFile", _wrap_SentencePieceProcessor_LoadFromFile, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsIds", _wrap_SentencePieceProcessor__EncodeAsIds, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsPieces", _wrap_SentencePieceProcessor__EncodeAsPieces, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsSerializedProto", _wrap_SentencePieceProcessor__EncodeAsSerializedProto, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsImmutableProto", _wrap_SentencePieceProcessor__EncodeAsImmutableProto, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsIdsBatch", _wrap_SentencePieceProcessor__EncodeAsIdsBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsFlatBatch", _wrap_SentencePieceProcessor__EncodeAsIdsFlatBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsPaddedBatch", _wrap_SentencePieceProcessor__EncodeAsIdsPaddedBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__NarrowIds", _wrap_SentencePieceProcessor__NarrowIds, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeCorpus", _wrap_SentencePieceProcessor__EncodeCorpus, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsPiecesBatch", _wrap_SentencePieceProcessor__EncodeAsPiecesBatch, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsSerializedProtoBatch", _wrap_SentencePieceProcessor__EncodeAsSerializedProtoBatch, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__EncodeAsImmutableProtoBatch", _wrap_SentencePieceProcessor__EncodeAsImmutableProtoBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsFromBuffer", _wrap_SentencePieceProcessor__EncodeAsIdsFromBuffer, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsFlatFromBuffer", _wrap_SentencePieceProcessor__EncodeAsIdsFlatFromBuffer, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsPiecesFromBuffer", _wrap_SentencePieceProcessor__EncodeAsPiecesFromBuffer, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeArrow", _wrap_SentencePieceProcessor__EncodeArrow, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__DecodeIds", _wrap_SentencePieceProcessor__DecodeIds, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__DecodeIdsAsBytes", _wrap_SentencePieceProcessor__DecodeIdsAsBytes, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__DecodePieces", _wrap_SentencePieceProcessor__DecodePieces, METH_VARARGS, NULL},
@@ -9699,13 +11947,19 @@ static PyMethodDef SwigMethods[] = {
 	 { "SentencePieceProcessor__SampleEncodeAndScoreAsPieces", _wrap_SentencePieceProcessor__SampleEncodeAndScoreAsPieces, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__SampleEncodeAndScoreAsSerializedProto", _wrap_SentencePieceProcessor__SampleEncodeAndScoreAsSerializedProto, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto", _wrap_SentencePieceProcessor__SampleEncodeAndScoreAsImmutableProto, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__SampleEncodeManyAsIdsBatch", _wrap_SentencePieceProcessor__SampleEncodeManyAsIdsBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__SampleEncodeManyAsPiecesBatch", _wrap_SentencePieceProcessor__SampleEncodeManyAsPiecesBatch, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__Normalize", _wrap_SentencePieceProcessor__Normalize, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__NormalizeWithOffsets", _wrap_SentencePieceProcessor__NormalizeWithOffsets, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__NormalizeBatch", _wrap_SentencePieceProcessor__NormalizeBatch, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__CalculateEntropy", _wrap_SentencePieceProcessor__CalculateEntropy, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__CalculateEntropyBatch", _wrap_SentencePieceProcessor__CalculateEntropyBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch", _wrap_SentencePieceProcessor__CalculateEntropyAndExpectedCountsBatch, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor__OverrideNormalizerSpec", _wrap_SentencePieceProcessor__OverrideNormalizerSpec, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor_swigregister", SentencePieceProcessor_swigregister, METH_O, NULL},
 	 { "SentencePieceProcessor_swiginit", SentencePieceProcessor_swiginit, METH_VARARGS, NULL},
+	 { "ConfigureThreadPools", _wrap_ConfigureThreadPools, METH_VARARGS, NULL},
+	 { "GetDefaultNumThreads", _wrap_GetDefaultNumThreads, METH_NOARGS, NULL},
 	 { "SetRandomGeneratorSeed", _wrap_SetRandomGeneratorSeed, METH_O, NULL},
 	 { "SetMinLogLevel", _wrap_SetMinLogLevel, METH_O, NULL},
 	 { "SentencePieceTrainer__TrainFromString", _wrap_SentencePieceTrainer__TrainFromString, METH_O, NULL},
@@ -20,9 +20,11 @@ import sys
 sys.path.insert(0, 'src')
 
 from collections import defaultdict
+import array
 import io
 import os
 import pickle
+import threading
 import unittest
 import sentencepiece as spm
 
@@ -267,6 +269,42 @@ class TestSentencepieceProcessor(unittest.TestCase):
         [sp2.id_to_piece(i) for i in range(sp2.get_piece_size())],
     )
 
+  def test_train_iterator_batches(self):
+    with open(os.path.join(data_dir, 'botchan.txt'), 'rb') as f:
+      lines = f.read().splitlines()
+
+    def train(sentence_iterator):
+      model = io.BytesIO()
+      spm.SentencePieceTrainer.train(
+          sentence_iterator=sentence_iterator,
+          model_writer=model,
+          vocab_size=1000,
+          logstream=open(os.devnull, 'w'),
+      )
+      sp = spm.SentencePieceProcessor(model_proto=model.getvalue())
+      return [sp.id_to_piece(i) for i in range(sp.get_piece_size())]
+
+    def buffers(batch_size):
+      for i in range(0, len(lines), batch_size):
+        batch = lines[i:i + batch_size]
+        offsets = array.array('q', [0])
+        for line in batch:
+          offsets.append(offsets[-1] + len(line))
+        yield (b''.join(batch), offsets)
+
+    expected = train(iter(lines))
+    # Batches of sentences, including an empty one.
+    self.assertEqual(
+        expected,
+        train(iter([[]] + [lines[i:i + 100] for i in range(0, len(lines), 100)])),
+    )
+    self.assertEqual(expected, train(buffers(100)))
+
+    with self.assertRaises(RuntimeError):
+      train(iter([lines[:10], [1, 2]]))
+    with self.assertRaises(IndexError):
+      train(iter([(b'abc', array.array('q', [0, 4]))]))
+
   def test_train_kwargs(self):
     # suppress logging (redirect to /dev/null)
     spm.SentencePieceTrainer.train(
@@ -720,6 +758,23 @@ class TestSentencepieceProcessor(unittest.TestCase):
     sp.sample_encode_and_score_as_immutable_proto(text, 10)
     sp.sample_encode_and_score_as_serialized_proto(text, 10)
 
+  def test_sample_encode_many(self):
+    sp = self.sp_
+    text = 'hello world'
+    texts = ['hello world', 'I have a pen.']
+
+    samples = sp.SampleEncodeMany(text, 5, alpha=0.5, out_type=str)
+    self.assertEqual(len(samples), 5)
+    for pieces in samples:
+      self.assertEqual(sp.DecodePieces(pieces), text)
+
+    samples = sp.sample_encode_many(texts, 3, alpha=0.5)
+    self.assertEqual(len(samples), len(texts))
+    for t, ids_list in zip(texts, samples):
+      self.assertEqual(len(ids_list), 3)
+      for ids in ids_list:
+        self.assertEqual(sp.DecodeIds(ids), t)
+
   def test_valid_range(self):
     size = self.sp_.piece_size()
     funcs = [
@@ -772,11 +827,157 @@ class TestSentencepieceProcessor(unittest.TestCase):
         self.assertEqual(d1, d4)
         self.assertEqual(d1, d5)
 
+    ids = sp.encode(texts, out_type=int)
+    for num_threads in [1, 8]:
+      flat, offsets = sp.encode(texts, out_type='array', num_threads=num_threads)
+      self.assertEqual(len(texts) + 1, len(offsets))
+      self.assertEqual(
+          ids, [flat[offsets[i]:offsets[i + 1]].tolist() for i in range(len(texts))])
+    self.assertEqual(ids[0], sp.encode(texts[0], out_type='array').tolist())
+    flat, offsets = sp.encode(['hello', 'world'], out_type='array', add_bos=True)
+    self.assertEqual(sp.bos_id(), flat[offsets[1]])
+    flat, offsets = sp.encode([], out_type='array')
+    self.assertEqual(([], [0]), (flat.tolist(), offsets.tolist()))
+    flat, _ = sp.encode(texts, out_type='array')
+    for dtype, format in [('uint16', 'H'), ('uint32', 'I'), ('int32', 'i')]:
+      narrow, offsets = sp.encode(texts, out_type='array', dtype=dtype)
+      self.assertEqual(format, narrow.format)
+      self.assertEqual(flat.tolist(), narrow.tolist())
+    self.assertEqual(ids[0], sp.encode(texts[0], out_type='array', dtype='uint16').tolist())
+    with self.assertRaises(RuntimeError):
+      sp.encode(texts[0], out_type='array', dtype='float32')
+
+    # The same sentences in one buffer with Arrow style offsets.
+    data = ''.join(texts).encode('utf-8')
+    offsets = array.array('q', [0])
+    for text in texts:
+      offsets.append(offsets[-1] + len(text.encode('utf-8')))
+    for num_threads in [1, 8]:
+      self.assertEqual(
+          ids, sp.encode_from_buffer(data, offsets, out_type=int, num_threads=num_threads))
+    self.assertEqual(
+        sp.encode(texts, out_type=str),
+        sp.encode_from_buffer(memoryview(data), array.array('i', offsets), out_type=str))
+    flat, flat_offsets = sp.encode_from_buffer(bytearray(data), offsets, out_type='array')
+    self.assertEqual(sp.encode(texts, out_type='array')[0].tolist(), flat.tolist())
+    self.assertEqual(len(texts) + 1, len(flat_offsets))
+    self.assertEqual([], sp.encode_from_buffer(b'', array.array('q', [0]), out_type=int))
+    with self.assertRaises(IndexError):
+      sp.encode_from_buffer(b'abc', array.array('q', [0, 4]))
+    with self.assertRaises(IndexError):
+      sp.encode_from_buffer(b'abc', array.array('i', [2, 1]))
+    with self.assertRaises(SyntaxError):
+      sp.encode_from_buffer(b'abc', array.array('d', [0, 1]))
+    with self.assertRaises(TypeError):
+      sp.encode_from_buffer('abc', array.array('q', [0, 1]))
+
+    # Arrow buffers: the 2nd string is null and the array starts at the
+    # 2nd string of the buffers.
+    validity = bytearray(b'\xff' * ((len(texts) + 7) // 8))
+    validity[0] &= ~2
+    for large_offsets in [False, True]:
+      arrow_offsets = array.array('q' if large_offsets else 'i', offsets)
+      values, list_offsets = sp.encode_arrow_buffers(
+          validity, arrow_offsets, data, offset=1, large_offsets=large_offsets)
+      self.assertEqual(len(texts), len(list_offsets))
+      self.assertEqual(8 if large_offsets else 4, list_offsets.itemsize)
+      self.assertEqual(
+          [[]] + [sp.encode(text) for text in texts[2:]],
+          [values[list_offsets[i]:list_offsets[i + 1]].tolist() for i in range(len(texts) - 1)])
+    values, list_offsets = sp.encode_arrow_buffers(None, array.array('i', offsets), data,
+                                                   length=2, add_bos=True)
+    self.assertEqual([sp.bos_id()] + sp.encode(texts[0]) + [sp.bos_id()] + sp.encode(texts[1]),
+                     values.tolist())
+    self.assertEqual(3, len(list_offsets))
+    with self.assertRaises(IndexError):
+      sp.encode_arrow_buffers(None, array.array('i', [0, 4]), b'abc')
+    with self.assertRaises(RuntimeError):
+      sp.encode_arrow_buffers(None, array.array('i', [2, 1]), b'abc')
+    with self.assertRaises(RuntimeError):
+      sp.encode_arrow_buffers(None, array.array('i', [0, 1]), b'abc', offset=2)
+
+    # Padded matrix of ids.
+    batch = texts[:20]
+    encoded = [sp.encode(text) for text in batch]
+    longest = max(len(ids) for ids in encoded)
+    ids, mask = sp.encode_padded(batch, pad_id=0, num_threads=4)
+    self.assertEqual((len(batch), longest), ids.shape)
+    self.assertEqual(ids.shape, mask.shape)
+    for row, mask_row, expected in zip(ids.tolist(), mask.tolist(), encoded):
+      self.assertEqual(expected + [0] * (longest - len(expected)), row)
+      self.assertEqual([1] * len(expected) + [0] * (longest - len(expected)), mask_row)
+    ids, mask = sp.encode_padded(batch, max_length=10, padding='max_length',
+                                 pad_to_multiple_of=8, padding_side='left',
+                                 truncation_side='left', pad_id=0, add_bos=True, add_eos=True)
+    self.assertEqual((len(batch), 16), ids.shape)
+    for row, mask_row, expected in zip(ids.tolist(), mask.tolist(), encoded):
+      expected = [sp.bos_id()] + expected[-8:] + [sp.eos_id()]
+      self.assertEqual([0] * (16 - len(expected)) + expected, row)
+      self.assertEqual(len(expected), sum(mask_row))
+    ids, mask = sp.encode_padded(batch, max_length=3, pad_id=0)
+    self.assertEqual([e[:3] + [0] * (3 - len(e[:3])) for e in encoded], ids.tolist())
+    ids, mask = sp.encode_padded([], pad_id=0)
+    self.assertEqual(([], []), (ids.tolist(), mask.tolist()))
+    with self.assertRaises(RuntimeError):
+      sp.encode_padded(batch, pad_id=-1)
+    with self.assertRaises(RuntimeError):
+      sp.encode_padded(batch, padding='max_length', pad_id=0)
+
+    # Corpus encoding, longest first.
+    self.assertEqual(sp.encode(texts), sp.encode_corpus(texts))
+    ids, stats = sp.encode_corpus(texts, add_bos=True, with_stats=True)
+    self.assertEqual(sp.encode(texts, add_bos=True), ids)
+    self.assertEqual(len(texts), sum(stats['num_inputs']))
+    self.assertEqual(sum(len(text.encode('utf-8')) for text in texts), sum(stats['num_bytes']))
+    self.assertEqual(len(stats['busy_seconds']), len(stats['utilization']))
+    self.assertGreater(stats['elapsed_seconds'], 0.0)
+    self.assertEqual([], sp.encode_corpus([]))
     e1 = sp.calculate_entropy(texts, alpha=1.0, num_threads=10)
     e2 = sp.CalculateEntropy(texts, alpha=1.0, num_threads=10)
     e3 = [sp.calculate_entropy(s, alpha=1.0) for s in texts]
     self.assertEqual(e1, e2)
     self.assertEqual(e1, e3)
+    e4, counts = sp.calculate_entropy(texts[:100], alpha=1.0,
+                                      with_expected_counts=True)
+    self.assertEqual(len(e4), len(counts))
+    for e, expected, text, count in zip(e4, e1, texts, counts):
+      self.assertAlmostEqual(expected, e, places=4)
+      self.assertTrue(all(0 <= i < sp.get_piece_size() for i in count))
+      self.assertTrue(all(c > 0.0 for c in count.values()))
+      # The best segmentation is among the possible ones.
+      self.assertTrue(all(i in count for i in sp.encode(text)))
+    e, count = sp.calculate_entropy(texts[0], 1.0, with_expected_counts=True)
+    self.assertEqual(e4[0], e)
+    self.assertEqual(counts[0], count)
+
+  def test_threads(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model')
+    )
+    with open(os.path.join(data_dir, 'botchan.txt'), 'r') as file:
+      texts = file.readlines()
+    expected = [sp.encode(s) for s in texts]
+
+    # The GIL is released while encoding, so the threads run concurrently.
+    results = [None] * 4
+
+    def _run(index):
+      ids = [sp.encode(s) for s in texts]
+      results[index] = (ids, [sp.decode(s) for s in ids],
+                        sp.encode(texts, out_type='array'))
+
+    threads = [threading.Thread(target=_run, args=(i,)) for i in range(4)]
+    for thread in threads:
+      thread.start()
+    for thread in threads:
+      thread.join()
+    for ids, decoded, (flat, offsets) in results:
+      self.assertEqual(expected, ids)
+      self.assertEqual(sp.decode(expected), decoded)
+      self.assertEqual(len(texts) + 1, len(offsets))
+
+    with self.assertRaises(IndexError):
+      sp.decode([sp.piece_size()])
 
   def test_pickle(self):
     with open('sp.pickle', 'wb') as f:
@@ -791,11 +992,53 @@ class TestSentencepieceProcessor(unittest.TestCase):
 
     self.assertEqual(id1, id2)
 
+  def test_model_handle(self):
+    # The processor of setUp() is loaded from a serialized proto.
+    with self.assertRaises(RuntimeError):
+      self.sp_.get_model_handle()
+
+    model_file = os.path.join('test', 'test_model.model')
+    sp = spm.SentencePieceProcessor(model_file=model_file, out_type=str)
+    self.assertEqual(model_file, sp.model_file())
+    handle = pickle.loads(pickle.dumps(sp.get_model_handle()))
+    self.assertEqual(model_file, handle.model_file)
+    self.assertIs(handle.get(), handle.Get())
+    self.assertEqual(
+        sp.encode('hello world.'), handle.get().encode('hello world.')
+    )
+
+  def test_benchmark(self):
+    from sentencepiece import benchmark
+
+    lines = ['hello world.', 'I saw a girl with a telescope.', '']
+    encode = benchmark.EncodeTimes(self.sp_, lines, min_seconds=0.0)
+    for name in ['single', 'single_swig', 'batch', 'batch_swig',
+                 'batch_rewrite_swig', 'batch_flat', 'buffer_flat']:
+      self.assertGreater(encode[name], 0.0)
+    breakdown = benchmark.EncodeBreakdown(encode)
+    self.assertEqual(['c++', 'input', 'output', 'arguments'],
+                     [name for name, _ in breakdown])
+    self.assertAlmostEqual(encode['batch'],
+                           sum(seconds for _, seconds in breakdown))
+
+    decode = benchmark.DecodeTimes(self.sp_, lines, min_seconds=0.0)
+    self.assertEqual(['batch', 'batch_swig', 'single', 'single_swig'],
+                     sorted(decode.keys()))
+
+    for batch in [False, True]:
+      times = benchmark.ThreadTimes(self.sp_, lines, [1, 2], batch,
+                                    min_seconds=0.0)
+      self.assertEqual([1, 2], sorted(times.keys()))
+
   def test_global_params(self):
     spm.SetRandomGeneratorSeed(0)
     spm.SetMinLogLevel(2)
     spm.set_random_generator_seed(1)
     spm.set_min_log_level(3)
+    self.assertGreaterEqual(spm.get_default_num_threads(), 1)
+    self.assertEqual(spm.GetDefaultNumThreads(), spm.get_default_num_threads())
+    with self.assertRaises(TypeError):
+      spm.configure_thread_pools(2, 0)
 
   def test_normalize(self):
     sp = spm.SentencePieceProcessor(
@@ -840,6 +1083,40 @@ class TestSentencepieceProcessor(unittest.TestCase):
     self.assertEqual('▁平成', x[1][0])
     self.assertEqual([0, 0, 0, 1], x[1][1])
 
+  def test_normalize_batch(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model')
+    )
+
+    inputs = ['ＫＡＤＯＫＡＷＡABC', '', '㍻', 'hello  world'] * 10
+    text, offsets = sp.normalize_batch(inputs)
+    self.assertEqual(len(inputs) + 1, len(offsets))
+    self.assertEqual(
+        [sp.normalize(x).encode('utf8') for x in inputs],
+        [text[offsets[i]:offsets[i + 1]] for i in range(len(inputs))],
+    )
+
+    text, offsets, runs, run_offsets = sp.NormalizeBatch(
+        inputs, with_offsets=True
+    )
+    self.assertEqual(len(inputs) + 1, len(run_offsets))
+    self.assertEqual(3 * run_offsets[-1], len(runs))
+    for i, x in enumerate(inputs):
+      _, expected = sp.normalize(x.encode('utf8'), with_offsets=True)
+      length = offsets[i + 1] - offsets[i]
+      expanded = []
+      for j in range(run_offsets[i], run_offsets[i + 1]):
+        norm, orig, identity = runs[3 * j:3 * j + 3]
+        end = runs[3 * j + 3] if j + 1 < run_offsets[i + 1] else length + 1
+        expanded += [orig + (k - norm) * identity for k in range(norm, end)]
+      self.assertEqual(expected, expanded)
+
+    text, offsets, runs, run_offsets = sp.normalize_batch([], True)
+    self.assertEqual((b'', [0], [], [0]),
+                     (text, list(offsets), list(runs), list(run_offsets)))
+    with self.assertRaises(TypeError):
+      sp.normalize_batch('not a list')
+
   def test_normalizer(self):
     sp = spm.SentencePieceNormalizer(
         model_file=os.path.join('test', 'test_model.model')
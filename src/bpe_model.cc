@@ -14,10 +14,12 @@
 
 #include "bpe_model.h"
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <queue>
 #include <random>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -28,15 +30,383 @@
 namespace sentencepiece {
 namespace bpe {
 
+namespace {
+// Buffers kept across EncodeWithScratch() calls.
+class BPEEncodeScratch : public EncodeScratch {
+ public:
+  explicit BPEEncodeScratch(const ModelInterface *model)
+      : EncodeScratch(model) {}
+  std::vector<Model::Symbol> symbols;
+  std::vector<Model::SymbolPair> agenda;
+};
+
+// Orders the agenda by score, then by the left position.
+struct SymbolPairLess {
+  bool operator()(const Model::SymbolPair &h1,
+                  const Model::SymbolPair &h2) const {
+    return (h1.score < h2.score ||
+            (h1.score == h2.score && h1.left > h2.left));
+  }
+};
+}  // namespace
+
+MergeTable::MergeTable(size_t size) {
+  size_t capacity = 16;
+  while (capacity < 2 * size) capacity *= 2;
+  entries_.resize(capacity);
+  mask_ = capacity - 1;
+}
+
+void MergeTable::Insert(int left, int right, int merged) {
+  if (2 * (size_ + 1) > entries_.size()) {
+    MergeTable larger(2 * (size_ + 1));
+    ForEach([&larger](int l, int r, int m) { larger.Insert(l, r, m); });
+    *this = std::move(larger);
+  }
+  for (size_t i = Hash(left, right) & mask_;; i = (i + 1) & mask_) {
+    auto &entry = entries_[i];
+    if (entry.merged < 0) {
+      entry.left = left;
+      entry.right = right;
+      entry.merged = merged;
+      ++size_;
+      return;
+    }
+    if (entry.left == left && entry.right == right) {
+      entry.merged = merged;
+      return;
+    }
+  }
+}
+
 Model::Model(const ModelProto &model_proto) {
   model_proto_ = &model_proto;
   InitializePieces();
+  if (!status().ok()) return;
+  InitializeByteIds();
+
+  std::vector<std::tuple<int, int, int>> rules;
+  for (int id = 0; id < static_cast<int>(piece_info_.size()); ++id) {
+    if (!IsNormalPieceType(piece_info_[id].type)) continue;
+    const absl::string_view piece = *piece_info_[id].piece;
+    for (size_t len = 1; len < piece.size(); ++len) {
+      const int left = FindNormalPiece(piece.substr(0, len));
+      if (left < 0) continue;
+      const int right = FindNormalPiece(piece.substr(len));
+      if (right < 0) continue;
+      rules.emplace_back(left, right, id);
+    }
+  }
+
+  merges_ = MergeTable(rules.size());
+  for (const auto &rule : rules) {
+    merges_.Insert(std::get<0>(rule), std::get<1>(rule), std::get<2>(rule));
+  }
+}
+
+Model::Model(const ModelProto &model_proto, absl::string_view merges_blob) {
+  model_proto_ = &model_proto;
+  InitializePieces();
+  if (!status().ok()) return;
+  InitializeByteIds();
+
+  auto read_uint32 = [&merges_blob](uint32_t *value) {
+    if (!string_util::DecodePOD<uint32_t>(
+            merges_blob.substr(0, sizeof(*value)), value)) {
+      return false;
+    }
+#ifdef IS_BIG_ENDIAN
+    *value = util::Swap32(*value);
+#endif
+    merges_blob.remove_prefix(sizeof(*value));
+    return true;
+  };
+
+  uint32_t num_rules = 0;
+  if (!read_uint32(&num_rules) ||
+      merges_blob.size() != 3 * sizeof(uint32_t) * num_rules) {
+    status_ = util::InternalError("Blob for the merge table is broken.");
+    return;
+  }
+
+  const int num_pieces = model_proto_->pieces_size();
+  merges_ = MergeTable(num_rules);
+  for (uint32_t i = 0; i < num_rules; ++i) {
+    uint32_t ids[3] = {0, 0, 0};
+    for (auto &id : ids) read_uint32(&id);
+    for (const auto id : ids) {
+      if (id >= static_cast<uint32_t>(num_pieces)) {
+        status_ = util::InternalError("Invalid id in the merge table.");
+        return;
+      }
+    }
+    const auto &left = model_proto_->pieces(ids[0]).piece();
+    const auto &right = model_proto_->pieces(ids[1]).piece();
+    const auto &merged = model_proto_->pieces(ids[2]).piece();
+    if (merged.size() != left.size() + right.size() ||
+        merged.compare(0, left.size(), left) != 0 ||
+        merged.compare(left.size(), right.size(), right) != 0) {
+      status_ = util::InternalError("The merge table does not match pieces: " +
+                                    merged);
+      return;
+    }
+    merges_.Insert(ids[0], ids[1], ids[2]);
+  }
 }
 
 Model::~Model() {}
 
+void Model::GetMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::GetMemoryUsage(usage);
+  usage->model_tables += merges_.MemoryUsage();
+}
+
+void Model::InitializeByteIds() {
+  std::fill(byte_ids_, byte_ids_ + 256, -1);
+  for (int id = 0; id < static_cast<int>(piece_info_.size()); ++id) {
+    const std::string &piece = *piece_info_[id].piece;
+    if (piece.size() == 1 && IsNormalPieceType(piece_info_[id].type)) {
+      byte_ids_[static_cast<unsigned char>(piece[0])] = id;
+    }
+  }
+}
+
+std::string Model::SerializeMerges() const {
+  auto append_uint32 = [](uint32_t value, std::string *output) {
+#ifdef IS_BIG_ENDIAN
+    value = util::Swap32(value);
+#endif
+    output->append(string_util::EncodePOD<uint32_t>(value));
+  };
+
+  std::string blob;
+  append_uint32(merges_.size(), &blob);
+  merges_.ForEach([&](int left, int right, int merged) {
+    append_uint32(left, &blob);
+    append_uint32(right, &blob);
+    append_uint32(merged, &blob);
+  });
+  return blob;
+}
+
+EncodeResult Model::Encode(absl::string_view normalized) const {
+  EncodeResult result;
+  std::unique_ptr<EncodeScratch> scratch;
+  EncodeWithScratch(normalized, &result, &scratch);
+  return result;
+}
+
+void Model::EncodeWithScratch(absl::string_view normalized,
+                              EncodeResult *result,
+                              std::unique_ptr<EncodeScratch> *scratch) const {
+  EncodeWithRestriction(normalized, nullptr, result, scratch);
+}
+
+void Model::EncodeRestricted(absl::string_view normalized,
+                             const VocabularyRestriction &restriction,
+                             EncodeResult *result,
+                             std::unique_ptr<EncodeScratch> *scratch) const {
+  EncodeWithRestriction(normalized, &restriction, result, scratch);
+}
+
+void Model::EncodeWithRestriction(
+    absl::string_view normalized, const VocabularyRestriction *restriction,
+    EncodeResult *result, std::unique_ptr<EncodeScratch> *scratch) const {
+  if (*scratch == nullptr || (*scratch)->owner() != this) {
+    *scratch = std::make_unique<BPEEncodeScratch>(this);
+  }
+  auto *buffers = static_cast<BPEEncodeScratch *>(scratch->get());
+  if (!EncodeDeterministic(normalized, restriction, &buffers->symbols,
+                           &buffers->agenda, result)) {
+    *result = SampleEncode(normalized, 0.0, restriction);
+  }
+}
+
+int Model::LookupMerge(const Symbol &left, const Symbol &right) const {
+  if (left.id >= 0 && right.id >= 0) {
+    return merges_.Find(left.id, right.id);
+  }
+  // Symbols out of the vocabulary, e.g., unknown characters.
+  return FindNormalPiece(absl::string_view(
+      left.piece.data(), left.piece.size() + right.piece.size()));
+}
+
+bool Model::EncodeDeterministic(absl::string_view normalized,
+                                const VocabularyRestriction *restriction,
+                                std::vector<Symbol> *symbols,
+                                std::vector<SymbolPair> *agenda,
+                                EncodeResult *output,
+                                MergeTree *tree) const {
+  output->clear();
+  symbols->clear();
+  agenda->clear();
+  if (tree != nullptr) {
+    tree->nodes.clear();
+    tree->roots.clear();
+  }
+  if (!status().ok() || normalized.empty()) {
+    return true;
+  }
+
+  // Lookup new symbol pair at [left, right] and inserts it to agenda.
+  // Returns false if the merged piece is unused.
+  auto MaybeAddNewSymbolPair = [this, restriction, symbols, agenda](int left,
+                                                                 int right) {
+    if (left == -1 || right == -1) return true;
+    const auto &l = (*symbols)[left];
+    const auto &r = (*symbols)[right];
+    if (l.freeze || r.freeze) return true;
+    const int id = LookupMerge(l, r);
+    if (id < 0) return true;
+    if (IsUnusedInlined(id, restriction)) return false;
+    const size_t size = l.piece.size() + r.piece.size();
+    agenda->push_back({left, right, id, GetScoreInlined(id), size});
+    std::push_heap(agenda->begin(), agenda->end(), SymbolPairLess());
+    return true;
+  };
+
+  // Splits the input into character sequence
+  int index = 0;
+  while (!normalized.empty()) {
+    Symbol s;
+    const int mblen = matcher_->PrefixMatch(normalized, &s.freeze);
+    s.piece = absl::string_view(normalized.data(), mblen);
+    if (mblen == 1) {
+      s.id = byte_ids_[static_cast<unsigned char>(normalized[0])];
+    } else {
+      s.id = FindNormalPiece(s.piece);
+    }
+    s.prev = index == 0 ? -1 : index - 1;
+    normalized.remove_prefix(mblen);
+    s.next = normalized.empty() ? -1 : index + 1;
+    ++index;
+    symbols->emplace_back(s);
+    // The leaves, and the node of each symbol in `roots` until the end.
+    if (tree != nullptr) {
+      tree->nodes.push_back(
+          {s.piece, s.id >= 0 ? s.id : PieceToId(s.piece), -1, -1});
+      tree->roots.push_back(tree->nodes.size() - 1);
+    }
+  }
+
+  // Lookup all bigrams.
+  for (size_t i = 1; i < symbols->size(); ++i) {
+    if (!MaybeAddNewSymbolPair(i - 1, i)) return false;
+  }
+
+  // Main loop.
+  auto &sym = *symbols;
+  while (!agenda->empty()) {
+    std::pop_heap(agenda->begin(), agenda->end(), SymbolPairLess());
+    const SymbolPair top = agenda->back();
+    agenda->pop_back();
+
+    // `top` is no longer available.
+    if (sym[top.left].piece.empty() || sym[top.right].piece.empty() ||
+        sym[top.left].piece.size() + sym[top.right].piece.size() != top.size) {
+      continue;
+    }
+
+    // Replaces symbols with `top` rule.
+    sym[top.left].piece =
+        absl::string_view(sym[top.left].piece.data(), top.size);
+    sym[top.left].id = top.id;
+
+    // Updates prev/next pointers.
+    sym[top.left].next = sym[top.right].next;
+    if (sym[top.right].next >= 0) {
+      sym[sym[top.right].next].prev = top.left;
+    }
+    sym[top.right].piece = absl::string_view("");
+
+    if (tree != nullptr) {
+      tree->nodes.push_back({sym[top.left].piece, top.id,
+                             tree->roots[top.left], tree->roots[top.right]});
+      tree->roots[top.left] = tree->nodes.size() - 1;
+    }
+
+    // Adds new symbol pairs which are newly added after symbol replacement.
+    if (!MaybeAddNewSymbolPair(sym[top.left].prev, top.left) ||
+        !MaybeAddNewSymbolPair(top.left, sym[top.left].next)) {
+      return false;
+    }
+  }
+
+  for (int index = 0; index != -1; index = sym[index].next) {
+    const auto &s = sym[index];
+    output->emplace_back(s.piece, s.id >= 0 ? s.id : PieceToId(s.piece));
+  }
+
+  if (tree != nullptr) {
+    size_t size = 0;
+    for (int index = 0; index != -1; index = sym[index].next) {
+      tree->roots[size++] = tree->roots[index];
+    }
+    tree->roots.resize(size);
+  }
+
+  return true;
+}
+
+bool Model::BuildMergeTree(absl::string_view normalized,
+                           MergeTree *tree) const {
+  std::vector<Symbol> symbols;
+  std::vector<SymbolPair> agenda;
+  EncodeResult output;
+  return EncodeDeterministic(normalized, nullptr, &symbols, &agenda, &output,
+                             tree);
+}
+
+// static
+void Model::SampleMergeTree(const MergeTree &tree, float alpha,
+                            EncodeResult *output) {
+  output->clear();
+  random::RandomGenerator *rand_gen = nullptr;
+  std::vector<int> stack;
+  for (const int root : tree.roots) {
+    stack.push_back(root);
+    while (!stack.empty()) {
+      const auto &node = tree.nodes[stack.back()];
+      stack.pop_back();
+      bool drop = false;
+      if (node.left >= 0 && alpha > 0.0) {
+        if (alpha >= 1.0) {
+          drop = true;
+        } else {
+          if (rand_gen == nullptr) rand_gen = random::GetRandomGenerator();
+          drop = rand_gen->UniformDouble() < alpha;
+        }
+      }
+      if (drop) {
+        stack.push_back(node.right);
+        stack.push_back(node.left);
+      } else {
+        output->emplace_back(node.piece, node.id);
+      }
+    }
+  }
+}
+
+std::vector<EncodeResult> Model::SampleEncodeMany(absl::string_view normalized,
+                                                  float alpha,
+                                                  int num_samples) const {
+  MergeTree tree;
+  if (!BuildMergeTree(normalized, &tree)) {
+    return ModelInterface::SampleEncodeMany(normalized, alpha, num_samples);
+  }
+  std::vector<EncodeResult> results(std::max(num_samples, 0));
+  for (auto &result : results) SampleMergeTree(tree, alpha, &result);
+  return results;
+}
+
 std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     absl::string_view normalized, float alpha) const {
+  return SampleEncode(normalized, alpha, nullptr);
+}
+
+EncodeResult Model::SampleEncode(
+    absl::string_view normalized, float alpha,
+    const VocabularyRestriction *restriction) const {
   if (!status().ok() || normalized.empty()) {
     return {};
   }
@@ -80,7 +450,8 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
   model::FreeList<SymbolPair> symbol_pair_allocator(kPreallocateSymbolPairSize);
 
   // Lookup new symbol pair at [left, right] and inserts it to agenda.
-  auto MaybeAddNewSymbolPair = [this, &symbol_pair_allocator, &symbols, &agenda,
+  auto MaybeAddNewSymbolPair = [this, restriction, &symbol_pair_allocator,
+                                &symbols, &agenda,
                                 &rev_merge](int left, int right) {
     if (left == -1 || right == -1 || symbols[left].freeze ||
         symbols[right].freeze)
@@ -88,19 +459,19 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     const absl::string_view piece(
         symbols[left].piece.data(),
         symbols[left].piece.size() + symbols[right].piece.size());
-    const auto it = pieces_.find(piece);
-    if (it == pieces_.end()) {
+    const int id = FindNormalPiece(piece);
+    if (id < 0) {
       return;
     }
     auto *h = symbol_pair_allocator.Allocate();
     h->left = left;
     h->right = right;
-    h->score = GetScore(it->second);
+    h->score = GetScore(id);
     h->size = piece.size();
     agenda.push(h);
 
     // Makes `rev_merge` for resegmentation.
-    if (IsUnusedInlined(it->second)) {
+    if (IsUnusedInlined(id, restriction)) {
       rev_merge[piece] =
           std::make_pair(symbols[left].piece, symbols[right].piece);
     }
@@ -129,13 +500,12 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
   }
 
   // BPE-dropout: https://arxiv.org/pdf/1910.13267.pdf
-  std::mt19937 *rand_gen = nullptr;
+  random::RandomGenerator *rand_gen = nullptr;
   auto skip_merge = [&]() {
     if (alpha <= 0.0) return false;
     if (alpha >= 1.0) return true;
     if (rand_gen == nullptr) rand_gen = random::GetRandomGenerator();
-    std::uniform_real_distribution<> gen(0.0, 1.0);
-    return gen(*rand_gen) < alpha;
+    return rand_gen->UniformDouble() < alpha;
   };
 
   // Main loop.
@@ -173,10 +543,10 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
   }
 
   std::function<void(absl::string_view, EncodeResult *)> resegment;
-  resegment = [this, &resegment, &rev_merge](absl::string_view w,
-                                             EncodeResult *output) -> void {
+  resegment = [this, restriction, &resegment, &rev_merge](
+                  absl::string_view w, EncodeResult *output) -> void {
     const int id = PieceToId(w);
-    if (id == -1 || !IsUnusedInlined(id)) {
+    if (id == -1 || !IsUnusedInlined(id, restriction)) {
       output->emplace_back(w, id);
       return;
     }
@@ -21,6 +21,55 @@
 namespace sentencepiece {
 namespace bpe {
 
+// Open-addressing hash table from a pair of piece ids to the id of the piece
+// made by merging them. Uses linear probing over a power-of-two array.
+class MergeTable {
+ public:
+  // Creates an empty table that can hold `size` entries.
+  explicit MergeTable(size_t size = 0);
+
+  // Inserts or overwrites the rule `left` + `right` -> `merged`.
+  void Insert(int left, int right, int merged);
+
+  // Returns the id merged from `left` and `right`, or -1.
+  inline int Find(int left, int right) const {
+    for (size_t i = Hash(left, right) & mask_;; i = (i + 1) & mask_) {
+      const auto &entry = entries_[i];
+      if (entry.merged < 0) return -1;
+      if (entry.left == left && entry.right == right) return entry.merged;
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  size_t MemoryUsage() const { return port::VectorBytes(entries_); }
+
+  // Calls `func(left, right, merged)` for all the entries.
+  template <typename Func>
+  void ForEach(Func &&func) const {
+    for (const auto &entry : entries_) {
+      if (entry.merged >= 0) func(entry.left, entry.right, entry.merged);
+    }
+  }
+
+ private:
+  struct Entry {
+    int left = -1;
+    int right = -1;
+    int merged = -1;  // -1 for an empty slot.
+  };
+
+  static inline size_t Hash(int left, int right) {
+    const uint64 key = (static_cast<uint64>(static_cast<uint32>(left)) << 32) |
+                       static_cast<uint32>(right);
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32);
+  }
+
+  std::vector<Entry> entries_;
+  size_t mask_ = 0;
+  size_t size_ = 0;
+};
+
 // Segmentation model with BPE (Byte Pair Encoding)
 // Details:
 // Neural Machine Translation of Rare Words with Subword Units
@@ -30,11 +79,31 @@ namespace bpe {
 class Model : public ModelInterface {
  public:
   explicit Model(const ModelProto &model_proto);
+
+  // Instantiates the model with a merge table serialized by SerializeMerges()
+  // instead of deriving it from the pieces. Every rule is validated against
+  // the pieces.
+  Model(const ModelProto &model_proto, absl::string_view merges_blob);
+
   ~Model() override;
 
-  EncodeResult Encode(absl::string_view normalized) const override {
-    return SampleEncode(normalized, 0.0);
-  }
+  // Returns the merge table as a binary blob.
+  // <num_rules (4byte)><left id, right id, merged id (4byte each)>*
+  std::string SerializeMerges() const;
+
+  // Adds the merge table.
+  void GetMemoryUsage(MemoryUsage *usage) const override;
+
+  EncodeResult Encode(absl::string_view normalized) const override;
+
+  void EncodeWithScratch(
+      absl::string_view normalized, EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
+  void EncodeRestricted(
+      absl::string_view normalized, const VocabularyRestriction &restriction,
+      EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
 
   // Sampling with BPE-dropout: https://arxiv.org/pdf/1910.13267.pdf
   // `alpha` is dropout probability in BPE-dropout paper.
@@ -43,9 +112,96 @@ class Model : public ModelInterface {
   EncodeResult SampleEncode(absl::string_view normalized,
                             float alpha) const override;
 
+  // Draws `num_samples` samples with BPE-dropout from the merge tree of
+  // `normalized`, which is built only once. See SampleMergeTree().
+  std::vector<EncodeResult> SampleEncodeMany(absl::string_view normalized,
+                                             float alpha,
+                                             int num_samples) const override;
+
   bool IsSampleEncodeAvailable() const override { return true; }
 
   bool IsNBestEncodeAvailable() const override { return false; }
+
+  // A symbol in the deterministic encoder.
+  struct Symbol {
+    int prev;     // prev index of this symbol. -1 for BOS.
+    int next;     // next index of this symbol. -1 for EOS.
+    int id;       // id of `piece` in pieces_, or -1.
+    bool freeze;  // this symbol is never be merged.
+    absl::string_view piece;
+  };
+
+  // A merge candidate of two adjacent symbols.
+  struct SymbolPair {
+    int left;     // left index of this pair
+    int right;    // right index of this pair
+    int id;       // id of the merged piece
+    float score;  // score of this pair. large is better.
+    size_t size;  // length of this piece
+  };
+
+  // The merges made by the deterministic encoder. Each piece of the
+  // encoding is the root of a binary tree whose leaves are the characters.
+  struct MergeTree {
+    struct Node {
+      absl::string_view piece;
+      int id;     // id of `piece`, or the unk id.
+      int left;   // index of the left child. -1 for a leaf.
+      int right;  // index of the right child. -1 for a leaf.
+    };
+    std::vector<Node> nodes;
+    std::vector<int> roots;  // The pieces of the encoding.
+  };
+
+  // Builds the merge tree of `normalized`, which can be kept to draw many
+  // samples, e.g. for a frequent word. Returns false when a merge
+  // candidate is an unused piece; such inputs need SampleEncode().
+  bool BuildMergeTree(absl::string_view normalized, MergeTree *tree) const;
+
+  // Samples from `tree` with BPE-dropout by expanding each node into its
+  // children with `alpha` probability, from the roots. This is the same as
+  // SampleEncode() unless a dropped merge lets the characters merge in
+  // another way: the samples are always refinements of the deterministic
+  // encoding, and no agenda is rebuilt for a sample.
+  static void SampleMergeTree(const MergeTree &tree, float alpha,
+                              EncodeResult *output);
+
+ private:
+  // Returns the id of the piece made by merging `left` and `right`, or -1.
+  int LookupMerge(const Symbol &left, const Symbol &right) const;
+
+  // The same as SampleEncode(normalized, 0.0), but works on the reusable
+  // buffers and never hashes strings of merge candidates. Returns false,
+  // leaving `output` unspecified, when a candidate is an unused piece; such
+  // inputs need the resegmentation done by SampleEncode(). Also records the
+  // merges in `tree` if it is given.
+  bool EncodeDeterministic(absl::string_view normalized,
+                           const VocabularyRestriction *restriction,
+                           std::vector<Symbol> *symbols,
+                           std::vector<SymbolPair> *agenda,
+                           EncodeResult *output,
+                           MergeTree *tree = nullptr) const;
+
+  // The same as SampleEncode(), but also treats the ids unused in
+  // `restriction` as unused pieces when it is given.
+  EncodeResult SampleEncode(absl::string_view normalized, float alpha,
+                            const VocabularyRestriction *restriction) const;
+
+  // EncodeWithScratch() and EncodeRestricted().
+  void EncodeWithRestriction(absl::string_view normalized,
+                             const VocabularyRestriction *restriction,
+                             EncodeResult *result,
+                             std::unique_ptr<EncodeScratch> *scratch) const;
+
+  // Initializes `byte_ids_`.
+  void InitializeByteIds();
+
+  // (left id, right id) -> id of the merged piece. Holds every way of
+  // splitting a piece into two pieces.
+  MergeTable merges_;
+
+  // Ids of the single-byte pieces, or -1.
+  int byte_ids_[256];
 };
 }  // namespace bpe
 }  // namespace sentencepiece
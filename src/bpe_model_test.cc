@@ -13,6 +13,7 @@
 // limitations under the License.!
 
 #include <cstdio>
+#include <random>
 #include <string>
 
 #include "bpe_model.h"
@@ -186,6 +187,92 @@ TEST(BPEModelTest, EncodeAmbiguousTest) {
   EXPECT_EQ(broken_utf8, result[0].first);
 }
 
+TEST(BPEModelTest, EncodeWithScratchTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+
+  AddPiece(&model_proto, "a", -1.0);
+  AddPiece(&model_proto, "b", -1.1);
+  AddPiece(&model_proto, "c", -1.2);
+  AddPiece(&model_proto, "\xE3\x81\x82", -1.3);
+  AddPiece(&model_proto, "ab", -0.1);
+  AddPiece(&model_proto, "bc", -0.1);
+  AddPiece(&model_proto, "abc", -0.2);
+  AddPiece(&model_proto, "ca", -0.3);
+  AddPiece(&model_proto, "cab", -0.4);
+  AddPiece(&model_proto, "a\xE3\x81\x82", -0.5);
+  AddPiece(&model_proto, "xa", -0.6);  // "x" is not a piece.
+  AddPiece(&model_proto, "xab", -0.7);
+
+  const Model model(model_proto);
+  const std::vector<std::string> chars = {"a", "b", "c", "x",
+                                          "\xE3\x81\x82"};
+  std::mt19937 gen(1);
+  EncodeResult result;
+  std::unique_ptr<EncodeScratch> scratch;
+  for (int i = 0; i < 1000; ++i) {
+    std::string text;
+    const int len = gen() % 20;
+    for (int j = 0; j < len; ++j) text += chars[gen() % chars.size()];
+    const auto expected = model.SampleEncode(text, 0.0);
+    EXPECT_EQ(expected, model.Encode(text));
+    model.EncodeWithScratch(text, &result, &scratch);
+    EXPECT_EQ(expected, result);
+  }
+
+  // Unused pieces are resegmented.
+  model_proto.mutable_pieces(9)->set_type(ModelProto::SentencePiece::UNUSED);
+  const Model unused_model(model_proto);
+  for (const auto *text : {"abc", "cabc", "xabca"}) {
+    EXPECT_EQ(unused_model.SampleEncode(text, 0.0), unused_model.Encode(text));
+  }
+}
+
+TEST(BPEModelTest, MergeTableTest) {
+  MergeTable table;
+  for (int i = 0; i < 1000; ++i) table.Insert(i, i + 1, i + 2);
+  EXPECT_EQ(1000, table.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i + 2, table.Find(i, i + 1));
+    EXPECT_EQ(-1, table.Find(i + 1, i));
+  }
+  table.Insert(3, 4, 0);
+  EXPECT_EQ(0, table.Find(3, 4));
+  EXPECT_EQ(1000, table.size());
+}
+
+TEST(BPEModelTest, SerializeMergesTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "abcd", 10.0);  // 3
+  AddPiece(&model_proto, "abc", 5.0);    // 4
+  AddPiece(&model_proto, "ab", 2.0);     // 5
+  AddPiece(&model_proto, "cd", 1.0);     // 6
+  AddPiece(&model_proto, "a", 0.0);      // 7
+  AddPiece(&model_proto, "b", 0.0);      // 8
+  AddPiece(&model_proto, "c", 0.0);      // 9
+  AddPiece(&model_proto, "d", 0.0);      // 10
+
+  const Model model(model_proto);
+  const std::string blob = model.SerializeMerges();
+  // ab+cd, abc+d, ab+c, a+b, c+d.
+  EXPECT_EQ(4 + 5 * 12, blob.size());
+
+  const Model precompiled(model_proto, blob);
+  EXPECT_TRUE(precompiled.status().ok());
+  for (const auto *text : {"abcd", "dcba", "abcabcd", "xabd"}) {
+    EXPECT_EQ(model.Encode(text), precompiled.Encode(text));
+  }
+
+  // Broken blobs.
+  EXPECT_FALSE(Model(model_proto, "").status().ok());
+  EXPECT_FALSE(
+      Model(model_proto, blob.substr(0, blob.size() - 1)).status().ok());
+
+  // The rules do not match the pieces.
+  ModelProto other_proto = model_proto;
+  other_proto.mutable_pieces(5)->set_piece("ba");
+  EXPECT_FALSE(Model(other_proto, blob).status().ok());
+}
+
 TEST(BPEModelTest, NotSupportedTest) {
   ModelProto model_proto = MakeBaseModelProto();
   const Model model(model_proto);
@@ -294,6 +381,64 @@ TEST(SampleModelTest, EncodeTest) {
   }
 }
 
+TEST(SampleModelTest, MergeTreeTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "ab", 0.0);
+  AddPiece(&model_proto, "cd", -0.1);
+  AddPiece(&model_proto, "abc", -0.2);
+  AddPiece(&model_proto, "abcd", -0.3);
+  AddPiece(&model_proto, "a", -0.4);
+  AddPiece(&model_proto, "b", -0.5);
+  AddPiece(&model_proto, "c", -0.6);
+  AddPiece(&model_proto, "d", -0.7);
+
+  const Model model(model_proto);
+  Model::MergeTree tree;
+  ASSERT_TRUE(model.BuildMergeTree("abcdxab", &tree));
+  ASSERT_EQ(3, tree.roots.size());
+  EXPECT_EQ("abcd", tree.nodes[tree.roots[0]].piece);
+  EXPECT_EQ(6, tree.nodes[tree.roots[0]].id);
+  EXPECT_EQ("x", tree.nodes[tree.roots[1]].piece);
+  EXPECT_EQ(0, tree.nodes[tree.roots[1]].id);
+  EXPECT_EQ(-1, tree.nodes[tree.roots[1]].left);
+
+  EncodeResult result;
+  Model::SampleMergeTree(tree, 0.0, &result);
+  EXPECT_EQ(model.Encode("abcdxab"), result);
+  Model::SampleMergeTree(tree, 1.0, &result);
+  ASSERT_EQ(7, result.size());
+  EXPECT_EQ("a", result[0].first);
+  EXPECT_EQ(7, result[0].second);
+  EXPECT_EQ("x", result[4].first);
+
+  // The samples cover the input and refine the deterministic encoding.
+  std::map<std::string, int> freq;
+  const auto samples = model.SampleEncodeMany("abcdxab", 0.5, 10000);
+  ASSERT_EQ(10000, samples.size());
+  for (const auto &sample : samples) {
+    std::string text, tokens;
+    for (const auto &piece : sample) {
+      text.append(piece.first.data(), piece.first.size());
+      tokens += std::string(piece.first) + " ";
+      EXPECT_EQ(model.PieceToId(piece.first), piece.second);
+    }
+    EXPECT_EQ("abcdxab", text);
+    ++freq[tokens];
+  }
+  // The 5 refinements of "abcd" = "ab" + "cd", times "ab" or "a b".
+  EXPECT_EQ(10, freq.size());
+  EXPECT_TRUE(model.SampleEncodeMany("", 0.5, 3)[0].empty());
+  EXPECT_TRUE(model.SampleEncodeMany("abc", 0.5, 0).empty());
+
+  // Unused pieces fall back to SampleEncode().
+  model_proto.mutable_pieces(5)->set_type(ModelProto::SentencePiece::UNUSED);
+  const Model unused_model(model_proto);
+  EXPECT_FALSE(unused_model.BuildMergeTree("abcd", &tree));
+  for (const auto &sample : unused_model.SampleEncodeMany("abcd", 0.0, 2)) {
+    EXPECT_EQ(unused_model.Encode("abcd"), sample);
+  }
+}
+
 }  // namespace
 }  // namespace bpe
 }  // namespace sentencepiece
@@ -15,23 +15,41 @@
 #include "bpe_model_trainer.h"
 
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_set>
 #include <vector>
 
 #include "pretokenizer_for_training.h"
 #include "third_party/absl/container/flat_hash_set.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_replace.h"
 #include "util.h"
 
 namespace sentencepiece {
 namespace bpe {
-
-std::string Trainer::Symbol::ToString() const {
-  return string_util::UnicodeTextToUTF8(chars);
+namespace {
+
+// Returns true if a1 + a2 is lexicographically smaller than b1 + b2, in the
+// same byte order as std::string.
+bool ConcatLess(absl::string_view a1, absl::string_view a2,
+                absl::string_view b1, absl::string_view b2) {
+  const size_t a_size = a1.size() + a2.size();
+  const size_t b_size = b1.size() + b2.size();
+  for (size_t i = 0; i < std::min(a_size, b_size); ++i) {
+    const unsigned char a = i < a1.size() ? a1[i] : a2[i - a1.size()];
+    const unsigned char b = i < b1.size() ? b1[i] : b2[i - b1.size()];
+    if (a != b) return a < b;
+  }
+  return a_size < b_size;
 }
 
+}  // namespace
+
+std::string Trainer::Symbol::ToString() const { return piece; }
+
 Trainer::Symbol *Trainer::GetCharSymbol(char32 c) {
   const uint64 freq = port::FindWithDefault(required_chars_, c, 1);
   CHECK_GT(freq, 0);
@@ -39,11 +57,13 @@ Trainer::Symbol *Trainer::GetCharSymbol(char32 c) {
   if (it != symbols_cache_.end()) {
     return it->second;
   }
-  Symbol *s = new Symbol;
-  allocated_.push_back(s);
+  Symbol *s = symbol_arena_.New();
   s->is_unk = (kUNKChar == c);
   s->fp = c;
-  s->chars.push_back(c);
+  s->properties_offset = symbol_properties_.size();
+  s->num_chars = 1;
+  symbol_properties_.push_back(GetCharProperties(c));
+  s->piece = string_util::UnicodeCharToUTF8(c);
   s->freq = freq;
   port::InsertOrDie(&symbols_cache_, s->fp, s);
   return s;
@@ -61,44 +81,76 @@ Trainer::Symbol *Trainer::GetPairSymbol(const Symbol *left,
     return it->second;
   }
 
-  CHECK(!left->chars.empty());
-  CHECK(!right->chars.empty());
-  string_util::UnicodeText ut;
-  for (const char32 c : left->chars) ut.push_back(c);
-  for (const char32 c : right->chars) ut.push_back(c);
+  CHECK_GT(left->num_chars, 0);
+  CHECK_GT(right->num_chars, 0);
+  const size_t num_chars = left->num_chars + right->num_chars;
 
   // Do not make an invalid piece.
-  if (!IsValidSentencePiece(ut)) {
+  if (num_chars >
+      static_cast<size_t>(trainer_spec_.max_sentencepiece_length())) {
+    return nullptr;
+  }
+
+  // The properties are appended tentatively, and dropped again if the
+  // piece is invalid.
+  const size_t offset = symbol_properties_.size();
+  symbol_properties_.resize(offset + num_chars);
+  CharProperties *properties = symbol_properties_.data();
+  std::copy(properties + left->properties_offset,
+            properties + left->properties_offset + left->num_chars,
+            properties + offset);
+  std::copy(properties + right->properties_offset,
+            properties + right->properties_offset + right->num_chars,
+            properties + offset + left->num_chars);
+  if (!IsValidSentencePiece(properties + offset, num_chars)) {
+    symbol_properties_.resize(offset);
     return nullptr;
   }
 
-  Symbol *s = new Symbol;
-  allocated_.push_back(s);
+  Symbol *s = symbol_arena_.New();
   s->fp = fp;
   s->left = left;
   s->right = right;
-  s->chars = ut;
+  s->properties_offset = offset;
+  s->num_chars = num_chars;
+  s->piece.reserve(left->piece.size() + right->piece.size());
+  s->piece.append(left->piece).append(right->piece);
   port::InsertOrDie(&symbols_cache_, s->fp, s);
   return s;
 }
 
+void Trainer::SortPositions(Symbol *symbol) {
+  auto &positions = symbol->positions;
+  if (std::adjacent_find(positions.begin(), positions.end(),
+                         std::greater_equal<uint64_t>()) == positions.end()) {
+    return;
+  }
+  std::sort(positions.begin(), positions.end());
+  positions.erase(std::unique(positions.begin(), positions.end()),
+                  positions.end());
+}
+
 void Trainer::ComputeFreq(Symbol *symbol) const {
   if (symbol->freq > 0) {  // if freq == 0, re-computation is required.
     return;
   }
   CHECK_EQ(0, symbol->freq);
-  for (auto it = symbol->positions.begin(); it != symbol->positions.end();) {
-    const Position pos = DecodePos(*it);
+  SortPositions(symbol);
+  auto &positions = symbol->positions;
+  auto out = positions.begin();
+  for (const uint64_t encoded_pos : positions) {
+    const Position pos = DecodePos(encoded_pos, symbol);
     // symbols_[sid][left] and symbols_[sid]right] must store
     // the same symbols in symbol->left and symbols->right.
-    if (symbol->left != symbols_[pos.sid][pos.left] ||
-        symbol->right != symbols_[pos.sid][pos.right]) {
-      it = symbol->positions.erase(it);
-    } else {
+    if (symbol->left == symbols_[pos.sid][pos.left] &&
+        symbol->right == symbols_[pos.sid][pos.right]) {
       symbol->freq += sentences_[pos.sid].second;
-      ++it;
+      *out++ = encoded_pos;
     }
   }
+  positions.erase(out, positions.end());
+  // Releases the memory of the positions which have been merged away.
+  if (positions.capacity() > 2 * positions.size()) positions.shrink_to_fit();
 }
 
 int Trainer::GetNextIndex(int sid, int index) const {
@@ -117,23 +169,161 @@ int Trainer::GetPrevIndex(int sid, int index) const {
   return -1;
 }
 
-void Trainer::AddNewPair(int sid, int left, int right) {
-  if (left == -1 || right == -1) return;
-  auto *symbol = GetPairSymbol(symbols_[sid][left], symbols_[sid][right]);
-  if (symbol != nullptr) {
-    active_symbols_.insert(symbol);
-    symbol->positions.insert(EncodePos(sid, left, right));
+Trainer::Symbol *Trainer::FindPairSymbol(const Symbol *left,
+                                         const Symbol *right) const {
+  if (left == nullptr || right == nullptr || left->is_unk || right->is_unk) {
+    return nullptr;
   }
+  const auto it =
+      symbols_cache_.find(port::FingerprintCat(left->fp, right->fp));
+  return it == symbols_cache_.end() ? nullptr : it->second;
 }
 
-void Trainer::ResetFreq(int sid, int left, int right, const Symbol *best) {
+void Trainer::AddPairEvent(int sid, int left, int right, bool reset,
+                           std::vector<PairEvent> *events) const {
   if (left == -1 || right == -1) return;
-  auto *symbol = GetPairSymbol(symbols_[sid][left], symbols_[sid][right]);
-  if (symbol != nullptr && symbol != best) {
-    symbol->freq = 0;
+  const Symbol *l = symbols_[sid][left];
+  const Symbol *r = symbols_[sid][right];
+  events->push_back({l, r, FindPairSymbol(l, r), EncodePos(sid, left), reset});
+}
+
+void Trainer::ApplyPairEvents(
+    const std::vector<std::vector<PairEvent>> &events, const Symbol *best) {
+  for (const auto &shard : events) {
+    for (const auto &event : shard) {
+      // Bigrams made by the earlier events are not seen by the workers.
+      Symbol *symbol = event.symbol != nullptr
+                           ? event.symbol
+                           : GetPairSymbol(event.left, event.right);
+      if (symbol == nullptr) continue;
+      if (event.reset) {
+        if (symbol != best) {
+          symbol->freq = 0;
+          MarkDirty(symbol);
+        }
+        continue;
+      }
+      // A symbol without frequency is recomputed with the new position.
+      if (active_symbols_.insert(symbol).second || symbol->freq == 0) {
+        MarkDirty(symbol);
+      }
+      symbol->positions.push_back(event.pos);
+    }
   }
 }
 
+void Trainer::MakePairs() {
+  // Shards of consecutive sentences.
+  auto *pool = GetThreadPool();
+  const int64 num_shards = pool->size();
+  const int64 num_sentences = symbols_.size();
+  events_.resize(num_shards);
+
+  // Makes the distinct bigrams in the order of their first occurrence first,
+  // so the workers find all of them in the second pass.
+  std::vector<std::vector<std::pair<const Symbol *, const Symbol *>>> pairs(
+      num_shards);
+  pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 shard = begin; shard < end; ++shard) {
+      absl::flat_hash_set<uint64_t> seen;
+      for (int64 sid = shard * num_sentences / num_shards;
+           sid < (shard + 1) * num_sentences / num_shards; ++sid) {
+        for (size_t i = 1; i < symbols_[sid].size(); ++i) {
+          const Symbol *left = symbols_[sid][i - 1];
+          const Symbol *right = symbols_[sid][i];
+          if (seen.insert(port::FingerprintCat(left->fp, right->fp)).second) {
+            pairs[shard].emplace_back(left, right);
+          }
+        }
+      }
+    }
+  });
+  for (const auto &shard : pairs) {
+    for (const auto &pair : shard) GetPairSymbol(pair.first, pair.second);
+  }
+
+  pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 shard = begin; shard < end; ++shard) {
+      auto &events = events_[shard];
+      events.clear();
+      for (int64 sid = shard * num_sentences / num_shards;
+           sid < (shard + 1) * num_sentences / num_shards; ++sid) {
+        for (size_t i = 1; i < symbols_[sid].size(); ++i) {
+          AddPairEvent(sid, i - 1, i, false, &events);
+        }
+      }
+    }
+  });
+  ApplyPairEvents(events_, nullptr);
+}
+
+util::Status Trainer::MergeSymbol(Symbol *best) {
+  // Shards of the positions, split between sentences so that a sentence is
+  // rewritten by one worker.
+  SortPositions(best);
+  const auto &positions = best->positions;
+  auto *pool = GetThreadPool();
+  const int64 num_positions = positions.size();
+  const int64 num_shards = std::max<int64>(
+      1, std::min<int64>(pool->size(), num_positions / 1024));
+  std::vector<int64> bounds(num_shards + 1, num_positions);
+  bounds[0] = 0;
+  for (int64 shard = 1; shard < num_shards; ++shard) {
+    int64 b = std::max(bounds[shard - 1], shard * num_positions / num_shards);
+    while (b > 0 && b < num_positions &&
+           (positions[b] >> 32) == (positions[b - 1] >> 32)) {
+      ++b;
+    }
+    bounds[shard] = b;
+  }
+  events_.resize(num_shards);
+  std::vector<uint8> failed(num_shards, false);
+
+  pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 shard = begin; shard < end; ++shard) {
+      auto &events = events_[shard];
+      events.clear();
+      for (int64 k = bounds[shard]; k < bounds[shard + 1]; ++k) {
+        const Position pos = DecodePos(positions[k], best);
+        auto &symbols = symbols_[pos.sid];
+
+        if (symbols[pos.left] == nullptr) {
+          // left index might be NULL (set in the previous iteration)
+          // when left_symbol == right_symbol.
+          continue;
+        }
+        if (symbols[pos.left] != best->left || symbols[pos.right] == nullptr) {
+          failed[shard] = true;
+          break;
+        }
+
+        // We have three bigrams [prev, left], [left, right], [right, next],
+        // which are affected with this symbol replacement.
+        const int next = GetNextIndex(pos.sid, pos.right);
+        const int prev = GetPrevIndex(pos.sid, pos.left);
+
+        // Resets the frequencies of bigrams [prev, left] and [right, next].
+        AddPairEvent(pos.sid, prev, pos.left, true, &events);
+        AddPairEvent(pos.sid, pos.right, next, true, &events);
+
+        // Merges two symbols.
+        symbols[pos.left] = best;
+        symbols[pos.right] = nullptr;
+
+        // Makes new symbol bigrams [prev, left] and [left, next].
+        AddPairEvent(pos.sid, prev, pos.left, false, &events);
+        AddPairEvent(pos.sid, pos.left, next, false, &events);
+      }
+    }
+  });
+  CHECK_OR_RETURN(std::find(failed.begin(), failed.end(), true) ==
+                  failed.end())
+      << "Invalid position of " << best->ToString();
+
+  ApplyPairEvents(events_, best);
+  return util::OkStatus();
+}
+
 void Trainer::UpdateActiveSymbols() {
   std::vector<Symbol *> symbols;
   for (auto &it : symbols_cache_) {
@@ -161,44 +351,84 @@ void Trainer::UpdateActiveSymbols() {
 
   active_symbols_.clear();
   active_symbols_.insert(symbols.begin(), symbols.begin() + size);
-}
-
-util::Status Trainer::Train() {
-  RETURN_IF_ERROR(status());
 
-  CHECK_OR_RETURN(normalizer_spec_.escape_whitespaces());
-  CHECK_EQ_OR_RETURN(TrainerSpec::BPE, trainer_spec_.model_type());
-
-  symbols_.clear();
-  allocated_.clear();
-  symbols_cache_.clear();
-  active_symbols_.clear();
+  for (Symbol *symbol : dirty_symbols_) symbol->dirty = false;
+  dirty_symbols_.clear();
+  std::vector<QueueEntry> entries;
+  entries.reserve(size);
+  for (Symbol *symbol : active_symbols_) {
+    entries.push_back({symbol->freq, symbol});
+  }
+  queue_ = decltype(queue_)(QueueEntryLess(), std::move(entries));
+}
 
-  // Load all sentences
-  RETURN_IF_ERROR(LoadSentences());
+void Trainer::MarkDirty(Symbol *symbol) {
+  if (symbol->dirty) return;
+  symbol->dirty = true;
+  dirty_symbols_.push_back(symbol);
+}
 
-  if (trainer_spec_.split_by_whitespace()) {
-    SplitSentencesByWhitespace();
+Trainer::Symbol *Trainer::PopBestSymbol() {
+  // Only the symbols whose frequency was reset need ComputeFreq(). The
+  // others keep their cached frequency, which is already in |queue_|.
+  for (Symbol *symbol : dirty_symbols_) {
+    symbol->dirty = false;
+    if (active_symbols_.count(symbol) == 0) continue;
+    ComputeFreq(symbol);
+    queue_.push({symbol->freq, symbol});
   }
+  dirty_symbols_.clear();
 
-  // Pretokenizer applied only in training time.
-  // Pretokenizer is used as a constraint of piece extractions.
-  const auto *pretokenizer = SentencePieceTrainer::GetPretokenizerForTraining();
+  while (!queue_.empty()) {
+    const QueueEntry entry = queue_.top();
+    Symbol *symbol = entry.symbol;
+    if (active_symbols_.count(symbol) && entry.freq == symbol->freq) {
+      return symbol;
+    }
+    queue_.pop();
+  }
+  return nullptr;
+}
 
-  if (pretokenizer || !trainer_spec_.pretokenization_delimiter().empty()) {
-    absl::string_view delimiter = trainer_spec_.pretokenization_delimiter();
-    LOG(INFO) << "Preprocessing with pretokenizer...";
-    for (auto &w : sentences_) {
-      if (pretokenizer) {
-        w.first = absl::StrJoin(pretokenizer->PreTokenize(w.first),
-                                TrainerInterface::kUPPBoundaryStr);
-      } else if (!delimiter.empty()) {
-        w.first = absl::StrReplaceAll(
-            w.first, {{delimiter, TrainerInterface::kUPPBoundaryStr}});
-      }
+util::Status Trainer::ReplayMerges(
+    const std::vector<std::pair<std::string, std::string>> &merges,
+    absl::flat_hash_set<std::string> *dup) {
+  // Symbols of the merged pieces. The other symbols in symbols_ are
+  // characters.
+  absl::flat_hash_map<std::string, Symbol *> merged;
+  const auto find_symbol = [&](const std::string &piece) -> Symbol * {
+    const auto chars = string_util::UTF8ToUnicodeText(piece);
+    if (chars.size() == 1) {
+      const auto it = symbols_cache_.find(chars[0]);
+      return it == symbols_cache_.end() ? nullptr : it->second;
+    }
+    return port::FindWithDefault(merged, piece, nullptr);
+  };
+
+  for (const auto &merge : merges) {
+    Symbol *symbol = FindPairSymbol(find_symbol(merge.first),
+                                    find_symbol(merge.second));
+    CHECK_OR_RETURN(symbol != nullptr)
+        << "Checkpoint does not match the corpus: " << merge.first << " "
+        << merge.second;
+    if (dup->insert(symbol->ToString()).second) {
+      final_pieces_.emplace_back(symbol->ToString(),
+                                 -static_cast<float>(final_pieces_.size()));
+      merged[symbol->ToString()] = symbol;
+      // The cached frequency may come with positions merged away.
+      symbol->freq = 0;
+      ComputeFreq(symbol);
+      RETURN_IF_ERROR(MergeSymbol(symbol));
+      std::vector<uint64_t>().swap(symbol->positions);
     }
+    // In the same order as MergeSymbols(), which shapes symbols_cache_.
+    symbols_cache_.erase(symbol->fp);
+    active_symbols_.erase(symbol);
   }
+  return util::OkStatus();
+}
 
+util::Status Trainer::MergeSymbols(int vocab_size) {
   // Initializes symbols_. symbols_[sid][i] stores an unary symbol.
   symbols_.resize(sentences_.size());
   for (size_t i = 0; i < sentences_.size(); ++i) {
@@ -208,51 +438,46 @@ util::Status Trainer::Train() {
   }
 
   // Makes all bigram symbols.
-  for (size_t sid = 0; sid < symbols_.size(); ++sid) {
-    for (size_t i = 1; i < symbols_[sid].size(); ++i) {
-      AddNewPair(sid, i - 1, i);
-    }
-  }
-
-  const int vocab_size =
-      trainer_spec_.vocab_size() - meta_pieces_.size() - required_chars_.size();
-  CHECK_GE_OR_RETURN(vocab_size, 0);
+  MakePairs();
 
   // We may see duplicated pieces that are extracted with different path.
   // In real segmentation phase, we can consider them as one symbol.
   // e.g., "aaa" => "aa" + "a" or "a" + "aa".
   absl::flat_hash_set<std::string> dup;
 
-  // Main loop.
-  CHECK_OR_RETURN(final_pieces_.empty());
+  // The selected pairs, for the checkpoints.
+  std::vector<std::pair<std::string, std::string>> merges;
+  int64 last_checkpoint = 0;
+  if (!resume_from_.empty()) {
+    TrainerCheckpoint checkpoint;
+    RETURN_IF_ERROR(LoadCheckpoint(&checkpoint));
+    RETURN_IF_ERROR(ReplayMerges(checkpoint.merges, &dup));
+    merges = std::move(checkpoint.merges);
+    last_checkpoint = final_pieces_.size();
+  }
+
+  // Main loop. Each batch of merges between the updates of the active
+  // symbols is a phase of the metrics.
+  constexpr int kUpdateActiveSymbolsInteval = 100;
+  auto batch =
+      std::make_unique<TrainingMetrics::Scope>(&metrics_, "bpe_merge_batch");
   while (final_pieces_.size() < static_cast<size_t>(vocab_size)) {
-    constexpr int kUpdateActiveSymbolsInteval = 100;
     if (final_pieces_.size() % kUpdateActiveSymbolsInteval == 0) {
       UpdateActiveSymbols();
     }
 
-    // Scanning active symbols, finds the best_symbol with highest freq.
-    Symbol *best_symbol = nullptr;
-    for (auto &it : active_symbols_) {
-      Symbol *symbol = it;
-      ComputeFreq(symbol);
-      // If the frequency is the same, take shorter symbol.
-      // if the length is the same, use lexicographical comparison
-      if (best_symbol == nullptr ||
-          (symbol->freq > best_symbol->freq ||
-           (symbol->freq == best_symbol->freq &&
-            (symbol->chars.size() < best_symbol->chars.size() ||
-             (symbol->chars.size() == best_symbol->chars.size() &&
-              symbol->ToString() < best_symbol->ToString()))))) {
-        best_symbol = symbol;
-      }
-    }
+    // Finds the active best_symbol with highest freq from the queue.
+    // If the frequency is the same, take shorter symbol.
+    // if the length is the same, use lexicographical comparison
+    Symbol *best_symbol = PopBestSymbol();
 
     if (best_symbol == nullptr) {
       LOG(WARNING) << "No valid symbol found";
       break;
     }
 
+    merges.emplace_back(best_symbol->left->ToString(),
+                        best_symbol->right->ToString());
     if (!dup.insert(best_symbol->ToString()).second) {
       // Removes best_symbol so it is not selected again.
       symbols_cache_.erase(best_symbol->fp);
@@ -263,6 +488,7 @@ util::Status Trainer::Train() {
     // Stores the best_symbol in the final output.
     final_pieces_.emplace_back(best_symbol->ToString(),
                                -static_cast<float>(final_pieces_.size()));
+    batch->AddItems(1);
 
     if (final_pieces_.size() % 20 == 0) {
       LOG(INFO) << "Added: freq=" << best_symbol->freq
@@ -275,49 +501,373 @@ util::Status Trainer::Train() {
     // Add new bigrams which are created after symbol replacement.
     // We do not need to scan all characters, but scan the neighbors in
     // best_symbol.
-    for (const uint64 &encoded_pos : best_symbol->positions) {
-      const Position pos = DecodePos(encoded_pos);
+    RETURN_IF_ERROR(MergeSymbol(best_symbol));
 
-      if (symbols_[pos.sid][pos.left] == nullptr) {
-        // left index might be NULL (set in the previous iteration)
-        // when left_symbol == right_symbol.
+    // Removes best_symbol so it is not selected again.
+    symbols_cache_.erase(best_symbol->fp);
+    active_symbols_.erase(best_symbol);
+    std::vector<uint64_t>().swap(best_symbol->positions);
+
+    // Checkpoints are written just before the active symbols are updated,
+    // so that a resumed job selects the same symbols.
+    if (final_pieces_.size() % kUpdateActiveSymbolsInteval == 0 &&
+        IsCheckpointStep(final_pieces_.size(), last_checkpoint, 1000)) {
+      last_checkpoint = final_pieces_.size();
+      TrainerCheckpoint checkpoint;
+      checkpoint.model_type = TrainerSpec::BPE;
+      checkpoint.step = final_pieces_.size();
+      checkpoint.merges = merges;
+      RETURN_IF_ERROR(SaveCheckpoint(checkpoint));
+    }
+
+    if (final_pieces_.size() % kUpdateActiveSymbolsInteval == 0 &&
+        final_pieces_.size() < static_cast<size_t>(vocab_size)) {
+      batch.reset();
+      batch = std::make_unique<TrainingMetrics::Scope>(&metrics_,
+                                                       "bpe_merge_batch");
+    }
+  }  // end of main loop
+
+  return util::OkStatus();
+}
+
+util::Status Trainer::MergeWords(int vocab_size) {
+  // Symbols by dense id, starting with the characters.
+  std::vector<std::string> pieces;
+  std::vector<int> lengths;  // Unicode length.
+  std::vector<uint8> is_unk;
+  // The properties of the characters of each symbol, so the validity of a
+  // pair is checked without decoding its piece.
+  std::vector<std::vector<CharProperties>> properties;
+  absl::flat_hash_map<char32, int32> char_ids;
+
+  // The w-th sentence has the symbols ids[offsets[w]] ...
+  // ids[offsets[w] + sizes[w] - 1]. Merges shrink the sentences in place.
+  std::vector<int32> ids;
+  std::vector<int64> offsets;
+  std::vector<int32> sizes;
+  for (const auto &w : sentences_) {
+    offsets.push_back(ids.size());
+    for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
+      auto it = char_ids.find(c);
+      if (it == char_ids.end()) {
+        it = char_ids.emplace(c, pieces.size()).first;
+        pieces.push_back(string_util::UnicodeCharToUTF8(c));
+        lengths.push_back(1);
+        is_unk.push_back(c == kUNKChar);
+        properties.push_back({GetCharProperties(c)});
+      }
+      ids.push_back(it->second);
+    }
+    sizes.push_back(ids.size() - offsets.back());
+  }
+
+  // A pair of symbols is packed in the key (left << 32 | right).
+  const auto left_of = [](uint64 key) { return static_cast<int32>(key >> 32); };
+  const auto right_of = [](uint64 key) {
+    return static_cast<int32>(key & 0xffffffff);
+  };
+
+  // The frequency of every pair, and the sentences where it occurs. A list
+  // may also have the sentences where the pair has been merged away.
+  absl::flat_hash_map<uint64, int64> freqs;
+  absl::flat_hash_map<uint64, std::vector<int32>> pair_sentences;
+  std::vector<uint64> touched;
+
+  // Adds |freq| to the pairs of the w-th sentence. The sentence is added to
+  // the lists of the pairs with |new_id|, or of all the pairs when -1.
+  const auto count_pairs = [&](int32 w, int64 freq, int32 new_id) {
+    const int32 *symbols = &ids[offsets[w]];
+    for (int i = 1; i < sizes[w]; ++i) {
+      const uint64 key = static_cast<uint64>(symbols[i - 1]) << 32 |
+                         static_cast<uint32>(symbols[i]);
+      freqs[key] += freq;
+      touched.push_back(key);
+      if (freq > 0 && (new_id == -1 || symbols[i - 1] == new_id ||
+                       symbols[i] == new_id)) {
+        auto &list = pair_sentences[key];
+        if (list.empty() || list.back() != w) list.push_back(w);
+      }
+    }
+  };
+  for (size_t w = 0; w < sentences_.size(); ++w) {
+    count_pairs(w, sentences_[w].second, -1);
+  }
+
+  // The queue of the pairs in the order of MergeSymbols(): higher
+  // frequency, shorter, and lexicographically smaller first. Stale entries
+  // are skipped when popped.
+  struct Entry {
+    int64 freq;
+    uint64 key;
+  };
+  const auto worse = [&](const Entry &a, const Entry &b) {
+    if (a.freq != b.freq) return a.freq < b.freq;
+    const int32 al = left_of(a.key), ar = right_of(a.key);
+    const int32 bl = left_of(b.key), br = right_of(b.key);
+    const int a_length = lengths[al] + lengths[ar];
+    const int b_length = lengths[bl] + lengths[br];
+    if (a_length != b_length) return a_length > b_length;
+    if (ConcatLess(pieces[bl], pieces[br], pieces[al], pieces[ar])) {
+      return true;
+    }
+    if (ConcatLess(pieces[al], pieces[ar], pieces[bl], pieces[br])) {
+      return false;
+    }
+    return a.key > b.key;
+  };
+  std::priority_queue<Entry, std::vector<Entry>, decltype(worse)> queue(worse);
+  const auto push_touched = [&]() {
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (const uint64 key : touched) {
+      const auto it = freqs.find(key);
+      if (it->second > 0) {
+        queue.push({it->second, key});
+      } else {
+        freqs.erase(it);
+        pair_sentences.erase(key);
+      }
+    }
+    touched.clear();
+  };
+  push_touched();
+
+  // Pairs which are never selected: invalid or duplicated pieces.
+  absl::flat_hash_set<uint64> removed;
+
+  // We may see duplicated pieces that are extracted with different path.
+  // In real segmentation phase, we can consider them as one symbol.
+  // e.g., "aaa" => "aa" + "a" or "a" + "aa".
+  absl::flat_hash_set<std::string> dup;
+
+  std::vector<CharProperties> pair_properties;
+  const auto is_valid_pair = [&](int32 left, int32 right) {
+    pair_properties = properties[left];
+    pair_properties.insert(pair_properties.end(), properties[right].begin(),
+                           properties[right].end());
+    return IsValidSentencePiece(pair_properties.data(),
+                                pair_properties.size());
+  };
+
+  // Batches of merges of the same size as in MergeSymbols() are the phases
+  // of the metrics.
+  constexpr int kMergeBatchSize = 100;
+  auto batch =
+      std::make_unique<TrainingMetrics::Scope>(&metrics_, "bpe_merge_batch");
+  while (final_pieces_.size() < static_cast<size_t>(vocab_size)) {
+    // Pops the most frequent valid pair.
+    bool found = false;
+    uint64 best = 0;
+    while (!found && !queue.empty()) {
+      const Entry entry = queue.top();
+      queue.pop();
+      const auto it = freqs.find(entry.key);
+      if (it == freqs.end() || it->second != entry.freq ||
+          removed.count(entry.key)) {
         continue;
       }
-      CHECK_OR_RETURN(symbols_[pos.sid][pos.right]);
+      const int32 left = left_of(entry.key), right = right_of(entry.key);
+      if (is_unk[left] || is_unk[right] || !is_valid_pair(left, right)) {
+        removed.insert(entry.key);
+        continue;
+      }
+      best = entry.key;
+      found = true;
+    }
 
-      // We have three bigrams [prev, left], [left, right], [right, next],
-      // which are affected with this symbol replacement.
-      const int next = GetNextIndex(pos.sid, pos.right);
-      const int prev = GetPrevIndex(pos.sid, pos.left);
+    if (!found) {
+      LOG(WARNING) << "No valid symbol found";
+      break;
+    }
 
-      // Resets the frequencies of bigrams [prev, left] and [right, next].
-      ResetFreq(pos.sid, prev, pos.left, best_symbol);
-      ResetFreq(pos.sid, pos.right, next, best_symbol);
+    const int32 left = left_of(best), right = right_of(best);
+    const std::string piece = pieces[left] + pieces[right];
+    if (!dup.insert(piece).second) {
+      removed.insert(best);
+      continue;
+    }
 
-      // Merges two symbols.
-      symbols_[pos.sid][pos.left] = best_symbol;
-      symbols_[pos.sid][pos.right] = nullptr;
+    // Stores the best pair in the final output.
+    final_pieces_.emplace_back(piece,
+                               -static_cast<float>(final_pieces_.size()));
+    batch->AddItems(1);
 
-      // Makes new symbol bigrams [prev, left] and [left, next].
-      AddNewPair(pos.sid, prev, pos.left);
-      AddNewPair(pos.sid, pos.left, next);
+    if (final_pieces_.size() % 20 == 0) {
+      LOG(INFO) << "Added: freq=" << freqs[best]
+                << " size=" << final_pieces_.size()
+                << " all=" << freqs.size() << " piece=" << piece;
     }
 
-    // Removes best_symbol so it is not selected again.
-    symbols_cache_.erase(best_symbol->fp);
-    active_symbols_.erase(best_symbol);
-  }  // end of main loop
+    // Merges the pair from left to right in the sentences where it occurs.
+    // Only the pairs of these sentences change, so their frequencies are
+    // subtracted before the merge and added again after it.
+    const int32 new_id = pieces.size();
+    pieces.push_back(piece);
+    lengths.push_back(lengths[left] + lengths[right]);
+    is_unk.push_back(false);
+    std::vector<CharProperties> new_properties = properties[left];
+    new_properties.insert(new_properties.end(), properties[right].begin(),
+                          properties[right].end());
+    properties.push_back(std::move(new_properties));
+    std::vector<int32> merged = std::move(pair_sentences[best]);
+    pair_sentences.erase(best);
+    std::sort(merged.begin(), merged.end());
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+    for (const int32 w : merged) {
+      int32 *symbols = &ids[offsets[w]];
+      const int size = sizes[w];
+      bool occurs = false;
+      for (int i = 1; i < size && !occurs; ++i) {
+        occurs = symbols[i - 1] == left && symbols[i] == right;
+      }
+      if (!occurs) continue;
+      const int64 freq = sentences_[w].second;
+      count_pairs(w, -freq, new_id);
+      int out = 0;
+      for (int i = 0; i < size;) {
+        if (i + 1 < size && symbols[i] == left && symbols[i + 1] == right) {
+          symbols[out++] = new_id;
+          i += 2;
+        } else {
+          symbols[out++] = symbols[i++];
+        }
+      }
+      sizes[w] = out;
+      count_pairs(w, freq, new_id);
+    }
+    push_touched();
+
+    if (final_pieces_.size() % kMergeBatchSize == 0 &&
+        final_pieces_.size() < static_cast<size_t>(vocab_size)) {
+      batch.reset();
+      batch = std::make_unique<TrainingMetrics::Scope>(&metrics_,
+                                                       "bpe_merge_batch");
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status Trainer::Train() {
+  RETURN_IF_ERROR(status());
+
+  CHECK_OR_RETURN(normalizer_spec_.escape_whitespaces());
+  CHECK_EQ_OR_RETURN(TrainerSpec::BPE, trainer_spec_.model_type());
+
+  symbols_.clear();
+  symbol_arena_.Clear();
+  symbol_properties_.clear();
+  symbols_cache_.clear();
+  active_symbols_.clear();
+  queue_ = decltype(queue_)();
+  dirty_symbols_.clear();
+
+  // Load all sentences
+  split_by_whitespace_while_loading_ = trainer_spec_.split_by_whitespace();
+  RETURN_IF_ERROR(LoadSentences());
+
+  if (trainer_spec_.split_by_whitespace()) {
+    SplitSentencesByWhitespace();
+  }
+
+  // Pretokenizer applied only in training time.
+  // Pretokenizer is used as a constraint of piece extractions.
+  const auto *pretokenizer = SentencePieceTrainer::GetPretokenizerForTraining();
+
+  if (pretokenizer || !trainer_spec_.pretokenization_delimiter().empty()) {
+    absl::string_view delimiter = trainer_spec_.pretokenization_delimiter();
+    LOG(INFO) << "Preprocessing with pretokenizer...";
+    std::vector<std::vector<std::string>> tokens;
+    if (pretokenizer) tokens = PreTokenizeSentences(*pretokenizer);
+    Sentences rewritten;
+    for (size_t i = 0; i < sentences_.size(); ++i) {
+      const auto w = sentences_[i];
+      if (pretokenizer) {
+        rewritten.emplace_back(
+            absl::StrJoin(tokens[i], TrainerInterface::kUPPBoundaryStr),
+            w.second);
+        std::vector<std::string>().swap(tokens[i]);
+      } else {
+        rewritten.emplace_back(
+            absl::StrReplaceAll(
+                w.first, {{delimiter, TrainerInterface::kUPPBoundaryStr}}),
+            w.second);
+      }
+    }
+    sentences_ = std::move(rewritten);
+  }
+
+  const int vocab_size =
+      trainer_spec_.vocab_size() - meta_pieces_.size() - required_chars_.size();
+  CHECK_GE_OR_RETURN(vocab_size, 0);
+  CHECK_OR_RETURN(final_pieces_.empty());
+
+  if (use_word_engine_ && trainer_spec_.split_by_whitespace()) {
+    RETURN_IF_ERROR(MergeWords(vocab_size));
+  } else {
+    RETURN_IF_ERROR(MergeSymbols(vocab_size));
+  }
 
   // Adds required_chars_
+  const size_t num_merges = final_pieces_.size();
   for (const auto &w : Sorted(required_chars_)) {
     const Symbol *symbol = GetCharSymbol(w.first);
     final_pieces_.emplace_back(symbol->ToString(),
                                -static_cast<float>(final_pieces_.size()));
   }
 
-  port::STLDeleteElements(&allocated_);
+  // The symbols are no longer needed, nor the pointers to them.
+  std::vector<std::vector<Symbol *>>().swap(symbols_);
+  symbols_cache_.clear();
+  active_symbols_.clear();
+  queue_ = decltype(queue_)();
+  dirty_symbols_.clear();
+  symbol_arena_.Clear();
+  std::vector<CharProperties>().swap(symbol_properties_);
+
+  RETURN_IF_ERROR(SaveSmallerModels(num_merges));
 
   return Save();
 }
+
+util::Status Trainer::SaveSmallerModels(size_t num_merges) {
+  std::vector<int> vocab_sizes;
+  for (const int size : extra_vocab_sizes_) {
+    if (size < trainer_spec_.vocab_size()) vocab_sizes.push_back(size);
+  }
+  std::sort(vocab_sizes.begin(), vocab_sizes.end());
+  vocab_sizes.erase(std::unique(vocab_sizes.begin(), vocab_sizes.end()),
+                    vocab_sizes.end());
+  if (vocab_sizes.empty()) return util::OkStatus();
+
+  TrainingMetrics::Scope phase(&metrics_, "smaller_models");
+  const TrainerSpec trainer_spec = trainer_spec_;
+  const auto final_pieces = final_pieces_;
+  const int num_fixed = meta_pieces_.size() + required_chars_.size();
+  util::Status status;
+  for (const int size : vocab_sizes) {
+    if (size < num_fixed) {
+      LOG(WARNING) << "Skipping vocab_size=" << size << " as the model needs "
+                   << num_fixed << " meta pieces and characters.";
+      continue;
+    }
+    const size_t n = std::min<size_t>(size - num_fixed, num_merges);
+    final_pieces_.assign(final_pieces.begin(), final_pieces.begin() + n);
+    for (size_t i = num_merges; i < final_pieces.size(); ++i) {
+      final_pieces_.emplace_back(final_pieces[i].first,
+                                 -static_cast<float>(final_pieces_.size()));
+    }
+    trainer_spec_.set_vocab_size(final_pieces_.size() + meta_pieces_.size());
+    trainer_spec_.set_model_prefix(
+        absl::StrCat(trainer_spec.model_prefix(), ".", size));
+    LOG(INFO) << "Saving the model of vocab_size=" << size;
+    status = Save();
+    if (!status.ok()) break;
+  }
+  trainer_spec_ = trainer_spec;
+  final_pieces_ = final_pieces;
+  return status;
+}
 }  // namespace bpe
 }  // namespace sentencepiece
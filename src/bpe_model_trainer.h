@@ -17,12 +17,16 @@
 
 #include <cstdint>
 #include <limits>
+#include <memory>
+#include <queue>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "sentencepiece_model.pb.h"
 #include "third_party/absl/container/btree_set.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "trainer_interface.h"
 
 namespace sentencepiece {
@@ -42,20 +46,81 @@ class Trainer : public TrainerInterface {
  private:
   // Symbol represents a character or symbol bigram.
   struct Symbol {
-    const Symbol *left;              // left symbol in bigram
-    const Symbol *right;             // right symbol in bigram
-    string_util::UnicodeText chars;  // all flattend chracter sequence
-    bool is_unk;                     // true if this symbol is unknown.
-    uint64_t fp;                     // fingerprint of this symbol.
-    uint64_t freq;                   // frequency of this symbol.
-
-    // Position list. Use set so that we can keep the order of occurrence.
+    const Symbol *left;   // left symbol in bigram
+    const Symbol *right;  // right symbol in bigram
+    // The CharProperties of the flattened character sequence are
+    // symbol_properties_[properties_offset, properties_offset + num_chars).
+    uint64_t properties_offset;
+    uint32_t num_chars;
+    std::string piece;  // UTF-8 of the characters, for tie-breaking.
+    bool is_unk;        // true if this symbol is unknown.
+    bool dirty;         // true if in dirty_symbols_.
+    uint64_t fp;        // fingerprint of this symbol.
+    uint64_t freq;      // frequency of this symbol.
+
+    // Position list, appended to by AddNewPair(). It is sorted in the order
+    // of occurrence, and deduplicated, by SortPositions() before it is read.
     // See EncodePos/DecodePos.
-    absl::btree_set<uint64_t> positions;
+    std::vector<uint64_t> positions;
 
     bool IsBigram() const { return left != nullptr && right != nullptr; }
     std::string ToString() const;
-    Symbol() : left(nullptr), right(nullptr), is_unk(false), fp(0), freq(0) {}
+    Symbol()
+        : left(nullptr),
+          right(nullptr),
+          properties_offset(0),
+          num_chars(0),
+          is_unk(false),
+          dirty(false),
+          fp(0),
+          freq(0) {}
+  };
+
+  // Typed arena of the symbols. They are allocated in blocks, so that
+  // making one does not cost a heap allocation of its own and all of them
+  // are freed at once. The symbols never move.
+  class SymbolArena {
+   public:
+    Symbol *New() {
+      if (used_ == kBlockSize) {
+        blocks_.emplace_back(new Symbol[kBlockSize]);
+        used_ = 0;
+      }
+      return &blocks_.back()[used_++];
+    }
+
+    void Clear() {
+      blocks_.clear();
+      used_ = kBlockSize;
+    }
+
+   private:
+    static constexpr size_t kBlockSize = 4096;
+    std::vector<std::unique_ptr<Symbol[]>> blocks_;
+    size_t used_ = kBlockSize;  // Symbols made in the last block.
+  };
+
+  // An active symbol with its frequency when it was queued. The entry is
+  // stale when the symbol is no longer active or the frequency changed.
+  struct QueueEntry {
+    uint64_t freq;
+    Symbol *symbol;
+  };
+
+  // Orders the entries so that the top of |queue_| is the best symbol:
+  // the most frequent, then the shortest, then the lexicographically
+  // smallest piece, then the first one in |active_symbols_|.
+  struct QueueEntryLess {
+    bool operator()(const QueueEntry &a, const QueueEntry &b) const {
+      if (a.freq != b.freq) return a.freq < b.freq;
+      if (a.symbol->num_chars != b.symbol->num_chars) {
+        return a.symbol->num_chars > b.symbol->num_chars;
+      }
+      if (a.symbol->piece != b.symbol->piece) {
+        return a.symbol->piece > b.symbol->piece;
+      }
+      return a.symbol > b.symbol;
+    }
   };
 
   struct Position {
@@ -64,27 +129,27 @@ class Trainer : public TrainerInterface {
     int right;  // right symbol index
   };
 
-  // Encodes sid, left and right bigram index into uint64_t.
-  // Encoded value keeps the order of sid, left and right.
-  static uint64_t EncodePos(int sid, int l, int r) {
+  // Encodes sid and the left bigram index into uint64_t.
+  // Encoded value keeps the order of sid and left. The right index is not
+  // stored, as the left symbol of a valid position covers the characters up
+  // to it.
+  static uint64_t EncodePos(int sid, int l) {
     CHECK_GE(l, 0);
-    CHECK_GE(r, 0);
-    CHECK_LE(l, std::numeric_limits<uint16_t>::max());
-    CHECK_LE(r, std::numeric_limits<uint16_t>::max());
-    const uint64_t n = (static_cast<uint64_t>(sid) << 32) |
-                       (static_cast<uint64_t>(l) << 16) | r;
-    return n;
+    return (static_cast<uint64_t>(sid) << 32) | static_cast<uint32_t>(l);
   }
 
-  // Decodes sid, left and right bigram index from uint64_t.
-  static Position DecodePos(uint64_t n) {
+  // Decodes sid, left and right bigram index of |symbol| from uint64_t.
+  static Position DecodePos(uint64_t n, const Symbol *symbol) {
     Position p;
     p.sid = n >> 32;
-    p.left = (n >> 16) & 0xffff;
-    p.right = n & 0xffff;
+    p.left = n & 0xffffffff;
+    p.right = p.left + symbol->left->num_chars;
     return p;
   }
 
+  // Sorts and deduplicates |symbol->positions| if needed.
+  static void SortPositions(Symbol *symbol);
+
   // Gets unary (character) symbol from the char code |c|.
   // The return value is cached.
   Symbol *GetCharSymbol(char32 c);
@@ -101,29 +166,107 @@ class Trainer : public TrainerInterface {
   // Returns the valid index after symbols_[sid][index].
   int GetPrevIndex(int sid, int index) const;
 
-  // Makes a new bigram from [symbols_[sid][left], symbols_[sid][right]] and
-  // Adds it to symbols_cache_ and active_symbols_.
-  void AddNewPair(int sid, int left, int right);
+  // A change to the bigram [symbols_[sid][left], symbols_[sid][right]]
+  // found while the sentences are scanned in parallel. The changes are
+  // applied to the shared symbols by ApplyPairEvents() in sentence order.
+  struct PairEvent {
+    const Symbol *left;
+    const Symbol *right;
+    Symbol *symbol;  // The cached bigram, or nullptr if not found.
+    uint64_t pos;    // Encoded position of the bigram.
+    bool reset;      // Resets the frequency instead of adding the position.
+  };
+
+  // Returns the cached bigram of |left| and |right| without creating it.
+  // Safe to call from several threads while symbols_cache_ is not modified.
+  Symbol *FindPairSymbol(const Symbol *left, const Symbol *right) const;
+
+  // Appends the event of the bigram [symbols_[sid][left],
+  // symbols_[sid][right]] to |events|. Does nothing if an index is -1.
+  void AddPairEvent(int sid, int left, int right, bool reset,
+                    std::vector<PairEvent> *events) const;
 
-  // Resets the fequency of bigram [symbols_[sid][left] symbols_[sid][right]],
-  // if this bigram is not |best|.
-  void ResetFreq(int sid, int left, int right, const Symbol *best);
+  // Applies |events| in order. A reset event resets the frequency of the
+  // bigram if it is not |best|. Otherwise, the bigram is made, added to
+  // symbols_cache_ and active_symbols_, and gets the position.
+  void ApplyPairEvents(const std::vector<std::vector<PairEvent>> &events,
+                       const Symbol *best);
+
+  // Makes all bigram symbols of symbols_.
+  void MakePairs();
+
+  // Replaces the bigrams of |best| in symbols_ with |best| and updates the
+  // neighbouring bigrams. The sentences are rewritten in parallel.
+  util::Status MergeSymbol(Symbol *best);
+
+  // Applies the pairs of a checkpoint, as selected by MergeSymbols(), to
+  // symbols_ and final_pieces_. |dup| receives the merged pieces.
+  util::Status ReplayMerges(
+      const std::vector<std::pair<std::string, std::string>> &merges,
+      absl::flat_hash_set<std::string> *dup);
+
+  // Adds at most |vocab_size| merged pieces to final_pieces_ with Symbol
+  // objects and their positions in symbols_. The best symbol is searched
+  // among |active_symbols_| only. Checkpoints are written and resumed here.
+  util::Status MergeSymbols(int vocab_size);
+
+  // The same as MergeSymbols(), but over the distinct sentences as arrays of
+  // dense symbol ids. The exact frequency of every pair is kept in a hash
+  // map keyed by the packed ids and only the sentences with the merged pair
+  // are rewritten, so no frequency is computed again from the positions.
+  // As the best pair is searched among all of them, and pairs which no
+  // longer occur are not merged, the pieces may differ from MergeSymbols().
+  // It does not use checkpoints.
+  util::Status MergeWords(int vocab_size);
+
+  // Saves the models of extra_vocab_sizes_ smaller than the vocab_size of
+  // the spec. As the merges are selected greedily, such a model has the
+  // first merges of |final_pieces_| and the required characters, which is
+  // what the merge loop stopped at that size would make. |num_merges| is
+  // the number of merges in |final_pieces_|.
+  util::Status SaveSmallerModels(size_t num_merges);
 
   // Updates |active_symbols_| by copying the top 5% frequent symbols in
-  // symbols_cache_.
+  // symbols_cache_, and rebuilds |queue_| from them.
   void UpdateActiveSymbols();
 
+  // Marks |symbol| to be queued again before the next selection, as its
+  // frequency was reset or it became active.
+  void MarkDirty(Symbol *symbol);
+
+  // Returns the active symbol with the highest frequency, as a scan of
+  // |active_symbols_| calling ComputeFreq() would, or nullptr.
+  Symbol *PopBestSymbol();
+
   // All unique symbols. Key is a fingerprint of Symbol.
   absl::flat_hash_map<uint64_t, Symbol *> symbols_cache_;
 
   // Set of symbols from which we find the best symbol in each iteration.
   absl::btree_set<Symbol *> active_symbols_;
 
-  // Stores symbols allocated in heap so that we can delete them at onece.
-  std::vector<Symbol *> allocated_;
+  // Active symbols by priority, with lazily skipped stale entries.
+  std::priority_queue<QueueEntry, std::vector<QueueEntry>, QueueEntryLess>
+      queue_;
+
+  // Symbols whose entries in |queue_| may be stale.
+  std::vector<Symbol *> dirty_symbols_;
+
+  // All symbols, deleted at once.
+  SymbolArena symbol_arena_;
+
+  // The character properties of all symbols, interned by Symbol::
+  // properties_offset. A bigram appends the ones of its left and right
+  // symbols.
+  std::vector<CharProperties> symbol_properties_;
 
   // Sentences. symbols_[sid][index] stores a symbol in sentence_[sid][index].
   std::vector<std::vector<Symbol *>> symbols_;
+
+  // Per-shard events of MakePairs() and MergeSymbol(), kept for their
+  // capacity.
+  std::vector<std::vector<PairEvent>> events_;
+
+  FRIEND_TEST(BPETrainerTest, WordEngineTest);
 };
 }  // namespace bpe
 }  // namespace sentencepiece
@@ -89,6 +89,40 @@ TEST(BPETrainerTest, BasicTest) {
             RunTrainer({"pen", "pineapple", "apple"}, 20, {"app"}));
 }
 
+// Positions beyond 65535 characters in a sentence are supported.
+TEST(BPETrainerTest, LongSentenceTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "long_input");
+  const std::string model_prefix =
+      util::JoinPath(::testing::TempDir(), "long_model");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    std::string line;
+    for (int i = 0; i < 40000; ++i) line += i % 3 ? "ab" : "abc";
+    output->WriteLine(line);
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::BPE);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(10);
+  trainer_spec.set_model_prefix(model_prefix);
+  trainer_spec.set_max_sentence_length(1 << 20);
+  trainer_spec.set_split_by_whitespace(false);
+
+  NormalizerSpec normalizer_spec;
+  normalizer_spec.set_name("identity");
+  normalizer_spec.set_add_dummy_prefix(false);
+  NormalizerSpec denormalizer_spec;
+
+  Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+  ASSERT_TRUE(trainer.Train().ok());
+
+  SentencePieceProcessor processor;
+  ASSERT_TRUE(processor.Load(model_prefix + ".model").ok());
+  EXPECT_EQ("ab", processor.IdToPiece(3));
+}
+
 static constexpr char kTestInputData[] = "wagahaiwa_nekodearu.txt";
 
 TEST(BPETrainerTest, EndToEndTest) {
@@ -134,6 +168,145 @@ TEST(BPETrainerTest, EndToEndTest) {
             absl::StrJoin(tok, " "));
 }
 
+TEST(BPETrainerTest, NumThreadsTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), kTestInputData);
+
+  // The merges are applied in parallel, but give the same pieces.
+  auto train = [&](int num_threads) {
+    const std::string model_prefix = util::JoinPath(
+        ::testing::TempDir(), absl::StrCat("threads_model", num_threads));
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", model_prefix,
+                                 " --input=", input,
+                                 " --vocab_size=4000 --model_type=bpe"
+                                 " --split_by_whitespace=false"
+                                 " --max_sentence_length=2048"
+                                 " --num_threads=",
+                                 num_threads))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_prefix + ".model").ok());
+    std::vector<std::string> pieces;
+    for (int i = 0; i < sp.GetPieceSize(); ++i) {
+      pieces.push_back(sp.IdToPiece(i));
+    }
+    return pieces;
+  };
+
+  EXPECT_EQ(train(1), train(4));
+}
+
+// A job resumed from a checkpoint of a smaller vocabulary continues with
+// the same merges.
+TEST(BPETrainerTest, CheckpointTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+  const std::string checkpoint =
+      util::JoinPath(::testing::TempDir(), "bpe_checkpoint");
+
+  auto train = [&](int vocab_size, absl::string_view checkpoint_path,
+                   absl::string_view resume_from) {
+    const std::string model_prefix = util::JoinPath(
+        ::testing::TempDir(), absl::StrCat("bpe_model", vocab_size));
+    EXPECT_TRUE(SentencePieceTrainer::SetCheckpointForTraining(
+                    checkpoint_path, 100, resume_from)
+                    .ok());
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", model_prefix,
+                                 " --input=", input, " --model_type=bpe",
+                                 " --vocab_size=", vocab_size))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_prefix + ".model").ok());
+    std::vector<std::string> pieces;
+    for (int i = 0; i < sp.GetPieceSize(); ++i) {
+      pieces.push_back(sp.IdToPiece(i));
+    }
+    return pieces;
+  };
+
+  const auto expected = train(1000, "", "");
+  train(500, checkpoint, "");
+  EXPECT_EQ(expected, train(1000, "", checkpoint));
+}
+
+// The models of the smaller sizes are the same as the models trained with
+// these sizes.
+TEST(BPETrainerTest, ExtraVocabSizesTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+
+  auto train = [&](int vocab_size, const std::vector<int> &extra_sizes) {
+    const std::string model_prefix = util::JoinPath(
+        ::testing::TempDir(),
+        absl::StrCat(
+            extra_sizes.empty() ? "bpe_small_model" : "bpe_extra_model",
+            vocab_size));
+    EXPECT_TRUE(
+        SentencePieceTrainer::SetExtraVocabSizesForTraining(extra_sizes).ok());
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", model_prefix,
+                                 " --input=", input, " --model_type=bpe",
+                                 " --vocab_size=", vocab_size))
+                    .ok());
+    return model_prefix;
+  };
+
+  auto pieces = [](const std::string &filename) {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(filename + ".model").ok());
+    EXPECT_EQ(sp.GetPieceSize(), sp.model_proto().trainer_spec().vocab_size());
+    EXPECT_EQ(filename, sp.model_proto().trainer_spec().model_prefix());
+    std::vector<std::pair<std::string, float>> result;
+    for (int i = 0; i < sp.GetPieceSize(); ++i) {
+      result.emplace_back(sp.IdToPiece(i), sp.GetScore(i));
+    }
+    return result;
+  };
+
+  const std::string model_prefix = train(1000, {600, 2000, 10});
+  EXPECT_EQ(1000, pieces(model_prefix).size());
+  const std::string extra_prefix = absl::StrCat(model_prefix, ".600");
+  EXPECT_EQ(pieces(train(600, {})), pieces(extra_prefix));
+  EXPECT_TRUE(
+      filesystem::NewReadableFile(extra_prefix + ".vocab")->status().ok());
+
+  // Larger than the final size, or smaller than the characters.
+  for (const int size : {2000, 10}) {
+    EXPECT_FALSE(
+        filesystem::NewReadableFile(
+            absl::StrCat(model_prefix, ".", size) + ".model")
+            ->status()
+            .ok());
+  }
+}
+
 }  // namespace
+
+// On a natural corpus the word engine picks the same pieces.
+TEST(BPETrainerTest, WordEngineTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+
+  auto train = [&](bool use_word_engine) {
+    TrainerSpec trainer_spec;
+    trainer_spec.set_model_type(TrainerSpec::BPE);
+    trainer_spec.add_input(input);
+    trainer_spec.set_vocab_size(2000);
+    trainer_spec.set_model_prefix(util::JoinPath(
+        ::testing::TempDir(), absl::StrCat("word_model", use_word_engine)));
+    NormalizerSpec normalizer_spec;
+    normalizer_spec.set_name("nmt_nfkc");
+    NormalizerSpec denormalizer_spec;
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.SetWordEngine(use_word_engine);
+    EXPECT_TRUE(trainer.Train().ok());
+    return trainer.final_pieces_;
+  };
+
+  EXPECT_EQ(train(false), train(true));
+}
+
 }  // namespace bpe
 }  // namespace sentencepiece
@@ -15,10 +15,13 @@
 #include "builder.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <functional>
+#include <mutex>
 #include <utility>
 
 #include "filesystem.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_replace.h"
 #include "third_party/absl/strings/str_split.h"
@@ -35,7 +38,9 @@
 
 #include <set>
 
+#ifndef SPM_EXTERNAL_NORMALIZATION_RULES
 #include "normalization_rule.h"
+#endif
 #include "normalizer.h"
 #include "third_party/darts_clone/darts.h"
 #include "util.h"
@@ -113,6 +118,39 @@ std::vector<Builder::Chars> ExpandUnnormalized(
   CHECK_EQ(nfkd.size(), results[0].size());
   return results;
 }
+
+// Calls `func(begin, end)` over the code points [1, kMaxUnicode] split into
+// chunks [begin, end), in parallel on the shared worker pool. The ICU
+// normalizers and case folding may be called from any thread.
+void ParallelForUnicode(const std::function<void(char32, char32)> &func) {
+  RunOnSharedThreadPool(kMaxUnicode, -1, [&func](size_t begin, size_t end) {
+    func(static_cast<char32>(begin + 1), static_cast<char32>(end + 1));
+  });
+}
+
+// Returns the rules {cp} => `normalizer`({cp}) of the Unicode characters
+// which are changed by `normalizer`.
+Builder::CharsMap BuildSingleCharMap(
+    std::function<Builder::Chars(const Builder::Chars &)> normalizer) {
+  Builder::CharsMap chars_map;
+  std::mutex mutex;
+  ParallelForUnicode([&](char32 begin, char32 end) {
+    Builder::CharsMap local_map;
+    for (char32 cp = begin; cp < end; ++cp) {
+      if (!U_IS_UNICODE_CHAR(cp)) {
+        continue;
+      }
+      const auto normalized = normalizer({cp});
+      if (normalized.size() >= 2 ||
+          (normalized.size() == 1 && normalized[0] != cp)) {
+        local_map[{cp}] = normalized;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    chars_map.insert(local_map.begin(), local_map.end());
+  });
+  return chars_map;
+}
 #endif  // ENABLE_NFKC_COMPILE
 
 // Normalizes `src` with `chars_map` and returns normalized Chars.
@@ -148,6 +186,41 @@ Builder::Chars Normalize(const Builder::CharsMap &chars_map,
 
   return normalized;
 }
+
+// Calls `func(key, value)` for every key of the double-array `trie` in the
+// lexicographical order of the UTF-8 keys.
+void ForEachTrieKey(const Darts::DoubleArray &trie,
+                    const std::function<void(const std::string &, int)> &func) {
+  std::string key;
+  std::function<void(size_t, size_t)> traverse;
+
+  // Given a Trie node at `node_pos` and the key position at `key_position`,
+  // Expands children nodes from `node_pos`.
+  // When leaf nodes are found, calls `func`.
+  traverse = [&traverse, &key, &trie, &func](size_t node_pos,
+                                             size_t key_pos) -> void {
+    for (int c = 0; c <= 255; ++c) {
+      key.push_back(static_cast<char>(c));
+      size_t copied_node_pos = node_pos;
+      size_t copied_key_pos = key_pos;
+      // Note: `copied_(node|key)_pos` are non-const references.
+      // They store the new positions after node traversal.
+      const Darts::DoubleArray::result_type result = trie.traverse(
+          key.data(), copied_node_pos, copied_key_pos, key.size());
+      if (result >= -1) {   // node exists.
+        if (result >= 0) {  // has a value after transition.
+          func(key, result);
+        }
+        // Recursively traverse.
+        traverse(copied_node_pos, copied_key_pos);
+      }
+      key.pop_back();
+    }
+  };
+
+  traverse(0, 0);
+}
+
 }  // namespace
 
 // static
@@ -182,12 +255,91 @@ util::Status Builder::CompileCharsMap(const CharsMap &chars_map,
     kv.emplace_back(utf8_in, port::FindOrDie(normalized2pos, p.second));
   }
 
-  std::sort(kv.begin(), kv.end());
-  std::vector<const char *> key(kv.size());
-  std::vector<int> value(kv.size());
+  return BuildPrecompiledCharsMap(&kv, normalized, output);
+}
+
+// static
+util::Status Builder::MergeCharsMap(absl::string_view blob,
+                                    const CharsMap &delta,
+                                    std::string *output) {
+  CHECK_OR_RETURN(output);
+
+  absl::string_view trie_blob, old_normalized;
+  std::string buf;
+  std::vector<std::pair<std::string, int>> kv;  // key-value of Trie.
+  if (!blob.empty()) {
+    RETURN_IF_ERROR(Normalizer::DecodePrecompiledCharsMap(
+        blob, &trie_blob, &old_normalized, &buf));
+    Darts::DoubleArray trie;
+    trie.set_array(const_cast<char *>(trie_blob.data()),
+                   trie_blob.size() / trie.unit_size());
+    ForEachTrieKey(trie, [&kv](const std::string &key, int value) {
+      kv.emplace_back(key, value);
+    });
+  }
+
+  // The normalized strings of `blob` are kept at their positions, and only
+  // the new ones are appended.
+  std::string normalized(old_normalized.data(), old_normalized.size());
+  std::map<std::string, int> new_normalized2pos;
+  std::map<std::string, int> delta_kv;  // key => position or -1 to remove.
+  for (const auto &p : delta) {
+    const std::string utf8_in = string_util::UnicodeTextToUTF8(p.first);
+    CHECK_OR_RETURN(!utf8_in.empty());
+    CHECK_OR_RETURN(string_util::IsStructurallyValid(utf8_in));
+    if (p.first == p.second) {
+      delta_kv[utf8_in] = -1;
+      continue;
+    }
+    const std::string utf8_out = string_util::UnicodeTextToUTF8(p.second);
+    CHECK_OR_RETURN(string_util::IsStructurallyValid(utf8_out));
+    auto it = new_normalized2pos.find(utf8_out);
+    if (it == new_normalized2pos.end()) {
+      it = new_normalized2pos.emplace(utf8_out, normalized.size()).first;
+      normalized += utf8_out;
+      normalized += '\0';
+    }
+    delta_kv[utf8_in] = it->second;
+  }
+
+  // Replaces or removes the existing rules, then adds the new ones.
+  size_t size = 0;
   for (size_t i = 0; i < kv.size(); ++i) {
-    key[i] = kv[i].first.c_str();
-    value[i] = kv[i].second;
+    const auto it = delta_kv.find(kv[i].first);
+    if (it != delta_kv.end()) {
+      if (it->second < 0) continue;
+      kv[i].second = it->second;
+      delta_kv.erase(it);
+    }
+    if (size != i) kv[size] = std::move(kv[i]);
+    ++size;
+  }
+  kv.resize(size);
+  for (const auto &p : delta_kv) {
+    if (p.second >= 0) kv.emplace_back(p.first, p.second);
+  }
+
+  LOG(INFO) << "Merged " << delta.size() << " rules into CharsMap of size="
+            << kv.size();
+
+  if (kv.empty()) {
+    output->clear();
+    return util::OkStatus();
+  }
+
+  return BuildPrecompiledCharsMap(&kv, normalized, output);
+}
+
+// static
+util::Status Builder::BuildPrecompiledCharsMap(
+    std::vector<std::pair<std::string, int>> *kv, absl::string_view normalized,
+    std::string *output) {
+  std::sort(kv->begin(), kv->end());
+  std::vector<const char *> key(kv->size());
+  std::vector<int> value(kv->size());
+  for (size_t i = 0; i < kv->size(); ++i) {
+    key[i] = (*kv)[i].first.c_str();
+    value[i] = (*kv)[i].second;
   }
 
   Darts::DoubleArray trie;
@@ -195,14 +347,21 @@ util::Status Builder::CompileCharsMap(const CharsMap &chars_map,
                                    nullptr, &value[0]))
       << "cannot build double-array";
 
+  // The keys are checked in parallel, as the lookups only read the trie.
   int max_nodes_size = 0;
-  std::vector<Darts::DoubleArray::result_pair_type> results(
-      2 * Normalizer::kMaxTrieResultsSize);
-  for (const char *str : key) {
-    const int num_nodes = trie.commonPrefixSearch(str, results.data(),
-                                                  results.size(), strlen(str));
-    max_nodes_size = std::max(num_nodes, max_nodes_size);
-  }
+  std::mutex mutex;
+  RunOnSharedThreadPool(key.size(), -1, [&](size_t begin, size_t end) {
+    std::vector<Darts::DoubleArray::result_pair_type> results(
+        2 * Normalizer::kMaxTrieResultsSize);
+    int local_max = 0;
+    for (size_t i = begin; i < end; ++i) {
+      const int num_nodes = trie.commonPrefixSearch(
+          key[i], results.data(), results.size(), strlen(key[i]));
+      local_max = std::max(num_nodes, local_max);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    max_nodes_size = std::max(local_max, max_nodes_size);
+  });
   CHECK_LT_OR_RETURN(max_nodes_size, Normalizer::kMaxTrieResultsSize)
       << "This charmaps contain many shared prefix. "
       << "The number of shared prefix must be less than "
@@ -232,40 +391,16 @@ util::Status Builder::DecompileCharsMap(absl::string_view blob,
   trie.set_array(const_cast<char *>(trie_blob.data()),
                  trie_blob.size() / trie.unit_size());
 
-  std::string key;
-  std::function<void(size_t, size_t)> traverse;
-
-  // Given a Trie node at `node_pos` and the key position at `key_position`,
-  // Expands children nodes from `node_pos`.
-  // When leaf nodes are found, stores them into `chars_map`.
-  traverse = [&traverse, &key, &trie, &normalized, &chars_map](
-                 size_t node_pos, size_t key_pos) -> void {
-    for (int c = 0; c <= 255; ++c) {
-      key.push_back(static_cast<char>(c));
-      size_t copied_node_pos = node_pos;
-      size_t copied_key_pos = key_pos;
-      // Note: `copied_(node|key)_pos` are non-const references.
-      // They store the new positions after node traversal.
-      const Darts::DoubleArray::result_type result = trie.traverse(
-          key.data(), copied_node_pos, copied_key_pos, key.size());
-      if (result >= -1) {   // node exists.
-        if (result >= 0) {  // has a value after transition.
-          const absl::string_view value = normalized.data() + result;
-          Chars key_chars, value_chars;
-          for (const auto c : string_util::UTF8ToUnicodeText(key))
-            key_chars.push_back(c);
-          for (const auto c : string_util::UTF8ToUnicodeText(value))
-            value_chars.push_back(c);
-          (*chars_map)[key_chars] = value_chars;
-        }
-        // Recursively traverse.
-        traverse(copied_node_pos, copied_key_pos);
-      }
-      key.pop_back();
-    }
-  };
-
-  traverse(0, 0);
+  ForEachTrieKey(trie, [&normalized, &chars_map](const std::string &key,
+                                                 int result) {
+    const absl::string_view value = normalized.data() + result;
+    Chars key_chars, value_chars;
+    for (const auto c : string_util::UTF8ToUnicodeText(key))
+      key_chars.push_back(c);
+    for (const auto c : string_util::UTF8ToUnicodeText(value))
+      value_chars.push_back(c);
+    (*chars_map)[key_chars] = value_chars;
+  });
 
   return util::OkStatus();
 }
@@ -280,7 +415,22 @@ util::Status Builder::GetPrecompiledCharsMap(absl::string_view name,
     return util::OkStatus();
   }
 
-  std::string result;
+#ifdef SPM_EXTERNAL_NORMALIZATION_RULES
+  // The indices are read on demand, so the unused ones are never loaded.
+  static std::mutex mutex;
+  static auto *cache = new std::map<std::string, std::string>;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache->find(std::string(name));
+  if (it == cache->end()) {
+    const char *dir = std::getenv("SENTENCEPIECE_NORMALIZATION_RULE_DIR");
+    std::string blob;
+    RETURN_IF_ERROR(LoadPrecompiledCharsMap(
+        dir != nullptr ? dir : SPM_NORMALIZATION_RULE_DIR, name, &blob));
+    it = cache->emplace(std::string(name), std::move(blob)).first;
+  }
+  *output = it->second;
+  return util::OkStatus();
+#else
   for (size_t i = 0; i < kNormalizationRules_size; ++i) {
     const auto *blob = &kNormalizationRules_blob[i];
     if (blob->name == name) {
@@ -290,6 +440,24 @@ util::Status Builder::GetPrecompiledCharsMap(absl::string_view name,
   }
   return util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
          << "No precompiled charsmap is found: " << name;
+#endif  // SPM_EXTERNAL_NORMALIZATION_RULES
+}
+
+// static
+util::Status Builder::LoadPrecompiledCharsMap(absl::string_view dir,
+                                              absl::string_view name,
+                                              std::string *output) {
+  CHECK_OR_RETURN(output);
+  const std::string filename =
+      util::JoinPath(dir, absl::StrCat(name, ".bin"));
+  auto input = filesystem::NewReadableFile(filename, true);
+  if (!input->status().ok()) {
+    return util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+           << "No precompiled charsmap is found: " << name << " ("
+           << filename << ")";
+  }
+  CHECK_OR_RETURN(input->ReadAll(output));
+  return util::OkStatus();
 }
 
 #ifdef ENABLE_NFKC_COMPILE
@@ -305,41 +473,62 @@ util::Status BuildMapInternal(
   // Fully normalized one character to unnormalized one character map.
   std::map<char32, std::set<char32>> norm2orig;
 
-  Builder::CharsMap nfkc_map;  // The final NFKC mapping.
-
-  constexpr int kMaxUnicode = 0x10FFFF;
-  for (char32 cp = 1; cp <= kMaxUnicode; ++cp) {
-    if (!U_IS_UNICODE_CHAR(cp)) {
-      continue;
-    }
-    // Aggregates single character to fully NFKC normalized characters.
-    const auto nfkc = composer({cp});
-    if (nfkc.size() >= 2 || (nfkc.size() == 1 && nfkc[0] != cp)) {
-      nfkc_map[{cp}] = nfkc;
-    }
-    const auto nfkd = decomposer({cp});
-    if (nfkd.size() == 1) {
-      // Aggregates reverse mapping from normalized to unnormalized character.
-      norm2orig[nfkd[0]].insert(cp);
-    } else {
-      // One character is decomposed into multiple characters.
-      nfkd_decomposed.insert(nfkd);
+  // The final NFKC mapping, starting with the single characters aggregated
+  // to fully NFKC normalized characters.
+  Builder::CharsMap nfkc_map = BuildSingleCharMap(composer);
+
+  // The code points are decomposed in parallel. The chunks are merged into
+  // sets, so the result does not depend on the order of the chunks.
+  std::mutex mutex;
+  ParallelForUnicode([&](char32 begin, char32 end) {
+    std::set<Builder::Chars> local_decomposed;
+    std::map<char32, std::set<char32>> local_norm2orig;
+    for (char32 cp = begin; cp < end; ++cp) {
+      if (!U_IS_UNICODE_CHAR(cp)) {
+        continue;
+      }
+      const auto nfkd = decomposer({cp});
+      if (nfkd.size() == 1) {
+        // Aggregates reverse mapping from normalized to unnormalized
+        // character.
+        local_norm2orig[nfkd[0]].insert(cp);
+      } else {
+        // One character is decomposed into multiple characters.
+        local_decomposed.insert(nfkd);
+      }
     }
-  }
-
-  for (const auto &nfkd : nfkd_decomposed) {
-    const auto nfkc = composer(nfkd);
-    // This case is already covered by single-character to NFKC mapping.
-    if (nfkc == nfkd) {
-      continue;
+    std::lock_guard<std::mutex> lock(mutex);
+    nfkd_decomposed.insert(local_decomposed.begin(), local_decomposed.end());
+    for (const auto &p : local_norm2orig) {
+      norm2orig[p.first].insert(p.second.begin(), p.second.end());
     }
-    // Expand all possible sequences which are normalized into the same
-    // `nfkd`.
-    for (const auto &nfkd_orig : ExpandUnnormalized(nfkd, norm2orig)) {
-      if (nfkd_orig != nfkc) {
-        nfkc_map[nfkd_orig] = nfkc;
+  });
+
+  // Composes the decomposed sequences in parallel. The rules are added in the
+  // order of `nfkd_decomposed`, as a later sequence may override a rule.
+  const std::vector<Builder::Chars> decomposed(nfkd_decomposed.begin(),
+                                               nfkd_decomposed.end());
+  std::vector<std::vector<std::pair<Builder::Chars, Builder::Chars>>> rules(
+      decomposed.size());
+  RunOnSharedThreadPool(decomposed.size(), -1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const auto &nfkd = decomposed[i];
+      const auto nfkc = composer(nfkd);
+      // This case is already covered by single-character to NFKC mapping.
+      if (nfkc == nfkd) {
+        continue;
+      }
+      // Expand all possible sequences which are normalized into the same
+      // `nfkd`.
+      for (const auto &nfkd_orig : ExpandUnnormalized(nfkd, norm2orig)) {
+        if (nfkd_orig != nfkc) {
+          rules[i].emplace_back(nfkd_orig, nfkc);
+        }
       }
     }
+  });
+  for (const auto &rule : rules) {
+    for (const auto &p : rule) nfkc_map[p.first] = p.second;
   }
 
   RETURN_IF_ERROR(Builder::RemoveRedundantMap(&nfkc_map));
@@ -399,15 +588,23 @@ util::Status Builder::MergeUnicodeCaseFoldMap(Builder::CharsMap *chars_map) {
     c.second = trg;
   }
 
-  constexpr int kMaxUnicode = 0x10FFFF;
-  for (char32 cp = 1; cp <= kMaxUnicode; ++cp) {
-    if (!U_IS_UNICODE_CHAR(cp)) {
-      continue;
+  // Only reads `chars_map` while folding the code points in parallel.
+  std::vector<std::pair<char32, char32>> folded;
+  std::mutex mutex;
+  ParallelForUnicode([&](char32 begin, char32 end) {
+    std::vector<std::pair<char32, char32>> local_folded;
+    for (char32 cp = begin; cp < end; ++cp) {
+      if (!U_IS_UNICODE_CHAR(cp)) {
+        continue;
+      }
+      if (chars_map->find({cp}) != chars_map->end()) continue;
+      const char32 trg = u_foldCase(cp, U_FOLD_CASE_DEFAULT);
+      if (trg != cp) local_folded.emplace_back(cp, trg);
     }
-    if (chars_map->find({cp}) != chars_map->end()) continue;
-    const char32 trg = u_foldCase(cp, U_FOLD_CASE_DEFAULT);
-    if (trg != cp) (*chars_map)[{cp}] = {trg};
-  }
+    std::lock_guard<std::mutex> lock(mutex);
+    folded.insert(folded.end(), local_folded.begin(), local_folded.end());
+  });
+  for (const auto &p : folded) (*chars_map)[{p.first}] = {p.second};
 
   RETURN_IF_ERROR(RemoveRedundantMap(chars_map));
 #endif
@@ -506,15 +703,8 @@ util::Status Builder::BuildNmtNFKC_CFMap(CharsMap *chars_map) {
 // static
 util::Status Builder::BuildNFKDMap(CharsMap *chars_map) {
 #ifdef ENABLE_NFKC_COMPILE
-  constexpr int kMaxUnicode = 0x10FFFF;
-  for (char32 cp = 1; cp <= kMaxUnicode; ++cp) {
-    if (!U_IS_UNICODE_CHAR(cp)) {
-      continue;
-    }
-    const auto nfkd = ToNFKD({cp});
-    if (nfkd.size() >= 2 || (nfkd.size() == 1 && nfkd[0] != cp)) {
-      (*chars_map)[{cp}] = nfkd;
-    }
+  for (const auto &p : BuildSingleCharMap(ToNFKD)) {
+    (*chars_map)[p.first] = p.second;
   }
 #else
   LOG(ERROR) << kCompileError;
@@ -525,15 +715,8 @@ util::Status Builder::BuildNFKDMap(CharsMap *chars_map) {
 // static
 util::Status Builder::BuildNFDMap(CharsMap *chars_map) {
 #ifdef ENABLE_NFKC_COMPILE
-  constexpr int kMaxUnicode = 0x10FFFF;
-  for (char32 cp = 1; cp <= kMaxUnicode; ++cp) {
-    if (!U_IS_UNICODE_CHAR(cp)) {
-      continue;
-    }
-    const auto nfd = ToNFD({cp});
-    if (nfd.size() >= 2 || (nfd.size() == 1 && nfd[0] != cp)) {
-      (*chars_map)[{cp}] = nfd;
-    }
+  for (const auto &p : BuildSingleCharMap(ToNFD)) {
+    (*chars_map)[p.first] = p.second;
   }
 
 #else
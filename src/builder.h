@@ -17,6 +17,7 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "common.h"
@@ -50,10 +51,29 @@ class Builder {
   static util::Status DecompileCharsMap(absl::string_view blob,
                                         CharsMap *chars_map);
 
-  // Returns a pre-compiled binary index with `name`.
+  // Merges the rules of `delta` into the precompiled charsmap `blob` and
+  // writes the result to `output`. A rule of `delta` replaces the rule of the
+  // same source in `blob`, and a rule mapping a source to itself removes it.
+  // The normalized strings of `blob` are reused as they are, and only the
+  // trie is rebuilt, so that a few user rules can be added to a large map,
+  // e.g. nfkc, without building the map again.
+  static util::Status MergeCharsMap(absl::string_view blob,
+                                    const CharsMap &delta, std::string *output);
+
+  // Returns a pre-compiled binary index with `name`. When SentencePiece is
+  // built with SPM_EXTERNAL_NORMALIZATION_RULES, the index is read on the
+  // first request by LoadPrecompiledCharsMap() from the directory given by
+  // the SENTENCEPIECE_NORMALIZATION_RULE_DIR environment variable, or else
+  // SPM_NORMALIZATION_RULE_DIR, and is kept for the later requests.
   static util::Status GetPrecompiledCharsMap(absl::string_view name,
                                              std::string *output);
 
+  // Reads the pre-compiled binary index `name` from `<dir>/<name>.bin`, as
+  // written by compile_charsmap --output_binary_dir.
+  static util::Status LoadPrecompiledCharsMap(absl::string_view dir,
+                                              absl::string_view name,
+                                              std::string *output);
+
   // Makes a normalization mapping based on NFKC.
   //
   // Note that Normalizer/Builder classes do not support
@@ -142,6 +162,13 @@ class Builder {
 
  private:
   FRIEND_TEST(BuilderTest, RemoveRedundantMapTest);
+
+  // Builds the trie of `kv`, whose values are the positions of the normalized
+  // strings in `normalized`, and writes the precompiled charsmap to `output`.
+  // Sorts `kv` by key.
+  static util::Status BuildPrecompiledCharsMap(
+      std::vector<std::pair<std::string, int>> *kv,
+      absl::string_view normalized, std::string *output);
 };
 }  // namespace normalizer
 }  // namespace sentencepiece
@@ -97,6 +97,28 @@ TEST(BuilderTest, GetPrecompiledCharsMapTest) {
   }
 }
 
+TEST(BuilderTest, LoadPrecompiledCharsMapTest) {
+  std::string blob;
+  EXPECT_TRUE(Builder::GetPrecompiledCharsMap("nmt_nfkc", &blob).ok());
+  {
+    auto output = filesystem::NewWritableFile(
+        util::JoinPath(::testing::TempDir(), "nmt_nfkc.bin"), true);
+    EXPECT_TRUE(output->Write(blob));
+  }
+
+  std::string loaded;
+  EXPECT_TRUE(
+      Builder::LoadPrecompiledCharsMap(::testing::TempDir(), "nmt_nfkc",
+                                       &loaded)
+          .ok());
+  EXPECT_EQ(blob, loaded);
+
+  EXPECT_EQ(util::StatusCode::kNotFound,
+            Builder::LoadPrecompiledCharsMap(::testing::TempDir(),
+                                             "__UNKNOWN__", &loaded)
+                .code());
+}
+
 TEST(BuilderTest, CompileCharsMap) {
   Builder::CharsMap chars_map;
 
@@ -137,6 +159,69 @@ TEST(BuilderTest, CompileCharsMap) {
   EXPECT_EQ("abcか", normalizer.Normalize("あいうえおか"));
 }
 
+TEST(BuilderTest, MergeCharsMapTest) {
+  Builder::CharsMap chars_map;
+  chars_map[{0x0061}] = {0x0041};                  // a => A
+  chars_map[{0x0062}] = {0x0042};                  // b => B
+  chars_map[{0x0063}] = {0x0043};                  // c => C
+  chars_map[{0x3042, 0x3044}] = {0x0061, 0x0062};  // あい => ab
+
+  std::string blob;
+  ASSERT_TRUE(Builder::CompileCharsMap(chars_map, &blob).ok());
+
+  Builder::CharsMap delta;
+  delta[{0x0061}] = {0x0078};    // a => x, replaced.
+  delta[{0x0062}] = {0x0062};    // b => b, removed.
+  delta[{0x0064}] = {0x0041};    // d => A, reuses "A".
+  delta[{0x3048, 0x304A}] = {};  // えお => "", added.
+  delta[{0x0065}] = {0x0065};    // e => e, not in the map.
+
+  std::string merged;
+  ASSERT_TRUE(Builder::MergeCharsMap(blob, delta, &merged).ok());
+
+  Builder::CharsMap expected = chars_map;
+  expected[{0x0061}] = {0x0078};
+  expected.erase({0x0062});
+  expected[{0x0064}] = {0x0041};
+  expected[{0x3048, 0x304A}] = {};
+  Builder::CharsMap decompiled;
+  ASSERT_TRUE(Builder::DecompileCharsMap(merged, &decompiled).ok());
+  EXPECT_EQ(expected, decompiled);
+
+  NormalizerSpec spec;
+  spec.set_add_dummy_prefix(false);
+  spec.set_precompiled_charsmap(merged);
+  const Normalizer normalizer(spec);
+  EXPECT_EQ("xbCA", normalizer.Normalize("abcd"));
+  EXPECT_EQ("ab", normalizer.Normalize("あい"));
+  EXPECT_EQ("", normalizer.Normalize("えお"));
+
+  // Merges into an empty or a pre-compiled map.
+  ASSERT_TRUE(Builder::MergeCharsMap("", chars_map, &merged).ok());
+  ASSERT_TRUE(Builder::DecompileCharsMap(merged, &decompiled).ok());
+  EXPECT_EQ(chars_map, decompiled);
+
+  ASSERT_TRUE(Builder::GetPrecompiledCharsMap("nmt_nfkc", &blob).ok());
+  ASSERT_TRUE(Builder::DecompileCharsMap(blob, &expected).ok());
+  ASSERT_TRUE(Builder::MergeCharsMap(blob, delta, &merged).ok());
+  for (const auto &p : delta) {
+    if (p.first == p.second) {
+      expected.erase(p.first);
+    } else {
+      expected[p.first] = p.second;
+    }
+  }
+  ASSERT_TRUE(Builder::DecompileCharsMap(merged, &decompiled).ok());
+  EXPECT_EQ(expected, decompiled);
+
+  // Removing all the rules gives the identity map.
+  delta.clear();
+  for (const auto &p : chars_map) delta[p.first] = p.first;
+  ASSERT_TRUE(Builder::CompileCharsMap(chars_map, &blob).ok());
+  ASSERT_TRUE(Builder::MergeCharsMap(blob, delta, &merged).ok());
+  EXPECT_TRUE(merged.empty());
+}
+
 static constexpr char kTestInputData[] = "nfkc.tsv";
 
 TEST(BuilderTest, LoadCharsMapTest) {
@@ -13,18 +13,69 @@
 // limitations under the License.!
 
 #include "char_model.h"
+
+#include <algorithm>
+
 #include "util.h"
 
 namespace sentencepiece {
 namespace character {
 
+namespace {
+constexpr char32 kNumBMPChars = 0x10000;
+
+// Returns true if `w` is one valid character and stores it in `c`.
+inline bool DecodeOneChar(absl::string_view w, char32 *c) {
+  size_t mblen = 0;
+  *c = string_util::DecodeUTF8(w, &mblen);
+  return mblen == w.size() && (*c != kUnicodeError || mblen == 3);
+}
+}  // namespace
+
 Model::Model(const ModelProto &model_proto) {
   model_proto_ = &model_proto;
   InitializePieces();
+  if (!status().ok()) return;
+
+  // PieceToId() decides the id of a character which is the surface of
+  // several pieces.
+  bmp_ids_.assign(kNumBMPChars, unk_id_);
+  for (const auto &sp : model_proto_->pieces()) {
+    if (sp.type() == ModelProto::SentencePiece::USER_DEFINED) {
+      has_user_defined_ = true;
+    }
+    char32 c = 0;
+    if (!DecodeOneChar(sp.piece(), &c)) continue;
+    if (c < kNumBMPChars) {
+      bmp_ids_[c] = PieceToId(sp.piece());
+    } else {
+      supplementary_ids_[c] = PieceToId(sp.piece());
+    }
+  }
 }
 
 Model::~Model() {}
 
+void Model::GetMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::GetMemoryUsage(usage);
+  usage->model_tables += port::VectorBytes(bmp_ids_) +
+                         port::HashMapBytes(supplementary_ids_);
+}
+
+int Model::CharToId(absl::string_view w) const {
+  if (w.size() == 1 && static_cast<unsigned char>(w[0]) < 0x80) {
+    return bmp_ids_[static_cast<unsigned char>(w[0])];
+  }
+  char32 c = 0;
+  if (!DecodeOneChar(w, &c)) {
+    // Broken characters and user defined symbols.
+    return PieceToId(w);
+  }
+  if (c < kNumBMPChars) return bmp_ids_[c];
+  const auto it = supplementary_ids_.find(c);
+  return it == supplementary_ids_.end() ? unk_id_ : it->second;
+}
+
 EncodeResult Model::Encode(absl::string_view normalized) const {
   if (!status().ok() || normalized.empty()) {
     return {};
@@ -33,9 +84,13 @@ EncodeResult Model::Encode(absl::string_view normalized) const {
   // Splits the input into character sequence
   EncodeResult output;
   while (!normalized.empty()) {
-    const int mblen = matcher_->PrefixMatch(normalized);
+    const int mblen =
+        has_user_defined_
+            ? matcher_->PrefixMatch(normalized)
+            : std::min<int>(normalized.size(),
+                            string_util::OneCharLen(normalized.data()));
     absl::string_view w(normalized.data(), mblen);
-    output.emplace_back(w, PieceToId(w));
+    output.emplace_back(w, CharToId(w));
     normalized.remove_prefix(mblen);
   }
 
@@ -15,8 +15,11 @@
 #ifndef CHAR_MODEL_H_
 #define CHAR_MODEL_H_
 
+#include <vector>
+
 #include "model_interface.h"
 #include "sentencepiece_model.pb.h"
+#include "third_party/absl/container/flat_hash_map.h"
 
 namespace sentencepiece {
 namespace character {
@@ -28,6 +31,21 @@ class Model : public ModelInterface {
   ~Model() override;
 
   EncodeResult Encode(absl::string_view normalized) const override;
+
+  // Adds the character to id tables.
+  void GetMemoryUsage(MemoryUsage *usage) const override;
+
+ private:
+  // Returns the id of the character or user defined symbol `w`.
+  inline int CharToId(absl::string_view w) const;
+
+  // Id of each character of the BMP, and of the other characters in the
+  // vocabulary. The unknown characters map to the unknown id.
+  std::vector<int> bmp_ids_;
+  absl::flat_hash_map<char32, int> supplementary_ids_;
+
+  // True if there are user defined symbols, which the PrefixMatcher finds.
+  bool has_user_defined_ = false;
 };
 }  // namespace character
 }  // namespace sentencepiece
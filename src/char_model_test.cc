@@ -106,6 +106,44 @@ TEST(ModelTest, EncodeTest) {
   EXPECT_EQ("d", result[5].first);
 }
 
+TEST(ModelTest, EncodeCharTableTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, WS);            // 3
+  AddPiece(&model_proto, "a");           // 4
+  AddPiece(&model_proto, "東");          // 5
+  AddPiece(&model_proto, "\xF0\x9F\x98\x80");  // 6, U+1F600
+  AddPiece(&model_proto, "\xEF\xBF\xBD");      // 7, U+FFFD
+
+  for (const bool user_defined : {false, true}) {
+    if (user_defined) {
+      AddPiece(&model_proto, "京都");  // 8
+      model_proto.mutable_pieces(8)->set_type(
+          ModelProto::SentencePiece::USER_DEFINED);
+    }
+    const Model model(model_proto);
+    ASSERT_TRUE(model.status().ok());
+
+    const std::string broken = std::string("京").substr(0, 2);
+    const std::string input = WS "a東京\xF0\x9F\x98\x80\xF0\x9F\x98\x81"
+                              "\xEF\xBF\xBD京都" +
+                              broken;
+    const auto result = model.Encode(input);
+    std::vector<int> ids;
+    std::string joined;
+    for (const auto &p : result) {
+      EXPECT_EQ(model.PieceToId(p.first), p.second);
+      ids.push_back(p.second);
+      joined.append(p.first.data(), p.first.size());
+    }
+    EXPECT_EQ(input, joined);
+    if (user_defined) {
+      EXPECT_EQ(std::vector<int>({3, 4, 5, 0, 6, 0, 7, 8, 0}), ids);
+    } else {
+      EXPECT_EQ(std::vector<int>({3, 4, 5, 0, 6, 0, 7, 0, 0, 0}), ids);
+    }
+  }
+}
+
 TEST(CharModelTest, NotSupportedTest) {
   ModelProto model_proto = MakeBaseModelProto();
   const Model model(model_proto);
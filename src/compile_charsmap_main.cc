@@ -29,6 +29,10 @@ using sentencepiece::normalizer::Builder;
 
 ABSL_FLAG(bool, output_precompiled_header, false,
           "make normalization_rule.h file");
+ABSL_FLAG(std::string, output_binary_dir, "",
+          "writes the precompiled charsmaps as <dir>/<name>.bin files, which "
+          "are loaded at runtime when SentencePiece is built with "
+          "-DSPM_EXTERNAL_NORMALIZATION_RULES=ON");
 
 namespace sentencepiece {
 namespace {
@@ -202,5 +206,15 @@ int main(int argc, char **argv) {
     output->Write(sentencepiece::MakeHeader(data));
   }
 
+  if (!absl::GetFlag(FLAGS_output_binary_dir).empty()) {
+    for (const auto &p : data) {
+      auto output = sentencepiece::filesystem::NewWritableFile(
+          absl::GetFlag(FLAGS_output_binary_dir) + "/" + p.first + ".bin",
+          true);
+      CHECK_OK(output->status());
+      CHECK(output->Write(p.second));
+    }
+  }
+
   return 0;
 }
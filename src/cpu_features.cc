@@ -0,0 +1,121 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "cpu_features.h"
+
+#include <atomic>
+#include <cstdlib>
+
+#include "common.h"
+
+namespace sentencepiece {
+namespace cpu {
+namespace {
+
+constexpr struct {
+  SimdLevel level;
+  const char *name;
+} kSimdLevelNames[] = {
+    {SimdLevel::kScalar, "scalar"}, {SimdLevel::kSSE2, "sse2"},
+    {SimdLevel::kSSE42, "sse4.2"},  {SimdLevel::kAVX2, "avx2"},
+    {SimdLevel::kAVX512, "avx512"}, {SimdLevel::kNEON, "neon"},
+};
+
+SimdLevel Detect() {
+#if defined(SPM_X86_DISPATCH)
+  __builtin_cpu_init();
+  // The checks of AVX include the support of the OS for the registers.
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return SimdLevel::kAVX512;
+  if (__builtin_cpu_supports("avx2")) return SimdLevel::kAVX2;
+  if (__builtin_cpu_supports("sse4.2")) return SimdLevel::kSSE42;
+  if (__builtin_cpu_supports("sse2")) return SimdLevel::kSSE2;
+  return SimdLevel::kScalar;
+#elif defined(__SSE2__)
+  return SimdLevel::kSSE2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  return SimdLevel::kNEON;
+#else
+  return SimdLevel::kScalar;
+#endif
+}
+
+// The level in use, initialized from DetectedSimdLevel() and
+// SPM_SIMD_LEVEL on the first call.
+std::atomic<int> &CurrentLevel() {
+  static std::atomic<int> level([]() {
+    SimdLevel result = DetectedSimdLevel();
+    const char *env = std::getenv("SPM_SIMD_LEVEL");
+    if (env != nullptr && *env != '\0') {
+      SimdLevel forced;
+      if (!ParseSimdLevel(env, &forced)) {
+        LOG(WARNING) << "Unknown SPM_SIMD_LEVEL: " << env;
+      } else if (!IsSupported(forced)) {
+        LOG(WARNING) << "SPM_SIMD_LEVEL=" << env
+                     << " is not supported on this CPU.";
+      } else {
+        result = forced;
+      }
+    }
+    return static_cast<int>(result);
+  }());
+  return level;
+}
+
+}  // namespace
+
+SimdLevel DetectedSimdLevel() {
+  static const SimdLevel level = Detect();
+  return level;
+}
+
+bool IsSupported(SimdLevel level) {
+  if (level == SimdLevel::kScalar) return true;
+  const SimdLevel detected = DetectedSimdLevel();
+  if (detected == SimdLevel::kNEON || level == SimdLevel::kNEON) {
+    return level == detected;
+  }
+  return level <= detected;
+}
+
+SimdLevel GetSimdLevel() {
+  return static_cast<SimdLevel>(
+      CurrentLevel().load(std::memory_order_relaxed));
+}
+
+bool SetSimdLevel(SimdLevel level) {
+  if (!IsSupported(level)) return false;
+  CurrentLevel().store(static_cast<int>(level), std::memory_order_relaxed);
+  return true;
+}
+
+const char *SimdLevelName(SimdLevel level) {
+  for (const auto &entry : kSimdLevelNames) {
+    if (entry.level == level) return entry.name;
+  }
+  return "unknown";
+}
+
+bool ParseSimdLevel(absl::string_view name, SimdLevel *level) {
+  for (const auto &entry : kSimdLevelNames) {
+    if (name == entry.name) {
+      *level = entry.level;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace cpu
+}  // namespace sentencepiece
@@ -0,0 +1,80 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef CPU_FEATURES_H_
+#define CPU_FEATURES_H_
+
+#include "third_party/absl/strings/string_view.h"
+
+// Kernels for instruction sets above the baseline of the build are compiled
+// in the same translation unit with a target attribute and selected at
+// runtime with cpu::GetSimdLevel():
+//
+//   #ifdef SPM_X86_DISPATCH
+//   SPM_TARGET_AVX2 size_t KernelAVX2(...) { ... _mm256_... }
+//   #endif
+//
+//   #ifdef SPM_X86_DISPATCH
+//     if (cpu::GetSimdLevel() >= cpu::SimdLevel::kAVX2) return KernelAVX2();
+//   #endif
+//
+// The levels are only compared with the levels of the same architecture.
+#if !defined(SPM_DISABLE_SIMD_DISPATCH) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SPM_X86_DISPATCH 1
+#include <immintrin.h>
+#define SPM_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define SPM_TARGET_AVX2 __attribute__((target("avx2")))
+#define SPM_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+namespace sentencepiece {
+namespace cpu {
+
+// Instruction set levels of the SIMD kernels. The x86 levels are in
+// increasing order.
+enum class SimdLevel {
+  kScalar = 0,
+  kSSE2 = 1,    // Baseline of x86-64.
+  kSSE42 = 2,
+  kAVX2 = 3,
+  kAVX512 = 4,  // AVX-512 F and BW.
+  kNEON = 5,    // Baseline of aarch64.
+};
+
+// Returns the highest level supported by both the CPU and the build.
+SimdLevel DetectedSimdLevel();
+
+// Returns true if the kernels of `level` can run on this CPU. kScalar is
+// always supported.
+bool IsSupported(SimdLevel level);
+
+// Returns the level used by the kernels. It is the detected level, unless
+// another supported level is set by the SPM_SIMD_LEVEL environment variable
+// at startup or by SetSimdLevel().
+SimdLevel GetSimdLevel();
+
+// Makes the kernels use `level`, e.g. to test the scalar code on a machine
+// with AVX2. Returns false and keeps the current level if `level` is not
+// supported. Must not be called while kernels are running.
+bool SetSimdLevel(SimdLevel level);
+
+// Converts between a level and its name: scalar, sse2, sse4.2, avx2,
+// avx512 or neon.
+const char *SimdLevelName(SimdLevel level);
+bool ParseSimdLevel(absl::string_view name, SimdLevel *level);
+
+}  // namespace cpu
+}  // namespace sentencepiece
+#endif  // CPU_FEATURES_H_
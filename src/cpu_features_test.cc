@@ -0,0 +1,77 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "cpu_features.h"
+
+#include <string>
+
+#include "testharness.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace cpu {
+
+constexpr SimdLevel kAllLevels[] = {
+    SimdLevel::kScalar, SimdLevel::kSSE2,   SimdLevel::kSSE42,
+    SimdLevel::kAVX2,   SimdLevel::kAVX512, SimdLevel::kNEON};
+
+TEST(CpuFeaturesTest, NameTest) {
+  for (const SimdLevel level : kAllLevels) {
+    SimdLevel parsed;
+    EXPECT_TRUE(ParseSimdLevel(SimdLevelName(level), &parsed));
+    EXPECT_EQ(level, parsed);
+  }
+  SimdLevel parsed;
+  EXPECT_FALSE(ParseSimdLevel("", &parsed));
+  EXPECT_FALSE(ParseSimdLevel("mmx", &parsed));
+}
+
+TEST(CpuFeaturesTest, SetSimdLevelTest) {
+  const SimdLevel original = GetSimdLevel();
+  EXPECT_TRUE(IsSupported(original));
+  EXPECT_TRUE(IsSupported(DetectedSimdLevel()));
+  EXPECT_TRUE(IsSupported(SimdLevel::kScalar));
+
+  for (const SimdLevel level : kAllLevels) {
+    if (IsSupported(level)) {
+      EXPECT_TRUE(SetSimdLevel(level));
+      EXPECT_EQ(level, GetSimdLevel());
+    } else {
+      const SimdLevel current = GetSimdLevel();
+      EXPECT_FALSE(SetSimdLevel(level));
+      EXPECT_EQ(current, GetSimdLevel());
+    }
+  }
+
+  EXPECT_TRUE(SetSimdLevel(original));
+}
+
+TEST(CpuFeaturesTest, KernelsTest) {
+  // Every kernel returns the same results.
+  const SimdLevel original = GetSimdLevel();
+  for (const SimdLevel level : kAllLevels) {
+    if (!SetSimdLevel(level)) continue;
+    for (size_t size = 0; size < 200; size += 7) {
+      for (size_t pos = 0; pos <= size; ++pos) {
+        std::string str(size, 'a');
+        if (pos < size) str[pos] = '\x80';
+        EXPECT_EQ(pos, string_util::ASCIIPrefixLength(str));
+      }
+    }
+  }
+  EXPECT_TRUE(SetSimdLevel(original));
+}
+
+}  // namespace cpu
+}  // namespace sentencepiece
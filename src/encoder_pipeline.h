@@ -0,0 +1,192 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef ENCODER_PIPELINE_H_
+#define ENCODER_PIPELINE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+#include "model_interface.h"
+#include "normalizer.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// Output options of EncoderPipeline, fixed at compile time. They are applied
+// in the order of EncodeOptions: reverse, bos and then eos.
+template <bool AddBos = false, bool AddEos = false, bool Reverse = false>
+struct PipelineOptions {
+  static constexpr bool kAddBos = AddBos;
+  static constexpr bool kAddEos = AddEos;
+  static constexpr bool kReverse = Reverse;
+};
+
+// Encodes text into the ids of SentencePieceProcessor::Encode() with the
+// model type, the normalizer type and the output options known at compile
+// time. The calls into ModelT and NormalizerT are not virtual and the
+// options are not branched on at runtime, so the normalize, segment and
+// emit path can be inlined into the caller's loop.
+//
+//   EncoderPipeline<unigram::Model, normalizer::Normalizer,
+//                   PipelineOptions<true, true>> pipeline(sp);
+//   CHECK_OK(pipeline.status());
+//   EncodeContext context;
+//   for (const auto &line : lines) {
+//     CHECK_OK(pipeline.Encode(line, &ids, &context));
+//   }
+//
+// The pipeline fails to initialize when the model or the normalizer of the
+// processor is not a ModelT or a NormalizerT, or when the processor has
+// encode extra options, which the pipeline would otherwise drop. Unlike
+// Encode(), it neither records metrics nor encodes long inputs in parallel.
+// `processor` must outlive the pipeline and must not be reloaded.
+template <typename ModelT, typename NormalizerT = normalizer::Normalizer,
+          typename Options = PipelineOptions<>>
+class EncoderPipeline {
+ public:
+  explicit EncoderPipeline(const SentencePieceProcessor &processor) {
+    status_ = Init(processor);
+  }
+
+  util::Status status() const { return status_; }
+
+  // Encodes `input` into `ids`. `context` holds the work buffers and must
+  // not be shared by concurrent calls.
+  util::Status Encode(absl::string_view input, std::vector<int> *ids,
+                      EncodeContext *context) const {
+    RETURN_IF_ERROR(status_);
+    CHECK_OR_RETURN(ids) << "output container is null";
+    CHECK_OR_RETURN(context) << "context is null";
+    ids->clear();
+
+    std::string &normalized = context->normalized_;
+    RETURN_IF_ERROR(normalizer_->NormalizerT::Normalize(
+        input, &normalized, static_cast<normalizer::Alignment *>(nullptr)));
+
+    auto &result = context->result_;
+    if (model_->word_cache()) {
+      model_->EncodeWithWordCache(normalized, &result, &context->scratch_);
+    } else if constexpr (kHasScratch) {
+      model_->ModelT::EncodeWithScratch(normalized, &result,
+                                        &context->scratch_);
+    } else {
+      result = model_->ModelT::Encode(normalized);
+    }
+
+    ids->reserve(result.size() + Options::kAddBos + Options::kAddEos);
+    if constexpr (Options::kAddBos) ids->push_back(bos_id_);
+    const size_t begin = ids->size();
+
+    size_t consumed = 0;
+    bool is_prev_unk = false;
+    for (const auto &p : result) {
+      const absl::string_view w = p.first;  // piece
+      const int id = p.second;              // id
+
+      CHECK_OR_RETURN(!w.empty()) << "Empty piece is not allowed.";
+
+      const PieceKind kind = kinds_[id];
+      const bool is_unk = kind == kUnknown;
+
+      if (kind == kControl) {
+        ids->push_back(id);
+      } else {
+        if (is_unk && !byte_ids_.empty()) {
+          // Decomposes an unknown piece into UTF-8 bytes
+          for (const char b : w) {
+            ids->push_back(byte_ids_[static_cast<unsigned char>(b)]);
+          }
+        } else if (!(is_prev_unk && is_unk)) {
+          // Continuous run of unknown pieces is merged into one.
+          ids->push_back(id);
+        }
+        consumed += w.size();
+      }
+      is_prev_unk = is_unk;
+    }
+
+    CHECK_EQ_OR_RETURN(consumed, normalized.size())
+        << "all normalized characters are not consumed.";
+
+    if constexpr (Options::kReverse) {
+      std::reverse(ids->begin() + begin, ids->end());
+    }
+    if constexpr (Options::kAddEos) ids->push_back(eos_id_);
+
+    return util::OkStatus();
+  }
+
+ private:
+  enum PieceKind : uint8_t { kNormal, kUnknown, kControl };
+
+  // True when ModelT overrides EncodeWithScratch(); otherwise the default
+  // one would call the virtual Encode().
+  static constexpr bool kHasScratch = !std::is_same<
+      decltype(&ModelT::EncodeWithScratch),
+      void (ModelInterface::*)(absl::string_view, EncodeResult *,
+                               std::unique_ptr<EncodeScratch> *) const>::value;
+
+  util::Status Init(const SentencePieceProcessor &processor) {
+    RETURN_IF_ERROR(processor.status());
+    model_ = dynamic_cast<const ModelT *>(processor.model_.get());
+    CHECK_OR_RETURN(model_) << "the model is not of the pipeline's type.";
+    normalizer_ =
+        dynamic_cast<const NormalizerT *>(processor.normalizer_.get());
+    CHECK_OR_RETURN(normalizer_)
+        << "the normalizer is not of the pipeline's type.";
+    CHECK_OR_RETURN(processor.encode_extra_options_.empty())
+        << "the pipeline does not apply the encode extra options.";
+
+    // The piece types are looked up once per piece, so they are kept in a
+    // flat table instead of going through the model proto.
+    kinds_.resize(processor.GetPieceSize(), kNormal);
+    for (int id = 0; id < processor.GetPieceSize(); ++id) {
+      if (processor.IsControl(id)) {
+        kinds_[id] = kControl;
+      } else if (processor.IsUnknown(id)) {
+        kinds_[id] = kUnknown;
+      }
+    }
+    if (model_->ByteFallbackEnabled()) {
+      byte_ids_.resize(256);
+      for (int b = 0; b < 256; ++b) {
+        byte_ids_[b] = model_->ByteToId(b);
+      }
+    }
+    bos_id_ = processor.PieceToId(
+        absl::string_view(model_->bos_piece().data()));
+    eos_id_ = processor.PieceToId(
+        absl::string_view(model_->eos_piece().data()));
+    return util::OkStatus();
+  }
+
+  util::Status status_;
+  const ModelT *model_ = nullptr;
+  const NormalizerT *normalizer_ = nullptr;
+  std::vector<PieceKind> kinds_;
+  // Ids of the byte pieces. Empty unless the byte fallback is enabled.
+  std::vector<int> byte_ids_;
+  int bos_id_ = -1;
+  int eos_id_ = -1;
+};
+
+}  // namespace sentencepiece
+#endif  // ENCODER_PIPELINE_H_
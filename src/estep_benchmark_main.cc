@@ -0,0 +1,191 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Compares the accumulators of the E step of the unigram trainer on random
+// lattices: the drift of the expected counts and the objective from exact
+// sums, and the throughput.
+//
+//   % estep_benchmark --sentences=1000000 --freq=100
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "init.h"
+#include "third_party/absl/flags/flag.h"
+#include "unigram_model.h"
+
+ABSL_FLAG(int32, length, 30, "Number of characters of the sentences.");
+ABSL_FLAG(int32, max_piece_length, 8, "Maximum length of the nodes.");
+ABSL_FLAG(int32, vocab_size, 1000, "Number of the vocabulary ids.");
+ABSL_FLAG(int32, lattices, 100, "Number of distinct random lattices.");
+ABSL_FLAG(int64, sentences, 100000, "Number of sentences to sum.");
+ABSL_FLAG(int32, freq, 100, "Frequency of the sentences.");
+ABSL_FLAG(uint32, seed, 1, "Seed of the random scores.");
+
+namespace sentencepiece {
+namespace {
+
+using Lattice = unigram::Lattice;
+
+// Fills `lattice` with all the nodes up to --max_piece_length characters
+// with random ids and scores.
+void BuildLattice(std::mt19937 *mt, Lattice *lattice,
+                  const std::string &sentence) {
+  std::uniform_real_distribution<float> score(-10.0, 0.0);
+  std::uniform_int_distribution<int> id(0, absl::GetFlag(FLAGS_vocab_size) - 1);
+  lattice->SetSentence(sentence);
+  const int max_length = absl::GetFlag(FLAGS_max_piece_length);
+  for (int pos = 0; pos < lattice->size(); ++pos) {
+    for (int len = 1; len <= max_length && pos + len <= lattice->size();
+         ++len) {
+      auto *node = lattice->Insert(pos, len);
+      node->id = id(*mt);
+      node->score = score(*mt);
+    }
+  }
+}
+
+// Sums of the expected counts and the objective of one accumulator.
+struct Result {
+  std::vector<double> expected;
+  double objective = 0.0;
+  double seconds = 0.0;
+};
+
+// Runs `add(lattice, freq)`, which returns the log-likelihood, for all the
+// sentences and returns the elapsed seconds.
+template <typename Add>
+double Measure(const std::vector<Lattice> &lattices, float freq, Add &&add) {
+  const int64 sentences = absl::GetFlag(FLAGS_sentences);
+  const auto start = std::chrono::steady_clock::now();
+  for (int64 i = 0; i < sentences; ++i) {
+    add(lattices[i % lattices.size()], freq);
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Returns the largest relative error of `values` from `exact`.
+double MaxRelativeError(const std::vector<long double> &exact,
+                        const std::vector<double> &values) {
+  double error = 0.0;
+  for (size_t i = 0; i < exact.size(); ++i) {
+    if (exact[i] == 0.0) continue;
+    const long double relative = (values[i] - exact[i]) / exact[i];
+    error = std::max(error, static_cast<double>(std::abs(relative)));
+  }
+  return error;
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  using sentencepiece::Lattice;
+  using sentencepiece::Result;
+  const int vocab_size = absl::GetFlag(FLAGS_vocab_size);
+  const int64 sentences = absl::GetFlag(FLAGS_sentences);
+  const float freq = absl::GetFlag(FLAGS_freq);
+
+  std::mt19937 mt(absl::GetFlag(FLAGS_seed));
+  const std::string sentence(absl::GetFlag(FLAGS_length), 'a');
+  std::vector<Lattice> lattices(absl::GetFlag(FLAGS_lattices));
+  for (auto &lattice : lattices) {
+    sentencepiece::BuildLattice(&mt, &lattice, sentence);
+  }
+
+  // The exact sums: every lattice occurs a known number of times.
+  std::vector<long double> exact_expected(vocab_size, 0.0);
+  long double exact_objective = 0.0;
+  for (size_t l = 0; l < lattices.size(); ++l) {
+    const int64 count = sentences / lattices.size() +
+                        (l < sentences % lattices.size() ? 1 : 0);
+    std::vector<double> marginal(vocab_size, 0.0);
+    const float logZ = lattices[l].PopulateMarginal(freq, &marginal);
+    for (int id = 0; id < vocab_size; ++id) {
+      exact_expected[id] += static_cast<long double>(marginal[id]) * count;
+    }
+    exact_objective -= static_cast<long double>(logZ) * count;
+  }
+
+  Result float_result, double_result, kahan_result;
+  {
+    std::vector<float> expected(vocab_size, 0.0);
+    float objective = 0.0;
+    float_result.seconds =
+        sentencepiece::Measure(lattices, freq, [&](const Lattice &l, float f) {
+          objective -= l.PopulateMarginal(f, &expected);
+        });
+    float_result.expected.assign(expected.begin(), expected.end());
+    float_result.objective = objective;
+  }
+  {
+    std::vector<double> expected(vocab_size, 0.0);
+    double objective = 0.0;
+    double_result.seconds =
+        sentencepiece::Measure(lattices, freq, [&](const Lattice &l, float f) {
+          objective -= l.PopulateMarginal(f, &expected);
+        });
+    double_result.expected = expected;
+    double_result.objective = objective;
+  }
+  {
+    std::vector<float> expected(vocab_size, 0.0);
+    std::vector<float> compensation(vocab_size, 0.0);
+    float objective = 0.0, objective_compensation = 0.0;
+    kahan_result.seconds =
+        sentencepiece::Measure(lattices, freq, [&](const Lattice &l, float f) {
+          const float y =
+              -l.PopulateMarginal(f, &expected, &compensation) -
+              objective_compensation;
+          const float t = objective + y;
+          objective_compensation = (t - objective) - y;
+          objective = t;
+        });
+    for (int id = 0; id < vocab_size; ++id) {
+      kahan_result.expected.push_back(expected[id] - compensation[id]);
+    }
+    kahan_result.objective = objective - objective_compensation;
+  }
+
+  printf("sentences=%lld length=%d vocab_size=%d freq=%g\n",
+         static_cast<long long>(sentences), lattices.front().size(),
+         vocab_size, freq);
+  printf("%-8s %12s %14s %14s\n", "", "sentences/s", "expected err",
+         "objective err");
+  const std::pair<const char *, const Result *> results[] = {
+      {"float", &float_result},
+      {"double", &double_result},
+      {"kahan", &kahan_result}};
+  for (const auto &it : results) {
+    const Result &result = *it.second;
+    printf("%-8s %12.0f %14.3e %14.3e\n", it.first,
+           sentences / result.seconds,
+           sentencepiece::MaxRelativeError(exact_expected, result.expected),
+           static_cast<double>(std::abs((result.objective - exact_objective) /
+                                        exact_objective)));
+  }
+
+  return 0;
+}
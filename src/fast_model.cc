@@ -0,0 +1,121 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "fast_model.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+
+// Layout of the fast-model format.
+// <magic (8byte)><ModelProto size (4byte)><trie size (4byte)>
+// <table size (4byte)><checksum of the rest of the file (8byte)>
+// <serialized ModelProto><padding to 4 bytes><precompiled trie>
+// <padding to 4 bytes><frequent word table><padding to 4 bytes>
+constexpr char kFastModelMagic[] = "SPMFAST1";
+constexpr size_t kFastModelMagicSize = 8;
+constexpr size_t kFastModelHeaderSize = kFastModelMagicSize + 20;
+
+size_t AlignTo4(size_t size) { return (size + 3) & ~static_cast<size_t>(3); }
+
+}  // namespace
+
+bool IsFastModel(absl::string_view blob) {
+  return blob.size() >= kFastModelHeaderSize &&
+         blob.substr(0, kFastModelMagicSize) ==
+             absl::string_view(kFastModelMagic, kFastModelMagicSize);
+}
+
+bool IsValidDoubleArray(const void *array, size_t size, uint32 num_values) {
+  // A unit with the bit 31 is a leaf holding a value. The others hold the
+  // offset of their children, which are read at `index ^ offset ^ label`
+  // for any label byte, and their leaf at `index ^ offset`.
+  const char *units = static_cast<const char *>(array);
+  if (size == 0) return false;
+  for (size_t index = 0; index < size; ++index) {
+    uint32 unit = 0;
+    std::memcpy(&unit, units + index * sizeof(unit), sizeof(unit));
+    if (unit >> 31) {
+      if ((unit & 0x7FFFFFFF) >= num_values) return false;
+      continue;
+    }
+    const size_t offset = (unit >> 10) << ((unit & (1U << 9)) >> 6);
+    if (((index ^ offset) | 0xFF) >= size) return false;
+  }
+  return true;
+}
+
+util::Status DecodeFastModel(absl::string_view blob,
+                             absl::string_view *serialized,
+                             absl::string_view *trie_blob,
+                             absl::string_view *frequent_words) {
+  CHECK_OR_RETURN(IsFastModel(blob)) << "Not a fast-model file.";
+  blob.remove_prefix(kFastModelMagicSize);
+  uint32 proto_size = 0, trie_size = 0, words_size = 0;
+  uint32 checksum_low = 0, checksum_high = 0;
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&blob, &proto_size) &&
+                  string_util::ConsumeUInt32(&blob, &trie_size) &&
+                  string_util::ConsumeUInt32(&blob, &words_size) &&
+                  string_util::ConsumeUInt32(&blob, &checksum_low) &&
+                  string_util::ConsumeUInt32(&blob, &checksum_high))
+      << "Fast-model file is broken.";
+  // The sections are verified before any of them is parsed.
+  CHECK_OR_RETURN(port::Fingerprint(blob) ==
+                  (static_cast<uint64>(checksum_high) << 32 | checksum_low))
+      << "Fast-model file is broken: checksum mismatch.";
+  const size_t trie_offset = AlignTo4(proto_size);
+  const size_t words_offset = AlignTo4(trie_offset + trie_size);
+  CHECK_OR_RETURN(words_offset <= blob.size() &&
+                  AlignTo4(words_offset + words_size) == blob.size())
+      << "Fast-model file is broken.";
+  *serialized = blob.substr(0, proto_size);
+  *trie_blob = blob.substr(trie_offset, trie_size);
+  *frequent_words = blob.substr(words_offset, words_size);
+  return util::OkStatus();
+}
+
+util::Status EncodeFastModel(absl::string_view serialized,
+                             absl::string_view trie_blob,
+                             absl::string_view frequent_words,
+                             std::string *blob) {
+  CHECK_OR_RETURN(serialized.size() <= std::numeric_limits<uint32_t>::max())
+      << "ModelProto is too large.";
+  CHECK_OR_RETURN(frequent_words.size() <=
+                  std::numeric_limits<uint32_t>::max())
+      << "The frequent word table is too large.";
+
+  std::string body(serialized.data(), serialized.size());
+  body.resize(AlignTo4(body.size()), '\0');
+  body.append(trie_blob.data(), trie_blob.size());
+  body.resize(AlignTo4(body.size()), '\0');
+  body.append(frequent_words.data(), frequent_words.size());
+  body.resize(AlignTo4(body.size()), '\0');
+  const uint64 checksum = port::Fingerprint(body);
+
+  blob->assign(kFastModelMagic, kFastModelMagicSize);
+  string_util::AppendUInt32(serialized.size(), blob);
+  string_util::AppendUInt32(trie_blob.size(), blob);
+  string_util::AppendUInt32(frequent_words.size(), blob);
+  string_util::AppendUInt32(static_cast<uint32>(checksum), blob);
+  string_util::AppendUInt32(static_cast<uint32>(checksum >> 32), blob);
+  blob->append(body);
+  return util::OkStatus();
+}
+
+}  // namespace sentencepiece
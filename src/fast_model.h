@@ -0,0 +1,54 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef FAST_MODEL_H_
+#define FAST_MODEL_H_
+
+#include <string>
+
+#include "common.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+// Container of the fast-model format written by io::SaveFastModel(). It
+// does not depend on the protobuf runtime, so that sentencepiece_infer
+// reads it as well.
+namespace sentencepiece {
+
+// Returns true if `blob` starts with the header of a fast-model file.
+bool IsFastModel(absl::string_view blob);
+
+// Splits the fast-model file `blob` into the serialized ModelProto, the
+// precompiled trie or merge table, and the frequent word table. The parts
+// point into `blob`.
+util::Status DecodeFastModel(absl::string_view blob,
+                             absl::string_view *serialized,
+                             absl::string_view *trie_blob,
+                             absl::string_view *frequent_words);
+
+// Joins the parts into the fast-model file `blob`. The inverse of
+// DecodeFastModel(), which verifies the checksum written in the header.
+util::Status EncodeFastModel(absl::string_view serialized,
+                             absl::string_view trie_blob,
+                             absl::string_view frequent_words,
+                             std::string *blob);
+
+// Returns true if no lookup in the double-array trie of `size` units at
+// `array` reads outside of it, and all its values are below `num_values`.
+// The tries read from a model file are checked before they are used, since
+// Darts does not check the indices.
+bool IsValidDoubleArray(const void *array, size_t size, uint32 num_values);
+
+}  // namespace sentencepiece
+#endif  // FAST_MODEL_H_
@@ -14,12 +14,36 @@
 
 #include "filesystem.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include "third_party/absl/strings/match.h"
 #include "util.h"
 
+#if !defined(OS_WIN)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef SPM_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef SPM_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
 #if defined(OS_WIN) && defined(UNICODE) && defined(_UNICODE)
 #define WPATH(path) (::sentencepiece::util::Utf8ToWide(path).c_str())
 #else
@@ -52,6 +76,12 @@ class PosixReadableFile : public ReadableFile {
     return static_cast<bool>(std::getline(*is_, *line));
   }
 
+  bool ReadLine(absl::string_view *line) {
+    if (!ReadLine(&line_)) return false;
+    *line = line_;
+    return true;
+  }
+
   bool ReadAll(std::string *line) {
     if (is_ == &std::cin) {
       LOG(ERROR) << "ReadAll is not supported for stdin.";
@@ -65,7 +95,341 @@ class PosixReadableFile : public ReadableFile {
  private:
   util::Status status_;
   std::istream *is_;
+  std::string line_;
+};
+
+#if !defined(OS_WIN)
+// ReadableFile on a file descriptor. A regular file is mapped with mmap(2)
+// and its lines are views of the mapping. Pipes, stdin and files whose size
+// is unknown are read with large read(2) calls into a buffer that grows to
+// hold the longest line. The lines are split at '\n' as std::getline() does.
+class MappedReadableFile : public ReadableFile {
+ public:
+  // `map` enables the mapping of regular files.
+  explicit MappedReadableFile(absl::string_view filename, bool map = true) {
+    const std::string path(filename);
+    fd_ = path.empty() ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      status_ = util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+                << "\"" << path << "\": " << util::StrError(errno);
+      return;
+    }
+    struct stat st;
+    if (map && ::fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+      void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+      if (addr != MAP_FAILED) {
+        ::madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        addr_ = addr;
+        data_ = static_cast<const char *>(addr);
+        end_ = st.st_size;
+        eof_ = true;
+      }
+    }
+  }
+
+  virtual ~MappedReadableFile() {
+    if (addr_ != nullptr) ::munmap(addr_, end_);
+    if (fd_ > STDIN_FILENO) ::close(fd_);
+  }
+
+  util::Status status() const { return status_; }
+
+  bool ReadLine(std::string *line) {
+    absl::string_view view;
+    if (!ReadLine(&view)) return false;
+    line->assign(view.data(), view.size());
+    return true;
+  }
+
+  bool ReadLine(absl::string_view *line) {
+    if (!status_.ok()) return false;
+    size_t searched = 0;  // Unread bytes known to have no newline.
+    while (true) {
+      const char *begin = data_ + pos_ + searched;
+      const void *newline = memchr(begin, '\n', end_ - pos_ - searched);
+      if (newline != nullptr) {
+        const size_t found = static_cast<const char *>(newline) - data_;
+        *line = absl::string_view(data_ + pos_, found - pos_);
+        pos_ = found + 1;
+        return true;
+      }
+      searched = end_ - pos_;
+      if (eof_) break;
+      Fill();
+    }
+    if (pos_ == end_) return false;
+    *line = absl::string_view(data_ + pos_, end_ - pos_);
+    pos_ = end_;
+    return true;
+  }
+
+  bool ReadAll(std::string *line) {
+    if (!status_.ok()) return false;
+    while (!eof_) Fill();
+    line->assign(data_ + pos_, end_ - pos_);
+    pos_ = end_;
+    return status_.ok();
+  }
+
+ protected:
+  static constexpr size_t kBufferSize = 1 << 20;
+
+  // Reads up to `capacity` bytes of the content into `data`. `*size` is 0
+  // at the end of the file.
+  virtual util::Status ReadSome(char *data, size_t capacity, size_t *size) {
+    return ReadFd(fd_, data, capacity, size);
+  }
+
+  // read(2) of `fd`, retried on EINTR.
+  static util::Status ReadFd(int fd, char *data, size_t capacity,
+                             size_t *size) {
+    ssize_t result = 0;
+    do {
+      result = ::read(fd, data, capacity);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+      *size = 0;
+      return util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+             << "read failed: " << util::StrError(errno);
+    }
+    *size = result;
+    return util::OkStatus();
+  }
+
+  util::Status status_;
+  int fd_ = -1;
+
+ private:
+  // Moves the unread bytes to the front of buffer_ and appends the next
+  // ReadSome() to them. Sets eof_ at the end of the file or on an error.
+  void Fill() {
+    if (pos_ > 0) {
+      buffer_.erase(0, pos_);
+      end_ -= pos_;
+      pos_ = 0;
+    }
+    if (buffer_.size() - end_ < kBufferSize / 2) {
+      buffer_.resize(std::max(kBufferSize, 2 * buffer_.size()));
+    }
+    size_t size = 0;
+    status_ = ReadSome(&buffer_[end_], buffer_.size() - end_, &size);
+    if (size == 0) {
+      eof_ = true;
+    } else {
+      end_ += size;
+    }
+    data_ = buffer_.data();
+  }
+
+  void *addr_ = nullptr;  // The mapping, or null when reading buffer_.
+  std::string buffer_;
+  const char *data_ = "";  // The mapping or buffer_.data().
+  size_t pos_ = 0;         // Start of the unread bytes in data_.
+  size_t end_ = 0;         // End of the valid bytes in data_.
+  bool eof_ = false;
+};
+
+// Streaming decompressor of one compressed format.
+class Decompressor {
+ public:
+  virtual ~Decompressor() {}
+
+  // Decompresses `input` and appends the output to `output`.
+  virtual util::Status Decompress(absl::string_view input,
+                                  std::string *output) = 0;
+
+  // Returns an error if the input ended in the middle of a stream.
+  virtual util::Status Finish() const = 0;
+};
+
+#ifdef SPM_ENABLE_ZLIB
+// Decompressor of gzip files, including concatenated gzip members.
+class GzipDecompressor : public Decompressor {
+ public:
+  GzipDecompressor() {
+    memset(&stream_, 0, sizeof(stream_));
+    initialized_ = inflateInit2(&stream_, 16 + MAX_WBITS) == Z_OK;
+  }
+
+  ~GzipDecompressor() {
+    if (initialized_) inflateEnd(&stream_);
+  }
+
+  util::Status Decompress(absl::string_view input, std::string *output) {
+    CHECK_OR_RETURN(initialized_) << "inflateInit2 failed.";
+    stream_.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream_.avail_in = input.size();
+    while (stream_.avail_in > 0) {
+      if (ended_) {
+        // Another member follows the end of the previous one.
+        CHECK_OR_RETURN(inflateReset(&stream_) == Z_OK);
+        ended_ = false;
+      }
+      const size_t size = output->size();
+      output->resize(size + kChunkSize);
+      stream_.next_out = reinterpret_cast<Bytef *>(&(*output)[size]);
+      stream_.avail_out = kChunkSize;
+      const int result = inflate(&stream_, Z_NO_FLUSH);
+      output->resize(size + kChunkSize - stream_.avail_out);
+      if (result == Z_STREAM_END) {
+        ended_ = true;
+      } else if (result == Z_BUF_ERROR && stream_.avail_out == kChunkSize) {
+        break;  // No progress is possible with the remaining input.
+      } else if (result != Z_OK && result != Z_BUF_ERROR) {
+        return util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+               << "gzip: " << (stream_.msg ? stream_.msg : "broken data");
+      }
+    }
+    return util::OkStatus();
+  }
+
+  util::Status Finish() const {
+    CHECK_OR_RETURN(ended_) << "gzip: unexpected end of file.";
+    return util::OkStatus();
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 1 << 18;
+
+  z_stream stream_;
+  bool initialized_ = false;
+  bool ended_ = false;
+};
+#endif  // SPM_ENABLE_ZLIB
+
+#ifdef SPM_ENABLE_ZSTD
+// Decompressor of zstd files, including concatenated frames.
+class ZstdDecompressor : public Decompressor {
+ public:
+  ZstdDecompressor() : stream_(ZSTD_createDStream()) {
+    if (stream_ != nullptr) ZSTD_initDStream(stream_);
+  }
+
+  ~ZstdDecompressor() { ZSTD_freeDStream(stream_); }
+
+  util::Status Decompress(absl::string_view input, std::string *output) {
+    CHECK_OR_RETURN(stream_) << "ZSTD_createDStream failed.";
+    ZSTD_inBuffer in = {input.data(), input.size(), 0};
+    const size_t chunk_size = ZSTD_DStreamOutSize();
+    bool full = false;  // The last call may have more output to flush.
+    while (in.pos < in.size || full) {
+      const size_t size = output->size();
+      output->resize(size + chunk_size);
+      ZSTD_outBuffer out = {&(*output)[size], chunk_size, 0};
+      const size_t result = ZSTD_decompressStream(stream_, &out, &in);
+      output->resize(size + out.pos);
+      if (ZSTD_isError(result)) {
+        return util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+               << "zstd: " << ZSTD_getErrorName(result);
+      }
+      ended_ = result == 0;
+      full = out.pos == chunk_size;
+    }
+    return util::OkStatus();
+  }
+
+  util::Status Finish() const {
+    CHECK_OR_RETURN(ended_) << "zstd: unexpected end of file.";
+    return util::OkStatus();
+  }
+
+ private:
+  ZSTD_DStream *stream_ = nullptr;
+  bool ended_ = true;
+};
+#endif  // SPM_ENABLE_ZSTD
+
+// ReadableFile of a compressed file. A background thread reads and
+// decompresses the file ahead of the reader into a bounded queue of chunks,
+// so the decompression overlaps with the processing of the lines.
+class DecompressedReadableFile : public MappedReadableFile {
+ public:
+  DecompressedReadableFile(absl::string_view filename,
+                           std::unique_ptr<Decompressor> decompressor)
+      : MappedReadableFile(filename, false),
+        decompressor_(std::move(decompressor)) {
+    if (status_.ok()) {
+      decompressor_thread_ = std::thread([this]() { DecompressorLoop(); });
+    }
+  }
+
+  ~DecompressedReadableFile() {
+    if (decompressor_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+      }
+      cond_.notify_all();
+      decompressor_thread_.join();
+    }
+  }
+
+ protected:
+  util::Status ReadSome(char *data, size_t capacity, size_t *size) {
+    *size = 0;
+    if (chunk_pos_ == chunk_.size()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return !chunks_.empty() || done_; });
+      if (chunks_.empty()) return result_;
+      chunk_ = std::move(chunks_.front());
+      chunks_.pop_front();
+      chunk_pos_ = 0;
+      cond_.notify_all();
+    }
+    *size = std::min(capacity, chunk_.size() - chunk_pos_);
+    memcpy(data, chunk_.data() + chunk_pos_, *size);
+    chunk_pos_ += *size;
+    return util::OkStatus();
+  }
+
+ private:
+  static constexpr size_t kMaxChunks = 4;
+
+  void DecompressorLoop() {
+    std::string input(kBufferSize, '\0');
+    util::Status status;
+    while (true) {
+      size_t size = 0;
+      status = ReadFd(fd_, &input[0], input.size(), &size);
+      if (!status.ok()) break;
+      if (size == 0) {
+        status = decompressor_->Finish();
+        break;
+      }
+      std::string output;
+      status = decompressor_->Decompress(absl::string_view(input.data(), size),
+                                         &output);
+      if (!status.ok()) break;
+      if (output.empty()) continue;
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock,
+                 [this]() { return chunks_.size() < kMaxChunks || stopped_; });
+      if (stopped_) return;
+      chunks_.push_back(std::move(output));
+      cond_.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    result_ = status;
+    done_ = true;
+    cond_.notify_all();
+  }
+
+  std::unique_ptr<Decompressor> decompressor_;
+  std::thread decompressor_thread_;
+  std::string chunk_;  // The chunk being read.
+  size_t chunk_pos_ = 0;
+
+  // Guards the members below, shared with the decompressor thread.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::string> chunks_;
+  util::Status result_;  // Status of the decompression, set with done_.
+  bool done_ = false;
+  bool stopped_ = false;
 };
+#endif
 
 class PosixWritableFile : public WritableFile {
  public:
@@ -94,16 +458,290 @@ class PosixWritableFile : public WritableFile {
 
   bool WriteLine(absl::string_view text) { return Write(text) && Write("\n"); }
 
+  bool Flush() { return static_cast<bool>(os_->flush()); }
+
  private:
   util::Status status_;
   std::ostream *os_;
 };
 
+#if !defined(OS_WIN)
+// WritableFile combining the writes in a buffer of kBufferSize bytes. A full
+// buffer is handed to a flusher thread, started on the first one, and the
+// next writes go to a second buffer. Texts larger than the buffer are
+// written directly with writev(2).
+class BufferedWritableFile : public WritableFile {
+ public:
+  BufferedWritableFile(absl::string_view filename, bool is_binary = false) {
+    const std::string path(filename);
+    fd_ = path.empty() ? STDOUT_FILENO
+                       : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                0644);
+    if (fd_ < 0) {
+      status_ =
+          util::StatusBuilder(util::StatusCode::kPermissionDenied, GTL_LOC)
+          << "\"" << path << "\": " << util::StrError(errno);
+    }
+    buffer_.reserve(kBufferSize);
+  }
+
+  ~BufferedWritableFile() {
+    Flush();
+    if (flusher_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+      }
+      cond_.notify_all();
+      flusher_.join();
+    }
+    if (fd_ > STDERR_FILENO) ::close(fd_);
+  }
+
+  util::Status status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  bool Write(absl::string_view text) { return Append(text, ""); }
+
+  bool WriteLine(absl::string_view text) { return Append(text, "\n"); }
+
+  bool Flush() {
+    if (fd_ < 0) return false;
+    Submit();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return !has_pending_; });
+    return status_.ok();
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 20;
+
+  bool Append(absl::string_view text, absl::string_view suffix) {
+    if (fd_ < 0) return false;
+    if (text.size() >= kBufferSize) {
+      if (!Flush()) return false;
+      const struct iovec iov[2] = {
+          {const_cast<char *>(text.data()), text.size()},
+          {const_cast<char *>(suffix.data()), suffix.size()}};
+      const util::Status status = WriteAll(iov, 2);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (status_.ok()) status_ = status;
+      return status_.ok();
+    }
+    if (buffer_.size() + text.size() + suffix.size() > kBufferSize) {
+      Submit();
+    }
+    buffer_.append(text.data(), text.size());
+    buffer_.append(suffix.data(), suffix.size());
+    return true;
+  }
+
+  // Hands buffer_ to the flusher thread after the previous buffer has been
+  // written.
+  void Submit() {
+    if (buffer_.empty()) return;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return !has_pending_; });
+      pending_.swap(buffer_);
+      has_pending_ = true;
+    }
+    buffer_.clear();
+    if (!flusher_.joinable()) {
+      flusher_ = std::thread([this]() { FlusherLoop(); });
+    }
+    cond_.notify_all();
+  }
+
+  void FlusherLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [this]() { return has_pending_ || stopped_; });
+      if (!has_pending_) return;
+      lock.unlock();
+      const struct iovec iov = {&pending_[0], pending_.size()};
+      const util::Status status = WriteAll(&iov, 1);
+      lock.lock();
+      if (status_.ok()) status_ = status;
+      pending_.clear();
+      has_pending_ = false;
+      cond_.notify_all();
+    }
+  }
+
+  // Writes all of `iov` with writev(2), retrying the partial writes.
+  util::Status WriteAll(const struct iovec *iov, int size) const {
+    std::vector<struct iovec> rest(iov, iov + size);
+    size_t index = 0;
+    while (index < rest.size()) {
+      const ssize_t written = ::writev(fd_, &rest[index], rest.size() - index);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+               << "write failed: " << util::StrError(errno);
+      }
+      size_t remaining = written;
+      while (index < rest.size() && remaining >= rest[index].iov_len) {
+        remaining -= rest[index++].iov_len;
+      }
+      if (index < rest.size()) {
+        rest[index].iov_base = static_cast<char *>(rest[index].iov_base) +
+                               remaining;
+        rest[index].iov_len -= remaining;
+      }
+    }
+    return util::OkStatus();
+  }
+
+  int fd_ = -1;
+  std::string buffer_;  // Filled by the caller.
+
+  // Guards the members below, shared with the flusher thread.
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  util::Status status_;
+  std::string pending_;  // Written by the flusher thread.
+  bool has_pending_ = false;
+  bool stopped_ = false;
+  std::thread flusher_;
+};
+#endif
+
+// ReadableFile of a file that cannot be read, holding the reason.
+class UnsupportedReadableFile : public ReadableFile {
+ public:
+  explicit UnsupportedReadableFile(const util::Status &status)
+      : status_(status) {}
+
+  util::Status status() const { return status_; }
+  bool ReadLine(std::string *line) { return false; }
+  bool ReadLine(absl::string_view *line) { return false; }
+  bool ReadAll(std::string *line) { return false; }
+
+ private:
+  util::Status status_;
+};
+
+// Fallback MappedFile that keeps a copy of the file content.
+class BufferedMappedFile : public MappedFile {
+ public:
+  explicit BufferedMappedFile(absl::string_view filename) {
+    auto input = NewReadableFile(filename, true);
+    status_ = input->status();
+    if (status_.ok() && !input->ReadAll(&buffer_)) {
+      status_ = util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+                << "could not read " << filename;
+    }
+  }
+
+  util::Status status() const { return status_; }
+  absl::string_view data() const { return buffer_; }
+
+ private:
+  util::Status status_;
+  std::string buffer_;
+};
+
+#if !defined(OS_WIN)
+class PosixMappedFile : public MappedFile {
+ public:
+  explicit PosixMappedFile(absl::string_view filename) {
+    const std::string path(filename);
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      status_ = util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+                << "\"" << path << "\": " << util::StrError(errno);
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      status_ = util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+                << "\"" << path << "\": " << util::StrError(errno);
+    } else if (!S_ISREG(st.st_mode)) {
+      // Pipes, e.g. --model=<(cat m.model), have no size and cannot be
+      // mapped, so that they are read into memory.
+      MappedReadableFile input(path, false);
+      status_ = input.status();
+      if (status_.ok() && !input.ReadAll(&buffer_)) status_ = input.status();
+    } else if (st.st_size > 0) {
+      void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        status_ = util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+                  << "\"" << path << "\": " << util::StrError(errno);
+      } else {
+        addr_ = addr;
+        size_ = st.st_size;
+      }
+    }
+    ::close(fd);
+  }
+
+  ~PosixMappedFile() {
+    if (addr_ != nullptr) ::munmap(addr_, size_);
+  }
+
+  util::Status status() const { return status_; }
+
+  absl::string_view data() const {
+    if (addr_ == nullptr) return buffer_;
+    return absl::string_view(static_cast<const char *>(addr_), size_);
+  }
+
+ private:
+  util::Status status_;
+  void *addr_ = nullptr;
+  size_t size_ = 0;
+  std::string buffer_;  // The content of a file which is not mapped.
+};
+#endif
+
+#if defined(OS_WIN)
 using DefaultReadableFile = PosixReadableFile;
+#else
+using DefaultReadableFile = MappedReadableFile;
+#endif
 using DefaultWritableFile = PosixWritableFile;
+#if defined(OS_WIN)
+using DefaultMappedFile = BufferedMappedFile;
+#else
+using DefaultMappedFile = PosixMappedFile;
+#endif
+
+namespace {
+bool IsGzipFile(absl::string_view filename) {
+  return absl::EndsWith(filename, ".gz");
+}
+
+bool IsZstdFile(absl::string_view filename) {
+  return absl::EndsWith(filename, ".zst") || absl::EndsWith(filename, ".zstd");
+}
+}  // namespace
 
 std::unique_ptr<ReadableFile> NewReadableFile(absl::string_view filename,
                                               bool is_binary) {
+#if !defined(OS_WIN)
+  const bool is_gzip = IsGzipFile(filename);
+  const bool is_zstd = IsZstdFile(filename);
+  std::unique_ptr<Decompressor> decompressor;
+#ifdef SPM_ENABLE_ZLIB
+  if (is_gzip) decompressor = std::make_unique<GzipDecompressor>();
+#endif
+#ifdef SPM_ENABLE_ZSTD
+  if (is_zstd) decompressor = std::make_unique<ZstdDecompressor>();
+#endif
+  if (decompressor) {
+    return std::make_unique<DecompressedReadableFile>(filename,
+                                                      std::move(decompressor));
+  }
+  if (is_gzip || is_zstd) {
+    return std::make_unique<UnsupportedReadableFile>(
+        util::StatusBuilder(util::StatusCode::kUnimplemented, GTL_LOC)
+        << "\"" << filename << "\": SentencePiece is built without "
+        << (is_gzip ? "zlib" : "zstd") << " support.");
+  }
+#endif
   return std::make_unique<DefaultReadableFile>(filename, is_binary);
 }
 
@@ -112,5 +750,22 @@ std::unique_ptr<WritableFile> NewWritableFile(absl::string_view filename,
   return std::make_unique<DefaultWritableFile>(filename, is_binary);
 }
 
+std::unique_ptr<WritableFile> NewBufferedWritableFile(
+    absl::string_view filename, bool is_binary) {
+#if defined(OS_WIN)
+  return std::make_unique<DefaultWritableFile>(filename, is_binary);
+#else
+  return std::make_unique<BufferedWritableFile>(filename, is_binary);
+#endif
+}
+
+std::unique_ptr<MappedFile> NewMappedFile(absl::string_view filename) {
+  // A compressed file is decompressed into memory by NewReadableFile().
+  if (IsGzipFile(filename) || IsZstdFile(filename)) {
+    return std::make_unique<BufferedMappedFile>(filename);
+  }
+  return std::make_unique<DefaultMappedFile>(filename);
+}
+
 }  // namespace filesystem
 }  // namespace sentencepiece
@@ -35,6 +35,11 @@ class ReadableFile {
 
   virtual util::Status status() const = 0;
   virtual bool ReadLine(std::string *line) = 0;
+
+  // Same as above, but `line` points to the internal buffer of the file
+  // without a copy. It is valid until the next call.
+  virtual bool ReadLine(absl::string_view *line) = 0;
+
   virtual bool ReadAll(std::string *line) = 0;
 };
 
@@ -47,13 +52,45 @@ class WritableFile {
   virtual util::Status status() const = 0;
   virtual bool Write(absl::string_view text) = 0;
   virtual bool WriteLine(absl::string_view text) = 0;
+
+  // Writes the buffered data to the file. Returns false on an error.
+  virtual bool Flush() = 0;
+};
+
+// Read-only view of the whole content of a file. On POSIX systems the file
+// is mapped with mmap(2), so the pages are shared between processes and no
+// copy is made. On other platforms the content is read into memory.
+class MappedFile {
+ public:
+  MappedFile() {}
+  virtual ~MappedFile() {}
+
+  virtual util::Status status() const = 0;
+  virtual absl::string_view data() const = 0;
 };
 
+// Returns a file reading `filename`, or stdin when it is empty. On POSIX
+// systems a regular file is mapped with mmap(2) and other files are read
+// with large read(2) calls. Files named *.gz or *.zst are decompressed on a
+// background thread when SentencePiece is built with zlib or zstd, and
+// report kUnimplemented otherwise.
 std::unique_ptr<ReadableFile> NewReadableFile(absl::string_view filename,
                                               bool is_binary = false);
 std::unique_ptr<WritableFile> NewWritableFile(absl::string_view filename,
                                               bool is_binary = false);
 
+// Returns a file writing `filename`, or stdout when it is empty, through a
+// large buffer. On POSIX systems full buffers are written by a background
+// thread while the next one is filled, so the writes overlap with the
+// caller. The data is written at the latest by the destructor; call Flush()
+// to check for errors.
+std::unique_ptr<WritableFile> NewBufferedWritableFile(
+    absl::string_view filename, bool is_binary = false);
+
+// Returns the content of `filename`. A compressed file (see NewReadableFile)
+// is decompressed into memory instead of being mapped.
+std::unique_ptr<MappedFile> NewMappedFile(absl::string_view filename);
+
 }  // namespace filesystem
 }  // namespace sentencepiece
 #endif  // FILESYSTEM_H_
@@ -13,10 +13,25 @@
 // limitations under the License.!
 
 #include "filesystem.h"
+
+#include <fstream>
+#include <iterator>
+#include <thread>
+
 #include "testharness.h"
 #include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_join.h"
 #include "util.h"
 
+#if !defined(OS_WIN)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef SPM_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
 namespace sentencepiece {
 
 TEST(UtilTest, FilesystemTest) {
@@ -46,9 +61,211 @@ TEST(UtilTest, FilesystemTest) {
   }
 }
 
+TEST(UtilTest, FilesystemReadLineTest) {
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "read_line_file");
+  const std::string long_line(3 << 20, 'x');  // Longer than the buffer.
+  const std::vector<std::string> kData = {"first", "", long_line, "last"};
+
+  for (const bool trailing_newline : {true, false}) {
+    {
+      auto output = filesystem::NewWritableFile(filename, true);
+      output->Write(absl::StrJoin(kData, "\n"));
+      if (trailing_newline) output->Write("\n");
+    }
+
+    auto input = filesystem::NewReadableFile(filename);
+    ASSERT_TRUE(input->status().ok());
+    absl::string_view line;
+    for (const auto &expected : kData) {
+      EXPECT_TRUE(input->ReadLine(&line));
+      EXPECT_EQ(expected, line);
+    }
+    EXPECT_FALSE(input->ReadLine(&line));
+
+    std::string all;
+    EXPECT_TRUE(filesystem::NewReadableFile(filename, true)->ReadAll(&all));
+    EXPECT_EQ(absl::StrCat(absl::StrJoin(kData, "\n"),
+                           trailing_newline ? "\n" : ""),
+              all);
+  }
+
+#if !defined(OS_WIN)
+  // A pipe is read in chunks instead of being mapped.
+  const std::string fifo = util::JoinPath(::testing::TempDir(), "read_fifo");
+  ::unlink(fifo.c_str());
+  ASSERT_EQ(0, ::mkfifo(fifo.c_str(), 0600));
+  std::thread writer([&]() {
+    auto output = filesystem::NewWritableFile(fifo, true);
+    for (const auto &line : kData) output->WriteLine(line);
+  });
+  {
+    auto input = filesystem::NewReadableFile(fifo);
+    ASSERT_TRUE(input->status().ok());
+    std::string line;
+    for (const auto &expected : kData) {
+      EXPECT_TRUE(input->ReadLine(&line));
+      EXPECT_EQ(expected, line);
+    }
+    EXPECT_FALSE(input->ReadLine(&line));
+  }
+  writer.join();
+  ::unlink(fifo.c_str());
+#endif
+}
+
+TEST(UtilTest, CompressedReadableFileTest) {
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "compressed_file.gz");
+#ifdef SPM_ENABLE_ZLIB
+  std::vector<std::string> expected;
+  for (int i = 0; i < 200000; ++i) expected.push_back(absl::StrCat("line ", i));
+
+  // Two concatenated gzip members, as written by `cat a.gz b.gz`.
+  for (const char *mode : {"wb", "ab"}) {
+    gzFile file = gzopen(filename.c_str(), mode);
+    ASSERT_TRUE(file != nullptr);
+    const size_t half = expected.size() / 2;
+    const size_t begin = mode[0] == 'w' ? 0 : half;
+    for (size_t i = begin; i < begin + half; ++i) {
+      gzputs(file, absl::StrCat(expected[i], "\n").c_str());
+    }
+    gzclose(file);
+  }
+
+  {
+    auto input = filesystem::NewReadableFile(filename);
+    ASSERT_TRUE(input->status().ok());
+    absl::string_view line;
+    for (const auto &expected_line : expected) {
+      ASSERT_TRUE(input->ReadLine(&line));
+      EXPECT_EQ(expected_line, line);
+    }
+    EXPECT_FALSE(input->ReadLine(&line));
+    EXPECT_TRUE(input->status().ok());
+  }
+
+  // NewMappedFile() holds the decompressed content.
+  {
+    auto input = filesystem::NewMappedFile(filename);
+    ASSERT_TRUE(input->status().ok());
+    EXPECT_EQ(absl::StrCat(absl::StrJoin(expected, "\n"), "\n"),
+              input->data());
+  }
+
+  // A truncated file is an error.
+  std::string compressed;
+  {
+    std::ifstream is(filename, std::ios::binary);
+    compressed.assign(std::istreambuf_iterator<char>(is),
+                      std::istreambuf_iterator<char>());
+  }
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(compressed.substr(0, compressed.size() / 3));
+  }
+  {
+    auto input = filesystem::NewReadableFile(filename);
+    absl::string_view line;
+    while (input->ReadLine(&line)) {
+    }
+    EXPECT_FALSE(input->status().ok());
+  }
+#else
+  EXPECT_EQ(util::StatusCode::kUnimplemented,
+            filesystem::NewReadableFile(filename)->status().code());
+#endif
+
+#if !defined(OS_WIN) && !defined(SPM_ENABLE_ZSTD)
+  EXPECT_EQ(util::StatusCode::kUnimplemented,
+            filesystem::NewReadableFile("input.zst")->status().code());
+#endif
+}
+
+TEST(UtilTest, BufferedWritableFileTest) {
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "buffered_file");
+  std::string expected;
+  {
+    auto output = filesystem::NewBufferedWritableFile(filename);
+    ASSERT_TRUE(output->status().ok());
+    // Fills several buffers, with a line larger than the buffer between.
+    for (int i = 0; i < 300000; ++i) {
+      const std::string line = absl::StrCat("line ", i);
+      EXPECT_TRUE(output->WriteLine(line));
+      expected += line + "\n";
+      if (i == 1000) {
+        const std::string large(3 << 20, 'x');
+        EXPECT_TRUE(output->Write(large));
+        expected += large;
+      }
+    }
+    EXPECT_TRUE(output->Flush());
+    EXPECT_TRUE(output->Write("tail"));
+    expected += "tail";
+  }
+
+  std::string actual;
+  EXPECT_TRUE(filesystem::NewReadableFile(filename, true)->ReadAll(&actual));
+  EXPECT_EQ(expected, actual);
+
+  auto invalid = filesystem::NewBufferedWritableFile(
+      util::JoinPath("__UNKNOWN__DIR__", "file"));
+  EXPECT_FALSE(invalid->status().ok());
+  EXPECT_FALSE(invalid->WriteLine("text"));
+  EXPECT_FALSE(invalid->Flush());
+}
+
 TEST(UtilTest, FilesystemInvalidFileTest) {
   auto input = filesystem::NewReadableFile("__UNKNOWN__FILE__");
   EXPECT_FALSE(input->status().ok());
 }
 
+TEST(UtilTest, MappedFileTest) {
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "mapped_file");
+  const std::string kData("binary\0data\nwith\xff" "bytes", 22);
+
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    EXPECT_TRUE(output->Write(kData));
+  }
+
+  {
+    auto input = filesystem::NewMappedFile(filename);
+    EXPECT_TRUE(input->status().ok());
+    EXPECT_EQ(kData, input->data());
+  }
+
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+  }
+
+  {
+    auto input = filesystem::NewMappedFile(filename);
+    EXPECT_TRUE(input->status().ok());
+    EXPECT_TRUE(input->data().empty());
+  }
+
+  EXPECT_FALSE(filesystem::NewMappedFile("__UNKNOWN__FILE__")->status().ok());
+
+#if !defined(OS_WIN)
+  // A pipe has no size, and is read instead of being mapped.
+  const std::string fifo = util::JoinPath(::testing::TempDir(), "mapped_fifo");
+  ::unlink(fifo.c_str());
+  ASSERT_EQ(0, ::mkfifo(fifo.c_str(), 0600));
+  std::thread writer([&]() {
+    auto output = filesystem::NewWritableFile(fifo, true);
+    output->Write(kData);
+  });
+  {
+    auto input = filesystem::NewMappedFile(fifo);
+    EXPECT_TRUE(input->status().ok());
+    EXPECT_EQ(kData, input->data());
+  }
+  writer.join();
+  ::unlink(fifo.c_str());
+#endif
+}
+
 }  // namespace sentencepiece
@@ -43,6 +43,13 @@ class FreeList {
     element_index_ = 0;
   }
 
+  // Same as `Free`, but the elements are not zero-initialized, so the
+  // caller must initialize the elements returned by `Allocate`.
+  void Reset() {
+    chunk_index_ = 0;
+    element_index_ = 0;
+  }
+
   // Returns the number of allocated elements.
   size_t size() const { return chunk_size_ * chunk_index_ + element_index_; }
 
@@ -20,11 +20,11 @@ namespace model {
 
 TEST(FreeListTest, BasicTest) {
   FreeList<int> l(5);
-  EXPECT_EQ(0, l.size());
+  EXPECT_EQ(0, static_cast<int>(l.size()));
 
-  constexpr size_t kSize = 32;
+  constexpr int kSize = 32;
 
-  for (size_t i = 0; i < kSize; ++i) {
+  for (int i = 0; i < kSize; ++i) {
     int *n = l.Allocate();
     EXPECT_EQ(0, *n);
     *n = i;
@@ -33,19 +33,32 @@ TEST(FreeListTest, BasicTest) {
   FreeList<int> l2(3);  // Test swap()
   l.swap(l2);
 
-  EXPECT_EQ(kSize, l2.size());
-  for (size_t i = 0; i < kSize; ++i) {
+  EXPECT_EQ(kSize, static_cast<int>(l2.size()));
+  for (int i = 0; i < kSize; ++i) {
     EXPECT_EQ(i, *l2[i]);
   }
 
   l2.Free();
-  EXPECT_EQ(0, l2.size());
+  EXPECT_EQ(0, static_cast<int>(l2.size()));
 
   // Zero-initialized after `Free`.
-  for (size_t i = 0; i < kSize; ++i) {
+  for (int i = 0; i < kSize; ++i) {
     int *n = l2.Allocate();
     EXPECT_EQ(0, *n);
+    *n = i;
+  }
+
+  // The memory is reused as is after `Reset`.
+  std::vector<int *> ptrs;
+  for (int i = 0; i < kSize; ++i) ptrs.push_back(l2[i]);
+  l2.Reset();
+  EXPECT_EQ(0, static_cast<int>(l2.size()));
+  for (int i = 0; i < kSize; ++i) {
+    int *n = l2.Allocate();
+    EXPECT_EQ(ptrs[i], n);
+    EXPECT_EQ(i, *n);
   }
+  EXPECT_EQ(kSize, static_cast<int>(l2.size()));
 }
 }  // namespace model
 }  // namespace sentencepiece
@@ -20,11 +20,15 @@
 #include "third_party/absl/flags/parse.h"
 #include "third_party/absl/flags/usage.h"
 
+// SPM_NO_PROTOBUF is defined by the sentencepiece_infer library, which is
+// built without the protobuf runtime.
+#ifndef SPM_NO_PROTOBUF
 #ifdef _USE_EXTERNAL_PROTOBUF
 #include "google/protobuf/message_lite.h"
 #else
 #include "third_party/protobuf-lite/google/protobuf/message_lite.h"
 #endif
+#endif  // SPM_NO_PROTOBUF
 
 ABSL_DECLARE_FLAG(int32, minloglevel);
 
@@ -45,7 +49,9 @@ inline void ParseCommandLineFlags(const char *usage, int *argc, char ***argv,
 }
 
 inline void ShutdownLibrary() {
+#ifndef SPM_NO_PROTOBUF
   google::protobuf::ShutdownProtobufLibrary();
+#endif
 #ifdef HAS_ABSL_CLEANUP_FLAGS
   absl::CleanupFlags();
 #endif
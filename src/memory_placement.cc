@@ -0,0 +1,262 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "memory_placement.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "third_party/absl/strings/numbers.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
+#include "third_party/absl/strings/strip.h"
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace sentencepiece {
+namespace placement {
+namespace {
+
+// The node set by BindToNumaNode().
+thread_local int current_numa_node = -1;
+
+// The cpus of SetWorkerCpus().
+std::mutex worker_cpus_mutex;
+std::vector<int> *worker_cpus = new std::vector<int>;
+
+// Returns the number of cpus of `quota` per `period`, rounded up.
+int QuotaCpus(int64_t quota, int64_t period) {
+  return static_cast<int>((quota + period - 1) / period);
+}
+
+#if defined(__linux__)
+constexpr char kNodeDirectory[] = "/sys/devices/system/node";
+
+// Reads the cpus of `node` from sysfs. Returns false if they are unknown.
+bool ReadNodeCpus(int node, std::vector<int> *cpus) {
+  std::ifstream file(absl::StrCat(kNodeDirectory, "/node", node) +
+                     "/cpulist");
+  std::string list;
+  if (!file || !std::getline(file, list)) return false;
+  return ParseCpuList(list, cpus);
+}
+
+// Reads the first line of `filename`. Returns false if it is unreadable.
+bool ReadLine(const char *filename, std::string *line) {
+  std::ifstream file(filename);
+  return file && std::getline(file, *line);
+}
+
+// Returns the cpu quota of the cgroup of the process in cpus, or 0 when it
+// is unlimited or unknown.
+int CgroupCpuQuota() {
+  std::string line;
+  int cpus = 0;
+  if (ReadLine("/sys/fs/cgroup/cpu.max", &line) &&
+      ParseCgroupCpuMax(line, &cpus)) {
+    return cpus;
+  }
+  for (const char *dir : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+    std::string quota, period;
+    int64_t quota_us = 0, period_us = 0;
+    if (ReadLine(absl::StrCat(dir, "/cpu.cfs_quota_us").c_str(), &quota) &&
+        ReadLine(absl::StrCat(dir, "/cpu.cfs_period_us").c_str(), &period) &&
+        absl::SimpleAtoi(quota, &quota_us) &&
+        absl::SimpleAtoi(period, &period_us)) {
+      return quota_us > 0 && period_us > 0 ? QuotaCpus(quota_us, period_us)
+                                           : 0;
+    }
+  }
+  return 0;
+}
+#endif
+}  // namespace
+
+std::vector<int> NumaNodes() {
+  std::vector<int> nodes;
+#if defined(__linux__)
+  if (DIR *dir = opendir(kNodeDirectory)) {
+    while (const struct dirent *entry = readdir(dir)) {
+      absl::string_view name = entry->d_name;
+      int node = 0;
+      std::vector<int> cpus;
+      if (absl::ConsumePrefix(&name, "node") &&
+          absl::SimpleAtoi(name, &node) && ReadNodeCpus(node, &cpus) &&
+          !cpus.empty()) {
+        nodes.push_back(node);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(nodes.begin(), nodes.end());
+#endif
+  if (nodes.empty()) nodes.push_back(0);
+  return nodes;
+}
+
+bool BindToNumaNode(int node) {
+#if defined(__linux__)
+  std::vector<int> cpus;
+  if (!ReadNodeCpus(node, &cpus) || cpus.empty()) return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) return false;
+  current_numa_node = node;
+  return true;
+#else
+  return false;
+#endif
+}
+
+int CurrentNumaNode() { return current_numa_node; }
+
+void RunOnNumaNode(int node, const std::function<void()> &func) {
+  std::thread thread([node, &func]() {
+    BindToNumaNode(node);
+    func();
+  });
+  thread.join();
+}
+
+bool ParseCpuList(absl::string_view list, std::vector<int> *cpus) {
+  cpus->clear();
+  while (!list.empty() && (list.back() == '\n' || list.back() == ' ')) {
+    list.remove_suffix(1);
+  }
+  if (list.empty()) return true;
+  for (const auto range : absl::StrSplit(list, ",", absl::AllowEmpty())) {
+    const std::vector<absl::string_view> bounds =
+        absl::StrSplit(range, "-", absl::AllowEmpty());
+    int first = 0, last = 0;
+    if (bounds.empty() || bounds.size() > 2 ||
+        !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) cpus->push_back(cpu);
+  }
+  return true;
+}
+
+int AvailableCpus() {
+  int cpus = std::thread::hardware_concurrency();
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+    cpus = CPU_COUNT(&set);
+  }
+  const int quota = CgroupCpuQuota();
+  if (quota > 0 && (cpus <= 0 || quota < cpus)) cpus = quota;
+#endif
+  return std::max(cpus, 1);
+}
+
+bool ParseCgroupCpuMax(absl::string_view cpu_max, int *cpus) {
+  while (!cpu_max.empty() &&
+         (cpu_max.back() == '\n' || cpu_max.back() == ' ')) {
+    cpu_max.remove_suffix(1);
+  }
+  const std::vector<absl::string_view> fields = absl::StrSplit(cpu_max, " ");
+  int64_t quota = 0, period = 100000;
+  if (fields.empty() || fields.size() > 2 ||
+      (fields.size() == 2 &&
+       (!absl::SimpleAtoi(fields[1], &period) || period <= 0))) {
+    return false;
+  }
+  if (fields[0] == "max") {
+    *cpus = 0;
+    return true;
+  }
+  if (!absl::SimpleAtoi(fields[0], &quota) || quota <= 0) return false;
+  *cpus = QuotaCpus(quota, period);
+  return true;
+}
+
+bool BindToCpus(const std::vector<int> &cpus) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  if (CPU_COUNT(&set) == 0) return false;
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+void SetWorkerCpus(const std::vector<int> &cpus) {
+  std::lock_guard<std::mutex> lock(worker_cpus_mutex);
+  *worker_cpus = cpus;
+}
+
+std::vector<int> WorkerCpus() {
+  std::lock_guard<std::mutex> lock(worker_cpus_mutex);
+  return *worker_cpus;
+}
+
+std::function<void(int)> WorkerInitializer() {
+  const std::vector<int> cpus = WorkerCpus();
+  if (cpus.empty()) return nullptr;
+  return [cpus](int worker) { BindToCpus({cpus[worker % cpus.size()]}); };
+}
+
+void *AllocateTable(size_t size, bool huge_pages) {
+#if defined(__linux__)
+  if (huge_pages) {
+    size = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, kHugePageSize, std::max(size, kHugePageSize)) !=
+        0) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    // Only a hint: the kernel may not have transparent huge pages enabled.
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+  }
+#endif
+  return ::operator new(size);
+}
+
+void FreeTable(void *ptr, bool huge_pages) {
+#if defined(__linux__)
+  if (huge_pages) {
+    free(ptr);
+    return;
+  }
+#endif
+  ::operator delete(ptr);
+}
+
+}  // namespace placement
+}  // namespace sentencepiece
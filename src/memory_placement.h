@@ -0,0 +1,126 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef MEMORY_PLACEMENT_H_
+#define MEMORY_PLACEMENT_H_
+
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "third_party/absl/strings/string_view.h"
+
+// Placement of the lookup tables of the models in memory: on transparent
+// huge pages, and on the NUMA node of the threads reading them. The NUMA
+// topology is read from sysfs on Linux. Elsewhere the machine has one node
+// and the huge pages are ordinary memory.
+namespace sentencepiece {
+namespace placement {
+
+// Size of the huge pages the tables are aligned to.
+constexpr size_t kHugePageSize = 2 << 20;
+
+// Returns the NUMA nodes with cpus in increasing order, e.g. {0, 1} on a
+// dual-socket server, or {0} when the topology is unknown.
+std::vector<int> NumaNodes();
+
+// Binds the calling thread to the cpus of NUMA `node`. The memory the
+// thread touches first is then allocated on that node by the kernel.
+// Returns false if the thread could not be bound.
+bool BindToNumaNode(int node);
+
+// Returns the node the calling thread is bound to with BindToNumaNode(),
+// or -1.
+int CurrentNumaNode();
+
+// Runs `func` on a new thread bound to `node` and waits for it.
+void RunOnNumaNode(int node, const std::function<void()> &func);
+
+// Parses a cpu list of sysfs, e.g. "0-3,8,10-11", into `cpus`. Returns
+// false if the list is malformed.
+bool ParseCpuList(absl::string_view list, std::vector<int> *cpus);
+
+// Returns the number of cpus the process may run on: the cpus of its
+// affinity mask, limited by the cpu quota of its cgroup, e.g. the one of a
+// container, rounded up. The quota is read from cpu.max of cgroup v2, or
+// from cpu.cfs_quota_us and cpu.cfs_period_us of cgroup v1. Falls back to
+// std::thread::hardware_concurrency(). The result is at least 1.
+int AvailableCpus();
+
+// Parses cpu.max of cgroup v2, e.g. "400000 100000" or "max 100000", into
+// the number of cpus of the quota rounded up, or 0 when it is unlimited.
+// Returns false if `cpu_max` is malformed.
+bool ParseCgroupCpuMax(absl::string_view cpu_max, int *cpus);
+
+// Binds the calling thread to `cpus`. Returns false if the thread could not
+// be bound.
+bool BindToCpus(const std::vector<int> &cpus);
+
+// Sets the cpus the workers of the thread pools of the library are pinned
+// to, one cpu per worker in turn. Empty, the default, leaves the workers
+// unpinned. Applies to the pools started afterwards.
+void SetWorkerCpus(const std::vector<int> &cpus);
+std::vector<int> WorkerCpus();
+
+// Returns the `init_worker` function of a ThreadPool which pins its workers
+// to WorkerCpus(), or nullptr if they are not pinned.
+std::function<void(int)> WorkerInitializer();
+
+// Allocates and frees `size` bytes of a table. With `huge_pages`, the
+// memory is aligned to kHugePageSize and advised to be backed by huge pages.
+void *AllocateTable(size_t size, bool huge_pages);
+void FreeTable(void *ptr, bool huge_pages);
+
+// Allocator of std::vector with AllocateTable(). The vectors of a table
+// are copied to huge pages with
+//   table = Table(table.begin(), table.end(), TableAllocator<T>(true));
+template <typename T>
+class TableAllocator {
+ public:
+  using value_type = T;
+  // The assigned and swapped vectors keep the memory of their allocator.
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  TableAllocator() {}
+  explicit TableAllocator(bool huge_pages) : huge_pages_(huge_pages) {}
+  template <typename U>
+  TableAllocator(const TableAllocator<U> &other)
+      : huge_pages_(other.huge_pages()) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(AllocateTable(n * sizeof(T), huge_pages_));
+  }
+  void deallocate(T *ptr, size_t) { FreeTable(ptr, huge_pages_); }
+
+  bool huge_pages() const { return huge_pages_; }
+
+  template <typename U>
+  bool operator==(const TableAllocator<U> &other) const {
+    return huge_pages_ == other.huge_pages();
+  }
+  template <typename U>
+  bool operator!=(const TableAllocator<U> &other) const {
+    return !(*this == other);
+  }
+
+ private:
+  bool huge_pages_ = false;
+};
+
+}  // namespace placement
+}  // namespace sentencepiece
+#endif  // MEMORY_PLACEMENT_H_
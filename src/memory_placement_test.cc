@@ -0,0 +1,114 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "memory_placement.h"
+
+#include <cstdint>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace placement {
+
+TEST(MemoryPlacementTest, ParseCpuListTest) {
+  std::vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+  EXPECT_TRUE(ParseCpuList("5", &cpus));
+  EXPECT_EQ(std::vector<int>({5}), cpus);
+  EXPECT_TRUE(ParseCpuList("\n", &cpus));
+  EXPECT_TRUE(cpus.empty());
+
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("1-2-3", &cpus));
+  EXPECT_FALSE(ParseCpuList("1,,2", &cpus));
+  EXPECT_FALSE(ParseCpuList("-1", &cpus));
+}
+
+TEST(MemoryPlacementTest, AvailableCpusTest) {
+  int cpus = -1;
+  EXPECT_TRUE(ParseCgroupCpuMax("400000 100000\n", &cpus));
+  EXPECT_EQ(4, cpus);
+  EXPECT_TRUE(ParseCgroupCpuMax("150000 100000", &cpus));
+  EXPECT_EQ(2, cpus);
+  EXPECT_TRUE(ParseCgroupCpuMax("50000", &cpus));
+  EXPECT_EQ(1, cpus);
+  EXPECT_TRUE(ParseCgroupCpuMax("max 100000", &cpus));
+  EXPECT_EQ(0, cpus);
+
+  EXPECT_FALSE(ParseCgroupCpuMax("", &cpus));
+  EXPECT_FALSE(ParseCgroupCpuMax("a 100000", &cpus));
+  EXPECT_FALSE(ParseCgroupCpuMax("100000 0", &cpus));
+  EXPECT_FALSE(ParseCgroupCpuMax("1 2 3", &cpus));
+
+  EXPECT_LE(1, AvailableCpus());
+
+  // The workers are pinned to the cpus in turn.
+  EXPECT_TRUE(WorkerCpus().empty());
+  EXPECT_EQ(nullptr, WorkerInitializer());
+  SetWorkerCpus({0});
+  EXPECT_EQ(std::vector<int>({0}), WorkerCpus());
+  const auto init_worker = WorkerInitializer();
+  ASSERT_NE(nullptr, init_worker);
+  std::thread thread([&]() { init_worker(3); });
+  thread.join();
+  SetWorkerCpus({});
+  EXPECT_EQ(nullptr, WorkerInitializer());
+}
+
+TEST(MemoryPlacementTest, NumaNodesTest) {
+  const std::vector<int> nodes = NumaNodes();
+  ASSERT_FALSE(nodes.empty());
+  for (size_t i = 1; i < nodes.size(); ++i) EXPECT_LT(nodes[i - 1], nodes[i]);
+
+  EXPECT_EQ(-1, CurrentNumaNode());
+  int node = -2;
+  bool bound = false;
+  RunOnNumaNode(nodes.front(), [&]() {
+    node = CurrentNumaNode();
+    bound = node != -1;
+  });
+  if (bound) EXPECT_EQ(nodes.front(), node);
+  // The calling thread is not bound.
+  EXPECT_EQ(-1, CurrentNumaNode());
+}
+
+TEST(MemoryPlacementTest, TableAllocatorTest) {
+  for (const bool huge_pages : {false, true}) {
+    std::vector<int, TableAllocator<int>> table(
+        1000, 0, TableAllocator<int>(huge_pages));
+    std::iota(table.begin(), table.end(), 0);
+    EXPECT_EQ(999, table.back());
+    EXPECT_EQ(huge_pages, table.get_allocator().huge_pages());
+#if defined(__linux__)
+    if (huge_pages) {
+      EXPECT_EQ(0, reinterpret_cast<uintptr_t>(table.data()) % kHugePageSize);
+    }
+#endif
+
+    // The copy is in ordinary memory unless the allocator is given.
+    std::vector<int, TableAllocator<int>> copy(table.begin(), table.end());
+    EXPECT_FALSE(copy.get_allocator().huge_pages());
+    copy = table;
+    EXPECT_EQ(huge_pages, copy.get_allocator().huge_pages());
+    EXPECT_EQ(table, copy);
+  }
+}
+
+}  // namespace placement
+}  // namespace sentencepiece
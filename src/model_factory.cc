@@ -47,4 +47,17 @@ std::unique_ptr<ModelInterface> ModelFactory::Create(
 
   return std::make_unique<unigram::Model>(model_proto);
 }
+
+std::unique_ptr<ModelInterface> ModelFactory::Create(
+    const ModelProto& model_proto, absl::string_view trie_blob) {
+  if (model_proto.trainer_spec().model_type() == TrainerSpec::UNIGRAM &&
+      !trie_blob.empty()) {
+    return std::make_unique<unigram::Model>(model_proto, trie_blob);
+  }
+  if (model_proto.trainer_spec().model_type() == TrainerSpec::BPE &&
+      !trie_blob.empty()) {
+    return std::make_unique<bpe::Model>(model_proto, trie_blob);
+  }
+  return Create(model_proto);
+}
 }  // namespace sentencepiece
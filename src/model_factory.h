@@ -26,6 +26,13 @@ class ModelFactory {
  public:
   // Creates Model instance from |model_proto|.
   static std::unique_ptr<ModelInterface> Create(const ModelProto &model_proto);
+
+  // Creates Model instance from |model_proto| and a blob precompiled by
+  // unigram::Model::SerializeTrie() or bpe::Model::SerializeMerges(). The
+  // unigram trie must outlive the returned instance. Other model types
+  // ignore the blob.
+  static std::unique_ptr<ModelInterface> Create(const ModelProto &model_proto,
+                                                absl::string_view trie_blob);
 };
 }  // namespace sentencepiece
 #endif  // MODEL_FACTORY_H_
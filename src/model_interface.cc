@@ -15,17 +15,392 @@
 #include "model_interface.h"
 
 #include <algorithm>
+#include <functional>
+#include <limits>
+#include <numeric>
 
 #include "sentencepiece_model.pb.h"
 #include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/strings/strip.h"
 #include "util.h"
 
 namespace sentencepiece {
+namespace {
+constexpr size_t kMaxWordCacheShards = 16;
+}  // namespace
+
+WordCache::WordCache(size_t capacity) {
+  const size_t num_shards = std::max<size_t>(
+      1, std::min(kMaxWordCacheShards, capacity / kMaxWordCacheShards));
+  shard_capacity_ = std::max<size_t>(1, capacity / num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.emplace_back(std::make_unique<Shard>());
+  }
+}
+
+WordCache::Shard *WordCache::GetShard(absl::string_view word) {
+  return shards_[std::hash<absl::string_view>()(word) % shards_.size()].get();
+}
+
+bool WordCache::Lookup(absl::string_view word, EncodeResult *result) {
+  auto *shard = GetShard(word);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  const auto it = shard->index.find(word);
+  if (it == shard->index.end()) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+  size_t offset = 0;
+  for (const auto &span : it->second->second) {
+    result->emplace_back(word.substr(offset, span.first), span.second);
+    offset += span.first;
+  }
+  return true;
+}
+
+void WordCache::Insert(absl::string_view word, const EncodeResult &pieces) {
+  Spans spans;
+  spans.reserve(pieces.size());
+  for (const auto &p : pieces) spans.emplace_back(p.first.size(), p.second);
+
+  auto *shard = GetShard(word);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  if (shard->index.find(word) != shard->index.end()) return;
+  if (shard->lru.size() >= shard_capacity_) {
+    shard->index.erase(shard->lru.back().first);
+    shard->lru.pop_back();
+  }
+  shard->lru.emplace_front(std::string(word), std::move(spans));
+  shard->index.emplace(shard->lru.front().first, shard->lru.begin());
+}
+
+void WordCache::Clear() {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->index.clear();
+    shard->lru.clear();
+  }
+}
+
+size_t WordCache::MemoryUsage() const {
+  size_t size = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    size += port::HashMapBytes(shard->index);
+    for (const auto &entry : shard->lru) {
+      // The list node holds the entry and two pointers.
+      size += sizeof(entry) + 2 * sizeof(void *) +
+              port::StringBytes(entry.first) + port::VectorBytes(entry.second);
+    }
+  }
+  return size;
+}
+
+PieceIndex::PieceIndex(
+    const std::vector<std::pair<absl::string_view, int>> &pieces) {
+  if (pieces.empty()) return;
+  // A seed fails only when two surfaces have the same 64-bit hash or a
+  // bucket is unlucky. The table grows slightly if this repeats.
+  for (uint64 attempt = 0;; ++attempt) {
+    seed_ = Mix(attempt + 1);
+    if (Build(pieces, pieces.size() + pieces.size() * (attempt / 4) / 32)) {
+      size_ = pieces.size();
+      return;
+    }
+  }
+}
+
+bool PieceIndex::Build(
+    const std::vector<std::pair<absl::string_view, int>> &pieces,
+    size_t num_slots) {
+  // Two keys per bucket on average. The buckets are placed from the largest
+  // one, while most slots are free, by searching for a displacement which
+  // sends all of their keys to free slots.
+  const size_t num_buckets = pieces.size() / 2 + 1;
+  displacements_.assign(num_buckets, 0);
+  slots_.assign(num_slots, Slot());
+
+  std::vector<uint64> hashes(pieces.size());
+  std::vector<std::vector<size_t>> buckets(num_buckets);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    hashes[i] = Hash(pieces[i].first, seed_);
+    buckets[(hashes[i] >> 32) % num_buckets].push_back(i);
+  }
+
+  std::vector<size_t> order(num_buckets);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<bool> used(num_slots, false);
+  std::vector<size_t> positions;
+  const uint32 max_displacement = static_cast<uint32>(
+      std::min<uint64>(16 * static_cast<uint64>(num_slots) + 1024,
+                       std::numeric_limits<uint32>::max()));
+  for (const size_t b : order) {
+    const auto &bucket = buckets[b];
+    if (bucket.empty()) break;
+    bool placed = false;
+    for (uint32 displacement = 0;
+         !placed && displacement < max_displacement; ++displacement) {
+      positions.clear();
+      placed = true;
+      for (const size_t i : bucket) {
+        const size_t pos = SlotOf(hashes[i], displacement);
+        if (used[pos] || std::find(positions.begin(), positions.end(), pos) !=
+                             positions.end()) {
+          placed = false;
+          break;
+        }
+        positions.push_back(pos);
+      }
+      if (!placed) continue;
+      displacements_[b] = displacement;
+      for (size_t k = 0; k < bucket.size(); ++k) {
+        used[positions[k]] = true;
+        slots_[positions[k]].fingerprint =
+            static_cast<uint32>(hashes[bucket[k]]);
+        slots_[positions[k]].id = pieces[bucket[k]].second;
+      }
+    }
+    if (!placed) return false;
+  }
+  return true;
+}
 
 ModelInterface::ModelInterface(const ModelProto &model_proto)
     : model_proto_(&model_proto), status_(util::OkStatus()) {}
 ModelInterface::~ModelInterface() {}
 
+SafeCutFinder::SafeCutFinder(const ModelProto &model_proto) {
+  for (const auto &sp : model_proto.pieces()) {
+    if (sp.type() == ModelProto::SentencePiece::CONTROL ||
+        sp.type() == ModelProto::SentencePiece::UNKNOWN ||
+        sp.type() == ModelProto::SentencePiece::BYTE) {
+      continue;
+    }
+    const auto text = string_util::UTF8ToUnicodeText(sp.piece());
+    for (size_t i = 1; i < text.size(); ++i) {
+      bigrams_.insert(static_cast<uint64>(text[i - 1]) << 32 | text[i]);
+    }
+  }
+}
+
+size_t SafeCutFinder::NextCut(absl::string_view normalized,
+                              size_t pos) const {
+  if (pos == 0) return 0;
+  if (pos >= normalized.size()) return normalized.size();
+
+  // Moves to the next character boundary and decodes the character before
+  // it.
+  while (pos < normalized.size() && (normalized[pos] & 0xC0) == 0x80) ++pos;
+  if (pos == normalized.size()) return pos;
+  size_t begin = pos - 1;
+  while (begin > 0 && (normalized[begin] & 0xC0) == 0x80) --begin;
+  size_t mblen = 0;
+  char32 prev = string_util::DecodeUTF8(
+      normalized.substr(begin, pos - begin), &mblen);
+
+  while (pos < normalized.size()) {
+    const char32 next =
+        string_util::DecodeUTF8(normalized.substr(pos), &mblen);
+    if (!bigrams_.count(static_cast<uint64>(prev) << 32 | next)) return pos;
+    prev = next;
+    pos += mblen;
+  }
+  return normalized.size();
+}
+
+util::Status ModelInterface::VerifyWordSplittable() const {
+  RETURN_IF_ERROR(status());
+
+  // Space symbol (U+2581)
+  const absl::string_view kSpaceSymbol = "\xe2\x96\x81";
+  const bool treat_ws_as_suffix =
+      model_proto_->trainer_spec().treat_whitespace_as_suffix();
+  for (const auto &sp : model_proto_->pieces()) {
+    absl::string_view piece = sp.piece();
+    if (treat_ws_as_suffix) {
+      absl::ConsumeSuffix(&piece, kSpaceSymbol);
+    } else {
+      absl::ConsumePrefix(&piece, kSpaceSymbol);
+    }
+    CHECK_OR_RETURN(piece.find(kSpaceSymbol) == absl::string_view::npos)
+        << "piece \"" << sp.piece() << "\" spans words.";
+  }
+
+  return util::OkStatus();
+}
+
+FrequentWordTable::FrequentWordTable(absl::string_view blob) {
+  status_ = Parse(blob);
+  if (!status_.ok()) {
+    words_.clear();
+    span_offsets_.clear();
+    spans_.clear();
+    max_id_ = -1;
+  }
+}
+
+util::Status FrequentWordTable::Parse(absl::string_view blob) {
+  constexpr char kBroken[] = "The frequent word table is broken.";
+  uint32 size = 0;
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&blob, &size)) << kBroken;
+  std::vector<std::pair<absl::string_view, int>> keys;
+  absl::flat_hash_set<absl::string_view> seen;
+  span_offsets_.push_back(0);
+  for (uint32 n = 0; n < size; ++n) {
+    uint32 word_size = 0, num_pieces = 0;
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&blob, &word_size) &&
+                    string_util::ConsumeUInt32(&blob, &num_pieces) &&
+                    blob.size() >= word_size)
+        << kBroken;
+    const absl::string_view word = blob.substr(0, word_size);
+    blob.remove_prefix(word_size);
+    CHECK_OR_RETURN(!word.empty() && seen.insert(word).second) << kBroken;
+    uint32 consumed = 0;
+    for (uint32 i = 0; i < num_pieces; ++i) {
+      uint32 length = 0, id = 0;
+      CHECK_OR_RETURN(
+          string_util::ConsumeUInt32(&blob, &length) &&
+          string_util::ConsumeUInt32(&blob, &id) && length > 0 &&
+          length <= word_size - consumed &&
+          id <= static_cast<uint32>(std::numeric_limits<int32>::max()))
+          << kBroken;
+      consumed += length;
+      spans_.emplace_back(length, static_cast<int32>(id));
+      max_id_ = std::max<int>(max_id_, id);
+    }
+    CHECK_EQ_OR_RETURN(consumed, word_size) << kBroken;
+    keys.emplace_back(word, words_.size());
+    words_.push_back(word);
+    span_offsets_.push_back(spans_.size());
+  }
+  CHECK_OR_RETURN(blob.empty()) << kBroken;
+  index_ = PieceIndex(keys);
+  return util::OkStatus();
+}
+
+// static
+std::string FrequentWordTable::Serialize(
+    const std::vector<std::pair<absl::string_view, EncodeResult>> &words) {
+  std::string blob;
+  string_util::AppendUInt32(words.size(), &blob);
+  for (const auto &word : words) {
+    string_util::AppendUInt32(word.first.size(), &blob);
+    string_util::AppendUInt32(word.second.size(), &blob);
+    blob.append(word.first.data(), word.first.size());
+    for (const auto &piece : word.second) {
+      string_util::AppendUInt32(piece.first.size(), &blob);
+      string_util::AppendUInt32(piece.second, &blob);
+    }
+  }
+  return blob;
+}
+
+util::Status ModelInterface::SetFrequentWordTable(
+    std::shared_ptr<const FrequentWordTable> table) {
+  if (table == nullptr) {
+    frequent_words_.reset();
+    return util::OkStatus();
+  }
+  RETURN_IF_ERROR(table->status());
+  RETURN_IF_ERROR(VerifyWordSplittable());
+  CHECK_LT_OR_RETURN(table->max_id(), GetPieceSize())
+      << "The frequent word table has ids out of the model.";
+
+  frequent_words_ = std::move(table);
+  return util::OkStatus();
+}
+
+util::Status ModelInterface::SetSharedWordCacheSize(size_t num_slots) {
+  if (num_slots == 0) {
+    shared_word_cache_.reset();
+    return util::OkStatus();
+  }
+  RETURN_IF_ERROR(VerifyWordSplittable());
+
+  auto cache = std::make_shared<SharedWordCache>(
+      SharedWordCache::Fingerprint(model_proto_->SerializeAsString()),
+      num_slots, GetPieceSize());
+  RETURN_IF_ERROR(cache->status());
+  shared_word_cache_ = std::move(cache);
+  return util::OkStatus();
+}
+
+void ModelInterface::GetMemoryUsage(MemoryUsage *usage) const {
+  usage->piece_maps += port::VectorBytes(piece_info_) +
+                       piece_index_.MemoryUsage() +
+                       port::HashMapBytes(shadowed_pieces_) +
+                       port::VectorBytes(byte_piece_ids_);
+  if (matcher_) usage->piece_maps += matcher_->MemoryUsage();
+  if (word_cache_) usage->caches += word_cache_->MemoryUsage();
+  if (frequent_words_) usage->caches += frequent_words_->MemoryUsage();
+  if (shared_word_cache_) usage->caches += shared_word_cache_->MemoryUsage();
+}
+
+util::Status ModelInterface::SetWordCacheSize(size_t capacity) {
+  if (capacity == 0) {
+    word_cache_.reset();
+    return util::OkStatus();
+  }
+  RETURN_IF_ERROR(VerifyWordSplittable());
+
+  word_cache_ = std::make_unique<WordCache>(capacity);
+  return util::OkStatus();
+}
+
+void ModelInterface::EncodeWithWordCache(
+    absl::string_view normalized, EncodeResult *result,
+    std::unique_ptr<EncodeScratch> *scratch,
+    const VocabularyRestriction *restriction) const {
+  if (restriction != nullptr) {
+    EncodeRestricted(normalized, *restriction, result, scratch);
+    return;
+  }
+  if (!word_cache_ && !frequent_words_ && !shared_word_cache_) {
+    EncodeWithScratch(normalized, result, scratch);
+    return;
+  }
+
+  result->clear();
+  const bool treat_ws_as_suffix =
+      model_proto_->trainer_spec().treat_whitespace_as_suffix();
+  EncodeResult word_result;
+  for (const auto &word :
+       SplitIntoWords(normalized, treat_ws_as_suffix, false)) {
+    if (frequent_words_ && frequent_words_->Lookup(word, result)) continue;
+    if (word_cache_ && word_cache_->Lookup(word, result)) continue;
+    if (shared_word_cache_) {
+      const size_t size = result->size();
+      if (shared_word_cache_->Lookup(word, result)) {
+        // Warms up the cache of this process for the next lookups.
+        if (word_cache_) {
+          word_result.assign(result->begin() + size, result->end());
+          word_cache_->Insert(word, word_result);
+        }
+        continue;
+      }
+    }
+    EncodeWithScratch(word, &word_result, scratch);
+    if (word_cache_) word_cache_->Insert(word, word_result);
+    if (shared_word_cache_) shared_word_cache_->Insert(word, word_result);
+    result->insert(result->end(), word_result.begin(), word_result.end());
+  }
+}
+
+void ModelInterface::EncodeMany(const std::vector<absl::string_view> &normalized,
+                                std::vector<EncodeResult> *results,
+                                std::unique_ptr<EncodeScratch> *scratch) const {
+  results->resize(normalized.size());
+  for (size_t i = 0; i < normalized.size(); ++i) {
+    EncodeWithWordCache(normalized[i], &(*results)[i], scratch);
+  }
+}
+
 #define RETURN_PIECE(name, default_value)                                \
   if (model_proto_->trainer_spec().name().empty()) return default_value; \
   return model_proto_->trainer_spec().name();
@@ -49,41 +424,40 @@ absl::string_view ModelInterface::pad_piece() const {
 #undef RETURN_PIECE
 
 int ModelInterface::PieceToId(absl::string_view piece) const {
-  auto it = reserved_id_map_.find(piece);
-  if (it != reserved_id_map_.end()) {
-    return it->second;
-  }
-  auto it2 = pieces_.find(piece);
-  if (it2 != pieces_.end()) {
-    return it2->second;
+  const int id = FindPiece(piece);
+  return id >= 0 ? id : unk_id_;
+}
+
+void ModelInterface::InitializePieceInfo() {
+  piece_info_.resize(model_proto_->pieces_size());
+  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
+    const auto &sp = model_proto_->pieces(i);
+    piece_info_[i].piece = &sp.piece();
+    piece_info_[i].score = sp.score();
+    piece_info_[i].type = sp.type();
   }
-  return unk_id_;
 }
 
 void ModelInterface::InitializePieces() {
-  pieces_.clear();
-  reserved_id_map_.clear();
+  piece_index_ = PieceIndex();
+  shadowed_pieces_.clear();
   unk_id_ = -1;
+  byte_piece_ids_.clear();
+  InitializePieceInfo();
 
   std::set<absl::string_view> user_defined_symbols;
   std::vector<bool> byte_found(256, false);
 
-  int pieces_size = 0;
-  int reserved_id_map_size = 0;
-  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
-    const auto &sp = model_proto_->pieces(i);
-    const bool is_normal_piece =
-        (sp.type() == ModelProto::SentencePiece::NORMAL ||
-         sp.type() == ModelProto::SentencePiece::USER_DEFINED ||
-         sp.type() == ModelProto::SentencePiece::UNUSED);
-    if (is_normal_piece) {
-      ++pieces_size;
-    } else {
-      ++reserved_id_map_size;
-    }
+  // The surfaces must be unique among the normal pieces and among the
+  // reserved ones.
+  PieceToIdMap pieces;
+  PieceToIdMap reserved_pieces;
+  int num_normal_pieces = 0;
+  for (const auto &sp : model_proto_->pieces()) {
+    if (IsNormalPieceType(sp.type())) ++num_normal_pieces;
   }
-  pieces_.reserve(pieces_size);
-  reserved_id_map_.reserve(reserved_id_map_size);
+  pieces.reserve(num_normal_pieces);
+  reserved_pieces.reserve(model_proto_->pieces_size() - num_normal_pieces);
 
   for (int i = 0; i < model_proto_->pieces_size(); ++i) {
     const auto &sp = model_proto_->pieces(i);
@@ -92,12 +466,9 @@ void ModelInterface::InitializePieces() {
       return;
     }
 
-    const bool is_normal_piece =
-        (sp.type() == ModelProto::SentencePiece::NORMAL ||
-         sp.type() == ModelProto::SentencePiece::USER_DEFINED ||
-         sp.type() == ModelProto::SentencePiece::UNUSED);
     if (!port::InsertIfNotPresent(
-            is_normal_piece ? &pieces_ : &reserved_id_map_, sp.piece(), i)) {
+            IsNormalPieceType(sp.type()) ? &pieces : &reserved_pieces,
+            sp.piece(), i)) {
       status_ = util::InternalError(sp.piece() + " is already defined.");
       return;
     }
@@ -124,6 +495,8 @@ void ModelInterface::InitializePieces() {
       const int byte = PieceToByte(sp.piece());
       if (0 <= byte && byte < 256) {
         byte_found[byte] = true;
+        if (byte_piece_ids_.empty()) byte_piece_ids_.resize(256, -1);
+        byte_piece_ids_[byte] = i;
       } else {
         status_ =
             util::InternalError("byte piece " + sp.piece() + " is invalid.");
@@ -147,7 +520,21 @@ void ModelInterface::InitializePieces() {
     }
   }
 
+  std::vector<std::pair<absl::string_view, int>> entries;
+  entries.reserve(model_proto_->pieces_size());
+  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
+    const auto &sp = model_proto_->pieces(i);
+    if (IsNormalPieceType(sp.type()) &&
+        reserved_pieces.find(sp.piece()) != reserved_pieces.end()) {
+      shadowed_pieces_[sp.piece()] = i;
+    } else {
+      entries.emplace_back(sp.piece(), i);
+    }
+  }
+  piece_index_ = PieceIndex(entries);
+
   matcher_ = std::make_unique<normalizer::PrefixMatcher>(user_defined_symbols);
+  word_splittable_ = VerifyWordSplittable().ok();
 }
 
 std::vector<absl::string_view> SplitIntoWords(absl::string_view text,
@@ -211,6 +598,15 @@ std::string ByteToPiece(unsigned char c) {
   return absl::StrFormat("<0x%02X>", c);
 }
 
+absl::string_view ByteToPieceView(unsigned char c) {
+  static const auto *const kPieces = []() -> std::vector<std::string> * {
+    auto *v = new std::vector<std::string>(256);
+    for (int i = 0; i < 256; ++i) (*v)[i] = ByteToPiece(i);
+    return v;
+  }();
+  return (*kPieces)[c];
+}
+
 int PieceToByte(absl::string_view piece) {
   using PieceToByteMap = absl::flat_hash_map<std::string, unsigned char>;
   static const auto *const kMap = []() -> PieceToByteMap * {
@@ -15,7 +15,11 @@
 #ifndef MODEL_INTERFACE_H_
 #define MODEL_INTERFACE_H_
 
+#include <atomic>
+#include <cstring>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <utility>
@@ -25,7 +29,9 @@
 #include "normalizer.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_processor.h"
+#include "shared_word_cache.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/strings/string_view.h"
 #include "third_party/darts_clone/darts.h"
 #include "util.h"
@@ -40,6 +46,10 @@ std::vector<absl::string_view> SplitIntoWords(
 // Converts byte (0-255) to piece (e.g., 58 -> "<0x3A>").
 std::string ByteToPiece(unsigned char c);
 
+// The same as ByteToPiece(), but returns a view of a static table, which
+// avoids formatting the piece.
+absl::string_view ByteToPieceView(unsigned char c);
+
 // Converts piece to byte (e.g., "<0x3A>" -> 58). Returns -1 if `piece` is not
 // a valid byte piece.
 int PieceToByte(absl::string_view piece);
@@ -48,6 +58,233 @@ using EncodeResult = std::vector<std::pair<absl::string_view, int>>;
 using NBestEncodeResult = std::vector<std::pair<EncodeResult, float>>;
 
 class ModelProto;
+class ModelInterface;
+
+// Ids which an encoder treats as UNUSED pieces in addition to the pieces
+// typed UNUSED in the model, e.g. the pieces out of a vocabulary given to
+// SentencePieceProcessor::AddVocabularyRestriction(). Kept as a bitmask,
+// so the encoders check a candidate piece with one load and the model
+// itself is not changed.
+class VocabularyRestriction {
+ public:
+  // Allows all the ids in [0, `size`).
+  explicit VocabularyRestriction(int size) : bits_((size + 63) / 64, 0) {}
+
+  void SetUnused(int id) { bits_[id >> 6] |= uint64_t{1} << (id & 63); }
+
+  bool IsUnused(int id) const { return (bits_[id >> 6] >> (id & 63)) & 1; }
+
+  size_t MemoryUsage() const { return port::VectorBytes(bits_); }
+
+ private:
+  std::vector<uint64_t> bits_;
+};
+
+// Bounded LRU cache from a normalized word to its encoded pieces. The
+// capacity is split into shards with their own locks, so that concurrent
+// Encode() calls rarely contend. Thread-safe.
+class WordCache {
+ public:
+  // `capacity` is the maximum number of cached words (> 0).
+  explicit WordCache(size_t capacity);
+
+  // Appends the cached pieces of `word` to `result`. Pieces are views of
+  // `word`. Returns false if `word` is not cached.
+  bool Lookup(absl::string_view word, EncodeResult *result);
+
+  // Caches `pieces`, which must be the encoding of `word`.
+  void Insert(absl::string_view word, const EncodeResult &pieces);
+
+  // Drops all entries. The counters are kept.
+  void Clear();
+
+  // Returns the estimated heap bytes of the entries.
+  size_t MemoryUsage() const;
+
+  int64 hits() const { return hits_; }
+  int64 misses() const { return misses_; }
+
+ private:
+  // <byte length, id> of each piece in the word.
+  using Spans = std::vector<std::pair<int, int>>;
+  struct Shard {
+    std::mutex mutex;
+    // Most recently used first. Keys of `index` are views of the list keys.
+    std::list<std::pair<std::string, Spans>> lru;
+    absl::flat_hash_map<absl::string_view,
+                        std::list<std::pair<std::string, Spans>>::iterator>
+        index;
+  };
+
+  Shard *GetShard(absl::string_view word);
+
+  size_t shard_capacity_ = 0;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<int64> hits_{0};
+  std::atomic<int64> misses_{0};
+};
+
+// Model-specific work buffers reused across EncodeWithScratch() calls.
+// A scratch object is tied to the model that created it.
+class EncodeScratch {
+ public:
+  explicit EncodeScratch(const ModelInterface *owner) : owner_(owner) {}
+  virtual ~EncodeScratch() {}
+
+  const ModelInterface *owner() const { return owner_; }
+
+ private:
+  const ModelInterface *owner_ = nullptr;
+};
+
+// Finds the positions of a normalized input where no piece of a model can
+// span, i.e. between two characters which are not adjacent in any piece.
+// The parts of an input cut at these positions are encoded into the same
+// pieces as the whole input by the unigram Viterbi and by BPE, so they can
+// be encoded in parallel. With the usual models, whose pieces do not span
+// words, every word boundary is such a position.
+class SafeCutFinder {
+ public:
+  explicit SafeCutFinder(const ModelProto &model_proto);
+
+  // Returns the first safe position at or after `pos`, or normalized.size()
+  // if there is none. `pos` may be inside a character.
+  size_t NextCut(absl::string_view normalized, size_t pos) const;
+
+  size_t MemoryUsage() const { return port::HashMapBytes(bigrams_); }
+
+ private:
+  // Pairs of characters adjacent in some piece, packed as (first << 32) |
+  // second.
+  absl::flat_hash_set<uint64> bigrams_;
+};
+
+// Minimal perfect hash of the pieces of a model, built at load time. A
+// lookup hashes the key once and probes a single slot, whose 32-bit
+// fingerprint rejects almost all of the keys not in the index. The keys are
+// not stored, so the caller compares the key with the surface of the
+// returned id.
+class PieceIndex {
+ public:
+  PieceIndex() {}
+
+  // `pieces` are pairs of surface and id with distinct surfaces. The
+  // surfaces are not referenced after construction.
+  explicit PieceIndex(
+      const std::vector<std::pair<absl::string_view, int>> &pieces);
+
+  // Returns the id stored for `piece`, or -1 if `piece` is not in the index.
+  // The id may belong to another surface with the same fingerprint.
+  int Lookup(absl::string_view piece) const {
+    if (slots_.empty()) return -1;
+    const uint64 hash = Hash(piece, seed_);
+    const uint32 displacement =
+        displacements_[(hash >> 32) % displacements_.size()];
+    const Slot &slot = slots_[SlotOf(hash, displacement)];
+    return slot.fingerprint == static_cast<uint32>(hash) ? slot.id : -1;
+  }
+
+  // Returns the number of pieces in the index.
+  size_t size() const { return size_; }
+
+  size_t MemoryUsage() const {
+    return port::VectorBytes(displacements_) + port::VectorBytes(slots_);
+  }
+
+ private:
+  struct Slot {
+    uint32 fingerprint = 0;
+    int32 id = -1;
+  };
+
+  // Places the pieces in `num_slots` slots with `seed_`. Returns false if
+  // some bucket cannot be placed.
+  bool Build(const std::vector<std::pair<absl::string_view, int>> &pieces,
+             size_t num_slots);
+
+  // The splitmix64 finalizer.
+  static inline uint64 Mix(uint64 z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  static inline uint64 Hash(absl::string_view key, uint64 seed) {
+    uint64 hash = seed ^ (key.size() * 0x9E3779B97F4A7C15ULL);
+    const char *data = key.data();
+    size_t size = key.size();
+    for (; size >= 8; data += 8, size -= 8) {
+      uint64 word;
+      std::memcpy(&word, data, 8);
+      hash = Mix(hash ^ word);
+    }
+    uint64 word = 0;
+    std::memcpy(&word, data, size);
+    return Mix(hash ^ word ^ 0xFF);
+  }
+
+  inline size_t SlotOf(uint64 hash, uint32 displacement) const {
+    return Mix(hash + displacement * 0x9E3779B97F4A7C15ULL) % slots_.size();
+  }
+
+  uint64 seed_ = 0;
+  size_t size_ = 0;
+  std::vector<uint32> displacements_;  // Per bucket.
+  std::vector<Slot> slots_;
+};
+
+// Segmentations of the frequent words of a corpus, computed offline by
+// SentencePieceProcessor::BuildFrequentWordTable() and stored in the
+// fast-model file. Unlike WordCache, the table is filled before the first
+// call and never changes, so the lookups need no lock. Thread-safe.
+class FrequentWordTable {
+ public:
+  // Parses the table of Serialize(). The words are views of `blob`, which
+  // must outlive the table.
+  explicit FrequentWordTable(absl::string_view blob);
+
+  // Serializes the normalized words and their pieces. The pieces of a word
+  // must be a segmentation of it, and the words must be distinct.
+  static std::string Serialize(
+      const std::vector<std::pair<absl::string_view, EncodeResult>> &words);
+
+  // Appends the pieces of `word` to `result`. Pieces are views of `word`.
+  // Returns false if `word` is not in the table.
+  bool Lookup(absl::string_view word, EncodeResult *result) const {
+    const int index = index_.Lookup(word);
+    if (index < 0 || words_[index] != word) return false;
+    size_t offset = 0;
+    for (uint32 i = span_offsets_[index]; i < span_offsets_[index + 1]; ++i) {
+      result->emplace_back(word.substr(offset, spans_[i].first),
+                           spans_[i].second);
+      offset += spans_[i].first;
+    }
+    return true;
+  }
+
+  // Returns the largest id in the table, or -1 if it is empty.
+  int max_id() const { return max_id_; }
+  size_t size() const { return words_.size(); }
+
+  // The words are views of the blob, which is not counted.
+  size_t MemoryUsage() const {
+    return index_.MemoryUsage() + port::VectorBytes(words_) +
+           port::VectorBytes(span_offsets_) + port::VectorBytes(spans_);
+  }
+
+  util::Status status() const { return status_; }
+
+ private:
+  util::Status Parse(absl::string_view blob);
+
+  PieceIndex index_;  // word -> index in `words_`.
+  std::vector<absl::string_view> words_;
+  // The pieces of words_[i] are spans_[span_offsets_[i], span_offsets_[i+1]).
+  std::vector<uint32> span_offsets_;
+  std::vector<std::pair<uint32, int32>> spans_;  // <byte length, id>
+  int max_id_ = -1;
+  util::Status status_;
+};
 
 // Underlying model interface.
 // Given a normalized string, returns a sequence of sentence pieces with ids.
@@ -81,6 +318,108 @@ class ModelInterface {
   // The concatenation of pieces must be the same as `normalized`.
   virtual EncodeResult Encode(absl::string_view normalized) const = 0;
 
+  // The same as Encode(), but writes to `result` and keeps the model's work
+  // buffers in `scratch` so that repeated calls can avoid heap allocations.
+  // `scratch` is (re)created when it is empty or owned by another model.
+  virtual void EncodeWithScratch(
+      absl::string_view normalized, EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch) const {
+    *result = Encode(normalized);
+  }
+
+  // Returns an error if a piece has an inner whitespace symbol, i.e., if
+  // encoding the words of SplitIntoWords() one by one may differ from
+  // encoding the whole input.
+  util::Status VerifyWordSplittable() const;
+
+  // The same as VerifyWordSplittable().ok(), computed once with the pieces.
+  bool IsWordSplittable() const { return word_splittable_; }
+
+  // Enables the word cache with room for `capacity` words, or disables it
+  // when `capacity` is 0. The cache is only exact when no piece spans a word
+  // boundary, so an error is returned unless VerifyWordSplittable() is OK.
+  util::Status SetWordCacheSize(size_t capacity);
+
+  // Returns the word cache, or nullptr if it is disabled.
+  WordCache *word_cache() const { return word_cache_.get(); }
+
+  // Sets the table of frequent words looked up by EncodeWithWordCache()
+  // before the word cache, or removes it when `table` is null. As with the
+  // cache, an error is returned unless VerifyWordSplittable() is OK, or if
+  // the table has ids out of the model.
+  util::Status SetFrequentWordTable(
+      std::shared_ptr<const FrequentWordTable> table);
+
+  // Returns the table of frequent words, or nullptr.
+  const std::shared_ptr<const FrequentWordTable> &frequent_word_table() const {
+    return frequent_words_;
+  }
+
+  // Attaches to the SharedWordCache of `num_slots` slots of this model,
+  // which is keyed by the fingerprint of model_proto(), or detaches from it
+  // when `num_slots` is 0. It is looked up by EncodeWithWordCache() after
+  // the word cache. After the pieces are changed in place, e.g. by
+  // SentencePieceProcessor::SetVocabulary(), it must be called again to
+  // attach to the cache of the new pieces. As with the word cache, an error
+  // is returned unless VerifyWordSplittable() is OK.
+  util::Status SetSharedWordCacheSize(size_t num_slots);
+
+  // Returns the shared word cache, or nullptr if it is detached.
+  const std::shared_ptr<SharedWordCache> &shared_word_cache() const {
+    return shared_word_cache_;
+  }
+
+  // Called after the types of the pieces in model_proto() have been changed
+  // in place, e.g., by SentencePieceProcessor::SetVocabulary(). Models that
+  // cache the piece types must refresh them here and call this one.
+  virtual void UpdatePieceTypes() { InitializePieceInfo(); }
+
+  // The same as EncodeWithScratch(), but also treats the ids unused in
+  // `restriction` as UNUSED pieces. Models which do not use the UNUSED
+  // pieces, i.e. the char and the word models, ignore `restriction`.
+  virtual void EncodeRestricted(absl::string_view normalized,
+                                const VocabularyRestriction &restriction,
+                                EncodeResult *result,
+                                std::unique_ptr<EncodeScratch> *scratch) const {
+    EncodeWithScratch(normalized, result, scratch);
+  }
+
+  // The same as EncodeWithScratch(), but encodes `normalized` word by word
+  // through the table of frequent words and the word caches when they are
+  // set. They are bypassed when `restriction` is given, since their entries
+  // are for the whole vocabulary.
+  void EncodeWithWordCache(
+      absl::string_view normalized, EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch,
+      const VocabularyRestriction *restriction = nullptr) const;
+
+  // Makes the encoder read fixed-point scores validated on the normalized
+  // `calibration` texts. See unigram::Model::QuantizeScores(). The other
+  // models return an Unimplemented error.
+  virtual util::Status QuantizeScores(
+      const std::vector<absl::string_view> &calibration, float max_deviation,
+      float *deviation = nullptr) {
+    return util::UnimplementedError(
+        "The model does not support quantized scores.");
+  }
+
+  // Adds the estimated memory of the piece maps and the caches to `usage`.
+  // Models with lookup tables override it to add them to `model_tables`.
+  virtual void GetMemoryUsage(MemoryUsage *usage) const;
+
+  // Copies the lookup tables read by the encoders into memory allocated by
+  // the calling thread, on huge pages when `huge_pages` is true. A thread
+  // bound to a NUMA node then gets the tables on its node. Models without
+  // such tables keep them as they are.
+  virtual void RelocateTables(bool huge_pages) {}
+
+  // Encodes each text of `normalized` into `results` as
+  // EncodeWithWordCache() does. Models can override it to encode the texts
+  // together, e.g. to overlap the memory accesses of their traversals.
+  virtual void EncodeMany(const std::vector<absl::string_view> &normalized,
+                          std::vector<EncodeResult> *results,
+                          std::unique_ptr<EncodeScratch> *scratch) const;
+
   // The same as above, but returns nbest result with score.
   virtual NBestEncodeResult NBestEncode(absl::string_view normalized,
                                         int nbest_size) const {
@@ -94,6 +433,18 @@ class ModelInterface {
     return EncodeResult();
   }
 
+  // Draws `num_samples` segmentations in the distribution of SampleEncode().
+  // Models which share work between the samples of one sentence override
+  // it; the default calls SampleEncode() `num_samples` times.
+  virtual std::vector<EncodeResult> SampleEncodeMany(
+      absl::string_view normalized, float alpha, int num_samples) const {
+    std::vector<EncodeResult> results;
+    for (int i = 0; i < num_samples; ++i) {
+      results.push_back(SampleEncode(normalized, alpha));
+    }
+    return results;
+  }
+
   // Sample `samples` many tokenisations from the segmentation lattice
   // If `wor` is true, the samples are taken without replacement, and the scores
   // are the inclusion probabilities of the elements in the sample; otherwise
@@ -109,6 +460,21 @@ class ModelInterface {
     return {{EncodeResult(), 0.0}};
   }
 
+  // The same as NBestEncode() and SampleEncodeAndScore(), but keep the
+  // model's work buffers, e.g. the lattice, in `scratch` across calls as in
+  // EncodeWithScratch(). The defaults ignore `scratch`.
+  virtual NBestEncodeResult NBestEncodeWithScratch(
+      absl::string_view normalized, int nbest_size,
+      std::unique_ptr<EncodeScratch> *scratch) const {
+    return NBestEncode(normalized, nbest_size);
+  }
+
+  virtual NBestEncodeResult SampleEncodeAndScoreWithScratch(
+      absl::string_view normalized, float alpha, int samples, bool wor,
+      bool include_best, std::unique_ptr<EncodeScratch> *scratch) const {
+    return SampleEncodeAndScore(normalized, alpha, samples, wor, include_best);
+  }
+
   // Calculates the entropy of the segmentation lattice with inverse temperature
   // `alpha`. Uses a novel dynamic program to calculate the entropy.
   virtual float CalculateEntropy(absl::string_view normalized,
@@ -117,6 +483,18 @@ class ModelInterface {
     return 0.0;
   }
 
+  // The same as CalculateEntropy(), but also sets `marginals` to the expected
+  // count of each piece in the same distribution, as (id, count) pairs sorted
+  // by id, when it is not nullptr. `scratch` keeps the model's work buffers
+  // across calls as in EncodeWithScratch().
+  virtual float CalculateEntropyAndMarginals(
+      absl::string_view normalized, float alpha,
+      std::vector<std::pair<int, float>> *marginals,
+      std::unique_ptr<EncodeScratch> *scratch) const {
+    LOG(ERROR) << "Not implemented.";
+    return 0.0;
+  }
+
   // Return true if SampleEncode returns a valid result.
   virtual bool IsSampleEncodeAvailable() const { return false; }
 
@@ -136,7 +514,7 @@ class ModelInterface {
   // Returns the string representation of vocab with `id`.
   // id must be 0 <= id < GetPieceSize().
   virtual const std::string &IdToPiece(int id) const {
-    return model_proto_->pieces(id).piece();
+    return *piece_info_[id].piece;
   }
 
   // Returns the size of sentence pieces, which is the same
@@ -149,43 +527,44 @@ class ModelInterface {
   // Returns the score of `id`.
   // Score represents a log probability of the piece.
   // We can roughly estimate the unigram frequency of the piece.
-  virtual float GetScore(int id) const {
-    return model_proto_->pieces(id).score();
-  }
+  virtual float GetScore(int id) const { return piece_info_[id].score; }
 
   // Returns true if `id` is unknown symbol.
   virtual bool IsUnknown(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNKNOWN);
+    return (piece_info_[id].type == ModelProto::SentencePiece::UNKNOWN);
   }
 
   // Returns true if `id` is control symbol.
   virtual bool IsControl(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::CONTROL);
+    return (piece_info_[id].type == ModelProto::SentencePiece::CONTROL);
   }
 
   // Returns true if `id` is unused symbol.
   virtual bool IsUnused(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNUSED);
+    return (piece_info_[id].type == ModelProto::SentencePiece::UNUSED);
   }
 
   // Returns true if `id` is user defined symbol.
   virtual bool IsUserDefined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::USER_DEFINED);
+    return (piece_info_[id].type == ModelProto::SentencePiece::USER_DEFINED);
   }
 
   // Returns true if `id` is byte symbol.
   virtual bool IsByte(int id) const {
-    return (model_proto_->pieces(id).type() == ModelProto::SentencePiece::BYTE);
+    return (piece_info_[id].type == ModelProto::SentencePiece::BYTE);
   }
 
   virtual bool ByteFallbackEnabled() const {
     return model_proto_ && model_proto_->trainer_spec().byte_fallback();
   }
 
+  // Returns the id of the byte piece of `c` when the byte fallback is
+  // enabled, which is read from a table built at load time.
+  virtual int ByteToId(unsigned char c) const {
+    if (byte_piece_ids_.empty()) return PieceToId(ByteToPieceView(c));
+    return byte_piece_ids_[c];
+  }
+
   // Verifies if the `expected` and `actual` outputs are equivalent. `expected`
   // and `actual` are sentence pieces joined by space (` `). Normally it means
   // that the two strings are identical. In some model, due to float rounding
@@ -199,49 +578,103 @@ class ModelInterface {
  protected:
   void InitializePieces();
 
+  // Initializes `piece_info_` from `model_proto_`.
+  void InitializePieceInfo();
+
   // Non-virtual (inlined) implementation for faster execution.
-  inline float GetScoreInlined(int id) const {
-    return model_proto_->pieces(id).score();
-  }
+  inline float GetScoreInlined(int id) const { return piece_info_[id].score; }
 
   inline bool IsUnknownInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNKNOWN);
+    return (piece_info_[id].type == ModelProto::SentencePiece::UNKNOWN);
   }
 
   inline bool IsControlInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::CONTROL);
+    return (piece_info_[id].type == ModelProto::SentencePiece::CONTROL);
   }
 
   inline bool IsUnusedInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNUSED);
+    return (piece_info_[id].type == ModelProto::SentencePiece::UNUSED);
+  }
+
+  // The same as above, but also checks `restriction` when it is given.
+  inline bool IsUnusedInlined(int id,
+                              const VocabularyRestriction *restriction) const {
+    return IsUnusedInlined(id) ||
+           (restriction != nullptr && restriction->IsUnused(id));
   }
 
   inline bool IsUserDefinedInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::USER_DEFINED);
+    return (piece_info_[id].type == ModelProto::SentencePiece::USER_DEFINED);
   }
 
   inline bool IsByteInlined(int id) const {
-    return (model_proto_->pieces(id).type() == ModelProto::SentencePiece::BYTE);
+    return (piece_info_[id].type == ModelProto::SentencePiece::BYTE);
+  }
+
+  // Returns the id of `piece`, or -1 if it is not in the vocabulary. The
+  // control, unknown and byte pieces take precedence over the other pieces
+  // with the same surface.
+  inline int FindPiece(absl::string_view piece) const {
+    const int id = piece_index_.Lookup(piece);
+    return id >= 0 && *piece_info_[id].piece == piece ? id : -1;
+  }
+
+  // The same as above, but only finds the normal, user defined and unused
+  // pieces.
+  inline int FindNormalPiece(absl::string_view piece) const {
+    const int id = FindPiece(piece);
+    if (id < 0 || IsNormalPieceType(piece_info_[id].type)) return id;
+    if (shadowed_pieces_.empty()) return -1;
+    const auto it = shadowed_pieces_.find(piece);
+    return it == shadowed_pieces_.end() ? -1 : it->second;
+  }
+
+  static inline bool IsNormalPieceType(ModelProto::SentencePiece::Type type) {
+    return type == ModelProto::SentencePiece::NORMAL ||
+           type == ModelProto::SentencePiece::USER_DEFINED ||
+           type == ModelProto::SentencePiece::UNUSED;
   }
 
   const ModelProto *model_proto_ = nullptr;
 
+  // Piece, score and type of the pieces in `model_proto_`, indexed by id,
+  // so that the accessors above take one load instead of going through
+  // the protobuf accessors.
+  struct PieceInfo {
+    const std::string *piece = nullptr;
+    float score = 0.0;
+    ModelProto::SentencePiece::Type type = ModelProto::SentencePiece::NORMAL;
+  };
+  std::vector<PieceInfo> piece_info_;
+
   // PrefixMatcher for user defined symbols.
   std::unique_ptr<normalizer::PrefixMatcher> matcher_;
 
-  // piece -> id map for normal pieces
-  PieceToIdMap pieces_;
+  // piece -> id of all the pieces. A control, unknown or byte piece hides a
+  // normal piece with the same surface.
+  PieceIndex piece_index_;
 
-  // piece -> id map for control, unknown, and byte pieces
-  PieceToIdMap reserved_id_map_;
+  // piece -> id of the normal pieces hidden in `piece_index_`. Usually empty.
+  PieceToIdMap shadowed_pieces_;
 
   // unknown id.
   int unk_id_ = 0;
 
+  // VerifyWordSplittable().ok() when the pieces were initialized.
+  bool word_splittable_ = false;
+
+  // byte -> id of its byte piece. Empty unless the byte fallback is enabled.
+  std::vector<int> byte_piece_ids_;
+
+  // Optional cache of encoded words.
+  std::unique_ptr<WordCache> word_cache_;
+
+  // Optional precomputed segmentations of frequent words.
+  std::shared_ptr<const FrequentWordTable> frequent_words_;
+
+  // Optional cache of encoded words shared with other processes.
+  std::shared_ptr<SharedWordCache> shared_word_cache_;
+
   // status.
   util::Status status_;
 };
@@ -17,6 +17,7 @@
 #include "model_factory.h"
 #include "testharness.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "util.h"
 
 namespace sentencepiece {
@@ -204,6 +205,16 @@ TEST(ModelInterfaceTest, PieceToIdTest) {
     EXPECT_NEAR(0.3, model->GetScore(5), 0.0001);
     EXPECT_NEAR(0.4, model->GetScore(6), 0.0001);
     EXPECT_NEAR(0.5, model->GetScore(7), 0.0001);
+
+    // The types changed in place are visible after UpdatePieceTypes().
+    model_proto.mutable_pieces(5)->set_type(ModelProto::SentencePiece::UNUSED);
+    model_proto.mutable_pieces(6)->set_type(ModelProto::SentencePiece::NORMAL);
+    EXPECT_FALSE(model->IsUnused(5));
+    model->UpdatePieceTypes();
+    EXPECT_TRUE(model->IsUnused(5));
+    EXPECT_FALSE(model->IsUnused(6));
+    EXPECT_EQ("c", model->IdToPiece(5));
+    EXPECT_NEAR(0.3, model->GetScore(5), 0.0001);
   }
 }
 
@@ -251,6 +262,9 @@ TEST(ModelInterfaceTest, ByteFallbackModelTest) {
     AddPiece(&model_proto, "a");
     auto model = ModelFactory::Create(model_proto);
     EXPECT_TRUE(model->status().ok());
+    for (int i = 0; i < 256; ++i) {
+      EXPECT_EQ(model->PieceToId(ByteToPiece(i)), model->ByteToId(i));
+    }
   }
 
   // `byte_fallback` is true, but there are not 256 byte pieces.
@@ -463,6 +477,9 @@ TEST(ModelInterfaceTest, ByteToPieceTest) {
   EXPECT_EQ(ByteToPiece(10), "<0x0A>");
   EXPECT_EQ(ByteToPiece(16), "<0x10>");
   EXPECT_EQ(ByteToPiece(255), "<0xFF>");
+  for (int i = 0; i < 256; ++i) {
+    EXPECT_EQ(ByteToPiece(i), ByteToPieceView(i));
+  }
 }
 
 TEST(ModelInterfaceTest, PieceToByteTest) {
@@ -498,5 +515,246 @@ TEST(ModelInterfaceTest, VerifyOutputsEquivalent) {
   }
 }
 
+TEST(ModelInterfaceTest, WordCacheTest) {
+  WordCache cache(2);
+  EncodeResult result;
+  EXPECT_FALSE(cache.Lookup(WS "ab", &result));
+  cache.Insert(WS "ab", {{WS "a", 3}, {"b", 4}});
+  cache.Insert(WS "c", {{WS "c", 5}});
+
+  const std::string word = WS "ab";
+  EXPECT_TRUE(cache.Lookup(word, &result));
+  ASSERT_EQ(2, result.size());
+  EXPECT_EQ(WS "a", result[0].first);
+  EXPECT_EQ(3, result[0].second);
+  EXPECT_EQ("b", result[1].first);
+  EXPECT_EQ(word.data() + 4, result[1].first.data());
+
+  // WS "c" is the least recently used entry.
+  cache.Insert("d", {{"d", 6}});
+  EXPECT_FALSE(cache.Lookup(WS "c", &result));
+  EXPECT_TRUE(cache.Lookup("d", &result));
+  EXPECT_TRUE(cache.Lookup(WS "ab", &result));
+  EXPECT_EQ(5, result.size());
+  EXPECT_EQ(3, cache.hits());
+  EXPECT_EQ(2, cache.misses());
+
+  cache.Clear();
+  EXPECT_FALSE(cache.Lookup("d", &result));
+}
+
+TEST(ModelInterfaceTest, SetWordCacheSizeTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, WS "a", 1.0);
+    AddPiece(&model_proto, "b", 2.0);
+    auto model = ModelFactory::Create(model_proto);
+    EXPECT_EQ(nullptr, model->word_cache());
+    EXPECT_TRUE(model->SetWordCacheSize(10).ok());
+    EXPECT_NE(nullptr, model->word_cache());
+    EXPECT_TRUE(model->SetWordCacheSize(0).ok());
+    EXPECT_EQ(nullptr, model->word_cache());
+
+    // A piece spanning two words.
+    AddPiece(&model_proto, "b" WS "a", 0.0);
+    model = ModelFactory::Create(model_proto);
+    EXPECT_FALSE(model->SetWordCacheSize(10).ok());
+    EXPECT_EQ(nullptr, model->word_cache());
+  }
+}
+
+TEST(ModelInterfaceTest, FrequentWordTableTest) {
+  const std::string blob = FrequentWordTable::Serialize(
+      {{WS "ab", {{WS "a", 3}, {"b", 4}}}, {WS "c", {{WS "c", 5}}}});
+  FrequentWordTable table(blob);
+  ASSERT_TRUE(table.status().ok());
+  EXPECT_EQ(2, table.size());
+  EXPECT_EQ(5, table.max_id());
+
+  const std::string word = WS "ab";
+  EncodeResult result;
+  EXPECT_TRUE(table.Lookup(word, &result));
+  ASSERT_EQ(2, result.size());
+  EXPECT_EQ(WS "a", result[0].first);
+  EXPECT_EQ(3, result[0].second);
+  EXPECT_EQ("b", result[1].first);
+  EXPECT_EQ(word.data() + 4, result[1].first.data());
+  EXPECT_TRUE(table.Lookup(WS "c", &result));
+  EXPECT_EQ(3, result.size());
+  EXPECT_FALSE(table.Lookup("d", &result));
+  EXPECT_FALSE(table.Lookup(WS "a", &result));
+  EXPECT_EQ(3, result.size());
+
+  EXPECT_TRUE(FrequentWordTable(FrequentWordTable::Serialize({})).status().ok());
+  // Truncated, or pieces not covering the word.
+  EXPECT_FALSE(FrequentWordTable(blob.substr(0, blob.size() - 1)).status().ok());
+  EXPECT_FALSE(FrequentWordTable(FrequentWordTable::Serialize(
+                                     {{"ab", {{"a", 3}}}}))
+                   .status()
+                   .ok());
+  // Duplicated words.
+  EXPECT_FALSE(FrequentWordTable(FrequentWordTable::Serialize(
+                                     {{"a", {{"a", 3}}}, {"a", {{"a", 3}}}}))
+                   .status()
+                   .ok());
+}
+
+TEST(ModelInterfaceTest, SetFrequentWordTableTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, WS "a", 1.0);
+    AddPiece(&model_proto, "b", 2.0);
+    auto model = ModelFactory::Create(model_proto);
+    const int id_a = model->PieceToId(WS "a");
+    const int id_b = model->PieceToId("b");
+
+    // The table gives another segmentation than the model, so its hits can
+    // be told apart.
+    const std::string blob = FrequentWordTable::Serialize(
+        {{WS "ab", {{WS "a", id_b}, {"b", id_a}}}});
+    auto table = std::make_shared<FrequentWordTable>(blob);
+    EXPECT_TRUE(model->SetFrequentWordTable(table).ok());
+    EXPECT_EQ(table, model->frequent_word_table());
+
+    EncodeResult result;
+    std::unique_ptr<EncodeScratch> scratch;
+    model->EncodeWithWordCache(WS "ab" WS "b", &result, &scratch);
+    ASSERT_LE(2, result.size());
+    EXPECT_EQ(id_b, result[0].second);
+    EXPECT_EQ(id_a, result[1].second);
+    const EncodeResult rest = model->Encode(WS "b");
+    ASSERT_EQ(2 + rest.size(), result.size());
+    for (size_t i = 0; i < rest.size(); ++i) {
+      EXPECT_EQ(rest[i].first, result[i + 2].first);
+      EXPECT_EQ(rest[i].second, result[i + 2].second);
+    }
+
+    EXPECT_TRUE(model->SetFrequentWordTable(nullptr).ok());
+    EXPECT_EQ(nullptr, model->frequent_word_table());
+
+    // Ids out of the model.
+    EXPECT_FALSE(model
+                     ->SetFrequentWordTable(std::make_shared<FrequentWordTable>(
+                         FrequentWordTable::Serialize({{"b", {{"b", 1000}}}})))
+                     .ok());
+
+    // A piece spanning two words.
+    AddPiece(&model_proto, "b" WS "a", 0.0);
+    model = ModelFactory::Create(model_proto);
+    EXPECT_FALSE(model->SetFrequentWordTable(table).ok());
+    EXPECT_EQ(nullptr, model->frequent_word_table());
+  }
+}
+
+TEST(ModelInterfaceTest, SetSharedWordCacheSizeTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, WS "a", 1.0);
+    AddPiece(&model_proto, "b", 2.0);
+    auto model = ModelFactory::Create(model_proto);
+    auto other = ModelFactory::Create(model_proto);
+    EXPECT_EQ(nullptr, model->shared_word_cache());
+    ASSERT_TRUE(model->SetSharedWordCacheSize(64).ok());
+    ASSERT_TRUE(other->SetSharedWordCacheSize(64).ok());
+    ASSERT_NE(nullptr, model->shared_word_cache());
+    EXPECT_EQ(64, model->shared_word_cache()->num_slots());
+
+    // The words encoded by `model` are found by `other`.
+    EncodeResult result, expected;
+    std::unique_ptr<EncodeScratch> scratch;
+    model->EncodeWithWordCache(WS "ab" WS "a", &expected, &scratch);
+    other->EncodeWithWordCache(WS "ab" WS "a", &result, &scratch);
+    EXPECT_EQ(expected, result);
+    EXPECT_EQ(2, other->shared_word_cache()->hits());
+    EXPECT_EQ(0, other->shared_word_cache()->misses());
+
+    EXPECT_TRUE(SharedWordCache::Remove(
+                    SharedWordCache::Fingerprint(
+                        model->model_proto().SerializeAsString()),
+                    64)
+                    .ok());
+    EXPECT_TRUE(model->SetSharedWordCacheSize(0).ok());
+    EXPECT_EQ(nullptr, model->shared_word_cache());
+
+    // A piece spanning two words.
+    AddPiece(&model_proto, "b" WS "a", 0.0);
+    model = ModelFactory::Create(model_proto);
+    EXPECT_FALSE(model->SetSharedWordCacheSize(64).ok());
+    EXPECT_EQ(nullptr, model->shared_word_cache());
+  }
+}
+
+TEST(ModelInterfaceTest, PieceIndexTest) {
+  for (const int size : {0, 1, 2, 3, 10, 1000, 50000}) {
+    std::vector<std::string> surfaces;
+    for (int i = 0; i < size; ++i) surfaces.push_back(absl::StrCat("p", i));
+    std::vector<std::pair<absl::string_view, int>> pieces;
+    for (int i = 0; i < size; ++i) pieces.emplace_back(surfaces[i], i * 3);
+
+    const PieceIndex index(pieces);
+    EXPECT_EQ(size, index.size());
+    for (int i = 0; i < size; ++i) {
+      EXPECT_EQ(i * 3, index.Lookup(surfaces[i]));
+    }
+    // Almost all of the other keys are rejected by the fingerprint.
+    int num_false_positives = 0;
+    for (int i = size; i < size + 1000; ++i) {
+      if (index.Lookup(absl::StrCat("p", i)) >= 0) ++num_false_positives;
+    }
+    EXPECT_LE(num_false_positives, 1);
+    EXPECT_EQ(-1, PieceIndex().Lookup("p0"));
+  }
+}
+
+TEST(ModelInterfaceTest, PieceToIdWithSameSurfaceTest) {
+  // A control piece hides the normal piece with the same surface from
+  // PieceToId(), but not from the merges of BPE.
+  ModelProto model_proto;
+  auto *unk = model_proto.add_pieces();
+  unk->set_piece("<unk>");
+  unk->set_type(ModelProto::SentencePiece::UNKNOWN);
+  auto *control = model_proto.add_pieces();
+  control->set_piece("ab");
+  control->set_type(ModelProto::SentencePiece::CONTROL);
+  for (const auto &piece : {"a", "b", "ab"}) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(piece);
+    sp->set_score(0.0);
+  }
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::BPE);
+
+  auto model = ModelFactory::Create(model_proto);
+  ASSERT_TRUE(model->status().ok());
+  EXPECT_EQ(0, model->PieceToId("x"));
+  EXPECT_EQ(1, model->PieceToId("ab"));
+  EXPECT_EQ(2, model->PieceToId("a"));
+  EXPECT_EQ(4, model->Encode("ab")[0].second);
+}
+
+TEST(ModelInterfaceTest, SafeCutFinderTest) {
+  ModelProto model_proto = MakeBaseModelProto(TrainerSpec::UNIGRAM);
+  AddPiece(&model_proto, WS "ab");
+  AddPiece(&model_proto, "b" WS);
+  AddPiece(&model_proto, "\xE3\x81\x82\xE3\x81\x84");  // あい
+  const SafeCutFinder finder(model_proto);
+
+  // The pairs WS "a", "ab" and "b" WS are adjacent in pieces.
+  const absl::string_view text = WS "ab" WS "a";
+  EXPECT_EQ(0, finder.NextCut(text, 0));
+  EXPECT_EQ(text.size(), finder.NextCut(text, 1));
+  EXPECT_EQ(text.size(), finder.NextCut(text, text.size() + 1));
+
+  // "a" WS is not.
+  const absl::string_view text2 = "ab" WS "a" WS;
+  EXPECT_EQ(6, finder.NextCut(text2, 1));
+  EXPECT_EQ(6, finder.NextCut(text2, 6));
+
+  // A position inside a character moves to the next boundary.
+  const absl::string_view kana = "\xE3\x81\x82\xE3\x81\x84\xE3\x81\x82";
+  EXPECT_EQ(6, finder.NextCut(kana, 1));
+  EXPECT_EQ(6, finder.NextCut(kana, 4));
+  EXPECT_EQ(kana.size(), finder.NextCut(kana, 7));
+}
+
 }  // namespace
 }  // namespace sentencepiece
@@ -0,0 +1,112 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Compares Lattice::NBest() and Lattice::LazyNBest() on random lattices,
+// and the sampling without replacement of Lattice::NBest() with
+// Lattice::StochasticBeamSample().
+//
+//   % nbest_benchmark --length=200 --nbest_size=64 --theta=0.5
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "init.h"
+#include "third_party/absl/flags/flag.h"
+#include "unigram_model.h"
+
+ABSL_FLAG(int32, length, 100, "Number of characters of the sentence.");
+ABSL_FLAG(int32, max_piece_length, 8, "Maximum length of the nodes.");
+ABSL_FLAG(int32, nbest_size, 64, "Size of the n-best list.");
+ABSL_FLAG(double, theta, 1.0, "Smoothing parameter of the sampling.");
+ABSL_FLAG(int32, iterations, 10, "Number of runs to average.");
+ABSL_FLAG(uint32, seed, 1, "Seed of the random scores.");
+
+namespace sentencepiece {
+namespace {
+
+using Lattice = unigram::Lattice;
+
+// Fills `lattice` with all the nodes up to --max_piece_length characters.
+void BuildLattice(Lattice *lattice, const std::string &sentence) {
+  std::mt19937 mt(absl::GetFlag(FLAGS_seed));
+  std::uniform_real_distribution<float> dist(-10.0, 0.0);
+  lattice->SetSentence(sentence);
+  const int max_length = absl::GetFlag(FLAGS_max_piece_length);
+  for (int pos = 0; pos < lattice->size(); ++pos) {
+    for (int len = 1; len <= max_length && pos + len <= lattice->size();
+         ++len) {
+      auto *node = lattice->Insert(pos, len);
+      node->id = 0;
+      node->score = dist(mt);
+    }
+  }
+}
+
+// Runs `func` --iterations times and returns the average seconds.
+template <typename Func>
+double Measure(Func &&func) {
+  const int iterations = absl::GetFlag(FLAGS_iterations);
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) func();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  const std::string sentence(absl::GetFlag(FLAGS_length), 'a');
+  const size_t nbest_size = absl::GetFlag(FLAGS_nbest_size);
+
+  sentencepiece::unigram::Lattice lattice;
+  sentencepiece::BuildLattice(&lattice, sentence);
+
+  size_t nbest_results = 0, lazy_results = 0;
+  const double nbest_seconds = sentencepiece::Measure([&]() {
+    nbest_results = lattice.NBest(nbest_size, false, 0.0).size();
+  });
+  const double lazy_seconds = sentencepiece::Measure([&]() {
+    lazy_results = lattice.LazyNBest(nbest_size).size();
+  });
+
+  const float theta = absl::GetFlag(FLAGS_theta);
+  size_t sample_results = 0, beam_results = 0;
+  const double sample_seconds = sentencepiece::Measure([&]() {
+    sample_results = lattice.NBest(nbest_size, true, theta).size();
+  });
+  const double beam_seconds = sentencepiece::Measure([&]() {
+    beam_results = lattice.StochasticBeamSample(nbest_size, theta).size();
+  });
+
+  printf("length=%d nbest_size=%zu\n", lattice.size(), nbest_size);
+  printf("NBest:                %10.3f ms  (%zu results)\n",
+         nbest_seconds * 1e3, nbest_results);
+  printf("LazyNBest:            %10.3f ms  (%zu results)\n",
+         lazy_seconds * 1e3, lazy_results);
+  printf("NBest(sample):        %10.3f ms  (%zu results)\n",
+         sample_seconds * 1e3, sample_results);
+  printf("StochasticBeamSample: %10.3f ms  (%zu results)\n",
+         beam_seconds * 1e3, beam_results);
+
+  return 0;
+}
@@ -14,21 +14,118 @@
 
 #include "normalizer.h"
 
+#include <algorithm>
+#include <numeric>
 #include <utility>
 #include <vector>
 
 #include "common.h"
+#include "fast_model.h"
 #include "third_party/absl/strings/match.h"
 #include "third_party/absl/strings/string_view.h"
 #include "third_party/absl/strings/strip.h"
 #include "third_party/darts_clone/darts.h"
 #include "util.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 namespace sentencepiece {
 namespace normalizer {
 
 constexpr int Normalizer::kMaxTrieResultsSize;
 
+void Alignment::clear() {
+  runs_.clear();
+  size_ = 0;
+  cursor_ = 0;
+}
+
+void Alignment::AppendIdentity(size_t orig, size_t length) {
+  if (length == 0) return;
+  if (!runs_.empty()) {
+    auto &last = runs_.back();
+    const size_t last_length = size_ - last.norm;
+    // A run of one offset is extended as an identity run too.
+    if ((last.identity || last_length == 1) &&
+        last.orig + last_length == orig) {
+      last.identity = true;
+      size_ += length;
+      return;
+    }
+  }
+  runs_.push_back({size_, orig, true});
+  size_ += length;
+}
+
+void Alignment::AppendConstant(size_t orig, size_t length) {
+  if (length == 0) return;
+  if (!runs_.empty()) {
+    auto &last = runs_.back();
+    const size_t last_length = size_ - last.norm;
+    if ((!last.identity || last_length == 1) && last.orig == orig) {
+      last.identity = false;
+      size_ += length;
+      return;
+    }
+  }
+  // One offset may continue an identity run.
+  if (length == 1) {
+    AppendIdentity(orig, 1);
+    return;
+  }
+  runs_.push_back({size_, orig, false});
+  size_ += length;
+}
+
+size_t Alignment::FindRun(size_t index) const {
+  if (cursor_ >= runs_.size() || runs_[cursor_].norm > index) {
+    cursor_ = std::upper_bound(runs_.begin(), runs_.end(), index,
+                               [](size_t index, const Run &run) {
+                                 return index < run.norm;
+                               }) -
+              runs_.begin() - 1;
+  } else {
+    while (cursor_ + 1 < runs_.size() && runs_[cursor_ + 1].norm <= index) {
+      ++cursor_;
+    }
+  }
+  return cursor_;
+}
+
+size_t Alignment::operator[](size_t index) const {
+  const Run &run = runs_[FindRun(index)];
+  return run.identity ? run.orig + (index - run.norm) : run.orig;
+}
+
+void Alignment::Truncate(size_t size) {
+  if (size >= size_) return;
+  if (size == 0) {
+    clear();
+    return;
+  }
+  runs_.resize(FindRun(size - 1) + 1);
+  size_ = size;
+  cursor_ = 0;
+}
+
+void Alignment::ToVector(std::vector<size_t> *norm_to_orig) const {
+  norm_to_orig->resize(size_);
+  for (size_t i = 0; i < runs_.size(); ++i) {
+    const size_t end = i + 1 < runs_.size() ? runs_[i + 1].norm : size_;
+    auto first = norm_to_orig->begin() + runs_[i].norm;
+    auto last = norm_to_orig->begin() + end;
+    if (runs_[i].identity) {
+      std::iota(first, last, runs_[i].orig);
+    } else {
+      std::fill(first, last, runs_[i].orig);
+    }
+  }
+}
+
 Normalizer::Normalizer(const NormalizerSpec &spec,
                        const TrainerSpec &trainer_spec)
     : spec_(&spec),
@@ -55,6 +152,13 @@ void Normalizer::Init() {
     status_ = DecodePrecompiledCharsMap(index, &trie_blob, &normalized);
 #endif
     if (!status_.ok()) return;
+    // The values are offsets of NUL-terminated strings in `normalized`.
+    if (normalized.empty() || normalized.back() != '\0' ||
+        !IsValidDoubleArray(trie_blob.data(), trie_blob.size() / 4,
+                            normalized.size())) {
+      status_ = util::InternalError("Blob for normalization rule is broken.");
+      return;
+    }
 
     // Reads the body of double array.
     trie_ = std::make_unique<Darts::DoubleArray>();
@@ -66,12 +170,157 @@ void Normalizer::Init() {
 
     normalized_ = normalized.data();
   }
+
+  InitPassthroughTable();
+  InitLookupTable();
+}
+
+size_t Normalizer::MemoryUsage() const {
+  size_t size =
+      port::VectorBytes(lookup_) + port::VectorBytes(charsmap_buffer_);
+#ifdef IS_BIG_ENDIAN
+  size += port::StringBytes(precompiled_charsmap_buffer_);
+#endif
+  return size;
+}
+
+void Normalizer::RelocateTables(bool huge_pages) {
+  if (!status_.ok() || trie_ == nullptr) return;
+#ifndef IS_BIG_ENDIAN
+  // The byte-swapped chars map is already a copy of the model.
+  const absl::string_view index = spec_->precompiled_charsmap();
+  decltype(charsmap_buffer_) buffer(
+      index.begin(), index.end(), placement::TableAllocator<char>(huge_pages));
+  absl::string_view trie_blob, normalized;
+  status_ = DecodePrecompiledCharsMap(
+      absl::string_view(buffer.data(), buffer.size()), &trie_blob,
+      &normalized);
+  if (!status_.ok()) return;
+  trie_->set_array(const_cast<char *>(trie_blob.data()),
+                   trie_blob.size() / trie_->unit_size());
+  normalized_ = normalized.data();
+  charsmap_buffer_ = std::move(buffer);
+#endif
+  lookup_ = decltype(lookup_)(lookup_.begin(), lookup_.end(),
+                              placement::TableAllocator<uint32_t>(huge_pages));
+}
+
+void Normalizer::InitPassthroughTable() {
+  printable_ascii_passthrough_ = true;
+  for (int c = 0; c < 256; ++c) {
+    const char ch = static_cast<char>(c);
+    bool passthrough = c > 0x20 && c < 0x7F;
+    if (passthrough && trie_ != nullptr) {
+      size_t node_pos = 0, key_pos = 0;
+      passthrough = trie_->traverse(&ch, node_pos, key_pos, 1) == -2;
+    }
+    if (passthrough && matcher_ != nullptr) {
+      passthrough = !matcher_->HasEntryStartingWith(ch);
+    }
+    passthrough_[c] = passthrough;
+    if (c > 0x20 && c < 0x7F && !passthrough) {
+      printable_ascii_passthrough_ = false;
+    }
+  }
+}
+
+void Normalizer::InitLookupTable() {
+  lookup_.clear();
+  if (trie_ == nullptr) return;
+
+  lookup_.resize(0x10000, kLookupTrie);
+  char buf[4];
+  for (char32 c = 0; c < lookup_.size(); ++c) {
+    if (!string_util::IsValidCodepoint(c)) continue;
+    const size_t length = string_util::EncodeUTF8(c, buf);
+    const absl::string_view key(buf, length);
+    if (matcher_ != nullptr) {
+      bool found = false;
+      matcher_->PrefixMatch(key, &found);
+      if (found || matcher_->HasEntryStartingWith(key)) continue;
+    }
+
+    // Walks the trie byte by byte, since a rule must neither end in the
+    // middle of the character nor continue after it.
+    size_t node_pos = 0, key_pos = 0;
+    int value = -2;
+    bool partial = false;
+    for (size_t i = 1; i <= length; ++i) {
+      value = trie_->traverse(buf, node_pos, key_pos, i);
+      if (value == -2) break;
+      if (i < length && value >= 0) partial = true;
+    }
+    if (partial) continue;
+    if (value == -2) {
+      lookup_[c] = kLookupIdentity;
+      continue;
+    }
+
+    bool has_longer_rule = false;
+    for (int b = 0; b < 256 && !has_longer_rule; ++b) {
+      const char next = static_cast<char>(b);
+      size_t next_node_pos = node_pos, next_key_pos = 0;
+      has_longer_rule =
+          trie_->traverse(&next, next_node_pos, next_key_pos, 1) != -2;
+    }
+    if (!has_longer_rule && value >= 0) lookup_[c] = value;
+  }
+}
+
+size_t Normalizer::PassthroughPrefixLength(absl::string_view input) const {
+  const char *begin = input.data();
+  const char *end = begin + input.size();
+  const char *p = begin;
+  if (printable_ascii_passthrough_) {
+    // Scans 16 bytes at once for a byte outside of [0x21, 0x7E].
+#if defined(__SSE2__)
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i upper = _mm_set1_epi8(0x7F);
+    for (; p + 16 <= end; p += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      // Bytes >= 0x80 are negative in the signed comparisons.
+      const int mask = _mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpgt_epi8(v, lower), _mm_cmplt_epi8(v, upper)));
+      if (mask != 0xFFFF) {
+        return p - begin + __builtin_ctz(~mask);
+      }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t lower = vdupq_n_u8(0x20);
+    const uint8x16_t upper = vdupq_n_u8(0x7F);
+    for (; p + 16 <= end; p += 16) {
+      const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+      const uint8x16_t in_range =
+          vandq_u8(vcgtq_u8(v, lower), vcltq_u8(v, upper));
+      if (vminvq_u8(in_range) == 0) break;
+    }
+#endif
+    for (; p < end && *p > 0x20 && *p < 0x7F; ++p) {
+    }
+    return p - begin;
+  }
+
+  for (; p < end && passthrough_[static_cast<uint8_t>(*p)]; ++p) {
+  }
+  return p - begin;
 }
 
 util::Status Normalizer::Normalize(absl::string_view input,
                                    std::string *normalized,
                                    std::vector<size_t> *norm_to_orig) const {
-  norm_to_orig->clear();
+  if (norm_to_orig == nullptr) {
+    return Normalize(input, normalized, static_cast<Alignment *>(nullptr));
+  }
+  Alignment alignment;
+  RETURN_IF_ERROR(Normalize(input, normalized, &alignment));
+  alignment.ToVector(norm_to_orig);
+  return util::OkStatus();
+}
+
+util::Status Normalizer::Normalize(absl::string_view input,
+                                   std::string *normalized,
+                                   Alignment *norm_to_orig) const {
+  if (norm_to_orig != nullptr) norm_to_orig->clear();
   normalized->clear();
 
   if (input.empty()) {
@@ -102,7 +351,6 @@ util::Status Normalizer::Normalize(absl::string_view input,
   // Reserves the output buffer to avoid re-allocations.
   const size_t kReservedSize = input.size() * 3;
   normalized->reserve(kReservedSize);
-  norm_to_orig->reserve(kReservedSize);
 
   // Replaces white space with U+2581 (LOWER ONE EIGHT BLOCK)
   // if escape_whitespaces() is set (default = true).
@@ -112,12 +360,12 @@ util::Status Normalizer::Normalize(absl::string_view input,
   auto add_ws = [this, &consumed, &normalized, &norm_to_orig, &kSpaceSymbol]() {
     if (spec_->escape_whitespaces()) {
       normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
-      for (size_t n = 0; n < kSpaceSymbol.size(); ++n) {
-        norm_to_orig->push_back(consumed);
+      if (norm_to_orig != nullptr) {
+        norm_to_orig->AppendConstant(consumed, kSpaceSymbol.size());
       }
     } else {
       normalized->append(" ");
-      norm_to_orig->push_back(consumed);
+      if (norm_to_orig != nullptr) norm_to_orig->AppendConstant(consumed, 1);
     }
   };
 
@@ -129,6 +377,19 @@ util::Status Normalizer::Normalize(absl::string_view input,
 
   bool is_prev_space = spec_->remove_extra_whitespaces();
   while (!input.empty()) {
+    // Copies the run of bytes without any rule as is.
+    const size_t length = PassthroughPrefixLength(input);
+    if (length > 0) {
+      normalized->append(input.data(), length);
+      if (norm_to_orig != nullptr) {
+        norm_to_orig->AppendIdentity(consumed, length);
+      }
+      consumed += length;
+      input.remove_prefix(length);
+      is_prev_space = false;
+      continue;
+    }
+
     auto p = NormalizePrefix(input);
     absl::string_view sp = p.first;
 
@@ -138,21 +399,27 @@ util::Status Normalizer::Normalize(absl::string_view input,
     }
 
     if (!sp.empty()) {
-      const char *data = sp.data();
-      for (size_t n = 0; n < sp.size(); ++n) {
-        if (spec_->escape_whitespaces() && data[n] == ' ') {
+      // Checks whether the last character of sp is whitespace.
+      is_prev_space = absl::EndsWith(sp, " ");
+      // Appends the runs between the spaces at once.
+      while (!sp.empty()) {
+        const size_t length = spec_->escape_whitespaces()
+                                  ? std::min(sp.find(' '), sp.size())
+                                  : sp.size();
+        normalized->append(sp.data(), length);
+        if (norm_to_orig != nullptr) {
+          norm_to_orig->AppendConstant(consumed, length);
+        }
+        sp.remove_prefix(length);
+        if (!sp.empty()) {
           // replace ' ' with kSpaceSymbol.
           normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
-          for (size_t m = 0; m < kSpaceSymbol.size(); ++m) {
-            norm_to_orig->push_back(consumed);
+          if (norm_to_orig != nullptr) {
+            norm_to_orig->AppendConstant(consumed, kSpaceSymbol.size());
           }
-        } else {
-          *normalized += data[n];
-          norm_to_orig->push_back(consumed);
+          sp.remove_prefix(1);
         }
       }
-      // Checks whether the last character of sp is whitespace.
-      is_prev_space = absl::EndsWith(sp, " ");
     }
 
     consumed += p.second;
@@ -169,26 +436,72 @@ util::Status Normalizer::Normalize(absl::string_view input,
     while (absl::EndsWith(*normalized, space)) {
       const int length = normalized->size() - space.size();
       CHECK_GE_OR_RETURN(length, 0);
-      consumed = (*norm_to_orig)[length];
       normalized->resize(length);
-      norm_to_orig->resize(length);
+      if (norm_to_orig != nullptr) {
+        consumed = (*norm_to_orig)[length];
+        norm_to_orig->Truncate(length);
+      }
     }
   }
 
   // Adds a space symbol as a suffix (default is false)
   if (treat_whitespace_as_suffix_ && spec_->add_dummy_prefix()) add_ws();
 
-  norm_to_orig->push_back(consumed);
-
-  CHECK_EQ_OR_RETURN(norm_to_orig->size(), normalized->size() + 1);
+  if (norm_to_orig != nullptr) {
+    norm_to_orig->AppendConstant(consumed, 1);
+    CHECK_EQ_OR_RETURN(norm_to_orig->size(), normalized->size() + 1);
+  }
 
   return util::OkStatus();
 }
 
+bool Normalizer::NeedsMoreInput(absl::string_view input) const {
+  if (input.empty()) return true;
+  if (matcher_ != nullptr && matcher_->HasEntryStartingWith(input)) {
+    return true;
+  }
+  if (trie_ != nullptr) {
+    size_t node_pos = 0, key_pos = 0;
+    if (trie_->traverse(input.data(), node_pos, key_pos, input.size()) != -2)
+      return true;
+  }
+  return static_cast<size_t>(string_util::OneCharLen(input.data())) >
+         input.size();
+}
+
+bool Normalizer::CanSplitAfter(absl::string_view text) const {
+  if (!status_.ok() || spec_->add_dummy_prefix() ||
+      spec_->remove_extra_whitespaces() || spec_->escape_whitespaces()) {
+    return false;
+  }
+  for (size_t begin = 0; begin < text.size();
+       begin += string_util::OneCharLen(text.data() + begin)) {
+    const absl::string_view suffix = text.substr(begin);
+    if (matcher_ != nullptr && matcher_->HasEntryStartingWith(suffix)) {
+      return false;
+    }
+    if (trie_ == nullptr) continue;
+    size_t node_pos = 0, key_pos = 0;
+    const int result =
+        trie_->traverse(suffix.data(), node_pos, key_pos, suffix.size());
+    if (result == -2) continue;
+    if (result == -1) return false;  // A longer rule starts with `suffix`.
+    // `suffix` is a rule. Checks that no longer one starts with it.
+    for (int c = 1; c < 256; ++c) {
+      const char key = static_cast<char>(c);
+      size_t child_pos = node_pos, child_key_pos = 0;
+      if (trie_->traverse(&key, child_pos, child_key_pos, 1) != -2) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 std::string Normalizer::Normalize(absl::string_view input) const {
-  std::vector<size_t> norm_to_orig;
   std::string normalized;
-  Normalize(input, &normalized, &norm_to_orig).IgnoreError();
+  Normalize(input, &normalized, static_cast<Alignment *>(nullptr))
+      .IgnoreError();
   return normalized;
 }
 
@@ -198,6 +511,19 @@ std::pair<absl::string_view, int> Normalizer::NormalizePrefix(
 
   if (input.empty()) return result;
 
+  if (!lookup_.empty()) {
+    size_t mblen = 0;
+    const char32 c = string_util::DecodeUTF8(input, &mblen);
+    if (c < lookup_.size() && (c != kUnicodeError || mblen == 3)) {
+      const uint32_t value = lookup_[c];
+      if (value == kLookupIdentity) {
+        return std::make_pair(input.substr(0, mblen), mblen);
+      } else if (value != kLookupTrie) {
+        return std::make_pair(absl::string_view(&normalized_[value]), mblen);
+      }
+    }
+  }
+
   if (matcher_ != nullptr) {
     bool found = false;
     const int mblen = matcher_->PrefixMatch(input, &found);
@@ -318,15 +644,14 @@ PrefixMatcher::PrefixMatcher(const std::set<absl::string_view> &dic) {
                    nullptr) != 0) {
     LOG(ERROR) << "Failed to build the TRIE for PrefixMatcher";
     trie_.reset();
+    return;
   }
-}
-
-int PrefixMatcher::PrefixMatch(absl::string_view w, bool *found) const {
-  if (trie_ == nullptr) {
-    if (found) *found = false;
-    return std::min<int>(w.size(), string_util::OneCharLen(w.data()));
+  for (const auto &it : dic) {
+    if (!it.empty()) first_bytes_[static_cast<unsigned char>(it[0])] = true;
   }
+}
 
+int PrefixMatcher::TriePrefixMatch(absl::string_view w, bool *found) const {
   constexpr int kResultSize = 64;
   Darts::DoubleArray::result_pair_type trie_results[kResultSize];
   const int num_nodes =
@@ -345,21 +670,246 @@ int PrefixMatcher::PrefixMatch(absl::string_view w, bool *found) const {
   return mblen;
 }
 
-std::string PrefixMatcher::GlobalReplace(absl::string_view w,
-                                         absl::string_view out) const {
-  std::string result;
-  while (!w.empty()) {
+bool PrefixMatcher::HasEntryStartingWith(char c) const {
+  return first_bytes_[static_cast<unsigned char>(c)];
+}
+
+bool PrefixMatcher::HasEntryStartingWith(absl::string_view prefix) const {
+  if (trie_ == nullptr || prefix.empty()) return false;
+  size_t node_pos = 0, key_pos = 0;
+  return trie_->traverse(prefix.data(), node_pos, key_pos, prefix.size()) !=
+         -2;
+}
+
+size_t PrefixMatcher::Find(absl::string_view w, int *length) const {
+  if (trie_ == nullptr) return absl::string_view::npos;
+  size_t pos = 0;
+  while (pos < w.size()) {
     bool found = false;
-    const int mblen = PrefixMatch(w, &found);
+    const int mblen = PrefixMatch(w.substr(pos), &found);
     if (found) {
-      result.append(out.data(), out.size());
-    } else {
-      result.append(w.data(), mblen);
+      *length = mblen;
+      return pos;
     }
-    w.remove_prefix(mblen);
+    pos += mblen;
   }
+  return absl::string_view::npos;
+}
+
+void PrefixMatcher::AppendReplaced(absl::string_view w, absl::string_view out,
+                                   std::string *result) const {
+  // Copies the text between the entries in bulk.
+  int length = 0;
+  size_t pos = 0;
+  while ((pos = Find(w, &length)) != absl::string_view::npos) {
+    result->append(w.data(), pos);
+    result->append(out.data(), out.size());
+    w.remove_prefix(pos + length);
+  }
+  result->append(w.data(), w.size());
+}
+
+std::string PrefixMatcher::GlobalReplace(absl::string_view w,
+                                         absl::string_view out) const {
+  std::string result;
+  result.reserve(w.size());
+  AppendReplaced(w, out, &result);
   return result;
 }
 
+void PrefixMatcher::GlobalReplace(std::string *w, absl::string_view out) const {
+  int length = 0;
+  const size_t pos = Find(*w, &length);
+  if (pos == absl::string_view::npos) return;
+  std::string result;
+  result.reserve(w->size());
+  result.append(w->data(), pos);
+  result.append(out.data(), out.size());
+  AppendReplaced(absl::string_view(*w).substr(pos + length), out, &result);
+  w->swap(result);
+}
+
+StreamNormalizer::StreamNormalizer(const Normalizer &normalizer)
+    : normalizer_(normalizer) {
+  Reset();
+}
+
+void StreamNormalizer::Reset() {
+  buffer_.clear();
+  consumed_ = 0;
+  started_ = false;
+  is_prev_space_ = normalizer_.spec_->remove_extra_whitespaces();
+  pending_.clear();
+  pending_to_orig_.clear();
+}
+
+util::Status StreamNormalizer::Feed(absl::string_view chunk,
+                                    std::string *normalized,
+                                    std::vector<size_t> *norm_to_orig) {
+  CHECK_OR_RETURN(normalized);
+  RETURN_IF_ERROR(normalizer_.status());
+  if (consumed_ == 0 && buffer_.empty()) align_ = norm_to_orig != nullptr;
+  CHECK_EQ_OR_RETURN(align_, norm_to_orig != nullptr)
+      << "norm_to_orig must be null in all or none of the calls.";
+  buffer_.append(chunk.data(), chunk.size());
+  return Process(false, normalized, norm_to_orig);
+}
+
+util::Status StreamNormalizer::Finish(std::string *normalized,
+                                      std::vector<size_t> *norm_to_orig) {
+  CHECK_OR_RETURN(normalized);
+  RETURN_IF_ERROR(normalizer_.status());
+  if (consumed_ == 0 && buffer_.empty()) align_ = norm_to_orig != nullptr;
+  CHECK_EQ_OR_RETURN(align_, norm_to_orig != nullptr)
+      << "norm_to_orig must be null in all or none of the calls.";
+  RETURN_IF_ERROR(Process(true, normalized, norm_to_orig));
+
+  // All chars are whitespace.
+  if (!started_) {
+    Reset();
+    return util::OkStatus();
+  }
+
+  const auto *spec = normalizer_.spec_;
+  size_t consumed = consumed_;
+  if (spec->remove_extra_whitespaces() && !pending_.empty()) {
+    // Ignores trailing space.
+    if (align_) consumed = pending_to_orig_.front();
+  } else {
+    normalized->append(pending_);
+    if (align_) {
+      norm_to_orig->insert(norm_to_orig->end(), pending_to_orig_.begin(),
+                           pending_to_orig_.end());
+    }
+  }
+  pending_.clear();
+  pending_to_orig_.clear();
+
+  // Adds a space symbol as a suffix (default is false)
+  if (normalizer_.treat_whitespace_as_suffix_ && spec->add_dummy_prefix()) {
+    Append(" ", consumed);
+    normalized->append(pending_);
+    if (align_) {
+      norm_to_orig->insert(norm_to_orig->end(), pending_to_orig_.begin(),
+                           pending_to_orig_.end());
+    }
+  }
+
+  if (align_) norm_to_orig->push_back(consumed);
+  Reset();
+
+  return util::OkStatus();
+}
+
+void StreamNormalizer::Append(absl::string_view sp, size_t orig) {
+  const absl::string_view kSpaceSymbol = "\xe2\x96\x81";
+  while (!sp.empty()) {
+    const size_t length = normalizer_.spec_->escape_whitespaces()
+                              ? std::min(sp.find(' '), sp.size())
+                              : sp.size();
+    pending_.append(sp.data(), length);
+    if (align_) pending_to_orig_.insert(pending_to_orig_.end(), length, orig);
+    sp.remove_prefix(length);
+    if (!sp.empty()) {
+      pending_.append(kSpaceSymbol.data(), kSpaceSymbol.size());
+      if (align_) {
+        pending_to_orig_.insert(pending_to_orig_.end(), kSpaceSymbol.size(),
+                                orig);
+      }
+      sp.remove_prefix(1);
+    }
+  }
+}
+
+void StreamNormalizer::Flush(std::string *normalized,
+                             std::vector<size_t> *norm_to_orig) {
+  size_t length = pending_.size();
+  if (normalizer_.spec_->remove_extra_whitespaces()) {
+    const absl::string_view space =
+        normalizer_.spec_->escape_whitespaces() ? "\xe2\x96\x81" : " ";
+    while (length >= space.size() &&
+           absl::string_view(pending_).substr(length - space.size(),
+                                              space.size()) == space) {
+      length -= space.size();
+    }
+  }
+  normalized->append(pending_.data(), length);
+  pending_.erase(0, length);
+  if (align_) {
+    norm_to_orig->insert(norm_to_orig->end(), pending_to_orig_.begin(),
+                         pending_to_orig_.begin() + length);
+    pending_to_orig_.erase(pending_to_orig_.begin(),
+                           pending_to_orig_.begin() + length);
+  }
+}
+
+util::Status StreamNormalizer::Process(bool finish, std::string *normalized,
+                                       std::vector<size_t> *norm_to_orig) {
+  const auto *spec = normalizer_.spec_;
+  absl::string_view input = buffer_;
+
+  while (!input.empty()) {
+    // Copies the run of bytes without any rule as is.
+    if (started_) {
+      const size_t length = normalizer_.PassthroughPrefixLength(input);
+      if (length > 0) {
+        pending_.append(input.data(), length);
+        if (align_) {
+          const size_t size = pending_to_orig_.size();
+          pending_to_orig_.resize(size + length);
+          std::iota(pending_to_orig_.begin() + size, pending_to_orig_.end(),
+                    consumed_);
+        }
+        consumed_ += length;
+        input.remove_prefix(length);
+        is_prev_space_ = false;
+        continue;
+      }
+    }
+
+    if (!finish && normalizer_.NeedsMoreInput(input)) break;
+
+    const auto p = normalizer_.NormalizePrefix(input);
+    absl::string_view sp = p.first;
+
+    if (!started_) {
+      // Ignores heading space.
+      if (spec->remove_extra_whitespaces() && sp == " ") {
+        consumed_ += p.second;
+        input.remove_prefix(p.second);
+        continue;
+      }
+      started_ = true;
+      // Adds a space symbol as a prefix (default is true)
+      if (!normalizer_.treat_whitespace_as_suffix_ &&
+          spec->add_dummy_prefix()) {
+        Append(" ", consumed_);
+      }
+    }
+
+    // Removes heading spaces in sentence piece,
+    // if the previous sentence piece ends with whitespace.
+    while (is_prev_space_ && absl::ConsumePrefix(&sp, " ")) {
+    }
+
+    if (!sp.empty()) {
+      Append(sp, consumed_);
+      // Checks whether the last character of sp is whitespace.
+      is_prev_space_ = absl::EndsWith(sp, " ");
+    }
+
+    consumed_ += p.second;
+    input.remove_prefix(p.second);
+    if (!spec->remove_extra_whitespaces()) {
+      is_prev_space_ = false;
+    }
+  }
+
+  buffer_.erase(0, buffer_.size() - input.size());
+  Flush(normalized, norm_to_orig);
+
+  return util::OkStatus();
+}
+
 }  // namespace normalizer
 }  // namespace sentencepiece
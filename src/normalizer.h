@@ -15,6 +15,8 @@
 #ifndef NORMALIZER_NORMALIZER_H_
 #define NORMALIZER_NORMALIZER_H_
 
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <set>
 #include <string>
@@ -22,10 +24,12 @@
 #include <vector>
 
 #include "common.h"
+#include "memory_placement.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_processor.h"
 #include "third_party/absl/strings/string_view.h"
 #include "third_party/darts_clone/darts.h"
+#include "util.h"
 
 namespace sentencepiece {
 namespace normalizer {
@@ -41,13 +45,104 @@ class PrefixMatcher {
   // Returns the UTF8 byte length of matched string.
   // `found` is set if a prefix match exists.
   // If no entry is found, consumes one Unicode character.
-  int PrefixMatch(absl::string_view w, bool *found = nullptr) const;
+  int PrefixMatch(absl::string_view w, bool *found = nullptr) const {
+    // Most characters start no entry, e.g. all of them when `dic` is empty,
+    // which is decided by the first byte without probing the trie.
+    if (w.empty() || !first_bytes_[static_cast<unsigned char>(w[0])]) {
+      if (found) *found = false;
+      return std::min<int>(w.size(), string_util::OneCharLen(w.data()));
+    }
+    return TriePrefixMatch(w, found);
+  }
+
+  // Returns true if `dic` is empty.
+  bool empty() const { return trie_ == nullptr; }
+
+  // Returns the bytes of the trie.
+  size_t MemoryUsage() const { return trie_ ? trie_->total_size() : 0; }
 
   // Replaces entries in `w` with `out`.
   std::string GlobalReplace(absl::string_view w, absl::string_view out) const;
 
+  // Replaces entries in `*w` with `out` in place. `*w` is left untouched
+  // when it contains no entry, which is the common case.
+  void GlobalReplace(std::string *w, absl::string_view out) const;
+
+  // Returns true if some entry starts with the byte `c`.
+  bool HasEntryStartingWith(char c) const;
+
+  // Returns true if some entry starts with `prefix`.
+  bool HasEntryStartingWith(absl::string_view prefix) const;
+
  private:
+  // PrefixMatch() for `w` whose first byte starts some entry.
+  int TriePrefixMatch(absl::string_view w, bool *found) const;
+
+  // Returns the offset of the first entry in `w` and sets its length to
+  // `*length`, or returns absl::string_view::npos when there is none.
+  size_t Find(absl::string_view w, int *length) const;
+
+  // Appends `w` to `*result` replacing entries with `out`.
+  void AppendReplaced(absl::string_view w, absl::string_view out,
+                      std::string *result) const;
+
   std::unique_ptr<Darts::DoubleArray> trie_;
+
+  // first_bytes_[b] is true if some entry starts with the byte b.
+  std::array<bool, 256> first_bytes_{};
+};
+
+// Byte alignment from a normalized string to the input, i.e. the
+// `norm_to_orig` of Normalizer::Normalize() stored as runs. An identity run
+// maps consecutive normalized bytes to consecutive input bytes and a
+// constant run, e.g. the bytes of a replacement, maps them to one input
+// offset, so a text which is mostly copied as is takes a few runs instead
+// of one size_t per byte.
+class Alignment {
+ public:
+  // Number of the normalized offsets.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void clear();
+
+  // Appends the offsets orig, orig + 1, ..., orig + length - 1.
+  void AppendIdentity(size_t orig, size_t length);
+
+  // Appends `length` offsets of `orig`.
+  void AppendConstant(size_t orig, size_t length);
+
+  // Returns the input offset of the normalized offset `index` < size().
+  // Lookups at increasing offsets take amortized constant time. Not
+  // thread-safe, as it caches the run of the last lookup.
+  size_t operator[](size_t index) const;
+
+  // Removes the offsets from `size` on.
+  void Truncate(size_t size);
+
+  // Expands the runs into one offset per normalized byte.
+  void ToVector(std::vector<size_t> *norm_to_orig) const;
+
+  struct Run {
+    size_t norm;  // first normalized offset of the run
+    size_t orig;  // input offset of `norm`
+    bool identity;
+  };
+
+  // The runs in the order of `norm`. A run ends where the next one starts,
+  // and the last one at size().
+  const std::vector<Run> &runs() const { return runs_; }
+
+  // Number of the runs, for tests.
+  size_t num_runs() const { return runs_.size(); }
+
+ private:
+  // Returns the index of the run holding `index`.
+  size_t FindRun(size_t index) const;
+
+  std::vector<Run> runs_;
+  size_t size_ = 0;
+  mutable size_t cursor_ = 0;
 };
 
 // Normalizer implements a simple text normalizer with
@@ -69,16 +164,32 @@ class Normalizer {
   virtual ~Normalizer();
 
   virtual void SetPrefixMatcher(const PrefixMatcher *matcher) {
+    // An empty matcher never matches, so it is dropped to skip the calls.
+    if (matcher != nullptr && matcher->empty()) matcher = nullptr;
+    // The tables of the constructor are kept when no matcher is set.
+    if (matcher == matcher_) return;
     matcher_ = matcher;
+    InitPassthroughTable();
+    InitLookupTable();
   }
 
   // Returns Status.
   // Normalizes function is valid only when status is OK.
   virtual util::Status status() const { return status_; }
 
+  // Copies the chars map and the lookup table into memory allocated by the
+  // calling thread, on huge pages when `huge_pages` is true, as
+  // ModelInterface::RelocateTables() does.
+  void RelocateTables(bool huge_pages);
+
+  // Returns the estimated bytes of the copies of the chars map and the
+  // lookup table. The chars map of the spec is not counted.
+  size_t MemoryUsage() const;
+
   // Normalizes a plain utf8 string into an internal representation for
   // Sentencepiece model. |norm_to_orig| stores the byte-alignment from
-  // normalized string to the original input.
+  // normalized string to the original input. |norm_to_orig| can be nullptr
+  // when the alignment is not needed.
   // This function can do the following normalizations:
   // - Character normalization.
   //   (NFKC / full-width to half-width conversion etc).
@@ -89,17 +200,49 @@ class Normalizer {
                                  std::string *normalized,
                                  std::vector<size_t> *norm_to_orig) const;
 
+  // The same as above, but stores the alignment as runs. `norm_to_orig` can
+  // be nullptr.
+  util::Status Normalize(absl::string_view input, std::string *normalized,
+                         Alignment *norm_to_orig) const;
+
   // Returns a normalized string without alignments.
   // This function is used in sentencepiece training.
   virtual std::string Normalize(absl::string_view input) const;
 
+  // Returns true if Normalize() of `text` followed by any string is
+  // Normalize() of `text` followed by Normalize() of the string, i.e., the
+  // spec adds, removes and escapes no whitespace, and no rule or user
+  // defined symbol matching at a character of `text` extends past its end.
+  // `text` must be valid UTF-8. The decoder uses it to denormalize the
+  // surfaces of the pieces one by one.
+  bool CanSplitAfter(absl::string_view text) const;
+
   friend class Builder;
+  friend class StreamNormalizer;
 
  private:
   FRIEND_TEST(NormalizerTest, EncodeDecodePrecompiledCharsMapTest);
+  FRIEND_TEST(NormalizerTest, LookupTableTest);
 
   void Init();
 
+  // Initializes `passthrough_` from the rules and the prefix matcher.
+  void InitPassthroughTable();
+
+  // Initializes `lookup_` from the rules and the prefix matcher.
+  void InitLookupTable();
+
+  // Returns the length of the longest prefix of `input` which is copied to
+  // the output as is, i.e., ASCII bytes that start no normalization rule nor
+  // user defined symbol and are not whitespace. Such bytes can skip
+  // NormalizePrefix().
+  size_t PassthroughPrefixLength(absl::string_view input) const;
+
+  // Returns true if appending more bytes to `input` may change the result of
+  // NormalizePrefix(input), i.e., `input` is a prefix of a longer rule or
+  // user defined symbol, or ends in the middle of a UTF-8 character.
+  bool NeedsMoreInput(absl::string_view input) const;
+
   // Normalizes the prefix of |input| and returns the pair of
   // normalized prefix and length we must consume after
   // normalization.
@@ -142,6 +285,25 @@ class Normalizer {
   // Prefix matcher;
   const PrefixMatcher *matcher_ = nullptr;
 
+  // passthrough_[c] is true if the byte c is copied as is by
+  // NormalizePrefix(). Only ASCII bytes except for space can be set.
+  bool passthrough_[256] = {};
+
+  // True if all printable ASCII characters [0x21, 0x7E] are passthrough,
+  // which allows the vectorized scan in PassthroughPrefixLength().
+  bool printable_ascii_passthrough_ = false;
+
+  // lookup_[c] caches NormalizePrefix() for the BMP character c: the offset
+  // of its replacement in `normalized_`, kLookupIdentity when it is copied as
+  // is, or kLookupTrie when a longer rule or a user defined symbol may start
+  // with it, which needs the trie. Empty when there are no rules.
+  static constexpr uint32_t kLookupIdentity = 0xFFFFFFFF;
+  static constexpr uint32_t kLookupTrie = 0xFFFFFFFE;
+  std::vector<uint32_t, placement::TableAllocator<uint32_t>> lookup_;
+
+  // Copy of the precompiled chars map made by RelocateTables().
+  std::vector<char, placement::TableAllocator<char>> charsmap_buffer_;
+
   // Split hello world into "hello_" and "world_" instead of
   // "_hello" and "_world".
   const bool treat_whitespace_as_suffix_ = false;
@@ -154,6 +316,76 @@ class Normalizer {
   // Normalizer's status.
   util::Status status_;
 };
+
+// Incremental version of Normalizer::Normalize() for unbounded inputs given
+// in chunks. The concatenation of the outputs of Feed() and Finish() is the
+// same as the output of Normalize() for the concatenated input, including
+// the whitespace handling across chunk boundaries. Only the unconsumed tail
+// of a partial rule, and trailing spaces which may be removed, are buffered.
+//
+//  StreamNormalizer stream(normalizer);
+//  while (ReadChunk(&chunk)) {
+//    RETURN_IF_ERROR(stream.Feed(chunk, &normalized, &norm_to_orig));
+//    // Consume and clear `normalized` and `norm_to_orig`...
+//  }
+//  RETURN_IF_ERROR(stream.Finish(&normalized, &norm_to_orig));
+//
+// The values of `norm_to_orig` are byte offsets in the whole stream.
+class StreamNormalizer {
+ public:
+  // |normalizer| should not be deleted until StreamNormalizer is destroyed.
+  explicit StreamNormalizer(const Normalizer &normalizer);
+
+  // Normalizes `chunk` and appends the part of the output which is decided
+  // so far to `normalized` and `norm_to_orig`. `norm_to_orig` may be null
+  // when the alignment is not needed, but then in all the calls of the
+  // stream.
+  util::Status Feed(absl::string_view chunk, std::string *normalized,
+                    std::vector<size_t> *norm_to_orig);
+
+  // Flushes the remaining output at the end of the stream. After Finish(),
+  // `norm_to_orig` has one more trailing entry, as in Normalize(), unless
+  // the whole output is empty. The stream is reset for the next input.
+  util::Status Finish(std::string *normalized,
+                      std::vector<size_t> *norm_to_orig);
+
+  // Discards the state and starts a new stream.
+  void Reset();
+
+ private:
+  // Processes the buffered input. If `finish` is false, stops at the point
+  // where more input is needed to decide the output.
+  util::Status Process(bool finish, std::string *normalized,
+                       std::vector<size_t> *norm_to_orig);
+
+  // Appends `sp` to the output replacing spaces with the space symbol.
+  void Append(absl::string_view sp, size_t orig);
+
+  // Moves the output except for trailing spaces to `normalized`.
+  void Flush(std::string *normalized, std::vector<size_t> *norm_to_orig);
+
+  const Normalizer &normalizer_;
+
+  // Input which has not been consumed.
+  std::string buffer_;
+
+  // Offset of `buffer_` in the stream.
+  size_t consumed_ = 0;
+
+  // True after the heading spaces have been removed.
+  bool started_ = false;
+  bool is_prev_space_ = false;
+
+  // Output that has not been returned, which ends with the spaces that are
+  // removed when they turn out to be trailing spaces.
+  std::string pending_;
+  std::vector<size_t> pending_to_orig_;
+
+  // True when the stream computes norm_to_orig, which pending_to_orig_ is
+  // kept for.
+  bool align_ = true;
+};
+
 }  // namespace normalizer
 }  // namespace sentencepiece
 #endif  // NORMALIZER_NORMALIZER_H_
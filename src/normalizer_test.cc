@@ -371,6 +371,37 @@ TEST(NormalizerTest, EncodeDecodePrecompiledCharsMapTest) {
                    .ok());
 }
 
+TEST(NormalizerTest, LookupTableTest) {
+  const auto spec = MakeDefaultSpec();
+  const PrefixMatcher matcher({"\xE3\x81\x82\xE3\x81\x84", "\xC3\xA9"});
+  for (const PrefixMatcher *m : {static_cast<const PrefixMatcher *>(nullptr),
+                                 &matcher}) {
+    Normalizer normalizer(spec);
+    Normalizer no_lookup(spec);
+    normalizer.SetPrefixMatcher(m);
+    no_lookup.SetPrefixMatcher(m);
+    EXPECT_FALSE(normalizer.lookup_.empty());
+    no_lookup.lookup_.clear();
+
+    // Each BMP character alone and followed by characters which may extend
+    // a rule or a user defined symbol.
+    for (char32 c = 0; c < 0x10000; ++c) {
+      if (!string_util::IsValidCodepoint(c)) continue;
+      const std::string ch = string_util::UnicodeCharToUTF8(c);
+      for (const std::string &input :
+           {ch, ch + "a", ch + "\xEF\xBE\x9E", ch + "\xE3\x81\x84"}) {
+        EXPECT_EQ(no_lookup.NormalizePrefix(input),
+                  normalizer.NormalizePrefix(input));
+      }
+    }
+  }
+
+  // No rules, no table.
+  NormalizerSpec identity;
+  identity.set_name("identity");
+  EXPECT_TRUE(Normalizer(identity).lookup_.empty());
+}
+
 TEST(NormalizerTest, StatusTest) {
   NormalizerSpec spec;
   {
@@ -391,8 +422,212 @@ TEST(NormalizerTest, StatusTest) {
   }
 }
 
+TEST(NormalizerTest, NormalizePassthroughTest) {
+  auto spec = MakeDefaultSpec();
+  Normalizer normalizer(spec);
+
+  const std::string ascii = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJ";
+  {
+    std::string output;
+    std::vector<size_t> norm_to_orig;
+    EXPECT_TRUE(normalizer.Normalize(ascii, &output, &norm_to_orig).ok());
+    EXPECT_EQ(WS + ascii, output);
+    ASSERT_EQ(output.size() + 1, norm_to_orig.size());
+    for (size_t i = 0; i < ascii.size(); ++i) {
+      EXPECT_EQ(i, norm_to_orig[i + 3]);
+    }
+    EXPECT_EQ(ascii.size(), norm_to_orig.back());
+  }
+
+  {
+    const std::string input = ascii + "\xE2\x91\xA0 " + ascii + "\x7F" + ascii;
+    std::string output;
+    std::vector<size_t> norm_to_orig;
+    EXPECT_TRUE(normalizer.Normalize(input, &output, &norm_to_orig).ok());
+    EXPECT_EQ(WS + ascii + "1" WS + ascii + ascii, output);
+    EXPECT_EQ(ascii.size(), norm_to_orig[3 + ascii.size()]);
+    EXPECT_EQ(ascii.size() + 4, norm_to_orig[7 + ascii.size()]);
+    EXPECT_EQ(input.size() - ascii.size(), norm_to_orig[7 + 2 * ascii.size()]);
+    EXPECT_EQ(input.size(), norm_to_orig.back());
+  }
+
+  // User defined symbols are not copied by the fast path.
+  const PrefixMatcher matcher({"a\x7F"});
+  EXPECT_TRUE(matcher.HasEntryStartingWith('a'));
+  EXPECT_FALSE(matcher.HasEntryStartingWith('b'));
+  normalizer.SetPrefixMatcher(&matcher);
+  EXPECT_EQ(WS + ascii + "a\x7F" + ascii,
+            normalizer.Normalize(ascii + "a\x7F" + ascii));
+}
+
+TEST(NormalizerTest, StreamNormalizerTest) {
+  const std::vector<std::string> kInputs = {
+      "",
+      "      ",
+      "\xE3\x80\x80",
+      " ABC ",
+      "   \xEF\xBC\xA1\xEF\xBC\xA2\xEF\xBC\xA3   ",
+      " I  saw a\xE3\x80\x80 \xE3\x80\x80girl\xE3\x80\x80\xE3\x80\x80",
+      " \xEF\xBD\xB8\xEF\xBE\x9E\xEF\xBD\xB0\xEF\xBD\xB8\xEF\xBE\x9E"
+      "\xEF\xBE\x99 ",
+      "The quick brown fox jumps over the lazy dog. \xE2\x91\xA0\x7F\xFF"
+      "\xE3\x8D\xBF end  "};
+
+  auto spec = MakeDefaultSpec();
+  auto no_extra_spec = MakeDefaultSpec();
+  no_extra_spec.set_remove_extra_whitespaces(false);
+  auto no_escape_spec = MakeDefaultSpec();
+  no_escape_spec.set_escape_whitespaces(false);
+  TrainerSpec suffix_spec;
+  suffix_spec.set_treat_whitespace_as_suffix(true);
+
+  const Normalizer normalizers[] = {
+      Normalizer(spec), Normalizer(no_extra_spec), Normalizer(no_escape_spec),
+      Normalizer(spec, suffix_spec)};
+
+  for (const auto &normalizer : normalizers) {
+    StreamNormalizer stream(normalizer);
+    for (const auto &input : kInputs) {
+      std::string expected;
+      std::vector<size_t> expected_to_orig;
+      EXPECT_TRUE(
+          normalizer.Normalize(input, &expected, &expected_to_orig).ok());
+
+      for (const size_t chunk_size : {1, 2, 3, 5, 100}) {
+        std::string normalized;
+        std::vector<size_t> norm_to_orig;
+        for (size_t i = 0; i < input.size(); i += chunk_size) {
+          EXPECT_TRUE(stream
+                          .Feed(absl::string_view(input).substr(i, chunk_size),
+                                &normalized, &norm_to_orig)
+                          .ok());
+        }
+        EXPECT_TRUE(stream.Finish(&normalized, &norm_to_orig).ok());
+        EXPECT_EQ(expected, normalized);
+        EXPECT_EQ(expected_to_orig, norm_to_orig);
+      }
+
+      // Without the alignment.
+      for (const size_t chunk_size : {1, 3, 100}) {
+        std::string normalized;
+        for (size_t i = 0; i < input.size(); i += chunk_size) {
+          EXPECT_TRUE(stream
+                          .Feed(absl::string_view(input).substr(i, chunk_size),
+                                &normalized, nullptr)
+                          .ok());
+        }
+        EXPECT_TRUE(stream.Finish(&normalized, nullptr).ok());
+        EXPECT_EQ(expected, normalized);
+      }
+    }
+  }
+}
+
+TEST(NormalizerTest, AlignmentTest) {
+  Alignment alignment;
+  EXPECT_TRUE(alignment.empty());
+  alignment.AppendIdentity(0, 3);
+  alignment.AppendIdentity(3, 2);
+  alignment.AppendConstant(5, 3);
+  alignment.AppendConstant(5, 1);
+  alignment.AppendConstant(8, 1);
+  alignment.AppendIdentity(9, 2);
+  const std::vector<size_t> expected = {0, 1, 2, 3, 4, 5, 5, 5, 5, 8, 9, 10};
+  EXPECT_EQ(expected.size(), alignment.size());
+  EXPECT_EQ(3, alignment.num_runs());
+
+  // Forward, backward and random lookups.
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i], alignment[i]);
+  }
+  for (size_t i = expected.size(); i > 0; --i) {
+    EXPECT_EQ(expected[i - 1], alignment[i - 1]);
+  }
+  for (const size_t i : {7, 2, 11, 0, 9, 5}) {
+    EXPECT_EQ(expected[i], alignment[i]);
+  }
+
+  std::vector<size_t> v;
+  alignment.ToVector(&v);
+  EXPECT_EQ(expected, v);
+
+  alignment.Truncate(7);
+  alignment.ToVector(&v);
+  EXPECT_EQ(std::vector<size_t>(expected.begin(), expected.begin() + 7), v);
+  EXPECT_EQ(2, alignment.num_runs());
+  alignment.AppendIdentity(6, 1);
+  EXPECT_EQ(6, alignment[7]);
+
+  alignment.Truncate(0);
+  EXPECT_TRUE(alignment.empty());
+  EXPECT_EQ(0, alignment.num_runs());
+
+  // Normalize() with the runs gives the same alignment as with the vector.
+  auto spec = MakeDefaultSpec();
+  const Normalizer normalizer(spec);
+  for (const std::string input :
+       {"", "   ", " ABC ", "I  saw a\xE3\x80\x80 \xE3\x80\x80girl  ",
+        "\xEF\xBD\xB8\xEF\xBE\x9E\xEF\xBD\xB0 \xE2\x91\xA0\x7F\xFF end"}) {
+    std::string normalized, normalized2;
+    std::vector<size_t> norm_to_orig;
+    EXPECT_TRUE(normalizer.Normalize(input, &normalized, &alignment).ok());
+    EXPECT_TRUE(
+        normalizer.Normalize(input, &normalized2, &norm_to_orig).ok());
+    EXPECT_EQ(normalized2, normalized);
+    alignment.ToVector(&v);
+    EXPECT_EQ(norm_to_orig, v);
+  }
+
+  // A plain ASCII text takes one run per word.
+  const std::string text = "The quick brown fox jumps over the lazy dog.";
+  std::string normalized;
+  EXPECT_TRUE(normalizer.Normalize(text, &normalized, &alignment).ok());
+  EXPECT_EQ(normalized.size() + 1, alignment.size());
+  EXPECT_EQ(18, alignment.num_runs());
+}
+
+TEST(NormalizerTest, CanSplitAfterTest) {
+  Builder::CharsMap chars_map;
+  chars_map[{'a', 'b'}] = {'X'};
+  chars_map[{'c'}] = {'C'};
+  chars_map[{'d'}] = {'D'};
+  chars_map[{'d', 'e', 'f'}] = {'Y'};
+  NormalizerSpec spec;
+  ASSERT_TRUE(
+      Builder::CompileCharsMap(chars_map, spec.mutable_precompiled_charsmap())
+          .ok());
+
+  // The whitespace rules are not local to the text.
+  EXPECT_FALSE(Normalizer(spec).CanSplitAfter("xyz"));
+
+  spec.set_add_dummy_prefix(false);
+  spec.set_remove_extra_whitespaces(false);
+  spec.set_escape_whitespaces(false);
+  const Normalizer normalizer(spec);
+  EXPECT_TRUE(normalizer.CanSplitAfter(""));
+  EXPECT_TRUE(normalizer.CanSplitAfter("xyz"));
+  EXPECT_TRUE(normalizer.CanSplitAfter("abc"));
+  EXPECT_TRUE(normalizer.CanSplitAfter("xc"));
+  EXPECT_TRUE(normalizer.CanSplitAfter("\xe4\xba\xac"));
+  EXPECT_FALSE(normalizer.CanSplitAfter("xa"));
+  EXPECT_FALSE(normalizer.CanSplitAfter("d"));
+  EXPECT_FALSE(normalizer.CanSplitAfter("xde"));
+  EXPECT_TRUE(normalizer.CanSplitAfter("dx"));
+
+  // The normalization of the concatenation is the concatenation of the
+  // normalizations when the first text can be split after.
+  for (const std::string first : {"xyz", "abc", "xc", "dx", "xa", "d"}) {
+    for (const std::string second : {"b", "ef", "c", "x"}) {
+      if (!normalizer.CanSplitAfter(first)) continue;
+      EXPECT_EQ(normalizer.Normalize(first) + normalizer.Normalize(second),
+                normalizer.Normalize(first + second));
+    }
+  }
+}
+
 TEST(NormalizerTest, PrefixMatcherTest) {
   const PrefixMatcher matcher({"abc", "ab", "xy", "京都"});
+  EXPECT_FALSE(matcher.empty());
   bool found;
   EXPECT_EQ(1, matcher.PrefixMatch("test", &found));
   EXPECT_FALSE(found);
@@ -408,14 +643,30 @@ TEST(NormalizerTest, PrefixMatcherTest) {
   EXPECT_TRUE(found);
   EXPECT_EQ(3, matcher.PrefixMatch("東京大学", &found));
   EXPECT_FALSE(found);
+  EXPECT_EQ(3, matcher.PrefixMatch("京大", &found));
+  EXPECT_FALSE(found);
+  EXPECT_EQ(0, matcher.PrefixMatch("", &found));
+  EXPECT_FALSE(found);
+
+  EXPECT_TRUE(matcher.HasEntryStartingWith('a'));
+  EXPECT_TRUE(matcher.HasEntryStartingWith('\xE4'));
+  EXPECT_FALSE(matcher.HasEntryStartingWith('b'));
 
   EXPECT_EQ("", matcher.GlobalReplace("", ""));
   EXPECT_EQ("", matcher.GlobalReplace("abc", ""));
   EXPECT_EQ("--de-pqr", matcher.GlobalReplace("xyabcdeabpqr", "-"));
+
+  for (const std::string input :
+       {"", "abc", "xyabcdeabpqr", "pq京都r", "pqr"}) {
+    std::string replaced = input;
+    matcher.GlobalReplace(&replaced, "<>");
+    EXPECT_EQ(matcher.GlobalReplace(input, "<>"), replaced);
+  }
 }
 
 TEST(NormalizerTest, PrefixMatcherWithEmptyTest) {
   const PrefixMatcher matcher({});
+  EXPECT_TRUE(matcher.empty());
   bool found;
   EXPECT_EQ(1, matcher.PrefixMatch("test", &found));
   EXPECT_FALSE(found);
@@ -0,0 +1,267 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Times the normalizer and the encoders on adversarial inputs: long runs of
+// one character, long tokens without whitespace, invalid UTF-8, dense
+// user-defined symbols, characters only covered by byte fallback, and so
+// on. Each case runs on an input of --size bytes and on one 4 times
+// longer. A case fails when its time grows by more than --max_growth,
+// which catches the quadratic paths whatever the speed of the machine, or
+// when the longer input takes more than its time limit. The exit status
+// is 1 if any case fails, so that ctest runs it as the perf test.
+//
+//   % pathological_benchmark --input=data/botchan.txt --size=4096
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+ABSL_FLAG(std::string, input, "data/botchan.txt",
+          "Corpus on which the models are trained.");
+ABSL_FLAG(int32, vocab_size, 2000, "Vocabulary size of the trained models.");
+ABSL_FLAG(int32, size, 4096,
+          "Bytes of the shorter input of each case. The longer one is 4 "
+          "times longer.");
+ABSL_FLAG(double, max_growth, 8.0,
+          "Largest ratio of the times of the longer and the shorter input. "
+          "It is 4 for linear cases and 16 for quadratic ones.");
+ABSL_FLAG(double, time_limit_scale, 1.0,
+          "Scale of the time limits of the cases, e.g. for the sanitizer "
+          "builds.");
+ABSL_FLAG(double, min_seconds, 0.02,
+          "Minimum time of a measurement, over which the calls are "
+          "averaged.");
+ABSL_FLAG(std::string, cases, "",
+          "Comma separated list of the input names to run. All when empty.");
+
+namespace sentencepiece {
+namespace {
+
+constexpr char kUserDefinedSymbols[] = "<mask>,<sep>,<u1>,<u12>,<u123>";
+constexpr int kNBestSize = 8;
+constexpr float kAlpha = 0.1;
+
+// Returns a string of `size` bytes or a bit more, made of `unit` repeated.
+std::string Repeat(absl::string_view unit, int size) {
+  std::string text;
+  while (text.size() < size) text.append(unit.data(), unit.size());
+  return text;
+}
+
+// Returns `size` bytes of `next()` appended.
+std::string Generate(int size, const std::function<std::string()> &next) {
+  std::string text;
+  while (text.size() < size) text += next();
+  return text;
+}
+
+// Adversarial inputs of about `size` bytes.
+struct Input {
+  const char *name;
+  std::function<std::string(int size)> make;
+};
+
+std::vector<Input> MakeInputs() {
+  return {
+      {"repeated_char", [](int size) { return Repeat("a", size); }},
+      {"repeated_multibyte",
+       [](int size) { return Repeat("\xe3\x81\x82", size); }},  // あ
+      {"long_token",
+       [](int size) {
+         std::mt19937 mt(1);
+         return Generate(size, [&mt]() {
+           return std::string(1, static_cast<char>('a' + mt() % 26));
+         });
+       }},
+      {"invalid_utf8",
+       [](int size) {
+         std::mt19937 mt(2);
+         return Generate(size, [&mt]() {
+           return std::string(1, static_cast<char>(0x80 + mt() % 0x80));
+         });
+       }},
+      {"whitespace_runs",
+       [](int size) {
+         return Repeat(absl::StrCat("a", std::string(63, ' '), "\t\t \n"),
+                       size);
+       }},
+      {"user_defined_symbols",
+       [](int size) { return Repeat("<u1><u12><u123><mask><u12", size); }},
+      {"byte_fallback",
+       [](int size) {
+         // Characters of the CJK extension B, which are not in the
+         // vocabulary and are encoded into 4 byte pieces each.
+         std::mt19937 mt(3);
+         return Generate(size, [&mt]() {
+           return string_util::UnicodeCharToUTF8(0x20000 + mt() % 0x1000);
+         });
+       }},
+      {"combining_marks",
+       [](int size) { return Repeat("a\xcc\x81\xcc\x88\xcc\xa3", size); }},
+      {"digits", [](int size) { return Repeat("0123456789", size); }},
+  };
+}
+
+// An operation of the processors on an input.
+struct Operation {
+  const char *name;
+  // Limit of the time of one call on the longer input, in seconds.
+  double time_limit;
+  std::function<void(const std::string &)> run;
+};
+
+std::vector<Operation> MakeOperations(const SentencePieceProcessor &unigram,
+                                      const SentencePieceProcessor &bpe) {
+  return {
+      {"Normalize", 0.1,
+       [&](const std::string &text) { unigram.Normalize(text); }},
+      {"unigram Encode", 0.1,
+       [&](const std::string &text) {
+         std::vector<int> ids;
+         CHECK_OK(unigram.Encode(text, &ids));
+       }},
+      {"unigram NBestEncode", 1.0,
+       [&](const std::string &text) {
+         std::vector<std::vector<int>> nbest;
+         CHECK_OK(unigram.NBestEncode(text, kNBestSize, &nbest));
+       }},
+      {"unigram SampleEncode", 0.25,
+       [&](const std::string &text) {
+         std::vector<int> ids;
+         CHECK_OK(unigram.SampleEncode(text, -1, kAlpha, &ids));
+       }},
+      {"unigram SampleEncode nbest", 1.0,
+       [&](const std::string &text) {
+         std::vector<int> ids;
+         CHECK_OK(unigram.SampleEncode(text, kNBestSize, kAlpha, &ids));
+       }},
+      {"bpe Encode", 0.1,
+       [&](const std::string &text) {
+         std::vector<int> ids;
+         CHECK_OK(bpe.Encode(text, &ids));
+       }},
+      {"bpe SampleEncode", 0.25,
+       [&](const std::string &text) {
+         std::vector<int> ids;
+         CHECK_OK(bpe.SampleEncode(text, -1, kAlpha, &ids));
+       }},
+  };
+}
+
+// Returns the seconds of one call of `run` on `text`: the calls are
+// repeated for --min_seconds at least, and the best of 3 rounds is taken.
+double Measure(const Operation &operation, const std::string &text) {
+  const double min_seconds = absl::GetFlag(FLAGS_min_seconds);
+  double best = 0.0;
+  for (int round = 0; round < 3; ++round) {
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    int calls = 0;
+    do {
+      operation.run(text);
+      ++calls;
+      elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < min_seconds);
+    const double seconds = elapsed.count() / calls;
+    if (round == 0 || seconds < best) best = seconds;
+    // A call over the time limit is not repeated.
+    if (seconds > operation.time_limit) break;
+  }
+  return best;
+}
+
+// Trains a model of `model_type` on --input and loads it into `sp`.
+void TrainModel(const std::vector<std::string> &lines,
+                absl::string_view model_type, SentencePieceProcessor *sp) {
+  std::string serialized;
+  CHECK_OK(SentencePieceTrainer::Train(
+      absl::StrCat("--model_type=", model_type, " --vocab_size=",
+                   absl::StrCat(absl::GetFlag(FLAGS_vocab_size)),
+                   " --hard_vocab_limit=false --byte_fallback=true",
+                   " --user_defined_symbols=", kUserDefinedSymbols),
+      lines, &serialized));
+  CHECK_OK(sp->LoadFromSerializedProto(serialized));
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  std::vector<std::string> lines;
+  {
+    auto input =
+        sentencepiece::filesystem::NewReadableFile(absl::GetFlag(FLAGS_input));
+    CHECK_OK(input->status());
+    std::string line;
+    while (input->ReadLine(&line)) lines.push_back(line);
+  }
+  sentencepiece::SentencePieceProcessor unigram, bpe;
+  sentencepiece::TrainModel(lines, "unigram", &unigram);
+  sentencepiece::TrainModel(lines, "bpe", &bpe);
+
+  const std::vector<std::string> cases =
+      sentencepiece::util::StrSplitAsCSV(absl::GetFlag(FLAGS_cases));
+  const int size = absl::GetFlag(FLAGS_size);
+  const double max_growth = absl::GetFlag(FLAGS_max_growth);
+  const double scale = absl::GetFlag(FLAGS_time_limit_scale);
+  const auto operations = sentencepiece::MakeOperations(unigram, bpe);
+
+  printf("%-22s %-28s %10s %10s %7s\n", "input", "operation", "short_ms",
+         "long_ms", "growth");
+  int num_failures = 0;
+  for (const auto &input : sentencepiece::MakeInputs()) {
+    if (!cases.empty() &&
+        std::find(cases.begin(), cases.end(), input.name) == cases.end()) {
+      continue;
+    }
+    const std::string short_text = input.make(size);
+    const std::string long_text = input.make(4 * size);
+    for (const auto &operation : operations) {
+      const double short_seconds =
+          sentencepiece::Measure(operation, short_text);
+      const double long_seconds = sentencepiece::Measure(operation, long_text);
+      const double growth = long_seconds / std::max(short_seconds, 1e-9);
+      const bool too_slow = long_seconds > operation.time_limit * scale;
+      const bool failed = growth > max_growth || too_slow;
+      printf("%-22s %-28s %10.3f %10.3f %7.2f%s\n", input.name,
+             operation.name, short_seconds * 1e3, long_seconds * 1e3, growth,
+             failed ? (too_slow ? "  FAILED (time limit)" : "  FAILED (growth)")
+                    : "");
+      fflush(stdout);
+      if (failed) ++num_failures;
+    }
+  }
+
+  if (num_failures > 0) {
+    printf("%d cases failed.\n", num_failures);
+    return 1;
+  }
+  return 0;
+}
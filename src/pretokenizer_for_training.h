@@ -17,6 +17,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include "sentencepiece.pb.h"
@@ -46,12 +47,25 @@ class PretokenizerForTrainingInterface {
   // output: I love sentence<tab>piece.
   std::vector<std::string> PreTokenize(absl::string_view text) const;
 
+  // Pre-tokenizes a batch of texts with one call of TokenizeBatch().
+  std::vector<std::vector<std::string>> PreTokenize(
+      const std::vector<absl::string_view> &texts) const;
+
   // Returns pre-tokenized result.
   // Note that the pre-tokenized constraint is specified with the
   // byte offsets (SentencePiece::begin, SentencePiece::end) over
   // the input text.
+  // The trainers call Tokenize() and TokenizeBatch() from several threads
+  // at the same time, so they must be thread-safe.
   virtual SentencePieceText Tokenize(absl::string_view text) const = 0;
 
+  // Returns the pre-tokenized results of `texts`. Calls Tokenize() for each
+  // text by default. Pre-tokenizers with a large overhead per call, e.g.
+  // external morphological analyzers, can override it to process the batch
+  // at once.
+  virtual std::vector<SentencePieceText> TokenizeBatch(
+      const std::vector<absl::string_view> &texts) const;
+
  private:
   static std::string Preprocess(absl::string_view text);
   static std::vector<std::string> Postprocess(const SentencePieceText &spt);
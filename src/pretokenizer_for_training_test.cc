@@ -105,5 +105,52 @@ TEST(PretokenizerForTrainingTest, BaseTest) {
   }
 }
 
+// Segments the text into characters and counts the batches.
+class CharPretokenizer : public PretokenizerForTrainingInterface {
+ public:
+  SentencePieceText Tokenize(absl::string_view text) const override {
+    SentencePieceText spt;
+    spt.set_text(std::string(text));
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (text[i] == ' ') continue;
+      auto *piece = spt.add_pieces();
+      piece->set_surface(std::string(text.substr(i, 1)));
+      piece->set_begin(i);
+      piece->set_end(i + 1);
+    }
+    return spt;
+  }
+
+  std::vector<SentencePieceText> TokenizeBatch(
+      const std::vector<absl::string_view> &texts) const override {
+    ++num_batches_;
+    return PretokenizerForTrainingInterface::TokenizeBatch(texts);
+  }
+
+  util::Status status() const override { return util::OkStatus(); }
+
+  int num_batches() const { return num_batches_; }
+
+ private:
+  mutable int num_batches_ = 0;
+};
+
+TEST(PretokenizerForTrainingTest, BatchTest) {
+  CharPretokenizer pretokenizer;
+  const std::vector<absl::string_view> texts = {
+      "ab", absl::StrCat("a", TrainerInterface::kWSStr, "bc"), ""};
+  const auto result = pretokenizer.PreTokenize(texts);
+  EXPECT_EQ(1, pretokenizer.num_batches());
+  ASSERT_EQ(texts.size(), result.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    EXPECT_EQ(pretokenizer.PreTokenize(texts[i]), result[i]);
+  }
+  EXPECT_EQ(std::vector<std::string>({"a", "b"}), result[0]);
+  EXPECT_EQ(std::vector<std::string>(
+                {absl::StrCat("a", TrainerInterface::kWSStr, "b"), "c"}),
+            result[1]);
+  EXPECT_TRUE(result[2].empty());
+}
+
 }  // namespace pretokenizer
 }  // namespace sentencepiece
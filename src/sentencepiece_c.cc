@@ -0,0 +1,254 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentencepiece_c.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "sentencepiece_processor.h"
+#include "util.h"
+
+struct spm_processor {
+  sentencepiece::SentencePieceProcessor sp;
+};
+
+namespace sentencepiece {
+namespace {
+
+static_assert(sizeof(int) == sizeof(int32_t), "ids are int32_t.");
+
+// Message of the last error of the thread, returned by spm_last_error().
+thread_local std::string last_error;
+
+// Per-thread buffers reused across the calls, so that the steady-state
+// spm_encode_ids() and spm_decode_ids() do not allocate.
+thread_local EncodeContext context;
+thread_local std::vector<int> ids_buffer;
+thread_local std::vector<size_t> offsets_buffer;
+thread_local std::string text_buffer;
+
+int ToCode(const util::Status &status) {
+  if (status.ok()) {
+    last_error.clear();
+  } else {
+    last_error = status.ToString();
+  }
+  return static_cast<int>(status.code());
+}
+
+util::Status CheckProcessor(const spm_processor *processor) {
+  CHECK_OR_RETURN(processor != nullptr) << "processor is null.";
+  return processor->sp.status();
+}
+
+// Checks that `offsets` of `num_inputs` + 1 elements are increasing.
+util::Status CheckOffsets(const size_t *offsets, size_t num_inputs) {
+  CHECK_OR_RETURN(offsets != nullptr) << "offsets is null.";
+  for (size_t i = 0; i < num_inputs; ++i) {
+    CHECK_LE_OR_RETURN(offsets[i], offsets[i + 1])
+        << "offsets are not increasing.";
+  }
+  return util::OkStatus();
+}
+
+util::Status Load(std::unique_ptr<spm_processor> processor,
+                  const util::Status &status, spm_processor **output) {
+  CHECK_OR_RETURN(output != nullptr) << "output is null.";
+  RETURN_IF_ERROR(status);
+  *output = processor.release();
+  return util::OkStatus();
+}
+
+util::Status EncodeIds(const spm_processor *processor, const char *input,
+                       size_t size, int32_t *ids, size_t capacity,
+                       size_t *num_ids) {
+  RETURN_IF_ERROR(CheckProcessor(processor));
+  CHECK_OR_RETURN(input != nullptr || size == 0) << "input is null.";
+  CHECK_OR_RETURN(num_ids != nullptr) << "num_ids is null.";
+  RETURN_IF_ERROR(
+      processor->sp.Encode(absl::string_view(input, size), &ids_buffer,
+                           &context));
+  *num_ids = ids_buffer.size();
+  if (ids_buffer.size() > capacity) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted,
+                               GTL_LOC)
+           << "ids need the capacity of " << ids_buffer.size() << ".";
+  }
+  std::copy(ids_buffer.begin(), ids_buffer.end(), ids);
+  return util::OkStatus();
+}
+
+util::Status EncodeIdsBatch(const spm_processor *processor, const char *data,
+                            const size_t *offsets, size_t num_inputs,
+                            int32_t *ids, size_t capacity,
+                            size_t *ids_offsets) {
+  RETURN_IF_ERROR(CheckProcessor(processor));
+  RETURN_IF_ERROR(CheckOffsets(offsets, num_inputs));
+  CHECK_OR_RETURN(data != nullptr || offsets[num_inputs] == 0)
+      << "data is null.";
+  CHECK_OR_RETURN(ids_offsets != nullptr) << "ids_offsets is null.";
+  std::vector<absl::string_view> inputs(num_inputs);
+  for (size_t i = 0; i < num_inputs; ++i) {
+    inputs[i] =
+        absl::string_view(data + offsets[i], offsets[i + 1] - offsets[i]);
+  }
+  std::vector<std::vector<int>> idss;
+  RETURN_IF_ERROR(processor->sp.EncodeBatch(inputs, &idss));
+  ids_offsets[0] = 0;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    ids_offsets[i + 1] = ids_offsets[i] + idss[i].size();
+  }
+  if (ids_offsets[num_inputs] > capacity) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted,
+                               GTL_LOC)
+           << "ids need the capacity of " << ids_offsets[num_inputs] << ".";
+  }
+  for (size_t i = 0; i < num_inputs; ++i) {
+    std::copy(idss[i].begin(), idss[i].end(), ids + ids_offsets[i]);
+  }
+  return util::OkStatus();
+}
+
+util::Status DecodeIds(const spm_processor *processor, const int32_t *ids,
+                       size_t num_ids, char *text, size_t capacity,
+                       size_t *size) {
+  RETURN_IF_ERROR(CheckProcessor(processor));
+  CHECK_OR_RETURN(ids != nullptr || num_ids == 0) << "ids is null.";
+  CHECK_OR_RETURN(size != nullptr) << "size is null.";
+  ids_buffer.assign(ids, ids + num_ids);
+  RETURN_IF_ERROR(processor->sp.Decode(ids_buffer, &text_buffer, &context));
+  *size = text_buffer.size();
+  if (text_buffer.size() > capacity) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted,
+                               GTL_LOC)
+           << "text needs the capacity of " << text_buffer.size() << ".";
+  }
+  std::copy(text_buffer.begin(), text_buffer.end(), text);
+  return util::OkStatus();
+}
+
+util::Status DecodeIdsBatch(const spm_processor *processor,
+                            const int32_t *ids, const size_t *offsets,
+                            size_t num_inputs, char *text, size_t capacity,
+                            size_t *text_offsets) {
+  RETURN_IF_ERROR(CheckProcessor(processor));
+  RETURN_IF_ERROR(CheckOffsets(offsets, num_inputs));
+  CHECK_OR_RETURN(ids != nullptr || offsets[num_inputs] == 0)
+      << "ids is null.";
+  CHECK_OR_RETURN(text_offsets != nullptr) << "text_offsets is null.";
+  // DecodeBatch() takes the sequences from the beginning of `ids`.
+  ids_buffer.assign(ids + offsets[0], ids + offsets[num_inputs]);
+  offsets_buffer.resize(num_inputs + 1);
+  for (size_t i = 0; i <= num_inputs; ++i) {
+    offsets_buffer[i] = offsets[i] - offsets[0];
+  }
+  std::vector<size_t> output_offsets;
+  RETURN_IF_ERROR(processor->sp.DecodeBatch(ids_buffer, offsets_buffer,
+                                            &text_buffer, &output_offsets));
+  std::copy(output_offsets.begin(), output_offsets.end(), text_offsets);
+  if (text_buffer.size() > capacity) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted,
+                               GTL_LOC)
+           << "text needs the capacity of " << text_buffer.size() << ".";
+  }
+  std::copy(text_buffer.begin(), text_buffer.end(), text);
+  return util::OkStatus();
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+using sentencepiece::ToCode;
+
+extern "C" {
+
+const char *spm_last_error(void) {
+  return sentencepiece::last_error.c_str();
+}
+
+int spm_processor_load(const char *filename, spm_processor **processor) {
+  if (filename == nullptr) {
+    return ToCode(sentencepiece::util::InvalidArgumentError(
+        "filename is null."));
+  }
+  auto output = std::make_unique<spm_processor>();
+  const auto status = output->sp.Load(filename);
+  return ToCode(sentencepiece::Load(std::move(output), status, processor));
+}
+
+int spm_processor_load_from_serialized_proto(const char *data, size_t size,
+                                             spm_processor **processor) {
+  if (data == nullptr && size > 0) {
+    return ToCode(sentencepiece::util::InvalidArgumentError("data is null."));
+  }
+  auto output = std::make_unique<spm_processor>();
+  const auto status =
+      output->sp.LoadFromSerializedProto(absl::string_view(data, size));
+  return ToCode(sentencepiece::Load(std::move(output), status, processor));
+}
+
+void spm_processor_free(spm_processor *processor) { delete processor; }
+
+int spm_processor_set_num_threads(spm_processor *processor, int num_threads) {
+  if (processor == nullptr) {
+    return ToCode(sentencepiece::CheckProcessor(processor));
+  }
+  return ToCode(processor->sp.SetNumThreads(num_threads));
+}
+
+int spm_processor_set_encode_extra_options(spm_processor *processor,
+                                           const char *extra_option) {
+  if (processor == nullptr || extra_option == nullptr) {
+    return ToCode(sentencepiece::util::InvalidArgumentError(
+        "processor or extra_option is null."));
+  }
+  return ToCode(processor->sp.SetEncodeExtraOptions(extra_option));
+}
+
+int spm_piece_size(const spm_processor *processor) {
+  return processor == nullptr ? 0 : processor->sp.GetPieceSize();
+}
+
+int spm_encode_ids(const spm_processor *processor, const char *input,
+                   size_t size, int32_t *ids, size_t capacity,
+                   size_t *num_ids) {
+  return ToCode(sentencepiece::EncodeIds(processor, input, size, ids,
+                                         capacity, num_ids));
+}
+
+int spm_encode_ids_batch(const spm_processor *processor, const char *data,
+                         const size_t *offsets, size_t num_inputs,
+                         int32_t *ids, size_t capacity, size_t *ids_offsets) {
+  return ToCode(sentencepiece::EncodeIdsBatch(
+      processor, data, offsets, num_inputs, ids, capacity, ids_offsets));
+}
+
+int spm_decode_ids(const spm_processor *processor, const int32_t *ids,
+                   size_t num_ids, char *text, size_t capacity, size_t *size) {
+  return ToCode(sentencepiece::DecodeIds(processor, ids, num_ids, text,
+                                         capacity, size));
+}
+
+int spm_decode_ids_batch(const spm_processor *processor, const int32_t *ids,
+                         const size_t *offsets, size_t num_inputs, char *text,
+                         size_t capacity, size_t *text_offsets) {
+  return ToCode(sentencepiece::DecodeIdsBatch(
+      processor, ids, offsets, num_inputs, text, capacity, text_offsets));
+}
+
+}  // extern "C"
@@ -0,0 +1,129 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SENTENCEPIECE_C_H_
+#define SENTENCEPIECE_C_H_
+
+// C API of SentencePieceProcessor for the foreign function interfaces,
+// e.g., of Rust or Go. The outputs are written to the buffers of the
+// caller, so that no object of the library crosses the interface.
+//
+// Every function returning int returns a spm_status_code, which is
+// SPM_OK on success. The message of the last error of the calling thread
+// is returned by spm_last_error().
+//
+// spm_processor *sp = NULL;
+// if (spm_processor_load("m.model", &sp) != SPM_OK) {
+//   fprintf(stderr, "%s\n", spm_last_error());
+// }
+// int32_t ids[256];
+// size_t num_ids = 0;
+// spm_encode_ids(sp, "hello", 5, ids, 256, &num_ids);
+// spm_processor_free(sp);
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The same values as sentencepiece::util::StatusCode.
+typedef enum {
+  SPM_OK = 0,
+  SPM_CANCELLED = 1,
+  SPM_UNKNOWN = 2,
+  SPM_INVALID_ARGUMENT = 3,
+  SPM_DEADLINE_EXCEEDED = 4,
+  SPM_NOT_FOUND = 5,
+  SPM_ALREADY_EXISTS = 6,
+  SPM_PERMISSION_DENIED = 7,
+  SPM_RESOURCE_EXHAUSTED = 8,
+  SPM_FAILED_PRECONDITION = 9,
+  SPM_ABORTED = 10,
+  SPM_OUT_OF_RANGE = 11,
+  SPM_UNIMPLEMENTED = 12,
+  SPM_INTERNAL = 13,
+  SPM_UNAVAILABLE = 14,
+  SPM_DATA_LOSS = 15,
+  SPM_UNAUTHENTICATED = 16,
+} spm_status_code;
+
+// A loaded model. The encoding and decoding functions may be called
+// concurrently on the same processor.
+typedef struct spm_processor spm_processor;
+
+// Returns the message of the last error of the calling thread. The string
+// is valid until the next call of this API on the thread.
+const char *spm_last_error(void);
+
+// Loads the model file `filename` into `*processor`.
+int spm_processor_load(const char *filename, spm_processor **processor);
+
+// Loads the model from the serialized ModelProto `data` of `size` bytes.
+int spm_processor_load_from_serialized_proto(const char *data, size_t size,
+                                             spm_processor **processor);
+
+// Frees `processor`. Does nothing if it is NULL.
+void spm_processor_free(spm_processor *processor);
+
+// Sets the number of threads of the batch functions. When `num_threads` <= 0,
+// the process-wide pool is used.
+int spm_processor_set_num_threads(spm_processor *processor, int num_threads);
+
+// Sets the encode extra options, e.g., "bos:eos".
+int spm_processor_set_encode_extra_options(spm_processor *processor,
+                                           const char *extra_option);
+
+// Returns the size of the vocabulary.
+int spm_piece_size(const spm_processor *processor);
+
+// Encodes `input` of `size` bytes into `ids` of `capacity` elements. The
+// number of ids is stored in `*num_ids`. If the ids do not fit, returns
+// SPM_RESOURCE_EXHAUSTED, and `*num_ids` is the required capacity.
+int spm_encode_ids(const spm_processor *processor, const char *input,
+                   size_t size, int32_t *ids, size_t capacity,
+                   size_t *num_ids);
+
+// Encodes `num_inputs` inputs in parallel. The i-th input is
+// data[offsets[i], offsets[i + 1]), so `offsets` has `num_inputs` + 1
+// elements. The ids of the i-th input are written to
+// ids[ids_offsets[i], ids_offsets[i + 1]), where `ids_offsets` has
+// `num_inputs` + 1 elements. If the ids do not fit in `capacity`, returns
+// SPM_RESOURCE_EXHAUSTED with `ids_offsets` filled, so that
+// ids_offsets[num_inputs] is the required capacity.
+int spm_encode_ids_batch(const spm_processor *processor, const char *data,
+                         const size_t *offsets, size_t num_inputs,
+                         int32_t *ids, size_t capacity, size_t *ids_offsets);
+
+// Decodes `num_ids` ids into `text` of `capacity` bytes, which is not NUL
+// terminated. The size of the text is stored in `*size`. If the text does
+// not fit, returns SPM_RESOURCE_EXHAUSTED, and `*size` is the required
+// capacity.
+int spm_decode_ids(const spm_processor *processor, const int32_t *ids,
+                   size_t num_ids, char *text, size_t capacity, size_t *size);
+
+// Decodes `num_inputs` id sequences in parallel. The i-th sequence is
+// ids[offsets[i], offsets[i + 1]). The i-th text is written to
+// text[text_offsets[i], text_offsets[i + 1]). If the texts do not fit,
+// returns SPM_RESOURCE_EXHAUSTED with `text_offsets` filled.
+int spm_decode_ids_batch(const spm_processor *processor, const int32_t *ids,
+                         const size_t *offsets, size_t num_inputs, char *text,
+                         size_t capacity, size_t *text_offsets);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // SENTENCEPIECE_C_H_
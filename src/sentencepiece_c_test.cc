@@ -0,0 +1,166 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentencepiece_c.h"
+
+#include <string>
+#include <vector>
+
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace {
+
+#define WS "\xe2\x96\x81"
+
+std::string MakeSerializedModel() {
+  ModelProto model_proto;
+  auto *unk = model_proto.add_pieces();
+  unk->set_type(ModelProto::SentencePiece::UNKNOWN);
+  unk->set_piece("<unk>");
+  for (const auto &piece : {"a", "b", "ab", WS "ab", WS}) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(piece);
+    sp->set_score(static_cast<float>(std::string(piece).size()));
+  }
+  *model_proto.mutable_normalizer_spec() =
+      SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+  return model_proto.SerializeAsString();
+}
+
+TEST(SentencePieceCTest, LoadTest) {
+  spm_processor *processor = nullptr;
+  EXPECT_EQ(SPM_NOT_FOUND, spm_processor_load("__UNKNOWN_FILE__", &processor));
+  EXPECT_EQ(nullptr, processor);
+  EXPECT_NE(std::string(), spm_last_error());
+  EXPECT_EQ(SPM_INVALID_ARGUMENT, spm_processor_load(nullptr, &processor));
+
+  const std::string serialized = MakeSerializedModel();
+  ASSERT_EQ(SPM_OK, spm_processor_load_from_serialized_proto(
+                        serialized.data(), serialized.size(), &processor));
+  EXPECT_EQ(std::string(), spm_last_error());
+  EXPECT_EQ(6, spm_piece_size(processor));
+  EXPECT_EQ(SPM_OK, spm_processor_set_num_threads(processor, 2));
+  EXPECT_NE(SPM_OK,
+            spm_processor_set_encode_extra_options(processor, "unknown"));
+  spm_processor_free(processor);
+  spm_processor_free(nullptr);
+}
+
+TEST(SentencePieceCTest, EncodeDecodeTest) {
+  const std::string serialized = MakeSerializedModel();
+  spm_processor *processor = nullptr;
+  ASSERT_EQ(SPM_OK, spm_processor_load_from_serialized_proto(
+                        serialized.data(), serialized.size(), &processor));
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.LoadFromSerializedProto(serialized).ok());
+
+  const std::string input = "ab ba";
+  const std::vector<int> expected = sp.EncodeAsIds(input);
+  ASSERT_FALSE(expected.empty());
+
+  std::vector<int32_t> ids(16);
+  size_t num_ids = 0;
+  ASSERT_EQ(SPM_OK, spm_encode_ids(processor, input.data(), input.size(),
+                                   ids.data(), ids.size(), &num_ids));
+  ids.resize(num_ids);
+  EXPECT_EQ(expected, std::vector<int>(ids.begin(), ids.end()));
+
+  // The required capacity is returned when the ids do not fit.
+  EXPECT_EQ(SPM_RESOURCE_EXHAUSTED,
+            spm_encode_ids(processor, input.data(), input.size(), ids.data(),
+                           1, &num_ids));
+  EXPECT_EQ(expected.size(), num_ids);
+
+  std::string text(16, '\0');
+  size_t size = 0;
+  ASSERT_EQ(SPM_OK, spm_decode_ids(processor, ids.data(), ids.size(),
+                                   &text[0], text.size(), &size));
+  text.resize(size);
+  EXPECT_EQ(sp.DecodeIds(expected), text);
+  EXPECT_EQ(SPM_RESOURCE_EXHAUSTED,
+            spm_decode_ids(processor, ids.data(), ids.size(), &text[0], 1,
+                           &size));
+  EXPECT_EQ(text.size(), size);
+
+  EXPECT_EQ(SPM_INTERNAL,
+            spm_encode_ids(nullptr, input.data(), input.size(), ids.data(),
+                           ids.size(), &num_ids));
+  spm_processor_free(processor);
+}
+
+TEST(SentencePieceCTest, BatchTest) {
+  const std::string serialized = MakeSerializedModel();
+  spm_processor *processor = nullptr;
+  ASSERT_EQ(SPM_OK, spm_processor_load_from_serialized_proto(
+                        serialized.data(), serialized.size(), &processor));
+  ASSERT_EQ(SPM_OK, spm_processor_set_num_threads(processor, 2));
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.LoadFromSerializedProto(serialized).ok());
+
+  const std::vector<std::string> inputs = {"ab", "", "b a ab", "ba ba ba"};
+  std::string data;
+  std::vector<size_t> offsets = {0};
+  for (const auto &input : inputs) {
+    data += input;
+    offsets.push_back(data.size());
+  }
+
+  std::vector<size_t> ids_offsets(inputs.size() + 1);
+  std::vector<int32_t> ids(1);
+  ASSERT_EQ(SPM_RESOURCE_EXHAUSTED,
+            spm_encode_ids_batch(processor, data.data(), offsets.data(),
+                                 inputs.size(), ids.data(), ids.size(),
+                                 ids_offsets.data()));
+  ids.resize(ids_offsets.back());
+  ASSERT_EQ(SPM_OK, spm_encode_ids_batch(processor, data.data(),
+                                         offsets.data(), inputs.size(),
+                                         ids.data(), ids.size(),
+                                         ids_offsets.data()));
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    EXPECT_EQ(sp.EncodeAsIds(inputs[i]),
+              std::vector<int>(ids.begin() + ids_offsets[i],
+                               ids.begin() + ids_offsets[i + 1]));
+  }
+
+  std::vector<size_t> text_offsets(inputs.size() + 1);
+  std::string text;
+  ASSERT_EQ(SPM_RESOURCE_EXHAUSTED,
+            spm_decode_ids_batch(processor, ids.data(), ids_offsets.data(),
+                                 inputs.size(), &text[0], 0,
+                                 text_offsets.data()));
+  text.resize(text_offsets.back());
+  ASSERT_EQ(SPM_OK, spm_decode_ids_batch(processor, ids.data(),
+                                         ids_offsets.data(), inputs.size(),
+                                         &text[0], text.size(),
+                                         text_offsets.data()));
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    EXPECT_EQ(sp.DecodeIds(sp.EncodeAsIds(inputs[i])),
+              text.substr(text_offsets[i],
+                          text_offsets[i + 1] - text_offsets[i]));
+  }
+
+  // The offsets must be increasing.
+  const std::vector<size_t> invalid = {0, 2, 1};
+  EXPECT_EQ(SPM_INTERNAL,
+            spm_encode_ids_batch(processor, data.data(), invalid.data(), 2,
+                                 ids.data(), ids.size(), ids_offsets.data()));
+  spm_processor_free(processor);
+}
+
+}  // namespace
+}  // namespace sentencepiece
@@ -0,0 +1,1000 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentencepiece_infer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "fast_model.h"
+#include "filesystem.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/strings/match.h"
+#include "third_party/absl/strings/strip.h"
+#include "third_party/darts_clone/darts.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace infer {
+namespace {
+
+// Replaces white space with U+2581 (LOWER ONE EIGHT BLOCK).
+constexpr absl::string_view kSpaceSymbol = "\xe2\x96\x81";
+
+// Surface of <unk> when the model does not set unk_surface.
+constexpr absl::string_view kDefaultUnknownSymbol = " \xE2\x81\x87 ";
+
+// REPLACEMENT CHARACTER (U+FFFD) in UTF-8.
+constexpr absl::string_view kReplacementCharacter = "\xef\xbf\xbd";
+
+// Penalty of an unknown character, as the one of unigram::Model.
+constexpr float kUnkPenalty = 10.0;
+
+// Maximum number of the rules matching a prefix of the input, as the one of
+// normalizer::Normalizer.
+constexpr int kMaxTrieResultsSize = 32;
+
+// Values of ModelProto::SentencePiece::Type and TrainerSpec::ModelType.
+enum PieceType {
+  kNormal = 1,
+  kUnknown = 2,
+  kControl = 3,
+  kUserDefined = 4,
+  kUnused = 5,
+  kByte = 6,
+};
+
+enum ModelType {
+  kUnigram = 1,
+  kBPE = 2,
+};
+
+bool IsNormalPieceType(int type) {
+  return type == kNormal || type == kUserDefined || type == kUnused;
+}
+
+// Returns the byte of a byte piece "<0xXX>", or -1.
+int PieceToByte(absl::string_view piece) {
+  if (piece.size() != 6 || !absl::StartsWith(piece, "<0x") ||
+      piece[5] != '>') {
+    return -1;
+  }
+  int byte = 0;
+  for (const char c : piece.substr(3, 2)) {
+    byte *= 16;
+    if (c >= '0' && c <= '9') {
+      byte += c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      byte += c - 'A' + 10;
+    } else {
+      return -1;
+    }
+  }
+  return byte;
+}
+
+// Reader of the fields of a serialized protobuf message. ModelProto only
+// has varint, 32-bit, and length-delimited fields, and 64-bit ones are
+// skipped.
+class WireReader {
+ public:
+  enum WireType {
+    kVarint = 0,
+    kFixed64 = 1,
+    kLengthDelimited = 2,
+    kFixed32 = 5,
+  };
+
+  explicit WireReader(absl::string_view data) : data_(data) {}
+
+  // Reads the next field. Returns false at the end of the message and on a
+  // malformed field, after which ok() is false.
+  bool Next() {
+    if (data_.empty()) return false;
+    uint64_t tag = 0;
+    if (!ReadVarint(&tag)) return Fail();
+    field_ = static_cast<int>(tag >> 3);
+    wire_type_ = static_cast<int>(tag & 7);
+    switch (wire_type_) {
+      case kVarint:
+        return ReadVarint(&value_) || Fail();
+      case kFixed64:
+        if (data_.size() < 8) return Fail();
+        data_.remove_prefix(8);
+        return true;
+      case kLengthDelimited: {
+        uint64_t size = 0;
+        if (!ReadVarint(&size) || size > data_.size()) return Fail();
+        bytes_ = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return true;
+      }
+      case kFixed32:
+        if (data_.size() < 4) return Fail();
+        value_ = 0;
+        for (int i = 3; i >= 0; --i) {
+          value_ = (value_ << 8) | static_cast<unsigned char>(data_[i]);
+        }
+        data_.remove_prefix(4);
+        return true;
+      default:
+        return Fail();
+    }
+  }
+
+  bool ok() const { return ok_; }
+
+  // Returns true if the current field is `field` of `wire_type`.
+  bool Is(int field, WireType wire_type) const {
+    return field_ == field && wire_type_ == wire_type;
+  }
+
+  uint64_t varint() const { return value_; }
+  absl::string_view bytes() const { return bytes_; }
+
+  float fixed32_as_float() const {
+    const uint32 bits = static_cast<uint32>(value_);
+    float value = 0.0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+ private:
+  bool ReadVarint(uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && !data_.empty(); shift += 7) {
+      const unsigned char byte = data_[0];
+      data_.remove_prefix(1);
+      *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+  }
+
+  bool Fail() {
+    ok_ = false;
+    return false;
+  }
+
+  absl::string_view data_;
+  int field_ = 0;
+  int wire_type_ = 0;
+  uint64_t value_ = 0;
+  absl::string_view bytes_;
+  bool ok_ = true;
+};
+
+// The fields of ModelProto used for encoding and decoding. The strings
+// point into the serialized proto.
+struct Piece {
+  absl::string_view piece;
+  float score = 0.0;
+  int type = kNormal;
+};
+
+struct ModelSpec {
+  std::vector<Piece> pieces;
+  int model_type = kUnigram;
+  bool treat_whitespace_as_suffix = false;
+  bool byte_fallback = false;
+  absl::string_view unk_surface = kDefaultUnknownSymbol;
+  absl::string_view precompiled_charsmap;
+  bool add_dummy_prefix = true;
+  bool remove_extra_whitespaces = true;
+  bool escape_whitespaces = true;
+  bool has_denormalizer = false;
+};
+
+util::Status ParsePiece(absl::string_view serialized, Piece *piece) {
+  WireReader reader(serialized);
+  while (reader.Next()) {
+    if (reader.Is(1, WireReader::kLengthDelimited)) {
+      piece->piece = reader.bytes();
+    } else if (reader.Is(2, WireReader::kFixed32)) {
+      piece->score = reader.fixed32_as_float();
+    } else if (reader.Is(3, WireReader::kVarint)) {
+      piece->type = static_cast<int>(reader.varint());
+    }
+  }
+  CHECK_OR_RETURN(reader.ok()) << "ModelProto.pieces is broken.";
+  return util::OkStatus();
+}
+
+util::Status ParseTrainerSpec(absl::string_view serialized, ModelSpec *spec) {
+  WireReader reader(serialized);
+  while (reader.Next()) {
+    if (reader.Is(3, WireReader::kVarint)) {
+      spec->model_type = static_cast<int>(reader.varint());
+    } else if (reader.Is(24, WireReader::kVarint)) {
+      spec->treat_whitespace_as_suffix = reader.varint() != 0;
+    } else if (reader.Is(35, WireReader::kVarint)) {
+      spec->byte_fallback = reader.varint() != 0;
+    } else if (reader.Is(44, WireReader::kLengthDelimited)) {
+      spec->unk_surface = reader.bytes();
+    }
+  }
+  CHECK_OR_RETURN(reader.ok()) << "ModelProto.trainer_spec is broken.";
+  return util::OkStatus();
+}
+
+util::Status ParseNormalizerSpec(absl::string_view serialized,
+                                 ModelSpec *spec) {
+  WireReader reader(serialized);
+  while (reader.Next()) {
+    if (reader.Is(2, WireReader::kLengthDelimited)) {
+      spec->precompiled_charsmap = reader.bytes();
+    } else if (reader.Is(3, WireReader::kVarint)) {
+      spec->add_dummy_prefix = reader.varint() != 0;
+    } else if (reader.Is(4, WireReader::kVarint)) {
+      spec->remove_extra_whitespaces = reader.varint() != 0;
+    } else if (reader.Is(5, WireReader::kVarint)) {
+      spec->escape_whitespaces = reader.varint() != 0;
+    }
+  }
+  CHECK_OR_RETURN(reader.ok()) << "ModelProto.normalizer_spec is broken.";
+  return util::OkStatus();
+}
+
+// The denormalizer only matters if it has rules.
+util::Status HasRules(absl::string_view serialized, bool *has_rules) {
+  WireReader reader(serialized);
+  while (reader.Next()) {
+    if (reader.Is(2, WireReader::kLengthDelimited) &&
+        !reader.bytes().empty()) {
+      *has_rules = true;
+    }
+  }
+  CHECK_OR_RETURN(reader.ok()) << "ModelProto.denormalizer_spec is broken.";
+  return util::OkStatus();
+}
+
+util::Status ParseModelProto(absl::string_view serialized, ModelSpec *spec) {
+  WireReader reader(serialized);
+  while (reader.Next()) {
+    if (reader.Is(1, WireReader::kLengthDelimited)) {
+      spec->pieces.emplace_back();
+      RETURN_IF_ERROR(ParsePiece(reader.bytes(), &spec->pieces.back()));
+    } else if (reader.Is(2, WireReader::kLengthDelimited)) {
+      RETURN_IF_ERROR(ParseTrainerSpec(reader.bytes(), spec));
+    } else if (reader.Is(3, WireReader::kLengthDelimited)) {
+      RETURN_IF_ERROR(ParseNormalizerSpec(reader.bytes(), spec));
+    } else if (reader.Is(5, WireReader::kLengthDelimited)) {
+      RETURN_IF_ERROR(HasRules(reader.bytes(), &spec->has_denormalizer));
+    }
+  }
+  CHECK_OR_RETURN(reader.ok()) << "ModelProto is broken.";
+  return util::OkStatus();
+}
+
+// Points `trie` to the double array in `blob`, whose values must be below
+// `num_values`. The units are copied into `buffer` if they are not aligned,
+// or byte-swapped on big-endian systems. The array is verified before it is
+// used, since the file may be broken.
+util::Status SetArray(absl::string_view blob, uint32 num_values,
+                      std::string *buffer, Darts::DoubleArray *trie) {
+  const void *array = blob.data();
+#ifdef IS_BIG_ENDIAN
+  buffer->assign(blob.data(), blob.size());
+  uint32 *data = reinterpret_cast<uint32 *>(&(*buffer)[0]);
+  for (size_t i = 0; i < buffer->size() / 4; ++i) {
+    data[i] = util::Swap32(data[i]);
+  }
+  array = buffer->data();
+#else
+  if (reinterpret_cast<uintptr_t>(array) % alignof(uint32) != 0) {
+    buffer->assign(blob.data(), blob.size());
+    array = buffer->data();
+  }
+#endif
+  CHECK_OR_RETURN(IsValidDoubleArray(array, blob.size() / sizeof(uint32),
+                                     num_values))
+      << "The double array is broken.";
+  trie->set_array(array, blob.size() / trie->unit_size());
+  return util::OkStatus();
+}
+
+// Builds `trie` of the sorted unique `keys` with the values `values`.
+util::Status BuildTrie(const std::vector<absl::string_view> &keys,
+                       const std::vector<int> &values,
+                       Darts::DoubleArray *trie) {
+  std::vector<const char *> data(keys.size());
+  std::vector<size_t> lengths(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    data[i] = keys[i].data();
+    lengths[i] = keys[i].size();
+  }
+  CHECK_OR_RETURN(trie->build(keys.size(), data.data(), lengths.data(),
+                              values.empty() ? nullptr : values.data()) == 0)
+      << "cannot build double-array.";
+  return util::OkStatus();
+}
+
+}  // namespace
+
+// The model loaded from a fast-model file. The normalizer and the encoder
+// follow normalizer::Normalizer, unigram::Model, and bpe::Model.
+class Model {
+ public:
+  util::Status Init(absl::string_view blob) {
+    absl::string_view serialized, trie_blob, frequent_words;
+    RETURN_IF_ERROR(
+        DecodeFastModel(blob, &serialized, &trie_blob, &frequent_words));
+    RETURN_IF_ERROR(ParseModelProto(serialized, &spec_));
+    if (spec_.model_type != kUnigram && spec_.model_type != kBPE) {
+      return util::UnimplementedError(
+          "sentencepiece_infer only supports unigram and BPE models.");
+    }
+    if (spec_.has_denormalizer) {
+      return util::UnimplementedError(
+          "sentencepiece_infer does not support denormalizer rules.");
+    }
+    RETURN_IF_ERROR(InitPieces());
+    RETURN_IF_ERROR(InitNormalizer());
+    if (spec_.model_type == kUnigram) {
+      RETURN_IF_ERROR(InitUnigram(trie_blob));
+    } else {
+      RETURN_IF_ERROR(InitBPE(trie_blob));
+    }
+    return util::OkStatus();
+  }
+
+  int GetPieceSize() const { return spec_.pieces.size(); }
+  int unk_id() const { return unk_id_; }
+
+  absl::string_view IdToPiece(int id) const {
+    if (id < 0 || id >= GetPieceSize()) return absl::string_view();
+    return spec_.pieces[id].piece;
+  }
+
+  int PieceToId(absl::string_view piece) const {
+    int id = FindNormalPiece(piece);
+    if (id >= 0) return id;
+    const auto it = reserved_pieces_.find(piece);
+    return it == reserved_pieces_.end() ? unk_id_ : it->second;
+  }
+
+  util::Status Encode(absl::string_view input, std::vector<int> *ids) const {
+    ids->clear();
+    std::string normalized;
+    RETURN_IF_ERROR(Normalize(input, &normalized));
+    std::vector<std::pair<absl::string_view, int>> result;
+    if (spec_.model_type == kUnigram) {
+      EncodeUnigram(normalized, &result);
+    } else {
+      EncodeBPE(normalized, &result);
+    }
+
+    // The same ids as AppendPieceIds() of SentencePieceProcessor.
+    ids->reserve(result.size());
+    bool is_prev_unk = false;
+    for (const auto &p : result) {
+      CHECK_OR_RETURN(!p.first.empty()) << "Empty piece is not allowed.";
+      const bool is_unk = p.second == unk_id_;
+      if (spec_.pieces[p.second].type == kControl) {
+        ids->push_back(p.second);
+      } else if (is_unk && spec_.byte_fallback) {
+        // Decomposes an unknown piece into UTF-8 bytes
+        for (const char b : p.first) {
+          ids->push_back(byte_ids_[static_cast<unsigned char>(b)]);
+        }
+      } else if (!(is_prev_unk && is_unk)) {
+        // Continuous run of unknown pieces is merged into one.
+        ids->push_back(p.second);
+      }
+      is_prev_unk = is_unk;
+    }
+    return util::OkStatus();
+  }
+
+  util::Status Decode(const std::vector<int> &ids, std::string *text) const {
+    // The same text as DecodeTable::Decode() of SentencePieceProcessor.
+    text->clear();
+    const bool strip_bos_ws =
+        spec_.add_dummy_prefix || spec_.remove_extra_whitespaces;
+    std::string bytes;
+    bool is_bos_ws = strip_bos_ws;
+    bool bos_ws_seen = false;
+    for (const int id : ids) {
+      if (id < 0 || id >= GetPieceSize()) {
+        text->clear();
+        return util::Status(util::StatusCode::kOutOfRange,
+                            "Invalid id: " + std::to_string(id));
+      }
+      const Piece &piece = spec_.pieces[id];
+      if (piece.type == kByte) {
+        bytes.push_back(static_cast<char>(PieceToByte(piece.piece)));
+        continue;
+      }
+      if (!bytes.empty()) {
+        AppendBytes(bytes, text);
+        bytes.clear();
+      }
+      if (piece.type == kControl) continue;
+      const bool is_unk = piece.type == kUnknown;
+      absl::string_view surface = is_unk ? spec_.unk_surface : piece.piece;
+      const bool space_prefixed =
+          !is_unk && absl::StartsWith(surface, kSpaceSymbol);
+      if (is_bos_ws) {
+        if (bos_ws_seen || !text->empty()) {
+          is_bos_ws = false;
+        } else {
+          bos_ws_seen = space_prefixed && !spec_.remove_extra_whitespaces;
+        }
+      }
+      if (is_unk) {
+        text->append(surface.data(), surface.size());
+        continue;
+      }
+      if (is_bos_ws && space_prefixed) {
+        surface.remove_prefix(kSpaceSymbol.size());
+      }
+      for (size_t pos = 0; pos < surface.size();) {
+        const size_t found = std::min(surface.find(kSpaceSymbol, pos),
+                                      surface.size());
+        text->append(surface.data() + pos, found - pos);
+        if (found == surface.size()) break;
+        text->push_back(' ');
+        pos = found + kSpaceSymbol.size();
+      }
+    }
+    AppendBytes(bytes, text);
+    return util::OkStatus();
+  }
+
+ private:
+  // Appends `bytes` to `text` one Unicode character at a time. A
+  // structurally invalid byte becomes REPLACEMENT CHARACTER (U+FFFD).
+  static void AppendBytes(absl::string_view bytes, std::string *text) {
+    while (!bytes.empty()) {
+      size_t consumed = 0;
+      if (string_util::IsValidDecodeUTF8(bytes, &consumed)) {
+        text->append(bytes.data(), consumed);
+      } else {
+        text->append(kReplacementCharacter.data(),
+                     kReplacementCharacter.size());
+        consumed = 1;
+      }
+      bytes.remove_prefix(consumed);
+    }
+  }
+
+  util::Status InitPieces() {
+    std::vector<absl::string_view> user_defined;
+    std::fill(byte_ids_, byte_ids_ + 256, -1);
+    for (int id = 0; id < GetPieceSize(); ++id) {
+      const Piece &piece = spec_.pieces[id];
+      CHECK_OR_RETURN(!piece.piece.empty()) << "piece must not be empty.";
+      if (piece.type == kUnknown) {
+        CHECK_EQ_OR_RETURN(unk_id_, -1) << "unk is already defined.";
+        unk_id_ = id;
+      } else if (piece.type == kUserDefined) {
+        user_defined.push_back(piece.piece);
+      } else if (piece.type == kByte) {
+        CHECK_OR_RETURN(spec_.byte_fallback)
+            << "byte piece " << piece.piece
+            << " is found although `byte_fallback` is false.";
+        const int byte = PieceToByte(piece.piece);
+        CHECK_OR_RETURN(byte >= 0)
+            << "byte piece " << piece.piece << " is invalid.";
+        byte_ids_[byte] = id;
+      }
+      if (!IsNormalPieceType(piece.type)) {
+        CHECK_OR_RETURN(reserved_pieces_.emplace(piece.piece, id).second)
+            << piece.piece << " is already defined.";
+      }
+      if (piece.type == kNormal) {
+        min_score_ = std::min(min_score_, piece.score);
+        max_score_ = std::max(max_score_, piece.score);
+      }
+      max_piece_size_ = std::max<int>(max_piece_size_, piece.piece.size());
+    }
+    CHECK_NE_OR_RETURN(unk_id_, -1) << "unk is not defined.";
+    if (spec_.byte_fallback) {
+      CHECK_OR_RETURN(std::find(byte_ids_, byte_ids_ + 256, -1) ==
+                      byte_ids_ + 256)
+          << "there are not 256 byte pieces although `byte_fallback` is "
+             "true.";
+    }
+
+    if (!user_defined.empty()) {
+      std::sort(user_defined.begin(), user_defined.end());
+      user_defined.erase(std::unique(user_defined.begin(), user_defined.end()),
+                         user_defined.end());
+      user_defined_ = std::make_unique<Darts::DoubleArray>();
+      RETURN_IF_ERROR(BuildTrie(user_defined, {}, user_defined_.get()));
+    }
+    return util::OkStatus();
+  }
+
+  util::Status InitNormalizer() {
+    absl::string_view blob = spec_.precompiled_charsmap;
+    if (blob.empty()) return util::OkStatus();
+    // <trie size(4byte)><double array trie><normalized string>
+    uint32 trie_size = 0;
+    // The values are offsets of NUL-terminated strings after the trie.
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&blob, &trie_size) &&
+                    trie_size < blob.size() && blob.back() == '\0')
+        << "Blob for normalization rule is broken.";
+    charsmap_ = std::make_unique<Darts::DoubleArray>();
+    RETURN_IF_ERROR(SetArray(blob.substr(0, trie_size),
+                             blob.size() - trie_size, &charsmap_buffer_,
+                             charsmap_.get()));
+    normalized_ = blob.data() + trie_size;
+    return util::OkStatus();
+  }
+
+  util::Status InitUnigram(absl::string_view trie_blob) {
+    // <max number of prefix matches (4byte)><double array trie>
+    uint32 trie_results_size = 0;
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&trie_blob, &trie_results_size) &&
+                    !trie_blob.empty() && trie_blob.size() % 4 == 0)
+        << "Blob for the precompiled trie is broken.";
+    trie_ = std::make_unique<Darts::DoubleArray>();
+    RETURN_IF_ERROR(
+        SetArray(trie_blob, GetPieceSize(), &trie_buffer_, trie_.get()));
+
+    // The trie must return exactly the ids of the model.
+    for (int id = 0; id < GetPieceSize(); ++id) {
+      if (!IsNormalPieceType(spec_.pieces[id].type)) continue;
+      const absl::string_view piece = spec_.pieces[id].piece;
+      int found = -1;
+      trie_->exactMatchSearch(piece.data(), found, piece.size());
+      CHECK_EQ_OR_RETURN(found, id)
+          << "The precompiled trie does not match the model.";
+    }
+    return util::OkStatus();
+  }
+
+  util::Status InitBPE(absl::string_view merges_blob) {
+    for (int id = 0; id < GetPieceSize(); ++id) {
+      const Piece &piece = spec_.pieces[id];
+      if (!IsNormalPieceType(piece.type)) continue;
+      CHECK_OR_RETURN(normal_pieces_.emplace(piece.piece, id).second)
+          << piece.piece << " is already defined.";
+      if (piece.piece.size() == 1) {
+        single_byte_ids_[static_cast<unsigned char>(piece.piece[0])] = id;
+      }
+    }
+
+    // <number of rules (4byte)>(<left id><right id><merged id> (4byte each))*
+    uint32 num_rules = 0;
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&merges_blob, &num_rules) &&
+                    merges_blob.size() == 3 * sizeof(uint32) * num_rules)
+        << "Blob for the merge table is broken.";
+    merges_.reserve(num_rules);
+    for (uint32 i = 0; i < num_rules; ++i) {
+      uint32 ids[3] = {0, 0, 0};
+      for (auto &id : ids) {
+        string_util::ConsumeUInt32(&merges_blob, &id);
+        CHECK_LT_OR_RETURN(id, static_cast<uint32>(GetPieceSize()))
+            << "Invalid id in the merge table.";
+      }
+      const absl::string_view left = spec_.pieces[ids[0]].piece;
+      const absl::string_view right = spec_.pieces[ids[1]].piece;
+      const absl::string_view merged = spec_.pieces[ids[2]].piece;
+      CHECK_OR_RETURN(merged.size() == left.size() + right.size() &&
+                      absl::StartsWith(merged, left) &&
+                      absl::EndsWith(merged, right))
+          << "The merge table does not match pieces: " << merged;
+      merges_[MergeKey(ids[0], ids[1])] = ids[2];
+    }
+    return util::OkStatus();
+  }
+
+  int FindNormalPiece(absl::string_view piece) const {
+    if (trie_ != nullptr) {
+      int id = -1;
+      trie_->exactMatchSearch(piece.data(), id, piece.size());
+      return id;
+    }
+    const auto it = normal_pieces_.find(piece);
+    return it == normal_pieces_.end() ? -1 : it->second;
+  }
+
+  // Returns the length of the user defined symbol at the beginning of
+  // `input`, or 0.
+  int MatchUserDefined(absl::string_view input) const {
+    if (user_defined_ == nullptr) return 0;
+    constexpr int kResultSize = 64;
+    Darts::DoubleArray::result_pair_type results[kResultSize];
+    const int num_nodes = user_defined_->commonPrefixSearch(
+        input.data(), results, kResultSize, input.size());
+    int length = 0;
+    for (int i = 0; i < num_nodes; ++i) {
+      length = std::max<int>(length, results[i].length);
+    }
+    return length;
+  }
+
+  // Returns the normalized prefix of `input` and the number of the bytes
+  // consumed.
+  std::pair<absl::string_view, int> NormalizePrefix(
+      absl::string_view input) const {
+    const int user_defined = MatchUserDefined(input);
+    if (user_defined > 0) {
+      return std::make_pair(input.substr(0, user_defined), user_defined);
+    }
+
+    size_t longest_length = 0;
+    int longest_value = 0;
+    if (charsmap_ != nullptr) {
+      Darts::DoubleArray::result_pair_type results[kMaxTrieResultsSize];
+      const size_t num_nodes = charsmap_->commonPrefixSearch(
+          input.data(), results, kMaxTrieResultsSize, input.size());
+      for (size_t k = 0; k < num_nodes; ++k) {
+        if (results[k].length > longest_length) {
+          longest_length = results[k].length;
+          longest_value = results[k].value;
+        }
+      }
+    }
+    if (longest_length > 0) {
+      // The normalized strings are delimited by "\0".
+      return std::make_pair(absl::string_view(normalized_ + longest_value),
+                            longest_length);
+    }
+
+    size_t length = 0;
+    if (!string_util::IsValidDecodeUTF8(input, &length)) {
+      // A malformed byte becomes REPLACEMENT CHARACTER (U+FFFD).
+      return std::make_pair(kReplacementCharacter, 1);
+    }
+    return std::make_pair(input.substr(0, length), length);
+  }
+
+  util::Status Normalize(absl::string_view input,
+                         std::string *normalized) const {
+    normalized->clear();
+
+    // Ignores heading space.
+    if (spec_.remove_extra_whitespaces) {
+      while (!input.empty()) {
+        const auto p = NormalizePrefix(input);
+        if (p.first != " ") break;
+        input.remove_prefix(p.second);
+      }
+    }
+    if (input.empty()) return util::OkStatus();
+
+    normalized->reserve(input.size() * 3);
+    const absl::string_view space =
+        spec_.escape_whitespaces ? kSpaceSymbol : " ";
+    const bool add_dummy_prefix = spec_.add_dummy_prefix;
+    if (!spec_.treat_whitespace_as_suffix && add_dummy_prefix) {
+      normalized->append(space.data(), space.size());
+    }
+
+    bool is_prev_space = spec_.remove_extra_whitespaces;
+    while (!input.empty()) {
+      const auto p = NormalizePrefix(input);
+      absl::string_view sp = p.first;
+
+      // Removes heading spaces in sentence piece,
+      // if the previous sentence piece ends with whitespace.
+      while (is_prev_space && absl::ConsumePrefix(&sp, " ")) {
+      }
+
+      if (!sp.empty()) {
+        is_prev_space = absl::EndsWith(sp, " ");
+        for (const char c : sp) {
+          if (c == ' ' && spec_.escape_whitespaces) {
+            normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
+          } else {
+            normalized->push_back(c);
+          }
+        }
+      }
+
+      input.remove_prefix(p.second);
+      if (!spec_.remove_extra_whitespaces) is_prev_space = false;
+    }
+
+    // Ignores trailing space.
+    if (spec_.remove_extra_whitespaces) {
+      while (absl::EndsWith(*normalized, space)) {
+        normalized->resize(normalized->size() - space.size());
+      }
+    }
+
+    // Adds a space symbol as a suffix (default is false)
+    if (spec_.treat_whitespace_as_suffix && add_dummy_prefix) {
+      normalized->append(space.data(), space.size());
+    }
+    return util::OkStatus();
+  }
+
+  // The Viterbi algorithm of unigram::Model::EncodeOptimized().
+  void EncodeUnigram(
+      absl::string_view normalized,
+      std::vector<std::pair<absl::string_view, int>> *result) const {
+    struct BestPathNode {
+      int id = -1;
+      float best_path_score = 0;
+      int starts_at = -1;
+    };
+    const int size = normalized.size();
+    if (size == 0) return;
+    const float unk_score = min_score_ - kUnkPenalty;
+    std::vector<BestPathNode> best_path_ends_at(size + 1);
+    int starts_at = 0;
+    while (starts_at < size) {
+      std::size_t node_pos = 0;
+      std::size_t key_pos = starts_at;
+      const float best_path_score_till_here =
+          best_path_ends_at[starts_at].best_path_score;
+      bool has_single_node = false;
+      const int mblen =
+          std::min<int>(string_util::OneCharLen(normalized.data() + starts_at),
+                        size - starts_at);
+      const std::size_t key_end =
+          std::min<std::size_t>(size, starts_at + max_piece_size_);
+      while (key_pos < key_end) {
+        const int ret =
+            trie_->traverse(normalized.data(), node_pos, key_pos, key_pos + 1);
+        if (ret == -2) break;
+        if (ret < 0) continue;
+        const Piece &piece = spec_.pieces[ret];
+        if (piece.type == kUnused) continue;
+        auto &target_node = best_path_ends_at[key_pos];
+        const auto length = key_pos - starts_at;
+        // User defined symbol receives extra bonus to always be selected.
+        const float score = piece.type == kUserDefined
+                                ? (length * max_score_ - 0.1)
+                                : piece.score;
+        const float candidate_best_path_score =
+            score + best_path_score_till_here;
+        if (target_node.starts_at == -1 ||
+            candidate_best_path_score > target_node.best_path_score) {
+          target_node.best_path_score = candidate_best_path_score;
+          target_node.starts_at = starts_at;
+          target_node.id = ret;
+        }
+        if (length == static_cast<size_t>(mblen)) has_single_node = true;
+      }
+      if (!has_single_node) {
+        auto &target_node = best_path_ends_at[starts_at + mblen];
+        const float candidate_best_path_score =
+            unk_score + best_path_score_till_here;
+        if (target_node.starts_at == -1 ||
+            candidate_best_path_score > target_node.best_path_score) {
+          target_node.best_path_score = candidate_best_path_score;
+          target_node.starts_at = starts_at;
+          target_node.id = unk_id_;
+        }
+      }
+      starts_at += mblen;
+    }
+
+    for (int ends_at = size; ends_at > 0;) {
+      const auto &node = best_path_ends_at[ends_at];
+      result->emplace_back(
+          normalized.substr(node.starts_at, ends_at - node.starts_at),
+          node.id);
+      ends_at = node.starts_at;
+    }
+    std::reverse(result->begin(), result->end());
+  }
+
+  // The merges of bpe::Model::SampleEncode() without dropout.
+  void EncodeBPE(absl::string_view normalized,
+                 std::vector<std::pair<absl::string_view, int>> *result) const {
+    struct Symbol {
+      int prev;
+      int next;
+      bool freeze;  // A user defined symbol, which is never merged.
+      int id;       // Id of the piece, or -1 if it is not in the vocabulary.
+      absl::string_view piece;
+    };
+    struct SymbolPair {
+      int left;
+      int right;
+      int id;
+      float score;
+      size_t size;
+    };
+    // Orders the agenda by score, then by the left position.
+    const auto less = [](const SymbolPair &h1, const SymbolPair &h2) {
+      return h1.score < h2.score ||
+             (h1.score == h2.score && h1.left > h2.left);
+    };
+
+    std::vector<Symbol> symbols;
+    std::vector<SymbolPair> agenda;
+    // Pairs of the pieces merged into an unused piece, which is split
+    // again after the merges.
+    absl::flat_hash_map<absl::string_view,
+                        std::pair<absl::string_view, absl::string_view>>
+        rev_merge;
+
+    const auto maybe_add_pair = [&](int left, int right) {
+      if (left == -1 || right == -1) return;
+      const Symbol &l = symbols[left];
+      const Symbol &r = symbols[right];
+      if (l.freeze || r.freeze) return;
+      const absl::string_view piece(l.piece.data(),
+                                    l.piece.size() + r.piece.size());
+      int id = -1;
+      if (l.id >= 0 && r.id >= 0) {
+        const auto it = merges_.find(MergeKey(l.id, r.id));
+        if (it != merges_.end()) id = it->second;
+      } else {
+        id = FindNormalPiece(piece);
+      }
+      if (id < 0) return;
+      agenda.push_back({left, right, id, spec_.pieces[id].score, piece.size()});
+      std::push_heap(agenda.begin(), agenda.end(), less);
+      if (spec_.pieces[id].type == kUnused) {
+        rev_merge[piece] = std::make_pair(l.piece, r.piece);
+      }
+    };
+
+    // Splits the input into characters and user defined symbols.
+    while (!normalized.empty()) {
+      Symbol s;
+      int mblen = MatchUserDefined(normalized);
+      s.freeze = mblen > 0;
+      if (!s.freeze) {
+        mblen = std::min<int>(normalized.size(),
+                              string_util::OneCharLen(normalized.data()));
+      }
+      s.piece = normalized.substr(0, mblen);
+      s.id = mblen == 1 ? single_byte_ids_[static_cast<unsigned char>(
+                              normalized[0])]
+                        : FindNormalPiece(s.piece);
+      s.prev = static_cast<int>(symbols.size()) - 1;
+      normalized.remove_prefix(mblen);
+      s.next = normalized.empty() ? -1 : static_cast<int>(symbols.size()) + 1;
+      symbols.push_back(s);
+    }
+    if (symbols.empty()) return;
+
+    for (size_t i = 1; i < symbols.size(); ++i) maybe_add_pair(i - 1, i);
+
+    while (!agenda.empty()) {
+      std::pop_heap(agenda.begin(), agenda.end(), less);
+      const SymbolPair top = agenda.back();
+      agenda.pop_back();
+      Symbol &left = symbols[top.left];
+      Symbol &right = symbols[top.right];
+      // `top` is no longer available.
+      if (left.piece.empty() || right.piece.empty() ||
+          left.piece.size() + right.piece.size() != top.size) {
+        continue;
+      }
+      left.piece = absl::string_view(left.piece.data(), top.size);
+      left.id = top.id;
+      left.next = right.next;
+      if (right.next >= 0) symbols[right.next].prev = top.left;
+      right.piece = absl::string_view();
+      maybe_add_pair(left.prev, top.left);
+      maybe_add_pair(top.left, left.next);
+    }
+
+    std::function<void(absl::string_view)> resegment =
+        [&](absl::string_view w) {
+          const int id = PieceToId(w);
+          const auto it = spec_.pieces[id].type == kUnused
+                              ? rev_merge.find(w)
+                              : rev_merge.end();
+          if (it == rev_merge.end()) {
+            result->emplace_back(w, id);
+            return;
+          }
+          resegment(it->second.first);
+          resegment(it->second.second);
+        };
+    for (int index = 0; index != -1; index = symbols[index].next) {
+      resegment(symbols[index].piece);
+    }
+  }
+
+  static uint64_t MergeKey(uint32 left, uint32 right) {
+    return (static_cast<uint64_t>(left) << 32) | right;
+  }
+
+  ModelSpec spec_;
+  int unk_id_ = -1;
+  int byte_ids_[256];  // Ids of the byte pieces, used by byte fallback.
+  int max_piece_size_ = 0;
+  float min_score_ = FLT_MAX;
+  float max_score_ = FLT_MIN;
+  absl::flat_hash_map<absl::string_view, int> reserved_pieces_;
+  std::unique_ptr<Darts::DoubleArray> user_defined_;
+
+  // Precompiled charsmap of the normalizer.
+  std::unique_ptr<Darts::DoubleArray> charsmap_;
+  std::string charsmap_buffer_;
+  const char *normalized_ = nullptr;
+
+  // Unigram models.
+  std::unique_ptr<Darts::DoubleArray> trie_;
+  std::string trie_buffer_;
+
+  // BPE models.
+  absl::flat_hash_map<absl::string_view, int> normal_pieces_;
+  absl::flat_hash_map<uint64_t, int> merges_;
+  int single_byte_ids_[256] = {};
+};
+
+Processor::Processor() {}
+Processor::~Processor() {}
+
+util::Status Processor::Load(absl::string_view filename) {
+  auto mapped_file = filesystem::NewMappedFile(filename);
+  status_ = mapped_file->status();
+  if (!status_.ok()) return status_;
+  blob_.clear();
+  mapped_file_ = std::move(mapped_file);
+  return LoadModel(mapped_file_->data());
+}
+
+util::Status Processor::LoadFromFastModel(absl::string_view blob) {
+  mapped_file_.reset();
+  blob_.assign(blob.data(), blob.size());
+  return LoadModel(blob_);
+}
+
+util::Status Processor::LoadModel(absl::string_view blob) {
+  model_ = std::make_unique<Model>();
+  status_ = model_->Init(blob);
+  if (!status_.ok()) model_.reset();
+  return status_;
+}
+
+util::Status Processor::status() const {
+  if (model_ == nullptr && status_.ok()) {
+    return util::InternalError("Model is not initialized.");
+  }
+  return status_;
+}
+
+util::Status Processor::Encode(absl::string_view input,
+                               std::vector<int> *ids) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(ids) << "output container is null";
+  return model_->Encode(input, ids);
+}
+
+util::Status Processor::Decode(const std::vector<int> &ids,
+                               std::string *text) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(text) << "output container is null";
+  return model_->Decode(ids, text);
+}
+
+int Processor::GetPieceSize() const {
+  return model_ == nullptr ? 0 : model_->GetPieceSize();
+}
+
+int Processor::PieceToId(absl::string_view piece) const {
+  return model_ == nullptr ? -1 : model_->PieceToId(piece);
+}
+
+absl::string_view Processor::IdToPiece(int id) const {
+  return model_ == nullptr ? absl::string_view() : model_->IdToPiece(id);
+}
+
+int Processor::unk_id() const {
+  return model_ == nullptr ? -1 : model_->unk_id();
+}
+
+}  // namespace infer
+}  // namespace sentencepiece
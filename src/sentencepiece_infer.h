@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SENTENCEPIECE_INFER_H_
+#define SENTENCEPIECE_INFER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "sentencepiece_processor.h"
+
+// Encoder and decoder of the sentencepiece_infer library, which is built
+// without the protobuf runtime for mobile and embedded targets. It reads
+// only the fast-model files written by spm_compile_model or
+// io::SaveFastModel(): the ModelProto in the file is parsed in place, and
+// the precompiled trie or merge table is used as is, so loading a mapped
+// file copies almost nothing.
+//
+// Unigram and BPE models are supported. The ids are the same as the ones
+// of SentencePieceProcessor::Encode() and Decode() without extra options,
+// sampling, or vocabulary restrictions. A model with a denormalizer is
+// rejected.
+//
+//   sentencepiece::infer::Processor processor;
+//   CHECK_OK(processor.Load("//path/to/model.fast"));
+//   std::vector<int> ids;
+//   CHECK_OK(processor.Encode("hello world.", &ids));
+//   std::string text;
+//   CHECK_OK(processor.Decode(ids, &text));
+namespace sentencepiece {
+namespace infer {
+
+class Model;
+
+class Processor {
+ public:
+  Processor();
+  virtual ~Processor();
+
+  Processor(const Processor &) = delete;
+  Processor &operator=(const Processor &) = delete;
+
+  // Loads the fast-model file `filename`, which is memory-mapped on POSIX
+  // systems and stays mapped while the model is loaded.
+  util::Status Load(absl::string_view filename);
+
+  // Loads the model from the content of a fast-model file. `blob` is
+  // copied.
+  util::Status LoadFromFastModel(absl::string_view blob);
+
+  // Returns the status of the last Load().
+  util::Status status() const;
+
+  // Encodes `input` into `ids`.
+  util::Status Encode(absl::string_view input, std::vector<int> *ids) const;
+
+  // Decodes `ids` into `text`.
+  util::Status Decode(const std::vector<int> &ids, std::string *text) const;
+
+  // Returns the size of the vocabulary, or 0 if no model is loaded.
+  int GetPieceSize() const;
+
+  // Returns the id of `piece`, or the id of <unk> if it is unknown.
+  int PieceToId(absl::string_view piece) const;
+
+  // Returns the piece of `id`, or an empty string if it is out of range.
+  absl::string_view IdToPiece(int id) const;
+
+  // Returns the id of <unk>.
+  int unk_id() const;
+
+ private:
+  util::Status LoadModel(absl::string_view blob);
+
+  // The fast-model file mapped by Load(), or the blob copied by
+  // LoadFromFastModel(), which `model_` points into.
+  std::unique_ptr<filesystem::MappedFile> mapped_file_;
+  std::string blob_;
+  std::unique_ptr<Model> model_;
+  util::Status status_;
+};
+
+}  // namespace infer
+}  // namespace sentencepiece
+#endif  // SENTENCEPIECE_INFER_H_
@@ -0,0 +1,263 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentencepiece_infer.h"
+
+#include <string>
+#include <vector>
+
+#include "fast_model.h"
+#include "filesystem.h"
+#include "model_interface.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "testharness.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace infer {
+namespace {
+
+#define WS "\xe2\x96\x81"
+
+void AddPiece(ModelProto *model_proto, absl::string_view piece, float score,
+              ModelProto::SentencePiece::Type type =
+                  ModelProto::SentencePiece::NORMAL) {
+  auto *sp = model_proto->add_pieces();
+  sp->set_piece(std::string(piece));
+  sp->set_score(score);
+  sp->set_type(type);
+}
+
+ModelProto MakeModelProto(TrainerSpec::ModelType model_type) {
+  ModelProto model_proto;
+  model_proto.mutable_trainer_spec()->set_model_type(model_type);
+  AddPiece(&model_proto, "<unk>", 0.0, ModelProto::SentencePiece::UNKNOWN);
+  AddPiece(&model_proto, "<s>", 0.0, ModelProto::SentencePiece::CONTROL);
+  AddPiece(&model_proto, "<sep>", 0.0,
+           ModelProto::SentencePiece::USER_DEFINED);
+  AddPiece(&model_proto, "ab", -1.0);
+  AddPiece(&model_proto, WS "ab", -2.0);
+  AddPiece(&model_proto, "abc", -3.0);
+  AddPiece(&model_proto, "bc", -3.5, ModelProto::SentencePiece::UNUSED);
+  AddPiece(&model_proto, WS, -4.0);
+  AddPiece(&model_proto, "a", -5.0);
+  AddPiece(&model_proto, "b", -6.0);
+  AddPiece(&model_proto, "c", -7.0);
+  *model_proto.mutable_normalizer_spec() =
+      SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+  return model_proto;
+}
+
+// Checks that `processor` encodes and decodes `texts` as `sp`.
+void ExpectSameAsProcessor(const SentencePieceProcessor &sp,
+                           const Processor &processor,
+                           const std::vector<std::string> &texts) {
+  for (const auto &text : texts) {
+    std::vector<int> expected, ids;
+    ASSERT_TRUE(sp.Encode(text, &expected).ok());
+    ASSERT_TRUE(processor.Encode(text, &ids).ok());
+    EXPECT_EQ(expected, ids) << text;
+    std::string expected_text, decoded;
+    ASSERT_TRUE(sp.Decode(expected, &expected_text).ok());
+    ASSERT_TRUE(processor.Decode(ids, &decoded).ok());
+    EXPECT_EQ(expected_text, decoded) << text;
+  }
+}
+
+const std::vector<std::string> kTexts = {"",
+                                         " ",
+                                         "ab c",
+                                         "abcab",
+                                         "  a  b xabc ",
+                                         "ab<sep>ab",
+                                         "ＡＢ ①",
+                                         "x\xff"
+                                         "ab",
+                                         "abc\xe3\x81\x82"};
+
+TEST(InferProcessorTest, EncodeDecodeTest) {
+  for (const auto model_type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    const ModelProto model_proto = MakeModelProto(model_type);
+    const std::string filename =
+        util::JoinPath(::testing::TempDir(), "infer_fast_model");
+    ASSERT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    Processor processor;
+    ASSERT_TRUE(processor.Load(filename).ok());
+    EXPECT_EQ(model_proto.pieces_size(), processor.GetPieceSize());
+    EXPECT_EQ(0, processor.unk_id());
+    EXPECT_EQ(3, processor.PieceToId("ab"));
+    EXPECT_EQ(1, processor.PieceToId("<s>"));
+    EXPECT_EQ(0, processor.PieceToId("xyz"));
+    EXPECT_EQ("abc", processor.IdToPiece(5));
+    EXPECT_EQ("", processor.IdToPiece(100));
+    ExpectSameAsProcessor(sp, processor, kTexts);
+
+    std::string text;
+    EXPECT_FALSE(processor.Decode({100}, &text).ok());
+  }
+}
+
+TEST(InferProcessorTest, ByteFallbackTest) {
+  ModelProto model_proto = MakeModelProto(TrainerSpec::UNIGRAM);
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  for (int i = 0; i < 256; ++i) {
+    AddPiece(&model_proto, ByteToPiece(i), 0.0,
+             ModelProto::SentencePiece::BYTE);
+  }
+  model_proto.mutable_normalizer_spec()->set_add_dummy_prefix(false);
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  std::string blob;
+  {
+    const std::string filename =
+        util::JoinPath(::testing::TempDir(), "infer_byte_fallback_model");
+    ASSERT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+    auto input = filesystem::NewReadableFile(filename, true);
+    ASSERT_TRUE(input->ReadAll(&blob));
+  }
+  Processor processor;
+  ASSERT_TRUE(processor.LoadFromFastModel(blob).ok());
+  ExpectSameAsProcessor(sp, processor, kTexts);
+
+  // Broken bytes are decoded into U+FFFD.
+  std::string text;
+  ASSERT_TRUE(processor.Decode({processor.PieceToId("<0xE3>"),
+                                processor.PieceToId("ab")},
+                               &text)
+                  .ok());
+  EXPECT_EQ("\xef\xbf\xbd" "ab", text);
+}
+
+TEST(InferProcessorTest, TrainedModelTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+  std::vector<std::string> texts;
+  {
+    auto file = filesystem::NewReadableFile(input);
+    ASSERT_TRUE(file->status().ok());
+    std::string line;
+    while (texts.size() < 200 && file->ReadLine(&line)) texts.push_back(line);
+  }
+
+  for (const auto *model_type : {"unigram", "bpe"}) {
+    const std::string prefix =
+        util::JoinPath(::testing::TempDir(), "infer_trained_model");
+    ASSERT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--input=", input, " --model_prefix=", prefix,
+                                 " --vocab_size=1000 --model_type=",
+                                 model_type))
+                    .ok());
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(prefix + ".model").ok());
+    const std::string filename = prefix + ".fast";
+    ASSERT_TRUE(io::SaveFastModel(filename, sp.model_proto()).ok());
+
+    Processor processor;
+    ASSERT_TRUE(processor.Load(filename).ok());
+    ExpectSameAsProcessor(sp, processor, texts);
+
+    // Only the fast-model format is read.
+    Processor plain;
+    EXPECT_FALSE(plain.Load(prefix + ".model").ok());
+    EXPECT_FALSE(plain.status().ok());
+    std::vector<int> ids;
+    EXPECT_FALSE(plain.Encode("a", &ids).ok());
+  }
+}
+
+TEST(InferProcessorTest, LoadErrorTest) {
+  Processor processor;
+  EXPECT_FALSE(processor.status().ok());
+  EXPECT_EQ(0, processor.GetPieceSize());
+  EXPECT_FALSE(processor.Load("__UNKNOWN_FILE__").ok());
+  EXPECT_FALSE(processor.LoadFromFastModel("SPMFAST1").ok());
+
+  ModelProto model_proto = MakeModelProto(TrainerSpec::UNIGRAM);
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "infer_broken_model");
+  ASSERT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+  std::string blob;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    ASSERT_TRUE(input->ReadAll(&blob));
+  }
+  ASSERT_TRUE(processor.LoadFromFastModel(blob).ok());
+  EXPECT_FALSE(processor.LoadFromFastModel(blob.substr(0, blob.size() - 4))
+                   .ok());
+  // A flipped byte in the serialized ModelProto fails the checksum.
+  blob[28 + 2] ^= 0x10;
+  EXPECT_FALSE(processor.LoadFromFastModel(blob).ok());
+
+  // A denormalizer is not supported.
+  *model_proto.mutable_denormalizer_spec() =
+      SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+  ASSERT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+  EXPECT_EQ(util::StatusCode::kUnimplemented,
+            processor.Load(filename).code());
+}
+
+TEST(InferProcessorTest, BrokenTrieTest) {
+  // The root unit of a double array pointing outside of it.
+  const std::string broken_unit = string_util::EncodePOD<uint32>(0x7FFFFC00);
+  for (const auto model_type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    const std::string filename =
+        util::JoinPath(::testing::TempDir(), "infer_broken_trie_model");
+    ASSERT_TRUE(io::SaveFastModel(filename, MakeModelProto(model_type)).ok());
+    std::string blob;
+    {
+      auto input = filesystem::NewReadableFile(filename, true);
+      ASSERT_TRUE(input->ReadAll(&blob));
+    }
+    absl::string_view serialized, trie_blob, frequent_words;
+    ASSERT_TRUE(
+        DecodeFastModel(blob, &serialized, &trie_blob, &frequent_words).ok());
+
+    // The files have valid checksums, so the tries are rejected by their
+    // bounds.
+    ModelProto model_proto;
+    ASSERT_TRUE(model_proto.ParseFromArray(serialized.data(),
+                                           serialized.size()));
+    std::string *charsmap =
+        model_proto.mutable_normalizer_spec()->mutable_precompiled_charsmap();
+    ASSERT_LT(8, charsmap->size());
+    charsmap->replace(4, 4, broken_unit);
+    std::string broken;
+    ASSERT_TRUE(EncodeFastModel(model_proto.SerializeAsString(), trie_blob,
+                                frequent_words, &broken)
+                    .ok());
+    Processor processor;
+    EXPECT_FALSE(processor.LoadFromFastModel(broken).ok());
+
+    if (model_type == TrainerSpec::UNIGRAM) {
+      // <max number of prefix matches (4byte)><double array trie>
+      std::string broken_trie(trie_blob.data(), trie_blob.size());
+      broken_trie.replace(4, 4, broken_unit);
+      ASSERT_TRUE(
+          EncodeFastModel(serialized, broken_trie, frequent_words, &broken)
+              .ok());
+      EXPECT_FALSE(processor.LoadFromFastModel(broken).ok());
+    }
+  }
+}
+
+}  // namespace
+}  // namespace infer
+}  // namespace sentencepiece
@@ -15,21 +15,36 @@
 #include "sentencepiece_processor.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <functional>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "bpe_model.h"
 #include "common.h"
+#include "fast_model.h"
 #include "filesystem.h"
+#include "memory_placement.h"
 #include "model_factory.h"
 #include "model_interface.h"
 #include "normalizer.h"
 #include "sentencepiece.pb.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/strings/match.h"
 #include "third_party/absl/strings/numbers.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
@@ -37,15 +52,56 @@
 #include "third_party/absl/strings/str_split.h"
 #include "third_party/absl/strings/string_view.h"
 #include "third_party/absl/strings/strip.h"
+#include "trace.h"
 #include "unigram_model.h"
 #include "util.h"
 
+#ifndef OS_WIN
+#include <pthread.h>
+#endif
+
 namespace sentencepiece {
 namespace {
 
 // Replaces white space with U+2581 (LOWER ONE EIGHT BLOCK).
 const char kSpaceSymbol[] = "\xe2\x96\x81";
 
+// Input bytes normalized at a time by the truncated and the windowed
+// encodings, unless the fused encoding window is set.
+constexpr size_t kIncrementalEncodeWindow = 4096;
+
+// Returns the size of the complete words at the start of `normalized`,
+// which are followed by the space symbol of the next word. 0 if none.
+size_t LastWordBoundary(absl::string_view normalized,
+                        bool treat_ws_as_suffix) {
+  const size_t pos = normalized.rfind(kSpaceSymbol);
+  if (pos == absl::string_view::npos) return 0;
+  return treat_ws_as_suffix ? pos + sizeof(kSpaceSymbol) - 1 : pos;
+}
+
+// Joins the n-th results of the segments of an input into its n-th
+// result, adding the scores. A segment with fewer results repeats its last
+// one.
+NBestEncodeResult JoinSegmentResults(
+    const std::vector<NBestEncodeResult> &segments) {
+  if (segments.size() == 1) return segments[0];
+  size_t size = 0;
+  for (const auto &results : segments) size = std::max(size, results.size());
+  NBestEncodeResult joined(size);
+  for (size_t n = 0; n < size; ++n) {
+    auto &result = joined[n];
+    result.second = 0.0;
+    for (const auto &results : segments) {
+      if (results.empty()) continue;
+      const auto &segment = results[std::min(n, results.size() - 1)];
+      result.first.insert(result.first.end(), segment.first.begin(),
+                          segment.first.end());
+      result.second += segment.second;
+    }
+  }
+  return joined;
+}
+
 // Encodes <unk> into U+2047 (DOUBLE QUESTION MARK),
 // since this character can be useful both for user and
 // developer. We can easily figure out that <unk> is emitted.
@@ -88,6 +144,131 @@ void ConvertToUnicodeSpansInternal(SentencePieceText *spt) {
   }
 }
 
+// Counts the Unicode characters of a text before byte offsets given in
+// non-decreasing order, walking the text once over all the calls. An offset
+// inside a character gives the index of that character as
+// ConvertToUnicodeSpansInternal() does.
+class UnicodeOffsetCounter {
+ public:
+  explicit UnicodeOffsetCounter(absl::string_view text) : text_(text) {}
+
+  uint32_t Count(size_t offset) {
+    if (offset < pos_) pos_ = chars_ = 0;  // Starts over.
+    offset = std::min(offset, text_.size());
+    while (pos_ < offset) {
+      const size_t mblen = std::min<size_t>(
+          std::max<size_t>(1, string_util::OneCharLen(text_.data() + pos_)),
+          text_.size() - pos_);
+      if (pos_ + mblen > offset) break;
+      pos_ += mblen;
+      ++chars_;
+    }
+    return chars_;
+  }
+
+ private:
+  const absl::string_view text_;
+  size_t pos_ = 0;
+  uint32_t chars_ = 0;
+};
+
+constexpr int kMaxBatchThreads = 256;
+
+// Settings of ConfigureThreadPools() and the process-wide pool.
+struct SharedPoolConfig {
+  std::mutex mutex;
+  int num_threads = 0;
+  bool started = false;  // The process-wide pool is running.
+  std::shared_ptr<ThreadPool> pool;
+};
+
+SharedPoolConfig *GetSharedPoolConfig() {
+  static auto *config = []() {
+    auto *config = new SharedPoolConfig;
+#ifndef OS_WIN
+    // Holds the mutex across fork(), so that the child does not inherit it
+    // locked by a thread which does not exist there.
+    static SharedPoolConfig *const forked_config = config;
+    pthread_atfork([]() { forked_config->mutex.lock(); },
+                   []() { forked_config->mutex.unlock(); },
+                   []() { forked_config->mutex.unlock(); });
+#endif
+    return config;
+  }();
+  return config;
+}
+
+// Returns the process-wide pool of GetDefaultNumThreads() threads. It is
+// never destroyed, so that it outlives the processors and the callers of
+// RunOnSharedThreadPool() at the exit. The child of a fork() starts a new
+// pool, as the workers of the parent are not copied.
+std::shared_ptr<ThreadPool> GetSharedThreadPool() {
+  const int size = GetDefaultNumThreads();
+  auto *config = GetSharedPoolConfig();
+  std::lock_guard<std::mutex> lock(config->mutex);
+  if (config->pool == nullptr || config->pool->forked()) {
+    config->started = true;
+    config->pool = std::make_shared<ThreadPool>(
+        std::max<int>(1, std::min<int>(size, kMaxBatchThreads)),
+        placement::WorkerInitializer());
+  }
+  return config->pool;
+}
+
+}  // namespace
+
+util::Status ConfigureThreadPools(int num_threads,
+                                  const std::vector<int> &cpus) {
+  for (const int cpu : cpus) {
+    CHECK_GE_OR_RETURN(cpu, 0) << "invalid cpu.";
+  }
+  auto *config = GetSharedPoolConfig();
+  std::lock_guard<std::mutex> lock(config->mutex);
+  CHECK_OR_RETURN(!config->started)
+      << "The process-wide thread pool has already started.";
+  config->num_threads = std::max(num_threads, 0);
+  placement::SetWorkerCpus(cpus);
+  return util::OkStatus();
+}
+
+int GetDefaultNumThreads() {
+  {
+    auto *config = GetSharedPoolConfig();
+    std::lock_guard<std::mutex> lock(config->mutex);
+    if (config->num_threads > 0) return config->num_threads;
+  }
+  static const int num_cpus = placement::AvailableCpus();
+  return num_cpus;
+}
+
+void RunOnSharedThreadPool(size_t size, int num_threads,
+                           const std::function<void(size_t, size_t)> &func) {
+  if (num_threads <= 0) num_threads = GetDefaultNumThreads();
+  num_threads = std::min(num_threads, kMaxBatchThreads);
+  if (num_threads <= 1 || size <= 1) {
+    if (size > 0) func(0, size);
+    return;
+  }
+  // A few chunks per thread balance uneven inputs, even in small batches.
+  constexpr size_t kChunksPerThread = 4;
+  const size_t chunk_size =
+      std::max<size_t>(1, size / (kChunksPerThread * num_threads));
+  GetSharedThreadPool()->ParallelFor(
+      size, chunk_size,
+      [&func](int32, int64 begin, int64 end) { func(begin, end); },
+      num_threads);
+}
+
+namespace {
+// Returns a `T` allocated on a protobuf Arena which the pointer owns, so
+// that the pieces of a result and their strings are allocated by bumping a
+// pointer, and freed at once with the last copy of the pointer.
+template <typename T>
+std::shared_ptr<T> MakeArenaMessage() {
+  auto arena = std::make_shared<google::protobuf::Arena>();
+  T *message = google::protobuf::Arena::CreateMessage<T>(arena.get());
+  return std::shared_ptr<T>(std::move(arena), message);
+}
 }  // namespace
 
 ImmutableSentencePieceText::ImmutableSentencePieceText()
@@ -130,14 +311,10 @@ uint32_t ImmutableSentencePieceText_ImmutableSentencePiece::end() const {
   return sp_->end();
 }
 
-std::vector<ImmutableSentencePieceText_ImmutableSentencePiece>
+ImmutableRepeatedView<ImmutableSentencePieceText_ImmutableSentencePiece,
+                      ImmutableSentencePieceText>
 ImmutableSentencePieceText::pieces() const {
-  std::vector<ImmutableSentencePieceText_ImmutableSentencePiece> pieces(
-      spt_->pieces_size());
-  for (int i = 0; i < spt_->pieces_size(); ++i)
-    pieces[i] =
-        ImmutableSentencePieceText_ImmutableSentencePiece(spt_->pieces(i));
-  return pieces;
+  return {*this, &ImmutableSentencePieceText::pieces, pieces_size()};
 }
 
 size_t ImmutableSentencePieceText::pieces_size() const {
@@ -159,7 +336,7 @@ float ImmutableSentencePieceText::score() const {
 
 SentencePieceText *ImmutableSentencePieceText::mutable_proto() {
   if (rep_ == nullptr) {
-    rep_ = std::make_shared<SentencePieceText>();
+    rep_ = MakeArenaMessage<SentencePieceText>();
     spt_ = rep_.get();
   }
   return rep_.get();
@@ -185,18 +362,15 @@ ImmutableSentencePieceText ImmutableNBestSentencePieceText::nbests(
   return ImmutableSentencePieceText(rep_->nbests(index));
 }
 
-std::vector<ImmutableSentencePieceText>
+ImmutableRepeatedView<ImmutableSentencePieceText,
+                      ImmutableNBestSentencePieceText>
 ImmutableNBestSentencePieceText::nbests() const {
-  if (rep_ == nullptr) return {};
-  std::vector<ImmutableSentencePieceText> nbests(rep_->nbests_size());
-  for (int i = 0; i < rep_->nbests_size(); ++i)
-    nbests[i] = ImmutableSentencePieceText(rep_->nbests(i));
-  return nbests;
+  return {*this, &ImmutableNBestSentencePieceText::nbests, nbests_size()};
 }
 
 NBestSentencePieceText *ImmutableNBestSentencePieceText::mutable_proto() {
   if (rep_ == nullptr) {
-    rep_ = std::make_shared<NBestSentencePieceText>();
+    rep_ = MakeArenaMessage<NBestSentencePieceText>();
   }
   return rep_.get();
 }
@@ -212,13 +386,651 @@ util::bytes ImmutableNBestSentencePieceText::SerializeAsString() const {
   return rep_ ? rep_->SerializeAsString() : "";
 }
 
-SentencePieceProcessor::SentencePieceProcessor() {}
+uint64_t ProcessorMetrics::Histogram::Quantile(double q) const {
+  if (count == 0) return 0;
+  const double rank = std::min(std::max(q, 0.0), 1.0) * count;
+  uint64_t accumulated = 0;
+  for (int i = 0; i < kNumBuckets - 1; ++i) {
+    accumulated += buckets[i];
+    if (accumulated >= rank && accumulated > 0) return uint64_t(2) << i;
+  }
+  return uint64_t(1) << kNumBuckets;
+}
+
+// Atomic counterpart of ProcessorMetrics, updated by concurrent calls with
+// relaxed increments.
+class MetricsRecorder {
+ public:
+  // Per-call results of Encode().
+  struct EncodeCall {
+    size_t input_bytes = 0;
+    size_t output_pieces = 0;
+    size_t unk_pieces = 0;
+    size_t byte_fallback_pieces = 0;
+    uint64_t normalize_ns = 0;
+    uint64_t model_ns = 0;
+    uint64_t populate_ns = 0;
+  };
+
+  MetricsRecorder() { Reset(); }
+
+  void RecordEncode(const EncodeCall &call) {
+    Add(&encode_calls_, 1);
+    Add(&input_bytes_, call.input_bytes);
+    Add(&output_pieces_, call.output_pieces);
+    Add(&unk_pieces_, call.unk_pieces);
+    Add(&byte_fallback_pieces_, call.byte_fallback_pieces);
+    normalize_.Add(call.normalize_ns);
+    model_.Add(call.model_ns);
+    populate_.Add(call.populate_ns);
+    encode_.Add(call.normalize_ns + call.model_ns + call.populate_ns);
+  }
+
+  void RecordDecode(size_t pieces, uint64_t ns) {
+    Add(&decode_calls_, 1);
+    Add(&decode_pieces_, pieces);
+    decode_.Add(ns);
+  }
+
+  void CopyTo(ProcessorMetrics *metrics) const {
+    metrics->encode_calls = encode_calls_.load(std::memory_order_relaxed);
+    metrics->input_bytes = input_bytes_.load(std::memory_order_relaxed);
+    metrics->output_pieces = output_pieces_.load(std::memory_order_relaxed);
+    metrics->unk_pieces = unk_pieces_.load(std::memory_order_relaxed);
+    metrics->byte_fallback_pieces =
+        byte_fallback_pieces_.load(std::memory_order_relaxed);
+    normalize_.CopyTo(&metrics->normalize);
+    model_.CopyTo(&metrics->model);
+    populate_.CopyTo(&metrics->populate);
+    encode_.CopyTo(&metrics->encode);
+    metrics->decode_calls = decode_calls_.load(std::memory_order_relaxed);
+    metrics->decode_pieces = decode_pieces_.load(std::memory_order_relaxed);
+    decode_.CopyTo(&metrics->decode);
+  }
+
+  void Reset() {
+    for (auto *counter : {&encode_calls_, &input_bytes_, &output_pieces_,
+                          &unk_pieces_, &byte_fallback_pieces_,
+                          &decode_calls_, &decode_pieces_}) {
+      counter->store(0, std::memory_order_relaxed);
+    }
+    for (auto *histogram : {&normalize_, &model_, &populate_, &encode_,
+                            &decode_}) {
+      histogram->Reset();
+    }
+  }
+
+ private:
+  static void Add(std::atomic<uint64_t> *counter, uint64_t value) {
+    counter->fetch_add(value, std::memory_order_relaxed);
+  }
+
+  struct Histogram {
+    static constexpr int kNumBuckets = ProcessorMetrics::Histogram::kNumBuckets;
+
+    void Add(uint64_t ns) {
+      int bucket = 0;
+      for (uint64_t v = ns; v >= 2 && bucket < kNumBuckets - 1; v >>= 1) {
+        ++bucket;
+      }
+      MetricsRecorder::Add(&count, 1);
+      MetricsRecorder::Add(&sum_ns, ns);
+      MetricsRecorder::Add(&buckets[bucket], 1);
+    }
+
+    void CopyTo(ProcessorMetrics::Histogram *histogram) const {
+      histogram->count = count.load(std::memory_order_relaxed);
+      histogram->sum_ns = sum_ns.load(std::memory_order_relaxed);
+      for (int i = 0; i < kNumBuckets; ++i) {
+        histogram->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    void Reset() {
+      count.store(0, std::memory_order_relaxed);
+      sum_ns.store(0, std::memory_order_relaxed);
+      for (auto &bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> buckets[kNumBuckets];
+  };
+
+  std::atomic<uint64_t> encode_calls_;
+  std::atomic<uint64_t> input_bytes_;
+  std::atomic<uint64_t> output_pieces_;
+  std::atomic<uint64_t> unk_pieces_;
+  std::atomic<uint64_t> byte_fallback_pieces_;
+  Histogram normalize_;
+  Histogram model_;
+  Histogram populate_;
+  Histogram encode_;
+  std::atomic<uint64_t> decode_calls_;
+  std::atomic<uint64_t> decode_pieces_;
+  Histogram decode_;
+};
+
+// Surfaces of all the ids, precomputed at load time for the ids-to-text
+// decoder. The surfaces are stored back to back in one buffer. The surface
+// without the leading whitespace of a piece starting with kSpaceSymbol is
+// the same bytes minus the first one, so both forms share the storage.
+//
+// With a denormalizer, the denormalized forms of the surfaces are stored
+// as well for the pieces whose surfaces no denormalization rule matches
+// across, so that the text of such pieces is denormalized piece by piece.
+class DecodeTable {
+ public:
+  struct Entry {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int16_t byte = -1;            // Value of a byte piece, or -1.
+    bool space_prefixed = false;  // The piece starts with kSpaceSymbol.
+  };
+
+  // Denormalized surfaces of an entry: the whole surface is at `offset`
+  // and the one without the leading whitespace follows it.
+  struct DenormalizedEntry {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint32_t stripped_length = 0;
+    bool valid = false;  // The surface can be denormalized by itself.
+  };
+
+  // `denormalizer` can be null.
+  DecodeTable(const ModelInterface &model, absl::string_view unk_surface,
+              const normalizer::Normalizer *denormalizer) {
+    const int size = model.GetPieceSize();
+    entries_.resize(size);
+    for (int id = 0; id < size; ++id) {
+      auto &entry = entries_[id];
+      entry.offset = surfaces_.size();
+      if (model.IsByte(id)) {
+        entry.byte = PieceToByte(model.IdToPiece(id));
+      } else if (model.IsUnknown(id)) {
+        surfaces_.append(unk_surface.data(), unk_surface.size());
+      } else if (!model.IsControl(id)) {
+        const absl::string_view piece = model.IdToPiece(id);
+        entry.space_prefixed = absl::StartsWith(piece, kSpaceSymbol);
+        surfaces_.append(absl::StrReplaceAll(piece, {{kSpaceSymbol, " "}}));
+      }
+      entry.length = surfaces_.size() - entry.offset;
+    }
+    if (denormalizer != nullptr) InitDenormalized(*denormalizer);
+  }
+
+  int size() const { return entries_.size(); }
+  const Entry &entry(int id) const { return entries_[id]; }
+
+  size_t MemoryUsage() const {
+    return port::VectorBytes(entries_) + port::StringBytes(surfaces_) +
+           port::VectorBytes(denormalized_entries_) +
+           port::StringBytes(denormalized_);
+  }
+
+  // Returns true if the text of the `size` ids at `ids` can be decoded with
+  // `denormalize` = true, i.e., all the ids are in range and are pieces
+  // whose surfaces are denormalized by themselves. Byte pieces are not, as
+  // their characters are only known after decoding the run of bytes.
+  bool CanDenormalize(const int *ids, size_t size) const {
+    if (denormalized_entries_.empty()) return false;
+    for (const int *it = ids; it != ids + size; ++it) {
+      if (*it < 0 || *it >= this->size() ||
+          !denormalized_entries_[*it].valid) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns the surface of `entry`, without its leading whitespace if
+  // `strip_space` is true and the piece starts with kSpaceSymbol.
+  absl::string_view Surface(const Entry &entry, bool strip_space) const {
+    const int strip = strip_space && entry.space_prefixed ? 1 : 0;
+    return absl::string_view(surfaces_.data() + entry.offset + strip,
+                             entry.length - strip);
+  }
+
+  // Returns the denormalized surface of `id` as Surface() does.
+  absl::string_view DenormalizedSurface(int id, bool strip_space) const {
+    const DenormalizedEntry &entry = denormalized_entries_[id];
+    if (strip_space && entries_[id].space_prefixed) {
+      return absl::string_view(
+          denormalized_.data() + entry.offset + entry.length,
+          entry.stripped_length);
+    }
+    return absl::string_view(denormalized_.data() + entry.offset,
+                             entry.length);
+  }
+
+  // Appends `bytes` to `text` one Unicode character at a time. A
+  // structurally invalid byte becomes REPLACEMENT CHARACTER (U+FFFD).
+  static void AppendBytes(absl::string_view bytes, std::string *text) {
+    while (!bytes.empty()) {
+      size_t consumed = 0;
+      if (string_util::IsValidDecodeUTF8(bytes, &consumed)) {
+        text->append(bytes.data(), consumed);
+      } else {
+        text->append(kReplacementCharacter);
+        consumed = 1;
+      }
+      bytes.remove_prefix(consumed);
+    }
+  }
+
+  // Decodes the `size` ids at `ids` and appends the text to `text` with the
+  // same rules as Decode() into a SentencePieceText. The leading whitespace
+  // of the first pieces is stripped if `strip_bos_ws`;
+  // `remove_extra_whitespaces` keeps stripping it until the appended text
+  // becomes non-empty. With `denormalize`, which requires
+  // CanDenormalize(ids, size), the denormalized surfaces are appended, so
+  // the text is the denormalization of the decoded one. `text` is left
+  // unchanged on error.
+  util::Status Decode(const int *ids, size_t size, bool strip_bos_ws,
+                      bool remove_extra_whitespaces, bool denormalize,
+                      std::string *text) const {
+    const size_t start = text->size();
+    std::string bytes;
+    bool is_bos_ws = strip_bos_ws;
+    bool bos_ws_seen = false;
+    // Whether the text before the denormalization is non-empty, which
+    // the stripping of the leading whitespace depends on.
+    bool appended = false;
+    for (const int *it = ids; it != ids + size; ++it) {
+      const int id = *it;
+      if (id < 0 || id >= this->size()) {
+        text->resize(start);
+        return util::Status(util::StatusCode::kOutOfRange,
+                            absl::StrCat("Invalid id: ", id));
+      }
+      const Entry &entry = entries_[id];
+      if (entry.byte >= 0) {
+        bytes.push_back(static_cast<char>(entry.byte));
+        continue;
+      }
+      if (!bytes.empty()) {
+        AppendBytes(bytes, text);
+        bytes.clear();
+        appended = true;
+      }
+      if (is_bos_ws) {
+        if (bos_ws_seen || appended) {
+          is_bos_ws = false;
+        } else {
+          bos_ws_seen = entry.space_prefixed && !remove_extra_whitespaces;
+        }
+      }
+      const absl::string_view surface =
+          denormalize ? DenormalizedSurface(id, is_bos_ws)
+                      : Surface(entry, is_bos_ws);
+      text->append(surface.data(), surface.size());
+      if (entry.length > (is_bos_ws && entry.space_prefixed ? 1 : 0)) {
+        appended = true;
+      }
+    }
+    AppendBytes(bytes, text);
+    return util::OkStatus();
+  }
+
+ private:
+  void InitDenormalized(const normalizer::Normalizer &denormalizer) {
+    denormalized_entries_.resize(entries_.size());
+    bool any_valid = false;
+    for (size_t id = 0; id < entries_.size(); ++id) {
+      const Entry &entry = entries_[id];
+      auto &denormalized = denormalized_entries_[id];
+      if (entry.byte >= 0) continue;
+      const absl::string_view surface = Surface(entry, false);
+      if (!denormalizer.CanSplitAfter(surface)) continue;
+      denormalized.valid = any_valid = true;
+      denormalized.offset = denormalized_.size();
+      denormalized_.append(denormalizer.Normalize(surface));
+      denormalized.length = denormalized_.size() - denormalized.offset;
+      if (entry.space_prefixed) {
+        denormalized_.append(denormalizer.Normalize(Surface(entry, true)));
+        denormalized.stripped_length =
+            denormalized_.size() - denormalized.offset - denormalized.length;
+      }
+    }
+    if (!any_valid) {
+      denormalized_entries_.clear();
+      denormalized_entries_.shrink_to_fit();
+      denormalized_.clear();
+    }
+  }
+
+  std::vector<Entry> entries_;
+  std::string surfaces_;
+  std::vector<DenormalizedEntry> denormalized_entries_;
+  std::string denormalized_;
+};
+
+namespace {
+// Lap times of the phases of a call. The clock is only read when the
+// metrics are compiled in, otherwise the laps are 0.
+class CallTimer {
+ public:
+  CallTimer() : last_(Now()) {}
+
+  // Returns the nanoseconds since the previous Lap() or the construction.
+  uint64_t Lap() {
+    const uint64_t now = Now();
+    const uint64_t lap = now - last_;
+    last_ = now;
+    return lap;
+  }
+
+ private:
+  static uint64_t Now() {
+#ifdef SPM_ENABLE_METRICS
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#else
+    return 0;
+#endif
+  }
+
+  uint64_t last_;
+};
+
+// Appends the ids of `result`, the model output of the next `size` bytes
+// of the normalized text, to `ids`. The run of unknown pieces continues
+// across the calls sharing `is_prev_unk`.
+// Appends the ids of the piece `w` with `id` as PopulateSentencePieceText()
+// does. Returns false if `w` is empty.
+inline bool AppendPieceIds(const ModelInterface &model, absl::string_view w,
+                           int id, bool *is_prev_unk, std::vector<int> *ids,
+                           MetricsRecorder::EncodeCall *call) {
+  if (w.empty()) return false;
+
+  const bool is_unk = model.IsUnknown(id);
+
+  if (model.IsControl(id)) {
+    ids->push_back(id);
+  } else if (is_unk && model.ByteFallbackEnabled()) {
+    // Decomposes an unknown piece into UTF-8 bytes
+    for (const char b : w) {
+      ids->push_back(model.ByteToId(b));
+    }
+    call->byte_fallback_pieces += w.size();
+  } else if (!(*is_prev_unk && is_unk)) {
+    // Continuous run of unknown pieces is merged into one.
+    ids->push_back(id);
+    call->unk_pieces += is_unk;
+  }
+  *is_prev_unk = is_unk;
+  return true;
+}
+
+util::Status AppendIds(const ModelInterface &model, const EncodeResult &result,
+                       size_t size, bool *is_prev_unk, std::vector<int> *ids,
+                       MetricsRecorder::EncodeCall *call) {
+  size_t consumed = 0;
+  for (const auto &p : result) {
+    CHECK_OR_RETURN(
+        AppendPieceIds(model, p.first, p.second, is_prev_unk, ids, call))
+        << "Empty piece is not allowed.";
+    if (!model.IsControl(p.second)) consumed += p.first.size();
+  }
+
+  CHECK_EQ_OR_RETURN(consumed, size)
+      << "all normalized characters are not consumed.";
+  return util::OkStatus();
+}
+
+// Returns the longest prefix of `input` of at most `max_bytes` bytes which
+// ends at a UTF-8 character boundary, or `input` if `max_bytes` is 0.
+absl::string_view CutAtCharBoundary(absl::string_view input,
+                                    size_t max_bytes) {
+  if (max_bytes == 0 || input.size() <= max_bytes) return input;
+  size_t size = max_bytes;
+  while (size > 0 && (static_cast<unsigned char>(input[size]) & 0xC0) == 0x80) {
+    --size;
+  }
+  return input.substr(0, size);
+}
+
+// Appends the ids of the results as AppendIds() until there are
+// `max_ids` ids, and counts the normalized bytes of the pieces whose ids
+// are all kept. A piece adding no id, i.e. the continuation of a run of
+// unknown pieces, is kept after the last id.
+class IdTruncator {
+ public:
+  IdTruncator(const ModelInterface &model, size_t max_ids,
+              std::vector<int> *ids, MetricsRecorder::EncodeCall *call)
+      : model_(model), limit_(ids->size() + max_ids), ids_(ids), call_(call) {}
+
+  // Appends the pieces of `result` until a piece is cut.
+  util::Status Append(const EncodeResult &result) {
+    for (const auto &p : result) {
+      if (done_) break;
+      CHECK_OR_RETURN(AppendPieceIds(model_, p.first, p.second, &is_prev_unk_,
+                                     ids_, call_))
+          << "Empty piece is not allowed.";
+      if (ids_->size() > limit_) {
+        ids_->resize(limit_);
+        done_ = true;
+      } else if (!model_.IsControl(p.second)) {
+        normalized_size_ += p.first.size();
+      }
+    }
+    return util::OkStatus();
+  }
+
+  // True after a piece is cut, so no more pieces are kept.
+  bool done() const { return done_; }
+
+  // Normalized bytes of the kept pieces.
+  size_t normalized_size() const { return normalized_size_; }
+
+ private:
+  const ModelInterface &model_;
+  const size_t limit_;
+  std::vector<int> *ids_;
+  MetricsRecorder::EncodeCall *call_;
+  bool is_prev_unk_ = false;
+  bool done_ = false;
+  size_t normalized_size_ = 0;
+};
+
+// Returns true if `piece` is out of `vocab`, i.e., SetVocabulary() marks
+// it as UNUSED. Single characters are always kept.
+bool IsOutOfVocabulary(const ModelProto::SentencePiece &piece,
+                       const std::set<absl::string_view> &vocab) {
+  if (piece.type() == ModelProto::SentencePiece::CONTROL ||
+      piece.type() == ModelProto::SentencePiece::UNKNOWN ||
+      piece.type() == ModelProto::SentencePiece::USER_DEFINED) {
+    return false;
+  }
+  return vocab.find(piece.piece()) == vocab.end() &&
+         string_util::OneCharLen(piece.piece().c_str()) != piece.piece().size();
+}
+
+// Attaches `model` to the shared word cache of its current pieces, if it is
+// attached to one.
+util::Status ReattachSharedWordCache(ModelInterface *model) {
+  const auto &cache = model->shared_word_cache();
+  return cache ? model->SetSharedWordCacheSize(cache->num_slots())
+               : util::OkStatus();
+}
+
+// Returns a key which is equal for the models normalizing an input into the
+// same text and alignment: the normalizer reads the precompiled charsmap,
+// the whitespace flags, and the user defined symbols, which it leaves as is.
+std::string NormalizationKey(const ModelProto &model_proto) {
+  const auto &spec = model_proto.normalizer_spec();
+  std::string key;
+  for (const bool flag :
+       {spec.add_dummy_prefix(), spec.remove_extra_whitespaces(),
+        spec.escape_whitespaces(),
+        model_proto.trainer_spec().treat_whitespace_as_suffix()}) {
+    key.push_back(flag ? '1' : '0');
+  }
+  const std::string &charsmap = spec.precompiled_charsmap();
+  key += ":" + std::to_string(charsmap.size()) + ":" +
+         std::to_string(std::hash<std::string>()(charsmap));
+  for (const auto &sp : model_proto.pieces()) {
+    if (sp.type() == ModelProto::SentencePiece::USER_DEFINED) {
+      key.push_back('\0');
+      key += sp.piece();
+    }
+  }
+  return key;
+}
+
+// Drops the fields of `model_proto` which are not read once the model, the
+// normalizers and the self-test are done with it. Swapping with empty
+// messages frees their memory, while clearing them would keep it for reuse.
+void SlimModelProto(bool has_denormalizer, ModelProto *model_proto) {
+  const TrainerSpec &trainer_spec = model_proto->trainer_spec();
+  TrainerSpec slim;
+  slim.set_model_type(trainer_spec.model_type());
+  slim.set_vocab_size(trainer_spec.vocab_size());
+  slim.set_byte_fallback(trainer_spec.byte_fallback());
+  slim.set_treat_whitespace_as_suffix(
+      trainer_spec.treat_whitespace_as_suffix());
+  slim.set_unk_id(trainer_spec.unk_id());
+  slim.set_bos_id(trainer_spec.bos_id());
+  slim.set_eos_id(trainer_spec.eos_id());
+  slim.set_pad_id(trainer_spec.pad_id());
+  slim.set_unk_piece(trainer_spec.unk_piece());
+  slim.set_bos_piece(trainer_spec.bos_piece());
+  slim.set_eos_piece(trainer_spec.eos_piece());
+  slim.set_pad_piece(trainer_spec.pad_piece());
+  if (trainer_spec.has_unk_surface()) {
+    slim.set_unk_surface(trainer_spec.unk_surface());
+  }
+  model_proto->mutable_trainer_spec()->Swap(&slim);
+
+  SelfTestData().Swap(model_proto->mutable_self_test_data());
+  model_proto->clear_self_test_data();
+  model_proto->mutable_normalizer_spec()->set_normalization_rule_tsv(
+      std::string());
+  if (has_denormalizer) {
+    model_proto->mutable_denormalizer_spec()->set_normalization_rule_tsv(
+        std::string());
+  } else if (model_proto->has_denormalizer_spec()) {
+    NormalizerSpec().Swap(model_proto->mutable_denormalizer_spec());
+    model_proto->clear_denormalizer_spec();
+  }
+}
+}  // namespace
+
+EncodeContext::EncodeContext()
+    : norm_to_orig_(std::make_unique<normalizer::Alignment>()) {}
+EncodeContext::~EncodeContext() {}
+
+FlatSentencePieceText::FlatSentencePieceText() {}
+FlatSentencePieceText::~FlatSentencePieceText() {}
+
+absl::string_view FlatSentencePieceText::piece(size_t index) const {
+  const auto &p = pieces_[index];
+  return absl::string_view(piece_text_)
+      .substr(p.piece_begin, p.piece_end - p.piece_begin);
+}
+
+absl::string_view FlatSentencePieceText::surface(size_t index) const {
+  const auto &p = pieces_[index];
+  if (!p.has_surface) return absl::string_view();
+  return absl::string_view(text_).substr(p.begin, p.end - p.begin);
+}
+
+void FlatSentencePieceText::CopyToProto(SentencePieceText *spt) const {
+  spt->set_text(text_);
+  spt->mutable_pieces()->Reserve(spt->pieces_size() + pieces_.size());
+  for (size_t i = 0; i < pieces_.size(); ++i) {
+    auto *sp = spt->add_pieces();
+    const auto piece = this->piece(i);
+    sp->set_piece(piece.data(), piece.size());
+    sp->set_id(pieces_[i].id);
+    if (pieces_[i].has_surface) {
+      const auto surface = this->surface(i);
+      sp->set_surface(surface.data(), surface.size());
+    }
+    if (unicode_spans_.empty()) {
+      sp->set_begin(pieces_[i].begin);
+      sp->set_end(pieces_[i].end);
+    } else {
+      sp->set_begin(unicode_spans_[i].first);
+      sp->set_end(unicode_spans_[i].second);
+    }
+  }
+}
+
+ImmutableSentencePieceText FlatSentencePieceText::ToImmutableProto() const {
+  ImmutableSentencePieceText spt;
+  CopyToProto(spt.mutable_proto());
+  return spt;
+}
+
+void FlatSentencePieceText::AppendPiece(absl::string_view piece, Piece *p) {
+  if (p->piece_end == p->piece_begin) p->piece_begin = piece_text_.size();
+  piece_text_.append(piece.data(), piece.size());
+  p->piece_end = piece_text_.size();
+}
+
+void FlatSentencePieceText::Clear() {
+  text_.clear();
+  piece_text_.clear();
+  pieces_.clear();
+  unicode_spans_.clear();
+}
+
+SentencePieceProcessor::SentencePieceProcessor() {
+#ifdef SPM_ENABLE_METRICS
+  metrics_ = std::make_unique<MetricsRecorder>();
+#endif
+}
 SentencePieceProcessor::~SentencePieceProcessor() {}
 
 util::Status SentencePieceProcessor::Load(absl::string_view filename) {
+  if (filename.empty()) {
+    return util::NotFoundError("model file path should not be empty.");
+  }
+
+  auto mapped_file = filesystem::NewMappedFile(filename);
+  RETURN_IF_ERROR(mapped_file->status());
+
+  std::string registry_key;
+  if (share_identical_models_) {
+    registry_key = RegistryKey(mapped_file->data());
+    if (AdoptRegisteredModel(registry_key, mapped_file->data())) {
+      model_file_ = std::string(filename);
+      return util::OkStatus();
+    }
+  }
+
+  absl::string_view serialized = mapped_file->data(), trie_blob,
+                    frequent_words;
+  const bool is_fast_model = IsFastModel(serialized);
+  if (is_fast_model) {
+    RETURN_IF_ERROR(DecodeFastModel(mapped_file->data(), &serialized,
+                                    &trie_blob, &frequent_words));
+  }
+  // The mapping of a plain model is released below, so that the bytes of
+  // the registry are copied first.
+  std::string registered_bytes;
+  if (!registry_key.empty()) {
+    registered_bytes = std::string(mapped_file->data());
+  }
+
   auto model_proto = std::make_unique<ModelProto>();
-  RETURN_IF_ERROR(io::LoadModelProto(filename, model_proto.get()));
-  return Load(std::move(model_proto));
+  if (!model_proto->ParseFromArray(serialized.data(), serialized.size())) {
+    return util::InternalError(
+        absl::StrCat("could not parse ModelProto from ", filename));
+  }
+
+  // The precompiled trie and the frequent words are used in place, so the
+  // mapping is kept alive.
+  if (!is_fast_model) mapped_file.reset();
+  RETURN_IF_ERROR(LoadInternal(std::move(model_proto), trie_blob,
+                               frequent_words, std::move(mapped_file)));
+  if (!registry_key.empty()) {
+    RegisterModel(registry_key, std::move(registered_bytes));
+  }
+  model_file_ = std::string(filename);
+  return util::OkStatus();
 }
 
 void SentencePieceProcessor::LoadOrDie(absl::string_view filename) {
@@ -233,29 +1045,242 @@ util::Status SentencePieceProcessor::Load(const ModelProto &model_proto) {
 
 util::Status SentencePieceProcessor::LoadFromSerializedProto(
     absl::string_view serialized) {
+  std::string registry_key;
+  if (share_identical_models_) {
+    registry_key = RegistryKey(serialized);
+    if (AdoptRegisteredModel(registry_key, serialized)) {
+      model_file_.clear();
+      return util::OkStatus();
+    }
+  }
   auto model_proto = std::make_unique<ModelProto>();
   CHECK_OR_RETURN(
       model_proto->ParseFromArray(serialized.data(), serialized.size()));
-  return Load(std::move(model_proto));
+  RETURN_IF_ERROR(Load(std::move(model_proto)));
+  if (!registry_key.empty()) {
+    RegisterModel(registry_key, std::string(serialized));
+  }
+  return util::OkStatus();
 }
 
 util::Status SentencePieceProcessor::Load(
     std::unique_ptr<ModelProto> model_proto) {
+  return LoadInternal(std::move(model_proto), "", "", nullptr);
+}
+
+util::Status SentencePieceProcessor::LoadShared(
+    const SentencePieceProcessor &other) {
+  RETURN_IF_ERROR(other.status());
+  CHECK_OR_RETURN(other.model_proto_) << "Model is not loaded.";
+  model_proto_ = other.model_proto_;
+  model_ = other.model_;
+  mapped_file_ = other.mapped_file_;
+  model_file_ = other.model_file_;
+  normalizer_ = other.normalizer_;
+  denormalizer_ = other.denormalizer_;
+  normalization_key_ = other.normalization_key_;
+  decode_table_ = other.decode_table_;
+  // The tables are placed as in `other`.
+  replicas_ = other.replicas_;
+  registered_model_ = other.registered_model_;
+  ResetModelOptions();
+  return util::OkStatus();
+}
+
+void SentencePieceProcessor::ResetModelOptions() {
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    pool_.reset();
+  }
+  // The options are the ones of this processor, which are verified against
+  // each model as after Load().
+  parallel_encode_threshold_ = 0;
+  safe_cut_finder_.reset();
+  fused_encode_window_ = 0;
+  vocabulary_restrictions_.clear();
+}
+
+// The shared members of a processor which loaded the model. The processors
+// using the model hold the entry, so that it expires with the last one.
+struct SentencePieceProcessor::RegisteredModel {
+  std::shared_ptr<ModelInterface> model;
+  std::shared_ptr<normalizer::Normalizer> normalizer;
+  std::shared_ptr<normalizer::Normalizer> denormalizer;
+  std::string normalization_key;
+  std::shared_ptr<ModelProto> model_proto;
+  std::shared_ptr<filesystem::MappedFile> mapped_file;
+  std::shared_ptr<DecodeTable> decode_table;
+  std::vector<Replica> replicas;
+
+  // The serialized model. The key only has a 64-bit fingerprint of it, so
+  // that the bytes are compared before the model is shared.
+  std::string bytes;
+
+  // The registry, keyed by RegistryKey(). The entries are weak, so that
+  // the models are released by their processors; the expired entries are
+  // erased by the next registration.
+  using Registry =
+      absl::flat_hash_map<std::string, std::weak_ptr<const RegisteredModel>>;
+  static std::mutex *GetMutex() {
+    static auto *mutex = new std::mutex;
+    return mutex;
+  }
+  static Registry *GetRegistry() {
+    static auto *registry = new Registry;
+    return registry;
+  }
+};
+
+void SentencePieceProcessor::SetShareIdenticalModels(bool share) {
+  share_identical_models_ = share;
+}
+
+// static
+size_t SentencePieceProcessor::GetNumSharedModels() {
+  std::lock_guard<std::mutex> lock(*RegisteredModel::GetMutex());
+  const auto *registry = RegisteredModel::GetRegistry();
+  return std::count_if(registry->begin(), registry->end(),
+                       [](const auto &it) { return !it.second.expired(); });
+}
+
+std::string SentencePieceProcessor::RegistryKey(
+    absl::string_view bytes) const {
+  // The options change the loaded tables and proto, so that they are part
+  // of the key.
+  std::string key = string_util::IntToHex(SharedWordCache::Fingerprint(bytes));
+  key += ":" + std::to_string(bytes.size()) + ":";
+  for (const bool flag : {slim_load_, huge_page_tables_, numa_replicas_}) {
+    key.push_back(flag ? '1' : '0');
+  }
+  return key;
+}
+
+bool SentencePieceProcessor::AdoptRegisteredModel(const std::string &key,
+                                                  absl::string_view bytes) {
+  std::shared_ptr<const RegisteredModel> entry;
+  {
+    std::lock_guard<std::mutex> lock(*RegisteredModel::GetMutex());
+    const auto *registry = RegisteredModel::GetRegistry();
+    const auto it = registry->find(key);
+    if (it != registry->end()) entry = it->second.lock();
+  }
+  if (!entry || entry->bytes != bytes) return false;
+  model_ = entry->model;
+  normalizer_ = entry->normalizer;
+  denormalizer_ = entry->denormalizer;
+  normalization_key_ = entry->normalization_key;
+  model_proto_ = entry->model_proto;
+  mapped_file_ = entry->mapped_file;
+  decode_table_ = entry->decode_table;
+  replicas_ = entry->replicas;
+  registered_model_ = std::move(entry);
+  ResetModelOptions();
+  return true;
+}
+
+void SentencePieceProcessor::RegisterModel(const std::string &key,
+                                           std::string bytes) {
+  auto entry = std::make_shared<RegisteredModel>();
+  entry->model = model_;
+  entry->normalizer = normalizer_;
+  entry->denormalizer = denormalizer_;
+  entry->normalization_key = normalization_key_;
+  entry->model_proto = model_proto_;
+  entry->mapped_file = mapped_file_;
+  entry->decode_table = decode_table_;
+  entry->replicas = replicas_;
+  entry->bytes = std::move(bytes);
+  {
+    std::lock_guard<std::mutex> lock(*RegisteredModel::GetMutex());
+    auto *registry = RegisteredModel::GetRegistry();
+    for (auto it = registry->begin(); it != registry->end();) {
+      if (it->second.expired()) {
+        registry->erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    auto &registered = (*registry)[key];
+    const auto alive = registered.lock();
+    if (!alive) {
+      registered = entry;
+      registered_model_ = std::move(entry);
+      return;
+    }
+    // Different bytes with the same fingerprint. The model loaded here is
+    // kept and not shared.
+    if (alive->bytes != entry->bytes) return;
+  }
+  // Another processor loaded the same bytes concurrently. Its model is used
+  // and the one loaded here is released.
+  AdoptRegisteredModel(key, entry->bytes);
+}
+
+util::Status SentencePieceProcessor::CheckModelNotShared() const {
+  CHECK_OR_RETURN(model_.use_count() <= 1)
+      << "The model is shared by LoadShared() and cannot be changed.";
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::LoadInternal(
+    std::unique_ptr<ModelProto> model_proto, absl::string_view trie_blob,
+    absl::string_view frequent_words,
+    std::unique_ptr<filesystem::MappedFile> mapped_file) {
   model_proto_ = std::move(model_proto);
-  model_ = ModelFactory::Create(*model_proto_);
-  normalizer_ = std::make_unique<normalizer::Normalizer>(
-      model_proto_->normalizer_spec(), model_proto_->trainer_spec());
-  if (model_proto_->has_denormalizer_spec() &&
-      !model_proto_->denormalizer_spec().precompiled_charsmap().empty()) {
-    denormalizer_ = std::make_unique<normalizer::Normalizer>(
-        model_proto_->denormalizer_spec());
+  mapped_file_ = std::move(mapped_file);
+  model_file_.clear();
+  registered_model_.reset();
+  // The parallel and the fused encoding are verified against each model.
+  parallel_encode_threshold_ = 0;
+  safe_cut_finder_.reset();
+  fused_encode_window_ = 0;
+  vocabulary_restrictions_.clear();
+
+  // The normalizers do not depend on the model. When a chars map is to be
+  // decoded into their lookup tables, they are built on a helper thread
+  // while this thread builds the pieces and the trie of the model.
+  const bool has_denormalizer =
+      model_proto_->has_denormalizer_spec() &&
+      !model_proto_->denormalizer_spec().precompiled_charsmap().empty();
+  auto build_normalizers = [this, has_denormalizer]() {
+    normalizer_ = std::make_unique<normalizer::Normalizer>(
+        model_proto_->normalizer_spec(), model_proto_->trainer_spec());
+    if (has_denormalizer) {
+      denormalizer_ = std::make_unique<normalizer::Normalizer>(
+          model_proto_->denormalizer_spec());
+    }
+  };
+  if (num_threads_ != 1 &&
+      (has_denormalizer ||
+       !model_proto_->normalizer_spec().precompiled_charsmap().empty())) {
+    std::thread helper(build_normalizers);
+    model_ = ModelFactory::Create(*model_proto_, trie_blob);
+    helper.join();
+  } else {
+    model_ = ModelFactory::Create(*model_proto_, trie_blob);
+    build_normalizers();
   }
 
   // Escapes user-defined-symbols in normalizer.
   normalizer_->SetPrefixMatcher(model_->prefix_matcher());
+  normalization_key_ = NormalizationKey(*model_proto_);
 
   RETURN_IF_ERROR(status());
 
+  if (!frequent_words.empty()) {
+    RETURN_IF_ERROR(model_->SetFrequentWordTable(
+        std::make_shared<FrequentWordTable>(frequent_words)));
+  }
+
+  decode_table_ = std::make_unique<DecodeTable>(
+      *model_,
+      model_proto_->trainer_spec().has_unk_surface()
+          ? model_proto_->trainer_spec().unk_surface()
+          : kDefaultUnknownSymbol,
+      denormalizer_.get());
+
+  RETURN_IF_ERROR(PlaceTables(huge_page_tables_));
+
   // Running self-testing.
   std::vector<std::string> errors, sps;
   for (const auto &s : model_proto_->self_test_data().samples()) {
@@ -277,12 +1302,49 @@ util::Status SentencePieceProcessor::Load(
     return util::InternalError("Self-test failures. See LOG(INFO).");
   }
 
+  if (slim_load_) SlimModelProto(denormalizer_ != nullptr, model_proto_.get());
+
   return util::OkStatus();
 }
 
 util::Status SentencePieceProcessor::SetEncodeExtraOptions(
     absl::string_view extra_options) {
-  return ParseExtraOptions(extra_options, &encode_extra_options_);
+  // "word_cache=<size>" and "shared_word_cache=<slots>" configure the model
+  // instead of the output.
+  std::vector<absl::string_view> options;
+  size_t word_cache_size = 0, shared_word_cache_size = 0;
+  for (absl::string_view option : absl::StrSplit(extra_options, ":")) {
+    if (absl::ConsumePrefix(&option, "word_cache=")) {
+      CHECK_OR_RETURN(absl::SimpleAtoi(option, &word_cache_size))
+          << "invalid word_cache size \"" << option << "\".";
+    } else if (absl::ConsumePrefix(&option, "shared_word_cache=")) {
+      CHECK_OR_RETURN(absl::SimpleAtoi(option, &shared_word_cache_size))
+          << "invalid shared_word_cache size \"" << option << "\".";
+    } else {
+      options.push_back(option);
+    }
+  }
+  RETURN_IF_ERROR(
+      ParseExtraOptions(absl::StrJoin(options, ":"), &encode_extra_options_));
+
+  if (word_cache_size > 0 || shared_word_cache_size > 0) {
+    RETURN_IF_ERROR(status());
+  }
+  if (model_ && (word_cache_size > 0 || model_->word_cache())) {
+    RETURN_IF_ERROR(CheckModelNotShared());
+    RETURN_IF_ERROR(model_->SetWordCacheSize(word_cache_size));
+  }
+  if (model_ &&
+      (shared_word_cache_size > 0 || model_->shared_word_cache())) {
+    RETURN_IF_ERROR(CheckModelNotShared());
+    RETURN_IF_ERROR(model_->SetSharedWordCacheSize(shared_word_cache_size));
+    for (const auto &replica : replicas_) {
+      if (!replica.model) continue;
+      RETURN_IF_ERROR(
+          replica.model->SetSharedWordCacheSize(shared_word_cache_size));
+    }
+  }
+  return util::OkStatus();
 }
 
 util::Status SentencePieceProcessor::SetDecodeExtraOptions(
@@ -301,6 +1363,8 @@ util::Status SentencePieceProcessor::status() const {
 util::Status SentencePieceProcessor::SetVocabulary(
     const std::vector<absl::string_view> &valid_vocab) {
   RETURN_IF_ERROR(status());
+  RETURN_IF_ERROR(CheckModelNotShared());
+  model_file_.clear();
 
   // TODO(taku): supports vocabulary constraint in BPE model.
   const auto type = model_proto_->trainer_spec().model_type();
@@ -317,30 +1381,219 @@ util::Status SentencePieceProcessor::SetVocabulary(
         piece->type() == ModelProto::SentencePiece::USER_DEFINED) {
       continue;
     }
-    if (vocab.find(piece->piece()) != vocab.end() ||
-        string_util::OneCharLen(piece->piece().c_str()) ==
-            piece->piece().size()) {
-      piece->set_type(ModelProto::SentencePiece::NORMAL);
-    } else {
-      piece->set_type(ModelProto::SentencePiece::UNUSED);
+    piece->set_type(IsOutOfVocabulary(*piece, vocab)
+                        ? ModelProto::SentencePiece::UNUSED
+                        : ModelProto::SentencePiece::NORMAL);
+  }
+  model_->UpdatePieceTypes();
+  if (model_->word_cache()) model_->word_cache()->Clear();
+  // The precomputed segmentations are for the whole vocabulary, and the
+  // shared cache is the one of the pieces of the new types.
+  RETURN_IF_ERROR(model_->SetFrequentWordTable(nullptr));
+  RETURN_IF_ERROR(ReattachSharedWordCache(model_.get()));
+  for (const auto &replica : replicas_) {
+    if (!replica.model) continue;
+    replica.model->UpdatePieceTypes();
+    RETURN_IF_ERROR(replica.model->SetFrequentWordTable(nullptr));
+    RETURN_IF_ERROR(ReattachSharedWordCache(replica.model.get()));
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::AddVocabularyRestriction(
+    const std::vector<absl::string_view> &valid_vocab, int *index) {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(index) << "output index is null";
+
+  const auto type = model_proto_->trainer_spec().model_type();
+  CHECK_OR_RETURN(type == TrainerSpec::UNIGRAM || type == TrainerSpec::BPE)
+      << "Vocabulary constraint is only enabled in subword units.";
+
+  const std::set<absl::string_view> vocab(valid_vocab.begin(),
+                                          valid_vocab.end());
+  auto restriction =
+      std::make_unique<VocabularyRestriction>(model_proto_->pieces_size());
+  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
+    if (IsOutOfVocabulary(model_proto_->pieces(i), vocab)) {
+      restriction->SetUnused(i);
     }
   }
+  *index = vocabulary_restrictions_.size();
+  vocabulary_restrictions_.push_back(std::move(restriction));
+
+  return util::OkStatus();
+}
 
+util::Status SentencePieceProcessor::GetVocabularyRestriction(
+    const EncodeOptions &options,
+    const VocabularyRestriction **restriction) const {
+  *restriction = nullptr;
+  if (options.vocabulary < 0) return util::OkStatus();
+  CHECK_LT_OR_RETURN(options.vocabulary,
+                     static_cast<int>(vocabulary_restrictions_.size()))
+      << "unknown vocabulary restriction";
+  *restriction = vocabulary_restrictions_[options.vocabulary].get();
   return util::OkStatus();
 }
 
 util::Status SentencePieceProcessor::ResetVocabulary() {
   RETURN_IF_ERROR(status());
+  RETURN_IF_ERROR(CheckModelNotShared());
+  model_file_.clear();
   for (auto &piece : *(model_proto_->mutable_pieces())) {
     if (piece.type() == ModelProto::SentencePiece::UNUSED)
       piece.set_type(ModelProto::SentencePiece::NORMAL);
   }
+  model_->UpdatePieceTypes();
+  if (model_->word_cache()) model_->word_cache()->Clear();
+  // The precomputed segmentations are for the whole vocabulary, and the
+  // shared cache is the one of the pieces of the new types.
+  RETURN_IF_ERROR(model_->SetFrequentWordTable(nullptr));
+  RETURN_IF_ERROR(ReattachSharedWordCache(model_.get()));
+  for (const auto &replica : replicas_) {
+    if (!replica.model) continue;
+    replica.model->UpdatePieceTypes();
+    RETURN_IF_ERROR(replica.model->SetFrequentWordTable(nullptr));
+    RETURN_IF_ERROR(ReattachSharedWordCache(replica.model.get()));
+  }
 
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::LoadVocabulary(absl::string_view filename,
-                                                    int threshold) {
+util::Status SentencePieceProcessor::GetWordCacheStats(int64_t *hits,
+                                                       int64_t *misses) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(hits) << "output is null";
+  CHECK_OR_RETURN(misses) << "output is null";
+  const auto *cache = model_->word_cache();
+  *hits = cache ? cache->hits() : 0;
+  *misses = cache ? cache->misses() : 0;
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::BuildFrequentWordTable(
+    const std::vector<absl::string_view> &sentences, size_t size,
+    std::string *table) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(table) << "output table is null";
+  RETURN_IF_ERROR(model_->VerifyWordSplittable());
+
+  const bool treat_ws_as_suffix =
+      model_proto_->trainer_spec().treat_whitespace_as_suffix();
+  absl::flat_hash_map<std::string, int64_t> counts;
+  std::string normalized;
+  for (const auto &sentence : sentences) {
+    RETURN_IF_ERROR(normalizer_->Normalize(
+        sentence, &normalized, static_cast<normalizer::Alignment *>(nullptr)));
+    for (const auto &word :
+         SplitIntoWords(normalized, treat_ws_as_suffix, false)) {
+      ++counts[std::string(word)];
+    }
+  }
+
+  // The most frequent words first, and the ties in the order of the bytes
+  // so that the table does not depend on the hash map.
+  std::vector<std::pair<std::string, int64_t>> sorted(counts.begin(),
+                                                      counts.end());
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  });
+  if (sorted.size() > size) sorted.resize(size);
+
+  std::vector<std::pair<absl::string_view, EncodeResult>> words;
+  words.reserve(sorted.size());
+  std::unique_ptr<EncodeScratch> scratch;
+  for (const auto &word : sorted) {
+    words.emplace_back(word.first, EncodeResult());
+    model_->EncodeWithScratch(word.first, &words.back().second, &scratch);
+  }
+  *table = FrequentWordTable::Serialize(words);
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::GetMetrics(
+    ProcessorMetrics *metrics) const {
+  CHECK_OR_RETURN(metrics) << "output is null";
+  if (metrics_ == nullptr) {
+    return util::Status(util::StatusCode::kUnimplemented,
+                        "Built without SPM_ENABLE_METRICS.");
+  }
+  metrics_->CopyTo(metrics);
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::ResetMetrics() {
+  if (metrics_ == nullptr) {
+    return util::Status(util::StatusCode::kUnimplemented,
+                        "Built without SPM_ENABLE_METRICS.");
+  }
+  metrics_->Reset();
+  return util::OkStatus();
+}
+
+namespace {
+// Estimated heap bytes of `model_proto`, whose pieces dominate, without the
+// precompiled charsmaps.
+size_t ModelProtoMemoryUsage(const ModelProto &model_proto) {
+  size_t size = model_proto.pieces_size() *
+                (sizeof(ModelProto::SentencePiece) + sizeof(void *));
+  for (const auto &piece : model_proto.pieces()) {
+    size += port::StringBytes(piece.piece());
+  }
+  // The serialized sizes of the specs stand for their strings.
+  size += model_proto.trainer_spec().ByteSizeLong() +
+          model_proto.normalizer_spec().ByteSizeLong() -
+          model_proto.normalizer_spec().precompiled_charsmap().size() +
+          model_proto.denormalizer_spec().ByteSizeLong() -
+          model_proto.denormalizer_spec().precompiled_charsmap().size() +
+          model_proto.self_test_data().ByteSizeLong();
+  return size;
+}
+}  // namespace
+
+util::Status SentencePieceProcessor::GetMemoryUsage(MemoryUsage *usage) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(usage) << "output is null";
+  *usage = MemoryUsage();
+
+  usage->model_proto = ModelProtoMemoryUsage(*model_proto_);
+  model_->GetMemoryUsage(usage);
+  usage->normalizer =
+      port::StringBytes(
+          model_proto_->normalizer_spec().precompiled_charsmap()) +
+      port::StringBytes(
+          model_proto_->denormalizer_spec().precompiled_charsmap());
+  if (normalizer_) usage->normalizer += normalizer_->MemoryUsage();
+  if (denormalizer_) usage->normalizer += denormalizer_->MemoryUsage();
+
+  if (decode_table_) usage->processor_tables += decode_table_->MemoryUsage();
+  for (const auto &restriction : vocabulary_restrictions_) {
+    usage->processor_tables += restriction->MemoryUsage();
+  }
+  if (safe_cut_finder_) {
+    usage->processor_tables += safe_cut_finder_->MemoryUsage();
+  }
+
+  // The replicas share the ModelProto and the caches with model_.
+  for (const auto &replica : replicas_) {
+    if (!replica.model) continue;
+    MemoryUsage copy;
+    replica.model->GetMemoryUsage(&copy);
+    usage->numa_replicas += copy.piece_maps + copy.model_tables +
+                            replica.normalizer->MemoryUsage();
+  }
+
+  if (mapped_file_) usage->mapped_file = mapped_file_->data().size();
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    if (pool_) usage->pool_threads = pool_->size();
+  }
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::LoadVocabulary(absl::string_view filename,
+                                                    int threshold) {
   auto input = filesystem::NewReadableFile(filename);
   RETURN_IF_ERROR(input->status());
 
@@ -378,27 +1631,350 @@ util::Status SentencePieceProcessor::LoadVocabulary(absl::string_view filename,
 // Simple API.
 util::Status SentencePieceProcessor::Encode(
     absl::string_view input, std::vector<std::string> *pieces) const {
-  CHECK_OR_RETURN_STATUS_STL(pieces);
+  EncodeContext context;
+  return Encode(input, EncodeOptions(), pieces, &context);
+}
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(Encode(input, &spt));
-  for (const auto &sp : spt.pieces()) {
-    pieces->emplace_back(sp.piece());
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            std::vector<int> *ids) const {
+  EncodeContext context;
+  return Encode(input, ids, &context);
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            std::vector<int> *ids,
+                                            EncodeContext *context) const {
+  return Encode(input, EncodeOptions(), ids, context);
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            const EncodeOptions &options,
+                                            std::vector<int> *ids,
+                                            EncodeContext *context) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN(context) << "context is null";
+  CHECK_OR_RETURN(!options.enable_sampling || options.max_tokens == 0)
+      << "vocabulary and max_tokens are not supported with sampling.";
+  OutputLayout layout;
+  RETURN_IF_ERROR(GetOutputLayout(encode_extra_options_, options, &layout));
+  const VocabularyRestriction *restriction = nullptr;
+  RETURN_IF_ERROR(GetVocabularyRestriction(options, &restriction));
+  input = CutAtCharBoundary(input, options.max_input_bytes);
+  context->consumed_input_bytes_ = input.size();
+
+  // Ids do not need the alignment nor the SentencePieceText, so this path
+  // skips both and emits the same ids as PopulateSentencePieceText().
+  CallTimer timer;
+  MetricsRecorder::EncodeCall call;
+  ids->insert(ids->end(), layout.prefix.begin(), layout.prefix.end());
+
+  // The run of unknown pieces continues across the parts of the normalized
+  // text encoded apart.
+  bool is_prev_unk = false;
+  const auto emit = [&](const EncodeResult &result, size_t size) {
+    return AppendIds(*model_, result, size, &is_prev_unk, ids, &call);
+  };
+
+  std::string &normalized = context->normalized_;
+  auto &result = context->result_;
+  if (options.max_tokens > 0) {
+    // Encodes the input from the left until a piece is cut.
+    IdTruncator truncator(*model_, options.max_tokens, ids, &call);
+    std::vector<size_t> &norm_to_orig = context->stream_to_orig_;
+    normalized.clear();
+    norm_to_orig.clear();
+    if (!LocalModel()->IsWordSplittable()) {
+      // A piece may span words, so no piece is final before the end.
+      RETURN_IF_ERROR(
+          LocalNormalizer()->Normalize(input, &normalized, &norm_to_orig));
+      call.normalize_ns = timer.Lap();
+      EncodeNormalized(normalized, restriction, &result, &context->scratch_);
+      RETURN_IF_ERROR(truncator.Append(result));
+      call.model_ns = timer.Lap();
+    } else {
+      // Normalizes and encodes the complete words one window at a time, as
+      // the fused encoding below.
+      if (context->stream_ == nullptr ||
+          context->stream_normalizer_ != normalizer_.get()) {
+        context->stream_ =
+            std::make_unique<normalizer::StreamNormalizer>(*normalizer_);
+        context->stream_normalizer_ = normalizer_.get();
+      }
+      auto *stream = context->stream_.get();
+      stream->Reset();
+      const size_t window = fused_encode_window_ > 0 ? fused_encode_window_
+                                                     : kIncrementalEncodeWindow;
+      const bool treat_ws_as_suffix =
+          model_proto_->trainer_spec().treat_whitespace_as_suffix();
+      size_t encoded = 0;
+      for (size_t pos = 0; pos <= input.size() && !truncator.done();
+           pos += window) {
+        const bool finish = pos + window > input.size();
+        RETURN_IF_ERROR(stream->Feed(input.substr(pos, window), &normalized,
+                                     &norm_to_orig));
+        if (finish) {
+          RETURN_IF_ERROR(stream->Finish(&normalized, &norm_to_orig));
+        }
+        call.normalize_ns += timer.Lap();
+        const absl::string_view rest =
+            absl::string_view(normalized).substr(encoded);
+        const size_t size =
+            finish ? rest.size() : LastWordBoundary(rest, treat_ws_as_suffix);
+        if (size == 0) continue;
+        LocalModel()->EncodeWithWordCache(rest.substr(0, size), &result,
+                                          &context->scratch_, restriction);
+        RETURN_IF_ERROR(truncator.Append(result));
+        encoded += size;
+        call.model_ns += timer.Lap();
+      }
+    }
+    if (truncator.done()) {
+      context->consumed_input_bytes_ =
+          norm_to_orig[truncator.normalized_size()];
+    }
+  } else if (fused_encode_window_ == 0 ||
+             input.size() <= fused_encode_window_ || options.enable_sampling) {
+    RETURN_IF_ERROR(LocalNormalizer()->Normalize(
+        input, &normalized, static_cast<normalizer::Alignment *>(nullptr)));
+    call.normalize_ns = timer.Lap();
+    RETURN_IF_ERROR(EncodeNormalized(normalized, options, restriction, &result,
+                                     &context->scratch_));
+    call.model_ns = timer.Lap();
+    ids->reserve(result.size() + layout.prefix.size() + layout.suffix.size());
+    RETURN_IF_ERROR(emit(result, normalized.size()));
+  } else {
+    // Normalizes the input window by window and encodes the complete words
+    // right away, so the normalized text stays small. The model has no
+    // pieces spanning words, so the words can be encoded apart.
+    if (context->stream_ == nullptr ||
+        context->stream_normalizer_ != normalizer_.get()) {
+      context->stream_ =
+          std::make_unique<normalizer::StreamNormalizer>(*normalizer_);
+      context->stream_normalizer_ = normalizer_.get();
+    }
+    auto *stream = context->stream_.get();
+    stream->Reset();
+    normalized.clear();
+    const bool treat_ws_as_suffix =
+        model_proto_->trainer_spec().treat_whitespace_as_suffix();
+    for (size_t pos = 0; pos <= input.size(); pos += fused_encode_window_) {
+      const bool finish = pos + fused_encode_window_ > input.size();
+      if (finish) {
+        RETURN_IF_ERROR(stream->Feed(input.substr(pos), &normalized, nullptr));
+        RETURN_IF_ERROR(stream->Finish(&normalized, nullptr));
+      } else {
+        RETURN_IF_ERROR(stream->Feed(input.substr(pos, fused_encode_window_),
+                                     &normalized, nullptr));
+      }
+      call.normalize_ns += timer.Lap();
+      const size_t size = finish ? normalized.size()
+                                 : LastWordBoundary(normalized,
+                                                    treat_ws_as_suffix);
+      if (size == 0) continue;
+      const absl::string_view words(normalized.data(), size);
+      LocalModel()->EncodeWithWordCache(words, &result, &context->scratch_,
+                                        restriction);
+      RETURN_IF_ERROR(emit(result, size));
+      normalized.erase(0, size);
+      call.model_ns += timer.Lap();
+    }
+  }
+
+  if (layout.reverse) {
+    std::reverse(ids->begin() + layout.prefix.size(), ids->end());
+  }
+  ids->insert(ids->end(), layout.suffix.begin(), layout.suffix.end());
+
+  if (metrics_) {
+    call.populate_ns = timer.Lap();
+    call.input_bytes = input.size();
+    call.output_pieces = ids->size();
+    metrics_->RecordEncode(call);
   }
 
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::Encode(absl::string_view input,
-                                            std::vector<int> *ids) const {
+util::Status SentencePieceProcessor::EncodeWindows(
+    absl::string_view input, int window_size, int stride,
+    const std::function<util::Status(const EncodedWindow &)> &callback,
+    EncodeContext *context) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(context) << "context is null";
+  CHECK_GT_OR_RETURN(stride, 0);
+  CHECK_LE_OR_RETURN(stride, window_size);
+
+  // The ids from the start of the next window with their input ranges.
+  // The first `covered` of them are in the last emitted window.
+  struct Token {
+    int id;
+    size_t begin;
+    size_t end;
+  };
+  std::deque<Token> tokens;
+  size_t covered = 0;
+  EncodedWindow window;
+  const auto emit = [&](size_t size) {
+    window.ids.clear();
+    for (size_t i = 0; i < size; ++i) window.ids.push_back(tokens[i].id);
+    window.begin = tokens.front().begin;
+    window.end = tokens[size - 1].end;
+    return callback(window);
+  };
+
+  std::string &normalized = context->normalized_;
+  std::vector<size_t> &norm_to_orig = context->stream_to_orig_;
+  auto &result = context->result_;
+  normalized.clear();
+  norm_to_orig.clear();
+
+  // Adds the ids of `pieces`, which start at the start of `normalized`, and
+  // emits the full windows.
+  MetricsRecorder::EncodeCall call;
+  bool is_prev_unk = false;
+  std::vector<int> piece_ids;
+  const auto add = [&](const EncodeResult &pieces) -> util::Status {
+    const auto orig = [&](size_t pos) {
+      return pos < norm_to_orig.size() ? norm_to_orig[pos] : input.size();
+    };
+    size_t pos = 0;
+    for (const auto &p : pieces) {
+      piece_ids.clear();
+      CHECK_OR_RETURN(AppendPieceIds(*model_, p.first, p.second, &is_prev_unk,
+                                     &piece_ids, &call))
+          << "Empty piece is not allowed.";
+      const size_t begin = pos;
+      if (!model_->IsControl(p.second)) pos += p.first.size();
+      if (piece_ids.empty()) {
+        // The run of unknown pieces of the last id goes on.
+        if (!tokens.empty()) tokens.back().end = orig(pos);
+        continue;
+      }
+      for (const int id : piece_ids) {
+        tokens.push_back({id, orig(begin), orig(pos)});
+      }
+      while (tokens.size() >= static_cast<size_t>(window_size)) {
+        RETURN_IF_ERROR(emit(window_size));
+        tokens.erase(tokens.begin(), tokens.begin() + stride);
+        covered = window_size - stride;
+      }
+    }
+    return util::OkStatus();
+  };
+
+  if (!model_->IsWordSplittable()) {
+    // A piece may span words, so the whole input is encoded at once.
+    RETURN_IF_ERROR(
+        LocalNormalizer()->Normalize(input, &normalized, &norm_to_orig));
+    EncodeNormalized(normalized, nullptr, &result, &context->scratch_);
+    RETURN_IF_ERROR(add(result));
+  } else {
+    // Normalizes and encodes the complete words one part at a time, and
+    // drops them once their ids are added.
+    if (context->stream_ == nullptr ||
+        context->stream_normalizer_ != normalizer_.get()) {
+      context->stream_ =
+          std::make_unique<normalizer::StreamNormalizer>(*normalizer_);
+      context->stream_normalizer_ = normalizer_.get();
+    }
+    auto *stream = context->stream_.get();
+    stream->Reset();
+    const size_t part = fused_encode_window_ > 0 ? fused_encode_window_
+                                                 : kIncrementalEncodeWindow;
+    const bool treat_ws_as_suffix =
+        model_proto_->trainer_spec().treat_whitespace_as_suffix();
+    for (size_t pos = 0; pos <= input.size(); pos += part) {
+      const bool finish = pos + part > input.size();
+      RETURN_IF_ERROR(
+          stream->Feed(input.substr(pos, part), &normalized, &norm_to_orig));
+      if (finish) RETURN_IF_ERROR(stream->Finish(&normalized, &norm_to_orig));
+      const size_t size = finish ? normalized.size()
+                                 : LastWordBoundary(normalized,
+                                                    treat_ws_as_suffix);
+      if (size == 0) continue;
+      LocalModel()->EncodeWithWordCache(
+          absl::string_view(normalized.data(), size), &result,
+          &context->scratch_);
+      RETURN_IF_ERROR(add(result));
+      normalized.erase(0, size);
+      norm_to_orig.erase(norm_to_orig.begin(), norm_to_orig.begin() + size);
+    }
+  }
+
+  if (tokens.size() > covered) RETURN_IF_ERROR(emit(tokens.size()));
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeWords(
+    const std::vector<absl::string_view> &words, std::vector<int> *ids,
+    std::vector<size_t> *offsets, EncodeContext *context) const {
   CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN(offsets) << "output offsets is null";
+  CHECK_OR_RETURN(context) << "context is null";
+  offsets->clear();
+  offsets->reserve(words.size() + 1);
+  offsets->push_back(0);
+
+  std::string &normalized = context->normalized_;
+  auto &result = context->result_;
+  MetricsRecorder::EncodeCall call;
+  for (const auto word : words) {
+    RETURN_IF_ERROR(LocalNormalizer()->Normalize(
+        word, &normalized, static_cast<normalizer::Alignment *>(nullptr)));
+    if (!normalized.empty()) {
+      // A run of unknown pieces does not go on over the words.
+      bool is_prev_unk = false;
+      LocalModel()->EncodeWithWordCache(normalized, &result,
+                                        &context->scratch_);
+      RETURN_IF_ERROR(AppendIds(*model_, result, normalized.size(),
+                                &is_prev_unk, ids, &call));
+    }
+    offsets->push_back(ids->size());
+  }
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(Encode(input, &spt));
-  for (const auto &sp : spt.pieces()) {
-    ids->emplace_back(sp.id());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            const EncodeOptions &options,
+                                            std::vector<std::string> *pieces,
+                                            EncodeContext *context) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  CHECK_OR_RETURN(context) << "context is null";
+  // The extra options are already applied to the FlatSentencePieceText,
+  // unless `options` ignores them, and the output options are applied below.
+  OutputLayout layout;
+  RETURN_IF_ERROR(GetOutputLayout({}, options, &layout));
+  const VocabularyRestriction *restriction = nullptr;
+  RETURN_IF_ERROR(GetVocabularyRestriction(options, &restriction));
+  FlatSentencePieceText *flat = &context->flat_;
+  input = CutAtCharBoundary(input, options.max_input_bytes);
+  EncodeOptions flat_options = options;
+  flat_options.add_bos = flat_options.add_eos = false;
+  flat_options.reverse = flat_options.emit_unk_piece = false;
+  RETURN_IF_ERROR(
+      EncodeToFlat(input, flat_options, restriction, flat, context));
+
+  // The pieces are encoded whole and then truncated.
+  size_t size = flat->size();
+  if (options.max_tokens > 0 &&
+      size > static_cast<size_t>(options.max_tokens)) {
+    size = options.max_tokens;
+    context->consumed_input_bytes_ = flat->begin(size);
   }
 
+  pieces->reserve(size + layout.prefix.size() + layout.suffix.size());
+  for (const int id : layout.prefix) pieces->emplace_back(IdToPiece(id));
+  for (size_t i = 0; i < size; ++i) {
+    const size_t index = layout.reverse ? size - 1 - i : i;
+    if (layout.unk_piece && IsUnknown(flat->id(index))) {
+      pieces->emplace_back(model_->unk_piece());
+    } else {
+      pieces->emplace_back(flat->piece(index));
+    }
+  }
+  for (const int id : layout.suffix) pieces->emplace_back(IdToPiece(id));
+
   return util::OkStatus();
 }
 
@@ -423,6 +1999,10 @@ util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
                                             std::string *detokenized) const {
   CHECK_OR_RETURN_STATUS_STL(detokenized);
 
+  if (decode_table_ && decode_extra_options_.empty()) {
+    return DecodeWithTable(ids.data(), ids.size(), detokenized);
+  }
+
   SentencePieceText spt;
   RETURN_IF_ERROR(Decode(ids, &spt));
   *detokenized = std::move(*spt.mutable_text());
@@ -430,6 +2010,36 @@ util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
   return util::OkStatus();
 }
 
+util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
+                                            std::string *detokenized,
+                                            EncodeContext *context) const {
+  CHECK_OR_RETURN_STATUS_STL(detokenized);
+  CHECK_OR_RETURN(context) << "context is null";
+
+  if (decode_table_ && decode_extra_options_.empty()) {
+    return DecodeWithTable(ids.data(), ids.size(), detokenized);
+  }
+
+  auto &pieces = context->pieces_;
+  pieces.clear();
+  const int num_pieces = GetPieceSize();
+  for (const int id : ids) {
+    if (id < 0 || id >= num_pieces) {
+      return util::Status(util::StatusCode::kOutOfRange,
+                          absl::StrCat("Invalid id: ", id));
+    }
+    pieces.emplace_back(IdToPiece(id));
+  }
+
+  if (context->spt_ == nullptr) {
+    context->spt_ = std::make_unique<SentencePieceText>();
+  }
+  RETURN_IF_ERROR(Decode(pieces, context->spt_.get()));
+  detokenized->assign(context->spt_->text());
+
+  return util::OkStatus();
+}
+
 util::Status SentencePieceProcessor::NBestEncode(
     absl::string_view input, int nbest_size,
     std::vector<std::vector<std::string>> *pieces) const {
@@ -544,12 +2154,832 @@ util::Status SentencePieceProcessor::SampleEncodeAndScore(
   return util::OkStatus();
 }
 
+util::Status SentencePieceProcessor::SampleEncodeMany(
+    absl::string_view input, int num_samples, float alpha,
+    std::vector<std::vector<std::string>> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+
+  NBestSentencePieceText spt;
+  RETURN_IF_ERROR(SampleEncodeMany(input, num_samples, alpha, &spt));
+
+  pieces->reserve(spt.nbests_size());
+  for (const auto &sample : spt.nbests()) {
+    std::vector<std::string> result;
+    result.reserve(sample.pieces_size());
+    for (const auto &sp : sample.pieces()) {
+      result.emplace_back(sp.piece());
+    }
+    pieces->emplace_back(std::move(result));
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeMany(
+    absl::string_view input, int num_samples, float alpha,
+    std::vector<std::vector<int>> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+
+  NBestSentencePieceText spt;
+  RETURN_IF_ERROR(SampleEncodeMany(input, num_samples, alpha, &spt));
+
+  ids->reserve(spt.nbests_size());
+  for (const auto &sample : spt.nbests()) {
+    std::vector<int> result;
+    result.reserve(sample.pieces_size());
+    for (const auto &sp : sample.pieces()) {
+      result.emplace_back(sp.id());
+    }
+    ids->emplace_back(std::move(result));
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeManyBatch(
+    const std::vector<absl::string_view> &inputs, int num_samples, float alpha,
+    std::vector<std::vector<std::vector<int>>> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  ids->resize(inputs.size());
+  return RunBatch(inputs.size(), [&](size_t i) {
+    return SampleEncodeMany(inputs[i], num_samples, alpha, &(*ids)[i]);
+  });
+}
+
+util::Status SentencePieceProcessor::SetNumThreads(int num_threads) {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  num_threads_ = num_threads;
+  // Running batches keep their own reference to the old pool.
+  pool_.reset();
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SetParallelEncodeThreshold(
+    size_t min_size) {
+  if (min_size > 0) {
+    RETURN_IF_ERROR(status());
+    if (safe_cut_finder_ == nullptr) {
+      safe_cut_finder_ = std::make_unique<SafeCutFinder>(*model_proto_);
+    }
+  }
+  parallel_encode_threshold_ = min_size;
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SetFusedEncodeWindow(size_t window) {
+  if (window > 0) {
+    RETURN_IF_ERROR(status());
+    RETURN_IF_ERROR(model_->VerifyWordSplittable());
+  }
+  fused_encode_window_ = window;
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SetMaxSegmentLength(size_t max_bytes,
+                                                         bool strict) {
+  max_segment_length_ = max_bytes;
+  strict_segment_length_ = strict;
+  return util::OkStatus();
+}
+
+uint64_t SentencePieceProcessor::GetNumSegmentedInputs() const {
+  return num_segmented_inputs_.load(std::memory_order_relaxed);
+}
+
+util::Status SentencePieceProcessor::SetMemoryPlacement(bool huge_pages,
+                                                        bool numa_replicas) {
+  if (model_) RETURN_IF_ERROR(CheckModelNotShared());
+  huge_page_tables_ = huge_pages;
+  numa_replicas_ = numa_replicas;
+  // The options are applied by Load() if no model is loaded yet.
+  if (!status().ok()) return util::OkStatus();
+  return PlaceTables(true);
+}
+
+void SentencePieceProcessor::SetSlimLoad(bool slim) { slim_load_ = slim; }
+
+util::Status SentencePieceProcessor::QuantizeScores(
+    const std::vector<absl::string_view> &calibration, float max_deviation,
+    float *deviation) {
+  RETURN_IF_ERROR(status());
+  RETURN_IF_ERROR(CheckModelNotShared());
+  std::vector<std::string> normalized(calibration.size());
+  for (size_t i = 0; i < calibration.size(); ++i) {
+    RETURN_IF_ERROR(Normalize(calibration[i], &normalized[i]));
+  }
+  return model_->QuantizeScores(
+      std::vector<absl::string_view>(normalized.begin(), normalized.end()),
+      max_deviation, deviation);
+}
+
+util::Status SentencePieceProcessor::PlaceTables(bool relocate) {
+  if (relocate) {
+    model_->RelocateTables(huge_page_tables_);
+    normalizer_->RelocateTables(huge_page_tables_);
+  }
+
+  replicas_.clear();
+  {
+    // The workers of the pool are pinned to the nodes of the replicas.
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    pool_.reset();
+  }
+  const std::vector<int> nodes = placement::NumaNodes();
+  if (!numa_replicas_ || nodes.size() <= 1) return util::OkStatus();
+
+  // Each replica is built by a thread bound to its node, so that its
+  // tables are allocated there when first touched.
+  std::vector<Replica> replicas(nodes.back() + 1);
+  for (const int node : nodes) {
+    util::Status status;
+    placement::RunOnNumaNode(node, [&]() {
+      Replica &replica = replicas[node];
+      replica.model = ModelFactory::Create(*model_proto_);
+      replica.normalizer = std::make_shared<normalizer::Normalizer>(
+          model_proto_->normalizer_spec(), model_proto_->trainer_spec());
+      status = replica.model->status();
+      if (status.ok()) status = replica.normalizer->status();
+      if (!status.ok()) return;
+      replica.normalizer->SetPrefixMatcher(replica.model->prefix_matcher());
+      status = replica.model->SetFrequentWordTable(
+          model_->frequent_word_table());
+      if (!status.ok()) return;
+      if (model_->shared_word_cache()) {
+        status = replica.model->SetSharedWordCacheSize(
+            model_->shared_word_cache()->num_slots());
+        if (!status.ok()) return;
+      }
+      replica.model->RelocateTables(huge_page_tables_);
+      replica.normalizer->RelocateTables(huge_page_tables_);
+    });
+    RETURN_IF_ERROR(status);
+  }
+  replicas_ = std::move(replicas);
+  return util::OkStatus();
+}
+
+const ModelInterface *SentencePieceProcessor::LocalModel() const {
+  const int node = placement::CurrentNumaNode();
+  if (node >= 0 && node < static_cast<int>(replicas_.size()) &&
+      replicas_[node].model) {
+    return replicas_[node].model.get();
+  }
+  return model_.get();
+}
+
+const normalizer::Normalizer *SentencePieceProcessor::LocalNormalizer() const {
+  const int node = placement::CurrentNumaNode();
+  if (node >= 0 && node < static_cast<int>(replicas_.size()) &&
+      replicas_[node].normalizer) {
+    return replicas_[node].normalizer.get();
+  }
+  return normalizer_.get();
+}
+
+util::Status SentencePieceProcessor::SplitIntoSegments(
+    absl::string_view normalized,
+    std::vector<absl::string_view> *segments) const {
+  segments->clear();
+  if (max_segment_length_ == 0 || normalized.size() <= max_segment_length_) {
+    segments->push_back(normalized);
+    return util::OkStatus();
+  }
+  if (strict_segment_length_) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted, GTL_LOC)
+           << "The normalized input of " << normalized.size()
+           << " bytes is longer than the maximum segment length "
+           << max_segment_length_ << ".";
+  }
+  num_segmented_inputs_.fetch_add(1, std::memory_order_relaxed);
+
+  const bool treat_ws_as_suffix =
+      model_proto_->trainer_spec().treat_whitespace_as_suffix();
+  while (normalized.size() > max_segment_length_) {
+    size_t size = LastWordBoundary(normalized.substr(0, max_segment_length_),
+                                   treat_ws_as_suffix);
+    if (size == 0) {
+      // Backs off to the start of the character at the limit, or takes the
+      // whole first character when it is longer than the limit.
+      size = max_segment_length_;
+      while (size > 0 && (normalized[size] & 0xC0) == 0x80) --size;
+      if (size == 0) {
+        size = max_segment_length_;
+        while (size < normalized.size() && (normalized[size] & 0xC0) == 0x80) {
+          ++size;
+        }
+      }
+    }
+    segments->push_back(normalized.substr(0, size));
+    normalized.remove_prefix(size);
+  }
+  if (!normalized.empty()) segments->push_back(normalized);
+  return util::OkStatus();
+}
+
+std::shared_ptr<ThreadPool> SentencePieceProcessor::GetThreadPool() const {
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+  // The workers of a pool started before fork() do not run in the child.
+  if (pool_ != nullptr && pool_->forked()) pool_.reset();
+  if (pool_ == nullptr && !replicas_.empty()) {
+    std::vector<int> nodes;
+    for (int node = 0; node < static_cast<int>(replicas_.size()); ++node) {
+      if (replicas_[node].model) nodes.push_back(node);
+    }
+    const int size =
+        num_threads_ <= 0 ? GetDefaultNumThreads() : num_threads_;
+    pool_ = std::make_shared<ThreadPool>(
+        std::max<int>(1, std::min<int>(size, kMaxBatchThreads)),
+        [nodes](int32 worker) {
+          placement::BindToNumaNode(nodes[worker % nodes.size()]);
+        });
+  }
+  if (pool_ == nullptr) {
+    pool_ = num_threads_ <= 0
+                ? GetSharedThreadPool()
+                : std::make_shared<ThreadPool>(
+                      std::min(num_threads_, kMaxBatchThreads),
+                      placement::WorkerInitializer());
+  }
+  return pool_;
+}
+
+void SentencePieceProcessor::EncodeNormalized(
+    absl::string_view normalized, const VocabularyRestriction *restriction,
+    EncodeResult *result, std::unique_ptr<EncodeScratch> *scratch) const {
+  if (parallel_encode_threshold_ == 0 ||
+      normalized.size() < parallel_encode_threshold_) {
+    LocalModel()->EncodeWithWordCache(normalized, result, scratch, restriction);
+    return;
+  }
+
+  const auto pool = GetThreadPool();
+  if (pool->size() <= 1) {
+    LocalModel()->EncodeWithWordCache(normalized, result, scratch, restriction);
+    return;
+  }
+
+  // Cuts the input into groups of at least `group_size` bytes at the
+  // positions no piece can span, so each group can be encoded
+  // independently.
+  constexpr size_t kGroupsPerThread = 4;
+  constexpr size_t kMinGroupSize = 256;
+  const size_t group_size = std::max(
+      kMinGroupSize, normalized.size() / (kGroupsPerThread * pool->size()));
+  std::vector<absl::string_view> groups;
+  for (size_t begin = 0; begin < normalized.size();) {
+    const size_t end =
+        safe_cut_finder_->NextCut(normalized, begin + group_size);
+    groups.push_back(normalized.substr(begin, end - begin));
+    begin = end;
+  }
+  if (groups.size() <= 1) {
+    LocalModel()->EncodeWithWordCache(normalized, result, scratch, restriction);
+    return;
+  }
+
+  std::vector<EncodeResult> group_results(groups.size());
+  std::vector<std::unique_ptr<EncodeScratch>> scratches(pool->size());
+  pool->ParallelFor(groups.size(), 1, [&](int32 slot, int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      LocalModel()->EncodeWithWordCache(groups[i], &group_results[i],
+                                        &scratches[slot], restriction);
+    }
+  });
+
+  result->clear();
+  for (const auto &group_result : group_results) {
+    result->insert(result->end(), group_result.begin(), group_result.end());
+  }
+}
+
+util::Status SentencePieceProcessor::RunBatch(
+    size_t size, const std::function<util::Status(size_t)> &func) const {
+  const auto pool = GetThreadPool();
+
+  const size_t num_tasks = std::min<size_t>(pool->size(), size);
+  if (num_tasks <= 1) {
+    for (size_t i = 0; i < size; ++i) {
+      RETURN_IF_ERROR(func(i));
+    }
+    return util::OkStatus();
+  }
+
+  // The calling thread runs the inputs along with the workers, so that a
+  // batch called from a worker, e.g. a callback of AsyncEncoder on the
+  // shared pool, makes progress even when all the other workers wait.
+  std::vector<util::Status> statuses(size);
+  pool->ParallelFor(size, 1, [&](int32 slot, int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) statuses[i] = func(i);
+  });
+
+  for (const auto &status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<std::string>> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  pieces->resize(inputs.size());
+  return RunBatch(inputs.size(), [&](size_t i) {
+    return Encode(inputs[i], &(*pieces)[i]);
+  });
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<int>> *ids) const {
+  return EncodeBatch(inputs, EncodeOptions(), ids);
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs, const EncodeOptions &options,
+    std::vector<std::vector<std::string>> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  pieces->resize(inputs.size());
+  return RunBatch(inputs.size(), [&](size_t i) {
+    EncodeContext context;
+    return Encode(inputs[i], options, &(*pieces)[i], &context);
+  });
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs, const EncodeOptions &options,
+    std::vector<std::vector<int>> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  ids->resize(inputs.size());
+  // The fused and the parallel encodings split long inputs, so they encode
+  // one sentence at a time, as do the options other than the output ones.
+  if (fused_encode_window_ != 0 || parallel_encode_threshold_ != 0 ||
+      options.vocabulary >= 0 || options.max_tokens > 0 ||
+      options.max_input_bytes > 0 || options.enable_sampling) {
+    return RunBatch(inputs.size(), [&](size_t i) {
+      EncodeContext context;
+      return Encode(inputs[i], options, &(*ids)[i], &context);
+    });
+  }
+
+  // Otherwise the sentences are encoded in groups, which the model can
+  // interleave, while keeping all the workers busy.
+  constexpr size_t kMaxGroupSize = 32;
+  const size_t group_size = std::max<size_t>(
+      1, std::min(kMaxGroupSize, inputs.size() / GetThreadPool()->size()));
+  const size_t num_groups = (inputs.size() + group_size - 1) / group_size;
+  return RunBatch(num_groups, [&](size_t g) {
+    return EncodeGroup(inputs, g * group_size,
+                       std::min(inputs.size(), (g + 1) * group_size), options,
+                       ids);
+  });
+}
+
+util::Status SentencePieceProcessor::EncodeGroup(
+    const std::vector<absl::string_view> &inputs, size_t begin, size_t end,
+    const EncodeOptions &options, std::vector<std::vector<int>> *ids) const {
+  OutputLayout layout;
+  RETURN_IF_ERROR(GetOutputLayout(encode_extra_options_, options, &layout));
+
+  CallTimer timer;
+  const size_t size = end - begin;
+  std::vector<MetricsRecorder::EncodeCall> calls(size);
+  std::vector<std::string> normalized(size);
+  {
+    SPM_TRACE_SPAN("encode_group_normalize");
+    for (size_t i = 0; i < size; ++i) {
+      RETURN_IF_ERROR(LocalNormalizer()->Normalize(
+          inputs[begin + i], &normalized[i],
+          static_cast<normalizer::Alignment *>(nullptr)));
+      calls[i].normalize_ns = timer.Lap();
+    }
+  }
+  std::vector<EncodeResult> results;
+  std::unique_ptr<EncodeScratch> scratch;
+  {
+    SPM_TRACE_SPAN("encode_group_model");
+    LocalModel()->EncodeMany(
+        std::vector<absl::string_view>(normalized.begin(), normalized.end()),
+        &results, &scratch);
+  }
+  // The model time of the group is split evenly between its sentences.
+  const uint64_t model_ns = timer.Lap() / size;
+
+  SPM_TRACE_SPAN("encode_group_populate");
+  for (size_t i = 0; i < size; ++i) {
+    auto &call = calls[i];
+    call.model_ns = model_ns;
+    std::vector<int> *output = &(*ids)[begin + i];
+    output->clear();
+    output->reserve(results[i].size() + layout.prefix.size() +
+                    layout.suffix.size());
+    output->insert(output->end(), layout.prefix.begin(), layout.prefix.end());
+    bool is_prev_unk = false;
+    RETURN_IF_ERROR(AppendIds(*model_, results[i], normalized[i].size(),
+                              &is_prev_unk, output, &call));
+    if (layout.reverse) {
+      std::reverse(output->begin() + layout.prefix.size(), output->end());
+    }
+    output->insert(output->end(), layout.suffix.begin(), layout.suffix.end());
+
+    if (metrics_) {
+      call.populate_ns = timer.Lap();
+      call.input_bytes = inputs[begin + i].size();
+      call.output_pieces = output->size();
+      metrics_->RecordEncode(call);
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<ImmutableSentencePieceText> *spts) const {
+  CHECK_OR_RETURN_STATUS_STL(spts);
+  spts->resize(inputs.size());
+  return RunBatch(inputs.size(), [&](size_t i) {
+    return Encode(inputs[i], (*spts)[i].mutable_proto());
+  });
+}
+
+util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<int> &ids, const std::vector<size_t> &offsets,
+    std::string *text, std::vector<size_t> *text_offsets) const {
+  CHECK_OR_RETURN_STATUS_STL(text);
+  CHECK_OR_RETURN_STATUS_STL(text_offsets);
+  CHECK_OR_RETURN(!offsets.empty()) << "offsets is empty";
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    CHECK_LE_OR_RETURN(offsets[i - 1], offsets[i]);
+  }
+  CHECK_LE_OR_RETURN(offsets.back(), ids.size());
+
+  // Each task decodes a contiguous range of the sentences into its own
+  // chunk, and the chunks are concatenated into `text` at the end.
+  const size_t size = offsets.size() - 1;
+  constexpr size_t kChunksPerThread = 4;
+  const size_t num_chunks =
+      std::min(size, kChunksPerThread * GetThreadPool()->size());
+  const bool use_table = decode_table_ && decode_extra_options_.empty();
+  std::vector<std::string> chunks(num_chunks);
+  std::vector<size_t> ends(size);  // End of each sentence in its chunk.
+  RETURN_IF_ERROR(RunBatch(num_chunks, [&](size_t c) {
+    SPM_TRACE_SPAN("decode_chunk");
+    std::string *chunk = &chunks[c];
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      const int *begin = ids.data() + offsets[i];
+      const size_t length = offsets[i + 1] - offsets[i];
+      if (use_table) {
+        RETURN_IF_ERROR(DecodeWithTable(begin, length, chunk));
+      } else {
+        std::string sentence;
+        RETURN_IF_ERROR(
+            Decode(std::vector<int>(begin, begin + length), &sentence));
+        chunk->append(sentence);
+      }
+      ends[i] = chunk->size();
+    }
+    return util::OkStatus();
+  }));
+
+  SPM_TRACE_SPAN("decode_concatenate");
+  size_t total = 0;
+  for (const auto &chunk : chunks) total += chunk.size();
+  text->reserve(total);
+  text_offsets->resize(size + 1);
+  (*text_offsets)[0] = 0;
+  for (size_t c = 0; c < num_chunks; ++c) {
+    const size_t base = text->size();
+    text->append(chunks[c]);
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      (*text_offsets)[i + 1] = base + ends[i];
+    }
+  }
+
+  return util::OkStatus();
+}
+
+namespace {
+template <typename T>
+util::Status CheckNarrowIdType(int piece_size) {
+  static_assert(std::is_same<T, uint16_t>::value ||
+                    std::is_same<T, uint32_t>::value,
+                "narrow ids are uint16_t or uint32_t");
+  if (static_cast<uint64_t>(piece_size) >
+      static_cast<uint64_t>(std::numeric_limits<T>::max()) + 1) {
+    return util::StatusBuilder(util::StatusCode::kOutOfRange, GTL_LOC)
+           << "The " << piece_size << " ids of the vocabulary do not fit in "
+           << sizeof(T) * 8 << "-bit ids.";
+  }
+  return util::OkStatus();
+}
+}  // namespace
+
+template <typename T>
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            std::vector<T> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  RETURN_IF_ERROR(CheckNarrowIdType<T>(GetPieceSize()));
+  // The wide ids are encoded in a buffer kept by the thread, so a call only
+  // allocates the output.
+  thread_local EncodeContext context;
+  thread_local std::vector<int> wide;
+  RETURN_IF_ERROR(Encode(input, &wide, &context));
+  ids->assign(wide.begin(), wide.end());
+  return util::OkStatus();
+}
+
+template <typename T>
+util::Status SentencePieceProcessor::Decode(const std::vector<T> &ids,
+                                            std::string *detokenized) const {
+  return Decode(std::vector<int>(ids.begin(), ids.end()), detokenized);
+}
+
+template <typename T>
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<T>> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  RETURN_IF_ERROR(CheckNarrowIdType<T>(GetPieceSize()));
+  std::vector<std::vector<int>> wide;
+  RETURN_IF_ERROR(EncodeBatch(inputs, &wide));
+  // Each wide sequence is released once narrowed, so the peak memory stays
+  // below the one of the wide batch and its copy.
+  ids->resize(inputs.size());
+  for (size_t i = 0; i < wide.size(); ++i) {
+    (*ids)[i].assign(wide[i].begin(), wide[i].end());
+    std::vector<int>().swap(wide[i]);
+  }
+  return util::OkStatus();
+}
+
+template <typename T>
+util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<T> &ids, const std::vector<size_t> &offsets,
+    std::string *text, std::vector<size_t> *text_offsets) const {
+  return DecodeBatch(std::vector<int>(ids.begin(), ids.end()), offsets, text,
+                     text_offsets);
+}
+
+template util::Status SentencePieceProcessor::Encode(
+    absl::string_view, std::vector<uint16_t> *) const;
+template util::Status SentencePieceProcessor::Encode(
+    absl::string_view, std::vector<uint32_t> *) const;
+template util::Status SentencePieceProcessor::Decode(
+    const std::vector<uint16_t> &, std::string *) const;
+template util::Status SentencePieceProcessor::Decode(
+    const std::vector<uint32_t> &, std::string *) const;
+template util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &,
+    std::vector<std::vector<uint16_t>> *) const;
+template util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &,
+    std::vector<std::vector<uint32_t>> *) const;
+template util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<uint16_t> &, const std::vector<size_t> &, std::string *,
+    std::vector<size_t> *) const;
+template util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<uint32_t> &, const std::vector<size_t> &, std::string *,
+    std::vector<size_t> *) const;
+
+template <typename Offset>
+util::Status SentencePieceProcessor::EncodeArrowImpl(
+    const ArrowStringArray<Offset> &input,
+    ArrowListArray<Offset> *output) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(output) << "output container is null";
+  CHECK_GE_OR_RETURN(input.length, 0);
+  CHECK_GE_OR_RETURN(input.offset, 0);
+  const size_t size = input.length;
+  CHECK_OR_RETURN(size == 0 || input.offsets != nullptr);
+  const Offset *offsets = input.offsets + input.offset;
+  if (size > 0) {
+    CHECK_OR_RETURN(input.data != nullptr || offsets[size] == offsets[0]);
+    for (size_t i = 0; i < size; ++i) {
+      CHECK_LE_OR_RETURN(offsets[i], offsets[i + 1]);
+    }
+    CHECK_GE_OR_RETURN(offsets[0], 0);
+  }
+  const auto is_valid = [&input](size_t i) {
+    const size_t bit = input.offset + i;
+    return input.validity == nullptr ||
+           (input.validity[bit / 8] >> (bit % 8)) & 1;
+  };
+
+  // As in DecodeBatch(), each task encodes a contiguous range of the
+  // strings into its own chunk.
+  constexpr size_t kChunksPerThread = 4;
+  const size_t num_chunks =
+      std::min(size, kChunksPerThread * GetThreadPool()->size());
+  std::vector<std::vector<int>> chunks(num_chunks);
+  std::vector<size_t> ends(size);  // End of each list in its chunk.
+  RETURN_IF_ERROR(RunBatch(num_chunks, [&](size_t c) {
+    EncodeContext context;
+    std::vector<int> ids;
+    std::vector<int> *chunk = &chunks[c];
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      if (is_valid(i)) {
+        RETURN_IF_ERROR(Encode(absl::string_view(input.data + offsets[i],
+                                                 offsets[i + 1] - offsets[i]),
+                               &ids, &context));
+        chunk->insert(chunk->end(), ids.begin(), ids.end());
+      }
+      ends[i] = chunk->size();
+    }
+    return util::OkStatus();
+  }));
+
+  size_t total = 0;
+  for (const auto &chunk : chunks) total += chunk.size();
+  CHECK_LE_OR_RETURN(total,
+                     static_cast<size_t>(std::numeric_limits<Offset>::max()))
+      << "Too many ids for the offsets of the output.";
+  output->values.clear();
+  output->values.reserve(total);
+  output->offsets.resize(size + 1);
+  output->offsets[0] = 0;
+  for (size_t c = 0; c < num_chunks; ++c) {
+    const size_t base = output->values.size();
+    output->values.insert(output->values.end(), chunks[c].begin(),
+                          chunks[c].end());
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      output->offsets[i + 1] = static_cast<Offset>(base + ends[i]);
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeArrow(
+    const ArrowStringArray<int32_t> &input,
+    ArrowListArray<int32_t> *output) const {
+  return EncodeArrowImpl(input, output);
+}
+
+util::Status SentencePieceProcessor::EncodeArrow(
+    const ArrowStringArray<int64_t> &input,
+    ArrowListArray<int64_t> *output) const {
+  return EncodeArrowImpl(input, output);
+}
+
+void SentencePieceProcessor::EncodeAsync(absl::string_view input,
+                                         EncodeCallback callback) const {
+  GetThreadPool()->Schedule(
+      [this, input = std::string(input), callback = std::move(callback)]() {
+        std::vector<int> ids;
+        auto status = Encode(input, &ids);
+        callback(std::move(status), std::move(ids));
+      });
+}
+
+std::future<std::pair<util::Status, std::vector<int>>>
+SentencePieceProcessor::EncodeAsync(absl::string_view input) const {
+  auto promise = std::make_shared<
+      std::promise<std::pair<util::Status, std::vector<int>>>>();
+  auto future = promise->get_future();
+  EncodeAsync(input, [promise](util::Status status, std::vector<int> ids) {
+    promise->set_value(std::make_pair(std::move(status), std::move(ids)));
+  });
+  return future;
+}
+
+util::Status SentencePieceProcessor::EncodeCorpus(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<int>> *ids, CorpusEncodeStats *stats) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(ids) << "output container is null";
+  const auto start = std::chrono::steady_clock::now();
+  const auto pool = GetThreadPool();
+  const size_t num_workers = pool->size();
+
+  // Longest first: the tasks are handed out in this order.
+  std::vector<size_t> order(inputs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&inputs](size_t a, size_t b) {
+    return inputs[a].size() > inputs[b].size();
+  });
+
+  // Groups consecutive inputs of `order` into tasks of about `task_bytes`,
+  // so that a long input is a task by itself and the short ones share one.
+  // Each byte counts one more, so that empty inputs are grouped too.
+  constexpr size_t kTasksPerWorker = 16;
+  constexpr size_t kMaxTaskBytes = 64 << 10;
+  size_t total_bytes = 0;
+  for (const auto &input : inputs) total_bytes += input.size() + 1;
+  const size_t task_bytes = std::max<size_t>(
+      1, std::min(kMaxTaskBytes,
+                  total_bytes / (kTasksPerWorker * num_workers)));
+  std::vector<size_t> task_begins = {0};
+  size_t bytes = 0;
+  for (size_t k = 0; k < order.size(); ++k) {
+    bytes += inputs[order[k]].size() + 1;
+    if (bytes >= task_bytes || k + 1 == order.size()) {
+      task_begins.push_back(k + 1);
+      bytes = 0;
+    }
+  }
+
+  ids->clear();
+  ids->resize(inputs.size());
+  std::vector<EncodeContext> contexts(num_workers);
+  std::vector<util::Status> statuses(num_workers);
+  std::vector<size_t> num_inputs(num_workers, 0);
+  std::vector<size_t> num_bytes(num_workers, 0);
+  std::vector<double> busy_seconds(num_workers, 0.0);
+  pool->ParallelFor(
+      task_begins.size() - 1, 1, [&](int32 slot, int64 begin, int64 end) {
+        const auto task_start = std::chrono::steady_clock::now();
+        for (size_t k = task_begins[begin]; k < task_begins[end]; ++k) {
+          const size_t i = order[k];
+          auto status = Encode(inputs[i], &(*ids)[i], &contexts[slot]);
+          if (!status.ok() && statuses[slot].ok()) statuses[slot] = status;
+          ++num_inputs[slot];
+          num_bytes[slot] += inputs[i].size();
+        }
+        const std::chrono::duration<double> task_elapsed =
+            std::chrono::steady_clock::now() - task_start;
+        busy_seconds[slot] += task_elapsed.count();
+      });
+
+  for (const auto &status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+
+  if (stats != nullptr) {
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats->num_inputs = std::move(num_inputs);
+    stats->num_bytes = std::move(num_bytes);
+    stats->busy_seconds = std::move(busy_seconds);
+    stats->elapsed_seconds = elapsed.count();
+  }
+
+  return util::OkStatus();
+}
+
 util::Status SentencePieceProcessor::PopulateSentencePieceText(
     absl::string_view input, absl::string_view normalized,
-    const std::vector<size_t> &norm_to_orig, const EncodeResult &result,
+    const normalizer::Alignment &norm_to_orig, const EncodeResult &result,
     SentencePieceText *spt) const {
-  size_t consumed = 0;
+  FlatSentencePieceText flat;
+  RETURN_IF_ERROR(PopulateFlatSentencePieceText(
+      input, normalized, norm_to_orig, result, EncodeOptions(), &flat));
+  flat.CopyToProto(spt);
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::PopulateFlatSentencePieceText(
+    absl::string_view input, absl::string_view normalized,
+    const normalizer::Alignment &norm_to_orig, const EncodeResult &result,
+    const EncodeOptions &options, FlatSentencePieceText *flat) const {
+  using Piece = FlatSentencePieceText::Piece;
+  flat->Clear();
+  flat->text_.assign(input.data(), input.size());
+  OutputLayout layout;
+  RETURN_IF_ERROR(GetOutputLayout(encode_extra_options_, options, &layout));
+
+  // The pieces are written once in their final order. They are counted
+  // first, so that a reversed output is written from the back.
+  size_t size = 0;
   bool is_prev_unk = false;
+  for (const auto &p : result) {
+    const bool is_unk = IsUnknown(p.second);
+    if (is_unk && model_->ByteFallbackEnabled()) {
+      size += p.first.size();
+    } else if (IsControl(p.second) || !(is_prev_unk && is_unk)) {
+      ++size;
+    }
+    is_prev_unk = is_unk;
+  }
+  auto &pieces = flat->pieces_;
+  pieces.resize(layout.prefix.size() + size + layout.suffix.size());
+
+  // The pieces come in the order of the input, so their character offsets
+  // are counted along the way with a single walk over `input`.
+  UnicodeOffsetCounter counter(input);
+  auto &spans = flat->unicode_spans_;
+  if (options.unicode_spans) spans.resize(pieces.size());
+  const auto set_span = [&](const Piece *piece, size_t begin, size_t end) {
+    if (!options.unicode_spans) return;
+    auto &span = spans[piece - pieces.data()];
+    span.first = counter.Count(begin);
+    span.second = counter.Count(end);
+  };
+
+  size_t emitted = 0;
+  const auto next_piece = [&]() {
+    const size_t index = layout.reverse ? size - 1 - emitted : emitted;
+    ++emitted;
+    return &pieces[layout.prefix.size() + index];
+  };
+  Piece *last = nullptr;
+
+  size_t consumed = 0;
+  is_prev_unk = false;
   for (const auto &p : result) {
     const absl::string_view w = p.first;  // piece
     const int id = p.second;              // id
@@ -560,11 +2990,11 @@ util::Status SentencePieceProcessor::PopulateSentencePieceText(
 
     if (IsControl(id)) {
       // Control symbol has no corresponding source surface, so begin == end.
-      auto *sp = spt->add_pieces();
-      sp->set_piece(w.data(), w.size());
-      sp->set_id(id);
-      sp->set_begin(norm_to_orig[consumed]);
-      sp->set_end(norm_to_orig[consumed]);
+      Piece *piece = next_piece();
+      piece->id = id;
+      piece->begin = piece->end = norm_to_orig[consumed];
+      set_span(piece, piece->begin, piece->end);
+      flat->AppendPiece(w, piece);
     } else {
       const size_t begin = consumed;
       const size_t end = consumed + w.size();
@@ -575,49 +3005,51 @@ util::Status SentencePieceProcessor::PopulateSentencePieceText(
       CHECK_LE_OR_RETURN(orig_begin, input.size());
       CHECK_LE_OR_RETURN(orig_end, input.size());
       CHECK_LE_OR_RETURN(orig_begin, orig_end);
-      const auto surface =
-          absl::ClippedSubstr(input, orig_begin, orig_end - orig_begin);
 
       if (is_unk && model_->ByteFallbackEnabled()) {
         // Decomposes an unknown piece into UTF-8 bytes
         for (int i = 0; i < w.size(); ++i) {
           // Create a byte piece
-          const char b = w[i];
-          auto *sp = spt->add_pieces();
-          const auto piece = ByteToPiece(b);
-          auto sp_id = model_->PieceToId(piece);
-          sp->set_piece(piece.data(), piece.size());
-          sp->set_id(sp_id);
+          Piece *piece = next_piece();
+          const absl::string_view byte_piece = ByteToPieceView(w[i]);
+          piece->id = model_->ByteToId(w[i]);
+          flat->AppendPiece(byte_piece, piece);
 
           // The last byte piece holds the surface of the original unknown
           // character. The other byte pieces have no surface.
+          piece->begin = orig_begin;
           if (i == w.size() - 1) {
-            sp->set_surface(surface.data(), surface.size());
-            sp->set_begin(orig_begin);
-            sp->set_end(orig_end);
+            piece->end = orig_end;
+            piece->has_surface = true;
           } else {
             // begin == end
-            sp->set_begin(orig_begin);
-            sp->set_end(orig_begin);
+            piece->end = orig_begin;
           }
+          set_span(piece, piece->begin, piece->end);
         }
       } else {
         // Merges continuous run of unknown pieces so that decoder
         // can copy or generate unknown tokens easily.
         // Note that merged tokens are still unknown,
         // since known pieces never consist of unknown characters.
+        // The pieces and the surfaces of a run are adjacent, so the merged
+        // piece just extends its ranges. With the "unk" extra option, the
+        // piece of the run is the unknown piece itself.
         if (is_prev_unk && is_unk) {
-          auto *sp = spt->mutable_pieces(spt->pieces_size() - 1);
-          sp->set_piece(sp->piece() + std::string(w));
-          sp->set_surface(sp->surface() + std::string(surface));
-          sp->set_end(orig_end);
+          if (!layout.unk_piece) flat->AppendPiece(w, last);
+          last->end = orig_end;
+          set_span(last, last->begin, last->end);
         } else {
-          auto *sp = spt->add_pieces();
-          sp->set_piece(w.data(), w.size());
-          sp->set_id(id);
-          sp->set_surface(surface.data(), surface.size());
-          sp->set_begin(orig_begin);
-          sp->set_end(orig_end);
+          last = next_piece();
+          last->id = id;
+          last->begin = orig_begin;
+          last->end = orig_end;
+          last->has_surface = true;
+          set_span(last, last->begin, last->end);
+          flat->AppendPiece(is_unk && layout.unk_piece
+                                ? absl::string_view(model_->unk_piece())
+                                : w,
+                            last);
         }
       }
       consumed += w.size();
@@ -628,42 +3060,210 @@ util::Status SentencePieceProcessor::PopulateSentencePieceText(
   CHECK_EQ_OR_RETURN(consumed, normalized.size())
       << "all normalized characters are not consumed.";
 
-  spt->set_text(input.data(), input.size());
-
-  RETURN_IF_ERROR(ApplyExtraOptions(encode_extra_options_, spt));
+  // <s> and </s> are placed at the start and the end of the input.
+  const auto add_bos_eos = [&](int id, bool eos, Piece *piece) {
+    piece->id = id;
+    piece->begin = piece->end = eos ? input.size() : 0;
+    if (options.unicode_spans) {
+      auto &span = spans[piece - pieces.data()];
+      span.first = span.second = eos ? counter.Count(input.size()) : 0;
+    }
+    flat->AppendPiece(IdToPiece(id), piece);
+  };
+  for (size_t i = 0; i < layout.prefix.size(); ++i) {
+    add_bos_eos(layout.prefix[i], layout.prefix_eos[i], &pieces[i]);
+  }
+  for (size_t i = 0; i < layout.suffix.size(); ++i) {
+    add_bos_eos(layout.suffix[i], layout.suffix_eos[i],
+                &pieces[layout.prefix.size() + size + i]);
+  }
 
   return util::OkStatus();
-}  // namespace sentencepiece
+}
 
 util::Status SentencePieceProcessor::Encode(absl::string_view input,
                                             SentencePieceText *spt) const {
+  EncodeContext context;
+  return Encode(input, spt, &context);
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            SentencePieceText *spt,
+                                            EncodeContext *context) const {
   CHECK_OR_RETURN_STATUS_PROTO(spt);
+  CHECK_OR_RETURN(context) << "context is null";
+  FlatSentencePieceText *flat = &context->flat_;
+  RETURN_IF_ERROR(Encode(input, flat, context));
+  flat->CopyToProto(spt);
+  return util::OkStatus();
+}
 
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            const EncodeOptions &options,
+                                            SentencePieceText *spt,
+                                            EncodeContext *context) const {
+  CHECK_OR_RETURN_STATUS_PROTO(spt);
+  CHECK_OR_RETURN(context) << "context is null";
+  CHECK_EQ_OR_RETURN(options.max_tokens, 0)
+      << "max_tokens is not supported for SentencePieceText.";
+  const VocabularyRestriction *restriction = nullptr;
+  RETURN_IF_ERROR(GetVocabularyRestriction(options, &restriction));
+  input = CutAtCharBoundary(input, options.max_input_bytes);
+  FlatSentencePieceText *flat = &context->flat_;
+  RETURN_IF_ERROR(EncodeToFlat(input, options, restriction, flat, context));
+  flat->CopyToProto(spt);
+  return util::OkStatus();
+}
 
-  const auto result = model_->Encode(normalized);
-  RETURN_IF_ERROR(
-      PopulateSentencePieceText(input, normalized, norm_to_orig, result, spt));
+util::Status SentencePieceProcessor::Encode(
+    absl::string_view input, FlatSentencePieceText *flat) const {
+  EncodeContext context;
+  return Encode(input, flat, &context);
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            FlatSentencePieceText *flat,
+                                            EncodeContext *context) const {
+  return EncodeToFlat(input, EncodeOptions(), nullptr, flat, context);
+}
+
+util::Status SentencePieceProcessor::EncodeToFlat(
+    absl::string_view input, const EncodeOptions &options,
+    const VocabularyRestriction *restriction, FlatSentencePieceText *flat,
+    EncodeContext *context) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(flat) << "output flat result is null";
+  CHECK_OR_RETURN(context) << "context is null";
+
+  context->consumed_input_bytes_ = input.size();
+  CallTimer timer;
+  RETURN_IF_ERROR(LocalNormalizer()->Normalize(input, &context->normalized_,
+                                               context->norm_to_orig_.get()));
+  return EncodeNormalizedToFlat(input, options, restriction, timer.Lap(),
+                                flat, context);
+}
+
+util::Status SentencePieceProcessor::EncodeNormalizedToFlat(
+    absl::string_view input, const EncodeOptions &options,
+    const VocabularyRestriction *restriction, uint64_t normalize_ns,
+    FlatSentencePieceText *flat, EncodeContext *context) const {
+  CallTimer timer;
+  MetricsRecorder::EncodeCall call;
+  call.normalize_ns = normalize_ns;
+
+  RETURN_IF_ERROR(EncodeNormalized(context->normalized_, options, restriction,
+                                   &context->result_, &context->scratch_));
+  call.model_ns = timer.Lap();
+  RETURN_IF_ERROR(PopulateFlatSentencePieceText(
+      input, context->normalized_, *context->norm_to_orig_, context->result_,
+      options, flat));
+
+  if (metrics_) {
+    call.populate_ns = timer.Lap();
+    call.input_bytes = input.size();
+    call.output_pieces = flat->size();
+    // Counted from the model output as PopulateSentencePieceText() and the
+    // ids path do.
+    const bool byte_fallback = model_->ByteFallbackEnabled();
+    bool is_prev_unk = false;
+    for (const auto &p : context->result_) {
+      const bool is_unk = IsUnknown(p.second);
+      if (is_unk && byte_fallback) {
+        call.byte_fallback_pieces += p.first.size();
+      } else if (is_unk && !is_prev_unk) {
+        ++call.unk_pieces;
+      }
+      is_prev_unk = is_unk;
+    }
+    metrics_->RecordEncode(call);
+  }
 
   return util::OkStatus();
 }
 
+bool SentencePieceProcessor::NormalizesAs(
+    const SentencePieceProcessor &other) const {
+  if (normalizer_ == other.normalizer_) return true;
+  return !normalization_key_.empty() &&
+         normalization_key_ == other.normalization_key_;
+}
+
+// static
+util::Status SentencePieceProcessor::EncodeWithModels(
+    const std::vector<const SentencePieceProcessor *> &processors,
+    absl::string_view input, std::vector<FlatSentencePieceText> *flats) {
+  CHECK_OR_RETURN(flats) << "output flat results are null";
+  for (const auto *processor : processors) {
+    CHECK_OR_RETURN(processor) << "processor is null";
+    RETURN_IF_ERROR(processor->status());
+  }
+  flats->resize(processors.size());
+
+  // The scratch buffers belong to a model, so each processor keeps its own
+  // while they take turns on the shared normalized text in `context`.
+  EncodeContext context;
+  std::vector<std::unique_ptr<EncodeScratch>> scratches(processors.size());
+  std::vector<bool> encoded(processors.size(), false);
+  for (size_t i = 0; i < processors.size(); ++i) {
+    if (encoded[i]) continue;
+    const SentencePieceProcessor &first = *processors[i];
+    CallTimer timer;
+    RETURN_IF_ERROR(first.LocalNormalizer()->Normalize(
+        input, &context.normalized_, context.norm_to_orig_.get()));
+    uint64_t normalize_ns = timer.Lap();
+    for (size_t j = i; j < processors.size(); ++j) {
+      if (encoded[j] || !first.NormalizesAs(*processors[j])) continue;
+      context.scratch_.swap(scratches[j]);
+      const util::Status status = processors[j]->EncodeNormalizedToFlat(
+          input, EncodeOptions(), nullptr, normalize_ns, &(*flats)[j],
+          &context);
+      context.scratch_.swap(scratches[j]);
+      RETURN_IF_ERROR(status);
+      // Only the first model of a group is charged for the normalization.
+      normalize_ns = 0;
+      encoded[j] = true;
+    }
+  }
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceProcessor::EncodeWithModels(
+    const std::vector<const SentencePieceProcessor *> &processors,
+    absl::string_view input, std::vector<std::vector<int>> *ids) {
+  CHECK_OR_RETURN(ids) << "output ids are null";
+  std::vector<FlatSentencePieceText> flats;
+  RETURN_IF_ERROR(EncodeWithModels(processors, input, &flats));
+  ids->resize(flats.size());
+  for (size_t i = 0; i < flats.size(); ++i) {
+    auto &out = (*ids)[i];
+    out.resize(flats[i].size());
+    for (size_t k = 0; k < flats[i].size(); ++k) out[k] = flats[i].id(k);
+  }
+  return util::OkStatus();
+}
+
 util::Status SentencePieceProcessor::NBestEncode(
     absl::string_view input, int nbest_size,
     NBestSentencePieceText *nbest_spt) const {
   CHECK_OR_RETURN_STATUS_PROTO(nbest_spt);
 
   std::string normalized;
-  std::vector<size_t> norm_to_orig;
+  normalizer::Alignment norm_to_orig;
   RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
 
   CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
       << "NBestEncode is not available for the current model.";
 
-  const auto nbests = model_->NBestEncode(normalized, nbest_size);
-  CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+  std::vector<absl::string_view> segments;
+  RETURN_IF_ERROR(SplitIntoSegments(normalized, &segments));
+  std::vector<NBestEncodeResult> segment_nbests;
+  for (const auto segment : segments) {
+    segment_nbests.push_back(model_->NBestEncode(segment, nbest_size));
+    CHECK_OR_RETURN(!segment_nbests.back().empty())
+        << "NBestEncode returns empty result.";
+  }
+  const auto nbests = JoinSegmentResults(segment_nbests);
 
   for (const auto &result : nbests) {
     auto *spt = nbest_spt->add_nbests();
@@ -683,78 +3283,328 @@ util::Status SentencePieceProcessor::SampleEncode(
   CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
 
   std::string normalized;
-  std::vector<size_t> norm_to_orig;
+  normalizer::Alignment norm_to_orig;
   RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
 
+  EncodeResult result;
+  RETURN_IF_ERROR(
+      SampleEncodeNormalized(normalized, nbest_size, alpha, &result));
+  RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
+                                            result, spt));
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeNormalized(
+    absl::string_view normalized, int nbest_size, float alpha,
+    EncodeResult *result) const {
+  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
   if (!model_->IsNBestEncodeAvailable() || nbest_size < 0) {
     CHECK_OR_RETURN(model_->IsSampleEncodeAvailable())
         << "SampleEncode is not available for the current model.";
-    const auto result = model_->SampleEncode(normalized, alpha);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result, spt));
-  } else if (nbest_size == 1 || nbest_size == 0) {
-    const auto result = model_->Encode(normalized);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result, spt));
-  } else if (nbest_size > 1) {
-    const auto nbests = model_->NBestEncode(normalized, nbest_size);
-    CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
-
-    std::vector<double> log_probs;
-    log_probs.reserve(nbests.size());
-    std::transform(nbests.begin(), nbests.end(), std::back_inserter(log_probs),
-                   [alpha](const auto &nbest) { return alpha * nbest.second; });
-
-    const double Z = log_domain::LogSum(log_probs);
-    std::vector<double> probs;
-    probs.reserve(log_probs.size());
-    std::transform(
-        log_probs.begin(), log_probs.end(), std::back_inserter(probs),
-        [Z](const auto &log_prob) { return std::exp(log_prob - Z); });
-
-    auto *mt = random::GetRandomGenerator();
-    std::discrete_distribution<int> dist(probs.begin(), probs.end());
+  }
+
+  std::vector<absl::string_view> segments;
+  RETURN_IF_ERROR(SplitIntoSegments(normalized, &segments));
+
+  result->clear();
+  for (const auto segment : segments) {
+    if (!model_->IsNBestEncodeAvailable() || nbest_size < 0) {
+      const auto sampled = model_->SampleEncode(segment, alpha);
+      result->insert(result->end(), sampled.begin(), sampled.end());
+    } else if (nbest_size == 1 || nbest_size == 0) {
+      const auto best = model_->Encode(segment);
+      result->insert(result->end(), best.begin(), best.end());
+    } else if (nbest_size > 1) {
+      const auto nbests = model_->NBestEncode(segment, nbest_size);
+      CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+
+      std::vector<double> log_probs;
+      log_probs.reserve(nbests.size());
+      std::transform(
+          nbests.begin(), nbests.end(), std::back_inserter(log_probs),
+          [alpha](const auto &nbest) { return alpha * nbest.second; });
+
+      const double Z = log_domain::LogSum(log_probs);
+      std::vector<double> probs;
+      probs.reserve(log_probs.size());
+      std::transform(
+          log_probs.begin(), log_probs.end(), std::back_inserter(probs),
+          [Z](const auto &log_prob) { return std::exp(log_prob - Z); });
+
+      auto *mt = random::GetRandomGenerator();
+      std::discrete_distribution<int> dist(probs.begin(), probs.end());
+      const auto &sampled = nbests[dist(*mt)].first;
+      result->insert(result->end(), sampled.begin(), sampled.end());
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeNormalized(
+    absl::string_view normalized, const EncodeOptions &options,
+    const VocabularyRestriction *restriction, EncodeResult *result,
+    std::unique_ptr<EncodeScratch> *scratch) const {
+  if (!options.enable_sampling) {
+    EncodeNormalized(normalized, restriction, result, scratch);
+    return util::OkStatus();
+  }
+  CHECK_OR_RETURN(restriction == nullptr && options.max_tokens == 0)
+      << "vocabulary and max_tokens are not supported with sampling.";
+  return SampleEncodeNormalized(normalized, options.nbest_size, options.alpha,
+                                result);
+}
+
+util::Status SentencePieceProcessor::SampleEncodeAndScore(
+    absl::string_view input, int samples, float alpha, bool wor,
+    bool include_best, NBestSentencePieceText *samples_spt) const {
+  CHECK_OR_RETURN(model_->IsSampleEncodeAndScoreAvailable())
+      << "SampleEncodeAndScore is not available for the current model.";
+  std::string normalized;
+  normalizer::Alignment norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+
+  std::vector<absl::string_view> segments;
+  RETURN_IF_ERROR(SplitIntoSegments(normalized, &segments));
+  std::vector<NBestEncodeResult> segment_results;
+  for (const auto segment : segments) {
+    segment_results.push_back(model_->SampleEncodeAndScore(
+        segment, alpha, samples, wor, include_best));
+    CHECK_OR_RETURN(!segment_results.back().empty())
+        << "SampleEncodeAndScore returns empty result.";
+  }
+  const auto results = JoinSegmentResults(segment_results);
+
+  for (const auto &result : results) {
+    auto *spt = samples_spt->add_nbests();
+    spt->set_score(result.second);
     RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              nbests[dist(*mt)].first, spt));
+                                              result.first, spt));
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeMany(
+    absl::string_view input, int num_samples, float alpha,
+    NBestSentencePieceText *samples_spt) const {
+  CHECK_OR_RETURN_STATUS_PROTO(samples_spt);
+  CHECK_OR_RETURN(model_->IsSampleEncodeAvailable())
+      << "SampleEncode is not available for the current model.";
+  CHECK_GE_OR_RETURN(num_samples, 0);
+
+  std::string normalized;
+  normalizer::Alignment norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+
+  std::vector<absl::string_view> segments;
+  RETURN_IF_ERROR(SplitIntoSegments(normalized, &segments));
+  std::vector<EncodeResult> results;
+  for (const auto segment : segments) {
+    auto samples = model_->SampleEncodeMany(segment, alpha, num_samples);
+    if (results.empty()) {
+      results = std::move(samples);
+      continue;
+    }
+    for (size_t i = 0; i < results.size() && i < samples.size(); ++i) {
+      results[i].insert(results[i].end(), samples[i].begin(),
+                        samples[i].end());
+    }
+  }
+
+  for (const auto &result : results) {
+    RETURN_IF_ERROR(PopulateSentencePieceText(
+        input, normalized, norm_to_orig, result, samples_spt->add_nbests()));
   }
 
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::SampleEncodeAndScore(
-    absl::string_view input, int samples, float alpha, bool wor,
-    bool include_best, NBestSentencePieceText *samples_spt) const {
+util::Status SentencePieceProcessor::CalculateEntropy(absl::string_view input,
+                                                      float alpha,
+                                                      float *entropy) const {
+  CHECK_OR_RETURN(model_->IsCalculateEntropyAvailable())
+      << "CalculateEntropy is not available for the current model.";
+  std::string normalized;
+  normalizer::Alignment norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+
+  *entropy = model_->CalculateEntropy(normalized, alpha);
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CalculateEntropyBatch(
+    const std::vector<absl::string_view> &inputs, float alpha,
+    std::vector<float> *entropies,
+    std::vector<std::vector<std::pair<int, float>>> *expected_counts) const {
+  CHECK_OR_RETURN_STATUS_STL(entropies);
+  CHECK_OR_RETURN(model_->IsCalculateEntropyAvailable())
+      << "CalculateEntropy is not available for the current model.";
+  entropies->resize(inputs.size());
+  if (expected_counts != nullptr) expected_counts->resize(inputs.size());
+
+  // The lattice of each worker is kept in its scratch, indexed by the slot.
+  const auto pool = GetThreadPool();
+  std::vector<std::unique_ptr<EncodeScratch>> scratches(
+      std::max<int32>(1, pool->size()));
+  std::vector<util::Status> statuses(inputs.size());
+  pool->ParallelFor(inputs.size(), 0, [&](int32 slot, int64 begin, int64 end) {
+    std::string normalized;
+    normalizer::Alignment norm_to_orig;
+    for (int64 i = begin; i < end; ++i) {
+      statuses[i] =
+          normalizer_->Normalize(inputs[i], &normalized, &norm_to_orig);
+      if (!statuses[i].ok()) continue;
+      (*entropies)[i] = model_->CalculateEntropyAndMarginals(
+          normalized, alpha,
+          expected_counts == nullptr ? nullptr : &(*expected_counts)[i],
+          &scratches[slot]);
+    }
+  });
+
+  for (const auto &status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CalculateEntropyBatch(
+    const std::vector<absl::string_view> &inputs, float alpha,
+    std::vector<float> *entropies,
+    std::vector<std::vector<float>> *expected_counts) const {
+  CHECK_OR_RETURN_STATUS_STL(expected_counts);
+  std::vector<std::vector<std::pair<int, float>>> sparse_counts;
+  RETURN_IF_ERROR(
+      CalculateEntropyBatch(inputs, alpha, entropies, &sparse_counts));
+  expected_counts->resize(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    auto &counts = (*expected_counts)[i];
+    counts.assign(GetPieceSize(), 0.0);
+    for (const auto &p : sparse_counts[i]) counts[p.first] = p.second;
+  }
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncodeBatch(
+    const std::vector<absl::string_view> &inputs, int nbest_size,
+    NBestBatch *batch) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
+      << "NBestEncode is not available for the current model.";
+  return EncodeCandidatesBatch(
+      inputs, "NBestEncode",
+      [&](absl::string_view segment, std::unique_ptr<EncodeScratch> *scratch) {
+        return model_->NBestEncodeWithScratch(segment, nbest_size, scratch);
+      },
+      batch);
+}
+
+util::Status SentencePieceProcessor::SampleEncodeAndScoreBatch(
+    const std::vector<absl::string_view> &inputs, int num_samples,
+    float alpha, bool wor, bool include_best, NBestBatch *batch) const {
+  RETURN_IF_ERROR(status());
   CHECK_OR_RETURN(model_->IsSampleEncodeAndScoreAvailable())
       << "SampleEncodeAndScore is not available for the current model.";
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+  return EncodeCandidatesBatch(
+      inputs, "SampleEncodeAndScore",
+      [&](absl::string_view segment, std::unique_ptr<EncodeScratch> *scratch) {
+        return model_->SampleEncodeAndScoreWithScratch(
+            segment, alpha, num_samples, wor, include_best, scratch);
+      },
+      batch);
+}
 
-  const auto results = model_->SampleEncodeAndScore(normalized, alpha, samples,
-                                                    wor, include_best);
-  CHECK_OR_RETURN(!results.empty())
-      << "SampleEncodeAndScore returns empty result.";
+util::Status SentencePieceProcessor::EncodeCandidatesBatch(
+    const std::vector<absl::string_view> &inputs, absl::string_view name,
+    const std::function<SegmentCandidates(
+        absl::string_view, std::unique_ptr<EncodeScratch> *)> &encode,
+    NBestBatch *batch) const {
+  CHECK_OR_RETURN(batch) << "output batch is null";
+  OutputLayout layout;
+  RETURN_IF_ERROR(GetOutputLayout(encode_extra_options_, EncodeOptions(),
+                                  &layout));
+
+  // Each worker appends the candidates of its inputs to its own arrays,
+  // which are joined in the order of the inputs at the end. The lattice of
+  // each worker is kept in its scratch, indexed by the slot.
+  struct Candidates {
+    std::vector<int> ids;
+    std::vector<size_t> ends;
+    std::vector<float> scores;
+  };
+  const auto pool = GetThreadPool();
+  const size_t num_slots = std::max<int32>(1, pool->size());
+  std::vector<std::unique_ptr<EncodeScratch>> scratches(num_slots);
+  std::vector<Candidates> slots(num_slots);
+  // The slot of each input and the range of its candidates in the slot.
+  std::vector<int32> input_slots(inputs.size());
+  std::vector<std::pair<size_t, size_t>> ranges(inputs.size());
+  std::vector<util::Status> statuses(inputs.size());
+  pool->ParallelFor(inputs.size(), 0, [&](int32 slot, int64 begin, int64 end) {
+    Candidates &out = slots[slot];
+    std::string normalized;
+    std::vector<absl::string_view> segments;
+    std::vector<SegmentCandidates> segment_candidates;
+    MetricsRecorder::EncodeCall call;
+    for (int64 i = begin; i < end; ++i) {
+      input_slots[i] = slot;
+      ranges[i].first = ranges[i].second = out.scores.size();
+      statuses[i] = [&]() -> util::Status {
+        RETURN_IF_ERROR(normalizer_->Normalize(
+            inputs[i], &normalized,
+            static_cast<normalizer::Alignment *>(nullptr)));
+        RETURN_IF_ERROR(SplitIntoSegments(normalized, &segments));
+        segment_candidates.clear();
+        for (const auto segment : segments) {
+          segment_candidates.push_back(encode(segment, &scratches[slot]));
+          CHECK_OR_RETURN(!segment_candidates.back().empty())
+              << name << " returns empty result.";
+        }
+        for (const auto &candidate : JoinSegmentResults(segment_candidates)) {
+          // The ids of a candidate are the ones of NBestEncode().
+          out.ids.insert(out.ids.end(), layout.prefix.begin(),
+                         layout.prefix.end());
+          const size_t begin = out.ids.size();
+          bool is_prev_unk = false;
+          RETURN_IF_ERROR(AppendIds(*model_, candidate.first,
+                                    normalized.size(), &is_prev_unk,
+                                    &out.ids, &call));
+          if (layout.reverse) {
+            std::reverse(out.ids.begin() + begin, out.ids.end());
+          }
+          out.ids.insert(out.ids.end(), layout.suffix.begin(),
+                         layout.suffix.end());
+          out.ends.push_back(out.ids.size());
+          out.scores.push_back(candidate.second);
+        }
+        return util::OkStatus();
+      }();
+      ranges[i].second = out.scores.size();
+    }
+  });
 
-  for (const auto &result : results) {
-    auto *spt = samples_spt->add_nbests();
-    spt->set_score(result.second);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result.first, spt));
+  for (const auto &status : statuses) {
+    RETURN_IF_ERROR(status);
   }
 
-  return util::OkStatus();
-}
-
-util::Status SentencePieceProcessor::CalculateEntropy(absl::string_view input,
-                                                      float alpha,
-                                                      float *entropy) const {
-  CHECK_OR_RETURN(model_->IsCalculateEntropyAvailable())
-      << "CalculateEntropy is not available for the current model.";
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+  batch->ids.clear();
+  batch->scores.clear();
+  batch->id_offsets.assign(1, 0);
+  batch->candidate_offsets.assign(1, 0);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const Candidates &out = slots[input_slots[i]];
+    for (size_t j = ranges[i].first; j < ranges[i].second; ++j) {
+      const size_t begin = j == 0 ? 0 : out.ends[j - 1];
+      batch->ids.insert(batch->ids.end(), out.ids.begin() + begin,
+                        out.ids.begin() + out.ends[j]);
+      batch->id_offsets.push_back(batch->ids.size());
+      batch->scores.push_back(out.scores[j]);
+    }
+    batch->candidate_offsets.push_back(batch->scores.size());
+  }
 
-  *entropy = model_->CalculateEntropy(normalized, alpha);
   return util::OkStatus();
 }
 
@@ -767,6 +3617,7 @@ util::Status SentencePieceProcessor::Decode(
     const std::vector<absl::string_view> &pieces,
     SentencePieceText *spt) const {
   CHECK_OR_RETURN_STATUS_PROTO(spt);
+  CallTimer timer;
 
   const char *unk_surface = kDefaultUnknownSymbol;
   if (model_proto_ && model_proto_->trainer_spec().has_unk_surface())
@@ -810,13 +3661,25 @@ util::Status SentencePieceProcessor::Decode(
                           has_bos_ws);
   };
 
-  for (absl::string_view w : pieces) {
+  // The extra options are applied while the pieces are added.
+  OutputLayout layout;
+  RETURN_IF_ERROR(
+      GetOutputLayout(decode_extra_options_, EncodeOptions(), &layout));
+  spt->mutable_pieces()->Reserve(pieces.size() + layout.prefix.size() +
+                                 layout.suffix.size());
+  const auto add_piece = [&](absl::string_view w, int id) {
     auto *sp = spt->add_pieces();
+    if (layout.unk_piece && IsUnknown(id)) w = model_->unk_piece();
     sp->mutable_piece()->assign(w.data(), w.size());
-    sp->set_id(PieceToId(w));
+    sp->set_id(id);
+  };
+  for (const int id : layout.prefix) add_piece(IdToPiece(id), id);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    const absl::string_view w =
+        pieces[layout.reverse ? pieces.size() - 1 - i : i];
+    add_piece(w, PieceToId(w));
   }
-
-  RETURN_IF_ERROR(ApplyExtraOptions(decode_extra_options_, spt));
+  for (const int id : layout.suffix) add_piece(IdToPiece(id), id);
 
   std::string *text = spt->mutable_text();
   auto SetSurface = [&](int index, absl::string_view surface) {
@@ -906,6 +3769,33 @@ util::Status SentencePieceProcessor::Decode(
     *text = denormalizer_->Normalize(*text);
   }
 
+  if (metrics_) metrics_->RecordDecode(pieces.size(), timer.Lap());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::DecodeWithTable(
+    const int *ids, size_t size, std::string *detokenized) const {
+  CallTimer timer;
+  const auto &normalizer_spec = model_proto_->normalizer_spec();
+  const bool strip_bos_ws = normalizer_spec.add_dummy_prefix() ||
+                            normalizer_spec.remove_extra_whitespaces();
+  if (denormalizer_ && !decode_table_->CanDenormalize(ids, size)) {
+    std::string text;
+    RETURN_IF_ERROR(decode_table_->Decode(
+        ids, size, strip_bos_ws, normalizer_spec.remove_extra_whitespaces(),
+        false, &text));
+    detokenized->append(denormalizer_->Normalize(text));
+  } else {
+    // Without a denormalizer, or when the ids can be denormalized piece by
+    // piece from the table.
+    RETURN_IF_ERROR(decode_table_->Decode(
+        ids, size, strip_bos_ws, normalizer_spec.remove_extra_whitespaces(),
+        denormalizer_ != nullptr, detokenized));
+  }
+
+  if (metrics_) metrics_->RecordDecode(size, timer.Lap());
+
   return util::OkStatus();
 }
 
@@ -924,6 +3814,775 @@ util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
   return Decode(pieces, spt);
 }
 
+StreamingDecoder::StreamingDecoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {}
+
+StreamingDecoder::~StreamingDecoder() {}
+
+util::Status StreamingDecoder::Decode(int id, std::string *text) {
+  CHECK_OR_RETURN(text) << "output container is null";
+  text->clear();
+  RETURN_IF_ERROR(processor_.status());
+  const DecodeTable *table = processor_.decode_table_.get();
+  CHECK_OR_RETURN(table) << "StreamingDecoder requires a loaded model.";
+  if (id < 0 || id >= table->size()) {
+    return util::Status(util::StatusCode::kOutOfRange,
+                        absl::StrCat("Invalid id: ", id));
+  }
+
+  const auto &entry = table->entry(id);
+  if (entry.byte >= 0) {
+    bytes_.push_back(static_cast<char>(entry.byte));
+    TakeBytes(false, text);
+  } else {
+    TakeBytes(true, text);
+    if (is_bos_ws_) {
+      if (bos_ws_seen_ || emitted_ || !text->empty()) {
+        is_bos_ws_ = false;
+      } else {
+        const auto &normalizer_spec =
+            processor_.model_proto_->normalizer_spec();
+        if (!normalizer_spec.add_dummy_prefix() &&
+            !normalizer_spec.remove_extra_whitespaces()) {
+          is_bos_ws_ = false;
+        } else {
+          bos_ws_seen_ = entry.space_prefixed &&
+                         !normalizer_spec.remove_extra_whitespaces();
+        }
+      }
+    }
+    const absl::string_view surface = table->Surface(entry, is_bos_ws_);
+    text->append(surface.data(), surface.size());
+  }
+
+  if (!text->empty()) emitted_ = true;
+  Denormalize(text);
+  return util::OkStatus();
+}
+
+util::Status StreamingDecoder::Finish(std::string *text) {
+  CHECK_OR_RETURN(text) << "output container is null";
+  text->clear();
+  TakeBytes(true, text);
+  Denormalize(text);
+  Reset();
+  return util::OkStatus();
+}
+
+void StreamingDecoder::Reset() {
+  bytes_.clear();
+  is_bos_ws_ = true;
+  bos_ws_seen_ = false;
+  emitted_ = false;
+}
+
+void StreamingDecoder::TakeBytes(bool flush, std::string *text) {
+  size_t size = bytes_.size();
+  if (!flush) {
+    // Holds back the last character while it may still be completed.
+    // DecodeUTF8() only reads as many bytes as the leading byte announces.
+    for (size_t begin = 0; begin < bytes_.size();) {
+      const unsigned char c = bytes_[begin];
+      const size_t length = (c & 0xE0) == 0xC0   ? 2
+                            : (c & 0xF0) == 0xE0 ? 3
+                            : (c & 0xF8) == 0xF0 ? 4
+                                                 : 1;
+      if (begin + length > bytes_.size()) {
+        size = begin;
+        break;
+      }
+      size_t consumed = 0;
+      string_util::IsValidDecodeUTF8(absl::string_view(bytes_).substr(begin),
+                                     &consumed);
+      begin += consumed;
+    }
+  }
+  DecodeTable::AppendBytes(absl::string_view(bytes_).substr(0, size), text);
+  bytes_.erase(0, size);
+}
+
+void StreamingDecoder::Denormalize(std::string *text) const {
+  if (processor_.denormalizer_ && !text->empty()) {
+    *text = processor_.denormalizer_->Normalize(*text);
+  }
+}
+
+IncrementalEncoder::IncrementalEncoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {}
+
+IncrementalEncoder::~IncrementalEncoder() {}
+
+util::Status IncrementalEncoder::Append(absl::string_view text,
+                                        int *num_retracted,
+                                        std::vector<int> *added) {
+  CHECK_OR_RETURN(num_retracted) << "output num_retracted is null";
+  CHECK_OR_RETURN(added) << "output container is null";
+  *num_retracted = 0;
+  added->clear();
+  RETURN_IF_ERROR(processor_.status());
+  if (stream_ == nullptr ||
+      stream_normalizer_ != processor_.normalizer_.get()) {
+    CHECK_OR_RETURN(ids_.empty() && pending_.empty())
+        << "The model of the processor has changed.";
+    stream_ = std::make_unique<normalizer::StreamNormalizer>(
+        *processor_.normalizer_);
+    stream_normalizer_ = processor_.normalizer_.get();
+    safe_cut_finder_.reset();
+    if (!processor_.model_->IsWordSplittable()) {
+      safe_cut_finder_ =
+          std::make_unique<SafeCutFinder>(*processor_.model_proto_);
+    }
+  }
+  RETURN_IF_ERROR(stream_->Feed(text, &pending_, nullptr));
+
+  // The ids from num_final_ids_ on, starting with the ones becoming final.
+  const ModelInterface *model = processor_.LocalModel();
+  MetricsRecorder::EncodeCall call;
+  EncodeResult result;
+  std::vector<int> ids;
+  const size_t final_size = FinalSize();
+  if (final_size > 0) {
+    model->EncodeWithWordCache(absl::string_view(pending_.data(), final_size),
+                               &result, &scratch_, nullptr);
+    RETURN_IF_ERROR(
+        AppendIds(*model, result, final_size, &is_prev_unk_, &ids, &call));
+    pending_.erase(0, final_size);
+  }
+  const size_t num_new_final_ids = ids.size();
+
+  // The rest is encoded as if the text ended here, on a copy of the stream
+  // which keeps the trailing spaces and the partial rules of the original.
+  normalizer::StreamNormalizer finisher(*stream_);
+  std::string rest = pending_;
+  RETURN_IF_ERROR(finisher.Finish(&rest, nullptr));
+  if (!rest.empty()) {
+    bool is_prev_unk = is_prev_unk_;
+    model->EncodeWithWordCache(rest, &result, &scratch_, nullptr);
+    RETURN_IF_ERROR(
+        AppendIds(*model, result, rest.size(), &is_prev_unk, &ids, &call));
+  }
+
+  // Only the ids after the common prefix with the previous ones change.
+  const size_t num_old_ids = ids_.size() - num_final_ids_;
+  size_t common = 0;
+  while (common < num_old_ids && common < ids.size() &&
+         ids_[num_final_ids_ + common] == ids[common]) {
+    ++common;
+  }
+  *num_retracted = static_cast<int>(num_old_ids - common);
+  added->assign(ids.begin() + common, ids.end());
+  ids_.resize(num_final_ids_ + common);
+  ids_.insert(ids_.end(), added->begin(), added->end());
+  num_final_ids_ += num_new_final_ids;
+  return util::OkStatus();
+}
+
+void IncrementalEncoder::Reset() {
+  if (stream_) stream_->Reset();
+  pending_.clear();
+  ids_.clear();
+  num_final_ids_ = 0;
+  is_prev_unk_ = false;
+}
+
+size_t IncrementalEncoder::FinalSize() const {
+  if (safe_cut_finder_ == nullptr) {
+    return LastWordBoundary(
+        pending_,
+        processor_.model_proto_->trainer_spec().treat_whitespace_as_suffix());
+  }
+  // The last position no piece spans, which is followed by a character
+  // already decided.
+  size_t size = 0;
+  for (size_t pos = safe_cut_finder_->NextCut(pending_, 1);
+       pos < pending_.size();
+       pos = safe_cut_finder_->NextCut(pending_, pos + 1)) {
+    size = pos;
+  }
+  return size;
+}
+
+DocumentEncoder::DocumentEncoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {}
+
+DocumentEncoder::~DocumentEncoder() {}
+
+util::Status DocumentEncoder::SetText(absl::string_view text) {
+  RETURN_IF_ERROR(processor_.status());
+  safe_cut_finder_.reset();
+  if (!processor_.model_->IsWordSplittable()) {
+    safe_cut_finder_ =
+        std::make_unique<SafeCutFinder>(*processor_.model_proto_);
+  }
+  text_.assign(text.data(), text.size());
+  RETURN_IF_ERROR(processor_.LocalNormalizer()->Normalize(
+      text_, &normalized_, static_cast<normalizer::Alignment *>(nullptr)));
+  ids_.clear();
+  ends_.clear();
+  initialized_ = true;
+  return EncodeRange(0, normalized_.size(), &ids_, &ends_);
+}
+
+util::Status DocumentEncoder::Edit(size_t offset, size_t removed,
+                                   absl::string_view inserted,
+                                   Splice *splice) {
+  CHECK_OR_RETURN(splice) << "output splice is null";
+  if (!initialized_) RETURN_IF_ERROR(SetText(""));
+  RETURN_IF_ERROR(processor_.status());
+  CHECK_LE_OR_RETURN(offset, text_.size());
+  CHECK_LE_OR_RETURN(removed, text_.size() - offset);
+  text_.replace(offset, removed, inserted.data(), inserted.size());
+
+  std::string normalized;
+  RETURN_IF_ERROR(processor_.LocalNormalizer()->Normalize(
+      text_, &normalized, static_cast<normalizer::Alignment *>(nullptr)));
+
+  // The normalized text changes in [prefix, old_end) of the old one and
+  // [prefix, new_end) of the new one, which are cut at characters.
+  const size_t common = std::min(normalized.size(), normalized_.size());
+  size_t prefix =
+      std::mismatch(normalized.begin(), normalized.begin() + common,
+                    normalized_.begin())
+          .first -
+      normalized.begin();
+  const size_t suffix =
+      std::mismatch(normalized.rbegin(),
+                    normalized.rbegin() + (common - prefix),
+                    normalized_.rbegin())
+          .first -
+      normalized.rbegin();
+  while (prefix > 0 && prefix < normalized.size() &&
+         string_util::IsTrailByte(normalized[prefix])) {
+    --prefix;
+  }
+  size_t old_end = normalized_.size() - suffix;
+  size_t new_end = normalized.size() - suffix;
+  while (new_end < normalized.size() &&
+         string_util::IsTrailByte(normalized[new_end])) {
+    ++old_end;
+    ++new_end;
+  }
+  normalized_.swap(normalized);
+
+  // Moves the cuts outwards until they are at the ends of the old ids, and
+  // no run of unknown pieces continues across them.
+  bool aligned = false;
+  size_t left = CutBefore(prefix);
+  size_t first = IdsBefore(left, &aligned);
+  while (!aligned || (first > 0 && IsMergeableUnknown(first - 1))) {
+    const size_t id = aligned ? first - 1 : first;
+    left = CutBefore(id > 0 ? ends_[id - 1] : 0);
+    first = IdsBefore(left, &aligned);
+  }
+  size_t right = CutAfter(new_end);
+  size_t last = IdsBefore(right - new_end + old_end, &aligned);
+  while (!aligned || (last < ids_.size() && IsMergeableUnknown(last))) {
+    right = CutAfter(ends_[last] - old_end + new_end);
+    last = IdsBefore(right - new_end + old_end, &aligned);
+  }
+
+  std::vector<int> ids;
+  std::vector<size_t> ends;
+  RETURN_IF_ERROR(EncodeRange(left, right, &ids, &ends));
+
+  // Leaves out the ids which have not changed.
+  size_t head = 0, tail = 0;
+  while (head < ids.size() && first + head < last &&
+         ids[head] == ids_[first + head] && ends[head] == ends_[first + head]) {
+    ++head;
+  }
+  while (tail < ids.size() - head && first + head + tail < last &&
+         ids[ids.size() - 1 - tail] == ids_[last - 1 - tail] &&
+         ends[ends.size() - 1 - tail] ==
+             ends_[last - 1 - tail] - old_end + new_end) {
+    ++tail;
+  }
+  splice->begin = first + head;
+  splice->num_removed = last - first - head - tail;
+  splice->ids.assign(ids.begin() + head, ids.end() - tail);
+
+  for (size_t i = last - tail; i < ends_.size(); ++i) {
+    ends_[i] = ends_[i] - old_end + new_end;
+  }
+  ids_.erase(ids_.begin() + splice->begin,
+             ids_.begin() + splice->begin + splice->num_removed);
+  ids_.insert(ids_.begin() + splice->begin, splice->ids.begin(),
+              splice->ids.end());
+  ends_.erase(ends_.begin() + splice->begin,
+              ends_.begin() + splice->begin + splice->num_removed);
+  ends_.insert(ends_.begin() + splice->begin, ends.begin() + head,
+               ends.end() - tail);
+  return util::OkStatus();
+}
+
+util::Status DocumentEncoder::EncodeRange(size_t begin, size_t end,
+                                          std::vector<int> *ids,
+                                          std::vector<size_t> *ends) {
+  const ModelInterface *model = processor_.LocalModel();
+  EncodeResult result;
+  model->EncodeWithWordCache(
+      absl::string_view(normalized_).substr(begin, end - begin), &result,
+      &scratch_, nullptr);
+  MetricsRecorder::EncodeCall call;
+  bool is_prev_unk = false;
+  size_t pos = begin;
+  for (const auto &p : result) {
+    const size_t num_ids = ids->size();
+    CHECK_OR_RETURN(
+        AppendPieceIds(*model, p.first, p.second, &is_prev_unk, ids, &call))
+        << "Empty piece is not allowed.";
+    if (!model->IsControl(p.second)) pos += p.first.size();
+    // A piece merged into the run of unknown pieces extends its id.
+    if (ids->size() == num_ids && !ends->empty()) ends->back() = pos;
+    ends->resize(ids->size(), pos);
+  }
+  CHECK_EQ_OR_RETURN(pos, end)
+      << "all normalized characters are not consumed.";
+  return util::OkStatus();
+}
+
+size_t DocumentEncoder::CutBefore(size_t pos) const {
+  const absl::string_view normalized =
+      absl::string_view(normalized_).substr(0, pos);
+  if (safe_cut_finder_ == nullptr) {
+    const size_t ws = normalized.rfind(kSpaceSymbol);
+    if (ws == absl::string_view::npos) return 0;
+    return processor_.model_proto_->trainer_spec().treat_whitespace_as_suffix()
+               ? ws + sizeof(kSpaceSymbol) - 1
+               : ws;
+  }
+  // Both characters around the cut are before `pos`. Searches back in
+  // growing windows, as the finder only searches forward.
+  for (size_t window = 256;; window *= 2) {
+    const size_t start = pos > window ? pos - window : 0;
+    size_t cut = 0;
+    for (size_t c = safe_cut_finder_->NextCut(normalized, std::max<size_t>(
+                                                              start, 1));
+         c < normalized.size(); c = safe_cut_finder_->NextCut(normalized,
+                                                              c + 1)) {
+      cut = c;
+    }
+    if (cut > 0 || start == 0) return cut;
+  }
+}
+
+size_t DocumentEncoder::CutAfter(size_t pos) const {
+  const absl::string_view normalized(normalized_);
+  if (pos >= normalized.size()) return normalized.size();
+  if (safe_cut_finder_ == nullptr) {
+    const size_t ws = normalized.find(kSpaceSymbol, pos);
+    if (ws == absl::string_view::npos) return normalized.size();
+    return processor_.model_proto_->trainer_spec().treat_whitespace_as_suffix()
+               ? ws + sizeof(kSpaceSymbol) - 1
+               : ws;
+  }
+  // Both characters around the cut are at or after `pos`.
+  return safe_cut_finder_->NextCut(
+      normalized, pos + string_util::OneCharLen(normalized.data() + pos));
+}
+
+size_t DocumentEncoder::IdsBefore(size_t pos, bool *aligned) const {
+  const size_t size =
+      std::upper_bound(ends_.begin(), ends_.end(), pos) - ends_.begin();
+  *aligned = size == 0 ? pos == 0 : ends_[size - 1] == pos;
+  return size;
+}
+
+bool DocumentEncoder::IsMergeableUnknown(size_t index) const {
+  const ModelInterface *model = processor_.model_.get();
+  return !model->ByteFallbackEnabled() && model->IsUnknown(ids_[index]);
+}
+
+SurfaceIndex::SurfaceIndex() {}
+
+SurfaceIndex::~SurfaceIndex() {}
+
+util::Status SurfaceIndex::Build(const SentencePieceProcessor &processor) {
+  RETURN_IF_ERROR(processor.status());
+  const DecodeTable *table = processor.decode_table_.get();
+  CHECK_OR_RETURN(table) << "SurfaceIndex requires a loaded model.";
+  surfaces_.clear();
+  entries_.clear();
+  piece_size_ = table->size();
+  for (int id = 0; id < table->size(); ++id) {
+    if (processor.IsUnknown(id) || processor.IsControl(id)) continue;
+    const auto &entry = table->entry(id);
+    Entry sorted;
+    sorted.offset = surfaces_.size();
+    sorted.id = id;
+    if (entry.byte >= 0) {
+      surfaces_.push_back(static_cast<char>(entry.byte));
+    } else {
+      const absl::string_view surface = table->Surface(entry, false);
+      surfaces_.append(surface.data(), surface.size());
+    }
+    sorted.length = surfaces_.size() - sorted.offset;
+    if (sorted.length > 0) entries_.push_back(sorted);
+  }
+  std::sort(entries_.begin(), entries_.end(),
+            [this](const Entry &a, const Entry &b) {
+              const int order = Surface(a).compare(Surface(b));
+              return order != 0 ? order < 0 : a.id < b.id;
+            });
+  return util::OkStatus();
+}
+
+std::pair<size_t, size_t> SurfaceIndex::Walk(
+    absl::string_view text,
+    const std::function<void(size_t, size_t)> &prefix) const {
+  size_t begin = 0, end = entries_.size();
+  for (size_t depth = 0; begin < end; ++depth) {
+    // [begin, end) start with text[0, depth), and the ones equal to it come
+    // first.
+    size_t equal = begin;
+    while (equal < end && entries_[equal].length == depth) ++equal;
+    if (equal > begin) prefix(begin, equal);
+    begin = equal;
+    if (depth == text.size()) break;
+    const unsigned char c = text[depth];
+    const auto char_at = [this, depth](const Entry &entry) {
+      return static_cast<unsigned char>(surfaces_[entry.offset + depth]);
+    };
+    const auto first = entries_.begin() + begin, last = entries_.begin() + end;
+    const auto lower = std::partition_point(
+        first, last, [&](const Entry &e) { return char_at(e) < c; });
+    const auto upper = std::partition_point(
+        lower, last, [&](const Entry &e) { return char_at(e) == c; });
+    begin = lower - entries_.begin();
+    end = upper - entries_.begin();
+  }
+  return std::make_pair(begin, end);
+}
+
+void SurfaceIndex::FindPrefixesOf(absl::string_view text,
+                                  std::vector<int> *ids) const {
+  ids->clear();
+  Walk(text, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) ids->push_back(entries_[i].id);
+  });
+}
+
+void SurfaceIndex::FindExtensionsOf(absl::string_view text,
+                                    std::vector<int> *ids) const {
+  ids->clear();
+  size_t equal_begin = 0, equal_end = 0;
+  const auto range = Walk(text, [&](size_t begin, size_t end) {
+    equal_begin = begin;
+    equal_end = end;
+  });
+  // The surfaces equal to `text` are the last prefixes found.
+  if (equal_end > equal_begin &&
+      entries_[equal_begin].length == text.size()) {
+    for (size_t i = equal_begin; i < equal_end; ++i) {
+      ids->push_back(entries_[i].id);
+    }
+  }
+  for (size_t i = range.first; i < range.second; ++i) {
+    ids->push_back(entries_[i].id);
+  }
+}
+
+void SurfaceIndex::FindCompatible(absl::string_view text,
+                                  std::vector<int> *ids) const {
+  ids->clear();
+  const auto range = Walk(text, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) ids->push_back(entries_[i].id);
+  });
+  for (size_t i = range.first; i < range.second; ++i) {
+    ids->push_back(entries_[i].id);
+  }
+}
+
+void SurfaceIndex::GetCompatibleMask(absl::string_view text,
+                                     std::vector<uint64_t> *mask) const {
+  mask->assign((piece_size_ + 63) / 64, 0);
+  const auto set = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const int id = entries_[i].id;
+      (*mask)[id / 64] |= uint64_t{1} << (id % 64);
+    }
+  };
+  const auto range = Walk(text, set);
+  set(range.first, range.second);
+}
+
+struct AsyncEncoder::State {
+  struct Request {
+    std::string input;
+    SentencePieceProcessor::EncodeCallback callback;
+    std::chrono::steady_clock::time_point arrival;
+  };
+
+  State(const SentencePieceProcessor &processor, int64_t max_delay_us,
+        size_t max_batch_size, bool adaptive_delay)
+      : processor(processor),
+        pool(processor.GetThreadPool()),
+        max_delay(std::max<int64_t>(max_delay_us, 0)),
+        max_batch_size(std::max<size_t>(max_batch_size, 1)),
+        adaptive_delay(adaptive_delay) {
+    stats.batch_sizes.resize(this->max_batch_size + 1, 0);
+  }
+
+  // Returns the time until which the pending requests wait for others.
+  std::chrono::steady_clock::time_point Deadline() const {
+    const auto deadline = requests.front().arrival + max_delay;
+    if (!adaptive_delay) return deadline;
+    // Waits for the next request only as long as the recent time between
+    // requests. Without an estimate, or when the next request is not
+    // expected in time, the batch is dispatched right away.
+    if (arrival_gap_us <= 0.0 || arrival_gap_us > max_delay.count()) {
+      return requests.front().arrival;
+    }
+    return std::min(deadline,
+                    last_arrival + std::chrono::microseconds(
+                                       static_cast<int64_t>(arrival_gap_us)));
+  }
+
+  const SentencePieceProcessor &processor;
+  const std::shared_ptr<ThreadPool> pool;
+  const std::chrono::microseconds max_delay;
+  const size_t max_batch_size;
+  const bool adaptive_delay;
+
+  // Guards the members below. The dispatcher waits on `queued` for
+  // requests, and Flush() and the destructor wait on `done` for the
+  // outstanding requests to complete.
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::condition_variable done;
+  std::deque<Request> requests;
+  size_t outstanding = 0;  // Queued or running requests.
+  int flushing = 0;        // Number of Flush() calls waiting.
+  bool stopped = false;
+
+  // Moving average of the time between requests in microseconds, or 0
+  // before the second request.
+  double arrival_gap_us = 0.0;
+  std::chrono::steady_clock::time_point last_arrival;
+  AsyncEncoder::Stats stats;
+
+  std::thread dispatcher;
+};
+
+double AsyncEncoder::Stats::fill_rate() const {
+  if (num_batches == 0 || batch_sizes.size() < 2) return 0.0;
+  return static_cast<double>(num_requests) /
+         (num_batches * (batch_sizes.size() - 1));
+}
+
+AsyncEncoder::AsyncEncoder(const SentencePieceProcessor &processor,
+                           int64_t max_delay_us, size_t max_batch_size,
+                           bool adaptive_delay)
+    : state_(std::make_unique<State>(processor, max_delay_us, max_batch_size,
+                                     adaptive_delay)) {
+  state_->dispatcher = std::thread([this]() { DispatchLoop(); });
+}
+
+AsyncEncoder::~AsyncEncoder() {
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->stopped = true;
+  }
+  state_->queued.notify_one();
+  state_->dispatcher.join();
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  state_->done.wait(lock, [this]() { return state_->outstanding == 0; });
+}
+
+void AsyncEncoder::Encode(absl::string_view input,
+                          SentencePieceProcessor::EncodeCallback callback) {
+  const auto now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    if (state_->stats.num_requests + state_->outstanding > 0) {
+      constexpr double kDecay = 0.125;
+      const double gap =
+          std::chrono::duration<double, std::micro>(now - state_->last_arrival)
+              .count();
+      state_->arrival_gap_us =
+          state_->arrival_gap_us <= 0.0
+              ? gap
+              : (1.0 - kDecay) * state_->arrival_gap_us + kDecay * gap;
+    }
+    state_->last_arrival = now;
+    state_->requests.push_back({std::string(input), std::move(callback), now});
+    ++state_->outstanding;
+  }
+  state_->queued.notify_one();
+}
+
+std::future<std::pair<util::Status, std::vector<int>>> AsyncEncoder::Encode(
+    absl::string_view input) {
+  auto promise = std::make_shared<
+      std::promise<std::pair<util::Status, std::vector<int>>>>();
+  auto future = promise->get_future();
+  Encode(input, [promise](util::Status status, std::vector<int> ids) {
+    promise->set_value(std::make_pair(std::move(status), std::move(ids)));
+  });
+  return future;
+}
+
+util::Status AsyncEncoder::Encode(absl::string_view input,
+                                  std::vector<int> *ids) {
+  CHECK_OR_RETURN(ids) << "output container is null";
+  auto result = Encode(input).get();
+  *ids = std::move(result.second);
+  return result.first;
+}
+
+AsyncEncoder::Stats AsyncEncoder::GetStats() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->stats;
+}
+
+void AsyncEncoder::Flush() {
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  ++state_->flushing;
+  state_->queued.notify_one();
+  state_->done.wait(lock, [this]() { return state_->outstanding == 0; });
+  --state_->flushing;
+}
+
+void AsyncEncoder::DispatchLoop() {
+  State *state = state_.get();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  while (true) {
+    state->queued.wait(
+        lock, [state]() { return state->stopped || !state->requests.empty(); });
+    if (state->requests.empty()) break;
+
+    // Gives the later requests until the deadline to join the batch. The
+    // deadline is updated by every new request.
+    while (!state->stopped && state->flushing == 0 &&
+           state->requests.size() < state->max_batch_size) {
+      const auto deadline = state->Deadline();
+      if (std::chrono::steady_clock::now() >= deadline) break;
+      state->queued.wait_until(lock, deadline);
+    }
+
+    const size_t size = std::min(state->requests.size(), state->max_batch_size);
+    auto batch = std::make_shared<std::vector<State::Request>>(
+        std::make_move_iterator(state->requests.begin()),
+        std::make_move_iterator(state->requests.begin() + size));
+    state->requests.erase(state->requests.begin(),
+                          state->requests.begin() + size);
+    state->stats.num_requests += size;
+    ++state->stats.num_batches;
+    ++state->stats.batch_sizes[size];
+    if (size == state->max_batch_size) ++state->stats.num_full_batches;
+    lock.unlock();
+
+    state->pool->Schedule([state, batch]() {
+      EncodeContext context;
+      for (auto &request : *batch) {
+        std::vector<int> ids;
+        auto status = state->processor.Encode(request.input, &ids, &context);
+        request.callback(std::move(status), std::move(ids));
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->outstanding -= batch->size();
+      if (state->outstanding == 0) state->done.notify_all();
+    });
+
+    lock.lock();
+  }
+}
+
+ProcessorHandle::Snapshot::Snapshot(Snapshot &&other) noexcept
+    : slot_(other.slot_),
+      processor_(other.processor_),
+      generation_(other.generation_) {
+  other.slot_ = nullptr;
+  other.processor_ = nullptr;
+}
+
+ProcessorHandle::Snapshot &ProcessorHandle::Snapshot::operator=(
+    Snapshot &&other) noexcept {
+  if (this != &other) {
+    if (slot_) slot_->readers.fetch_sub(1);
+    slot_ = other.slot_;
+    processor_ = other.processor_;
+    generation_ = other.generation_;
+    other.slot_ = nullptr;
+    other.processor_ = nullptr;
+  }
+  return *this;
+}
+
+ProcessorHandle::Snapshot::~Snapshot() {
+  if (slot_) slot_->readers.fetch_sub(1);
+}
+
+ProcessorHandle::ProcessorHandle()
+    : ProcessorHandle(std::make_unique<SentencePieceProcessor>()) {}
+
+ProcessorHandle::ProcessorHandle(
+    std::unique_ptr<SentencePieceProcessor> processor) {
+  if (!processor) processor = std::make_unique<SentencePieceProcessor>();
+  slots_[0].processor = std::move(processor);
+}
+
+ProcessorHandle::~ProcessorHandle() {
+  for (const auto &slot : slots_) WaitForReaders(slot);
+}
+
+ProcessorHandle::Snapshot ProcessorHandle::Acquire() const {
+  // The reader count is incremented before current_ is checked again, so
+  // that a publisher either sees the reader or the reader sees the switch
+  // and retries. Both use sequentially consistent operations.
+  while (true) {
+    const int index = current_.load();
+    Slot *slot = &slots_[index];
+    slot->readers.fetch_add(1);
+    if (current_.load() == index) {
+      return Snapshot(slot, slot->processor.get(), slot->generation);
+    }
+    slot->readers.fetch_sub(1);
+  }
+}
+
+void ProcessorHandle::Publish(
+    std::unique_ptr<SentencePieceProcessor> processor) {
+  if (!processor) processor = std::make_unique<SentencePieceProcessor>();
+  std::lock_guard<std::mutex> lock(publish_mutex_);
+  const int index = current_.load();
+  Slot &current = slots_[index];
+  Slot &next = slots_[1 - index];
+
+  // Readers may briefly count themselves in the inactive slot before they
+  // retry.
+  WaitForReaders(next);
+  next.processor = std::move(processor);
+  next.generation = current.generation + 1;
+  current_.store(1 - index);
+
+  WaitForReaders(current);
+  current.processor.reset();
+}
+
+util::Status ProcessorHandle::Load(absl::string_view filename) {
+  auto processor = std::make_unique<SentencePieceProcessor>();
+  RETURN_IF_ERROR(processor->Load(filename));
+  Publish(std::move(processor));
+  return util::OkStatus();
+}
+
+util::Status ProcessorHandle::LoadFromSerializedProto(
+    absl::string_view serialized) {
+  auto processor = std::make_unique<SentencePieceProcessor>();
+  RETURN_IF_ERROR(processor->LoadFromSerializedProto(serialized));
+  Publish(std::move(processor));
+  return util::OkStatus();
+}
+
+uint64_t ProcessorHandle::generation() const {
+  return Acquire().generation();
+}
+
+void ProcessorHandle::WaitForReaders(const Slot &slot) {
+  while (slot.readers.load() != 0) std::this_thread::yield();
+}
+
 #define CHECK_STATUS_OR_RETURN_DEFAULT(value)                                \
   if (!status().ok()) {                                                      \
     LOG(ERROR) << status().message() << "\nReturns default value " << value; \
@@ -950,6 +4609,73 @@ std::string SentencePieceProcessor::Normalize(absl::string_view input) const {
   return normalized;
 }
 
+util::Status SentencePieceProcessor::NormalizeBatch(
+    const std::vector<absl::string_view> &inputs, bool with_alignments,
+    NormalizedBatch *batch) const {
+  CHECK_OR_RETURN(normalizer_);
+  CHECK_OR_RETURN(batch) << "output container is null";
+
+  // As in DecodeBatch(), each task normalizes a contiguous range of the
+  // inputs into its own chunk, and the chunks are concatenated at the end.
+  struct Chunk {
+    std::string text;
+    std::vector<NormalizedBatch::Run> runs;
+  };
+  const size_t size = inputs.size();
+  constexpr size_t kChunksPerThread = 4;
+  const size_t num_chunks =
+      std::min(size, kChunksPerThread * GetThreadPool()->size());
+  std::vector<Chunk> chunks(num_chunks);
+  // Ends of the text and the runs of each input in its chunk.
+  std::vector<size_t> text_ends(size), run_ends(size);
+  RETURN_IF_ERROR(RunBatch(num_chunks, [&](size_t c) {
+    SPM_TRACE_SPAN("normalize_chunk");
+    Chunk *chunk = &chunks[c];
+    std::string normalized;
+    normalizer::Alignment alignment;
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      RETURN_IF_ERROR(normalizer_->Normalize(
+          inputs[i], &normalized, with_alignments ? &alignment : nullptr));
+      chunk->text.append(normalized);
+      text_ends[i] = chunk->text.size();
+      if (with_alignments) {
+        for (const auto &run : alignment.runs()) {
+          chunk->runs.push_back({run.norm, run.orig, run.identity});
+        }
+      }
+      run_ends[i] = chunk->runs.size();
+    }
+    return util::OkStatus();
+  }));
+
+  batch->text.clear();
+  batch->runs.clear();
+  size_t text_size = 0, runs_size = 0;
+  for (const auto &chunk : chunks) {
+    text_size += chunk.text.size();
+    runs_size += chunk.runs.size();
+  }
+  batch->text.reserve(text_size);
+  batch->runs.reserve(runs_size);
+  batch->text_offsets.assign(size + 1, 0);
+  batch->run_offsets.assign(size + 1, 0);
+  for (size_t c = 0; c < num_chunks; ++c) {
+    const size_t text_base = batch->text.size();
+    const size_t run_base = batch->runs.size();
+    batch->text.append(chunks[c].text);
+    batch->runs.insert(batch->runs.end(), chunks[c].runs.begin(),
+                       chunks[c].runs.end());
+    for (size_t i = size * c / num_chunks; i < size * (c + 1) / num_chunks;
+         ++i) {
+      batch->text_offsets[i + 1] = text_base + text_ends[i];
+      batch->run_offsets[i + 1] = run_base + run_ends[i];
+    }
+  }
+
+  return util::OkStatus();
+}
+
 int SentencePieceProcessor::GetPieceSize() const {
   CHECK_STATUS_OR_RETURN_DEFAULT(0);
   return model_->GetPieceSize();
@@ -1015,51 +4741,50 @@ int SentencePieceProcessor::pad_id() const {
   return -1;
 }
 
-// static
-util::Status SentencePieceProcessor::ApplyExtraOptions(
+util::Status SentencePieceProcessor::GetOutputLayout(
     const std::vector<ExtraOption> &extra_options,
-    SentencePieceText *spt) const {
-  for (const auto &extra_option : extra_options) {
+    const EncodeOptions &options, OutputLayout *layout) const {
+  // Reversing the output reverses and swaps the ids around the pieces too.
+  const auto apply = [this, layout](ExtraOption extra_option) {
     switch (extra_option) {
       case REVERSE:
-        std::reverse(spt->mutable_pieces()->begin(),
-                     spt->mutable_pieces()->end());
+        std::swap(layout->prefix, layout->suffix);
+        std::reverse(layout->prefix.begin(), layout->prefix.end());
+        std::reverse(layout->suffix.begin(), layout->suffix.end());
+        std::swap(layout->prefix_eos, layout->suffix_eos);
+        std::reverse(layout->prefix_eos.begin(), layout->prefix_eos.end());
+        std::reverse(layout->suffix_eos.begin(), layout->suffix_eos.end());
+        layout->reverse = !layout->reverse;
+        break;
+      case EOS:
+        layout->suffix.push_back(
+            PieceToId(absl::string_view(model_->eos_piece().data())));
+        layout->suffix_eos.push_back(true);
+        break;
+      case BOS:
+        layout->prefix.insert(
+            layout->prefix.begin(),
+            PieceToId(absl::string_view(model_->bos_piece().data())));
+        layout->prefix_eos.insert(layout->prefix_eos.begin(), false);
+        break;
+      case UNK_PIECE:
+        layout->unk_piece = true;
         break;
-      case EOS: {
-        auto *piece = spt->add_pieces();
-        piece->set_id(PieceToId(absl::string_view(model_->eos_piece().data())));
-        piece->set_piece(model_->eos_piece().data(),
-                         model_->eos_piece().size());
-        piece->set_begin(spt->text().size());
-        piece->set_end(spt->text().size());
-      } break;
-      case BOS: {
-        auto *array = spt->mutable_pieces();
-        array->Add();
-        for (int i = array->size() - 1; i > 0; --i) {
-          array->SwapElements(i - 1, i);
-        }
-        auto *piece = array->Mutable(0);
-        piece->set_id(PieceToId(absl::string_view(model_->bos_piece().data())));
-        piece->set_piece(model_->bos_piece().data(),
-                         model_->bos_piece().size());
-        piece->set_begin(0);
-        piece->set_end(0);
-      } break;
-      case UNK_PIECE: {
-        for (int i = 0; i < spt->pieces_size(); ++i) {
-          auto *piece = spt->mutable_pieces(i);
-          if (IsUnknown(piece->id())) {
-            piece->set_piece(model_->unk_piece().data(),
-                             model_->unk_piece().size());
-          }
-        }
-      } break;
       default:
         return util::InternalError("unknown extra_option type.");
     }
-  }
+    return util::OkStatus();
+  };
 
+  if (!options.ignore_extra_options) {
+    for (const auto &extra_option : extra_options) {
+      RETURN_IF_ERROR(apply(extra_option));
+    }
+  }
+  if (options.reverse) RETURN_IF_ERROR(apply(REVERSE));
+  if (options.add_bos) RETURN_IF_ERROR(apply(BOS));
+  if (options.add_eos) RETURN_IF_ERROR(apply(EOS));
+  if (options.emit_unk_piece) RETURN_IF_ERROR(apply(UNK_PIECE));
   return util::OkStatus();
 }
 
@@ -1102,11 +4827,19 @@ util::Status SentencePieceProcessor::ParseExtraOptions(
 
 void SentencePieceProcessor::SetModel(std::unique_ptr<ModelInterface> &&model) {
   model_ = std::move(model);
+  decode_table_.reset();
+  replicas_.clear();
+  model_file_.clear();
+  registered_model_.reset();
 }
 
 void SentencePieceProcessor::SetNormalizer(
     std::unique_ptr<normalizer::Normalizer> &&normalizer) {
   normalizer_ = std::move(normalizer);
+  normalization_key_.clear();
+  replicas_.clear();
+  model_file_.clear();
+  registered_model_.reset();
 }
 
 const ModelProto &SentencePieceProcessor::model_proto() const {
@@ -1127,6 +4860,28 @@ NormalizerSpec *SentencePieceProcessor::mutable_normalizer_spec() const {
 // std::random_device.
 void SetRandomGeneratorSeed(unsigned int seed);
 
+util::Status LoadProcessors(
+    const std::vector<std::string> &filenames,
+    std::vector<std::unique_ptr<SentencePieceProcessor>> *processors,
+    int num_threads) {
+  CHECK_OR_RETURN(processors) << "output processors are null.";
+  std::vector<std::unique_ptr<SentencePieceProcessor>> loaded(
+      filenames.size());
+  std::vector<util::Status> statuses(filenames.size());
+  RunOnSharedThreadPool(filenames.size(), num_threads,
+                        [&](size_t begin, size_t end) {
+                          for (size_t i = begin; i < end; ++i) {
+                            loaded[i] =
+                                std::make_unique<SentencePieceProcessor>();
+                            statuses[i] = loaded[i]->Load(filenames[i]);
+                          }
+                        });
+  processors->clear();
+  for (const auto &status : statuses) RETURN_IF_ERROR(status);
+  *processors = std::move(loaded);
+  return util::OkStatus();
+}
+
 namespace io {
 util::Status LoadModelProto(absl::string_view filename,
                             ModelProto *model_proto) {
@@ -1134,11 +4889,14 @@ util::Status LoadModelProto(absl::string_view filename,
     return util::NotFoundError("model file path should not be empty.");
   }
 
-  auto input = filesystem::NewReadableFile(filename, true);
+  // Parses directly from the mapped file to avoid an intermediate copy.
+  auto input = filesystem::NewMappedFile(filename);
   RETURN_IF_ERROR(input->status());
-  std::string serialized;
-  if (!input->ReadAll(&serialized)) {
-    return util::InternalError(absl::StrCat("could not read ", filename));
+  absl::string_view serialized = input->data();
+  if (IsFastModel(serialized)) {
+    absl::string_view trie_blob, frequent_words;
+    RETURN_IF_ERROR(DecodeFastModel(input->data(), &serialized, &trie_blob,
+                                    &frequent_words));
   }
   if (!model_proto->ParseFromArray(serialized.data(), serialized.size())) {
     return util::InternalError(
@@ -1159,5 +4917,34 @@ util::Status SaveModelProto(absl::string_view filename,
 
   return util::OkStatus();
 }
+
+util::Status SaveFastModel(absl::string_view filename,
+                           const ModelProto &model_proto,
+                           absl::string_view frequent_words) {
+  if (filename.empty()) {
+    return util::NotFoundError("model file path should not be empty.");
+  }
+
+  std::string trie_blob;
+  if (model_proto.trainer_spec().model_type() == TrainerSpec::UNIGRAM) {
+    const unigram::Model model(model_proto);
+    RETURN_IF_ERROR(model.status());
+    trie_blob = model.SerializeTrie();
+  } else if (model_proto.trainer_spec().model_type() == TrainerSpec::BPE) {
+    const bpe::Model model(model_proto);
+    RETURN_IF_ERROR(model.status());
+    trie_blob = model.SerializeMerges();
+  }
+
+  std::string blob;
+  RETURN_IF_ERROR(EncodeFastModel(model_proto.SerializeAsString(), trie_blob,
+                                  frequent_words, &blob));
+
+  auto output = filesystem::NewWritableFile(filename, true);
+  RETURN_IF_ERROR(output->status());
+  CHECK_OR_RETURN(output->Write(blob));
+
+  return util::OkStatus();
+}
 }  // namespace io
 }  // namespace sentencepiece
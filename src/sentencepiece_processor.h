@@ -15,8 +15,13 @@
 #ifndef SENTENCEPIECE_PROCESSOR_H_
 #define SENTENCEPIECE_PROCESSOR_H_
 
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <utility>
@@ -135,11 +140,25 @@ class ModelInterface;
 class SentencePieceText;
 class ModelProto;
 class NormalizerSpec;
+class ThreadPool;
+class SafeCutFinder;
+class EncodeScratch;
+class MetricsRecorder;
+class DecodeTable;
+class VocabularyRestriction;
+template <typename ModelT, typename NormalizerT, typename Options>
+class EncoderPipeline;
 
 namespace normalizer {
+class Alignment;
 class Normalizer;
+class StreamNormalizer;
 }  // namespace normalizer
 
+namespace filesystem {
+class MappedFile;
+}  // namespace filesystem
+
 #ifndef SWIGGO
 namespace util {
 // Redefine std::string for serialized_proto interface as Python's string is
@@ -154,6 +173,73 @@ class ModelInterface;
 class SentencePieceText;
 class SentencePieceText_SentencePiece;
 
+#ifndef SWIG
+// Read-only view of the elements of a repeated field of an immutable proto
+// wrapper `Owner`. The elements are wrapped on access with `get`, e.g.
+// ImmutableSentencePieceText::pieces(int), instead of being copied into a
+// vector up front. The view holds a copy of the owner, which shares the
+// proto, so it stays valid after the owner is destroyed.
+//
+//   for (const auto &piece : spt.pieces()) ...
+template <typename T, typename Owner>
+class ImmutableRepeatedView {
+ public:
+  using value_type = T;
+  using Getter = T (Owner::*)(int) const;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = T;
+
+    const_iterator(const ImmutableRepeatedView *view, size_t index)
+        : view_(view), index_(index) {}
+
+    T operator*() const { return (*view_)[index_]; }
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++index_;
+      return it;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    const ImmutableRepeatedView *view_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  ImmutableRepeatedView(const Owner &owner, Getter get, size_t size)
+      : owner_(owner), get_(get), size_(size) {}
+
+  T operator[](size_t i) const { return (owner_.*get_)(static_cast<int>(i)); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size_); }
+
+  // Copies the elements, as the vectors returned by the former API.
+  operator std::vector<T>() const { return std::vector<T>(begin(), end()); }
+
+ private:
+  Owner owner_;
+  Getter get_ = nullptr;
+  size_t size_ = 0;
+};
+#endif  // SWIG
+
 // Wrapper class of SentencePieceText
 // This wrapper only allows an immutable access to the proto and
 // hides the actual implementation of protobuf.
@@ -182,7 +268,12 @@ class ImmutableSentencePieceText {
   ImmutableSentencePieceText();
   virtual ~ImmutableSentencePieceText();
 
-  std::vector<ImmutableSentencePieceText_ImmutableSentencePiece> pieces() const;
+#ifndef SWIG
+  // Returns a view of the pieces, which wraps each piece on access.
+  ImmutableRepeatedView<ImmutableSentencePieceText_ImmutableSentencePiece,
+                        ImmutableSentencePieceText>
+  pieces() const;
+#endif  // SWIG
 
   size_t pieces_size() const;
   ImmutableSentencePieceText_ImmutableSentencePiece pieces(int index) const;
@@ -194,7 +285,8 @@ class ImmutableSentencePieceText {
 
   // Returns the actual mutable proto.
   // Do not use this outside of SentencePieceProcessor, as
-  // it returns the raw pointer managed by the shared_ptr.
+  // it returns the raw pointer managed by the shared_ptr. The proto is
+  // allocated on a protobuf Arena shared by the copies of this object.
   SentencePieceText *mutable_proto();
 
   // Converts the utf8 byte spans into Unicode char span.
@@ -217,7 +309,12 @@ class ImmutableNBestSentencePieceText {
   ImmutableNBestSentencePieceText();
   virtual ~ImmutableNBestSentencePieceText();
 
-  std::vector<ImmutableSentencePieceText> nbests() const;
+#ifndef SWIG
+  // Returns a view of the results, which wraps each result on access.
+  ImmutableRepeatedView<ImmutableSentencePieceText,
+                        ImmutableNBestSentencePieceText>
+  nbests() const;
+#endif  // SWIG
 
   size_t nbests_size() const;
   ImmutableSentencePieceText nbests(int index) const;
@@ -226,7 +323,8 @@ class ImmutableNBestSentencePieceText {
 
   // Returns the actual mutable proto.
   // Do not use this outside of SentencePieceProcessor, as
-  // it returns the raw pointer managed by the shared_ptr.
+  // it returns the raw pointer managed by the shared_ptr. The proto is
+  // allocated on a protobuf Arena as above.
   NBestSentencePieceText *mutable_proto();
 
   void ConvertToUnicodeSpans();
@@ -235,6 +333,331 @@ class ImmutableNBestSentencePieceText {
   std::shared_ptr<NBestSentencePieceText> rep_;
 };
 
+// Encode result with the information of SentencePieceText in flat arrays.
+// The pieces are views into one shared buffer and the surfaces views into
+// text(), so encoding does not allocate a string per piece.
+// CopyToProto() builds the SentencePieceText when it is needed.
+//
+// FlatSentencePieceText flat;
+// sp.Encode("hello", &flat).IgnoreError();
+// for (size_t i = 0; i < flat.size(); ++i) {
+//   std::cout << flat.id(i) << " " << flat.piece(i) << std::endl;
+// }
+class FlatSentencePieceText {
+ public:
+  FlatSentencePieceText();
+  ~FlatSentencePieceText();
+
+  size_t size() const { return pieces_.size(); }
+  bool empty() const { return pieces_.empty(); }
+  int id(size_t index) const { return pieces_[index].id; }
+  // Byte offsets of the surface in text().
+  uint32_t begin(size_t index) const { return pieces_[index].begin; }
+  uint32_t end(size_t index) const { return pieces_[index].end; }
+  absl::string_view piece(size_t index) const;
+  absl::string_view surface(size_t index) const;
+  absl::string_view text() const { return text_; }
+
+  // Appends the pieces to `spt` and sets its text. The result is the same
+  // as the SentencePieceText of SentencePieceProcessor::Encode().
+  void CopyToProto(SentencePieceText *spt) const;
+
+  // Returns the result as an ImmutableSentencePieceText.
+  ImmutableSentencePieceText ToImmutableProto() const;
+
+  void Clear();
+
+ private:
+  friend class SentencePieceProcessor;
+
+  struct Piece {
+    int id = 0;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    // Range of the piece in piece_text_.
+    uint32_t piece_begin = 0;
+    uint32_t piece_end = 0;
+    // SentencePieceText sets no surface of the control, bos/eos pieces and
+    // the leading byte pieces of a character.
+    bool has_surface = false;
+  };
+
+  // Appends `piece` to piece_text_ and extends the range of `p` over it.
+  void AppendPiece(absl::string_view piece, Piece *p);
+
+  std::string text_;
+  std::string piece_text_;
+  std::vector<Piece> pieces_;
+  // Character offsets [begin, end) of the pieces with
+  // EncodeOptions::unicode_spans, which CopyToProto() writes instead of the
+  // byte offsets, or empty.
+  std::vector<std::pair<uint32_t, uint32_t>> unicode_spans_;
+};
+
+// Work buffers reused across Encode()/Decode() calls. A context keeps the
+// normalized string, the alignment and model-specific buffers, so that
+// steady-state encoding does not allocate. Not thread-safe: keep one context
+// per thread. A context can be shared by different processors.
+//
+// EncodeContext context;
+// std::vector<int> ids;
+// for (const auto &line : lines) {
+//   sp.Encode(line, &ids, &context);
+// }
+class EncodeContext {
+ public:
+  EncodeContext();
+  ~EncodeContext();
+
+  // Returns the number of the input bytes covered by the output of the last
+  // Encode() with this context. It is less than the input size when the
+  // output was truncated by EncodeOptions::max_tokens or max_input_bytes,
+  // and the rest of the input starts there.
+  size_t consumed_input_bytes() const { return consumed_input_bytes_; }
+
+ private:
+  friend class SentencePieceProcessor;
+  template <typename ModelT, typename NormalizerT, typename Options>
+  friend class EncoderPipeline;
+
+  std::string normalized_;
+  std::unique_ptr<normalizer::Alignment> norm_to_orig_;
+  std::vector<std::pair<absl::string_view, int>> result_;
+  std::vector<absl::string_view> pieces_;
+  std::unique_ptr<SentencePieceText> spt_;
+  FlatSentencePieceText flat_;
+  std::unique_ptr<EncodeScratch> scratch_;
+  // Normalizer of the fused encoding, created for `stream_normalizer_`.
+  std::unique_ptr<normalizer::StreamNormalizer> stream_;
+  const normalizer::Normalizer *stream_normalizer_ = nullptr;
+  // Alignment of the truncated encoding.
+  std::vector<size_t> stream_to_orig_;
+  size_t consumed_input_bytes_ = 0;
+};
+
+// Output options of one Encode() call, applied after the extra options of
+// SetEncodeExtraOptions() in the order of "reverse:bos:eos:unk". Unlike the
+// extra options, they do not change the processor, so concurrent calls can
+// use different options.
+struct EncodeOptions {
+  bool add_bos = false;
+  bool add_eos = false;
+  bool reverse = false;
+  // Emits the unk piece instead of the unknown surface. Pieces only.
+  bool emit_unk_piece = false;
+  // Applies only these options and not the extra options of
+  // SetEncodeExtraOptions(), so that the output of a processor shared by
+  // callers of different options does not depend on them.
+  bool ignore_extra_options = false;
+  // Samples the segmentation as SampleEncode(input, nbest_size, alpha)
+  // instead of taking the best one. Not supported with `vocabulary` and
+  // `max_tokens`.
+  bool enable_sampling = false;
+  int nbest_size = -1;
+  float alpha = 0.1;
+  // Index of a vocabulary restriction returned by
+  // SentencePieceProcessor::AddVocabularyRestriction(), or -1 to encode with
+  // the whole vocabulary.
+  int vocabulary = -1;
+  // Keeps only the first `max_tokens` ids or pieces of the input, not
+  // counting <s> and </s>, when it is positive. Encode() into ids then
+  // normalizes and segments the input from the left, one window at a time,
+  // and stops once the kept pieces are final, so a long input costs in
+  // proportion to the kept prefix. This needs a model without pieces
+  // spanning words; the other models encode the whole input first. The
+  // bytes of a byte-fallback character may be cut.
+  int max_tokens = 0;
+  // Encodes only the first `max_input_bytes` bytes of the input, cut back
+  // to a UTF-8 character boundary, when it is positive.
+  size_t max_input_bytes = 0;
+  // Sets the begin and end of the pieces of a SentencePieceText in Unicode
+  // characters instead of bytes, as ConvertToUnicodeSpans() does. The
+  // characters are counted while the pieces are emitted, so the input is
+  // not walked again. SentencePieceText only.
+  bool unicode_spans = false;
+};
+
+// A window of SentencePieceProcessor::EncodeWindows(): its ids and the byte
+// range [begin, end) of the input which they cover.
+struct EncodedWindow {
+  std::vector<int> ids;
+  size_t begin = 0;
+  size_t end = 0;
+};
+
+// Candidates of a batch of inputs of SentencePieceProcessor::NBestEncodeBatch()
+// or SampleEncodeAndScoreBatch() in flat arrays. The candidates of inputs[i]
+// are [candidate_offsets[i], candidate_offsets[i + 1]), and the candidate j
+// has the ids ids[id_offsets[j], id_offsets[j + 1]) and the score scores[j].
+struct NBestBatch {
+  std::vector<int> ids;
+  std::vector<size_t> id_offsets;
+  std::vector<float> scores;
+  std::vector<size_t> candidate_offsets;
+};
+
+// Normalizations of a batch of inputs of
+// SentencePieceProcessor::NormalizeBatch() in one buffer. The normalization
+// of inputs[i] is text[text_offsets[i], text_offsets[i + 1]). With the
+// alignments, the norm_to_orig of Normalize() of inputs[i] is stored as the
+// runs[run_offsets[i], run_offsets[i + 1]), relative to the normalization
+// and to the input: the normalized offsets from runs[j].norm up to the
+// norm of the next run of the input, or up to the length of the
+// normalization + 1, map to runs[j].orig plus the distance from
+// runs[j].norm for an identity run, and to runs[j].orig otherwise. An
+// empty input has no runs.
+struct NormalizedBatch {
+  struct Run {
+    size_t norm = 0;
+    size_t orig = 0;
+    bool identity = false;
+  };
+
+  std::string text;
+  std::vector<size_t> text_offsets;
+  std::vector<Run> runs;
+  std::vector<size_t> run_offsets;
+};
+
+// Counters and latency histograms of the Encode() and Decode() calls of a
+// processor, recorded when the library is built with SPM_ENABLE_METRICS.
+// The encode calls are the ones returning ids, pieces or SentencePieceText;
+// the nbest and sampling calls are not recorded.
+struct ProcessorMetrics {
+  // Latencies in nanoseconds. buckets[0] counts the calls taking less than
+  // 2 ns, buckets[i] those taking [2^i, 2^(i+1)) ns, and the last bucket
+  // the longer ones.
+  struct Histogram {
+    static constexpr int kNumBuckets = 40;
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t buckets[kNumBuckets] = {};
+
+    // Returns the upper bound in nanoseconds of the bucket holding the
+    // `q`-quantile, 0 <= q <= 1, or 0 when the histogram is empty.
+    uint64_t Quantile(double q) const;
+  };
+
+  uint64_t encode_calls = 0;
+  uint64_t input_bytes = 0;
+  // Pieces of the results. A byte-fallback piece is a byte piece which
+  // replaces an unknown piece, so unk_pieces does not include them.
+  uint64_t output_pieces = 0;
+  uint64_t unk_pieces = 0;
+  uint64_t byte_fallback_pieces = 0;
+
+  // Phases of the encode calls: normalization, segmentation by the model,
+  // and population of the ids or the SentencePieceText. `encode` is the
+  // whole call.
+  Histogram normalize;
+  Histogram model;
+  Histogram populate;
+  Histogram encode;
+
+  uint64_t decode_calls = 0;
+  uint64_t decode_pieces = 0;
+  Histogram decode;
+};
+
+// Estimated bytes of memory held by a loaded processor, by component, from
+// SentencePieceProcessor::GetMemoryUsage(). The sizes are the heap bytes of
+// the containers, without the allocator overhead. A component shared with
+// other processors, e.g. the model of LoadShared(), is counted in full by
+// each of them.
+struct MemoryUsage {
+  // The ModelProto: the pieces with their strings and the specs, except for
+  // the precompiled charsmaps counted in `normalizer`.
+  size_t model_proto = 0;
+  // The piece to id index, the per-piece tables and the user defined symbol
+  // matcher of the model.
+  size_t piece_maps = 0;
+  // The lookup tables of the segmentation, e.g. the trie of the unigram
+  // model or the merge table of BPE. A trie read in place from a fast-model
+  // file is counted in `mapped_file` instead.
+  size_t model_tables = 0;
+  // The precompiled charsmaps of the normalizer and the denormalizer, and
+  // their lookup tables.
+  size_t normalizer = 0;
+  // The word cache, the frequent word table and the shared memory of the
+  // shared word cache.
+  size_t caches = 0;
+  // The decode table, the vocabulary restrictions and the cut finder of
+  // the parallel encoding.
+  size_t processor_tables = 0;
+  // The copies of the model tables and the normalizer on the NUMA nodes.
+  size_t numa_replicas = 0;
+  // The fast-model file mapped by Load(), whose pages are shared with the
+  // other processes mapping it.
+  size_t mapped_file = 0;
+  // Worker threads of the batch pool. Their stacks are not counted above.
+  int pool_threads = 0;
+
+  // Returns the sum of the byte counts.
+  size_t total() const {
+    return model_proto + piece_maps + model_tables + normalizer + caches +
+           processor_tables + numa_replicas + mapped_file;
+  }
+};
+
+// Buffers of an Apache Arrow string array, which are read in place. The
+// i-th string, 0 <= i < length, is data[offsets[offset + i],
+// offsets[offset + i + 1]), and it is null when the bit offset + i of
+// `validity` is 0. `validity` may be nullptr when there are no nulls.
+// `Offset` is int32_t for the utf8 type and int64_t for large_utf8.
+template <typename Offset>
+struct ArrowStringArray {
+  int64_t length = 0;
+  int64_t offset = 0;
+  const uint8_t *validity = nullptr;
+  const Offset *offsets = nullptr;
+  const char *data = nullptr;
+};
+
+// Buffers of an Arrow list<int32> (or large_list<int32>) array of
+// `offsets.size() - 1` lists. The i-th list is values[offsets[i],
+// offsets[i + 1]).
+template <typename Offset>
+struct ArrowListArray {
+  std::vector<Offset> offsets;
+  std::vector<int32_t> values;
+};
+
+// Per-worker statistics of EncodeCorpus(). The i-th worker encoded
+// num_inputs[i] inputs of num_bytes[i] bytes in busy_seconds[i] of the
+// elapsed_seconds of the call.
+struct CorpusEncodeStats {
+  std::vector<size_t> num_inputs;
+  std::vector<size_t> num_bytes;
+  std::vector<double> busy_seconds;
+  double elapsed_seconds = 0.0;
+};
+
+// Runs `func(begin, end)` over [0, size) split into chunks, on at most
+// `num_threads` threads of the process-wide worker pool. The calling thread
+// runs chunks too. The pool is shared with the batch API of the processors
+// whose number of threads is not set, so that the bindings do not start
+// threads per call. When `num_threads` <= 0, GetDefaultNumThreads() is
+// used. Returns after all the chunks have finished.
+void RunOnSharedThreadPool(size_t size, int num_threads,
+                           const std::function<void(size_t, size_t)> &func);
+
+// Configures the worker pools of the library once for the process. The
+// process-wide pool gets `num_threads` threads, or GetDefaultNumThreads()
+// when `num_threads` <= 0. When `cpus` is not empty, the workers of the
+// pools started afterwards, i.e. the process-wide pool, the pools of
+// SetNumThreads() and the ones of the trainers, are pinned to them, one cpu
+// per worker in turn. Returns an error once the process-wide pool has
+// started, as it is never resized.
+util::Status ConfigureThreadPools(int num_threads,
+                                  const std::vector<int> &cpus);
+
+// Returns the number of threads used when it is not given: the one set by
+// ConfigureThreadPools(), or else the number of cpus available to the
+// process, which respects its affinity mask and the cpu quota of its
+// cgroup, e.g. the one of a container, unlike
+// std::thread::hardware_concurrency().
+int GetDefaultNumThreads();
+
 class SentencePieceProcessor {
  public:
   SentencePieceProcessor();
@@ -260,10 +683,27 @@ class SentencePieceProcessor {
   // Useful to load the model from a platform independent blob object.
   virtual util::Status LoadFromSerializedProto(absl::string_view serialized);
 
+  // Uses the model loaded by `other` without copying it. The ModelProto,
+  // the model with its trie, the normalizers and the decode table are
+  // reference counted, so they live as long as any processor using them,
+  // and concurrent calls of the processors sharing them are thread-safe.
+  // The options of `other`, e.g. its extra options or vocabulary
+  // restrictions, are not taken. While the model is shared, the calls
+  // changing it, SetVocabulary(), ResetVocabulary() and the "word_cache"
+  // extra option, return an error; AddVocabularyRestriction() does not
+  // change the model.
+  virtual util::Status LoadShared(const SentencePieceProcessor &other);
+
   // Returns the status. Encode/Decode methods are valid when status is OK.
   virtual util::Status status() const;
 
   // Sets encode extra_option sequence.
+  // "word_cache=<size>" enables a cache of up to <size> encoded words, which
+  // speeds up Encode() on repetitive inputs. The cache is off by default.
+  // "shared_word_cache=<slots>" attaches to a cache of <slots> words in
+  // shared memory, which the processes of the same user encoding with the
+  // same model and <slots> share, so that its entries are warm for all of
+  // them. See SharedWordCache.
   virtual util::Status SetEncodeExtraOptions(absl::string_view extra_option);
 
   // Sets decode extra_option sequence.
@@ -282,6 +722,42 @@ class SentencePieceProcessor {
   // Reverts the vocabulary restriction.
   virtual util::Status ResetVocabulary();
 
+  // Compiles `valid_vocab` into a vocabulary restriction and sets its index
+  // to `*index`. An Encode() call selects it with EncodeOptions::vocabulary
+  // and is then restricted as after SetVocabulary(valid_vocab), on top of
+  // the current restriction of SetVocabulary(). The model is not changed,
+  // so concurrent calls can use different restrictions of one processor.
+  // Must not be called concurrently with Encode(). Load() drops them.
+  virtual util::Status AddVocabularyRestriction(
+      const std::vector<absl::string_view> &valid_vocab, int *index);
+
+  // Returns the hit and miss counts of the word cache enabled by the
+  // "word_cache" extra option. Both are 0 when the cache is disabled.
+  virtual util::Status GetWordCacheStats(int64_t *hits, int64_t *misses) const;
+
+  // Counts the normalized words of `sentences` and segments the `size` most
+  // frequent ones into `table`, which io::SaveFastModel() stores with the
+  // model. Encode() looks the words up in the table of a loaded fast-model
+  // file before encoding them, without the warmup and the locks of the word
+  // cache. As with the cache, the model must have no piece spanning words.
+  // SetVocabulary() and ResetVocabulary() drop the table.
+  util::Status BuildFrequentWordTable(
+      const std::vector<absl::string_view> &sentences, size_t size,
+      std::string *table) const;
+
+  // Copies the metrics of the calls since the construction or the last
+  // ResetMetrics() into `metrics`. Returns an Unimplemented error when the
+  // library is built without SPM_ENABLE_METRICS. Thread-safe.
+  virtual util::Status GetMetrics(ProcessorMetrics *metrics) const;
+
+  // Clears the metrics.
+  virtual util::Status ResetMetrics();
+
+  // Estimates the memory held by the loaded model and the tables, caches
+  // and pools of this processor into `usage`, e.g. to size the containers
+  // serving a model or to measure the memory reduction options.
+  virtual util::Status GetMemoryUsage(MemoryUsage *usage) const;
+
   // Loads the valid vocabulary set from `filename` in TSV format.
   // Format:  <token> <tab> <freq>.
   // Any token with frequency < threshold will be treated as OOV.
@@ -299,6 +775,54 @@ class SentencePieceProcessor {
   virtual util::Status Encode(absl::string_view input,
                               std::vector<int> *ids) const;
 
+  // The same as above, but reuses the buffers in `context`. The capacity of
+  // `ids` is kept, so reusing both makes repeated calls allocation-free.
+  virtual util::Status Encode(absl::string_view input, std::vector<int> *ids,
+                              EncodeContext *context) const;
+
+  // The same as above, but also applies `options`. The output is written
+  // once in its final order, without shifting it for <s>.
+  virtual util::Status Encode(absl::string_view input,
+                              const EncodeOptions &options,
+                              std::vector<int> *ids,
+                              EncodeContext *context) const;
+
+  virtual util::Status Encode(absl::string_view input,
+                              const EncodeOptions &options,
+                              std::vector<std::string> *pieces,
+                              EncodeContext *context) const;
+
+  // max_tokens is not supported for SentencePieceText.
+  virtual util::Status Encode(absl::string_view input,
+                              const EncodeOptions &options,
+                              SentencePieceText *spt,
+                              EncodeContext *context) const;
+
+  // Encodes `input` into windows of `window_size` ids which start every
+  // `stride` ids, 0 < stride <= window_size, e.g. for indexing the passages
+  // of a long document, and calls `callback` with each window in order. The
+  // last window ends with the last id and may be shorter; no window is
+  // emitted for an input without ids. The input is normalized and encoded
+  // one part at a time as with EncodeOptions::max_tokens, so the memory
+  // stays bounded by the window instead of the document, unless the model
+  // has pieces spanning words. The encode extra options are not applied.
+  // Stops at and returns the first error of `callback`.
+  virtual util::Status EncodeWindows(
+      absl::string_view input, int window_size, int stride,
+      const std::function<util::Status(const EncodedWindow &)> &callback,
+      EncodeContext *context) const;
+
+  // Encodes words split upstream, e.g. by a pretokenizer, without joining
+  // them into a sentence. Each word is normalized on its own, so it gets the
+  // dummy prefix (or suffix) of a word, and encoded as a word of a sentence.
+  // The ids of words[i] are ids[offsets[i], offsets[i + 1]), and `offsets`
+  // has words.size() + 1 entries. A word normalized to nothing, e.g. only
+  // spaces, has no ids. The encode extra options are not applied.
+  virtual util::Status EncodeWords(const std::vector<absl::string_view> &words,
+                                   std::vector<int> *ids,
+                                   std::vector<size_t> *offsets,
+                                   EncodeContext *context) const;
+
   // Given a sequence of pieces, decodes it into a detokenized output.
   virtual util::Status Decode(const std::vector<std::string> &pieces,
                               std::string *detokenized) const;
@@ -311,6 +835,23 @@ class SentencePieceProcessor {
   virtual util::Status Decode(const std::vector<int> &ids,
                               std::string *detokenized) const;
 
+  // The same as above, but reuses the buffers in `context`.
+  virtual util::Status Decode(const std::vector<int> &ids,
+                              std::string *detokenized,
+                              EncodeContext *context) const;
+
+  // Encodes into narrow ids, T = uint16_t or uint32_t, e.g. uint16_t for
+  // the vocabularies of up to 65536 pieces, which halves the memory and the
+  // transfers of the ids. Returns an OutOfRange error if the ids of the
+  // vocabulary do not fit in T.
+  template <typename T>
+  util::Status Encode(absl::string_view input, std::vector<T> *ids) const;
+
+  // Decodes narrow ids, T = uint16_t or uint32_t.
+  template <typename T>
+  util::Status Decode(const std::vector<T> &ids,
+                      std::string *detokenized) const;
+
   //////////////////////////////////////////////////////////////
   // NBest API.
   //
@@ -377,6 +918,23 @@ class SentencePieceProcessor {
       bool include_best,
       std::vector<std::pair<std::vector<int>, float>> *ids) const;
 
+  //////////////////////////////////////////////////////////////
+  // SampleEncodeMany API.
+  //
+  // Samples `num_samples` segmentations of `input` in the same distribution
+  // as SampleEncode() with nbest_size < 0, e.g. for consistency
+  // regularization. The unigram model builds the lattice and its forward
+  // scores once and draws all the samples from them. BPE runs BPE-dropout
+  // once per sample.
+  virtual util::Status SampleEncodeMany(
+      absl::string_view input, int num_samples, float alpha,
+      std::vector<std::vector<std::string>> *pieces) const;
+
+  // Same as above, but returns sequences of ids.
+  virtual util::Status SampleEncodeMany(
+      absl::string_view input, int num_samples, float alpha,
+      std::vector<std::vector<int>> *ids) const;
+
   //////////////////////////////////////////////////////////////
   // Entropy API.
   //
@@ -385,6 +943,228 @@ class SentencePieceProcessor {
   virtual util::Status CalculateEntropy(absl::string_view input, float alpha,
                                         float *entropy) const;
 
+  // Calculates the entropy of each of `inputs` as CalculateEntropy() in
+  // parallel with the worker pool. When `expected_counts` is not nullptr,
+  // (*expected_counts)[i] is the expected number of occurrences of each piece
+  // in the segmentations of `inputs[i]`, in the same distribution as the
+  // entropy, as (id, count) pairs sorted by id. The pieces which cannot occur
+  // are omitted. Each worker reuses one lattice for all its inputs.
+  virtual util::Status CalculateEntropyBatch(
+      const std::vector<absl::string_view> &inputs, float alpha,
+      std::vector<float> *entropies,
+      std::vector<std::vector<std::pair<int, float>>> *expected_counts =
+          nullptr) const;
+
+  // Same as above, but (*expected_counts)[i] is dense, with GetPieceSize()
+  // elements.
+  virtual util::Status CalculateEntropyBatch(
+      const std::vector<absl::string_view> &inputs, float alpha,
+      std::vector<float> *entropies,
+      std::vector<std::vector<float>> *expected_counts) const;
+
+  //////////////////////////////////////////////////////////////
+  // Batch API.
+  //
+  // Encodes all `inputs` in parallel with the worker pool owned by this
+  // processor. The pool is created on the first batch call and reused by
+  // the subsequent calls, so no threads are spawned per request.
+  // `outputs[i]` corresponds to `inputs[i]`.
+  virtual util::Status EncodeBatch(
+      const std::vector<absl::string_view> &inputs,
+      std::vector<std::vector<std::string>> *pieces) const;
+
+  // Same as above, but returns sequences of ids.
+  virtual util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                                   std::vector<std::vector<int>> *ids) const;
+
+  // Same as above, but returns ImmutableSentencePieceText.
+  virtual util::Status EncodeBatch(
+      const std::vector<absl::string_view> &inputs,
+      std::vector<ImmutableSentencePieceText> *spts) const;
+
+  // Same as above, but applies `options` to all the inputs, as
+  // Encode(input, options, ...). The processor is not changed, so one
+  // processor and its pool serve concurrent batches of different options.
+  virtual util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                                   const EncodeOptions &options,
+                                   std::vector<std::vector<int>> *ids) const;
+
+  virtual util::Status EncodeBatch(
+      const std::vector<absl::string_view> &inputs,
+      const EncodeOptions &options,
+      std::vector<std::vector<std::string>> *pieces) const;
+
+  // Samples `num_samples` segmentations of each of `inputs` as
+  // SampleEncodeMany(). `ids[i]` are the samples of `inputs[i]`.
+  virtual util::Status SampleEncodeManyBatch(
+      const std::vector<absl::string_view> &inputs, int num_samples,
+      float alpha, std::vector<std::vector<std::vector<int>>> *ids) const;
+
+  // Encodes each of `inputs` into the same candidates as NBestEncode(), in
+  // parallel with the worker pool, e.g. to rerank a large corpus. Each
+  // worker reuses one lattice for all its inputs.
+  virtual util::Status NBestEncodeBatch(
+      const std::vector<absl::string_view> &inputs, int nbest_size,
+      NBestBatch *batch) const;
+
+  // Samples and scores the segmentations of each of `inputs` as
+  // SampleEncodeAndScore(), in parallel as NBestEncodeBatch().
+  virtual util::Status SampleEncodeAndScoreBatch(
+      const std::vector<absl::string_view> &inputs, int num_samples,
+      float alpha, bool wor, bool include_best, NBestBatch *batch) const;
+
+  // Decodes a batch of id sequences stored back to back in `ids`. Sentence i
+  // is ids[offsets[i], offsets[i + 1]), so `offsets` has one more element
+  // than the batch. All the outputs are written to one buffer `text`, where
+  // the output i is text[text_offsets[i], text_offsets[i + 1]). No
+  // SentencePieceText is built unless decode extra options are set.
+  virtual util::Status DecodeBatch(const std::vector<int> &ids,
+                                   const std::vector<size_t> &offsets,
+                                   std::string *text,
+                                   std::vector<size_t> *text_offsets) const;
+
+  // Same as EncodeBatch() and DecodeBatch() above, but over narrow ids,
+  // T = uint16_t or uint32_t, as Encode() into std::vector<T>.
+  template <typename T>
+  util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                           std::vector<std::vector<T>> *ids) const;
+
+  template <typename T>
+  util::Status DecodeBatch(const std::vector<T> &ids,
+                           const std::vector<size_t> &offsets,
+                           std::string *text,
+                           std::vector<size_t> *text_offsets) const;
+
+  // Encodes the strings of an Arrow string array into the ids of a list
+  // array, in parallel with the worker pool as EncodeBatch(). A null string
+  // gives an empty list; the validity bitmap of the input also applies to
+  // the output. Returns an error if the offsets are not increasing, or if
+  // the ids do not fit in the offsets of the output.
+  virtual util::Status EncodeArrow(const ArrowStringArray<int32_t> &input,
+                                   ArrowListArray<int32_t> *output) const;
+
+  // Same as above, but for large_utf8 and large_list<int32>.
+  virtual util::Status EncodeArrow(const ArrowStringArray<int64_t> &input,
+                                   ArrowListArray<int64_t> *output) const;
+
+  // Encodes a large corpus into `ids` in the order of `inputs` on the worker
+  // pool. Unlike EncodeBatch(), the inputs are bucketed by byte length and
+  // handed out longest first, so that a few long documents do not finish
+  // last on one worker, while the short ones are encoded in groups. Fills
+  // `stats` when it is not nullptr.
+  virtual util::Status EncodeCorpus(
+      const std::vector<absl::string_view> &inputs,
+      std::vector<std::vector<int>> *ids,
+      CorpusEncodeStats *stats = nullptr) const;
+
+  // Called with the status and the ids of an asynchronous encoding.
+  using EncodeCallback = std::function<void(util::Status, std::vector<int>)>;
+
+  // Encodes `input` into ids on the batch worker pool without blocking the
+  // caller, and calls `callback` with the result on the worker. `input` is
+  // copied. The processor must outlive the callback and must not be
+  // modified until then. Use AsyncEncoder to gather concurrent requests into
+  // batches.
+  virtual void EncodeAsync(absl::string_view input,
+                           EncodeCallback callback) const;
+
+  // The same as above, but returns a future holding the status and the ids.
+  std::future<std::pair<util::Status, std::vector<int>>> EncodeAsync(
+      absl::string_view input) const;
+
+  // Sets the number of worker threads used in the batch API.
+  // When `num_threads` <= 0, the process-wide pool of GetDefaultNumThreads()
+  // threads, which is shared with RunOnSharedThreadPool(), is used.
+  // When `num_threads` is 1, Load() builds the normalizers on the calling
+  // thread instead of next to the model.
+  virtual util::Status SetNumThreads(int num_threads);
+
+  // Encodes inputs of at least `min_size` normalized bytes by splitting them
+  // into groups of characters, which are encoded in parallel on the batch
+  // worker pool. The groups are cut only where no piece of the model can
+  // span, e.g. at the word boundaries when no piece spans words, so the
+  // result is the same as the serial one. An input without such positions
+  // is encoded serially. 0 disables it, which is the default.
+  virtual util::Status SetParallelEncodeThreshold(size_t min_size);
+
+  // Makes Encode() into ids normalize inputs longer than `window` bytes one
+  // window at a time and encode the complete words of each window right
+  // away, instead of normalizing the whole input first. The normalized text
+  // and the model buffers then stay within a window. As with the word
+  // cache, the words are segmented apart, so an error is returned if the
+  // model has pieces spanning words. Long inputs are not encoded in
+  // parallel in this mode. 0 disables it, which is the default.
+  virtual util::Status SetFusedEncodeWindow(size_t window);
+
+  // Bounds the work of NBestEncode(), SampleEncode(), SampleEncodeAndScore()
+  // and SampleEncodeMany() on long inputs without whitespace, such as
+  // base64 blobs, whose lattices and agendas grow with the input. A
+  // normalized input longer than `max_bytes` is split into segments of at
+  // most `max_bytes` bytes, cut at the last word boundary in the segment,
+  // or else at the last character boundary, and the segments are encoded
+  // separately. The n-th result of the input joins the n-th results of the
+  // segments, and its score is the sum of their scores. With `strict`,
+  // these inputs fail with kResourceExhausted instead. 0 disables it, which
+  // is the default.
+  virtual util::Status SetMaxSegmentLength(size_t max_bytes,
+                                           bool strict = false);
+
+  // Returns the number of inputs split by SetMaxSegmentLength() so far.
+  uint64_t GetNumSegmentedInputs() const;
+
+  // Sets where the lookup tables of the model and the normalizer are placed
+  // in memory. With `huge_pages`, the tables are copied to memory backed by
+  // transparent huge pages, which saves TLB misses on large vocabularies.
+  // With `numa_replicas`, on a machine with several NUMA nodes, the tables
+  // are copied to each node, the batch workers are pinned to the nodes, and
+  // each worker reads the copy of its node. The copies do not use the word
+  // cache. Can be called before or after Load(). Returns an error if the
+  // model is shared by LoadShared(). Both are disabled by default.
+  virtual util::Status SetMemoryPlacement(bool huge_pages,
+                                          bool numa_replicas);
+
+  // Sets whether Load() keeps only the parts of the ModelProto read at
+  // inference. With `slim`, once the tables are built and the self-test
+  // passed, the trainer spec is reduced to the model type, the special
+  // pieces and the flags the encoder reads, and the self-test data and the
+  // normalization rules are dropped, so that model_proto() and
+  // serialized_model_proto() return the reduced model, which can not be
+  // used to resume training. The pieces are kept, since IdToPiece() and
+  // the tables of the model refer to them. Applied by the next Load().
+  // Disabled by default.
+  virtual void SetSlimLoad(bool slim);
+
+  // Sets whether Load(filename) and LoadFromSerializedProto() share the
+  // model with the other processors of the process loading the same bytes.
+  // With `share`, the bytes are fingerprinted before parsing, and if a
+  // processor with the same option loaded them with the same
+  // SetSlimLoad() and SetMemoryPlacement() options, its model is used as by
+  // LoadShared() instead of being built again. The registry keeps a copy of
+  // the bytes of each model to compare them in full. It only keeps
+  // weak references, so a model is released when the last processor using
+  // it is destroyed or loads another model. A model loaded this way is
+  // shared, so the calls changing it return an error as after
+  // LoadShared(). Applied by the next Load(). Disabled by default.
+  virtual void SetShareIdenticalModels(bool share);
+
+  // Returns the number of distinct models alive in the registry of
+  // SetShareIdenticalModels().
+  static size_t GetNumSharedModels();
+
+  // Makes Encode() of a unigram model sum int16 fixed-point piece scores
+  // instead of float ones. The `calibration` texts are normalized and
+  // encoded both ways, and the float score of each quantized path may fall
+  // short of the best one by at most `max_deviation`; otherwise an error is
+  // returned and the float scores stay in use. The largest shortfall is
+  // stored in `deviation` if it is not null. The table read by the encoder
+  // halves, but the float scores are kept for sampling, n-best and the
+  // NUMA replicas, so the model grows by 4 bytes per piece. Must be called
+  // after Load(); a later Load() or SetVocabulary() drops the table. Returns
+  // an error for the other models or if the model is shared.
+  virtual util::Status QuantizeScores(
+      const std::vector<absl::string_view> &calibration, float max_deviation,
+      float *deviation = nullptr);
+
   //////////////////////////////////////////////////////////////
   // Advanced API returning SentencePieceText, which manages
   // utf8-byte alignments between user-input/detokenized text
@@ -398,9 +1178,41 @@ class SentencePieceProcessor {
   // ImmutableSentencePieceText spt;
   // Encode("hello", spt.mutable_proto()).IgnoreError();
   // std::cout << spt.pieces_size() << std::endl;
+  //
+  // The pieces are allocated where `spt` is: a SentencePieceText created
+  // on a protobuf Arena, e.g. with
+  //   google::protobuf::Arena::CreateMessage<SentencePieceText>(&arena),
+  // receives its pieces and strings from the arena, which frees them all at
+  // once. ImmutableSentencePieceText always allocates on its own arena.
   virtual util::Status Encode(absl::string_view input,
                               SentencePieceText *spt) const;
 
+  // The same as above, but reuses the buffers in `context`.
+  virtual util::Status Encode(absl::string_view input, SentencePieceText *spt,
+                              EncodeContext *context) const;
+
+  // Encodes into a FlatSentencePieceText, which holds the same information
+  // as SentencePieceText without a protobuf message and a string per piece.
+  util::Status Encode(absl::string_view input,
+                      FlatSentencePieceText *flat) const;
+  util::Status Encode(absl::string_view input, FlatSentencePieceText *flat,
+                      EncodeContext *context) const;
+
+  // Encodes `input` with each of `processors`, e.g. models of different
+  // vocabulary sizes or types, into (*flats)[i] as Encode(). The processors
+  // whose normalizers are equivalent, i.e. loaded with the same precompiled
+  // charsmap, whitespace flags and user defined symbols, or sharing one
+  // normalizer, normalize `input` only once and segment the shared
+  // normalized text and alignment.
+  static util::Status EncodeWithModels(
+      const std::vector<const SentencePieceProcessor *> &processors,
+      absl::string_view input, std::vector<FlatSentencePieceText> *flats);
+
+  // Same as above, but returns sequences of ids.
+  static util::Status EncodeWithModels(
+      const std::vector<const SentencePieceProcessor *> &processors,
+      absl::string_view input, std::vector<std::vector<int>> *ids);
+
   virtual util::Status NBestEncode(absl::string_view input, int nbest_size,
                                    NBestSentencePieceText *nbest_spt) const;
 
@@ -411,6 +1223,11 @@ class SentencePieceProcessor {
       absl::string_view input, int num_samples, float alpha, bool wor,
       bool include_best, NBestSentencePieceText *samples_spt) const;
 
+  // The samples are the nbests of `samples_spt`, whose scores are 0.
+  virtual util::Status SampleEncodeMany(
+      absl::string_view input, int num_samples, float alpha,
+      NBestSentencePieceText *samples_spt) const;
+
   // DEPRECATED: Remove this API and use std::vector<std::string_view>
   virtual util::Status Decode(const std::vector<std::string> &pieces,
                               SentencePieceText *spt) const;
@@ -501,6 +1318,20 @@ class SentencePieceProcessor {
                                 alpha, wor, include_best);
   }
 
+  virtual std::vector<std::vector<std::string>> SampleEncodeManyAsPieces(
+      absl::string_view input, int num_samples, float alpha) const {
+    using _T = std::vector<std::vector<std::string>>;
+    DEFINE_SPP_DIRECT_FUNC_IMPL(SampleEncodeMany, _T, input, num_samples,
+                                alpha);
+  }
+
+  virtual std::vector<std::vector<int>> SampleEncodeManyAsIds(
+      absl::string_view input, int num_samples, float alpha) const {
+    using _T = std::vector<std::vector<int>>;
+    DEFINE_SPP_DIRECT_FUNC_IMPL(SampleEncodeMany, _T, input, num_samples,
+                                alpha);
+  }
+
   // DEPRECATED: Remove this API and use std::vector<std::string_view>
   virtual std::string DecodePieces(
       const std::vector<std::string> &pieces) const {
@@ -630,6 +1461,13 @@ class SentencePieceProcessor {
 
   virtual std::string Normalize(absl::string_view input) const;
 
+  // Normalizes `inputs` on the worker pool into one buffer, as DecodeBatch()
+  // decodes, instead of a string per input. The alignments are stored as
+  // runs when `with_alignments` is true, and `runs` is left empty otherwise.
+  virtual util::Status NormalizeBatch(
+      const std::vector<absl::string_view> &inputs, bool with_alignments,
+      NormalizedBatch *batch) const;
+
   //////////////////////////////////////////////////////////////
   // Vocabulary management methods.
   //
@@ -693,9 +1531,17 @@ class SentencePieceProcessor {
   // Useful to save the state of this instance via Python's pickle object.
   util::bytes serialized_model_proto() const;
 
+  // Returns the file loaded by Load(filename), or an empty string if the
+  // model was loaded from a proto or changed after the loading, e.g. by
+  // SetVocabulary(). Loading the file again in a child process shares the
+  // pages of a mapped fast model instead of copying the serialized proto.
+  // Changes made through mutable_normalizer_spec() are not tracked.
+  const std::string &model_file() const { return model_file_; }
+
   // Returns mutable normalizer_spec.
   // Updating the intenral normalization during the encoding/decoding are not
   // recommended and may result in unexpected behavior. Use at your own risk.
+  // The spec is shared with the processors of LoadShared().
   NormalizerSpec *mutable_normalizer_spec() const;
 
  private:
@@ -704,24 +1550,670 @@ class SentencePieceProcessor {
   util::Status ParseExtraOptions(absl::string_view extra_option,
                                  std::vector<ExtraOption> *extra_options) const;
 
-  util::Status ApplyExtraOptions(const std::vector<ExtraOption> &extra_options,
-                                 SentencePieceText *spt) const;
+  // Ids put before and after the pieces, and whether the pieces are reversed
+  // and their unknown pieces replaced, once `extra_options` and then
+  // `options` are applied. The outputs are written in this layout as the
+  // pieces are emitted.
+  struct OutputLayout {
+    std::vector<int> prefix;
+    std::vector<int> suffix;
+    // Whether each id of `prefix` and `suffix` is eos, which is placed at
+    // the end of the input, rather than bos, which is placed at the start.
+    std::vector<bool> prefix_eos;
+    std::vector<bool> suffix_eos;
+    bool reverse = false;
+    bool unk_piece = false;
+  };
+  util::Status GetOutputLayout(const std::vector<ExtraOption> &extra_options,
+                               const EncodeOptions &options,
+                               OutputLayout *layout) const;
 
   util::Status PopulateSentencePieceText(
       absl::string_view input, absl::string_view normalized,
-      const std::vector<size_t> &norm_to_orig,
+      const normalizer::Alignment &norm_to_orig,
       const std::vector<std::pair<absl::string_view, int>> &result,
       SentencePieceText *spt) const;
 
-  std::unique_ptr<ModelInterface> model_;
-  std::unique_ptr<normalizer::Normalizer> normalizer_;
-  std::unique_ptr<normalizer::Normalizer> denormalizer_;
+  // Applies the extra options and the output options of `options`.
+  util::Status PopulateFlatSentencePieceText(
+      absl::string_view input, absl::string_view normalized,
+      const normalizer::Alignment &norm_to_orig,
+      const std::vector<std::pair<absl::string_view, int>> &result,
+      const EncodeOptions &options, FlatSentencePieceText *flat) const;
+
+  // Loads `model_proto`. `trie_blob` is a precompiled trie and
+  // `frequent_words` a FrequentWordTable, both owned by `mapped_file`, or
+  // empty.
+  util::Status LoadInternal(std::unique_ptr<ModelProto> model_proto,
+                            absl::string_view trie_blob,
+                            absl::string_view frequent_words,
+                            std::unique_ptr<filesystem::MappedFile> mapped_file);
+
+  // Returns an error if the model is shared with another processor by
+  // LoadShared(), so that it must not be changed.
+  util::Status CheckModelNotShared() const;
+
+  // The loaded model held by the registry of SetShareIdenticalModels().
+  struct RegisteredModel;
+
+  // Returns the registry key of the model serialized as `bytes` with the
+  // load options of this processor.
+  std::string RegistryKey(absl::string_view bytes) const;
+
+  // Uses the model registered with `key` as LoadShared() does. Returns
+  // false if there is none alive or it was not serialized as `bytes`.
+  bool AdoptRegisteredModel(const std::string &key, absl::string_view bytes);
+
+  // Registers the loaded model, serialized as `bytes`, with `key`. If
+  // another processor registered the same bytes meanwhile, uses that model
+  // instead.
+  void RegisterModel(const std::string &key, std::string bytes);
+
+  // Resets the options verified against each model, as after Load().
+  void ResetModelOptions();
+
+  // Returns the batch worker pool, creating it if needed.
+  std::shared_ptr<ThreadPool> GetThreadPool() const;
+
+  // Applies SetMemoryPlacement() to the loaded model: relocates the tables
+  // of model_ and normalizer_ if `relocate`, and rebuilds replicas_.
+  util::Status PlaceTables(bool relocate);
+
+  // Returns the model and the normalizer to be read by the calling thread:
+  // the replicas of its NUMA node if any, or else model_ and normalizer_.
+  const ModelInterface *LocalModel() const;
+  const normalizer::Normalizer *LocalNormalizer() const;
+
+  // Splits `normalized` into the segments of SetMaxSegmentLength(). A short
+  // input is the only segment.
+  util::Status SplitIntoSegments(
+      absl::string_view normalized,
+      std::vector<absl::string_view> *segments) const;
+
+  // Encodes `normalized` with the model, in parallel if it is long enough.
+  // `restriction` may be null.
+  void EncodeNormalized(absl::string_view normalized,
+                        const VocabularyRestriction *restriction,
+                        std::vector<std::pair<absl::string_view, int>> *result,
+                        std::unique_ptr<EncodeScratch> *scratch) const;
+
+  // Samples a segmentation of `normalized` as SampleEncode() does, one
+  // segment of SplitIntoSegments() at a time.
+  util::Status SampleEncodeNormalized(
+      absl::string_view normalized, int nbest_size, float alpha,
+      std::vector<std::pair<absl::string_view, int>> *result) const;
+
+  // EncodeNormalized(), or SampleEncodeNormalized() with the parameters of
+  // `options` when it enables sampling.
+  util::Status EncodeNormalized(
+      absl::string_view normalized, const EncodeOptions &options,
+      const VocabularyRestriction *restriction,
+      std::vector<std::pair<absl::string_view, int>> *result,
+      std::unique_ptr<EncodeScratch> *scratch) const;
+
+  // Encode() into a FlatSentencePieceText with the output options of
+  // `options`, restricted by `restriction` unless it is null.
+  util::Status EncodeToFlat(absl::string_view input,
+                            const EncodeOptions &options,
+                            const VocabularyRestriction *restriction,
+                            FlatSentencePieceText *flat,
+                            EncodeContext *context) const;
+
+  // The second half of EncodeToFlat(): encodes the normalization of `input`
+  // in `context`, which took `normalize_ns` to compute.
+  util::Status EncodeNormalizedToFlat(absl::string_view input,
+                                      const EncodeOptions &options,
+                                      const VocabularyRestriction *restriction,
+                                      uint64_t normalize_ns,
+                                      FlatSentencePieceText *flat,
+                                      EncodeContext *context) const;
+
+  // The candidates of a segment of the normalized text, as returned by
+  // ModelInterface::NBestEncode().
+  using SegmentCandidates = std::vector<
+      std::pair<std::vector<std::pair<absl::string_view, int>>, float>>;
+
+  // NBestEncodeBatch() and SampleEncodeAndScoreBatch(): gets the candidates
+  // of each segment of the inputs from `encode`, which is named `name` in
+  // the errors.
+  util::Status EncodeCandidatesBatch(
+      const std::vector<absl::string_view> &inputs, absl::string_view name,
+      const std::function<SegmentCandidates(
+          absl::string_view, std::unique_ptr<EncodeScratch> *)> &encode,
+      NBestBatch *batch) const;
+
+  // Returns true if the normalizer of `other` gives the same normalized
+  // text and alignment as the one of this processor.
+  bool NormalizesAs(const SentencePieceProcessor &other) const;
+
+  // Sets the restriction selected by `options`, or null, to `*restriction`.
+  util::Status GetVocabularyRestriction(
+      const EncodeOptions &options,
+      const VocabularyRestriction **restriction) const;
+
+  // Decodes the `size` ids at `ids` with the precomputed surfaces of
+  // decode_table_, without building the SentencePieceText. Appends the text
+  // to `detokenized`.
+  util::Status DecodeWithTable(const int *ids, size_t size,
+                               std::string *detokenized) const;
+
+  template <typename Offset>
+  util::Status EncodeArrowImpl(const ArrowStringArray<Offset> &input,
+                               ArrowListArray<Offset> *output) const;
+
+  // Encodes inputs[begin, end) into (*ids)[begin, end) as Encode() with
+  // `options`, passing the normalized sentences to
+  // ModelInterface::EncodeMany() at once. Only the output options of
+  // `options` are supported.
+  util::Status EncodeGroup(const std::vector<absl::string_view> &inputs,
+                           size_t begin, size_t end,
+                           const EncodeOptions &options,
+                           std::vector<std::vector<int>> *ids) const;
+
+  // Runs `func(i)` for all i in [0, size) on the batch worker pool and the
+  // calling thread. Returns the first error status.
+  util::Status RunBatch(size_t size,
+                        const std::function<util::Status(size_t)> &func) const;
+
+  // The loaded model, which LoadShared() shares between processors. The
+  // members below up to decode_table_ are reference counted for that.
+  std::shared_ptr<ModelInterface> model_;
+  std::shared_ptr<normalizer::Normalizer> normalizer_;
+  std::shared_ptr<normalizer::Normalizer> denormalizer_;
+
+  // Identifies the normalization of normalizer_ for NormalizesAs(). Empty
+  // for a normalizer set with SetNormalizer().
+  std::string normalization_key_;
 
   // Underlying model protocol buffer. The same lifetime as model_.
-  std::unique_ptr<ModelProto> model_proto_;
+  std::shared_ptr<ModelProto> model_proto_;
+
+  // Mapped fast-model file holding the precompiled trie of model_.
+  std::shared_ptr<filesystem::MappedFile> mapped_file_;
+
+  // Path of model_file().
+  std::string model_file_;
 
   std::vector<ExtraOption> encode_extra_options_;
   std::vector<ExtraOption> decode_extra_options_;
+
+  // Worker pool for the batch API. Lazily created.
+  int num_threads_ = -1;
+  mutable std::mutex pool_mutex_;
+  mutable std::shared_ptr<ThreadPool> pool_;
+
+  // Minimum normalized size for the parallel encoding. 0 disables it.
+  size_t parallel_encode_threshold_ = 0;
+  // Cut positions of the parallel encoding. Built with the threshold.
+  std::unique_ptr<SafeCutFinder> safe_cut_finder_;
+
+  // Input window of the fused normalization and encoding. 0 disables it.
+  size_t fused_encode_window_ = 0;
+
+  // Limits of SetMaxSegmentLength(). 0 disables them.
+  size_t max_segment_length_ = 0;
+  bool strict_segment_length_ = false;
+  mutable std::atomic<uint64_t> num_segmented_inputs_{0};
+
+  // Restrictions added by AddVocabularyRestriction().
+  std::vector<std::unique_ptr<VocabularyRestriction>> vocabulary_restrictions_;
+
+  // Surfaces of the ids for the fast ids-to-text Decode(). Built by Load()
+  // and reset by SetModel().
+  std::shared_ptr<DecodeTable> decode_table_;
+
+  // Options of SetMemoryPlacement().
+  bool huge_page_tables_ = false;
+  bool numa_replicas_ = false;
+
+  // Option of SetSlimLoad().
+  bool slim_load_ = false;
+
+  // Option of SetShareIdenticalModels().
+  bool share_identical_models_ = false;
+
+  // Keeps the entry of the registry alive while this processor uses its
+  // model. Null unless the model was loaded with SetShareIdenticalModels()
+  // or shared by LoadShared() from such a processor.
+  std::shared_ptr<const RegisteredModel> registered_model_;
+
+  // Copies of model_ and normalizer_ allocated on each NUMA node, indexed
+  // by the node. Empty unless numa_replicas_ is set on a machine with
+  // several nodes.
+  struct Replica {
+    std::shared_ptr<ModelInterface> model;
+    std::shared_ptr<normalizer::Normalizer> normalizer;
+  };
+  std::vector<Replica> replicas_;
+
+  // Counters of GetMetrics(). Null unless built with SPM_ENABLE_METRICS.
+  std::unique_ptr<MetricsRecorder> metrics_;
+
+  friend class StreamingDecoder;
+  friend class IncrementalEncoder;
+  friend class DocumentEncoder;
+  friend class SurfaceIndex;
+  friend class AsyncEncoder;
+  template <typename ModelT, typename NormalizerT, typename Options>
+  friend class EncoderPipeline;
+};
+
+// Decodes the ids of a generated sequence one at a time. Each call returns
+// only the text finalized by the new id, so decoding a sequence of n ids
+// takes O(n) time in total, and the concatenated outputs are equal to
+// SentencePieceProcessor::Decode() of the whole sequence. Byte pieces are
+// held back until they form a complete UTF-8 character. The decode extra
+// options are not applied, and the denormalizer, if any, is applied to each
+// output separately.
+//
+//   StreamingDecoder decoder(sp);
+//   std::string text;
+//   for (int id : generated_ids) {
+//     CHECK_OK(decoder.Decode(id, &text));
+//     std::cout << text << std::flush;
+//   }
+//   CHECK_OK(decoder.Finish(&text));
+//   std::cout << text;
+//
+// `processor` must outlive the decoder and stay loaded with the same model.
+// A decoder is not thread-safe; use one per sequence.
+class StreamingDecoder {
+ public:
+  explicit StreamingDecoder(const SentencePieceProcessor &processor);
+  ~StreamingDecoder();
+
+  // Decodes `id` and stores the newly finalized text in `text`.
+  util::Status Decode(int id, std::string *text);
+
+  // Ends the sequence and stores the remaining text in `text`. An
+  // incomplete byte sequence becomes REPLACEMENT CHARACTER (U+FFFD). The
+  // decoder is then ready for a new sequence.
+  util::Status Finish(std::string *text);
+
+  // Discards the state to start a new sequence.
+  void Reset();
+
+ private:
+  // Moves the complete characters of bytes_ to `text`, or all of the bytes
+  // if `flush`.
+  void TakeBytes(bool flush, std::string *text);
+
+  // Applies the denormalizer of the processor to `text`.
+  void Denormalize(std::string *text) const;
+
+  const SentencePieceProcessor &processor_;
+  std::string bytes_;        // Pending byte pieces.
+  bool is_bos_ws_ = true;    // The leading whitespace may still be stripped.
+  bool bos_ws_seen_ = false;  // A leading whitespace has been stripped.
+  bool emitted_ = false;      // Some text has been finalized.
+};
+
+// Encodes a text which grows by appending, e.g. a chat buffer or the
+// transcript of a streaming recognizer, without encoding it again from the
+// start. After each Append(), ids() are the ids of
+// SentencePieceProcessor::Encode() for the whole text so far. The ids
+// before the last position where the segmentation can no longer change are
+// final: the last word boundary, or the last position no piece spans for
+// models whose pieces span words. Only the text after it is encoded again,
+// so an append takes time in the size of the chunk and of the last word.
+//
+//   IncrementalEncoder encoder(sp);
+//   int num_retracted = 0;
+//   std::vector<int> added;
+//   for (const auto &chunk : chunks) {
+//     CHECK_OK(encoder.Append(chunk, &num_retracted, &added));
+//     ids.resize(ids.size() - num_retracted);
+//     ids.insert(ids.end(), added.begin(), added.end());
+//   }
+//
+// The encode extra options are not applied. `processor` must outlive the
+// encoder and stay loaded with the same model. An encoder is not
+// thread-safe; use one per text.
+class IncrementalEncoder {
+ public:
+  explicit IncrementalEncoder(const SentencePieceProcessor &processor);
+  ~IncrementalEncoder();
+
+  // Appends `text` and stores the change of ids() in `num_retracted`, the
+  // number of ids removed from the end, and `added`, the ids appended
+  // after them.
+  util::Status Append(absl::string_view text, int *num_retracted,
+                      std::vector<int> *added);
+
+  // Returns the ids of the whole text so far.
+  const std::vector<int> &ids() const { return ids_; }
+
+  // Returns the number of the leading ids which no append changes.
+  size_t num_final_ids() const { return num_final_ids_; }
+
+  // Discards the text to start a new one.
+  void Reset();
+
+ private:
+  // Returns the size of the prefix of pending_ whose ids are final.
+  size_t FinalSize() const;
+
+  const SentencePieceProcessor &processor_;
+  // Normalizer of the appended text, created for `stream_normalizer_`.
+  std::unique_ptr<normalizer::StreamNormalizer> stream_;
+  const normalizer::Normalizer *stream_normalizer_ = nullptr;
+  // Finder of the final positions when pieces span words. Null otherwise.
+  std::unique_ptr<SafeCutFinder> safe_cut_finder_;
+  std::unique_ptr<EncodeScratch> scratch_;
+  // Normalized text after the final ids, which the stream has decided.
+  std::string pending_;
+  std::vector<int> ids_;
+  size_t num_final_ids_ = 0;
+  // The final ids end with a run of unknown pieces.
+  bool is_prev_unk_ = false;
+};
+
+// Keeps the ids of a document in sync with its edits, e.g. in an editor.
+// After each call, ids() are the ids of SentencePieceProcessor::Encode()
+// for text(). An edit normalizes the document again, which is a cheap pass
+// over it, but encodes only the normalized text between the closest
+// positions around the change where the segmentation cannot change: word
+// boundaries, or for models whose pieces span words, positions which no
+// piece spans. The ids outside are kept and the new ids are spliced in.
+//
+//   DocumentEncoder document(sp);
+//   CHECK_OK(document.SetText(text));
+//   DocumentEncoder::Splice splice;
+//   CHECK_OK(document.Edit(offset, removed, inserted, &splice));
+//   ids.erase(ids.begin() + splice.begin,
+//             ids.begin() + splice.begin + splice.num_removed);
+//   ids.insert(ids.begin() + splice.begin, splice.ids.begin(),
+//              splice.ids.end());
+//
+// The encode extra options are not applied. `processor` must outlive the
+// encoder and stay loaded with the same model. Not thread-safe.
+class DocumentEncoder {
+ public:
+  // The change of ids() made by an edit: `num_removed` ids from `begin`
+  // are replaced with `ids`.
+  struct Splice {
+    size_t begin = 0;
+    size_t num_removed = 0;
+    std::vector<int> ids;
+  };
+
+  explicit DocumentEncoder(const SentencePieceProcessor &processor);
+  ~DocumentEncoder();
+
+  // Replaces the document with `text` and encodes it.
+  util::Status SetText(absl::string_view text);
+
+  // Replaces `removed` bytes of the document at byte `offset` with
+  // `inserted`, and stores the change of ids() in `splice`.
+  util::Status Edit(size_t offset, size_t removed, absl::string_view inserted,
+                    Splice *splice);
+
+  const std::string &text() const { return text_; }
+  const std::vector<int> &ids() const { return ids_; }
+
+ private:
+  // Encodes normalized_[begin, end) and appends the ids and their ends to
+  // `ids` and `ends`.
+  util::Status EncodeRange(size_t begin, size_t end, std::vector<int> *ids,
+                           std::vector<size_t> *ends);
+
+  // Returns the last position at or before `pos` of normalized_ where the
+  // segmentation is split, or 0.
+  size_t CutBefore(size_t pos) const;
+
+  // Returns the first position at or after `pos` of normalized_ where the
+  // segmentation is split, or normalized_.size().
+  size_t CutAfter(size_t pos) const;
+
+  // Returns the number of ids ending at or before `pos` of the normalized
+  // text of ids_. `aligned` is set to false if an id spans `pos`.
+  size_t IdsBefore(size_t pos, bool *aligned) const;
+
+  // Returns true if the id at `index` is an unknown piece, which merges
+  // with an adjacent one.
+  bool IsMergeableUnknown(size_t index) const;
+
+  const SentencePieceProcessor &processor_;
+  std::unique_ptr<SafeCutFinder> safe_cut_finder_;
+  std::unique_ptr<EncodeScratch> scratch_;
+  std::string text_;
+  std::string normalized_;
+  std::vector<int> ids_;
+  // ends_[i] is the end of ids_[i] in normalized_.
+  std::vector<size_t> ends_;
+  // SetText() has been called.
+  bool initialized_ = false;
+};
+
+// Index of the decoded surfaces of the pieces of a model for constrained
+// generation, which needs the ids whose surface is consistent with the text
+// still to be generated at each step. The surface of a piece is the text
+// Decode() appends for it in the middle of a text: kSpaceSymbol is a space
+// and a byte piece is its byte. Control and unknown pieces are not indexed.
+// The leading space of the first piece of a text is stripped by Decode(),
+// so the text of the first step is given with a leading space.
+//
+// The surfaces are sorted, which makes a trie: a lookup narrows the range
+// of the surfaces starting with each prefix of the text by binary search,
+// and takes O(|text| log(vocabulary size)) time plus the number of ids
+// found.
+//
+//   SurfaceIndex index;
+//   CHECK_OK(index.Build(sp));
+//   std::vector<uint64_t> mask;
+//   index.GetCompatibleMask(" hello world", &mask);
+class SurfaceIndex {
+ public:
+  SurfaceIndex();
+  ~SurfaceIndex();
+
+  // Indexes the pieces of the model loaded in `processor`. The index does
+  // not refer to `processor` afterwards.
+  util::Status Build(const SentencePieceProcessor &processor);
+
+  // Stores the ids whose surface is a prefix of `text`, including `text`
+  // itself, in `ids`.
+  void FindPrefixesOf(absl::string_view text, std::vector<int> *ids) const;
+
+  // Stores the ids whose surface starts with `text` in `ids`.
+  void FindExtensionsOf(absl::string_view text, std::vector<int> *ids) const;
+
+  // Stores the ids whose surface is consistent with `text`, i.e. is a
+  // prefix of it or starts with it, in `ids`.
+  void FindCompatible(absl::string_view text, std::vector<int> *ids) const;
+
+  // The same as FindCompatible(), but sets bit (id % 64) of mask[id / 64]
+  // for each id, and clears the other bits of the GetPieceSize() ids.
+  void GetCompatibleMask(absl::string_view text,
+                         std::vector<uint64_t> *mask) const;
+
+  // Returns the number of ids of the model.
+  int GetPieceSize() const { return piece_size_; }
+
+ private:
+  struct Entry {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    int id = 0;
+  };
+
+  absl::string_view Surface(const Entry &entry) const {
+    return absl::string_view(surfaces_.data() + entry.offset, entry.length);
+  }
+
+  // Walks down the sorted entries along `text`. Calls `prefix(begin, end)`
+  // for the entries of each prefix of `text`, and returns the range of the
+  // entries longer than `text` which start with it.
+  std::pair<size_t, size_t> Walk(
+      absl::string_view text,
+      const std::function<void(size_t, size_t)> &prefix) const;
+
+  std::string surfaces_;
+  // Sorted by surface and id.
+  std::vector<Entry> entries_;
+  int piece_size_ = 0;
+};
+
+// Encodes requests from many threads, e.g. the IO threads of a server, on
+// the batch worker pool of a processor. The requests arriving within
+// `max_delay_us` microseconds of the first pending one are encoded together
+// as a batch of up to `max_batch_size` inputs with one EncodeContext, so
+// that a busy server pays the scheduling cost once per batch instead of
+// once per request. With `max_delay_us` = 0, the requests are not delayed
+// and only those already pending are batched.
+//
+//   AsyncEncoder encoder(sp, /*max_delay_us=*/200);
+//   encoder.Encode(request.text(), [&](util::Status status,
+//                                      std::vector<int> ids) { ... });
+//
+// With `adaptive_delay`, a batch is dispatched as soon as no request has
+// arrived for the recent average time between requests, and requests are
+// not delayed at all when that time exceeds `max_delay_us`, so that a
+// lightly loaded server does not add latency.
+//
+// The callbacks run on the workers of the pool and must not block on other
+// requests. `processor` must outlive the encoder and must not be modified
+// while it is in use. The methods are thread-safe.
+class AsyncEncoder {
+ public:
+  // Counters of the batches dispatched so far. batch_sizes[n] is the number
+  // of batches of n requests, for n in [1, max_batch_size].
+  struct Stats {
+    uint64_t num_requests = 0;
+    uint64_t num_batches = 0;
+    uint64_t num_full_batches = 0;
+    std::vector<uint64_t> batch_sizes;
+
+    // Returns the average fraction of max_batch_size filled by a batch.
+    double fill_rate() const;
+  };
+
+  AsyncEncoder(const SentencePieceProcessor &processor, int64_t max_delay_us,
+               size_t max_batch_size = 64, bool adaptive_delay = false);
+
+  // Encodes the pending requests and waits for all the callbacks.
+  ~AsyncEncoder();
+
+  // Queues `input`, which is copied, and calls `callback` with the result.
+  void Encode(absl::string_view input,
+              SentencePieceProcessor::EncodeCallback callback);
+
+  // The same as above, but returns a future holding the status and the ids.
+  std::future<std::pair<util::Status, std::vector<int>>> Encode(
+      absl::string_view input);
+
+  // Encodes `input` in a batch with the concurrent requests and blocks
+  // until `ids` are ready. Must not be called from a callback.
+  util::Status Encode(absl::string_view input, std::vector<int> *ids);
+
+  // Encodes the pending requests without waiting for the delay, and returns
+  // when all the requests queued so far have completed.
+  void Flush();
+
+  Stats GetStats() const;
+
+ private:
+  struct State;
+
+  // Takes batches from the queue and schedules them on the pool until the
+  // encoder is destroyed.
+  void DispatchLoop();
+
+  std::unique_ptr<State> state_;
+};
+
+// Holds the model in use by a server and replaces it while other threads
+// are encoding with it. A new model is loaded into its own processor and
+// published atomically; the calls already running finish on the old model,
+// which is destroyed once they have returned. Readers take no lock: a
+// Snapshot only increments the reader count of the current model.
+//
+//   ProcessorHandle handle;
+//   CHECK_OK(handle.Load("//path/to/model"));
+//
+//   // On any thread.
+//   auto sp = handle.Acquire();
+//   sp->Encode(text, &ids);
+//
+//   // On the reload thread, while the others keep encoding.
+//   CHECK_OK(handle.Load("//path/to/new_model"));
+class ProcessorHandle {
+ private:
+  struct Slot;
+
+ public:
+  // Keeps the model that was current when it was taken alive until it is
+  // destroyed. Snapshots are cheap, but should not be kept longer than a
+  // request, since Publish() waits for them.
+  class Snapshot {
+   public:
+    Snapshot(Snapshot &&other) noexcept;
+    Snapshot &operator=(Snapshot &&other) noexcept;
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    ~Snapshot();
+
+    const SentencePieceProcessor &operator*() const { return *processor_; }
+    const SentencePieceProcessor *operator->() const { return processor_; }
+    const SentencePieceProcessor *get() const { return processor_; }
+
+    // Generation of the model, incremented by every Publish().
+    uint64_t generation() const { return generation_; }
+
+   private:
+    friend class ProcessorHandle;
+    Snapshot(Slot *slot, const SentencePieceProcessor *processor,
+             uint64_t generation)
+        : slot_(slot), processor_(processor), generation_(generation) {}
+
+    Slot *slot_ = nullptr;
+    const SentencePieceProcessor *processor_ = nullptr;
+    uint64_t generation_ = 0;
+  };
+
+  // Starts with an empty processor, whose calls fail until a model is
+  // published.
+  ProcessorHandle();
+  explicit ProcessorHandle(std::unique_ptr<SentencePieceProcessor> processor);
+  ~ProcessorHandle();
+
+  ProcessorHandle(const ProcessorHandle &) = delete;
+  ProcessorHandle &operator=(const ProcessorHandle &) = delete;
+
+  // Returns the current model. Never blocks.
+  Snapshot Acquire() const;
+
+  // Makes `processor` the current model and returns when the calls on the
+  // previous model have finished and it has been destroyed. Must not be
+  // called by a thread holding a Snapshot of this handle. Publishers are
+  // serialized.
+  void Publish(std::unique_ptr<SentencePieceProcessor> processor);
+
+  // Loads a new model into a new processor and publishes it. On error, the
+  // current model is kept.
+  util::Status Load(absl::string_view filename);
+  util::Status LoadFromSerializedProto(absl::string_view serialized);
+
+  // Generation of the current model: 0 for the initial model, incremented
+  // by every Publish().
+  uint64_t generation() const;
+
+ private:
+  // The current model lives in one of two slots. Publish() fills the other
+  // slot once its readers have left, switches current_ to it, and then
+  // waits for the readers of the old slot before destroying the old model.
+  struct Slot {
+    std::unique_ptr<SentencePieceProcessor> processor;
+    uint64_t generation = 0;
+    std::atomic<int64_t> readers{0};
+  };
+
+  // Waits until no Snapshot refers to `slot`.
+  static void WaitForReaders(const Slot &slot);
+
+  mutable Slot slots_[2];
+  std::atomic<int> current_{0};
+  std::mutex publish_mutex_;
 };
 
 // Set seed value of random generator.
@@ -730,10 +2222,26 @@ class SentencePieceProcessor {
 // std::random_device.
 void SetRandomGeneratorSeed(unsigned int seed);
 
+// Reseeds the random generator of the calling thread with `seed` and
+// `stream`. The sampling calls made on this thread afterwards, e.g.
+// SampleEncode(), give the same result on any thread, so each example can
+// be sampled reproducibly with its own seed or stream, e.g. its index.
+void SetThreadRandomGeneratorSeed(uint64_t seed, uint64_t stream = 0);
+
 // Set the global log level. The default loglevel is 0.
 // The log is emitted only when min_log_level >= output_log_level.
 void SetMinLogLevel(int v);
 
+// Loads the model files `filenames` into `processors` concurrently, on at
+// most `num_threads` threads of the process-wide pool as
+// RunOnSharedThreadPool(), e.g. to load the models of a service at once.
+// Returns the first error in the order of `filenames`, in which case
+// `processors` is left empty.
+util::Status LoadProcessors(
+    const std::vector<std::string> &filenames,
+    std::vector<std::unique_ptr<SentencePieceProcessor>> *processors,
+    int num_threads = 0);
+
 // IO related functions to absorb model formats.
 namespace io {
 // Loads `model_proto` from `filename`.
@@ -747,6 +2255,19 @@ util::Status LoadModelProto(absl::string_view, ModelProto *model_proto);
 
 // Saves `model_proto` as `filename`.
 util::Status SaveModelProto(absl::string_view, const ModelProto &model_proto);
+
+// Saves `model_proto` as `filename` in the fast-model format, which stores
+// the precompiled trie of unigram models or the merge table of BPE models
+// next to the ModelProto. The file is
+// loaded by SentencePieceProcessor::Load() and LoadModelProto() as well.
+// When loaded by SentencePieceProcessor, the file is memory-mapped and the
+// trie is used in place instead of being rebuilt.
+// `frequent_words` is a table of SentencePieceProcessor::
+// BuildFrequentWordTable() for `model_proto`, which is stored as well and
+// looked up by Encode() before the model encodes a word.
+util::Status SaveFastModel(absl::string_view filename,
+                           const ModelProto &model_proto,
+                           absl::string_view frequent_words = "");
 }  // namespace io
 }  // namespace sentencepiece
 #endif  // SENTENCEPIECE_PROCESSOR_H_
@@ -14,9 +14,18 @@
 
 #include "sentencepiece_processor.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <set>
+#include <thread>
 #include <utility>
 
+#include "bpe_model.h"
 #include "builder.h"
+#include "encoder_pipeline.h"
+#include "fast_model.h"
 #include "filesystem.h"
 #include "model_interface.h"
 #include "normalizer.h"
@@ -25,10 +34,19 @@
 #include "sentencepiece_trainer.h"
 #include "testharness.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/strings/match.h"
 #include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_join.h"
+#include "third_party/absl/strings/str_replace.h"
 #include "third_party/absl/strings/string_view.h"
+#include "unigram_model.h"
 #include "util.h"
 
+#ifndef OS_WIN
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 namespace sentencepiece {
 
 // Space symbol
@@ -109,7 +127,7 @@ std::vector<int> GetIdVec(const EncodeResult &pieces) {
 
 std::vector<std::string> GetSpVec(const SentencePieceText &spt) {
   std::vector<std::string> sps;
-  for (auto &sp : spt.pieces()) {
+  for (const auto &sp : spt.pieces()) {
     sps.emplace_back(sp.piece());
   }
   return sps;
@@ -1155,6 +1173,83 @@ TEST(SentencePieceProcessorTest, EndToEndTest) {
     EXPECT_EQ(expected_id, ids);
   }
 
+  {
+    // The pieces are written in the reversed order with their spans.
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("bos:eos:reverse:unk").ok());
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Encode("abxyc", &spt).ok());
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode("abxyc", &ids).ok());
+    ASSERT_EQ(ids.size(), spt.pieces_size());
+    for (int i = 0; i < spt.pieces_size(); ++i) {
+      EXPECT_EQ(ids[i], spt.pieces(i).id());
+    }
+    ASSERT_EQ(6, spt.pieces_size());
+    EXPECT_EQ("</s>", spt.pieces(0).piece());
+    EXPECT_EQ(5, spt.pieces(0).begin());
+    EXPECT_EQ(5, spt.pieces(0).end());
+    EXPECT_EQ("c", spt.pieces(1).piece());
+    EXPECT_EQ("<unk>", spt.pieces(2).piece());
+    EXPECT_EQ("xy", spt.pieces(2).surface());
+    EXPECT_EQ("ab", spt.pieces(3).piece());
+    EXPECT_EQ("<s>", spt.pieces(5).piece());
+    EXPECT_EQ(0, spt.pieces(5).begin());
+    EXPECT_EQ(0, spt.pieces(5).end());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("").ok());
+  }
+
+  {
+    // The options of a call are applied after the extra options.
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("eos").ok());
+    EncodeOptions options;
+    options.reverse = true;
+    options.add_bos = true;
+    EncodeContext context;
+
+    std::vector<std::string> sps;
+    const std::vector<std::string> expected_str = {"<s>", "</s>", "c", "ab",
+                                                   WS};
+    EXPECT_TRUE(sp.Encode("abc", options, &sps, &context).ok());
+    EXPECT_EQ(expected_str, sps);
+
+    std::vector<int> ids;
+    const std::vector<int> expected_id = {1, 2, 5, 6, 7};
+    EXPECT_TRUE(sp.Encode("abc", options, &ids, &context).ok());
+    EXPECT_EQ(expected_id, ids);
+
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("").ok());
+    options = EncodeOptions();
+    options.add_eos = true;
+    options.emit_unk_piece = true;
+    EXPECT_TRUE(sp.Encode("abc", options, &ids, &context).ok());
+    EXPECT_EQ(std::vector<int>({7, 6, 5, 2}), ids);
+    EXPECT_TRUE(sp.Encode("abx", options, &sps, &context).ok());
+    EXPECT_EQ(std::vector<std::string>({WS, "ab", "<unk>", "</s>"}), sps);
+    options.emit_unk_piece = false;
+    EXPECT_TRUE(sp.Encode("abx", options, &sps, &context).ok());
+    EXPECT_EQ(std::vector<std::string>({WS, "ab", "x", "</s>"}), sps);
+  }
+
+  {
+    // ignore_extra_options bypasses the extra options of the processor.
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("bos:eos:reverse").ok());
+    EncodeOptions options;
+    options.ignore_extra_options = true;
+    options.add_eos = true;
+    EncodeContext context;
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode("abc", options, &ids, &context).ok());
+    EXPECT_EQ(std::vector<int>({7, 6, 5, 2}), ids);
+    std::vector<std::string> sps;
+    EXPECT_TRUE(sp.Encode("abc", options, &sps, &context).ok());
+    EXPECT_EQ(std::vector<std::string>({WS, "ab", "c", "</s>"}), sps);
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Encode("abc", options, &spt, &context).ok());
+    ASSERT_EQ(4, spt.pieces_size());
+    EXPECT_EQ("</s>", spt.pieces(3).piece());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("").ok());
+  }
+
   {
     std::string output;
     const std::vector<std::string> sps = {"ab", "c"};
@@ -1424,194 +1519,3075 @@ TEST(SentencePieceProcessorTest, ExtraOptionsUndefinedTest) {
   EXPECT_FALSE(sp.SetDecodeExtraOptions("eos").ok());
 }
 
-TEST(SentencePieceProcessorTest, OverrideSpecialPieceTest) {
+TEST(SentencePieceProcessorTest, EncodeBatchTest) {
   ModelProto model_proto;
   auto *sp1 = model_proto.add_pieces();
-  auto *sp2 = model_proto.add_pieces();
-  auto *sp3 = model_proto.add_pieces();
-
-  model_proto.mutable_trainer_spec()->set_unk_piece("__UNK__");
-  model_proto.mutable_trainer_spec()->set_bos_piece("__BOS__");
-  model_proto.mutable_trainer_spec()->set_eos_piece("__EOS__");
-  model_proto.mutable_trainer_spec()->set_pad_piece("__PAD__");
-
-  // No BOS/EOS.
   sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
-  sp1->set_piece("__UNK__");
-  sp2->set_type(ModelProto::SentencePiece::CONTROL);
-  sp2->set_piece("__BOS__");
-  sp3->set_type(ModelProto::SentencePiece::CONTROL);
-  sp3->set_piece("__EOS__");
+  sp1->set_piece("<unk>");
 
   AddPiece(&model_proto, "a", 0.0);
   AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
   SentencePieceProcessor sp;
-  EXPECT_TRUE(sp.Load(model_proto).ok());
-  EXPECT_EQ(0, sp.unk_id());
-  EXPECT_EQ(1, sp.bos_id());
-  EXPECT_EQ(2, sp.eos_id());
-  EXPECT_EQ(-1, sp.pad_id());
+  {
+    std::vector<std::vector<int>> ids;
+    EXPECT_FALSE(sp.EncodeBatch({"ab"}, &ids).ok());
+  }
 
-  EXPECT_EQ("__UNK__", sp.IdToPiece(sp.unk_id()));
-  EXPECT_EQ("__BOS__", sp.IdToPiece(sp.bos_id()));
-  EXPECT_EQ("__EOS__", sp.IdToPiece(sp.eos_id()));
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  std::vector<std::string> texts;
+  for (int i = 0; i < 100; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + " b" +
+                       std::string(i % 5, 'c') + " ab");
+  }
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+
+  for (const int num_threads : {1, 4, 0}) {
+    EXPECT_TRUE(sp.SetNumThreads(num_threads).ok());
+
+    std::vector<std::vector<int>> ids;
+    std::vector<std::vector<std::string>> pieces;
+    std::vector<ImmutableSentencePieceText> spts;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, &ids).ok());
+    EXPECT_TRUE(sp.EncodeBatch(inputs, &pieces).ok());
+    EXPECT_TRUE(sp.EncodeBatch(inputs, &spts).ok());
+    ASSERT_EQ(inputs.size(), ids.size());
+    ASSERT_EQ(inputs.size(), pieces.size());
+    ASSERT_EQ(inputs.size(), spts.size());
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.EncodeAsIds(inputs[i]), ids[i]);
+      EXPECT_EQ(sp.EncodeAsPieces(inputs[i]), pieces[i]);
+      EXPECT_EQ(sp.EncodeAsImmutableProto(inputs[i]).SerializeAsString(),
+                spts[i].SerializeAsString());
+    }
+  }
+
+  std::vector<std::vector<int>> ids;
+  EXPECT_TRUE(sp.EncodeBatch({}, &ids).ok());
+  EXPECT_TRUE(ids.empty());
+
+  // The options of a batch are applied to every input, whatever the extra
+  // options of the processor.
+  std::vector<std::vector<int>> best_ids;
+  for (const auto input : inputs) best_ids.push_back(sp.EncodeAsIds(input));
+  EXPECT_TRUE(sp.SetEncodeExtraOptions("reverse").ok());
+  for (const int num_threads : {1, 4}) {
+    EXPECT_TRUE(sp.SetNumThreads(num_threads).ok());
+    EncodeOptions options;
+    options.ignore_extra_options = true;
+    options.add_bos = true;
+    std::vector<std::vector<std::string>> pieces;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, options, &ids).ok());
+    EXPECT_TRUE(sp.EncodeBatch(inputs, options, &pieces).ok());
+    ASSERT_EQ(inputs.size(), ids.size());
+    ASSERT_EQ(inputs.size(), pieces.size());
+    EncodeContext context;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      std::vector<int> expected_ids;
+      std::vector<std::string> expected_pieces;
+      EXPECT_TRUE(
+          sp.Encode(inputs[i], options, &expected_ids, &context).ok());
+      EXPECT_TRUE(
+          sp.Encode(inputs[i], options, &expected_pieces, &context).ok());
+      EXPECT_EQ(expected_ids, ids[i]);
+      EXPECT_EQ(expected_pieces, pieces[i]);
+      ASSERT_EQ(best_ids[i].size() + 1, ids[i].size());
+      EXPECT_TRUE(std::equal(best_ids[i].begin(), best_ids[i].end(),
+                             ids[i].begin() + 1));
+    }
+
+    // Sampling per call gives segmentations of the input, and the best one
+    // with nbest_size = 1.
+    options = EncodeOptions();
+    options.ignore_extra_options = true;
+    options.enable_sampling = true;
+    options.alpha = 0.0;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, options, &pieces).ok());
+    EXPECT_TRUE(sp.EncodeBatch(inputs, options, &ids).ok());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      const std::string text = sp.DecodeIds(best_ids[i]);
+      EXPECT_EQ(text, sp.DecodePieces(pieces[i]));
+      EXPECT_EQ(text, sp.DecodeIds(ids[i]));
+    }
+    options.nbest_size = 1;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, options, &ids).ok());
+    EXPECT_EQ(best_ids, ids);
+
+    options.max_tokens = 2;
+    EXPECT_FALSE(sp.EncodeBatch(inputs, options, &ids).ok());
+  }
+  EXPECT_TRUE(sp.SetEncodeExtraOptions("").ok());
 }
 
-TEST(SentencePieceProcessorTest, VocabularyTest) {
+TEST(SentencePieceProcessorTest, SetMemoryPlacementTest) {
   ModelProto model_proto;
   auto *sp1 = model_proto.add_pieces();
-  auto *sp2 = model_proto.add_pieces();
-  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
 
-  auto GetInlineFilename = [](const std::string content) {
-    {
-      auto out = filesystem::NewWritableFile(
-          util::JoinPath(::testing::TempDir(), "vocab.txt"));
-      out->Write(content);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  std::vector<std::string> texts;
+  for (int i = 0; i < 100; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + " \uFF42" +
+                       std::string(i % 5, 'c') + " ab");
+  }
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  std::vector<std::vector<int>> expected;
+  EXPECT_TRUE(sp.EncodeBatch(inputs, &expected).ok());
+
+  // Before and after Load().
+  for (const bool before_load : {false, true}) {
+    for (const bool huge_pages : {false, true}) {
+      for (const bool numa_replicas : {false, true}) {
+        SentencePieceProcessor placed;
+        if (before_load) {
+          EXPECT_TRUE(
+              placed.SetMemoryPlacement(huge_pages, numa_replicas).ok());
+        }
+        ASSERT_TRUE(placed.Load(model_proto).ok());
+        if (!before_load) {
+          EXPECT_TRUE(
+              placed.SetMemoryPlacement(huge_pages, numa_replicas).ok());
+        }
+        EXPECT_TRUE(placed.SetNumThreads(4).ok());
+        std::vector<std::vector<int>> ids;
+        EXPECT_TRUE(placed.EncodeBatch(inputs, &ids).ok());
+        EXPECT_EQ(expected, ids);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+          EXPECT_EQ(expected[i], placed.EncodeAsIds(inputs[i]));
+        }
+
+        // The vocabulary applies to the replicas.
+        EXPECT_TRUE(placed.SetVocabulary({"a", "b", "c", WS}).ok());
+        EXPECT_TRUE(placed.EncodeBatch({"ab"}, &ids).ok());
+        EXPECT_EQ(std::vector<int>({5, 1, 2}), ids[0]);
+      }
     }
-    return util::JoinPath(::testing::TempDir(), "vocab.txt");
+  }
+
+  SentencePieceProcessor shared;
+  ASSERT_TRUE(shared.LoadShared(sp).ok());
+  EXPECT_FALSE(sp.SetMemoryPlacement(true, true).ok());
+  EXPECT_FALSE(shared.SetMemoryPlacement(true, true).ok());
+}
+
+TEST(SentencePieceProcessorTest, EncodeWithModelsTest) {
+  auto make_model = [](bool with_ab) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    if (with_ab) AddPiece(&model_proto, "ab", 1.0);
+    AddPiece(&model_proto, WS, 3.0);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+    return model_proto;
   };
 
+  // sp1 and sp2 normalize alike, sp3 does not add the dummy prefix, and sp4
+  // keeps "ab" as a user defined symbol. sp5 shares the normalizer of sp1.
+  SentencePieceProcessor sp1, sp2, sp3, sp4, sp5;
+  ASSERT_TRUE(sp1.Load(make_model(true)).ok());
+  ASSERT_TRUE(sp2.Load(make_model(false)).ok());
+  ModelProto model3 = make_model(true);
+  model3.mutable_normalizer_spec()->set_add_dummy_prefix(false);
+  ASSERT_TRUE(sp3.Load(model3).ok());
+  ModelProto model4 = make_model(false);
+  AddPiece(&model4, "ab", 0.0);
+  model4.mutable_pieces()->rbegin()->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+  ASSERT_TRUE(sp4.Load(model4).ok());
+  ASSERT_TRUE(sp5.LoadShared(sp1).ok());
+  ASSERT_TRUE(sp5.SetEncodeExtraOptions("reverse").ok());
+
+  const std::vector<const SentencePieceProcessor *> processors = {
+      &sp1, &sp3, &sp2, &sp4, &sp5};
+  for (const absl::string_view input : {"ab ba  xab", "", "abab"}) {
+    std::vector<FlatSentencePieceText> flats;
+    ASSERT_TRUE(
+        SentencePieceProcessor::EncodeWithModels(processors, input, &flats)
+            .ok());
+    std::vector<std::vector<int>> ids;
+    ASSERT_TRUE(
+        SentencePieceProcessor::EncodeWithModels(processors, input, &ids)
+            .ok());
+    ASSERT_EQ(processors.size(), flats.size());
+    ASSERT_EQ(processors.size(), ids.size());
+    for (size_t i = 0; i < processors.size(); ++i) {
+      SentencePieceText expected, actual;
+      ASSERT_TRUE(processors[i]->Encode(input, &expected).ok());
+      flats[i].CopyToProto(&actual);
+      EXPECT_EQ(expected.SerializeAsString(), actual.SerializeAsString());
+      std::vector<int> expected_ids;
+      ASSERT_TRUE(processors[i]->Encode(input, &expected_ids).ok());
+      EXPECT_EQ(expected_ids, ids[i]);
+    }
+  }
+
+  std::vector<FlatSentencePieceText> flats;
+  EXPECT_TRUE(
+      SentencePieceProcessor::EncodeWithModels({}, "ab", &flats).ok());
+  EXPECT_TRUE(flats.empty());
+  SentencePieceProcessor unloaded;
+  EXPECT_FALSE(
+      SentencePieceProcessor::EncodeWithModels({&sp1, &unloaded}, "ab", &flats)
+          .ok());
+  EXPECT_FALSE(
+      SentencePieceProcessor::EncodeWithModels({&sp1, nullptr}, "ab", &flats)
+          .ok());
+}
+
+TEST(SentencePieceProcessorTest, EncodeOnArenaTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
   sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
   sp1->set_piece("<unk>");
-  sp2->set_type(ModelProto::SentencePiece::CONTROL);
-  sp2->set_piece("<s>");
-  sp3->set_type(ModelProto::SentencePiece::CONTROL);
-  sp3->set_piece("</s>");
 
-  AddPiece(&model_proto, "aa", 0.0);
-  AddPiece(&model_proto, "bb", 0.0);
-  AddPiece(&model_proto, "cc", 0.0);
-  AddPiece(&model_proto, "dd", 0.0);
-  AddPiece(&model_proto, "e", 0.0);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
   SentencePieceProcessor sp;
-  EXPECT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  SentencePieceText expected;
+  ASSERT_TRUE(sp.Encode("ab ba xab", &expected).ok());
+
+  google::protobuf::Arena arena;
+  auto *spt = google::protobuf::Arena::CreateMessage<SentencePieceText>(&arena);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(sp.Encode("ab ba xab", spt).ok());
+    EXPECT_EQ(expected.SerializeAsString(), spt->SerializeAsString());
+    ASSERT_LT(0, spt->pieces_size());
+    EXPECT_EQ(&arena, spt->pieces(0).GetArena());
+  }
 
-  EXPECT_FALSE(sp.IsUnused(0));
-  EXPECT_FALSE(sp.IsUnused(1));
-  EXPECT_FALSE(sp.IsUnused(2));
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_FALSE(sp.IsUnused(4));
-  EXPECT_FALSE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  const auto immutable = sp.EncodeAsImmutableProto("ab ba xab");
+  EXPECT_EQ(expected.SerializeAsString(), immutable.SerializeAsString());
+  EXPECT_EQ(expected.SerializeAsString(),
+            sp.EncodeAsSerializedProto("ab ba xab"));
+}
 
-  EXPECT_TRUE(sp.SetVocabulary({"aa", "dd", "e"}).ok());
+TEST(SentencePieceProcessorTest, EncodeAsyncTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
 
-  EXPECT_FALSE(sp.IsUnused(0));
-  EXPECT_FALSE(sp.IsUnused(1));
-  EXPECT_FALSE(sp.IsUnused(2));
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));  // single char "e" is always used.
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
-  EXPECT_TRUE(sp.ResetVocabulary().ok());
+  SentencePieceProcessor sp;
+  {
+    const auto result = sp.EncodeAsync("ab").get();
+    EXPECT_FALSE(result.first.ok());
+  }
 
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_FALSE(sp.IsUnused(4));
-  EXPECT_FALSE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.SetNumThreads(4).ok());
 
-  EXPECT_TRUE(sp.SetVocabulary({"bb"}).ok());
-  EXPECT_TRUE(sp.IsUnused(3));
-  EXPECT_FALSE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_TRUE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  std::vector<std::string> texts;
+  for (int i = 0; i < 200; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + " b" +
+                       std::string(i % 5, 'b') + " ab");
+  }
 
-  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t2\n"), 2).ok());
-  EXPECT_TRUE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  {
+    std::vector<std::future<std::pair<util::Status, std::vector<int>>>>
+        futures;
+    for (const auto &text : texts) futures.push_back(sp.EncodeAsync(text));
+    for (size_t i = 0; i < texts.size(); ++i) {
+      const auto result = futures[i].get();
+      EXPECT_TRUE(result.first.ok());
+      EXPECT_EQ(sp.EncodeAsIds(texts[i]), result.second);
+    }
+  }
 
-  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t1\n"), 2).ok());
-  EXPECT_TRUE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_TRUE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  // Requests from several threads, batched with and without a delay.
+  for (const int64_t max_delay_us : {0, 500}) {
+    for (const size_t max_batch_size : {1, 8}) {
+      std::vector<std::vector<int>> ids(texts.size());
+      std::atomic<int> num_done(0);
+      AsyncEncoder encoder(sp, max_delay_us, max_batch_size);
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+          for (size_t i = t; i < texts.size(); i += 4) {
+            encoder.Encode(texts[i],
+                           [&, i](util::Status status, std::vector<int> out) {
+                             EXPECT_TRUE(status.ok());
+                             ids[i] = std::move(out);
+                             ++num_done;
+                           });
+          }
+        });
+      }
+      for (auto &thread : threads) thread.join();
+      encoder.Flush();
+      EXPECT_EQ(texts.size(), num_done.load());
+      for (size_t i = 0; i < texts.size(); ++i) {
+        EXPECT_EQ(sp.EncodeAsIds(texts[i]), ids[i]);
+      }
+      EXPECT_EQ(sp.EncodeAsIds(texts[0]),
+                encoder.Encode(texts[0]).get().second);
+    }
+  }
 
-  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t1\n"), 1).ok());
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  // The destructor encodes the pending requests without waiting for the
+  // delay.
+  {
+    std::atomic<int> num_done(0);
+    const auto start = std::chrono::steady_clock::now();
+    {
+      AsyncEncoder encoder(sp, /*max_delay_us=*/60 * 1000 * 1000);
+      for (int i = 0; i < 10; ++i) {
+        encoder.Encode(texts[i], [&](util::Status status, std::vector<int>) {
+          EXPECT_TRUE(status.ok());
+          ++num_done;
+        });
+      }
+    }
+    EXPECT_EQ(10, num_done.load());
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(30));
+  }
 
-  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t0\ndd\t0\n"), 0).ok());
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
+  // Batches are only dispatched when full until Flush().
+  {
+    AsyncEncoder encoder(sp, /*max_delay_us=*/60 * 1000 * 1000,
+                         /*max_batch_size=*/8);
+    for (int i = 0; i < 19; ++i) {
+      encoder.Encode(texts[i], [](util::Status, std::vector<int>) {});
+    }
+    encoder.Flush();
+    const auto stats = encoder.GetStats();
+    EXPECT_EQ(19, stats.num_requests);
+    EXPECT_EQ(3, stats.num_batches);
+    EXPECT_EQ(2, stats.num_full_batches);
+    ASSERT_EQ(9, stats.batch_sizes.size());
+    EXPECT_EQ(2, stats.batch_sizes[8]);
+    EXPECT_EQ(1, stats.batch_sizes[3]);
+    EXPECT_NEAR(19.0 / 24, stats.fill_rate(), 1e-6);
+  }
 
-  // No frequency.
-  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\ndd\n"), 1).ok());
-  EXPECT_FALSE(sp.IsUnused(3));
-  EXPECT_TRUE(sp.IsUnused(4));
-  EXPECT_TRUE(sp.IsUnused(5));
-  EXPECT_FALSE(sp.IsUnused(6));
-  EXPECT_FALSE(sp.IsUnused(7));
-}
+  // A batch called from a callback, which runs on a worker of the pool,
+  // is run by that worker too, so that it does not wait for the others.
+  {
+    ASSERT_TRUE(sp.SetNumThreads(2).ok());
+    const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+    std::atomic<int> num_done(0);
+    {
+      AsyncEncoder encoder(sp, /*max_delay_us=*/0, /*max_batch_size=*/1);
+      for (int i = 0; i < 8; ++i) {
+        encoder.Encode(texts[i], [&](util::Status status, std::vector<int>) {
+          std::vector<std::vector<int>> batch;
+          EXPECT_TRUE(sp.EncodeBatch(inputs, &batch).ok());
+          EXPECT_EQ(texts.size(), batch.size());
+          ++num_done;
+        });
+      }
+    }
+    EXPECT_EQ(8, num_done.load());
+    ASSERT_TRUE(sp.SetNumThreads(4).ok());
+  }
 
-TEST(SentencePieceProcessorTest, ImmutableSentencePieceTextTest) {
-  ImmutableSentencePieceText spt;
-  EXPECT_TRUE(spt.text().empty());
-  EXPECT_EQ(spt.score(), 0.0);
-  EXPECT_TRUE(spt.SerializeAsString().empty());
+  // Concurrent blocking calls are coalesced. The adaptive delay does not
+  // hold a lone request for the maximum delay.
+  {
+    AsyncEncoder encoder(sp, /*max_delay_us=*/60 * 1000 * 1000,
+                         /*max_batch_size=*/16, /*adaptive_delay=*/true);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&, t]() {
+        for (size_t i = t; i < texts.size(); i += 4) {
+          std::vector<int> ids;
+          EXPECT_TRUE(encoder.Encode(texts[i], &ids).ok());
+          EXPECT_EQ(sp.EncodeAsIds(texts[i]), ids);
+        }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::vector<int> ids;
+    EXPECT_TRUE(encoder.Encode(texts[0], &ids).ok());
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(30));
+    EXPECT_EQ(texts.size() + 1, encoder.GetStats().num_requests);
+    EXPECT_FALSE(encoder.Encode(texts[0], nullptr).ok());
+  }
+}
 
-  auto *v = spt.mutable_proto();
+TEST(SentencePieceProcessorTest, ProcessorHandleTest) {
+  // The two models encode "ab" differently.
+  std::vector<ModelProto> model_protos(2);
+  for (int i = 0; i < 2; ++i) {
+    auto *unk = model_protos[i].add_pieces();
+    unk->set_type(ModelProto::SentencePiece::UNKNOWN);
+    unk->set_piece("<unk>");
+    AddPiece(&model_protos[i], "a", 0.0);
+    AddPiece(&model_protos[i], "b", 0.3);
+    AddPiece(&model_protos[i], "ab", i == 0 ? 1.0 : -10.0);
+    AddPiece(&model_protos[i], WS, 3.0);
+    *(model_protos[i].mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  }
+  const std::vector<std::vector<std::string>> expected = {
+      {WS, "ab"}, {WS, "a", "b"}};
 
-  v->set_text("hello world");
-  v->set_score(1.0);
-  for (int i = 0; i < 10; ++i) {
-    auto *p = v->add_pieces();
-    p->set_surface(absl::StrCat("surface_", i));
-    p->set_piece(absl::StrCat("surface_", i));
-    p->set_id(i);
-    p->set_begin(i + 10);
-    p->set_end(i + 20);
+  ProcessorHandle handle;
+  EXPECT_EQ(0, handle.generation());
+  {
+    std::vector<std::string> pieces;
+    EXPECT_FALSE(handle.Acquire()->Encode("ab", &pieces).ok());
   }
 
-  EXPECT_EQ(v->pieces_size(), spt.pieces_size());
-  for (int i = 0; i < spt.pieces_size(); ++i) {
-    EXPECT_EQ(v->pieces(i).surface(), spt.pieces(i).surface());
-    EXPECT_EQ(v->pieces(i).piece(), spt.pieces(i).piece());
-    EXPECT_EQ(v->pieces(i).id(), spt.pieces(i).id());
-    EXPECT_EQ(v->pieces(i).begin(), spt.pieces(i).begin());
-    EXPECT_EQ(v->pieces(i).end(), spt.pieces(i).end());
+  EXPECT_TRUE(handle.LoadFromSerializedProto(model_protos[0].SerializeAsString())
+                  .ok());
+  EXPECT_EQ(1, handle.generation());
+  EXPECT_EQ(expected[0], handle.Acquire()->EncodeAsPieces("ab"));
+
+  // A failed load keeps the current model.
+  EXPECT_FALSE(handle.Load("__UNKNOWN_FILE__").ok());
+  EXPECT_EQ(1, handle.generation());
+  EXPECT_EQ(expected[0], handle.Acquire()->EncodeAsPieces("ab"));
+
+  // Readers see one of the models, and the models of their snapshots do not
+  // change under them, while the models are swapped.
+  std::atomic<bool> stop(false);
+  std::atomic<int> num_errors(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&]() {
+      while (!stop.load()) {
+        const auto sp = handle.Acquire();
+        const int index = (sp.generation() - 1) % 2;
+        for (int n = 0; n < 10; ++n) {
+          if (sp->EncodeAsPieces("ab") != expected[index]) ++num_errors;
+        }
+      }
+    });
   }
+  for (int i = 1; i <= 50; ++i) {
+    auto sp = std::make_unique<SentencePieceProcessor>();
+    ASSERT_TRUE(sp->Load(model_protos[i % 2]).ok());
+    handle.Publish(std::move(sp));
+    EXPECT_EQ(i + 1, handle.generation());
+  }
+  stop = true;
+  for (auto &thread : threads) thread.join();
+  EXPECT_EQ(0, num_errors.load());
+
+  // A snapshot keeps its model after a publication.
+  auto snapshot = handle.Acquire();
+  EXPECT_EQ(51, snapshot.generation());
+  std::thread publisher([&]() {
+    auto sp = std::make_unique<SentencePieceProcessor>();
+    ASSERT_TRUE(sp->Load(model_protos[1]).ok());
+    handle.Publish(std::move(sp));
+  });
+  while (handle.generation() != 52) std::this_thread::yield();
+  EXPECT_EQ(expected[0], snapshot->EncodeAsPieces("ab"));
+  EXPECT_EQ(expected[1], handle.Acquire()->EncodeAsPieces("ab"));
+  snapshot = handle.Acquire();
+  publisher.join();
+  EXPECT_EQ(52, snapshot.generation());
+}
 
-  auto check_proto = [&v](const ImmutableSentencePieceText &s) {
-    int n = 0;
-    for (auto &p : s.pieces()) {
-      EXPECT_EQ(v->pieces(n).surface(), p.surface());
-      EXPECT_EQ(v->pieces(n).piece(), p.piece());
-      EXPECT_EQ(v->pieces(n).id(), p.id());
-      EXPECT_EQ(v->pieces(n).begin(), p.begin());
-      EXPECT_EQ(v->pieces(n).end(), p.end());
-      ++n;
+TEST(SentencePieceProcessorTest, EncodeIdsTest) {
+  for (const bool byte_fallback : {false, true}) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    auto *sp2 = model_proto.add_pieces();
+    auto *sp3 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    sp2->set_type(ModelProto::SentencePiece::CONTROL);
+    sp2->set_piece("<s>");
+    sp3->set_type(ModelProto::SentencePiece::CONTROL);
+    sp3->set_piece("</s>");
+
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "ab", 1.0);
+    AddPiece(&model_proto, WS, 3.0);
+    if (byte_fallback) {
+      model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+      for (int i = 0; i < 256; ++i) {
+        auto *sp = model_proto.add_pieces();
+        sp->set_piece(ByteToPiece(i));
+        sp->set_type(ModelProto::SentencePiece::BYTE);
+      }
     }
-    EXPECT_EQ(v->text(), s.text());
-    EXPECT_EQ(v->score(), s.score());
-    EXPECT_EQ(v->SerializeAsString(), s.SerializeAsString());
-  };
-
-  // test copy.
-  const auto spt2 = spt;
-  check_proto(spt2);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+
+    for (const auto *extra_options :
+         {"", "bos:eos", "reverse", "bos:eos:reverse", "unk:bos", "eos"}) {
+      EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+      for (const auto *text : {"", " ", "ab", "a b ab", "xyz ab",
+                               "ab \xE3\x81\x82\xE3\x81\x84 b"}) {
+        SentencePieceText spt;
+        EXPECT_TRUE(sp.Encode(text, &spt).ok());
+        std::vector<int> expected;
+        for (const auto &piece : spt.pieces()) expected.push_back(piece.id());
+        std::vector<int> ids;
+        EXPECT_TRUE(sp.Encode(text, &ids).ok());
+        EXPECT_EQ(expected, ids);
+      }
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, FlatSentencePieceTextTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  FlatSentencePieceText flat;
+  EXPECT_TRUE(sp.Encode("ab xyz \xE3\x81\x82", &flat).ok());
+  EXPECT_EQ("ab xyz \xE3\x81\x82", flat.text());
+  ASSERT_EQ(6, flat.size());
+  const std::vector<std::string> pieces = {WS, "ab", WS, "xyz", WS,
+                                           "\xE3\x81\x82"};
+  const std::vector<std::string> surfaces = {"", "ab", " ", "xyz", " ",
+                                             "\xE3\x81\x82"};
+  for (int i = 0; i < flat.size(); ++i) {
+    EXPECT_EQ(pieces[i], flat.piece(i));
+    EXPECT_EQ(surfaces[i], flat.surface(i));
+  }
+  EXPECT_EQ(0, flat.id(3));
+  EXPECT_EQ(3, flat.begin(3));
+  EXPECT_EQ(6, flat.end(3));
+  EXPECT_EQ(flat.size(), flat.ToImmutableProto().pieces_size());
+
+  // The proto API gives the same pieces with all the extra options.
+  for (const auto *extra_options :
+       {"", "bos:eos", "reverse", "bos:eos:reverse", "unk:bos", "eos"}) {
+    EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+    for (const auto *text : {"", " ", "ab", "a b ab", "xyz ab",
+                             "ab \xE3\x81\x82\xE3\x81\x84 b"}) {
+      SentencePieceText spt;
+      EXPECT_TRUE(sp.Encode(text, &spt).ok());
+      EXPECT_TRUE(sp.Encode(text, &flat).ok());
+      ASSERT_EQ(spt.pieces_size(), flat.size());
+      for (int i = 0; i < spt.pieces_size(); ++i) {
+        EXPECT_EQ(spt.pieces(i).id(), flat.id(i));
+        EXPECT_EQ(spt.pieces(i).piece(), flat.piece(i));
+        EXPECT_EQ(spt.pieces(i).surface(), flat.surface(i));
+        EXPECT_EQ(spt.pieces(i).begin(), flat.begin(i));
+        EXPECT_EQ(spt.pieces(i).end(), flat.end(i));
+      }
+      EXPECT_EQ(spt.SerializeAsString(),
+                flat.ToImmutableProto().SerializeAsString());
+    }
+  }
+}
+
+template <typename Options>
+void RunEncoderPipelineTest(const SentencePieceProcessor &sp) {
+  const EncoderPipeline<unigram::Model, normalizer::Normalizer, Options>
+      pipeline(sp);
+  ASSERT_TRUE(pipeline.status().ok());
+  EncodeOptions options;
+  options.add_bos = Options::kAddBos;
+  options.add_eos = Options::kAddEos;
+  options.reverse = Options::kReverse;
+  EncodeContext context;
+  for (const auto *text : {"", " ", "ab", "a b ab", "xyz ab",
+                           "ab \xE3\x81\x82\xE3\x81\x84 b"}) {
+    std::vector<int> expected, ids = {1, 2};
+    EXPECT_TRUE(sp.Encode(text, options, &expected, &context).ok());
+    EXPECT_TRUE(pipeline.Encode(text, &ids, &context).ok());
+    EXPECT_EQ(expected, ids);
+  }
+}
+
+TEST(SentencePieceProcessorTest, EncoderPipelineTest) {
+  for (const bool byte_fallback : {false, true}) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    auto *sp2 = model_proto.add_pieces();
+    auto *sp3 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    sp2->set_type(ModelProto::SentencePiece::CONTROL);
+    sp2->set_piece("<s>");
+    sp3->set_type(ModelProto::SentencePiece::CONTROL);
+    sp3->set_piece("</s>");
+
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "ab", 1.0);
+    AddPiece(&model_proto, WS, 3.0);
+    if (byte_fallback) {
+      model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+      for (int i = 0; i < 256; ++i) {
+        auto *sp = model_proto.add_pieces();
+        sp->set_piece(ByteToPiece(i));
+        sp->set_type(ModelProto::SentencePiece::BYTE);
+      }
+    }
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+
+    RunEncoderPipelineTest<PipelineOptions<>>(sp);
+    RunEncoderPipelineTest<PipelineOptions<true, false, false>>(sp);
+    RunEncoderPipelineTest<PipelineOptions<false, true, true>>(sp);
+    RunEncoderPipelineTest<PipelineOptions<true, true, true>>(sp);
+
+    // The model type must match, and the extra options are not applied.
+    EXPECT_FALSE(EncoderPipeline<bpe::Model>(sp).status().ok());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("bos").ok());
+    const EncoderPipeline<unigram::Model> pipeline(sp);
+    EXPECT_FALSE(pipeline.status().ok());
+    std::vector<int> ids;
+    EncodeContext context;
+    EXPECT_FALSE(pipeline.Encode("ab", &ids, &context).ok());
+  }
+
+  // An unloaded processor.
+  SentencePieceProcessor sp;
+  EXPECT_FALSE(EncoderPipeline<unigram::Model>(sp).status().ok());
+}
+
+TEST(SentencePieceProcessorTest, EncodeContextTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  EncodeContext context;
+  std::vector<int> ids;
+  std::string detok;
+  for (const auto *extra_options : {"", "bos:eos:reverse"}) {
+    EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+    for (const auto *text :
+         {"ab c", "", "abc", "xyz abc", "ab\xE3\x81\x82 cb"}) {
+      std::vector<int> expected_ids;
+      EXPECT_TRUE(sp.Encode(text, &expected_ids).ok());
+      EXPECT_TRUE(sp.Encode(text, &ids, &context).ok());
+      EXPECT_EQ(expected_ids, ids);
+
+      SentencePieceText expected_spt, spt;
+      EXPECT_TRUE(sp.Encode(text, &expected_spt).ok());
+      EXPECT_TRUE(sp.Encode(text, &spt, &context).ok());
+      EXPECT_EQ(expected_spt.SerializeAsString(), spt.SerializeAsString());
+
+      std::string expected_detok;
+      EXPECT_TRUE(sp.Decode(expected_ids, &expected_detok).ok());
+      EXPECT_TRUE(sp.Decode(ids, &detok, &context).ok());
+      EXPECT_EQ(expected_detok, detok);
+    }
+  }
+
+  EXPECT_FALSE(sp.Encode("abc", &ids, nullptr).ok());
+  EXPECT_FALSE(sp.Decode(std::vector<int>{-1}, &detok, &context).ok());
+}
+
+TEST(SentencePieceProcessorTest, WordCacheTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS "ab", 1.5);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp, cached;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(cached.Load(model_proto).ok());
+  EXPECT_TRUE(cached.SetEncodeExtraOptions("word_cache=100:reverse").ok());
+
+  for (const auto *text : {"ab c ab", "abc xyz abc", "", "ab ab ab ab"}) {
+    SentencePieceText expected, actual;
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("reverse").ok());
+    EXPECT_TRUE(sp.Encode(text, &expected).ok());
+    EXPECT_TRUE(cached.Encode(text, &actual).ok());
+    EXPECT_EQ(expected.SerializeAsString(), actual.SerializeAsString());
+  }
+
+  int64_t hits = 0, misses = 0;
+  EXPECT_TRUE(cached.GetWordCacheStats(&hits, &misses).ok());
+  EXPECT_EQ(6, hits);
+  EXPECT_EQ(4, misses);
+
+  // Vocabulary restriction invalidates the cached words.
+  EXPECT_TRUE(cached.SetVocabulary({"a", "b", WS}).ok());
+  EXPECT_TRUE(sp.SetVocabulary({"a", "b", WS}).ok());
+  std::vector<int> expected_ids, ids;
+  EXPECT_TRUE(sp.Encode("ab ab", &expected_ids).ok());
+  EXPECT_TRUE(cached.Encode("ab ab", &ids).ok());
+  EXPECT_EQ(expected_ids, ids);
+
+  // Resetting the options disables the cache.
+  EXPECT_TRUE(cached.SetEncodeExtraOptions("").ok());
+  EXPECT_TRUE(cached.GetWordCacheStats(&hits, &misses).ok());
+  EXPECT_EQ(0, hits);
+  EXPECT_EQ(0, misses);
+
+  EXPECT_FALSE(cached.SetEncodeExtraOptions("word_cache=abc").ok());
+}
+
+TEST(SentencePieceProcessorTest, SharedWordCacheTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS "ab", 1.5);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  // `warm` fills the cache which `cached` attaches to, as two processes.
+  SentencePieceProcessor sp, warm, cached;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(warm.Load(model_proto).ok());
+  ASSERT_TRUE(cached.Load(model_proto).ok());
+  EXPECT_TRUE(warm.SetEncodeExtraOptions("shared_word_cache=1024").ok());
+  EXPECT_TRUE(
+      cached.SetEncodeExtraOptions("shared_word_cache=1024:word_cache=10")
+          .ok());
+
+  for (const auto *text : {"ab c ab", "abc xyz abc", "", "ab ab ab ab"}) {
+    SentencePieceText expected, actual;
+    EXPECT_TRUE(sp.Encode(text, &expected).ok());
+    EXPECT_TRUE(warm.Encode(text, &actual).ok());
+    EXPECT_EQ(expected.SerializeAsString(), actual.SerializeAsString());
+    EXPECT_TRUE(cached.Encode(text, &actual).ok());
+    EXPECT_EQ(expected.SerializeAsString(), actual.SerializeAsString());
+  }
+
+  // The vocabulary restriction attaches to the cache of the new pieces.
+  const uint64 fingerprint =
+      SharedWordCache::Fingerprint(model_proto.SerializeAsString());
+  EXPECT_TRUE(cached.SetVocabulary({"a", "b", WS}).ok());
+  EXPECT_TRUE(sp.SetVocabulary({"a", "b", WS}).ok());
+  const uint64 restricted_fingerprint =
+      SharedWordCache::Fingerprint(cached.model_proto().SerializeAsString());
+  EXPECT_NE(fingerprint, restricted_fingerprint);
+  std::vector<int> expected_ids, ids;
+  EXPECT_TRUE(sp.Encode("ab ab", &expected_ids).ok());
+  EXPECT_TRUE(cached.Encode("ab ab", &ids).ok());
+  EXPECT_EQ(expected_ids, ids);
+  EXPECT_TRUE(warm.Encode("ab ab", &ids).ok());
+  EXPECT_NE(expected_ids, ids);
+
+  EXPECT_TRUE(cached.SetEncodeExtraOptions("").ok());
+  EXPECT_FALSE(cached.SetEncodeExtraOptions("shared_word_cache=abc").ok());
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 1024).ok());
+  EXPECT_TRUE(SharedWordCache::Remove(restricted_fingerprint, 1024).ok());
+}
+
+TEST(SentencePieceProcessorTest, VocabularyRestrictionTest) {
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "c", 0.2);
+    AddPiece(&model_proto, "ab", 1.0);
+    AddPiece(&model_proto, "bc", 0.8);
+    AddPiece(&model_proto, "abc", 2.0);
+    AddPiece(&model_proto, WS "ab", 1.5);
+    AddPiece(&model_proto, WS, 3.0);
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    // The restricted calls bypass the word cache.
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("word_cache=100").ok());
+
+    const std::vector<std::vector<absl::string_view>> vocabs = {
+        {"a", "b", WS}, {"ab"}, {WS "ab", "bc"}, {"abc", WS}};
+    std::vector<int> indices;
+    for (const auto &vocab : vocabs) {
+      int index = -1;
+      EXPECT_TRUE(sp.AddVocabularyRestriction(vocab, &index).ok());
+      indices.push_back(index);
+    }
+
+    EncodeContext context;
+    EncodeOptions options;
+    for (size_t i = 0; i < vocabs.size(); ++i) {
+      SentencePieceProcessor expected;
+      ASSERT_TRUE(expected.Load(model_proto).ok());
+      EXPECT_TRUE(expected.SetVocabulary(vocabs[i]).ok());
+      options.vocabulary = indices[i];
+      for (const auto *text : {"abc ab bc", "abcabc cab", "", "xyz abd"}) {
+        std::vector<int> expected_ids, ids;
+        EXPECT_TRUE(expected.Encode(text, &expected_ids).ok());
+        EXPECT_TRUE(sp.Encode(text, options, &ids, &context).ok());
+        EXPECT_EQ(expected_ids, ids);
+
+        std::vector<std::string> expected_pieces, pieces;
+        EXPECT_TRUE(expected.Encode(text, &expected_pieces).ok());
+        EXPECT_TRUE(sp.Encode(text, options, &pieces, &context).ok());
+        EXPECT_EQ(expected_pieces, pieces);
+      }
+    }
+
+    // The whole vocabulary by default.
+    std::vector<int> expected_ids, ids;
+    EXPECT_TRUE(sp.Encode("abc ab bc", &expected_ids).ok());
+    EXPECT_TRUE(sp.Encode("abc ab bc", EncodeOptions(), &ids, &context).ok());
+    EXPECT_EQ(expected_ids, ids);
+
+    options.vocabulary = vocabs.size();
+    EXPECT_FALSE(sp.Encode("abc", options, &ids, &context).ok());
+
+    // Loading a model drops the restrictions.
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    options.vocabulary = 0;
+    EXPECT_FALSE(sp.Encode("abc", options, &ids, &context).ok());
+  }
+
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::CHAR);
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  int index = -1;
+  EXPECT_FALSE(sp.AddVocabularyRestriction({"a"}, &index).ok());
+}
+
+TEST(SentencePieceProcessorTest, LoadSharedTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor shared;
+  EXPECT_FALSE(shared.LoadShared(SentencePieceProcessor()).ok());
+
+  std::vector<int> expected_ids, ids;
+  {
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("reverse").ok());
+    ASSERT_TRUE(shared.LoadShared(sp).ok());
+    EXPECT_EQ(&sp.model_proto(), &shared.model_proto());
+
+    // The options are per processor.
+    EXPECT_TRUE(sp.Encode("ab b", &expected_ids).ok());
+    EXPECT_TRUE(shared.Encode("ab b", &ids).ok());
+    EXPECT_EQ(std::vector<int>(expected_ids.rbegin(), expected_ids.rend()),
+              ids);
+
+    // The model cannot be changed while it is shared.
+    EXPECT_FALSE(sp.SetVocabulary({"a", "b"}).ok());
+    EXPECT_FALSE(shared.SetVocabulary({"a", "b"}).ok());
+    EXPECT_FALSE(shared.ResetVocabulary().ok());
+    EXPECT_FALSE(shared.SetEncodeExtraOptions("word_cache=10").ok());
+    EXPECT_TRUE(shared.SetEncodeExtraOptions("reverse").ok());
+    int index = -1;
+    EXPECT_TRUE(shared.AddVocabularyRestriction({"a", "b"}, &index).ok());
+  }
+
+  // The model outlives the processor which loaded it.
+  EXPECT_TRUE(shared.SetEncodeExtraOptions("").ok());
+  EXPECT_TRUE(shared.Encode("ab b", &ids).ok());
+  EXPECT_EQ(std::vector<int>(expected_ids.rbegin(), expected_ids.rend()),
+            ids);
+  EXPECT_TRUE(shared.SetVocabulary({"a", "b"}).ok());
+}
+
+TEST(SentencePieceProcessorTest, ShareIdenticalModelsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  const std::string serialized = model_proto.SerializeAsString();
+  AddPiece(&model_proto, "ba", 2.0);
+  const std::string other_serialized = model_proto.SerializeAsString();
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "share_identical_models_model");
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(serialized);
+  }
+
+  const size_t num_shared_models =
+      SentencePieceProcessor::GetNumSharedModels();
+  std::vector<int> expected_ids, ids;
+  {
+    // Without the option, the models are loaded separately.
+    SentencePieceProcessor sp, separate;
+    ASSERT_TRUE(sp.LoadFromSerializedProto(serialized).ok());
+    ASSERT_TRUE(separate.LoadFromSerializedProto(serialized).ok());
+    EXPECT_NE(&sp.model_proto(), &separate.model_proto());
+    EXPECT_EQ(num_shared_models, SentencePieceProcessor::GetNumSharedModels());
+    EXPECT_TRUE(sp.Encode("ab b", &expected_ids).ok());
+  }
+
+  {
+    SentencePieceProcessor sp1, sp2, sp3, other, slim;
+    for (auto *sp : {&sp1, &sp2, &sp3, &other, &slim}) {
+      sp->SetShareIdenticalModels(true);
+    }
+    ASSERT_TRUE(sp1.LoadFromSerializedProto(serialized).ok());
+    ASSERT_TRUE(sp2.LoadFromSerializedProto(serialized).ok());
+    EXPECT_EQ(&sp1.model_proto(), &sp2.model_proto());
+    EXPECT_EQ(num_shared_models + 1,
+              SentencePieceProcessor::GetNumSharedModels());
+
+    // The options are per processor.
+    EXPECT_TRUE(sp2.SetEncodeExtraOptions("reverse").ok());
+    EXPECT_TRUE(sp1.Encode("ab b", &ids).ok());
+    EXPECT_EQ(expected_ids, ids);
+    EXPECT_TRUE(sp2.Encode("ab b", &ids).ok());
+    EXPECT_EQ(std::vector<int>(expected_ids.rbegin(), expected_ids.rend()),
+              ids);
+
+    // The model cannot be changed while it is shared.
+    EXPECT_FALSE(sp1.SetVocabulary({"a", "b"}).ok());
+
+    // The file holds the same bytes.
+    ASSERT_TRUE(sp3.Load(filename).ok());
+    EXPECT_EQ(&sp1.model_proto(), &sp3.model_proto());
+    EXPECT_EQ(filename, sp3.model_file());
+    EXPECT_TRUE(sp1.model_file().empty());
+
+    // Other bytes or other load options give other models.
+    ASSERT_TRUE(other.LoadFromSerializedProto(other_serialized).ok());
+    EXPECT_NE(&sp1.model_proto(), &other.model_proto());
+    slim.SetSlimLoad(true);
+    ASSERT_TRUE(slim.LoadFromSerializedProto(serialized).ok());
+    EXPECT_NE(&sp1.model_proto(), &slim.model_proto());
+    EXPECT_EQ(num_shared_models + 3,
+              SentencePieceProcessor::GetNumSharedModels());
+
+    // The entry lives as long as a processor uses the model.
+    ASSERT_TRUE(sp1.Load(model_proto).ok());
+    ASSERT_TRUE(sp2.Load(model_proto).ok());
+    EXPECT_EQ(num_shared_models + 3,
+              SentencePieceProcessor::GetNumSharedModels());
+    ASSERT_TRUE(sp2.LoadShared(sp3).ok());
+    ASSERT_TRUE(sp3.Load(model_proto).ok());
+    EXPECT_EQ(num_shared_models + 3,
+              SentencePieceProcessor::GetNumSharedModels());
+    ASSERT_TRUE(sp1.LoadFromSerializedProto(serialized).ok());
+    EXPECT_EQ(&sp1.model_proto(), &sp2.model_proto());
+    ASSERT_TRUE(sp2.Load(model_proto).ok());
+    EXPECT_TRUE(sp1.Encode("ab b", &ids).ok());
+    EXPECT_EQ(expected_ids, ids);
+  }
+
+  // The models are released with their processors.
+  EXPECT_EQ(num_shared_models, SentencePieceProcessor::GetNumSharedModels());
+}
+
+TEST(SentencePieceProcessorTest, QuantizeScoresTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", -2.0);
+  AddPiece(&model_proto, "b", -2.5);
+  AddPiece(&model_proto, "ab", -3.0);
+  AddPiece(&model_proto, "abc", -4.25);
+  AddPiece(&model_proto, WS, -1.0);
+  AddPiece(&model_proto, WS "ab", -3.5);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp, quantized;
+  EXPECT_FALSE(quantized.QuantizeScores({"ab"}, 1e-3).ok());
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(quantized.Load(model_proto).ok());
+
+  // The calibration texts are normalized as by Encode().
+  const std::vector<absl::string_view> texts = {"ab abc", "  abcab  b",
+                                                "c ba", "ＡＢ ab"};
+  float deviation = -1.0;
+  ASSERT_TRUE(quantized.QuantizeScores(texts, 1e-3, &deviation).ok());
+  EXPECT_LE(0.0, deviation);
+  EXPECT_GE(1e-3, deviation);
+  for (const auto text : texts) {
+    EXPECT_EQ(sp.EncodeAsIds(text), quantized.EncodeAsIds(text));
+  }
+
+  // The model is changed, so it cannot be shared.
+  SentencePieceProcessor shared;
+  ASSERT_TRUE(shared.LoadShared(sp).ok());
+  EXPECT_FALSE(sp.QuantizeScores(texts, 1e-3).ok());
+
+  // Only the unigram model has fixed-point scores.
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::BPE);
+  SentencePieceProcessor bpe;
+  ASSERT_TRUE(bpe.Load(model_proto).ok());
+  EXPECT_EQ(util::StatusCode::kUnimplemented,
+            bpe.QuantizeScores(texts, 1e-3).code());
+}
+
+TEST(SentencePieceProcessorTest, SampleEncodeManyTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, WS "a", 0.5);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  // The samples are drawn as by calls of SampleEncode().
+  constexpr int kNumSamples = 20;
+  SetThreadRandomGeneratorSeed(1);
+  const auto pieces = sp.SampleEncodeManyAsPieces("ab ab", kNumSamples, 0.5);
+  SetThreadRandomGeneratorSeed(1);
+  std::vector<std::vector<std::string>> expected_pieces;
+  for (int i = 0; i < kNumSamples; ++i) {
+    expected_pieces.push_back(sp.SampleEncodeAsPieces("ab ab", -1, 0.5));
+  }
+  EXPECT_EQ(expected_pieces, pieces);
+  std::set<std::vector<std::string>> distinct(pieces.begin(), pieces.end());
+  EXPECT_LT(1, distinct.size());
+
+  SetThreadRandomGeneratorSeed(1);
+  const auto ids = sp.SampleEncodeManyAsIds("ab ab", kNumSamples, 0.5);
+  ASSERT_EQ(kNumSamples, ids.size());
+  for (int i = 0; i < kNumSamples; ++i) {
+    std::vector<int> expected_ids;
+    for (const auto &piece : pieces[i]) {
+      expected_ids.push_back(sp.PieceToId(piece));
+    }
+    EXPECT_EQ(expected_ids, ids[i]);
+  }
+
+  std::vector<std::vector<std::vector<int>>> batch;
+  EXPECT_TRUE(sp.SampleEncodeManyBatch({"ab", "", "b a"}, 3, 0.5, &batch).ok());
+  ASSERT_EQ(3, batch.size());
+  for (const auto &samples : batch) EXPECT_EQ(3, samples.size());
+  EXPECT_EQ(std::vector<std::vector<int>>(3), batch[1]);
+  for (const auto &sample : batch[2]) {
+    EXPECT_EQ("b a", sp.DecodeIds(sample));
+  }
+
+  EXPECT_TRUE(sp.SampleEncodeManyAsIds("ab", 0, 0.5).empty());
+  std::vector<std::vector<int>> output;
+  EXPECT_FALSE(sp.SampleEncodeMany("ab", -1, 0.5, &output).ok());
+}
+
+TEST(SentencePieceProcessorTest, MaxSegmentLengthTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, "\xE3\x81\x82", 0.1);  // あ
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  std::string blob;
+  for (int i = 0; i < 100; ++i) blob += "ab";
+  std::string kana;
+  for (int i = 0; i < 10; ++i) kana += "\xE3\x81\x82";
+  const auto expected_short = sp.NBestEncodeAsPieces("ab ab", 3);
+  const auto unsegmented = sp.NBestEncodeAsPieces(blob, 3);
+
+  ASSERT_TRUE(sp.SetMaxSegmentLength(16).ok());
+  EXPECT_EQ(expected_short, sp.NBestEncodeAsPieces("ab ab", 3));
+  EXPECT_EQ(0, sp.GetNumSegmentedInputs());
+
+  const auto nbests = sp.NBestEncodeAsPieces(blob, 3);
+  EXPECT_EQ(1, sp.GetNumSegmentedInputs());
+  ASSERT_EQ(3, nbests.size());
+  for (const auto &pieces : nbests) {
+    EXPECT_EQ(WS + blob, absl::StrJoin(pieces, ""));
+  }
+  // The segments of 16 bytes cut the pieces "ab" at odd offsets.
+  EXPECT_LT(unsegmented[0].size(), nbests[0].size());
+
+  // The segments end at character boundaries.
+  ASSERT_TRUE(sp.SetMaxSegmentLength(4).ok());
+  for (const auto &ids : sp.NBestEncodeAsIds(kana, 2)) {
+    EXPECT_EQ(kana, sp.DecodeIds(ids));
+  }
+  EXPECT_EQ(kana, sp.DecodeIds(sp.SampleEncodeAsIds(kana, -1, 0.5)));
+
+  ASSERT_TRUE(sp.SetMaxSegmentLength(16).ok());
+  for (const int nbest_size : {-1, 1, 4}) {
+    EXPECT_EQ(blob, sp.DecodeIds(sp.SampleEncodeAsIds(blob, nbest_size, 0.5)));
+  }
+  const auto scored = sp.SampleEncodeAndScoreAsIds(blob, 3, 0.5, true, true);
+  ASSERT_EQ(3, scored.size());
+  for (const auto &sample : scored) {
+    EXPECT_EQ(blob, sp.DecodeIds(sample.first));
+  }
+  const auto samples = sp.SampleEncodeManyAsIds(blob, 3, 0.5);
+  ASSERT_EQ(3, samples.size());
+  for (const auto &sample : samples) EXPECT_EQ(blob, sp.DecodeIds(sample));
+
+  ASSERT_TRUE(sp.SetMaxSegmentLength(16, /*strict=*/true).ok());
+  const uint64_t num_segmented = sp.GetNumSegmentedInputs();
+  std::vector<std::vector<int>> ids;
+  const auto status = sp.NBestEncode(blob, 3, &ids);
+  EXPECT_EQ(util::StatusCode::kResourceExhausted, status.code());
+  EXPECT_EQ(num_segmented, sp.GetNumSegmentedInputs());
+  EXPECT_TRUE(sp.NBestEncode("ab", 3, &ids).ok());
+}
+
+TEST(SentencePieceProcessorTest, CalculateEntropyBatchTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, WS "a", 0.5);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.SetNumThreads(4).ok());
+
+  std::vector<absl::string_view> inputs;
+  for (int i = 0; i < 50; ++i) inputs.push_back(i % 2 ? "ab ab" : "b a ba");
+  inputs.push_back("");
+
+  std::vector<float> entropies;
+  std::vector<std::vector<std::pair<int, float>>> sparse;
+  ASSERT_TRUE(sp.CalculateEntropyBatch(inputs, 0.5, &entropies, &sparse).ok());
+  ASSERT_EQ(inputs.size(), entropies.size());
+  ASSERT_EQ(inputs.size(), sparse.size());
+
+  std::vector<float> dense_entropies;
+  std::vector<std::vector<float>> dense;
+  ASSERT_TRUE(
+      sp.CalculateEntropyBatch(inputs, 0.5, &dense_entropies, &dense).ok());
+  EXPECT_EQ(entropies, dense_entropies);
+
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    float entropy = 0.0;
+    ASSERT_TRUE(sp.CalculateEntropy(inputs[i], 0.5, &entropy).ok());
+    EXPECT_NEAR(entropy, entropies[i], 1e-5);
+
+    ASSERT_EQ(sp.GetPieceSize(), dense[i].size());
+    std::vector<float> expected(sp.GetPieceSize(), 0.0);
+    for (size_t k = 0; k < sparse[i].size(); ++k) {
+      if (k > 0) EXPECT_LT(sparse[i][k - 1].first, sparse[i][k].first);
+      EXPECT_GT(sparse[i][k].second, 0.0);
+      expected[sparse[i][k].first] = sparse[i][k].second;
+    }
+    EXPECT_EQ(expected, dense[i]);
+  }
+
+  // "ab ab" is "▁ab▁ab", where "▁" occurs once or twice, and "b" twice.
+  const float ws_count = dense[1][sp.PieceToId(WS)];
+  EXPECT_LT(1.0, ws_count);
+  EXPECT_GT(2.0, ws_count);
+  EXPECT_NEAR(2.0, dense[1][sp.PieceToId("b")] + dense[1][sp.PieceToId("ab")],
+              1e-5);
+  EXPECT_EQ(0.0, entropies.back());
+  EXPECT_TRUE(sparse.back().empty());
+}
+
+TEST(SentencePieceProcessorTest, NBestEncodeBatchTest) {
+  ModelProto model_proto;
+  AddPiece(&model_proto, "<unk>", 0.0);
+  AddPiece(&model_proto, "<s>", 0.0);
+  AddPiece(&model_proto, "</s>", 0.0);
+  model_proto.mutable_pieces(0)->set_type(ModelProto::SentencePiece::UNKNOWN);
+  model_proto.mutable_pieces(1)->set_type(ModelProto::SentencePiece::CONTROL);
+  model_proto.mutable_pieces(2)->set_type(ModelProto::SentencePiece::CONTROL);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, WS "a", 0.5);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.SetNumThreads(4).ok());
+
+  std::vector<absl::string_view> inputs;
+  for (int i = 0; i < 60; ++i) {
+    inputs.push_back(i % 3 == 0 ? "ab ab" : i % 3 == 1 ? "b a ba" : "xy ab");
+  }
+
+  NBestBatch batch;
+  const auto candidate_ids = [&](size_t j) {
+    return std::vector<int>(batch.ids.begin() + batch.id_offsets[j],
+                            batch.ids.begin() + batch.id_offsets[j + 1]);
+  };
+
+  for (const auto *extra_options : {"", "bos:eos:reverse"}) {
+    ASSERT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+    std::vector<absl::string_view> nbest_inputs = inputs;
+    nbest_inputs.push_back("");
+    ASSERT_TRUE(sp.NBestEncodeBatch(nbest_inputs, 3, &batch).ok());
+    ASSERT_EQ(nbest_inputs.size() + 1, batch.candidate_offsets.size());
+    ASSERT_EQ(batch.scores.size() + 1, batch.id_offsets.size());
+    EXPECT_EQ(batch.ids.size(), batch.id_offsets.back());
+    for (size_t i = 0; i < nbest_inputs.size(); ++i) {
+      NBestSentencePieceText expected;
+      ASSERT_TRUE(sp.NBestEncode(nbest_inputs[i], 3, &expected).ok());
+      const size_t begin = batch.candidate_offsets[i];
+      ASSERT_EQ(expected.nbests_size(),
+                batch.candidate_offsets[i + 1] - begin);
+      for (int k = 0; k < expected.nbests_size(); ++k) {
+        std::vector<int> expected_ids;
+        for (const auto &piece : expected.nbests(k).pieces()) {
+          expected_ids.push_back(piece.id());
+        }
+        EXPECT_EQ(expected_ids, candidate_ids(begin + k));
+        EXPECT_EQ(expected.nbests(k).score(), batch.scores[begin + k]);
+      }
+    }
+  }
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("").ok());
+
+  // The best segmentation comes first with the score 0, followed by the
+  // samples.
+  ASSERT_TRUE(
+      sp.SampleEncodeAndScoreBatch(inputs, 2, 0.5, true, true, &batch).ok());
+  ASSERT_EQ(inputs.size() + 1, batch.candidate_offsets.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    std::vector<std::pair<std::vector<int>, float>> expected;
+    ASSERT_TRUE(
+        sp.SampleEncodeAndScore(inputs[i], 2, 0.5, true, true, &expected).ok());
+    const size_t begin = batch.candidate_offsets[i];
+    ASSERT_EQ(expected.size(), batch.candidate_offsets[i + 1] - begin);
+    EXPECT_EQ(sp.EncodeAsIds(inputs[i]), candidate_ids(begin));
+    EXPECT_EQ(0.0, batch.scores[begin]);
+    for (size_t j = begin; j < batch.candidate_offsets[i + 1]; ++j) {
+      EXPECT_EQ(sp.DecodeIds(candidate_ids(begin)),
+                sp.DecodeIds(candidate_ids(j)));
+    }
+  }
+
+  // The errors of the inputs are returned.
+  EXPECT_FALSE(
+      sp.SampleEncodeAndScoreBatch({"ab", ""}, 2, 0.5, true, true, &batch)
+          .ok());
+}
+
+TEST(SentencePieceProcessorTest, MetricsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ProcessorMetrics metrics;
+#ifndef SPM_ENABLE_METRICS
+  EXPECT_EQ(util::StatusCode::kUnimplemented, sp.GetMetrics(&metrics).code());
+  EXPECT_EQ(util::StatusCode::kUnimplemented, sp.ResetMetrics().code());
+#else
+  std::vector<int> ids;
+  std::vector<std::string> pieces;
+  EXPECT_TRUE(sp.Encode("ab xy", &ids).ok());     // ▁ ab ▁ xy
+  EXPECT_TRUE(sp.Encode("ab xy", &pieces).ok());  // The same pieces.
+  std::string text;
+  EXPECT_TRUE(sp.Decode(ids, &text).ok());
+
+  ASSERT_TRUE(sp.GetMetrics(&metrics).ok());
+  EXPECT_EQ(2, metrics.encode_calls);
+  EXPECT_EQ(10, metrics.input_bytes);
+  EXPECT_EQ(8, metrics.output_pieces);
+  EXPECT_EQ(2, metrics.unk_pieces);
+  EXPECT_EQ(0, metrics.byte_fallback_pieces);
+  EXPECT_EQ(1, metrics.decode_calls);
+  EXPECT_EQ(4, metrics.decode_pieces);
+  for (const auto *histogram : {&metrics.normalize, &metrics.model,
+                                &metrics.populate, &metrics.encode}) {
+    EXPECT_EQ(2, histogram->count);
+    uint64_t count = 0;
+    for (const uint64_t bucket : histogram->buckets) count += bucket;
+    EXPECT_EQ(2, count);
+  }
+  EXPECT_EQ(1, metrics.decode.count);
+  EXPECT_GE(metrics.encode.sum_ns, metrics.model.sum_ns);
+  EXPECT_GT(metrics.encode.Quantile(1.0), 0);
+  EXPECT_LE(metrics.encode.Quantile(0.5), metrics.encode.Quantile(1.0));
+
+  // With the byte fallback, the unknown characters become byte pieces.
+  for (int i = 0; i < 256; ++i) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(ByteToPiece(i));
+    sp->set_type(ModelProto::SentencePiece::BYTE);
+  }
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  SentencePieceProcessor byte_sp;
+  ASSERT_TRUE(byte_sp.Load(model_proto).ok());
+  EXPECT_TRUE(byte_sp.Encode("ab xy", &ids).ok());
+  EXPECT_TRUE(byte_sp.Encode("ab xy", &pieces).ok());
+  ASSERT_TRUE(byte_sp.GetMetrics(&metrics).ok());
+  EXPECT_EQ(2, metrics.encode_calls);
+  EXPECT_EQ(10, metrics.output_pieces);
+  EXPECT_EQ(0, metrics.unk_pieces);
+  EXPECT_EQ(4, metrics.byte_fallback_pieces);
+
+  EXPECT_TRUE(byte_sp.ResetMetrics().ok());
+  ASSERT_TRUE(byte_sp.GetMetrics(&metrics).ok());
+  EXPECT_EQ(0, metrics.encode_calls);
+  EXPECT_EQ(0, metrics.encode.count);
+  EXPECT_EQ(0, metrics.encode.Quantile(0.5));
+#endif
+}
+
+TEST(SentencePieceProcessorTest, GetMemoryUsageTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS "ab", 1.5);
+  AddPiece(&model_proto, WS, 3.0);
+  for (int i = 0; i < 100; ++i) {
+    AddPiece(&model_proto, absl::StrCat("a_long_piece_", i), -1.0);
+  }
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  MemoryUsage usage;
+  EXPECT_FALSE(sp.GetMemoryUsage(&usage).ok());
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.GetMemoryUsage(&usage).ok());
+  EXPECT_LT(100 * sizeof(ModelProto::SentencePiece), usage.model_proto);
+  EXPECT_LT(0, usage.piece_maps);
+  EXPECT_LT(0, usage.model_tables);
+  EXPECT_LE(model_proto.normalizer_spec().precompiled_charsmap().size(),
+            usage.normalizer);
+  EXPECT_EQ(0, usage.caches);
+  EXPECT_LT(0, usage.processor_tables);
+  EXPECT_EQ(0, usage.numa_replicas);
+  EXPECT_EQ(0, usage.mapped_file);
+  EXPECT_EQ(usage.model_proto + usage.piece_maps + usage.model_tables +
+                usage.normalizer + usage.processor_tables,
+            usage.total());
+
+  // The word cache grows with the encoded words.
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("word_cache=100").ok());
+  ASSERT_TRUE(sp.GetMemoryUsage(&usage).ok());
+  const size_t empty_cache = usage.caches;
+  EXPECT_FALSE(sp.EncodeAsIds("ab ba aab").empty());
+  ASSERT_TRUE(sp.GetMemoryUsage(&usage).ok());
+  EXPECT_LT(empty_cache, usage.caches);
+
+  ASSERT_TRUE(sp.SetNumThreads(3).ok());
+  std::vector<std::vector<int>> ids;
+  ASSERT_TRUE(sp.EncodeBatch({"ab", "ba"}, &ids).ok());
+  ASSERT_TRUE(sp.GetMemoryUsage(&usage).ok());
+  EXPECT_EQ(3, usage.pool_threads);
+
+  // The trie of a fast-model file is read in place.
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "memory_usage_model");
+  ASSERT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+  SentencePieceProcessor fast_sp;
+  ASSERT_TRUE(fast_sp.Load(filename).ok());
+  MemoryUsage fast_usage;
+  ASSERT_TRUE(fast_sp.GetMemoryUsage(&fast_usage).ok());
+  EXPECT_LT(0, fast_usage.mapped_file);
+  EXPECT_LT(fast_usage.model_tables, usage.model_tables);
+}
+
+TEST(SentencePieceProcessorTest, SlimLoadTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS "ab", 1.5);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  model_proto.mutable_normalizer_spec()->set_normalization_rule_tsv(
+      std::string(1000, 'x'));
+  auto *trainer_spec = model_proto.mutable_trainer_spec();
+  for (int i = 0; i < 100; ++i) {
+    trainer_spec->add_input(absl::StrCat("/path/to/corpus_", i));
+  }
+  trainer_spec->set_model_prefix("m");
+  trainer_spec->set_unk_surface("??");
+  auto *sample = model_proto.mutable_self_test_data()->add_samples();
+  sample->set_input("abab");
+  sample->set_expected(WS " ab ab");
+
+  SentencePieceProcessor full_sp, slim_sp;
+  slim_sp.SetSlimLoad(true);
+  ASSERT_TRUE(full_sp.Load(model_proto).ok());
+  ASSERT_TRUE(slim_sp.Load(model_proto).ok());
+
+  MemoryUsage full_usage, slim_usage;
+  ASSERT_TRUE(full_sp.GetMemoryUsage(&full_usage).ok());
+  ASSERT_TRUE(slim_sp.GetMemoryUsage(&slim_usage).ok());
+  EXPECT_LT(slim_usage.model_proto + 2000, full_usage.model_proto);
+
+  const auto &slim_proto = slim_sp.model_proto();
+  EXPECT_EQ(0, slim_proto.trainer_spec().input_size());
+  EXPECT_TRUE(slim_proto.trainer_spec().model_prefix().empty());
+  EXPECT_EQ(0, slim_proto.self_test_data().samples_size());
+  EXPECT_TRUE(slim_proto.normalizer_spec().normalization_rule_tsv().empty());
+  EXPECT_EQ(model_proto.normalizer_spec().precompiled_charsmap(),
+            slim_proto.normalizer_spec().precompiled_charsmap());
+  EXPECT_EQ(model_proto.pieces_size(), slim_proto.pieces_size());
+
+  // Encoding and decoding are unchanged.
+  for (const char *text : {"ab ba aab", "abc", "  a  b  "}) {
+    EXPECT_EQ(full_sp.EncodeAsIds(text), slim_sp.EncodeAsIds(text));
+    EXPECT_EQ(full_sp.EncodeAsPieces(text), slim_sp.EncodeAsPieces(text));
+    EXPECT_EQ(full_sp.DecodeIds(full_sp.EncodeAsIds(text)),
+              slim_sp.DecodeIds(slim_sp.EncodeAsIds(text)));
+  }
+  EXPECT_EQ("??", slim_sp.DecodeIds({0}));
+  EXPECT_EQ(full_sp.unk_id(), slim_sp.unk_id());
+  EXPECT_EQ(full_sp.bos_id(), slim_sp.bos_id());
+
+  // The reduced model is loaded as is.
+  SentencePieceProcessor reloaded_sp;
+  ASSERT_TRUE(
+      reloaded_sp.LoadFromSerializedProto(slim_sp.serialized_model_proto())
+          .ok());
+  EXPECT_EQ(full_sp.EncodeAsIds("ab ba aab"),
+            reloaded_sp.EncodeAsIds("ab ba aab"));
+}
+
+// Returns a model with control, whitespace-prefixed and byte pieces.
+ModelProto MakeDecodeTestModel() {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  auto *sp2 = model_proto.add_pieces();
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, absl::StrCat(WS, "a"), 1.0);
+  AddPiece(&model_proto, absl::StrCat(WS, WS, "b"), 1.0);
+  for (int i = 0; i < 256; ++i) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(ByteToPiece(i));
+    sp->set_type(ModelProto::SentencePiece::BYTE);
+  }
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  return model_proto;
+}
+
+TEST(SentencePieceProcessorTest, DecodeTableTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+
+  // ▁a ▁ b <0xE3> <0x81> <0x82> <0xFF> <unk> <s>
+  const std::vector<int> ids = {5, 4, 3, 7 + 0xE3, 7 + 0x81, 7 + 0x82,
+                                7 + 0xFF, 0, 1};
+  std::string text;
+  EXPECT_TRUE(sp.Decode(ids, &text).ok());
+  EXPECT_EQ("a b\xE3\x81\x82\xEF\xBF\xBD \xE2\x81\x87 ", text);
+  EXPECT_EQ(util::StatusCode::kOutOfRange, sp.Decode({2, 1000}, &text).code());
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.Decode(std::vector<int>{-1}, &text).code());
+
+  // The table produces the same text as the decoder of SentencePieceText
+  // under all the whitespace rules.
+  std::mt19937 mt(1);
+  std::uniform_int_distribution<int> small_id(0, 6), any_id(0, 262);
+  EncodeContext context;
+  for (const bool add_dummy_prefix : {true, false}) {
+    for (const bool remove_extra_whitespaces : {true, false}) {
+      auto *normalizer_spec = sp.mutable_normalizer_spec();
+      normalizer_spec->set_add_dummy_prefix(add_dummy_prefix);
+      normalizer_spec->set_remove_extra_whitespaces(remove_extra_whitespaces);
+      for (int n = 0; n < 200; ++n) {
+        std::vector<int> ids(n % 8);
+        for (auto &id : ids) id = n % 2 ? small_id(mt) : any_id(mt);
+        SentencePieceText spt;
+        ASSERT_TRUE(sp.Decode(ids, &spt).ok());
+        EXPECT_TRUE(sp.Decode(ids, &text).ok());
+        EXPECT_EQ(spt.text(), text);
+        EXPECT_TRUE(sp.Decode(ids, &text, &context).ok());
+        EXPECT_EQ(spt.text(), text);
+      }
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, DenormalizeDecodeTableTest) {
+  // "a" is deleted, "b" becomes "B" and "b a" becomes "Z", which matches
+  // across the surfaces of "b" and "▁a".
+  normalizer::Builder::CharsMap chars_map;
+  chars_map[{'a'}] = {};
+  chars_map[{'b'}] = {'B'};
+  chars_map[{'b', ' ', 'a'}] = {'Z'};
+  ModelProto model_proto = MakeDecodeTestModel();
+  auto *denormalizer_spec = model_proto.mutable_denormalizer_spec();
+  ASSERT_TRUE(normalizer::Builder::CompileCharsMap(
+                  chars_map, denormalizer_spec->mutable_precompiled_charsmap())
+                  .ok());
+  denormalizer_spec->set_add_dummy_prefix(false);
+  denormalizer_spec->set_remove_extra_whitespaces(false);
+  denormalizer_spec->set_escape_whitespaces(false);
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  std::string text;
+  // ▁a ▁ a
+  EXPECT_TRUE(sp.Decode({5, 4, 2}, &text).ok());
+  EXPECT_EQ(" ", text);
+  // b ▁a ▁ b
+  EXPECT_TRUE(sp.Decode({3, 5, 4, 3}, &text).ok());
+  EXPECT_EQ("Z B", text);
+
+  // The denormalized surfaces give the same text as the denormalization of
+  // the whole text.
+  std::mt19937 mt(1);
+  std::uniform_int_distribution<int> small_id(0, 6), any_id(0, 262);
+  for (const bool add_dummy_prefix : {true, false}) {
+    for (const bool remove_extra_whitespaces : {true, false}) {
+      auto *normalizer_spec = sp.mutable_normalizer_spec();
+      normalizer_spec->set_add_dummy_prefix(add_dummy_prefix);
+      normalizer_spec->set_remove_extra_whitespaces(remove_extra_whitespaces);
+      for (int n = 0; n < 200; ++n) {
+        std::vector<int> ids(n % 8);
+        for (auto &id : ids) id = n % 2 ? small_id(mt) : any_id(mt);
+        SentencePieceText spt;
+        ASSERT_TRUE(sp.Decode(ids, &spt).ok());
+        EXPECT_TRUE(sp.Decode(ids, &text).ok());
+        EXPECT_EQ(spt.text(), text);
+      }
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, StreamingDecoderTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+
+  // ▁a <0xE3> <0x81> <0x82> ▁▁b <0xE3> <0x81>
+  StreamingDecoder decoder(sp);
+  std::vector<std::string> outputs;
+  std::string text;
+  for (const int id :
+       {5, 7 + 0xE3, 7 + 0x81, 7 + 0x82, 6, 7 + 0xE3, 7 + 0x81}) {
+    EXPECT_TRUE(decoder.Decode(id, &text).ok());
+    outputs.push_back(text);
+  }
+  EXPECT_TRUE(decoder.Finish(&text).ok());
+  outputs.push_back(text);
+  EXPECT_EQ(std::vector<std::string>({"a", "", "", "\xE3\x81\x82", "  b", "",
+                                      "", "\xEF\xBF\xBD\xEF\xBF\xBD"}),
+            outputs);
+
+  // Finish() starts a new sequence, which strips the whitespace again.
+  EXPECT_TRUE(decoder.Decode(5, &text).ok());
+  EXPECT_EQ("a", text);
+  EXPECT_EQ(util::StatusCode::kOutOfRange, decoder.Decode(1000, &text).code());
+
+  std::mt19937 mt(1);
+  std::uniform_int_distribution<int> small_id(0, 6), any_id(0, 262);
+  for (const bool add_dummy_prefix : {true, false}) {
+    for (const bool remove_extra_whitespaces : {true, false}) {
+      auto *normalizer_spec = sp.mutable_normalizer_spec();
+      normalizer_spec->set_add_dummy_prefix(add_dummy_prefix);
+      normalizer_spec->set_remove_extra_whitespaces(remove_extra_whitespaces);
+      for (int n = 0; n < 200; ++n) {
+        std::vector<int> ids(n % 8);
+        for (auto &id : ids) id = n % 2 ? small_id(mt) : any_id(mt);
+        std::string expected, streamed;
+        ASSERT_TRUE(sp.Decode(ids, &expected).ok());
+        decoder.Reset();
+        for (const int id : ids) {
+          EXPECT_TRUE(decoder.Decode(id, &text).ok());
+          streamed += text;
+        }
+        EXPECT_TRUE(decoder.Finish(&text).ok());
+        streamed += text;
+        EXPECT_EQ(expected, streamed);
+      }
+    }
+  }
+
+  SentencePieceProcessor unloaded;
+  StreamingDecoder unloaded_decoder(unloaded);
+  EXPECT_FALSE(unloaded_decoder.Decode(0, &text).ok());
+}
+
+TEST(SentencePieceProcessorTest, SurfaceIndexTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+  SurfaceIndex index;
+  ASSERT_TRUE(index.Build(sp).ok());
+  EXPECT_EQ(sp.GetPieceSize(), index.GetPieceSize());
+
+  // a b ▁ ▁a ▁▁b <0x61>
+  std::vector<int> ids;
+  index.FindPrefixesOf(" ab", &ids);
+  EXPECT_EQ(std::vector<int>({4, 7 + ' ', 5}), ids);
+  index.FindExtensionsOf(" ", &ids);
+  EXPECT_EQ(std::vector<int>({4, 7 + ' ', 6, 5}), ids);
+  index.FindCompatible("a", &ids);
+  EXPECT_EQ(std::vector<int>({2, 7 + 'a'}), ids);
+  index.FindCompatible("\xE3\x81", &ids);
+  EXPECT_EQ(std::vector<int>({7 + 0xE3}), ids);
+  index.FindCompatible("x", &ids);
+  EXPECT_EQ(std::vector<int>({7 + 'x'}), ids);
+  index.FindPrefixesOf("", &ids);
+  EXPECT_TRUE(ids.empty());
+
+  // Compares with the surfaces of all the ids.
+  const auto surface = [&](int id) -> std::string {
+    if (sp.IsByte(id)) return std::string(1, static_cast<char>(id - 7));
+    return absl::StrReplaceAll(sp.IdToPiece(id), {{WS, " "}});
+  };
+  std::mt19937 mt(1);
+  const std::vector<std::string> chars = {"a", "b", " ", "\xE3", "\x81"};
+  std::vector<uint64_t> mask;
+  for (int n = 0; n < 100; ++n) {
+    std::string text;
+    for (int i = 0; i < n % 5; ++i) text += chars[mt() % chars.size()];
+    std::set<int> prefixes, extensions, compatible;
+    for (int id = 0; id < sp.GetPieceSize(); ++id) {
+      if (sp.IsUnknown(id) || sp.IsControl(id)) continue;
+      const std::string s = surface(id);
+      if (absl::StartsWith(text, s)) prefixes.insert(id);
+      if (absl::StartsWith(s, text)) extensions.insert(id);
+    }
+    compatible = prefixes;
+    compatible.insert(extensions.begin(), extensions.end());
+
+    index.FindPrefixesOf(text, &ids);
+    EXPECT_EQ(prefixes, std::set<int>(ids.begin(), ids.end()));
+    EXPECT_EQ(prefixes.size(), ids.size());
+    index.FindExtensionsOf(text, &ids);
+    EXPECT_EQ(extensions, std::set<int>(ids.begin(), ids.end()));
+    EXPECT_EQ(extensions.size(), ids.size());
+    index.FindCompatible(text, &ids);
+    EXPECT_EQ(compatible, std::set<int>(ids.begin(), ids.end()));
+    EXPECT_EQ(compatible.size(), ids.size());
+    index.GetCompatibleMask(text, &mask);
+    ASSERT_EQ((sp.GetPieceSize() + 63) / 64, mask.size());
+    for (int id = 0; id < sp.GetPieceSize(); ++id) {
+      EXPECT_EQ(compatible.count(id) > 0, (mask[id / 64] >> (id % 64)) & 1);
+    }
+  }
+
+  SentencePieceProcessor unloaded;
+  EXPECT_FALSE(index.Build(unloaded).ok());
+}
+
+TEST(SentencePieceProcessorTest, DecodeBatchTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+  ASSERT_TRUE(sp.SetNumThreads(4).ok());
+
+  std::mt19937 mt(1);
+  std::uniform_int_distribution<int> any_id(0, 262);
+  std::vector<int> ids;
+  std::vector<size_t> offsets = {0};
+  std::vector<std::string> expected;
+  for (int n = 0; n < 100; ++n) {
+    std::vector<int> sentence(n % 7);
+    for (auto &id : sentence) id = any_id(mt);
+    ids.insert(ids.end(), sentence.begin(), sentence.end());
+    offsets.push_back(ids.size());
+    expected.emplace_back();
+    ASSERT_TRUE(sp.Decode(sentence, &expected.back()).ok());
+  }
+
+  for (const auto &extra_options : {"", "reverse"}) {
+    ASSERT_TRUE(sp.SetDecodeExtraOptions(extra_options).ok());
+    if (*extra_options) {
+      for (size_t i = 0; i < expected.size(); ++i) {
+        std::vector<int> sentence(ids.begin() + offsets[i],
+                                  ids.begin() + offsets[i + 1]);
+        ASSERT_TRUE(sp.Decode(sentence, &expected[i]).ok());
+      }
+    }
+    std::string text;
+    std::vector<size_t> text_offsets;
+    ASSERT_TRUE(sp.DecodeBatch(ids, offsets, &text, &text_offsets).ok());
+    ASSERT_EQ(offsets.size(), text_offsets.size());
+    EXPECT_EQ(text.size(), text_offsets.back());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_EQ(expected[i],
+                text.substr(text_offsets[i],
+                            text_offsets[i + 1] - text_offsets[i]));
+    }
+  }
+
+  std::string text;
+  std::vector<size_t> text_offsets;
+  EXPECT_TRUE(sp.DecodeBatch({}, {0}, &text, &text_offsets).ok());
+  EXPECT_EQ(std::vector<size_t>({0}), text_offsets);
+  EXPECT_FALSE(sp.DecodeBatch({}, {}, &text, &text_offsets).ok());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 3}, &text, &text_offsets).ok());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 2, 1}, &text, &text_offsets).ok());
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.DecodeBatch({1, 1000}, {0, 1, 2}, &text, &text_offsets).code());
+}
+
+TEST(SentencePieceProcessorTest, NormalizeBatchTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+  ASSERT_TRUE(sp.SetNumThreads(4).ok());
+
+  const std::vector<std::string> texts = {
+      "", "  ", "hello world", "  ＡＢＣ  ｄｅｆ  ", "ｶﾞｷﾞ", "a\tb",
+      "\xE2\x91\xA0\xE2\x91\xA1 x"};
+  std::vector<absl::string_view> inputs;
+  for (int n = 0; n < 100; ++n) inputs.push_back(texts[n % texts.size()]);
+
+  NormalizedBatch batch;
+  for (const bool with_alignments : {false, true}) {
+    ASSERT_TRUE(sp.NormalizeBatch(inputs, with_alignments, &batch).ok());
+    ASSERT_EQ(inputs.size() + 1, batch.text_offsets.size());
+    ASSERT_EQ(inputs.size() + 1, batch.run_offsets.size());
+    EXPECT_EQ(batch.text.size(), batch.text_offsets.back());
+    EXPECT_EQ(batch.runs.size(), batch.run_offsets.back());
+    EXPECT_EQ(with_alignments, !batch.runs.empty());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      std::string normalized;
+      std::vector<size_t> norm_to_orig;
+      ASSERT_TRUE(sp.Normalize(inputs[i], &normalized, &norm_to_orig).ok());
+      const size_t length = batch.text_offsets[i + 1] - batch.text_offsets[i];
+      EXPECT_EQ(normalized, batch.text.substr(batch.text_offsets[i], length));
+      if (!with_alignments) continue;
+
+      // Expands the runs of the input.
+      std::vector<size_t> expanded;
+      for (size_t j = batch.run_offsets[i]; j < batch.run_offsets[i + 1];
+           ++j) {
+        const auto &run = batch.runs[j];
+        const size_t end = j + 1 < batch.run_offsets[i + 1]
+                               ? batch.runs[j + 1].norm
+                               : (inputs[i].empty() ? 0 : length + 1);
+        ASSERT_EQ(run.norm, expanded.size());
+        for (size_t k = run.norm; k < end; ++k) {
+          expanded.push_back(run.identity ? run.orig + k - run.norm
+                                          : run.orig);
+        }
+      }
+      EXPECT_EQ(norm_to_orig, expanded);
+    }
+  }
+
+  ASSERT_TRUE(sp.NormalizeBatch({}, true, &batch).ok());
+  EXPECT_TRUE(batch.text.empty());
+  EXPECT_EQ(std::vector<size_t>({0}), batch.text_offsets);
+  EXPECT_EQ(std::vector<size_t>({0}), batch.run_offsets);
+  EXPECT_FALSE(sp.NormalizeBatch(inputs, true, nullptr).ok());
+}
+
+TEST(SentencePieceProcessorTest, NarrowIdsTest) {
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(MakeDecodeTestModel()).ok());
+
+  const std::vector<absl::string_view> inputs = {"a b", "",
+                                                 "ab \xE3\x81\x82 ba"};
+  std::vector<std::vector<int>> expected;
+  ASSERT_TRUE(sp.EncodeBatch(inputs, &expected).ok());
+
+  std::vector<std::vector<uint16_t>> ids16;
+  std::vector<std::vector<uint32_t>> ids32;
+  ASSERT_TRUE(sp.EncodeBatch(inputs, &ids16).ok());
+  ASSERT_TRUE(sp.EncodeBatch(inputs, &ids32).ok());
+  ASSERT_EQ(inputs.size(), ids16.size());
+  ASSERT_EQ(inputs.size(), ids32.size());
+  std::vector<uint16_t> flat;
+  std::vector<size_t> offsets = {0};
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    EXPECT_EQ(expected[i], std::vector<int>(ids16[i].begin(), ids16[i].end()));
+    EXPECT_EQ(expected[i], std::vector<int>(ids32[i].begin(), ids32[i].end()));
+
+    std::vector<uint16_t> single;
+    ASSERT_TRUE(sp.Encode(inputs[i], &single).ok());
+    EXPECT_EQ(ids16[i], single);
+
+    std::string text, narrow_text;
+    ASSERT_TRUE(sp.Decode(expected[i], &text).ok());
+    ASSERT_TRUE(sp.Decode(ids16[i], &narrow_text).ok());
+    EXPECT_EQ(text, narrow_text);
+    ASSERT_TRUE(sp.Decode(ids32[i], &narrow_text).ok());
+    EXPECT_EQ(text, narrow_text);
+
+    flat.insert(flat.end(), ids16[i].begin(), ids16[i].end());
+    offsets.push_back(flat.size());
+  }
+
+  std::string text;
+  std::vector<size_t> text_offsets;
+  ASSERT_TRUE(sp.DecodeBatch(flat, offsets, &text, &text_offsets).ok());
+  EXPECT_EQ(offsets.size(), text_offsets.size());
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.Decode(std::vector<uint16_t>{2, 1000}, &text).code());
+
+  // A vocabulary of 65537 pieces does not fit in uint16_t.
+  ModelProto model_proto = MakeDecodeTestModel();
+  for (int i = model_proto.pieces_size(); i <= 0x10000; ++i) {
+    AddPiece(&model_proto, absl::StrCat("p", i));
+  }
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  std::vector<uint16_t> single;
+  EXPECT_EQ(util::StatusCode::kOutOfRange, sp.Encode("a", &single).code());
+  EXPECT_EQ(util::StatusCode::kOutOfRange, sp.EncodeBatch(inputs, &ids16).code());
+  std::vector<uint32_t> wide;
+  EXPECT_TRUE(sp.Encode("a", &wide).ok());
+}
+
+template <typename Offset>
+void RunEncodeArrowTest(const SentencePieceProcessor &sp) {
+  std::vector<std::string> texts;
+  for (int i = 0; i < 100; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + " b" +
+                       std::string(i % 5, 'c') + " ab");
+  }
+
+  // Every third string is null. The array starts at the 2nd string of the
+  // buffers, so that the validity bits are not byte-aligned.
+  std::string data;
+  std::vector<Offset> offsets = {0};
+  std::vector<uint8_t> validity((texts.size() + 7) / 8, 0);
+  for (size_t i = 0; i < texts.size(); ++i) {
+    if (i % 3 != 0) {
+      validity[i / 8] |= 1 << (i % 8);
+      data += texts[i];
+    }
+    offsets.push_back(data.size());
+  }
+
+  ArrowStringArray<Offset> input;
+  input.length = texts.size() - 1;
+  input.offset = 1;
+  input.validity = validity.data();
+  input.offsets = offsets.data();
+  input.data = data.data();
+
+  ArrowListArray<Offset> output;
+  ASSERT_TRUE(sp.EncodeArrow(input, &output).ok());
+  ASSERT_EQ(texts.size(), output.offsets.size());
+  EXPECT_EQ(0, output.offsets[0]);
+  EXPECT_EQ(output.values.size(), output.offsets.back());
+  for (size_t i = 1; i < texts.size(); ++i) {
+    const std::vector<int> ids(output.values.begin() + output.offsets[i - 1],
+                               output.values.begin() + output.offsets[i]);
+    EXPECT_EQ(i % 3 == 0 ? std::vector<int>() : sp.EncodeAsIds(texts[i]), ids);
+  }
+
+  // Without the validity bitmap, the null strings are empty strings.
+  input.validity = nullptr;
+  ASSERT_TRUE(sp.EncodeArrow(input, &output).ok());
+  EXPECT_EQ(0, output.offsets[3] - output.offsets[2]);
+  EXPECT_EQ(sp.EncodeAsIds(texts[3 + 1]),
+            std::vector<int>(output.values.begin() + output.offsets[3],
+                             output.values.begin() + output.offsets[4]));
+
+  input.length = 0;
+  ASSERT_TRUE(sp.EncodeArrow(input, &output).ok());
+  EXPECT_EQ(std::vector<Offset>({0}), output.offsets);
+  EXPECT_TRUE(output.values.empty());
+
+  input.length = 3;
+  EXPECT_FALSE(sp.EncodeArrow(input, nullptr).ok());
+  offsets[2] = offsets[3] + 1;
+  EXPECT_FALSE(sp.EncodeArrow(input, &output).ok());
+  input.offsets = nullptr;
+  EXPECT_FALSE(sp.EncodeArrow(input, &output).ok());
+  input.length = -1;
+  EXPECT_FALSE(sp.EncodeArrow(input, &output).ok());
+}
+
+TEST(SentencePieceProcessorTest, EncodeArrowTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  {
+    ArrowStringArray<int32_t> input;
+    ArrowListArray<int32_t> output;
+    EXPECT_FALSE(sp.EncodeArrow(input, &output).ok());
+  }
+
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  for (const int num_threads : {1, 4}) {
+    EXPECT_TRUE(sp.SetNumThreads(num_threads).ok());
+    RunEncodeArrowTest<int32_t>(sp);
+    RunEncodeArrowTest<int64_t>(sp);
+  }
+}
+
+TEST(SentencePieceProcessorTest, RunOnSharedThreadPoolTest) {
+  for (const int num_threads : {1, 2, 0}) {
+    for (const size_t size : {0, 1, 5, 1000}) {
+      std::vector<int> visited(size, 0);
+      RunOnSharedThreadPool(size, num_threads, [&](size_t begin, size_t end) {
+        EXPECT_LT(begin, end);
+        for (size_t i = begin; i < end; ++i) ++visited[i];
+      });
+      EXPECT_EQ(std::vector<int>(size, 1), visited);
+    }
+  }
+
+  std::atomic<int> active(0);
+  std::atomic<int> max_active(0);
+  RunOnSharedThreadPool(100, 2, [&](size_t, size_t) {
+    const int n = ++active;
+    int max = max_active.load();
+    while (n > max && !max_active.compare_exchange_weak(max, n)) {
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    --active;
+  });
+  EXPECT_LE(max_active.load(), 2);
+}
+
+TEST(SentencePieceProcessorTest, ConfigureThreadPoolsTest) {
+  EXPECT_LE(1, GetDefaultNumThreads());
+  EXPECT_FALSE(ConfigureThreadPools(2, {-1}).ok());
+
+  // The process-wide pool is never resized once it has started.
+  RunOnSharedThreadPool(10, 0, [](size_t, size_t) {});
+  EXPECT_FALSE(ConfigureThreadPools(2, {}).ok());
+}
+
+TEST(SentencePieceProcessorTest, ModelFileTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "model_file_model");
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(model_proto.SerializeAsString());
+  }
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.model_file().empty());
+  ASSERT_TRUE(sp.Load(filename).ok());
+  EXPECT_EQ(filename, sp.model_file());
+
+  SentencePieceProcessor shared;
+  ASSERT_TRUE(shared.LoadShared(sp).ok());
+  EXPECT_EQ(filename, shared.model_file());
+
+  EXPECT_FALSE(sp.Load("__UNKNOWN_FILE__").ok());
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_TRUE(sp.model_file().empty());
+
+  ASSERT_TRUE(sp.Load(filename).ok());
+  ASSERT_TRUE(sp.SetVocabulary({"a", "b"}).ok());
+  EXPECT_TRUE(sp.model_file().empty());
+}
+
+TEST(SentencePieceProcessorTest, LoadProcessorsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  auto *sp2 = model_proto.add_pieces();
+  sp2->set_type(ModelProto::SentencePiece::USER_DEFINED);
+  sp2->set_piece("<sep>");
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  *(model_proto.mutable_denormalizer_spec()) =
+      SentencePieceTrainer::GetNormalizerSpec("nfkc");
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "load_processors_model");
+  const std::string fast_filename =
+      util::JoinPath(::testing::TempDir(), "load_processors_fast_model");
+  ASSERT_TRUE(io::SaveModelProto(filename, model_proto).ok());
+  ASSERT_TRUE(io::SaveFastModel(fast_filename, model_proto).ok());
+
+  // The normalizers are built on the calling thread.
+  SentencePieceProcessor expected;
+  ASSERT_TRUE(expected.SetNumThreads(1).ok());
+  ASSERT_TRUE(expected.Load(filename).ok());
+
+  std::vector<std::unique_ptr<SentencePieceProcessor>> processors;
+  ASSERT_TRUE(
+      LoadProcessors({filename, fast_filename, filename}, &processors, 2)
+          .ok());
+  ASSERT_EQ(3, processors.size());
+  for (const auto &processor : processors) {
+    EXPECT_EQ(expected.model_file().empty(), processor->model_file().empty());
+    for (const absl::string_view text :
+         {"ab <sep>ab", "ＡＢ ab", "a  b", ""}) {
+      std::vector<int> expected_ids, ids;
+      ASSERT_TRUE(expected.Encode(text, &expected_ids).ok());
+      ASSERT_TRUE(processor->Encode(text, &ids).ok());
+      EXPECT_EQ(expected_ids, ids);
+      std::string expected_text, decoded;
+      ASSERT_TRUE(expected.Decode(expected_ids, &expected_text).ok());
+      ASSERT_TRUE(processor->Decode(ids, &decoded).ok());
+      EXPECT_EQ(expected_text, decoded);
+    }
+  }
+
+  EXPECT_FALSE(
+      LoadProcessors({filename, "__UNKNOWN_FILE__"}, &processors).ok());
+  EXPECT_TRUE(processors.empty());
+  EXPECT_FALSE(LoadProcessors({filename}, nullptr).ok());
+}
+
+#ifndef OS_WIN
+TEST(SentencePieceProcessorTest, ForkTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(sp.SetNumThreads(2).ok());
+  const std::vector<absl::string_view> inputs(64, "ab ab");
+  std::vector<std::vector<int>> expected;
+  ASSERT_TRUE(sp.EncodeBatch(inputs, &expected).ok());
+  RunOnSharedThreadPool(10, 2, [](size_t, size_t) {});
+
+  // The pools started by the parent are replaced in the child.
+  const pid_t pid = ::fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    std::vector<std::vector<int>> ids;
+    bool ok = sp.EncodeBatch(inputs, &ids).ok() && ids == expected;
+    std::atomic<size_t> visited = 0;
+    RunOnSharedThreadPool(10, 2, [&visited](size_t begin, size_t end) {
+      visited += end - begin;
+    });
+    ok = ok && visited.load() == 10;
+    ::_exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}
+#endif
+
+TEST(SentencePieceProcessorTest, EncodeCorpusTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  {
+    std::vector<std::vector<int>> ids;
+    EXPECT_FALSE(sp.EncodeCorpus({"ab"}, &ids).ok());
+  }
+
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  // A few long documents among many short ones.
+  std::vector<std::string> texts;
+  for (int i = 0; i < 300; ++i) {
+    const int repeat = i % 50 == 7 ? 1000 : i % 5;
+    std::string text;
+    for (int n = 0; n < repeat; ++n) text += "ab c ";
+    texts.emplace_back(text + std::string(i % 3, 'b'));
+  }
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+
+  for (const int num_threads : {1, 4}) {
+    EXPECT_TRUE(sp.SetNumThreads(num_threads).ok());
+    std::vector<std::vector<int>> ids;
+    CorpusEncodeStats stats;
+    ASSERT_TRUE(sp.EncodeCorpus(inputs, &ids, &stats).ok());
+    ASSERT_EQ(inputs.size(), ids.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.EncodeAsIds(inputs[i]), ids[i]);
+    }
+
+    ASSERT_EQ(num_threads, stats.num_inputs.size());
+    ASSERT_EQ(num_threads, stats.num_bytes.size());
+    ASSERT_EQ(num_threads, stats.busy_seconds.size());
+    size_t num_inputs = 0, num_bytes = 0, total_bytes = 0;
+    for (int n = 0; n < num_threads; ++n) {
+      num_inputs += stats.num_inputs[n];
+      num_bytes += stats.num_bytes[n];
+      EXPECT_GE(stats.busy_seconds[n], 0.0);
+    }
+    for (const auto &text : texts) total_bytes += text.size();
+    EXPECT_EQ(inputs.size(), num_inputs);
+    EXPECT_EQ(total_bytes, num_bytes);
+    EXPECT_GT(stats.elapsed_seconds, 0.0);
+  }
+
+  std::vector<std::vector<int>> ids = {{1}};
+  EXPECT_TRUE(sp.EncodeCorpus({}, &ids).ok());
+  EXPECT_TRUE(ids.empty());
+  EXPECT_FALSE(sp.EncodeCorpus(inputs, nullptr).ok());
+}
+
+TEST(SentencePieceProcessorTest, ParallelEncodeTest) {
+  for (const auto type : {TrainerSpec::BPE, TrainerSpec::UNIGRAM}) {
+    ModelProto model_proto;
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+
+    AddPiece(&model_proto, "ab", 0.0);
+    AddPiece(&model_proto, WS "ab", -1.0);
+    AddPiece(&model_proto, "abc", -2.0);
+    AddPiece(&model_proto, WS, -3.0);
+    AddPiece(&model_proto, "a", -4.0);
+    AddPiece(&model_proto, "b", -5.0);
+    AddPiece(&model_proto, "c", -6.0);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp, parallel_sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(parallel_sp.Load(model_proto).ok());
+    EXPECT_TRUE(parallel_sp.SetNumThreads(4).ok());
+    EXPECT_TRUE(parallel_sp.SetParallelEncodeThreshold(1).ok());
+
+    std::string text;
+    const std::vector<std::string> words = {"ab", "abc", "cab", "x", "abcabc"};
+    for (int i = 0; i < 2000; ++i) {
+      text += words[i % words.size()];
+      text += i % 7 == 0 ? "  " : " ";
+    }
+    for (const auto &input : {text, std::string("ab c"), std::string()}) {
+      SentencePieceText expected, actual;
+      EXPECT_TRUE(sp.Encode(input, &expected).ok());
+      EXPECT_TRUE(parallel_sp.Encode(input, &actual).ok());
+      EXPECT_EQ(expected.SerializeAsString(), actual.SerializeAsString());
+      EXPECT_EQ(sp.EncodeAsIds(input), parallel_sp.EncodeAsIds(input));
+    }
+
+    // Pieces spanning words. The input is cut only where no piece spans,
+    // or not at all.
+    AddPiece(&model_proto, "b" WS "a", -7.0);
+    AddPiece(&model_proto, "c" WS "x", -8.0);
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(parallel_sp.Load(model_proto).ok());
+    EXPECT_TRUE(parallel_sp.SetParallelEncodeThreshold(1).ok());
+    std::string spanning;
+    for (int i = 0; i < 500; ++i) spanning += "ab ab abc x ";
+    for (const auto &input : {text, spanning}) {
+      EXPECT_EQ(sp.EncodeAsIds(input), parallel_sp.EncodeAsIds(input));
+    }
+    EXPECT_TRUE(parallel_sp.SetParallelEncodeThreshold(0).ok());
+  }
+}
+
+// Returns a model of whole-word pieces with the whitespace piece as a
+// prefix, or as a suffix if `suffix`, and the control pieces <s> and </s>.
+ModelProto MakeWordTestModel(bool suffix) {
+  ModelProto model_proto;
+  model_proto.mutable_trainer_spec()->set_treat_whitespace_as_suffix(suffix);
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  auto *sp2 = model_proto.add_pieces();
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  auto *sp3 = model_proto.add_pieces();
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+
+  AddPiece(&model_proto, "ab", 0.0);
+  AddPiece(&model_proto, suffix ? "ab" WS : WS "ab", -1.0);
+  AddPiece(&model_proto, "abc", -2.0);
+  AddPiece(&model_proto, WS, -3.0);
+  AddPiece(&model_proto, "a", -4.0);
+  AddPiece(&model_proto, "b", -5.0);
+  AddPiece(&model_proto, "c", -6.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  return model_proto;
+}
+
+TEST(SentencePieceProcessorTest, FusedEncodeTest) {
+  for (const bool suffix : {false, true}) {
+    ModelProto model_proto = MakeWordTestModel(suffix);
+
+    SentencePieceProcessor sp, fused_sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(fused_sp.Load(model_proto).ok());
+
+    std::string text;
+    const std::vector<std::string> words = {"ab", "abc", "cab", "xx",
+                                            "abcabc", "\xEF\xBC\xA1" "b"};
+    for (int i = 0; i < 500; ++i) {
+      text += words[i % words.size()];
+      text += i % 7 == 0 ? "  " : " ";
+    }
+    for (const size_t window : {1, 3, 16, 1000}) {
+      EXPECT_TRUE(fused_sp.SetFusedEncodeWindow(window).ok());
+      for (const auto *extra_options : {"", "bos:eos:reverse"}) {
+        EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+        EXPECT_TRUE(fused_sp.SetEncodeExtraOptions(extra_options).ok());
+        for (const auto &input :
+             {text, std::string("  ab  c  "), std::string("xx"),
+              std::string("   "), std::string()}) {
+          EXPECT_EQ(sp.EncodeAsIds(input), fused_sp.EncodeAsIds(input));
+        }
+      }
+    }
+
+    // A piece spanning words.
+    AddPiece(&model_proto, "b" WS "a", -7.0);
+    ASSERT_TRUE(fused_sp.Load(model_proto).ok());
+    EXPECT_FALSE(fused_sp.SetFusedEncodeWindow(16).ok());
+    EXPECT_TRUE(fused_sp.SetFusedEncodeWindow(0).ok());
+  }
+}
+
+TEST(SentencePieceProcessorTest, IncrementalEncoderTest) {
+  for (const bool suffix : {false, true}) {
+    ModelProto model_proto = MakeWordTestModel(suffix);
+
+    std::string text;
+    const std::vector<std::string> words = {"ab", "abc", "cab", "xx",
+                                            "abcabc", "\xEF\xBC\xA1" "b"};
+    for (int i = 0; i < 200; ++i) {
+      text += words[i % words.size()];
+      text += i % 7 == 0 ? "  " : " ";
+    }
+
+    // The second model has pieces spanning words.
+    for (const bool spanning : {false, true}) {
+      if (spanning) {
+        AddPiece(&model_proto, "b" WS "a", -7.0);
+        AddPiece(&model_proto, "c" WS "x", -8.0);
+      }
+      SentencePieceProcessor sp;
+      ASSERT_TRUE(sp.Load(model_proto).ok());
+      IncrementalEncoder encoder(sp);
+      std::mt19937 mt(1);
+      std::uniform_int_distribution<size_t> chunk_size(0, 7);
+      for (const auto &input :
+           {text, std::string("  ab  c  "), std::string("xx"),
+            std::string("   "), std::string()}) {
+        encoder.Reset();
+        std::vector<int> ids, added;
+        int num_retracted = 0;
+        for (size_t pos = 0; pos < input.size();) {
+          const size_t size = std::min(chunk_size(mt), input.size() - pos);
+          const size_t num_final_ids = encoder.num_final_ids();
+          ASSERT_TRUE(encoder
+                          .Append(absl::string_view(input).substr(pos, size),
+                                  &num_retracted, &added)
+                          .ok());
+          pos += size;
+          ASSERT_LE(num_retracted, ids.size() - num_final_ids);
+          ids.resize(ids.size() - num_retracted);
+          ids.insert(ids.end(), added.begin(), added.end());
+          EXPECT_EQ(sp.EncodeAsIds(input.substr(0, pos)), ids);
+          EXPECT_EQ(ids, encoder.ids());
+        }
+        EXPECT_EQ(sp.EncodeAsIds(input), encoder.ids());
+      }
+      // Most of the ids of the long text are final.
+      EXPECT_LT(encoder.ids().size() - encoder.num_final_ids(), 10);
+    }
+  }
+
+  SentencePieceProcessor unloaded;
+  IncrementalEncoder unloaded_encoder(unloaded);
+  std::vector<int> added;
+  int num_retracted = 0;
+  EXPECT_FALSE(unloaded_encoder.Append("a", &num_retracted, &added).ok());
+}
+
+TEST(SentencePieceProcessorTest, DocumentEncoderTest) {
+  for (const bool suffix : {false, true}) {
+    ModelProto model_proto = MakeWordTestModel(suffix);
+
+    const std::vector<std::string> words = {"ab",  "abc", "cab", "xx", " ",
+                                            "  ",  "c",   "\xEF\xBC\xA1" "b"};
+    std::string text;
+    for (int i = 0; i < 100; ++i) text += words[i % words.size()];
+
+    // The second model has pieces spanning words.
+    for (const bool spanning : {false, true}) {
+      if (spanning) {
+        AddPiece(&model_proto, "b" WS "a", -7.0);
+        AddPiece(&model_proto, "c" WS "x", -8.0);
+      }
+      SentencePieceProcessor sp;
+      ASSERT_TRUE(sp.Load(model_proto).ok());
+      DocumentEncoder document(sp);
+      ASSERT_TRUE(document.SetText(text).ok());
+      std::vector<int> ids = sp.EncodeAsIds(text);
+      EXPECT_EQ(ids, document.ids());
+
+      std::mt19937 mt(1);
+      DocumentEncoder::Splice splice;
+      for (int n = 0; n < 300; ++n) {
+        const size_t size = document.text().size();
+        const size_t offset =
+            std::uniform_int_distribution<size_t>(0, size)(mt);
+        const size_t removed = std::uniform_int_distribution<size_t>(
+            0, std::min<size_t>(size - offset, 6))(mt);
+        const std::string &inserted =
+            words[std::uniform_int_distribution<size_t>(0, words.size() - 1)(
+                mt)];
+        ASSERT_TRUE(document.Edit(offset, removed, n % 3 ? inserted : "",
+                                  &splice)
+                        .ok());
+        ASSERT_LE(splice.begin + splice.num_removed, ids.size());
+        ids.erase(ids.begin() + splice.begin,
+                  ids.begin() + splice.begin + splice.num_removed);
+        ids.insert(ids.begin() + splice.begin, splice.ids.begin(),
+                   splice.ids.end());
+        EXPECT_EQ(sp.EncodeAsIds(document.text()), ids);
+        EXPECT_EQ(ids, document.ids());
+      }
+
+      // An edit far from the end changes only the ids around it.
+      ASSERT_TRUE(document.SetText(text).ok());
+      ASSERT_TRUE(document.Edit(3, 0, "c", &splice).ok());
+      EXPECT_LT(splice.begin + splice.num_removed, 20);
+      EXPECT_FALSE(document.Edit(document.text().size() + 1, 0, "a", &splice)
+                       .ok());
+    }
+  }
+
+  SentencePieceProcessor unloaded;
+  DocumentEncoder unloaded_document(unloaded);
+  DocumentEncoder::Splice splice;
+  EXPECT_FALSE(unloaded_document.Edit(0, 0, "a", &splice).ok());
+}
+
+TEST(SentencePieceProcessorTest, TruncatedEncodeTest) {
+  for (const bool suffix : {false, true}) {
+    ModelProto model_proto = MakeWordTestModel(suffix);
+
+    std::string text;
+    const std::vector<std::string> words = {"ab", "abc", "cab", "xx",
+                                            "abcabc", "\xEF\xBC\xA1" "b"};
+    for (int i = 0; i < 500; ++i) {
+      text += words[i % words.size()];
+      text += i % 7 == 0 ? "  " : " ";
+    }
+
+    // The truncated output is the prefix of the whole output, with the
+    // window of the fused encoding or the default one, and for a model
+    // with a piece spanning words.
+    for (const bool splittable : {true, false}) {
+      if (!splittable) AddPiece(&model_proto, "b" WS "a", -7.0);
+      SentencePieceProcessor sp;
+      ASSERT_TRUE(sp.Load(model_proto).ok());
+      const std::vector<int> all_ids = sp.EncodeAsIds(text);
+      const std::vector<std::string> all_pieces = sp.EncodeAsPieces(text);
+      for (const size_t window : {0, 3, 1000}) {
+        if (splittable) EXPECT_TRUE(sp.SetFusedEncodeWindow(window).ok());
+        size_t prev_consumed = 0;
+        for (const int max_tokens : {1, 2, 5, 37, 500, 100000}) {
+          EncodeOptions options;
+          options.max_tokens = max_tokens;
+          EncodeContext context;
+          std::vector<int> ids;
+          EXPECT_TRUE(sp.Encode(text, options, &ids, &context).ok());
+          const size_t size = std::min<size_t>(max_tokens, all_ids.size());
+          EXPECT_EQ(std::vector<int>(all_ids.begin(), all_ids.begin() + size),
+                    ids);
+          EXPECT_LE(prev_consumed, context.consumed_input_bytes());
+          prev_consumed = context.consumed_input_bytes();
+          if (size == all_ids.size()) {
+            EXPECT_EQ(text.size(), context.consumed_input_bytes());
+          } else {
+            EXPECT_GT(text.size(), context.consumed_input_bytes());
+          }
+
+          std::vector<std::string> pieces;
+          EXPECT_TRUE(sp.Encode(text, options, &pieces, &context).ok());
+          EXPECT_EQ(std::vector<std::string>(all_pieces.begin(),
+                                             all_pieces.begin() + size),
+                    pieces);
+
+          // <s> and </s> are not counted.
+          options.add_bos = options.add_eos = true;
+          EXPECT_TRUE(sp.Encode(text, options, &ids, &context).ok());
+          EXPECT_EQ(size + 2, ids.size());
+          EXPECT_EQ(sp.bos_id(), ids.front());
+          EXPECT_EQ(sp.eos_id(), ids.back());
+        }
+      }
+    }
+  }
+
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "ab", 0.0);
+  AddPiece(&model_proto, WS "ab", -1.0);
+  AddPiece(&model_proto, "abc", -2.0);
+  AddPiece(&model_proto, WS, -3.0);
+  AddPiece(&model_proto, "a", -4.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  // "ab abc" is encoded into WS "ab", WS and "abc".
+  EncodeOptions options;
+  EncodeContext context;
+  std::vector<int> ids;
+  options.max_tokens = 1;
+  EXPECT_TRUE(sp.Encode("ab abc", options, &ids, &context).ok());
+  EXPECT_EQ(std::vector<int>({2}), ids);
+  EXPECT_EQ(2, context.consumed_input_bytes());
+  options.max_tokens = 2;
+  EXPECT_TRUE(sp.Encode("ab abc", options, &ids, &context).ok());
+  EXPECT_EQ(std::vector<int>({2, 4}), ids);
+  EXPECT_EQ(3, context.consumed_input_bytes());
+
+  // The unknown run of "xyz" is one id.
+  options.max_tokens = 2;
+  EXPECT_TRUE(sp.Encode("ab xyz ab", options, &ids, &context).ok());
+  EXPECT_EQ(std::vector<int>({2, 4}), ids);
+  EXPECT_EQ(3, context.consumed_input_bytes());
+  options.max_tokens = 3;
+  EXPECT_TRUE(sp.Encode("ab xyz ab", options, &ids, &context).ok());
+  EXPECT_EQ(std::vector<int>({2, 4, 0}), ids);
+  EXPECT_EQ(6, context.consumed_input_bytes());
+
+  // The input is cut at a character boundary.
+  options.max_tokens = 0;
+  options.max_input_bytes = 4;
+  EXPECT_TRUE(sp.Encode("ab abc", options, &ids, &context).ok());
+  EXPECT_EQ(std::vector<int>({2, 4, 5}), ids);
+  EXPECT_EQ(4, context.consumed_input_bytes());
+  options.max_input_bytes = 2;
+  EXPECT_TRUE(sp.Encode("\xEF\xBC\xA1" "b", options, &ids, &context).ok());
+  EXPECT_TRUE(ids.empty());
+  EXPECT_EQ(0, context.consumed_input_bytes());
+  std::vector<std::string> pieces;
+  options.max_input_bytes = 4;
+  EXPECT_TRUE(sp.Encode("ab abc", options, &pieces, &context).ok());
+  EXPECT_EQ(std::vector<std::string>({WS "ab", WS, "a"}), pieces);
+}
+
+TEST(SentencePieceProcessorTest, EncodeWindowsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "ab", 0.0);
+  AddPiece(&model_proto, WS "ab", -1.0);
+  AddPiece(&model_proto, "abc", -2.0);
+  AddPiece(&model_proto, WS, -3.0);
+  AddPiece(&model_proto, "a", -4.0);
+  AddPiece(&model_proto, "b", -5.0);
+  AddPiece(&model_proto, "c", -6.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  std::string text;
+  const std::vector<std::string> words = {"ab", "abc", "cab", "xx",
+                                          "abcabc", "\xEF\xBC\xA1" "b"};
+  for (int i = 0; i < 300; ++i) {
+    text += words[i % words.size()];
+    text += i % 7 == 0 ? "  " : " ";
+  }
+
+  // The windows are the slices of the whole encoding with the ranges of
+  // their pieces, also for a model with a piece spanning words.
+  for (const bool splittable : {true, false}) {
+    if (!splittable) AddPiece(&model_proto, "b" WS "a", -7.0);
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    SentencePieceText spt;
+    ASSERT_TRUE(sp.Encode(text, &spt).ok());
+    const std::vector<int> all_ids = sp.EncodeAsIds(text);
+    ASSERT_EQ(all_ids.size(), spt.pieces_size());
+    for (const size_t part : {0, 5}) {
+      if (splittable) EXPECT_TRUE(sp.SetFusedEncodeWindow(part).ok());
+      for (const auto &size_stride : std::vector<std::pair<int, int>>(
+               {{1, 1}, {5, 2}, {7, 7}, {16, 5}, {100000, 1}})) {
+        const size_t size = size_stride.first, stride = size_stride.second;
+        std::vector<EncodedWindow> windows;
+        EncodeContext context;
+        EXPECT_TRUE(sp.EncodeWindows(
+                          text, size, stride,
+                          [&windows](const EncodedWindow &window) {
+                            windows.push_back(window);
+                            return util::OkStatus();
+                          },
+                          &context)
+                        .ok());
+        ASSERT_FALSE(windows.empty());
+        for (size_t i = 0; i < windows.size(); ++i) {
+          const size_t begin = i * stride;
+          const size_t end = std::min(begin + size, all_ids.size());
+          EXPECT_EQ(std::vector<int>(all_ids.begin() + begin,
+                                     all_ids.begin() + end),
+                    windows[i].ids);
+          EXPECT_EQ(spt.pieces(begin).begin(), windows[i].begin);
+          EXPECT_EQ(spt.pieces(end - 1).end(), windows[i].end);
+        }
+        EXPECT_EQ(all_ids.size(),
+                  (windows.size() - 1) * stride + windows.back().ids.size());
+      }
+    }
+  }
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  EncodeContext context;
+  int calls = 0;
+  const auto count = [&calls](const EncodedWindow &window) {
+    ++calls;
+    return util::OkStatus();
+  };
+  EXPECT_TRUE(sp.EncodeWindows("", 4, 2, count, &context).ok());
+  EXPECT_TRUE(sp.EncodeWindows("   ", 4, 2, count, &context).ok());
+  EXPECT_EQ(0, calls);
+
+  // "ab ab ab ab" has 4 ids: the windows of 2 ids start at 0, 1 and 2, and
+  // the ones of 3 ids at 0 and 2.
+  EXPECT_TRUE(sp.EncodeWindows("ab ab ab ab", 2, 1, count, &context).ok());
+  EXPECT_EQ(3, calls);
+  EXPECT_TRUE(sp.EncodeWindows("ab ab ab ab", 3, 2, count, &context).ok());
+  EXPECT_EQ(5, calls);
+
+  EXPECT_FALSE(sp.EncodeWindows("ab", 2, 0, count, &context).ok());
+  EXPECT_FALSE(sp.EncodeWindows("ab", 2, 3, count, &context).ok());
+  const auto fail = [&calls](const EncodedWindow &window) {
+    ++calls;
+    return util::InternalError("stop");
+  };
+  calls = 0;
+  EXPECT_FALSE(sp.EncodeWindows("ab ab ab ab", 1, 1, fail, &context).ok());
+  EXPECT_EQ(1, calls);
+}
+
+TEST(SentencePieceProcessorTest, EncodeWordsTest) {
+  for (const bool suffix : {false, true}) {
+    ModelProto model_proto;
+    model_proto.mutable_trainer_spec()->set_treat_whitespace_as_suffix(suffix);
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    AddPiece(&model_proto, "ab", 0.0);
+    AddPiece(&model_proto, suffix ? "ab" WS : WS "ab", -1.0);
+    AddPiece(&model_proto, "abc", -2.0);
+    AddPiece(&model_proto, WS, -3.0);
+    AddPiece(&model_proto, "a", -4.0);
+    AddPiece(&model_proto, "b", -5.0);
+    AddPiece(&model_proto, "c", -6.0);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    const std::vector<absl::string_view> words = {
+        "ab", "abc", "xx", "", "  ", "\xEF\xBC\xA1" "b", "cab", "a b"};
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    EncodeContext context;
+    ASSERT_TRUE(sp.EncodeWords(words, &ids, &offsets, &context).ok());
+    ASSERT_EQ(words.size() + 1, offsets.size());
+    EXPECT_EQ(0, offsets.front());
+    EXPECT_EQ(ids.size(), offsets.back());
+
+    // Each word is encoded as a sentence of the word, and the words as the
+    // sentence joining them.
+    std::string text;
+    for (size_t i = 0; i < words.size(); ++i) {
+      EXPECT_EQ(sp.EncodeAsIds(words[i]),
+                std::vector<int>(ids.begin() + offsets[i],
+                                 ids.begin() + offsets[i + 1]));
+      if (!text.empty()) text += " ";
+      text.append(words[i].data(), words[i].size());
+    }
+    EXPECT_EQ(sp.EncodeAsIds(text), ids);
+    EXPECT_EQ(offsets[3], offsets[4]);
+    EXPECT_EQ(offsets[4], offsets[5]);
+
+    ASSERT_TRUE(sp.EncodeWords({}, &ids, &offsets, &context).ok());
+    EXPECT_TRUE(ids.empty());
+    EXPECT_EQ(std::vector<size_t>({0}), offsets);
+  }
+}
+
+TEST(SentencePieceProcessorTest, FastModelTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "fast_model");
+  EXPECT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+
+  SentencePieceProcessor sp, fast_sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_TRUE(fast_sp.Load(filename).ok());
+  EXPECT_EQ(model_proto.SerializeAsString(),
+            fast_sp.model_proto().SerializeAsString());
+  for (const auto text : {"ab c", "abcab", "a b xab"}) {
+    EXPECT_EQ(sp.EncodeAsIds(text), fast_sp.EncodeAsIds(text));
+    EXPECT_EQ(sp.EncodeAsPieces(text), fast_sp.EncodeAsPieces(text));
+  }
+
+  // LoadModelProto accepts the fast-model format as well.
+  ModelProto loaded;
+  EXPECT_TRUE(io::LoadModelProto(filename, &loaded).ok());
+  EXPECT_EQ(model_proto.SerializeAsString(), loaded.SerializeAsString());
+
+  // Broken file.
+  std::string blob;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+  }
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    EXPECT_TRUE(output->Write(blob.substr(0, blob.size() - 4)));
+  }
+  EXPECT_FALSE(fast_sp.Load(filename).ok());
+
+  // Flipped bytes are rejected by the checksum.
+  for (size_t pos = 8; pos < blob.size(); pos += 7) {
+    std::string broken = blob;
+    broken[pos] ^= 0x10;
+    auto output = filesystem::NewWritableFile(filename, true);
+    EXPECT_TRUE(output->Write(broken));
+    output.reset();
+    EXPECT_FALSE(fast_sp.Load(filename).ok());
+  }
+
+  // A trie pointing outside of itself is rejected although the checksum
+  // matches.
+  absl::string_view serialized, trie_blob, frequent_words;
+  ASSERT_TRUE(
+      DecodeFastModel(blob, &serialized, &trie_blob, &frequent_words).ok());
+  std::string broken_trie(trie_blob.data(), trie_blob.size());
+  // The offset of the root, after the size of the results.
+  const uint32 unit = 0x7FFFFC00;
+  std::memcpy(&broken_trie[sizeof(uint32)], &unit, sizeof(unit));
+  std::string broken;
+  ASSERT_TRUE(
+      EncodeFastModel(serialized, broken_trie, frequent_words, &broken).ok());
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    EXPECT_TRUE(output->Write(broken));
+  }
+  EXPECT_FALSE(fast_sp.Load(filename).ok());
+}
+
+TEST(SentencePieceProcessorTest, FastModelWithFrequentWordsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  std::string table;
+  ASSERT_TRUE(
+      sp.BuildFrequentWordTable({"ab c ab", "c ab  x", "abc"}, 2, &table).ok());
+  {
+    // WS "ab" and WS "c" are the most frequent words.
+    FrequentWordTable parsed(table);
+    ASSERT_TRUE(parsed.status().ok());
+    EXPECT_EQ(2, parsed.size());
+    EncodeResult result;
+    EXPECT_TRUE(parsed.Lookup(WS "ab", &result));
+    EXPECT_TRUE(parsed.Lookup(WS "c", &result));
+    EXPECT_FALSE(parsed.Lookup(WS "abc", &result));
+  }
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "fast_model_with_words");
+  ASSERT_TRUE(io::SaveFastModel(filename, model_proto, table).ok());
+
+  SentencePieceProcessor fast_sp;
+  ASSERT_TRUE(fast_sp.Load(filename).ok());
+  EXPECT_EQ(model_proto.SerializeAsString(),
+            fast_sp.model_proto().SerializeAsString());
+  for (const auto text : {"ab c", "abcab", "a b xab", "ab ab c ab"}) {
+    EXPECT_EQ(sp.EncodeAsIds(text), fast_sp.EncodeAsIds(text));
+    EXPECT_EQ(sp.EncodeAsPieces(text), fast_sp.EncodeAsPieces(text));
+    EXPECT_EQ(sp.EncodeAsSerializedProto(text),
+              fast_sp.EncodeAsSerializedProto(text));
+  }
+
+  ModelProto loaded;
+  EXPECT_TRUE(io::LoadModelProto(filename, &loaded).ok());
+  EXPECT_EQ(model_proto.SerializeAsString(), loaded.SerializeAsString());
+
+  // The table is dropped with a vocabulary restriction.
+  ASSERT_TRUE(fast_sp.SetVocabulary({"a", "b", "c"}).ok());
+  ASSERT_TRUE(sp.SetVocabulary({"a", "b", "c"}).ok());
+  EXPECT_EQ(sp.EncodeAsIds("ab c"), fast_sp.EncodeAsIds("ab c"));
+
+  // A piece spanning words.
+  ModelProto spanning = model_proto;
+  AddPiece(&spanning, "b" WS "a", -7.0);
+  SentencePieceProcessor spanning_sp;
+  ASSERT_TRUE(spanning_sp.Load(spanning).ok());
+  EXPECT_FALSE(spanning_sp.BuildFrequentWordTable({"ab"}, 2, &table).ok());
+  ASSERT_TRUE(io::SaveFastModel(filename, spanning, table).ok());
+  EXPECT_FALSE(spanning_sp.Load(filename).ok());
+}
+
+TEST(SentencePieceProcessorTest, FastBPEModelTest) {
+  ModelProto model_proto;
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::BPE);
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+
+  AddPiece(&model_proto, "ab", 0.0);
+  AddPiece(&model_proto, WS "ab", -1.0);
+  AddPiece(&model_proto, "abc", -2.0);
+  AddPiece(&model_proto, WS, -3.0);
+  AddPiece(&model_proto, "a", -4.0);
+  AddPiece(&model_proto, "b", -5.0);
+  AddPiece(&model_proto, "c", -6.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "fast_bpe_model");
+  EXPECT_TRUE(io::SaveFastModel(filename, model_proto).ok());
+
+  SentencePieceProcessor sp, fast_sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_TRUE(fast_sp.Load(filename).ok());
+  for (const auto text : {"ab c", "abcab", "a b xabc"}) {
+    EXPECT_EQ(sp.EncodeAsIds(text), fast_sp.EncodeAsIds(text));
+  }
+}
+
+TEST(SentencePieceProcessorTest, OverrideSpecialPieceTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+
+  model_proto.mutable_trainer_spec()->set_unk_piece("__UNK__");
+  model_proto.mutable_trainer_spec()->set_bos_piece("__BOS__");
+  model_proto.mutable_trainer_spec()->set_eos_piece("__EOS__");
+  model_proto.mutable_trainer_spec()->set_pad_piece("__PAD__");
+
+  // No BOS/EOS.
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("__UNK__");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("__BOS__");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("__EOS__");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_EQ(0, sp.unk_id());
+  EXPECT_EQ(1, sp.bos_id());
+  EXPECT_EQ(2, sp.eos_id());
+  EXPECT_EQ(-1, sp.pad_id());
+
+  EXPECT_EQ("__UNK__", sp.IdToPiece(sp.unk_id()));
+  EXPECT_EQ("__BOS__", sp.IdToPiece(sp.bos_id()));
+  EXPECT_EQ("__EOS__", sp.IdToPiece(sp.eos_id()));
+}
+
+TEST(SentencePieceProcessorTest, VocabularyTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+
+  auto GetInlineFilename = [](const std::string content) {
+    {
+      auto out = filesystem::NewWritableFile(
+          util::JoinPath(::testing::TempDir(), "vocab.txt"));
+      out->Write(content);
+    }
+    return util::JoinPath(::testing::TempDir(), "vocab.txt");
+  };
+
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+
+  AddPiece(&model_proto, "aa", 0.0);
+  AddPiece(&model_proto, "bb", 0.0);
+  AddPiece(&model_proto, "cc", 0.0);
+  AddPiece(&model_proto, "dd", 0.0);
+  AddPiece(&model_proto, "e", 0.0);
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  EXPECT_FALSE(sp.IsUnused(0));
+  EXPECT_FALSE(sp.IsUnused(1));
+  EXPECT_FALSE(sp.IsUnused(2));
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_FALSE(sp.IsUnused(4));
+  EXPECT_FALSE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.SetVocabulary({"aa", "dd", "e"}).ok());
+
+  EXPECT_FALSE(sp.IsUnused(0));
+  EXPECT_FALSE(sp.IsUnused(1));
+  EXPECT_FALSE(sp.IsUnused(2));
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));  // single char "e" is always used.
+
+  EXPECT_TRUE(sp.ResetVocabulary().ok());
+
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_FALSE(sp.IsUnused(4));
+  EXPECT_FALSE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.SetVocabulary({"bb"}).ok());
+  EXPECT_TRUE(sp.IsUnused(3));
+  EXPECT_FALSE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_TRUE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t2\n"), 2).ok());
+  EXPECT_TRUE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t1\n"), 2).ok());
+  EXPECT_TRUE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_TRUE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t1\ndd\t1\n"), 1).ok());
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\t0\ndd\t0\n"), 0).ok());
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  // No frequency.
+  EXPECT_TRUE(sp.LoadVocabulary(GetInlineFilename("aa\ndd\n"), 1).ok());
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+}
+
+TEST(SentencePieceProcessorTest, ImmutableSentencePieceTextTest) {
+  ImmutableSentencePieceText spt;
+  EXPECT_TRUE(spt.text().empty());
+  EXPECT_EQ(spt.score(), 0.0);
+  EXPECT_TRUE(spt.SerializeAsString().empty());
+
+  auto *v = spt.mutable_proto();
+  EXPECT_NE(nullptr, v->GetArena());
+
+  v->set_text("hello world");
+  v->set_score(1.0);
+  for (int i = 0; i < 10; ++i) {
+    auto *p = v->add_pieces();
+    p->set_surface(absl::StrCat("surface_", i));
+    p->set_piece(absl::StrCat("surface_", i));
+    p->set_id(i);
+    p->set_begin(i + 10);
+    p->set_end(i + 20);
+  }
+
+  EXPECT_EQ(v->pieces_size(), spt.pieces_size());
+  for (int i = 0; i < spt.pieces_size(); ++i) {
+    EXPECT_EQ(v->pieces(i).surface(), spt.pieces(i).surface());
+    EXPECT_EQ(v->pieces(i).piece(), spt.pieces(i).piece());
+    EXPECT_EQ(v->pieces(i).id(), spt.pieces(i).id());
+    EXPECT_EQ(v->pieces(i).begin(), spt.pieces(i).begin());
+    EXPECT_EQ(v->pieces(i).end(), spt.pieces(i).end());
+  }
+
+  auto check_proto = [&v](const ImmutableSentencePieceText &s) {
+    int n = 0;
+    for (const auto &p : s.pieces()) {
+      EXPECT_EQ(v->pieces(n).surface(), p.surface());
+      EXPECT_EQ(v->pieces(n).piece(), p.piece());
+      EXPECT_EQ(v->pieces(n).id(), p.id());
+      EXPECT_EQ(v->pieces(n).begin(), p.begin());
+      EXPECT_EQ(v->pieces(n).end(), p.end());
+      ++n;
+    }
+    EXPECT_EQ(v->text(), s.text());
+    EXPECT_EQ(v->score(), s.score());
+    EXPECT_EQ(v->SerializeAsString(), s.SerializeAsString());
+  };
+
+  // test copy.
+  const auto spt2 = spt;
+  check_proto(spt2);
 
   // test assign.
   const ImmutableSentencePieceText spt3(spt);
   check_proto(spt3);
 
+  // The copies keep the arena alive.
+  spt = ImmutableSentencePieceText();
+  check_proto(spt2);
+
   // default piece.
   const ImmutableSentencePieceText_ImmutableSentencePiece piece;
   EXPECT_TRUE(piece.surface().empty());
@@ -1654,6 +4630,45 @@ TEST(SentencePieceProcessorTest, ImmutableNBestSentencePieceTextTest) {
   check_proto(spt3);
 }
 
+TEST(SentencePieceProcessorTest, ImmutableRepeatedViewTest) {
+  ImmutableNBestSentencePieceText nbest;
+  EXPECT_TRUE(nbest.nbests().empty());
+  EXPECT_TRUE(ImmutableSentencePieceText().pieces().empty());
+
+  auto *v = nbest.mutable_proto();
+  for (int i = 0; i < 3; ++i) {
+    auto *spt = v->add_nbests();
+    spt->set_text(absl::StrCat("text_", i));
+    for (int j = 0; j < 5; ++j) spt->add_pieces()->set_id(10 * i + j);
+  }
+
+  const auto nbests = nbest.nbests();
+  EXPECT_EQ(3, nbests.size());
+  EXPECT_FALSE(nbests.empty());
+  int i = 0;
+  for (const auto &spt : nbests) {
+    EXPECT_EQ(absl::StrCat("text_", i), spt.text());
+    const auto pieces = spt.pieces();
+    EXPECT_EQ(5, pieces.size());
+    int j = 0;
+    for (auto it = pieces.begin(); it != pieces.end(); ++it, ++j) {
+      EXPECT_EQ(10 * i + j, (*it).id());
+      EXPECT_EQ(10 * i + j, pieces[j].id());
+    }
+    ++i;
+  }
+  EXPECT_EQ(3, i);
+
+  // The view outlives a temporary owner.
+  const auto pieces = ImmutableSentencePieceText(nbest.nbests(1)).pieces();
+  EXPECT_EQ(11, pieces[1].id());
+
+  // Converts to the vector of the former API.
+  const std::vector<ImmutableSentencePieceText> copied = nbest.nbests();
+  ASSERT_EQ(3, copied.size());
+  EXPECT_EQ("text_2", copied[2].text());
+}
+
 TEST(SentencePieceProcessorTest, ConvertToUnicodeSpansTest) {
   auto make_spt = [&](const std::vector<std::string> &tokens) {
     ImmutableSentencePieceText ispt;
@@ -1709,4 +4724,76 @@ TEST(SentencePieceProcessorTest, ConvertToUnicodeSpansTest) {
   }
 }
 
+TEST(SentencePieceProcessorTest, EncodeUnicodeSpansTest) {
+  for (const bool byte_fallback : {false, true}) {
+    ModelProto model_proto;
+    AddPiece(&model_proto, "<unk>", 0.0);
+    AddPiece(&model_proto, "<s>", 0.0);
+    AddPiece(&model_proto, "</s>", 0.0);
+    model_proto.mutable_pieces(0)->set_type(ModelProto::SentencePiece::UNKNOWN);
+    model_proto.mutable_pieces(1)->set_type(ModelProto::SentencePiece::CONTROL);
+    model_proto.mutable_pieces(2)->set_type(ModelProto::SentencePiece::CONTROL);
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "ab", 1.0);
+    AddPiece(&model_proto, "\xE3\x81\x82", 0.5);
+    AddPiece(&model_proto, WS, 3.0);
+    if (byte_fallback) {
+      model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+      for (int i = 0; i < 256; ++i) {
+        AddPiece(&model_proto, ByteToPiece(i), 0.0);
+        model_proto.mutable_pieces(model_proto.pieces_size() - 1)
+            ->set_type(ModelProto::SentencePiece::BYTE);
+      }
+    }
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(sp.SetEncodeExtraOptions("unk").ok());
+
+    EncodeContext context;
+    for (const bool reverse : {false, true}) {
+      EncodeOptions options;
+      options.add_bos = true;
+      options.add_eos = true;
+      options.reverse = reverse;
+      for (const auto *text :
+           {"", "ab", "a b ab", "xyz ab", "\xEF\xBC\xA1\xEF\xBC\xA2 ab",
+            "ab \xE3\x81\x82\xE3\x81\x84 b"}) {
+        // The same spans as ConvertToUnicodeSpans() after the encoding.
+        ImmutableSentencePieceText expected;
+        options.unicode_spans = false;
+        ASSERT_TRUE(
+            sp.Encode(text, options, expected.mutable_proto(), &context).ok());
+        expected.ConvertToUnicodeSpans();
+
+        options.unicode_spans = true;
+        SentencePieceText spt;
+        ASSERT_TRUE(sp.Encode(text, options, &spt, &context).ok());
+        EXPECT_EQ(expected.SerializeAsString(), spt.SerializeAsString())
+            << text;
+      }
+    }
+
+    {
+      EncodeOptions options;
+      options.unicode_spans = true;
+      SentencePieceText spt;
+      ASSERT_TRUE(sp.Encode("\xE3\x81\x82"
+                            "b",
+                            options, &spt, &context)
+                      .ok());
+      ASSERT_EQ(3, spt.pieces_size());
+      EXPECT_EQ(0, spt.pieces(1).begin());
+      EXPECT_EQ(1, spt.pieces(1).end());
+      EXPECT_EQ(1, spt.pieces(2).begin());
+      EXPECT_EQ(2, spt.pieces(2).end());
+
+      options.max_tokens = 1;
+      EXPECT_FALSE(sp.Encode("ab", options, &spt, &context).ok());
+    }
+  }
+}
+
 }  // namespace sentencepiece
@@ -14,7 +14,15 @@
 
 #include "sentencepiece_trainer.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "builder.h"
@@ -35,6 +43,99 @@
 namespace sentencepiece {
 namespace {
 static constexpr char kDefaultNormalizerName[] = "nmt_nfkc";
+
+// Options of the next Train() call, set by the Set*ForTraining() methods.
+// Train() takes them and leaves the defaults, so that they do not leak into
+// the later trainings of the process.
+struct TrainingOptions {
+  // Set by SetCheckpointForTraining().
+  std::string checkpoint_path;
+  int checkpoint_interval = 0;
+  std::string resume_from;
+
+  // Set by SetDistributedTraining().
+  std::string distributed_dir;
+  int num_shards = 1;
+  int shard_id = 0;
+
+  // Set by SetMetricsReportForTraining().
+  std::string metrics_report;
+
+  // Set by SetEMConvergenceForTraining().
+  double em_tolerance = 0.0;
+
+  // Set by SetStochasticEMForTraining().
+  int em_num_batches = 1;
+  double em_step_decay = 0.7;
+
+  // Set by SetExtraVocabSizesForTraining().
+  std::vector<int> extra_vocab_sizes;
+
+  // Set by SetCorpusCacheForTraining().
+  std::string corpus_cache_dir;
+
+  // Set by SetExternalMemoryForTraining().
+  std::string external_memory_dir;
+
+  // Set by SetSuffixArrayBackendForTraining().
+  TrainerInterface::SuffixArrayBackend suffix_array_backend =
+      TrainerInterface::SuffixArrayBackend::kSais;
+
+  // Set by SetLatticeCacheForTraining().
+  size_t lattice_cache_size = 0;
+
+  // Set by SetBPEWordEngineForTraining().
+  bool use_word_engine = false;
+
+  // Set by SetEStepAccumulatorForTraining().
+  TrainerInterface::EStepAccumulator estep_accumulator =
+      TrainerInterface::EStepAccumulator::kFloat;
+
+  // Set by SetBaseModelForTraining().
+  std::unique_ptr<ModelProto> base_model;
+  int num_new_pieces = 0;
+};
+
+TrainingOptions g_options;
+
+// Makes the specs of a training which adds `num_new_pieces` pieces to
+// `base_model`. The fields which define the pieces and how they are
+// encoded come from the base model, the others from `trainer_spec`.
+util::Status MakeExtensionSpecs(const ModelProto &base_model,
+                                int num_new_pieces, TrainerSpec *trainer_spec,
+                                NormalizerSpec *normalizer_spec,
+                                NormalizerSpec *denormalizer_spec) {
+  CHECK_EQ_OR_RETURN(trainer_spec->model_type(), TrainerSpec::UNIGRAM)
+      << "Only unigram models can be extended.";
+  const TrainerSpec &base = base_model.trainer_spec();
+  trainer_spec->set_vocab_size(base_model.pieces_size() + num_new_pieces);
+  trainer_spec->set_unk_id(base.unk_id());
+  trainer_spec->set_bos_id(base.bos_id());
+  trainer_spec->set_eos_id(base.eos_id());
+  trainer_spec->set_pad_id(base.pad_id());
+  trainer_spec->set_unk_piece(base.unk_piece());
+  trainer_spec->set_bos_piece(base.bos_piece());
+  trainer_spec->set_eos_piece(base.eos_piece());
+  trainer_spec->set_pad_piece(base.pad_piece());
+  trainer_spec->set_unk_surface(base.unk_surface());
+  *trainer_spec->mutable_control_symbols() = base.control_symbols();
+  *trainer_spec->mutable_user_defined_symbols() = base.user_defined_symbols();
+  trainer_spec->set_byte_fallback(base.byte_fallback());
+  trainer_spec->set_treat_whitespace_as_suffix(
+      base.treat_whitespace_as_suffix());
+  trainer_spec->set_allow_whitespace_only_pieces(
+      base.allow_whitespace_only_pieces());
+  trainer_spec->set_split_by_unicode_script(base.split_by_unicode_script());
+  trainer_spec->set_split_by_number(base.split_by_number());
+  trainer_spec->set_split_by_whitespace(base.split_by_whitespace());
+  trainer_spec->set_split_digits(base.split_digits());
+  trainer_spec->set_max_sentencepiece_length(base.max_sentencepiece_length());
+  *normalizer_spec = base_model.normalizer_spec();
+  if (base_model.has_denormalizer_spec()) {
+    *denormalizer_spec = base_model.denormalizer_spec();
+  }
+  return util::OkStatus();
+}
 }  // namespace
 
 // static
@@ -60,14 +161,47 @@ util::Status SentencePieceTrainer::Train(
     const TrainerSpec &trainer_spec, const NormalizerSpec &normalizer_spec,
     const NormalizerSpec &denormalizer_spec,
     SentenceIterator *sentence_iterator, std::string *serialized_model_proto) {
+  const TrainingOptions options = std::exchange(g_options, TrainingOptions());
+  auto copied_trainer_spec = trainer_spec;
   auto copied_normalizer_spec = normalizer_spec;
   RETURN_IF_ERROR(PopulateNormalizerSpec(&copied_normalizer_spec, false));
   auto copied_denormalizer_spec = denormalizer_spec;
   RETURN_IF_ERROR(PopulateNormalizerSpec(&copied_denormalizer_spec, true));
-  auto trainer = TrainerFactory::Create(trainer_spec, copied_normalizer_spec,
-                                        copied_denormalizer_spec);
+  if (options.base_model != nullptr) {
+    RETURN_IF_ERROR(MakeExtensionSpecs(
+        *options.base_model, options.num_new_pieces, &copied_trainer_spec,
+        &copied_normalizer_spec, &copied_denormalizer_spec));
+  }
+  auto trainer = TrainerFactory::Create(
+      copied_trainer_spec, copied_normalizer_spec, copied_denormalizer_spec);
+  trainer->SetCheckpoint(options.checkpoint_path, options.checkpoint_interval,
+                         options.resume_from);
+  trainer->SetEMTolerance(options.em_tolerance);
+  trainer->SetStochasticEM(options.em_num_batches, options.em_step_decay);
+  trainer->SetBaseModel(options.base_model.get());
+  trainer->SetCorpusCache(options.corpus_cache_dir);
+  trainer->SetExternalMemory(options.external_memory_dir);
+  trainer->SetSuffixArrayBackend(options.suffix_array_backend);
+  trainer->SetLatticeCacheSize(options.lattice_cache_size);
+  trainer->SetWordEngine(options.use_word_engine);
+  trainer->SetEStepAccumulator(options.estep_accumulator);
+  if (!options.extra_vocab_sizes.empty()) {
+    CHECK_OR_RETURN(trainer_spec.model_type() == TrainerSpec::UNIGRAM ||
+                    trainer_spec.model_type() == TrainerSpec::BPE)
+        << "Extra vocab sizes are supported only by the unigram and BPE "
+           "models.";
+    CHECK_OR_RETURN(serialized_model_proto == nullptr)
+        << "Extra vocab sizes need a model_prefix to save the models.";
+    trainer->SetExtraVocabSizes(options.extra_vocab_sizes);
+  }
+  if (options.num_shards > 1) {
+    CHECK_EQ_OR_RETURN(trainer_spec.model_type(), TrainerSpec::UNIGRAM)
+        << "Distributed training supports only the unigram model.";
+    trainer->SetDistributed(options.distributed_dir, options.num_shards,
+                            options.shard_id);
+  }
   std::string info =
-      absl::StrCat(PrintProto(trainer_spec, "trainer_spec"),
+      absl::StrCat(PrintProto(copied_trainer_spec, "trainer_spec"),
                    PrintProto(copied_normalizer_spec, "normalizer_spec"));
   if (!copied_denormalizer_spec.precompiled_charsmap().empty()) {
     info += PrintProto(copied_denormalizer_spec, "denormalizer_spec");
@@ -85,6 +219,12 @@ util::Status SentencePieceTrainer::Train(
     RETURN_IF_ERROR(trainer->Train(sentence_iterator, nullptr));
   }
 
+  trainer->metrics().LogSummary();
+  if (!options.metrics_report.empty()) {
+    RETURN_IF_ERROR(WriteFileAtomically(options.metrics_report,
+                                        trainer->metrics().ToJson()));
+  }
+
   return util::OkStatus();
 }
 
@@ -179,8 +319,11 @@ util::Status SentencePieceTrainer::Train(absl::string_view args,
   TrainerSpec trainer_spec;
   NormalizerSpec normalizer_spec;
   NormalizerSpec denormalizer_spec;
-  RETURN_IF_ERROR(MergeSpecsFromArgs(args, &trainer_spec, &normalizer_spec,
-                                     &denormalizer_spec));
+  const util::Status status = MergeSpecsFromArgs(
+      args, &trainer_spec, &normalizer_spec, &denormalizer_spec);
+  // The options set for this call do not outlive it either.
+  if (!status.ok()) g_options = TrainingOptions();
+  RETURN_IF_ERROR(status);
   return Train(trainer_spec, normalizer_spec, denormalizer_spec,
                sentence_iterator, serialized_model_proto);
 }
@@ -192,8 +335,11 @@ util::Status SentencePieceTrainer::Train(
   TrainerSpec trainer_spec;
   NormalizerSpec normalizer_spec;
   NormalizerSpec denormalizer_spec;
-  RETURN_IF_ERROR(MergeSpecsFromArgs(kwargs, &trainer_spec, &normalizer_spec,
-                                     &denormalizer_spec));
+  const util::Status status = MergeSpecsFromArgs(
+      kwargs, &trainer_spec, &normalizer_spec, &denormalizer_spec);
+  // The options set for this call do not outlive it either.
+  if (!status.ok()) g_options = TrainingOptions();
+  RETURN_IF_ERROR(status);
   return Train(trainer_spec, normalizer_spec, denormalizer_spec,
                sentence_iterator, serialized_model_proto);
 }
@@ -215,6 +361,102 @@ class VectorSentenceIterator : public SentenceIterator {
 };
 }  // namespace
 
+struct PrefetchingSentenceIterator::Queue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<std::string>> batches;
+  // Consumed batches, which are refilled to reuse the string buffers.
+  std::vector<std::vector<std::string>> free_batches;
+  bool finished = false;
+  bool stopped = false;
+  util::Status status;
+  std::thread thread;
+};
+
+PrefetchingSentenceIterator::PrefetchingSentenceIterator(
+    SentenceIterator *source, size_t batch_size, size_t max_batches)
+    : queue_(std::make_unique<Queue>()) {
+  batch_size = std::max<size_t>(1, batch_size);
+  max_batches = std::max<size_t>(1, max_batches);
+  Queue *queue = queue_.get();
+  queue->thread = std::thread([queue, source, batch_size, max_batches]() {
+    std::vector<std::string> batch;
+    for (;;) {
+      size_t size = 0;
+      for (; size < batch_size && !source->done(); source->Next()) {
+        if (size < batch.size()) {
+          batch[size++] = source->value();
+        } else {
+          batch.push_back(source->value());
+          ++size;
+        }
+      }
+      batch.resize(size);
+
+      std::unique_lock<std::mutex> lock(queue->mutex);
+      queue->cv.wait(lock, [&]() {
+        return queue->stopped || queue->batches.size() < max_batches;
+      });
+      if (queue->stopped) return;
+      if (!batch.empty()) queue->batches.emplace_back(std::move(batch));
+      if (source->done()) {
+        queue->status = source->status();
+        queue->finished = true;
+        queue->cv.notify_all();
+        return;
+      }
+      batch.clear();
+      if (!queue->free_batches.empty()) {
+        batch = std::move(queue->free_batches.back());
+        queue->free_batches.pop_back();
+      }
+      queue->cv.notify_all();
+    }
+  });
+  Fetch();
+}
+
+PrefetchingSentenceIterator::~PrefetchingSentenceIterator() {
+  {
+    std::lock_guard<std::mutex> lock(queue_->mutex);
+    queue_->stopped = true;
+  }
+  queue_->cv.notify_all();
+  queue_->thread.join();
+}
+
+void PrefetchingSentenceIterator::Fetch() {
+  index_ = 0;
+  std::unique_lock<std::mutex> lock(queue_->mutex);
+  queue_->cv.wait(
+      lock, [this]() { return queue_->finished || !queue_->batches.empty(); });
+  if (!batch_.empty()) queue_->free_batches.emplace_back(std::move(batch_));
+  batch_.clear();
+  if (!queue_->batches.empty()) {
+    batch_ = std::move(queue_->batches.front());
+    queue_->batches.pop_front();
+  }
+  queue_->cv.notify_all();
+}
+
+void PrefetchingSentenceIterator::Next() {
+  if (++index_ >= batch_.size()) Fetch();
+}
+
+bool PrefetchingSentenceIterator::NextBatch(
+    const std::vector<std::string> **batch) {
+  if (index_ > 0) Fetch();
+  if (batch_.empty()) return false;
+  *batch = &batch_;
+  index_ = batch_.size();
+  return true;
+}
+
+util::Status PrefetchingSentenceIterator::status() const {
+  std::lock_guard<std::mutex> lock(queue_->mutex);
+  return queue_->status;
+}
+
 // static
 util::Status SentencePieceTrainer::Train(
     absl::string_view args, const std::vector<std::string> &sentences,
@@ -295,6 +537,144 @@ SentencePieceTrainer::GetPretokenizerForTraining() {
   return g_pretokenizer;
 }
 
+// static
+util::Status SentencePieceTrainer::SetCheckpointForTraining(
+    absl::string_view checkpoint_path, int checkpoint_interval,
+    absl::string_view resume_from) {
+  CHECK_GE_OR_RETURN(checkpoint_interval, 0);
+  g_options.checkpoint_path = std::string(checkpoint_path);
+  g_options.checkpoint_interval = checkpoint_interval;
+  g_options.resume_from = std::string(resume_from);
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetDistributedTraining(
+    absl::string_view directory, int num_shards, int shard_id) {
+  CHECK_GE_OR_RETURN(num_shards, 1);
+  CHECK_OR_RETURN(shard_id >= 0 && shard_id < num_shards)
+      << "shard_id must be in [0, num_shards).";
+  CHECK_OR_RETURN(num_shards == 1 || !directory.empty())
+      << "Distributed training needs a directory.";
+  g_options.distributed_dir = std::string(directory);
+  g_options.num_shards = num_shards;
+  g_options.shard_id = shard_id;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetMetricsReportForTraining(
+    absl::string_view filename) {
+  g_options.metrics_report = std::string(filename);
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetEMConvergenceForTraining(
+    double tolerance) {
+  CHECK_GE_OR_RETURN(tolerance, 0.0);
+  g_options.em_tolerance = tolerance;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetStochasticEMForTraining(
+    int num_batches, double step_decay) {
+  CHECK_GE_OR_RETURN(num_batches, 1);
+  CHECK_OR_RETURN(step_decay > 0.5 && step_decay <= 1.0)
+      << "step_decay must be in (0.5, 1].";
+  g_options.em_num_batches = num_batches;
+  g_options.em_step_decay = step_decay;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetExtraVocabSizesForTraining(
+    const std::vector<int> &vocab_sizes) {
+  for (const int size : vocab_sizes) CHECK_GT_OR_RETURN(size, 0);
+  g_options.extra_vocab_sizes = vocab_sizes;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetBaseModelForTraining(
+    absl::string_view filename, int num_new_pieces) {
+  if (filename.empty()) {
+    g_options.base_model.reset();
+    g_options.num_new_pieces = 0;
+    return util::OkStatus();
+  }
+  CHECK_GT_OR_RETURN(num_new_pieces, 0);
+  auto base_model = std::make_unique<ModelProto>();
+  RETURN_IF_ERROR(io::LoadModelProto(filename, base_model.get()));
+  CHECK_EQ_OR_RETURN(base_model->trainer_spec().model_type(),
+                     TrainerSpec::UNIGRAM)
+      << "Only unigram models can be extended.";
+  g_options.base_model = std::move(base_model);
+  g_options.num_new_pieces = num_new_pieces;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetCorpusCacheForTraining(
+    absl::string_view directory) {
+  g_options.corpus_cache_dir = std::string(directory);
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetExternalMemoryForTraining(
+    absl::string_view directory) {
+  g_options.external_memory_dir = std::string(directory);
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetSuffixArrayBackendForTraining(
+    absl::string_view name) {
+  if (name == "sais") {
+    g_options.suffix_array_backend = TrainerInterface::SuffixArrayBackend::kSais;
+  } else if (name == "doubling") {
+    g_options.suffix_array_backend =
+        TrainerInterface::SuffixArrayBackend::kParallelDoubling;
+  } else {
+    return util::InvalidArgumentError(
+        absl::StrCat("Unknown suffix array backend: ", name));
+  }
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetLatticeCacheForTraining(size_t size) {
+  CHECK_LE_OR_RETURN(size, static_cast<size_t>(
+                               std::numeric_limits<int64>::max()));
+  g_options.lattice_cache_size = size;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetBPEWordEngineForTraining(bool enabled) {
+  g_options.use_word_engine = enabled;
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceTrainer::SetEStepAccumulatorForTraining(
+    absl::string_view name) {
+  using EStepAccumulator = TrainerInterface::EStepAccumulator;
+  if (name == "float") {
+    g_options.estep_accumulator = EStepAccumulator::kFloat;
+  } else if (name == "double") {
+    g_options.estep_accumulator = EStepAccumulator::kDouble;
+  } else if (name == "kahan") {
+    g_options.estep_accumulator = EStepAccumulator::kKahan;
+  } else {
+    return util::InvalidArgumentError(
+        absl::StrCat("Unknown E step accumulator: ", name));
+  }
+  return util::OkStatus();
+}
+
 SentencePieceNormalizer::SentencePieceNormalizer() {}
 SentencePieceNormalizer::~SentencePieceNormalizer() {}
 
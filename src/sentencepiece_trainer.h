@@ -15,6 +15,7 @@
 #ifndef SENTENCEPIECE_TRAINER_H_
 #define SENTENCEPIECE_TRAINER_H_
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -55,6 +56,57 @@ class SentenceIterator {
   virtual util::Status status() const = 0;
 };
 
+// Iterator over batches of training sentences. The per-sentence virtual
+// calls and synchronization of SentenceIterator are paid once per batch.
+//
+// const std::vector<std::string> *batch = nullptr;
+// while (it.NextBatch(&batch)) {
+//   for (const std::string &s : *batch) { ... }
+// }
+// RETURN_IF_ERROR(it.status());
+//
+class SentenceBatchIterator {
+ public:
+  virtual ~SentenceBatchIterator() {}
+  // Points `batch` to the next non-empty batch, which is valid until the
+  // next call. Returns false at the end, including the error case.
+  virtual bool NextBatch(const std::vector<std::string> **batch) = 0;
+  virtual util::Status status() const = 0;
+};
+
+// Reads the sentences of `source` ahead on a background thread into a
+// bounded queue of `max_batches` batches of `batch_size` sentences, so that
+// the reading overlaps with the processing of the sentences. `source` is
+// used by the background thread only and must not be bound to the calling
+// thread, e.g., an iterator calling back into Python. Use either the
+// SentenceIterator or the SentenceBatchIterator interface, not both.
+class PrefetchingSentenceIterator : public SentenceIterator,
+                                    public SentenceBatchIterator {
+ public:
+  explicit PrefetchingSentenceIterator(SentenceIterator *source,
+                                       size_t batch_size = 1024,
+                                       size_t max_batches = 4);
+  // Stops the background thread. `source` may be left in the middle.
+  ~PrefetchingSentenceIterator() override;
+
+  bool done() const override { return index_ >= batch_.size(); }
+  void Next() override;
+  const std::string &value() const override { return batch_[index_]; }
+  bool NextBatch(const std::vector<std::string> **batch) override;
+  util::Status status() const override;
+
+ private:
+  struct Queue;
+
+  // Replaces batch_ with the next batch of the queue. batch_ is empty at
+  // the end.
+  void Fetch();
+
+  std::unique_ptr<Queue> queue_;
+  std::vector<std::string> batch_;
+  size_t index_ = 0;
+};
+
 class SentencePieceTrainer {
  public:
   // Trains SentencePiece model with `trainer_spec`.
@@ -141,6 +193,113 @@ class SentencePieceTrainer {
   static const pretokenizer::PretokenizerForTrainingInterface *
   GetPretokenizerForTraining();
 
+  // The options below apply to the next Train() call only, which resets
+  // them to their defaults whether it succeeds or not.
+
+  // Sets the checkpoint options of the trainers created by Train().
+  // When `checkpoint_path` is not empty, the training state is written there
+  // every `checkpoint_interval` EM rounds (unigram) or merges (bpe). 0 uses
+  // the default of the trainer. When `resume_from` is not empty, training
+  // restarts from that checkpoint, skipping the seeding and the completed
+  // steps. The corpus is still loaded. Empty paths disable them.
+  static util::Status SetCheckpointForTraining(
+      absl::string_view checkpoint_path, int checkpoint_interval,
+      absl::string_view resume_from);
+
+  // Makes Train() run the shard `shard_id` of a distributed unigram job of
+  // `num_shards` processes, which exchange their statistics as files in
+  // `directory`. Each process trains on its own `input`. Shard 0
+  // coordinates the job and saves the model; the others exit when it is
+  // done. `num_shards` = 1 trains on one process.
+  static util::Status SetDistributedTraining(absl::string_view directory,
+                                             int num_shards, int shard_id);
+
+  // Makes Train() write the wall time, CPU time, peak memory and throughput
+  // of the training phases to `filename` as JSON. An empty name disables
+  // the report. The totals of the phases are logged in any case.
+  static util::Status SetMetricsReportForTraining(absl::string_view filename);
+
+  // Makes the unigram trainer skip the remaining EM sub-iterations of a
+  // pruning round once the objective changes by less than `tolerance`
+  // relative to the previous sub-iteration, e.g. 1e-4. It saves time when
+  // `num_sub_iterations` is large. 0 runs all the sub-iterations.
+  static util::Status SetEMConvergenceForTraining(double tolerance);
+
+  // Makes the unigram trainer run stochastic EM on large corpora: the E
+  // steps before the last pruning round each process one of `num_batches`
+  // slices of the sentences in turn, and the expected counts are smoothed
+  // over the steps with the step size (t + 2)^-`step_decay`, which must be
+  // in (0.5, 1]. The last round runs the full E steps. `num_batches` = 1
+  // disables it. Distributed jobs always run the full E steps.
+  static util::Status SetStochasticEMForTraining(int num_batches,
+                                                 double step_decay = 0.7);
+
+  // Makes Train() of a unigram model also save the models of the
+  // `vocab_sizes` larger than `vocab_size`, e.g. {16000, 32000, 64000} when
+  // training 8000 pieces, as <model_prefix>.<size>.model and
+  // <model_prefix>.<size>.vocab. They are taken as the pruning passes
+  // through their sizes, so a single run makes all the models. A BPE model
+  // saves the `vocab_sizes` smaller than `vocab_size` instead, from the
+  // first merges of the run. Empty disables it.
+  static util::Status SetExtraVocabSizesForTraining(
+      const std::vector<int> &vocab_sizes);
+
+  // Makes Train() adapt the unigram model `filename` to a new corpus
+  // instead of training from scratch. Its pieces are the seed along with
+  // the candidates of the corpus, and EM rounds select `num_new_pieces` new
+  // pieces. The output model keeps the pieces of the base model with their
+  // ids, types and normalization, with the scores re-estimated on the
+  // corpus, followed by the new pieces. `vocab_size` and the special pieces
+  // come from the base model. A smaller `seed_sentencepiece_size`, e.g. ten
+  // times `num_new_pieces`, takes fewer rounds. An empty name disables it.
+  static util::Status SetBaseModelForTraining(absl::string_view filename,
+                                              int num_new_pieces);
+
+  // Makes Train() save the corpus loaded from the input files, after the
+  // sampling, the normalization and the whitespace split, to a binary cache
+  // file in the existing `directory`, and load it from there in the later
+  // runs with the same input files, normalizer and loading options, e.g.
+  // in a sweep over vocab_size. The files are told apart by their names,
+  // sizes and modification times. Sampled corpora need a fixed random seed
+  // to be reused. An empty directory disables it.
+  static util::Status SetCorpusCacheForTraining(absl::string_view directory);
+
+  // Makes the unigram trainer keep the text of the sentences of the EM
+  // training in a file in the existing `directory`, mapped into memory,
+  // instead of on the heap, so that corpora larger than the memory can be
+  // trained. The E steps read the file sequentially. The file is removed
+  // once mapped. An empty directory disables it.
+  static util::Status SetExternalMemoryForTraining(
+      absl::string_view directory);
+
+  // Selects how the unigram trainer builds the suffix array from which the
+  // seed pieces are extracted: "sais", the default, runs the linear time
+  // SA-IS on one thread, and "doubling" runs prefix doubling on the
+  // `num_threads` workers, which is faster on large corpora. Both make the
+  // same seed pieces.
+  static util::Status SetSuffixArrayBackendForTraining(
+      absl::string_view name);
+
+  // Makes the unigram trainer keep up to `size` bytes of the lattices of
+  // the sentences between the E steps of EM, so that they are rebuilt
+  // without looking up the pieces again. The sentences which do not fit
+  // are looked up as usual. The model is the same in any case. 0 disables
+  // it.
+  static util::Status SetLatticeCacheForTraining(size_t size);
+
+  // Makes the BPE trainer merge the pairs over the distinct words of the
+  // corpus as arrays of symbol ids, keeping the exact frequency of every
+  // pair, when `split_by_whitespace` is true. It is faster on large
+  // vocabularies, but the best pair is searched among all of them, so the
+  // pieces may differ slightly, and it does not write checkpoints.
+  static util::Status SetBPEWordEngineForTraining(bool enabled);
+
+  // Selects how the unigram trainer sums the expected counts and the
+  // objective over the corpus in the E steps: "float", the default and the
+  // fastest, "double", or "kahan" for compensated float sums. The float
+  // sums lose precision on large corpora.
+  static util::Status SetEStepAccumulatorForTraining(absl::string_view name);
+
   // Helper function to set `field_name=value` in `message`.
   // When `field_name` is repeated, multiple values can be passed
   // with comma-separated values. `field_name` must not be a nested message.
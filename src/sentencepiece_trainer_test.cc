@@ -14,6 +14,8 @@
 
 #include "sentencepiece_trainer.h"
 
+#include <cstdio>
+
 #include "filesystem.h"
 #include "sentencepiece_model.pb.h"
 #include "testharness.h"
@@ -152,6 +154,78 @@ TEST(SentencePieceTrainerTest, TrainFromIterator) {
   CheckNormalizer(model + ".model", true, false);
 }
 
+TEST(SentencePieceTrainerTest, PrefetchingSentenceIteratorTest) {
+  // Fails after `size` sentences when `error` is set.
+  class CountingIterator : public SentenceIterator {
+   public:
+    CountingIterator(size_t size, bool error) : size_(size), error_(error) {
+      value_ = "0";
+    }
+
+    bool done() const override { return index_ == size_; }
+    void Next() override { value_ = std::to_string(++index_); }
+    const std::string &value() const override { return value_; }
+    util::Status status() const override {
+      return error_ ? util::Status(util::StatusCode::kInternal, "read error")
+                    : util::OkStatus();
+    }
+
+   private:
+    size_t size_ = 0;
+    size_t index_ = 0;
+    bool error_ = false;
+    std::string value_;
+  };
+
+  for (const size_t size : {0, 1, 7, 10000}) {
+    for (const size_t batch_size : {1, 7, 1024}) {
+      {
+        CountingIterator source(size, false);
+        PrefetchingSentenceIterator it(&source, batch_size, 2);
+        size_t n = 0;
+        for (; !it.done(); it.Next(), ++n) {
+          EXPECT_EQ(std::to_string(n), it.value());
+        }
+        EXPECT_EQ(size, n);
+        EXPECT_OK(it.status());
+      }
+      {
+        CountingIterator source(size, false);
+        PrefetchingSentenceIterator it(&source, batch_size, 2);
+        const std::vector<std::string> *batch = nullptr;
+        size_t n = 0;
+        while (it.NextBatch(&batch)) {
+          EXPECT_FALSE(batch->empty());
+          EXPECT_GE(batch_size, batch->size());
+          for (const auto &value : *batch) {
+            EXPECT_EQ(std::to_string(n++), value);
+          }
+        }
+        EXPECT_EQ(size, n);
+        EXPECT_FALSE(it.NextBatch(&batch));
+        EXPECT_OK(it.status());
+      }
+    }
+  }
+
+  // The error of the source is reported at the end.
+  {
+    CountingIterator source(100, true);
+    PrefetchingSentenceIterator it(&source, 8, 2);
+    size_t n = 0;
+    for (; !it.done(); it.Next()) ++n;
+    EXPECT_EQ(100, n);
+    EXPECT_FALSE(it.status().ok());
+  }
+
+  // Stops reading when destroyed in the middle.
+  {
+    CountingIterator source(1000000, false);
+    PrefetchingSentenceIterator it(&source, 16, 2);
+    EXPECT_EQ("0", it.value());
+  }
+}
+
 TEST(SentencePieceTrainerTest, TrainWithCustomNormalizationRule) {
   std::string input =
       util::JoinPath(::testing::SrcDir(), kTestData);
@@ -208,6 +282,85 @@ TEST(SentencePieceTrainerTest, TrainTest) {
   ASSERT_TRUE(SentencePieceTrainer::Train(trainer_spec).ok());
 }
 
+TEST(SentencePieceTrainerTest, MetricsReportTest) {
+  const std::string report =
+      util::JoinPath(::testing::TempDir(), "metrics.json");
+  auto train = [](absl::string_view model_type) {
+    return SentencePieceTrainer::Train(absl::StrCat(
+        "--input=", util::JoinPath(::testing::SrcDir(), kTestData),
+        " --model_prefix=",
+        util::JoinPath(::testing::TempDir(), "metrics_model"),
+        " --vocab_size=300 --model_type=", model_type));
+  };
+  for (const auto *model_type : {"unigram", "bpe"}) {
+    ASSERT_TRUE(
+        SentencePieceTrainer::SetMetricsReportForTraining(report).ok());
+    ASSERT_TRUE(train(model_type).ok());
+    std::string json;
+    auto input = filesystem::NewReadableFile(report);
+    ASSERT_TRUE(input->ReadAll(&json));
+    EXPECT_EQ(0, json.find("{\"phases\": [{\"name\": "));
+    EXPECT_NE(std::string::npos, json.find("\"name\": \"load_sentences\""));
+    EXPECT_NE(std::string::npos, json.find("\"name\": \"save\""));
+    EXPECT_NE(std::string::npos, json.find("\"items_per_second\": "));
+    if (std::string(model_type) == "unigram") {
+      EXPECT_NE(std::string::npos,
+                json.find("\"name\": \"seed_suffix_array\""));
+      EXPECT_NE(std::string::npos, json.find("\"name\": \"em_iteration\""));
+      EXPECT_NE(std::string::npos, json.find("\"name\": \"prune\""));
+    } else {
+      EXPECT_NE(std::string::npos,
+                json.find("\"name\": \"bpe_merge_batch\""));
+    }
+  }
+
+  // The report is written by the next Train() call only, even when it
+  // fails.
+  ASSERT_TRUE(SentencePieceTrainer::SetMetricsReportForTraining(report).ok());
+  EXPECT_FALSE(train("dummy").ok());
+  ASSERT_EQ(0, std::remove(report.c_str()));
+  ASSERT_TRUE(train("unigram").ok());
+  EXPECT_FALSE(filesystem::NewReadableFile(report)->status().ok());
+}
+
+TEST(SentencePieceTrainerTest, SuffixArrayBackendTest) {
+  EXPECT_FALSE(
+      SentencePieceTrainer::SetSuffixArrayBackendForTraining("dummy").ok());
+  std::vector<std::string> vocabs;
+  for (const auto *backend : {"sais", "doubling"}) {
+    ASSERT_TRUE(
+        SentencePieceTrainer::SetSuffixArrayBackendForTraining(backend).ok());
+    const std::string prefix = util::JoinPath(
+        ::testing::TempDir(), absl::StrCat("suffix_array_", backend));
+    ASSERT_TRUE(SentencePieceTrainer::Train(absl::StrCat(
+                    "--input=", util::JoinPath(::testing::SrcDir(), kTestData),
+                    " --model_prefix=", prefix,
+                    " --vocab_size=300 --num_threads=4"))
+                    .ok());
+    std::string vocab;
+    auto input = filesystem::NewReadableFile(prefix + ".vocab");
+    ASSERT_TRUE(input->ReadAll(&vocab));
+    vocabs.push_back(vocab);
+  }
+  EXPECT_EQ(vocabs[0], vocabs[1]);
+}
+
+TEST(SentencePieceTrainerTest, EStepAccumulatorTest) {
+  EXPECT_FALSE(
+      SentencePieceTrainer::SetEStepAccumulatorForTraining("dummy").ok());
+  for (const auto *accumulator : {"double", "kahan", "float"}) {
+    ASSERT_TRUE(
+        SentencePieceTrainer::SetEStepAccumulatorForTraining(accumulator)
+            .ok());
+    EXPECT_TRUE(SentencePieceTrainer::Train(absl::StrCat(
+                    "--input=", util::JoinPath(::testing::SrcDir(), kTestData),
+                    " --model_prefix=",
+                    util::JoinPath(::testing::TempDir(), "estep_model"),
+                    " --vocab_size=300"))
+                    .ok());
+  }
+}
+
 TEST(SentencePieceTrainerTest, SetProtoFieldTest) {
   {
     TrainerSpec spec;
@@ -0,0 +1,245 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shared_word_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+#if !defined(OS_WIN)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sentencepiece {
+
+// An entry of 112 bytes: the word, the byte length of each piece, and the
+// ids of the pieces as 4 bytes in the native order. All the fields are
+// atomics, so the racing copies of a reader are well defined; the sequence
+// tells whether the copy is consistent.
+struct SharedWordCache::Slot {
+  static constexpr size_t kDataWords = 14;
+  static constexpr size_t kDataSize = kDataWords * sizeof(uint64);
+
+  std::atomic<uint32> sequence;
+  std::atomic<uint32> sizes;  // word size | number of pieces << 8.
+  std::atomic<uint64> hash;   // 0 for an empty slot.
+  std::atomic<uint64> data[kDataWords];
+};
+
+namespace {
+
+// Slots probed for a word, from the one of its hash.
+constexpr size_t kMaxProbes = 4;
+
+static_assert(sizeof(std::atomic<uint64>) == sizeof(uint64),
+              "atomics must have the layout of the values in shared memory");
+
+// Hash of a word in the table. Never 0, which marks the empty slots.
+inline uint64 WordHash(absl::string_view word) {
+  const uint64 hash = SharedWordCache::Fingerprint(word);
+  return hash == 0 ? 1 : hash;
+}
+
+#if !defined(OS_WIN)
+std::string SharedMemoryName(uint64 fingerprint, size_t num_slots) {
+  return absl::StrCat("/spm_word_cache_", string_util::IntToHex(fingerprint),
+                      "_", num_slots);
+}
+#endif
+}  // namespace
+
+SharedWordCache::SharedWordCache(uint64 fingerprint, size_t num_slots,
+                                 int piece_size)
+    : num_slots_(num_slots), piece_size_(piece_size) {
+#if defined(OS_WIN)
+  status_ = util::UnimplementedError(
+      "The shared word cache needs POSIX shared memory.");
+#else
+  if (num_slots == 0) {
+    status_ = util::InvalidArgumentError("The cache needs a slot.");
+    return;
+  }
+  const std::string name = SharedMemoryName(fingerprint, num_slots);
+  const size_t size = num_slots * sizeof(Slot);
+  const int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    status_ = util::StatusBuilder(util::StatusCode::kPermissionDenied, GTL_LOC)
+              << "\"" << name << "\": " << util::StrError(errno);
+    return;
+  }
+  // A new object is empty and is zero-filled by the first process; the
+  // others find it at its size. A zero slot is empty.
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      (st.st_size == 0 && ::ftruncate(fd, size) != 0) ||
+      (st.st_size != 0 && static_cast<size_t>(st.st_size) != size)) {
+    status_ = util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+              << "\"" << name << "\" cannot be sized to " << size
+              << " bytes.";
+    ::close(fd);
+    return;
+  }
+  void *addr =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    status_ = util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+              << "\"" << name << "\": " << util::StrError(errno);
+    return;
+  }
+  slots_ = static_cast<Slot *>(addr);
+  mapped_size_ = size;
+#endif
+}
+
+SharedWordCache::~SharedWordCache() {
+#if !defined(OS_WIN)
+  if (slots_ != nullptr) ::munmap(slots_, mapped_size_);
+#endif
+}
+
+bool SharedWordCache::Lookup(
+    absl::string_view word,
+    std::vector<std::pair<absl::string_view, int>> *result) {
+  if (slots_ == nullptr) return false;
+  const uint64 hash = WordHash(word);
+  for (size_t probe = 0; probe < kMaxProbes; ++probe) {
+    Slot &slot = slots_[(hash + probe) % num_slots_];
+    const uint32 sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence & 1) continue;
+    if (slot.hash.load(std::memory_order_relaxed) != hash) continue;
+    const uint32 sizes = slot.sizes.load(std::memory_order_relaxed);
+    uint64 data[Slot::kDataWords];
+    for (size_t i = 0; i < Slot::kDataWords; ++i) {
+      data[i] = slot.data[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+    // The object is shared with other processes, so an entry which does
+    // not fit in the slot, whose pieces do not cover the word or whose ids
+    // are not pieces of the model is rejected rather than trusted.
+    const size_t word_size = sizes & 0xFF;
+    const size_t num_pieces = sizes >> 8;
+    const char *bytes = reinterpret_cast<const char *>(data);
+    if (word_size != word.size() ||
+        word_size + num_pieces * (1 + sizeof(int32)) > Slot::kDataSize ||
+        absl::string_view(bytes, word_size) != word) {
+      continue;
+    }
+    const uint8 *lengths = reinterpret_cast<const uint8 *>(bytes + word_size);
+    size_t total_length = 0;
+    for (size_t i = 0; i < num_pieces; ++i) total_length += lengths[i];
+    if (total_length != word_size) continue;
+    int32 ids[Slot::kDataSize / sizeof(int32)];
+    std::memcpy(ids, bytes + word_size + num_pieces,
+                num_pieces * sizeof(int32));
+    if (!std::all_of(ids, ids + num_pieces, [this](int32 id) {
+          return id >= 0 && id < piece_size_;
+        })) {
+      continue;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < num_pieces; ++i) {
+      result->emplace_back(word.substr(offset, lengths[i]), ids[i]);
+      offset += lengths[i];
+    }
+    ++hits_;
+    return true;
+  }
+  ++misses_;
+  return false;
+}
+
+void SharedWordCache::Insert(
+    absl::string_view word,
+    const std::vector<std::pair<absl::string_view, int>> &pieces) {
+  if (slots_ == nullptr || word.size() > 0xFF || pieces.size() > 0xFF ||
+      word.size() + pieces.size() * (1 + sizeof(int32)) > Slot::kDataSize) {
+    return;
+  }
+  uint64 data[Slot::kDataWords] = {};
+  char *bytes = reinterpret_cast<char *>(data);
+  std::memcpy(bytes, word.data(), word.size());
+  uint8 lengths[Slot::kDataSize];
+  int32 ids[Slot::kDataSize / sizeof(int32)];
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    lengths[i] = pieces[i].first.size();
+    ids[i] = pieces[i].second;
+  }
+  std::memcpy(bytes + word.size(), lengths, pieces.size());
+  std::memcpy(bytes + word.size() + pieces.size(), ids,
+              pieces.size() * sizeof(int32));
+
+  // Takes the slot of the word or an empty one, or else evicts one of the
+  // probed slots.
+  const uint64 hash = WordHash(word);
+  Slot *target = &slots_[(hash + (hash >> 32) % kMaxProbes) % num_slots_];
+  for (size_t probe = 0; probe < kMaxProbes; ++probe) {
+    Slot &slot = slots_[(hash + probe) % num_slots_];
+    const uint64 slot_hash = slot.hash.load(std::memory_order_relaxed);
+    if (slot_hash == hash) return;
+    if (slot_hash == 0) {
+      target = &slot;
+      break;
+    }
+  }
+
+  // Another writer holds the slot when its sequence is odd; the entry is
+  // dropped rather than waited for. A writer which dies before the last
+  // store leaves the sequence odd, since it cannot be told from a live one,
+  // so the slot is skipped until the cache is removed with Remove().
+  uint32 sequence = target->sequence.load(std::memory_order_relaxed);
+  if ((sequence & 1) ||
+      !target->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                std::memory_order_acquire)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  target->hash.store(hash, std::memory_order_relaxed);
+  target->sizes.store(word.size() | pieces.size() << 8,
+                      std::memory_order_relaxed);
+  for (size_t i = 0; i < Slot::kDataWords; ++i) {
+    target->data[i].store(data[i], std::memory_order_relaxed);
+  }
+  target->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// static
+util::Status SharedWordCache::Remove(uint64 fingerprint, size_t num_slots) {
+#if defined(OS_WIN)
+  return util::UnimplementedError(
+      "The shared word cache needs POSIX shared memory.");
+#else
+  const std::string name = SharedMemoryName(fingerprint, num_slots);
+  if (::shm_unlink(name.c_str()) != 0 && errno != ENOENT) {
+    return util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+           << "\"" << name << "\": " << util::StrError(errno);
+  }
+  return util::OkStatus();
+#endif
+}
+
+// static
+uint64 SharedWordCache::Fingerprint(absl::string_view data) {
+  return port::Fingerprint(data);
+}
+
+}  // namespace sentencepiece
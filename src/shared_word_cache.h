@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SHARED_WORD_CACHE_H_
+#define SHARED_WORD_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// Cache from a normalized word to its encoded pieces in POSIX shared
+// memory, so that the processes encoding with the same model, e.g. the
+// workers of a data loader, share the warm entries. The cache of a model is
+// named after its fingerprint and is created by the first process which
+// attaches to it.
+//
+// The table is open-addressed with fixed-size slots. Each slot is guarded
+// by a sequence lock: a writer makes the sequence odd while it copies the
+// entry, and a reader discards what it copied if the sequence changed, so
+// neither blocks the other. A process which crashes while writing leaves
+// that slot unusable until the shared memory is removed with Remove(); the
+// other slots of its words are still probed. Entries which are
+// inconsistent or whose ids are not pieces of the model, e.g. written by a
+// foreign process, are treated as misses. Words whose pieces do not fit in
+// a slot are not cached, and an entry may be overwritten by a later word,
+// so a lookup can miss after an insertion. Thread-safe.
+class SharedWordCache {
+ public:
+  // Attaches to the cache of the model with `fingerprint` of `num_slots`
+  // slots of 128 bytes, creating it if no process has. The model has
+  // `piece_size` pieces, and the entries with other ids are rejected.
+  // status() is an Unimplemented error on platforms without POSIX shared
+  // memory.
+  SharedWordCache(uint64 fingerprint, size_t num_slots, int piece_size);
+  ~SharedWordCache();
+
+  SharedWordCache(const SharedWordCache &) = delete;
+  SharedWordCache &operator=(const SharedWordCache &) = delete;
+
+  // Appends the cached pieces of `word` to `result`. Pieces are views of
+  // `word`. Returns false if `word` is not cached.
+  bool Lookup(absl::string_view word,
+              std::vector<std::pair<absl::string_view, int>> *result);
+
+  // Caches `pieces`, which must be the encoding of `word`.
+  void Insert(absl::string_view word,
+              const std::vector<std::pair<absl::string_view, int>> &pieces);
+
+  // Removes the shared memory of the cache of `fingerprint`. The processes
+  // attached to it keep their mapping, and the next one creates a new one.
+  static util::Status Remove(uint64 fingerprint, size_t num_slots);
+
+  // Returns the fingerprint of `data`, e.g. a serialized ModelProto. The
+  // same in all the processes and builds.
+  static uint64 Fingerprint(absl::string_view data);
+
+  size_t num_slots() const { return num_slots_; }
+  // Bytes of the mapped shared memory.
+  size_t MemoryUsage() const { return mapped_size_; }
+  int64 hits() const { return hits_; }
+  int64 misses() const { return misses_; }
+
+  util::Status status() const { return status_; }
+
+ private:
+  struct Slot;
+
+  size_t num_slots_ = 0;
+  int piece_size_ = 0;
+  Slot *slots_ = nullptr;
+  size_t mapped_size_ = 0;
+  std::atomic<int64> hits_{0};
+  std::atomic<int64> misses_{0};
+  util::Status status_;
+};
+
+}  // namespace sentencepiece
+#endif  // SHARED_WORD_CACHE_H_
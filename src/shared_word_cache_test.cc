@@ -0,0 +1,223 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shared_word_cache.h"
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "testharness.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+#if !defined(OS_WIN)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace sentencepiece {
+namespace {
+
+using Pieces = std::vector<std::pair<absl::string_view, int>>;
+
+#define WS "\xe2\x96\x81"
+
+// Number of pieces of the model of the caches.
+constexpr int kPieceSize = 2000;
+
+// A fingerprint no other run of the test uses.
+uint64 NewFingerprint() {
+  std::random_device rd;
+  return SharedWordCache::Fingerprint(absl::StrCat(rd(), "-", rd()));
+}
+
+TEST(SharedWordCacheTest, FingerprintTest) {
+  EXPECT_EQ(SharedWordCache::Fingerprint("abc"),
+            SharedWordCache::Fingerprint(std::string("abc")));
+  EXPECT_NE(SharedWordCache::Fingerprint("abc"),
+            SharedWordCache::Fingerprint("abd"));
+  EXPECT_NE(SharedWordCache::Fingerprint(""),
+            SharedWordCache::Fingerprint(std::string(1, '\0')));
+  EXPECT_NE(SharedWordCache::Fingerprint("0123456789"),
+            SharedWordCache::Fingerprint("0123456789 "));
+}
+
+TEST(SharedWordCacheTest, LookupTest) {
+  const uint64 fingerprint = NewFingerprint();
+  SharedWordCache cache(fingerprint, 64, kPieceSize);
+  ASSERT_TRUE(cache.status().ok());
+  EXPECT_EQ(64, cache.num_slots());
+
+  Pieces result;
+  EXPECT_FALSE(cache.Lookup(WS "ab", &result));
+  cache.Insert(WS "ab", {{WS "a", 3}, {"b", 4}});
+
+  // Another attachment, as in another process, sees the entry.
+  SharedWordCache other(fingerprint, 64, kPieceSize);
+  ASSERT_TRUE(other.status().ok());
+  const std::string word = WS "ab";
+  EXPECT_TRUE(other.Lookup(word, &result));
+  ASSERT_EQ(2, result.size());
+  EXPECT_EQ(WS "a", result[0].first);
+  EXPECT_EQ(3, result[0].second);
+  EXPECT_EQ("b", result[1].first);
+  EXPECT_EQ(4, result[1].second);
+  EXPECT_EQ(word.data() + 4, result[1].first.data());
+  EXPECT_EQ(1, other.hits());
+  EXPECT_EQ(0, other.misses());
+  EXPECT_EQ(1, cache.misses());
+
+  // The caches of the other models and sizes are apart.
+  SharedWordCache resized(fingerprint, 128, kPieceSize);
+  ASSERT_TRUE(resized.status().ok());
+  EXPECT_FALSE(resized.Lookup(WS "ab", &result));
+
+  // Too long to be cached.
+  const std::string long_word(200, 'a');
+  cache.Insert(long_word, {{long_word, 5}});
+  EXPECT_FALSE(cache.Lookup(long_word, &result));
+  Pieces chars;
+  for (size_t i = 0; i < 30; ++i) chars.emplace_back(long_word.substr(i, 1), 1);
+  cache.Insert(long_word.substr(0, 30), chars);
+  EXPECT_FALSE(cache.Lookup(long_word.substr(0, 30), &result));
+
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 64).ok());
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 128).ok());
+  // Removing it again is fine.
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 64).ok());
+
+  // The attached caches keep their mapping.
+  result.clear();
+  EXPECT_TRUE(cache.Lookup(WS "ab", &result));
+  SharedWordCache recreated(fingerprint, 64, kPieceSize);
+  ASSERT_TRUE(recreated.status().ok());
+  EXPECT_FALSE(recreated.Lookup(WS "ab", &result));
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 64).ok());
+
+  EXPECT_FALSE(SharedWordCache(fingerprint, 0, kPieceSize).status().ok());
+}
+
+TEST(SharedWordCacheTest, EvictionTest) {
+  const uint64 fingerprint = NewFingerprint();
+  SharedWordCache cache(fingerprint, 4, kPieceSize);
+  ASSERT_TRUE(cache.status().ok());
+  std::vector<std::string> words;
+  for (int i = 0; i < 100; ++i) words.push_back(absl::StrCat("w", i));
+  for (int i = 0; i < 100; ++i) cache.Insert(words[i], {{words[i], i}});
+
+  // Each hit is the entry of its word.
+  int hits = 0;
+  for (int i = 0; i < 100; ++i) {
+    Pieces result;
+    if (!cache.Lookup(words[i], &result)) continue;
+    ++hits;
+    ASSERT_EQ(1, result.size());
+    EXPECT_EQ(i, result[0].second);
+  }
+  EXPECT_LE(1, hits);
+  EXPECT_GE(4, hits);
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 4).ok());
+}
+
+#if !defined(OS_WIN)
+TEST(SharedWordCacheTest, CorruptEntryTest) {
+  const uint64 fingerprint = NewFingerprint();
+  SharedWordCache cache(fingerprint, 1, kPieceSize);
+  ASSERT_TRUE(cache.status().ok());
+  cache.Insert("abc", {{"ab", 1}, {"c", 2}});
+  Pieces result;
+  ASSERT_TRUE(cache.Lookup("abc", &result));
+
+  // Rewrites the sizes of the entry as another process could.
+  const std::string name =
+      absl::StrCat("/spm_word_cache_", string_util::IntToHex(fingerprint),
+                   "_1");
+  const int fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+  ASSERT_LE(0, fd);
+  void *addr = ::mmap(nullptr, cache.MemoryUsage(), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  ::close(fd);
+  ASSERT_NE(MAP_FAILED, addr);
+  auto *sizes = reinterpret_cast<std::atomic<uint32> *>(
+      static_cast<char *>(addr) + sizeof(uint32));
+
+  // Too many pieces for the slot, and pieces not covering the word.
+  for (const uint32 num_pieces : {200, 1, 3}) {
+    sizes->store(3 | num_pieces << 8);
+    result.clear();
+    EXPECT_FALSE(cache.Lookup("abc", &result));
+    EXPECT_TRUE(result.empty());
+  }
+  sizes->store(3 | 2 << 8);
+  EXPECT_TRUE(cache.Lookup("abc", &result));
+
+  // Ids which are not pieces of the model. The entry has the word at 16,
+  // the 2 lengths and then the ids.
+  char *ids = static_cast<char *>(addr) + 16 + 3 + 2;
+  for (const int32 id : {-1, kPieceSize, 1 << 30}) {
+    std::memcpy(ids + sizeof(int32), &id, sizeof(id));
+    result.clear();
+    EXPECT_FALSE(cache.Lookup("abc", &result));
+    EXPECT_TRUE(result.empty());
+  }
+  const int32 id = kPieceSize - 1;
+  std::memcpy(ids + sizeof(int32), &id, sizeof(id));
+  result.clear();
+  EXPECT_TRUE(cache.Lookup("abc", &result));
+  ASSERT_EQ(2, result.size());
+  EXPECT_EQ(kPieceSize - 1, result[1].second);
+  ::munmap(addr, cache.MemoryUsage());
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 1).ok());
+}
+#endif
+
+TEST(SharedWordCacheTest, ConcurrentTest) {
+  const uint64 fingerprint = NewFingerprint();
+  std::vector<std::string> words;
+  for (int i = 0; i < 1000; ++i) words.push_back(absl::StrCat("word", i));
+
+  // The writers race on the slots of 1000 words in 256 slots, and the
+  // readers never see a torn entry.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+      SharedWordCache cache(fingerprint, 256, kPieceSize);
+      ASSERT_TRUE(cache.status().ok());
+      for (int n = 0; n < 20000; ++n) {
+        const int i = (n * 7 + t * 13) % words.size();
+        const absl::string_view word = words[i];
+        Pieces result;
+        if (cache.Lookup(word, &result)) {
+          ASSERT_EQ(2, result.size());
+          EXPECT_EQ(word.substr(0, 4), result[0].first);
+          EXPECT_EQ(i, result[0].second);
+          EXPECT_EQ(word.substr(4), result[1].first);
+          EXPECT_EQ(1000 + i, result[1].second);
+        } else {
+          cache.Insert(word,
+                       {{word.substr(0, 4), i}, {word.substr(4), 1000 + i}});
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_TRUE(SharedWordCache::Remove(fingerprint, 256).ok());
+}
+
+}  // namespace
+}  // namespace sentencepiece
@@ -0,0 +1,408 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Measures the throughput of the normalizer, the encoders of all the model
+// types and the decoder on the lines of the corpora. The models are
+// trained on each corpus at startup, so the numbers of one run compare the
+// code paths on the same data.
+//
+//   % spm_benchmark --input=data/botchan.txt,data/wagahaiwa_nekodearu.txt
+//                   --threads=1,2,4 --minloglevel=1
+//
+// With --perf_counters, the hardware counters of each case are printed
+// per input byte and per output token below its line, on Linux. The
+// counters need kernel.perf_event_paranoid <= 2, and the ones the CPU or
+// a virtual machine does not provide are printed as "-".
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "encoder_pipeline.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece.pb.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/numbers.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
+#include "unigram_model.h"
+
+ABSL_FLAG(std::string, input, "data/botchan.txt,data/wagahaiwa_nekodearu.txt",
+          "Comma separated list of the corpora.");
+ABSL_FLAG(std::string, threads, "1,2,4",
+          "Comma separated list of the numbers of threads.");
+ABSL_FLAG(int32, vocab_size, 4000, "Vocabulary size of the trained models.");
+ABSL_FLAG(int32, iterations, 3, "Passes over the corpus per measurement.");
+ABSL_FLAG(int32, nbest_size, 10, "Size of the n-best list of NBestEncode.");
+ABSL_FLAG(double, alpha, 0.1, "Smoothing parameter of SampleEncode.");
+ABSL_FLAG(int32, fused_window, 64,
+          "Input window of the fused unigram encoding benchmark.");
+ABSL_FLAG(bool, perf_counters, false,
+          "Prints the cycles, instructions, cache, branch and TLB misses of "
+          "each case per input byte and per output token (Linux only).");
+
+namespace sentencepiece {
+namespace {
+
+// Hardware counters of the calling thread and the threads it starts while
+// they are enabled. Each event is a separate counter, since the inherited
+// counters cannot be read as a group; the kernel multiplexes them when
+// there are more events than registers, and the counts are scaled to the
+// time they ran.
+class PerfCounters {
+ public:
+  static constexpr int kNumEvents = 6;
+  static constexpr const char *kNames[kNumEvents] = {
+      "cycles",     "instructions",  "l1d_misses",
+      "llc_misses", "branch_misses", "dtlb_misses"};
+
+  PerfCounters() {
+#if defined(__linux__)
+    constexpr uint64_t kReadMiss =
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const std::pair<uint32_t, uint64_t> events[kNumEvents] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | kReadMiss},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | kReadMiss},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | kReadMiss}};
+    for (int e = 0; e < kNumEvents; ++e) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[e].first;
+      attr.config = events[e].second;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds_[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fds_[e] < 0) {
+        LOG(WARNING) << "perf counter " << kNames[e]
+                     << " is not available.";
+      }
+    }
+#else
+    LOG(WARNING) << "perf counters are only available on Linux.";
+#endif
+  }
+
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (const int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  // Resets and enables the counters.
+  void Start() {
+#if defined(__linux__)
+    for (const int fd : fds_) {
+      if (fd < 0) continue;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Disables the counters and stores the counts since Start() into
+  // `counts`, -1 for the unavailable ones. The threads started in between
+  // must have been joined, which adds their counts to the ones of the
+  // calling thread.
+  void Stop(std::vector<double> *counts) {
+    counts->assign(kNumEvents, -1.0);
+#if defined(__linux__)
+    for (int e = 0; e < kNumEvents; ++e) {
+      if (fds_[e] < 0) continue;
+      ioctl(fds_[e], PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t values[3] = {0, 0, 0};  // value, time enabled, time running.
+      if (read(fds_[e], values, sizeof(values)) != sizeof(values) ||
+          values[2] == 0) {
+        continue;
+      }
+      (*counts)[e] = static_cast<double>(values[0]) * values[1] / values[2];
+    }
+#endif
+  }
+
+ private:
+  int fds_[kNumEvents] = {-1, -1, -1, -1, -1, -1};
+};
+
+constexpr const char *PerfCounters::kNames[];
+
+// Prints `counts` divided by `units`, e.g. the bytes of the corpus.
+void PrintPerCounts(const char *unit, const std::vector<double> &counts,
+                    double units) {
+  std::string line = absl::StrCat("    per ", unit, ":");
+  for (int e = 0; e < PerfCounters::kNumEvents; ++e) {
+    char value[32] = "-";
+    if (counts[e] >= 0.0) {
+      snprintf(value, sizeof(value), "%.4g", counts[e] / units);
+    }
+    line += absl::StrCat(" ", PerfCounters::kNames[e], "=", value);
+  }
+  printf("%s\n", line.c_str());
+}
+
+// Runs `func(i, context)` for all the lines i on `num_threads` threads,
+// --iterations times, and returns the elapsed seconds of one pass. Each
+// thread takes a contiguous range of the lines and its own context. When
+// `counters` is given, their counts of one pass are stored in `counts`.
+double Measure(size_t num_lines, int num_threads,
+               const std::function<void(size_t, EncodeContext *)> &func,
+               PerfCounters *counters = nullptr,
+               std::vector<double> *counts = nullptr) {
+  const int iterations = absl::GetFlag(FLAGS_iterations);
+  if (counters != nullptr) counters->Start();
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      EncodeContext context;
+      const size_t begin = num_lines * t / num_threads;
+      const size_t end = num_lines * (t + 1) / num_threads;
+      for (int n = 0; n < iterations; ++n) {
+        for (size_t i = begin; i < end; ++i) func(i, &context);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (counters != nullptr) {
+    counters->Stop(counts);
+    for (auto &count : *counts) {
+      if (count >= 0.0) count /= iterations;
+    }
+  }
+  return elapsed.count() / iterations;
+}
+
+// Returns the number of ids of `lines` encoded by `sp`.
+size_t CountTokens(const SentencePieceProcessor &sp,
+                   const std::vector<std::string> &lines) {
+  size_t num_tokens = 0;
+  std::vector<int> ids;
+  for (const auto &line : lines) {
+    CHECK_OK(sp.Encode(line, &ids));
+    num_tokens += ids.size();
+  }
+  return num_tokens;
+}
+
+// Trains a model of `model_type` on `lines` and loads it into `sp`.
+void TrainModel(const std::vector<std::string> &lines,
+                absl::string_view model_type, ModelProto *model_proto,
+                SentencePieceProcessor *sp) {
+  std::string serialized;
+  CHECK_OK(SentencePieceTrainer::Train(
+      absl::StrCat("--model_type=", model_type, " --vocab_size=",
+                   std::to_string(absl::GetFlag(FLAGS_vocab_size)),
+                   " --hard_vocab_limit=false --num_threads=1"),
+      lines, &serialized));
+  CHECK(model_proto->ParseFromString(serialized));
+  CHECK_OK(sp->LoadFromSerializedProto(serialized));
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  using sentencepiece::EncodeContext;
+  using sentencepiece::ModelProto;
+  using sentencepiece::SentencePieceProcessor;
+
+  std::vector<int> num_threads;
+  const std::vector<std::string> thread_flags =
+      absl::StrSplit(absl::GetFlag(FLAGS_threads), ",");
+  for (const auto &value : thread_flags) {
+    int n = 0;
+    CHECK(absl::SimpleAtoi(value, &n) && n > 0) << "Bad --threads: " << value;
+    num_threads.push_back(n);
+  }
+  const int nbest_size = absl::GetFlag(FLAGS_nbest_size);
+  const float alpha = absl::GetFlag(FLAGS_alpha);
+  std::unique_ptr<sentencepiece::PerfCounters> counters;
+  if (absl::GetFlag(FLAGS_perf_counters)) {
+    counters = std::make_unique<sentencepiece::PerfCounters>();
+  }
+
+  printf("%-28s %-24s %7s %12s %10s\n", "corpus", "benchmark", "threads",
+         "lines/s", "MB/s");
+  const std::vector<std::string> filenames =
+      absl::StrSplit(absl::GetFlag(FLAGS_input), ",");
+  for (const auto &filename : filenames) {
+    std::vector<std::string> lines;
+    {
+      auto input = sentencepiece::filesystem::NewReadableFile(filename);
+      CHECK_OK(input->status());
+      std::string line;
+      while (input->ReadLine(&line)) {
+        if (!line.empty()) lines.push_back(line);
+      }
+    }
+    CHECK(!lines.empty()) << filename << " has no lines.";
+    size_t num_bytes = 0;
+    for (const auto &line : lines) num_bytes += line.size();
+
+    SentencePieceProcessor unigram, bpe, chars, words;
+    ModelProto unigram_proto, bpe_proto, chars_proto, words_proto;
+    sentencepiece::TrainModel(lines, "unigram", &unigram_proto, &unigram);
+    sentencepiece::TrainModel(lines, "bpe", &bpe_proto, &bpe);
+    sentencepiece::TrainModel(lines, "char", &chars_proto, &chars);
+    sentencepiece::TrainModel(lines, "word", &words_proto, &words);
+
+    // The model-level encoders take the normalized lines; the decoder
+    // takes the ids of the unigram model.
+    std::vector<std::string> normalized(lines.size());
+    std::vector<std::vector<int>> ids(lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+      normalized[i] = unigram.Normalize(lines[i]);
+      CHECK_OK(unigram.Encode(lines[i], &ids[i]));
+    }
+    sentencepiece::unigram::Model optimized(unigram_proto);
+    sentencepiece::unigram::Model original(unigram_proto);
+    original.SetEncoderVersion(sentencepiece::unigram::Model::kOriginal);
+
+    SentencePieceProcessor fused;
+    CHECK_OK(fused.Load(unigram_proto));
+    CHECK_OK(fused.SetFusedEncodeWindow(absl::GetFlag(FLAGS_fused_window)));
+    const sentencepiece::EncoderPipeline<sentencepiece::unigram::Model>
+        pipeline(unigram);
+    CHECK_OK(pipeline.status());
+
+    // The tokens of a case are the ids of its model. The ones of the
+    // normalizer, the sampling and the n-best encoders are the ids of the
+    // unigram model, as the ones of the decoder.
+    const size_t unigram_tokens = sentencepiece::CountTokens(unigram, lines);
+    const size_t bpe_tokens = sentencepiece::CountTokens(bpe, lines);
+    const size_t char_tokens = sentencepiece::CountTokens(chars, lines);
+    const size_t word_tokens = sentencepiece::CountTokens(words, lines);
+
+    const auto encode_ids = [&lines](const SentencePieceProcessor *sp) {
+      return [sp, &lines](size_t i, EncodeContext *context) {
+        std::vector<int> result;
+        sp->Encode(lines[i], &result, context).IgnoreError();
+      };
+    };
+    struct Benchmark {
+      std::string name;
+      std::function<void(size_t, EncodeContext *)> func;
+      size_t num_tokens;
+    };
+    const std::vector<Benchmark> benchmarks = {
+        {"Normalize",
+         [&](size_t i, EncodeContext *) { unigram.Normalize(lines[i]); },
+         unigram_tokens},
+        {"unigram Model kOptimized",
+         [&](size_t i, EncodeContext *) { optimized.Encode(normalized[i]); },
+         unigram_tokens},
+        {"unigram Model kOriginal",
+         [&](size_t i, EncodeContext *) { original.Encode(normalized[i]); },
+         unigram_tokens},
+        {"unigram Encode", encode_ids(&unigram), unigram_tokens},
+        {"unigram EncoderPipeline",
+         [&](size_t i, EncodeContext *context) {
+           std::vector<int> result;
+           pipeline.Encode(lines[i], &result, context).IgnoreError();
+         },
+         unigram_tokens},
+        {"unigram Encode fused", encode_ids(&fused), unigram_tokens},
+        {"bpe Encode", encode_ids(&bpe), bpe_tokens},
+        {"char Encode", encode_ids(&chars), char_tokens},
+        {"word Encode", encode_ids(&words), word_tokens},
+        {"unigram SampleEncode",
+         [&](size_t i, EncodeContext *) {
+           std::vector<int> result;
+           unigram.SampleEncode(lines[i], -1, alpha, &result).IgnoreError();
+         },
+         unigram_tokens},
+        {"unigram NBestEncode",
+         [&](size_t i, EncodeContext *) {
+           std::vector<std::vector<int>> result;
+           unigram.NBestEncode(lines[i], nbest_size, &result).IgnoreError();
+         },
+         unigram_tokens},
+        // Encode() into a SentencePieceText copies the
+        // FlatSentencePieceText of the next benchmark.
+        {"unigram Encode proto",
+         [&](size_t i, EncodeContext *context) {
+           sentencepiece::SentencePieceText spt;
+           unigram.Encode(lines[i], &spt, context).IgnoreError();
+         },
+         unigram_tokens},
+        {"unigram Encode flat",
+         [&](size_t i, EncodeContext *context) {
+           sentencepiece::FlatSentencePieceText flat;
+           unigram.Encode(lines[i], &flat, context).IgnoreError();
+         },
+         unigram_tokens},
+        {"unigram Decode",
+         [&](size_t i, EncodeContext *context) {
+           std::string text;
+           unigram.Decode(ids[i], &text, context).IgnoreError();
+         },
+         unigram_tokens},
+    };
+
+    const std::string corpus = filename.substr(filename.rfind('/') + 1);
+    std::vector<double> counts;
+    for (const auto &benchmark : benchmarks) {
+      for (const int n : num_threads) {
+        const double seconds = sentencepiece::Measure(
+            lines.size(), n, benchmark.func, counters.get(), &counts);
+        printf("%-28s %-24s %7d %12.0f %10.2f\n", corpus.c_str(),
+               benchmark.name.c_str(), n, lines.size() / seconds,
+               num_bytes / seconds / 1e6);
+        if (counters) {
+          sentencepiece::PrintPerCounts("byte", counts, num_bytes);
+          sentencepiece::PrintPerCounts("token", counts,
+                                        benchmark.num_tokens);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+
+ABSL_FLAG(std::string, model, "", "input model file name");
+ABSL_FLAG(std::string, output, "", "output fast-model file name");
+ABSL_FLAG(std::string, frequent_words_input, "",
+          "corpus file, one sentence per line, whose most frequent words are "
+          "segmented in advance and stored in the fast model");
+ABSL_FLAG(int32, frequent_word_table_size, 100000,
+          "number of the frequent words stored with --frequent_words_input");
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  CHECK(!absl::GetFlag(FLAGS_model).empty());
+  CHECK(!absl::GetFlag(FLAGS_output).empty());
+
+  sentencepiece::SentencePieceProcessor sp;
+  CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
+
+  std::string frequent_words;
+  if (!absl::GetFlag(FLAGS_frequent_words_input).empty()) {
+    auto input = sentencepiece::filesystem::NewReadableFile(
+        absl::GetFlag(FLAGS_frequent_words_input));
+    CHECK_OK(input->status());
+    std::vector<std::string> lines;
+    std::string line;
+    while (input->ReadLine(&line)) lines.push_back(line);
+    const std::vector<absl::string_view> sentences(lines.begin(), lines.end());
+    CHECK_GE(absl::GetFlag(FLAGS_frequent_word_table_size), 0);
+    CHECK_OK(sp.BuildFrequentWordTable(
+        sentences, absl::GetFlag(FLAGS_frequent_word_table_size),
+        &frequent_words));
+  }
+
+  CHECK_OK(sentencepiece::io::SaveFastModel(
+      absl::GetFlag(FLAGS_output), sp.model_proto(), frequent_words));
+
+  return 0;
+}
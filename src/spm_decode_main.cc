@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <cctype>
+#include <deque>
 #include <functional>
+#include <future>
 #include <string>
 #include <vector>
 
@@ -32,6 +36,37 @@ ABSL_FLAG(std::string, input_format, "piece", "choose from piece or id");
 ABSL_FLAG(std::string, output_format, "string", "choose from string or proto");
 ABSL_FLAG(std::string, extra_options, "",
           "':' separated encoder extra options, e.g., \"reverse:bos:eos\"");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of decoding threads. The output keeps the input order.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines decoded by one task of the --num_threads pool.");
+
+namespace {
+// Parses the space separated ids of `line` into `ids` like atoi() of each
+// token, without copying the tokens.
+void ParseIds(absl::string_view line, std::vector<int> *ids) {
+  ids->clear();
+  const char *p = line.data();
+  const char *end = line.data() + line.size();
+  while (p < end) {
+    if (*p == ' ') {
+      ++p;
+      continue;
+    }
+    while (p < end && *p != ' ' && isspace(static_cast<unsigned char>(*p))) {
+      ++p;
+    }
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    int value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+      value = value * 10 + (*p - '0');
+    }
+    ids->push_back(negative ? -value : value);
+    while (p < end && *p != ' ') ++p;
+  }
+}
+}  // namespace
 
 int main(int argc, char *argv[]) {
   sentencepiece::ScopedResourceDestructor cleaner;
@@ -55,31 +90,33 @@ int main(int argc, char *argv[]) {
   CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
   CHECK_OK(sp.SetDecodeExtraOptions(absl::GetFlag(FLAGS_extra_options)));
 
-  auto output =
-      sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+  auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+      absl::GetFlag(FLAGS_output));
   CHECK_OK(output->status());
 
-  std::string detok, line;
-  sentencepiece::SentencePieceText spt;
-  std::function<void(const std::vector<std::string> &pieces)> process;
-
-  auto ToIds = [&](const std::vector<std::string> &pieces) {
+  // Output of a batch of lines and the buffers reused across its lines.
+  struct BatchOutput {
+    std::string text;
+    std::string detok;
     std::vector<int> ids;
-    ids.reserve(pieces.size());
-    for (const auto &s : pieces) {
-      ids.push_back(atoi(s.c_str()));
-    }
-    return ids;
   };
+  const auto append_detok = [](BatchOutput *out) {
+    out->text.append(out->detok);
+    out->text.push_back('\n');
+  };
+  std::function<void(absl::string_view line, BatchOutput *out)> process;
 
   if (absl::GetFlag(FLAGS_input_format) == "piece") {
     if (absl::GetFlag(FLAGS_output_format) == "string") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(pieces, &detok));
-        output->WriteLine(detok);
+      process = [&](absl::string_view line, BatchOutput *out) {
+        const std::vector<absl::string_view> pieces = absl::StrSplit(line, " ");
+        CHECK_OK(sp.Decode(pieces, &out->detok));
+        append_detok(out);
       };
     } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-      process = [&](const std::vector<std::string> &pieces) {
+      process = [&](absl::string_view line, BatchOutput *out) {
+        const std::vector<absl::string_view> pieces = absl::StrSplit(line, " ");
+        sentencepiece::SentencePieceText spt;
         CHECK_OK(sp.Decode(pieces, &spt));
       };
     } else {
@@ -88,13 +125,16 @@ int main(int argc, char *argv[]) {
     }
   } else if (absl::GetFlag(FLAGS_input_format) == "id") {
     if (absl::GetFlag(FLAGS_output_format) == "string") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(ToIds(pieces), &detok));
-        output->WriteLine(detok);
+      process = [&](absl::string_view line, BatchOutput *out) {
+        ParseIds(line, &out->ids);
+        CHECK_OK(sp.Decode(out->ids, &out->detok));
+        append_detok(out);
       };
     } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(ToIds(pieces), &spt));
+      process = [&](absl::string_view line, BatchOutput *out) {
+        ParseIds(line, &out->ids);
+        sentencepiece::SentencePieceText spt;
+        CHECK_OK(sp.Decode(out->ids, &spt));
       };
     } else {
       LOG(FATAL) << "Unknown output format: "
@@ -104,14 +144,42 @@ int main(int argc, char *argv[]) {
     LOG(FATAL) << "Unknown input format: " << absl::GetFlag(FLAGS_input_format);
   }
 
+  // The reader hands batches of lines to the worker pool and writes the
+  // finished batches in order. At most two batches per worker are in
+  // flight, which bounds the memory.
+  const int num_threads = std::max(1, absl::GetFlag(FLAGS_num_threads));
+  const size_t batch_size = std::max(1, absl::GetFlag(FLAGS_batch_size));
+  sentencepiece::ThreadPool pool(num_threads);
+  std::deque<std::future<std::string>> pending;
+
+  const auto write_front = [&]() {
+    output->Write(pending.front().get());
+    pending.pop_front();
+  };
+
+  std::vector<std::string> lines;
+  const auto submit = [&]() {
+    if (lines.empty()) return;
+    pending.push_back(pool.Submit([&process, lines = std::move(lines)]() {
+      BatchOutput out;
+      for (const auto &line : lines) process(line, &out);
+      return std::move(out.text);
+    }));
+    lines.clear();
+    if (pending.size() > 2 * static_cast<size_t>(num_threads)) write_front();
+  };
+
+  absl::string_view line;
   for (const auto &filename : rest_args) {
     auto input = sentencepiece::filesystem::NewReadableFile(filename);
     CHECK_OK(input->status());
     while (input->ReadLine(&line)) {
-      const auto pieces = absl::StrSplit(line, " ");
-      process(pieces);
+      lines.emplace_back(line);
+      if (lines.size() >= batch_size) submit();
     }
   }
+  submit();
+  while (!pending.empty()) write_front();
 
   return 0;
 }
@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -21,17 +25,18 @@
 #include "init.h"
 #include "sentencepiece.pb.h"
 #include "sentencepiece_processor.h"
-#include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/flags/flag.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
+#include "trace.h"
 #include "trainer_interface.h"
+#include "util.h"
 
 ABSL_FLAG(std::string, model, "", "model file name");
 ABSL_FLAG(
     std::string, output_format, "piece",
-    "choose from piece, id, proto, sample_piece, sample_id, sample_proto, "
-    "nbest_piece, nbest_id, or nbest_proto");
+    "choose from piece, id, binary_id, proto, sample_piece, sample_id, "
+    "sample_proto, nbest_piece, nbest_id, or nbest_proto");
 ABSL_FLAG(std::string, input, "", "input filename");
 ABSL_FLAG(std::string, output, "", "output filename");
 ABSL_FLAG(std::string, extra_options, "",
@@ -50,6 +55,34 @@ ABSL_FLAG(int32, vocabulary_threshold, 0,
           "Words with frequency < threshold will be treated as OOV");
 ABSL_FLAG(bool, generate_vocabulary, false,
           "Generates vocabulary file instead of segmentation");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of encoding threads. The output keeps the input order. "
+          "With more than one thread, the sample_* outputs are not "
+          "reproducible with --random_seed.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines encoded by one task of the --num_threads pool.");
+ABSL_FLAG(int32, binary_id_width, 0,
+          "Bytes per id of --output_format=binary_id: 2, 4, or 0 to use 2 "
+          "bytes when all the ids fit in uint16 and 4 otherwise.");
+ABSL_FLAG(std::string, offsets_output, "",
+          "Index file of --output_format=binary_id. Holds the offsets of the "
+          "sentences in ids followed by the total, as little-endian uint64. "
+          "Defaults to <output>.idx when --output is given.");
+ABSL_FLAG(std::string, trace_output, "",
+          "File to which the spans of the encoding batches are written as "
+          "Chrome trace JSON. Needs a build with SPM_ENABLE_TRACING.");
+
+namespace {
+// Appends the `width` low bytes of `value` in little-endian order.
+inline void AppendLittleEndian(uint64_t value, int width, std::string *out) {
+  for (int i = 0; i < width; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+// Index of the worker of the encoding pool running on this thread.
+thread_local int worker_index = 0;
+}  // namespace
 
 int main(int argc, char *argv[]) {
   sentencepiece::ScopedResourceDestructor cleaner;
@@ -73,6 +106,14 @@ int main(int argc, char *argv[]) {
 
   CHECK(!absl::GetFlag(FLAGS_model).empty());
 
+  const std::string trace_output = absl::GetFlag(FLAGS_trace_output);
+  if (!trace_output.empty()) {
+    CHECK(sentencepiece::trace::kCompiledIn)
+        << "--trace_output needs a build with SPM_ENABLE_TRACING.";
+    sentencepiece::trace::SetThreadName("main");
+    sentencepiece::trace::Start();
+  }
+
   sentencepiece::SentencePieceProcessor sp;
   CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
   CHECK_OK(sp.SetEncodeExtraOptions(absl::GetFlag(FLAGS_extra_options)));
@@ -82,73 +123,121 @@ int main(int argc, char *argv[]) {
                                absl::GetFlag(FLAGS_vocabulary_threshold)));
   }
 
-  auto output =
-      sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+  const bool is_binary = absl::GetFlag(FLAGS_output_format) == "binary_id" &&
+                         !absl::GetFlag(FLAGS_generate_vocabulary);
+  auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+      absl::GetFlag(FLAGS_output), is_binary);
   CHECK_OK(output->status());
 
-  std::string line;
-  std::vector<std::string> sps;
-  std::vector<int> ids;
-  std::vector<std::vector<std::string>> nbest_sps;
-  std::vector<std::vector<int>> nbest_ids;
-  absl::flat_hash_map<std::string, int> vocab;
-  sentencepiece::SentencePieceText spt;
-  sentencepiece::NBestSentencePieceText nbest_spt;
-  std::function<void(absl::string_view line)> process;
+  // The binary ids are written with a fixed width, so the output can be
+  // memory-mapped and indexed with the offsets file.
+  int id_width = absl::GetFlag(FLAGS_binary_id_width);
+  std::unique_ptr<sentencepiece::filesystem::WritableFile> offsets_output;
+  if (is_binary) {
+    if (id_width == 0) id_width = sp.GetPieceSize() <= 0x10000 ? 2 : 4;
+    CHECK(id_width == 2 || id_width == 4)
+        << "--binary_id_width must be 0, 2 or 4.";
+    CHECK(id_width == 4 || sp.GetPieceSize() <= 0x10000)
+        << "The vocabulary does not fit in uint16.";
+    std::string offsets_filename = absl::GetFlag(FLAGS_offsets_output);
+    if (offsets_filename.empty() && !absl::GetFlag(FLAGS_output).empty()) {
+      offsets_filename = absl::StrCat(absl::GetFlag(FLAGS_output), ".idx");
+    }
+    if (!offsets_filename.empty()) {
+      offsets_output = sentencepiece::filesystem::NewBufferedWritableFile(
+          offsets_filename, true);
+      CHECK_OK(offsets_output->status());
+    }
+  }
+
+  // Output of a batch of lines. Filled by a worker and written in the
+  // input order.
+  struct BatchOutput {
+    std::string text;
+    std::vector<uint32_t> sizes;  // Number of ids of each binary_id line.
+  };
+  const auto append_line = [](absl::string_view line, BatchOutput *out) {
+    out->text.append(line.data(), line.size());
+    out->text.push_back('\n');
+  };
+  std::function<void(absl::string_view line, BatchOutput *out)> process;
 
   const int nbest_size = absl::GetFlag(FLAGS_nbest_size);
   const float alpha = absl::GetFlag(FLAGS_alpha);
+  const int num_threads = std::max(1, absl::GetFlag(FLAGS_num_threads));
+
+  // Counts of the ids of --generate_vocabulary, one array per worker, which
+  // are summed and converted to pieces at the end.
+  std::vector<std::vector<int64_t>> id_counts;
 
   if (absl::GetFlag(FLAGS_generate_vocabulary)) {
-    process = [&](absl::string_view line) {
-      CHECK_OK(sp.Encode(line, &spt));
-      for (const auto &piece : spt.pieces()) {
-        if (!sp.IsUnknown(piece.id()) && !sp.IsControl(piece.id()))
-          vocab[piece.piece()]++;
-      }
+    id_counts.assign(num_threads, std::vector<int64_t>(sp.GetPieceSize(), 0));
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<int> ids;
+      CHECK_OK(sp.Encode(line, &ids));
+      auto &counts = id_counts[worker_index];
+      for (const int id : ids) ++counts[id];
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "piece") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<std::string> sps;
       CHECK_OK(sp.Encode(line, &sps));
-      output->WriteLine(absl::StrJoin(sps, " "));
+      append_line(absl::StrJoin(sps, " "), out);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "id") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<int> ids;
       CHECK_OK(sp.Encode(line, &ids));
-      output->WriteLine(absl::StrJoin(ids, " "));
+      append_line(absl::StrJoin(ids, " "), out);
+    };
+  } else if (absl::GetFlag(FLAGS_output_format) == "binary_id") {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<int> ids;
+      CHECK_OK(sp.Encode(line, &ids));
+      for (const int id : ids) AppendLittleEndian(id, id_width, &out->text);
+      out->sizes.push_back(ids.size());
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-    process = [&](absl::string_view line) { CHECK_OK(sp.Encode(line, &spt)); };
+    process = [&](absl::string_view line, BatchOutput *out) {
+      sentencepiece::SentencePieceText spt;
+      CHECK_OK(sp.Encode(line, &spt));
+    };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_piece") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<std::string> sps;
       CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &sps));
-      output->WriteLine(absl::StrJoin(sps, " "));
+      append_line(absl::StrJoin(sps, " "), out);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_id") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<int> ids;
       CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &ids));
-      output->WriteLine(absl::StrJoin(ids, " "));
+      append_line(absl::StrJoin(ids, " "), out);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_proto") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      sentencepiece::SentencePieceText spt;
       CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &spt));
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_piece") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<std::vector<std::string>> nbest_sps;
       CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_sps));
       for (const auto &result : nbest_sps) {
-        output->WriteLine(absl::StrJoin(result, " "));
+        append_line(absl::StrJoin(result, " "), out);
       }
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_id") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      std::vector<std::vector<int>> nbest_ids;
       CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_ids));
       for (const auto &result : nbest_ids) {
-        output->WriteLine(absl::StrJoin(result, " "));
+        append_line(absl::StrJoin(result, " "), out);
       }
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_proto") {
-    process = [&](absl::string_view line) {
+    process = [&](absl::string_view line, BatchOutput *out) {
+      sentencepiece::NBestSentencePieceText nbest_spt;
       CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_spt));
     };
   } else {
@@ -156,20 +245,77 @@ int main(int argc, char *argv[]) {
                << absl::GetFlag(FLAGS_output_format);
   }
 
+  // The reader hands batches of lines to the worker pool and writes the
+  // finished batches in order. At most two batches per worker are in
+  // flight, which bounds the memory.
+  const size_t batch_size = std::max(1, absl::GetFlag(FLAGS_batch_size));
+  sentencepiece::ThreadPool pool(num_threads,
+                                 [](int32 worker) { worker_index = worker; });
+  std::deque<std::future<BatchOutput>> pending;
+  uint64_t num_ids = 0;
+  std::string offsets;
+  if (offsets_output) AppendLittleEndian(0, 8, &offsets);
+
+  const auto write_front = [&]() {
+    SPM_TRACE_SPAN("write_batch");
+    const BatchOutput out = pending.front().get();
+    pending.pop_front();
+    output->Write(out.text);
+    if (offsets_output) {
+      for (const uint32_t size : out.sizes) {
+        num_ids += size;
+        AppendLittleEndian(num_ids, 8, &offsets);
+      }
+      offsets_output->Write(offsets);
+      offsets.clear();
+    }
+  };
+
+  std::vector<std::string> lines;
+  const auto submit = [&]() {
+    if (lines.empty()) return;
+    pending.push_back(pool.Submit([&process, lines = std::move(lines)]() {
+      SPM_TRACE_SPAN("encode_batch");
+      BatchOutput out;
+      for (const auto &line : lines) process(line, &out);
+      return out;
+    }));
+    lines.clear();
+    if (pending.size() > 2 * static_cast<size_t>(num_threads)) write_front();
+  };
+
+  absl::string_view line;
   for (const auto &filename : rest_args) {
     auto input = sentencepiece::filesystem::NewReadableFile(filename);
     CHECK_OK(input->status());
     while (input->ReadLine(&line)) {
-      process(line);
+      lines.emplace_back(line);
+      if (lines.size() >= batch_size) submit();
     }
   }
+  submit();
+  while (!pending.empty()) write_front();
+  if (offsets_output && !offsets.empty()) offsets_output->Write(offsets);
 
   if (absl::GetFlag(FLAGS_generate_vocabulary)) {
+    std::vector<std::pair<std::string, int64_t>> vocab;
+    for (int id = 0; id < sp.GetPieceSize(); ++id) {
+      int64_t count = 0;
+      for (const auto &counts : id_counts) count += counts[id];
+      if (count > 0 && !sp.IsUnknown(id) && !sp.IsControl(id)) {
+        vocab.emplace_back(sp.IdToPiece(id), count);
+      }
+    }
     for (const auto &it : sentencepiece::Sorted(vocab)) {
       output->WriteLine(it.first + "\t" +
                         sentencepiece::string_util::SimpleItoa(it.second));
     }
   }
 
+  if (!trace_output.empty()) {
+    sentencepiece::trace::Stop();
+    CHECK_OK(sentencepiece::trace::WriteChromeTrace(trace_output));
+  }
+
   return 0;
 }
@@ -12,7 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
-#include <sstream>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "common.h"
 #include "filesystem.h"
@@ -24,8 +27,10 @@
 ABSL_FLAG(std::string, output, "", "Output filename");
 ABSL_FLAG(std::string, model, "", "input model file name");
 ABSL_FLAG(std::string, output_format, "vocab",
-          "output format. choose from vocab or syms. vocab outputs pieces "
-          "and scores, syms outputs pieces and indices.");
+          "output format. choose from vocab, syms or memory. vocab outputs "
+          "pieces and scores, syms outputs pieces and indices, memory "
+          "outputs the estimated bytes of each component of the loaded "
+          "model.");
 
 int main(int argc, char *argv[]) {
   sentencepiece::ScopedResourceDestructor cleaner;
@@ -38,22 +43,52 @@ int main(int argc, char *argv[]) {
       sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
   CHECK_OK(output->status());
 
+  // The whole file is formatted into one buffer and written at once.
+  const auto &pieces = sp.model_proto().pieces();
+  size_t size = 0;
+  for (const auto &piece : pieces) size += piece.piece().size() + 16;
+  std::string buffer;
+  buffer.reserve(size);
+  char value[32];
+
   if (absl::GetFlag(FLAGS_output_format) == "vocab") {
-    for (const auto &piece : sp.model_proto().pieces()) {
-      std::ostringstream os;
-      os << piece.piece() << "\t" << piece.score();
-      output->WriteLine(os.str());
+    for (const auto &piece : pieces) {
+      // Same as the default formatting of std::ostream.
+      const int length =
+          std::snprintf(value, sizeof(value), "\t%g\n", piece.score());
+      buffer.append(piece.piece());
+      buffer.append(value, length);
     }
   } else if (absl::GetFlag(FLAGS_output_format) == "syms") {
-    for (int i = 0; i < sp.model_proto().pieces_size(); i++) {
-      std::ostringstream os;
-      os << sp.model_proto().pieces(i).piece() << "\t" << i;
-      output->WriteLine(os.str());
+    for (int i = 0; i < pieces.size(); i++) {
+      const int length = std::snprintf(value, sizeof(value), "\t%d\n", i);
+      buffer.append(pieces[i].piece());
+      buffer.append(value, length);
+    }
+  } else if (absl::GetFlag(FLAGS_output_format) == "memory") {
+    sentencepiece::MemoryUsage usage;
+    CHECK_OK(sp.GetMemoryUsage(&usage));
+    for (const auto &component : std::vector<std::pair<const char *, size_t>>{
+             {"model_proto", usage.model_proto},
+             {"piece_maps", usage.piece_maps},
+             {"model_tables", usage.model_tables},
+             {"normalizer", usage.normalizer},
+             {"caches", usage.caches},
+             {"processor_tables", usage.processor_tables},
+             {"numa_replicas", usage.numa_replicas},
+             {"mapped_file", usage.mapped_file},
+             {"total", usage.total()}}) {
+      const int length =
+          std::snprintf(value, sizeof(value), "\t%zu\n", component.second);
+      buffer.append(component.first);
+      buffer.append(value, length);
     }
   } else {
     LOG(FATAL) << "Unsupported output format: "
                << absl::GetFlag(FLAGS_output_format);
   }
 
+  CHECK(output->Write(buffer));
+
   return 0;
 }
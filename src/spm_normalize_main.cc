@@ -12,6 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+
 #include "builder.h"
 #include "common.h"
 #include "filesystem.h"
@@ -22,6 +29,7 @@
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/flags/flag.h"
+#include "util.h"
 
 ABSL_FLAG(std::string, model, "", "Model file name");
 ABSL_FLAG(bool, use_internal_normalization, false,
@@ -37,6 +45,23 @@ ABSL_FLAG(bool, decompile, false,
           "Decompile compiled charamap and output it as TSV.");
 ABSL_FLAG(std::string, input, "", "Input filename");
 ABSL_FLAG(std::string, output, "", "Output filename");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of normalizing threads. The output keeps the input order.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines normalized by one task of the --num_threads pool.");
+ABSL_FLAG(std::string, alignment_output, "",
+          "Binary alignment file. For each line, holds the input byte offset "
+          "of every normalized byte and of the end of the line, as "
+          "little-endian uint32 relative to the beginning of the line.");
+
+namespace {
+// Appends the 4 bytes of `value` in little-endian order.
+inline void AppendLittleEndian32(uint32_t value, std::string *out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+}  // namespace
 
 using sentencepiece::ModelProto;
 using sentencepiece::NormalizerSpec;
@@ -92,22 +117,80 @@ int main(int argc, char *argv[]) {
     CHECK_OK(Builder::SaveCharsMap(absl::GetFlag(FLAGS_output), chars_map));
   } else {
     const Normalizer normalizer(spec);
-    auto output =
-        sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+    auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+        absl::GetFlag(FLAGS_output));
     CHECK_OK(output->status());
 
     if (rest_args.empty()) {
       rest_args.push_back("");  // empty means that read from stdin.
     }
 
-    std::string line;
+    std::unique_ptr<sentencepiece::filesystem::WritableFile> alignment_output;
+    if (!absl::GetFlag(FLAGS_alignment_output).empty()) {
+      alignment_output = sentencepiece::filesystem::NewBufferedWritableFile(
+          absl::GetFlag(FLAGS_alignment_output));
+      CHECK_OK(alignment_output->status());
+    }
+
+    struct BatchOutput {
+      std::string text;
+      std::string alignment;
+    };
+
+    const auto process = [&](const std::vector<std::string> &lines) {
+      BatchOutput out;
+      std::string normalized;
+      std::vector<size_t> norm_to_orig;
+      for (const auto &line : lines) {
+        if (alignment_output) {
+          CHECK_OK(normalizer.Normalize(line, &normalized, &norm_to_orig));
+          for (const size_t offset : norm_to_orig) {
+            AppendLittleEndian32(static_cast<uint32_t>(offset), &out.alignment);
+          }
+        } else {
+          normalized = normalizer.Normalize(line);
+        }
+        out.text.append(normalized);
+        out.text.push_back('\n');
+      }
+      return out;
+    };
+
+    // The reader hands batches of lines to the worker pool and writes the
+    // finished batches in order. At most two batches per worker are in
+    // flight, which bounds the memory.
+    const int num_threads = std::max(1, absl::GetFlag(FLAGS_num_threads));
+    const size_t batch_size = std::max(1, absl::GetFlag(FLAGS_batch_size));
+    sentencepiece::ThreadPool pool(num_threads);
+    std::deque<std::future<BatchOutput>> pending;
+
+    const auto write_front = [&]() {
+      const BatchOutput out = pending.front().get();
+      pending.pop_front();
+      output->Write(out.text);
+      if (alignment_output) alignment_output->Write(out.alignment);
+    };
+
+    std::vector<std::string> lines;
+    const auto submit = [&]() {
+      if (lines.empty()) return;
+      pending.push_back(pool.Submit(
+          [&process, lines = std::move(lines)]() { return process(lines); }));
+      lines.clear();
+      if (pending.size() > 2 * static_cast<size_t>(num_threads)) write_front();
+    };
+
+    absl::string_view line;
     for (const auto &filename : rest_args) {
       auto input = sentencepiece::filesystem::NewReadableFile(filename);
       CHECK_OK(input->status());
       while (input->ReadLine(&line)) {
-        output->WriteLine(normalizer.Normalize(line));
+        lines.emplace_back(line);
+        if (lines.size() >= batch_size) submit();
       }
     }
+    submit();
+    while (!pending.empty()) write_front();
   }
 
   return 0;
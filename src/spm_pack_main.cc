@@ -0,0 +1,212 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Packs documents into fixed-length blocks of ids for language model
+// pretraining: each line is a document, which is encoded, followed by </s>
+// by default, and concatenated to the previous ones, and the stream of ids
+// is cut into blocks of --block_size ids. The blocks file is the
+// little-endian ids without a header, so it can be memory-mapped as a
+// [blocks, block_size] array. The index file holds the offset of each
+// document in the stream of ids followed by the total, as little-endian
+// uint64, as the one of spm_encode --output_format=binary_id.
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+ABSL_FLAG(std::string, model, "", "model file name");
+ABSL_FLAG(std::string, input, "", "input filename");
+ABSL_FLAG(std::string, output, "", "output filename of the blocks");
+ABSL_FLAG(std::string, index_output, "",
+          "Index file of the document offsets. Defaults to <output>.idx "
+          "when --output is given.");
+ABSL_FLAG(int32, block_size, 2048, "Number of ids of a block.");
+ABSL_FLAG(int32, id_width, 0,
+          "Bytes per id: 2, 4, or 0 to use 2 bytes when all the ids fit in "
+          "uint16 and 4 otherwise.");
+ABSL_FLAG(bool, add_bos, false, "Starts each document with <s>.");
+ABSL_FLAG(bool, add_eos, true, "Ends each document with </s>.");
+ABSL_FLAG(bool, pad_last, false,
+          "Writes the last partial block padded with --pad_id instead of "
+          "dropping it.");
+ABSL_FLAG(int32, pad_id, -1,
+          "Id padding the last block. -1 uses the pad id of the model.");
+ABSL_FLAG(int32, num_threads, 1, "Number of encoding threads.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of documents encoded by one task of the --num_threads "
+          "pool.");
+
+namespace {
+// Appends the `width` low bytes of `value` in little-endian order.
+inline void AppendLittleEndian(uint64_t value, int width, std::string *out) {
+  for (int i = 0; i < width; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+  std::vector<std::string> rest_args;
+
+  if (absl::GetFlag(FLAGS_input).empty()) {
+    for (int i = 1; i < argc; ++i) {
+      rest_args.push_back(std::string(argv[i]));
+    }
+  } else {
+    rest_args.push_back(absl::GetFlag(FLAGS_input));
+  }
+
+  if (rest_args.empty())
+    rest_args.push_back("");  // empty means that reading from stdin.
+
+  CHECK(!absl::GetFlag(FLAGS_model).empty());
+
+  sentencepiece::SentencePieceProcessor sp;
+  CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
+
+  sentencepiece::EncodeOptions options;
+  options.add_bos = absl::GetFlag(FLAGS_add_bos);
+  options.add_eos = absl::GetFlag(FLAGS_add_eos);
+  CHECK(!options.add_bos || sp.bos_id() >= 0) << "The model has no <s>.";
+  CHECK(!options.add_eos || sp.eos_id() >= 0) << "The model has no </s>.";
+
+  const size_t block_size = absl::GetFlag(FLAGS_block_size);
+  CHECK_GT(absl::GetFlag(FLAGS_block_size), 0);
+  int id_width = absl::GetFlag(FLAGS_id_width);
+  if (id_width == 0) id_width = sp.GetPieceSize() <= 0x10000 ? 2 : 4;
+  CHECK(id_width == 2 || id_width == 4) << "--id_width must be 0, 2 or 4.";
+  CHECK(id_width == 4 || sp.GetPieceSize() <= 0x10000)
+      << "The vocabulary does not fit in uint16.";
+  int pad_id = absl::GetFlag(FLAGS_pad_id);
+  if (pad_id < 0) pad_id = sp.pad_id();
+  CHECK(!absl::GetFlag(FLAGS_pad_last) || pad_id >= 0)
+      << "--pad_last needs --pad_id, as the model has no pad id.";
+
+  auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+      absl::GetFlag(FLAGS_output), true);
+  CHECK_OK(output->status());
+  std::string index_filename = absl::GetFlag(FLAGS_index_output);
+  if (index_filename.empty() && !absl::GetFlag(FLAGS_output).empty()) {
+    index_filename = absl::StrCat(absl::GetFlag(FLAGS_output), ".idx");
+  }
+  std::unique_ptr<sentencepiece::filesystem::WritableFile> index_output;
+  if (!index_filename.empty()) {
+    index_output =
+        sentencepiece::filesystem::NewBufferedWritableFile(index_filename,
+                                                            true);
+    CHECK_OK(index_output->status());
+  }
+
+  // The packed ids of a batch of documents and the number of ids of each.
+  // Filled by a worker and appended to the stream in the input order.
+  struct BatchOutput {
+    std::string ids;
+    std::vector<uint32_t> sizes;
+  };
+
+  // The reader hands batches of documents to the worker pool and packs the
+  // finished batches in order, as spm_encode does. At most two batches per
+  // worker are in flight, and only the ids of the partial last block are
+  // kept, which bounds the memory.
+  const int num_threads = std::max(1, absl::GetFlag(FLAGS_num_threads));
+  const size_t batch_size = std::max(1, absl::GetFlag(FLAGS_batch_size));
+  const size_t block_bytes = block_size * id_width;
+  sentencepiece::ThreadPool pool(num_threads);
+  std::deque<std::future<BatchOutput>> pending;
+  std::string stream;  // The ids after the last written block.
+  std::string index;
+  uint64_t num_documents = 0;
+  uint64_t num_ids = 0;
+  uint64_t num_blocks = 0;
+  if (index_output) AppendLittleEndian(0, 8, &index);
+
+  const auto write_front = [&]() {
+    const BatchOutput out = pending.front().get();
+    pending.pop_front();
+    stream.append(out.ids);
+    const size_t blocks = stream.size() / block_bytes;
+    if (blocks > 0) {
+      output->Write(absl::string_view(stream.data(), blocks * block_bytes));
+      stream.erase(0, blocks * block_bytes);
+      num_blocks += blocks;
+    }
+    num_documents += out.sizes.size();
+    for (const uint32_t size : out.sizes) {
+      num_ids += size;
+      if (index_output) AppendLittleEndian(num_ids, 8, &index);
+    }
+    if (index_output) {
+      index_output->Write(index);
+      index.clear();
+    }
+  };
+
+  std::vector<std::string> lines;
+  const auto submit = [&]() {
+    if (lines.empty()) return;
+    pending.push_back(
+        pool.Submit([&sp, &options, id_width, lines = std::move(lines)]() {
+          thread_local sentencepiece::EncodeContext context;
+          BatchOutput out;
+          std::vector<int> ids;
+          for (const auto &line : lines) {
+            CHECK_OK(sp.Encode(line, options, &ids, &context));
+            for (const int id : ids) AppendLittleEndian(id, id_width, &out.ids);
+            out.sizes.push_back(ids.size());
+          }
+          return out;
+        }));
+    lines.clear();
+    if (pending.size() > 2 * static_cast<size_t>(num_threads)) write_front();
+  };
+
+  absl::string_view line;
+  for (const auto &filename : rest_args) {
+    auto input = sentencepiece::filesystem::NewReadableFile(filename);
+    CHECK_OK(input->status());
+    while (input->ReadLine(&line)) {
+      lines.emplace_back(line);
+      if (lines.size() >= batch_size) submit();
+    }
+  }
+  submit();
+  while (!pending.empty()) write_front();
+
+  if (absl::GetFlag(FLAGS_pad_last) && !stream.empty()) {
+    while (stream.size() < block_bytes) {
+      AppendLittleEndian(pad_id, id_width, &stream);
+    }
+    output->Write(stream);
+    ++num_blocks;
+  }
+
+  LOG(INFO) << "Packed " << num_ids << " ids of " << num_documents
+            << " documents into " << num_blocks << " blocks of " << block_size
+            << " ids.";
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Pre-generates the segmentations of subword regularization: each line is
+// a sentence, of which --num_samples segmentations are sampled as
+// SampleEncodeMany() does, from one forward pass over the sentence. The
+// output is the little-endian ids of the samples without a header, as
+// spm_encode --output_format=binary_id writes them; the samples of
+// sentence i come one after another. The index file holds the offset of
+// each sample in the ids followed by the total, as little-endian uint64,
+// so sample k of sentence i is [index[i * num_samples + k],
+// index[i * num_samples + k + 1]).
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+ABSL_FLAG(std::string, model, "", "model file name");
+ABSL_FLAG(std::string, input, "", "input filename");
+ABSL_FLAG(std::string, output, "", "output filename of the ids");
+ABSL_FLAG(std::string, index_output, "",
+          "Index file of the sample offsets. Defaults to <output>.idx when "
+          "--output is given.");
+ABSL_FLAG(std::string, extra_options, "",
+          "':' separated encoder extra options, e.g., \"reverse:bos:eos\"");
+ABSL_FLAG(int32, num_samples, 8, "Number of samples of each sentence.");
+ABSL_FLAG(double, alpha, 0.1,
+          "Smoothing parameter of the unigram model, or the dropout "
+          "probability of BPE.");
+ABSL_FLAG(int32, id_width, 0,
+          "Bytes per id: 2, 4, or 0 to use 2 bytes when all the ids fit in "
+          "uint16 and 4 otherwise.");
+ABSL_FLAG(uint32, random_seed, static_cast<uint32>(-1),
+          "Seed value for random generator. When it is set, each sentence "
+          "is sampled with the seed and its line number, so the output does "
+          "not depend on --num_threads.");
+ABSL_FLAG(int32, num_threads, 1, "Number of sampling threads.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of sentences sampled by one task of the --num_threads "
+          "pool.");
+
+namespace {
+// Appends the `width` low bytes of `value` in little-endian order.
+inline void AppendLittleEndian(uint64_t value, int width, std::string *out) {
+  for (int i = 0; i < width; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+  std::vector<std::string> rest_args;
+
+  if (absl::GetFlag(FLAGS_input).empty()) {
+    for (int i = 1; i < argc; ++i) {
+      rest_args.push_back(std::string(argv[i]));
+    }
+  } else {
+    rest_args.push_back(absl::GetFlag(FLAGS_input));
+  }
+
+  if (rest_args.empty())
+    rest_args.push_back("");  // empty means that reading from stdin.
+
+  CHECK(!absl::GetFlag(FLAGS_model).empty());
+
+  sentencepiece::SentencePieceProcessor sp;
+  CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
+  CHECK_OK(sp.SetEncodeExtraOptions(absl::GetFlag(FLAGS_extra_options)));
+
+  const int num_samples = absl::GetFlag(FLAGS_num_samples);
+  CHECK_GT(num_samples, 0);
+  const float alpha = absl::GetFlag(FLAGS_alpha);
+  const bool seeded = absl::GetFlag(FLAGS_random_seed) != -1;
+  const uint64_t seed = absl::GetFlag(FLAGS_random_seed);
+  int id_width = absl::GetFlag(FLAGS_id_width);
+  if (id_width == 0) id_width = sp.GetPieceSize() <= 0x10000 ? 2 : 4;
+  CHECK(id_width == 2 || id_width == 4) << "--id_width must be 0, 2 or 4.";
+  CHECK(id_width == 4 || sp.GetPieceSize() <= 0x10000)
+      << "The vocabulary does not fit in uint16.";
+
+  auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+      absl::GetFlag(FLAGS_output), true);
+  CHECK_OK(output->status());
+  std::string index_filename = absl::GetFlag(FLAGS_index_output);
+  if (index_filename.empty() && !absl::GetFlag(FLAGS_output).empty()) {
+    index_filename = absl::StrCat(absl::GetFlag(FLAGS_output), ".idx");
+  }
+  std::unique_ptr<sentencepiece::filesystem::WritableFile> index_output;
+  if (!index_filename.empty()) {
+    index_output =
+        sentencepiece::filesystem::NewBufferedWritableFile(index_filename,
+                                                            true);
+    CHECK_OK(index_output->status());
+  }
+
+  // The ids of the samples of a batch of sentences and the number of ids
+  // of each sample. Filled by a worker and written in the input order.
+  struct BatchOutput {
+    std::string ids;
+    std::vector<uint32_t> sizes;
+  };
+
+  // The reader hands batches of sentences to the worker pool and writes
+  // the finished batches in order, as spm_encode does. At most two batches
+  // per worker are in flight, which bounds the memory.
+  const int num_threads = std::max(1, absl::GetFlag(FLAGS_num_threads));
+  const size_t batch_size = std::max(1, absl::GetFlag(FLAGS_batch_size));
+  sentencepiece::ThreadPool pool(num_threads);
+  std::deque<std::future<BatchOutput>> pending;
+  std::string index;
+  uint64_t num_sentences = 0;
+  uint64_t num_ids = 0;
+  if (index_output) AppendLittleEndian(0, 8, &index);
+
+  const auto write_front = [&]() {
+    const BatchOutput out = pending.front().get();
+    pending.pop_front();
+    output->Write(out.ids);
+    num_sentences += out.sizes.size() / num_samples;
+    for (const uint32_t size : out.sizes) {
+      num_ids += size;
+      if (index_output) AppendLittleEndian(num_ids, 8, &index);
+    }
+    if (index_output) {
+      index_output->Write(index);
+      index.clear();
+    }
+  };
+
+  std::vector<std::string> lines;
+  uint64_t num_lines = 0;
+  const auto submit = [&]() {
+    if (lines.empty()) return;
+    const uint64_t line_number = num_lines;  // Of the first line of `lines`.
+    num_lines += lines.size();
+    pending.push_back(pool.Submit([&sp, num_samples, alpha, seeded, seed,
+                                   id_width, line_number,
+                                   lines = std::move(lines)]() {
+      BatchOutput out;
+      std::vector<std::vector<int>> samples;
+      for (size_t i = 0; i < lines.size(); ++i) {
+        if (seeded) {
+          sentencepiece::SetThreadRandomGeneratorSeed(seed, line_number + i);
+        }
+        samples.clear();
+        CHECK_OK(sp.SampleEncodeMany(lines[i], num_samples, alpha, &samples));
+        CHECK_EQ(num_samples, samples.size());
+        for (const auto &ids : samples) {
+          for (const int id : ids) AppendLittleEndian(id, id_width, &out.ids);
+          out.sizes.push_back(ids.size());
+        }
+      }
+      return out;
+    }));
+    lines.clear();
+    if (pending.size() > 2 * static_cast<size_t>(num_threads)) write_front();
+  };
+
+  absl::string_view line;
+  for (const auto &filename : rest_args) {
+    auto input = sentencepiece::filesystem::NewReadableFile(filename);
+    CHECK_OK(input->status());
+    while (input->ReadLine(&line)) {
+      lines.emplace_back(line);
+      if (lines.size() >= batch_size) submit();
+    }
+  }
+  submit();
+  while (!pending.empty()) write_front();
+
+  LOG(INFO) << "Sampled " << num_samples << " segmentations of "
+            << num_sentences << " sentences into " << num_ids << " ids.";
+
+  return 0;
+}
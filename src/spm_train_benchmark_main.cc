@@ -0,0 +1,322 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Measures the trainers end to end on a synthetic multilingual corpus: the
+// wall and CPU time of each training phase and the peak memory of each run,
+// for every model type and number of threads. The corpus is generated from
+// --seed, so the runs of two builds train on the same sentences.
+//
+// Each sentence is in one script, picked by the weights of --scripts. The
+// words of a script are random strings of its letters, drawn with
+// Zipfian frequencies; the number of words of a sentence is Poisson
+// distributed. Han and hiragana sentences have no spaces.
+//
+//   % spm_train_benchmark --sentences=200000 --threads=1,4,16
+//                         --scripts=latin:0.6,han:0.4 --minloglevel=1
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_trainer.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/numbers.h"
+#include "third_party/absl/strings/str_split.h"
+#include "trainer_factory.h"
+#include "trainer_interface.h"
+#include "util.h"
+
+ABSL_FLAG(int64, sentences, 100000, "Number of generated sentences.");
+ABSL_FLAG(std::string, scripts, "latin:0.5,cyrillic:0.2,han:0.2,hiragana:0.1",
+          "Comma separated script:weight pairs of the sentences. The "
+          "scripts are latin, cyrillic, greek, arabic, devanagari, hiragana "
+          "and han.");
+ABSL_FLAG(int32, words_per_script, 20000,
+          "Number of distinct words of each script.");
+ABSL_FLAG(double, zipf, 1.1,
+          "Exponent of the Zipfian frequencies of the words.");
+ABSL_FLAG(double, mean_words, 12.0, "Mean number of words of a sentence.");
+ABSL_FLAG(int32, max_words, 100, "Maximum number of words of a sentence.");
+ABSL_FLAG(uint32, seed, 1, "Seed of the corpus generator.");
+ABSL_FLAG(std::string, corpus, "/tmp/spm_train_benchmark.txt",
+          "File to which the corpus is written and from which it is "
+          "trained.");
+ABSL_FLAG(std::string, model_types, "unigram,bpe,char,word",
+          "Comma separated list of the trained model types.");
+ABSL_FLAG(std::string, threads, "1,2,4",
+          "Comma separated list of the numbers of threads.");
+ABSL_FLAG(int32, vocab_size, 8000, "Vocabulary size of the trained models.");
+
+namespace sentencepiece {
+namespace {
+
+struct Script {
+  const char *name;
+  char32 first;  // The letters are [first, first + size).
+  int size;
+  int min_word_length;
+  int max_word_length;
+  bool spaces;  // Whether the words are separated by spaces.
+};
+
+constexpr Script kScripts[] = {
+    {"latin", 0x61, 26, 2, 10, true},
+    {"cyrillic", 0x430, 32, 2, 10, true},
+    {"greek", 0x3B1, 25, 2, 10, true},
+    {"arabic", 0x627, 36, 2, 8, true},
+    {"devanagari", 0x915, 37, 2, 8, true},
+    {"hiragana", 0x3041, 83, 1, 4, false},
+    {"han", 0x4E00, 3000, 1, 3, false},
+};
+
+// Random numbers from the raw output of std::mt19937, which is the same on
+// all platforms, unlike the standard distributions.
+class Random {
+ public:
+  explicit Random(uint32 seed) : mt_(seed) {}
+
+  // Uniform in [0, 1).
+  double Uniform() {
+    const uint64 high = mt_() >> 5, low = mt_() >> 6;
+    return (high * 67108864.0 + low) / 9007199254740992.0;
+  }
+
+  // Uniform in [0, n).
+  int Int(int n) { return std::min<int>(n - 1, Uniform() * n); }
+
+  int Poisson(double mean) {
+    const double limit = std::exp(-mean);
+    int k = 0;
+    for (double p = Uniform(); p > limit; p *= Uniform()) ++k;
+    return k;
+  }
+
+ private:
+  std::mt19937 mt_;
+};
+
+// Words of one script in the order of their ranks, and the weight of the
+// script in --scripts.
+struct Lexicon {
+  const Script *script = nullptr;
+  double weight = 0.0;
+  std::vector<std::string> words;
+};
+
+std::vector<Lexicon> MakeLexicons(Random *random) {
+  std::vector<Lexicon> lexicons;
+  for (const auto &spec :
+       util::StrSplitAsCSV(absl::GetFlag(FLAGS_scripts))) {
+    const std::vector<std::string> fields = absl::StrSplit(spec, ":");
+    Lexicon lexicon;
+    for (const auto &script : kScripts) {
+      if (fields[0] == script.name) lexicon.script = &script;
+    }
+    CHECK(lexicon.script != nullptr) << "Unknown script: " << fields[0];
+    CHECK(fields.size() == 2 && absl::SimpleAtoi(fields[1], &lexicon.weight) &&
+          lexicon.weight > 0.0)
+        << "Bad --scripts: " << spec;
+    const Script &script = *lexicon.script;
+    for (int i = 0; i < absl::GetFlag(FLAGS_words_per_script); ++i) {
+      const int length =
+          script.min_word_length +
+          random->Int(script.max_word_length - script.min_word_length + 1);
+      std::string word;
+      for (int j = 0; j < length; ++j) {
+        word += string_util::UnicodeCharToUTF8(script.first +
+                                               random->Int(script.size));
+      }
+      lexicon.words.push_back(std::move(word));
+    }
+    lexicons.push_back(std::move(lexicon));
+  }
+  CHECK(!lexicons.empty()) << "No --scripts.";
+  return lexicons;
+}
+
+// Writes the corpus to --corpus and returns its size in bytes.
+uint64 GenerateCorpus() {
+  Random random(absl::GetFlag(FLAGS_seed));
+  const std::vector<Lexicon> lexicons = MakeLexicons(&random);
+
+  std::vector<double> script_cdf;
+  double total_weight = 0.0;
+  for (const auto &lexicon : lexicons) {
+    total_weight += lexicon.weight;
+    script_cdf.push_back(total_weight);
+  }
+  std::vector<double> rank_cdf;
+  double total_rank = 0.0;
+  for (int r = 1; r <= absl::GetFlag(FLAGS_words_per_script); ++r) {
+    total_rank += std::pow(r, -absl::GetFlag(FLAGS_zipf));
+    rank_cdf.push_back(total_rank);
+  }
+  const auto sample = [&random](const std::vector<double> &cdf) {
+    const double u = random.Uniform() * cdf.back();
+    return std::min<size_t>(
+        cdf.size() - 1,
+        std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+  };
+
+  auto output = filesystem::NewWritableFile(absl::GetFlag(FLAGS_corpus));
+  CHECK_OK(output->status());
+  uint64 size = 0;
+  std::string sentence;
+  for (int64 i = 0; i < absl::GetFlag(FLAGS_sentences); ++i) {
+    const Lexicon &lexicon = lexicons[sample(script_cdf)];
+    const int num_words =
+        std::max(1, std::min(absl::GetFlag(FLAGS_max_words),
+                             random.Poisson(absl::GetFlag(FLAGS_mean_words))));
+    sentence.clear();
+    for (int w = 0; w < num_words; ++w) {
+      if (w > 0 && lexicon.script->spaces) sentence += ' ';
+      sentence += lexicon.words[sample(rank_cdf)];
+    }
+    CHECK(output->WriteLine(sentence));
+    size += sentence.size() + 1;
+  }
+  return size;
+}
+
+// Resets the peak resident memory of the process, which PeakRssBytes()
+// then reports for the work done since. Linux only.
+void ResetPeakRss() {
+#if defined(__linux__)
+  std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+// Returns the peak resident memory since ResetPeakRss(), or 0 when it is
+// unknown.
+int64 PeakRssBytes() {
+#if defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    int64 kb = 0;  // "VmHWM:   1234 kB"
+    if (line.compare(0, 6, "VmHWM:") == 0 &&
+        absl::SimpleAtoi(line.substr(6), &kb)) {
+      return kb * 1024;
+    }
+  }
+#endif
+  return 0;
+}
+
+// Trains a model of `model_type` on --corpus with `num_threads` threads
+// and prints the total of each phase and of the run.
+void Train(absl::string_view model_type, int num_threads) {
+  TrainerSpec trainer_spec;
+  CHECK_OK(SentencePieceTrainer::PopulateModelTypeFromString(model_type,
+                                                             &trainer_spec));
+  trainer_spec.add_input(absl::GetFlag(FLAGS_corpus));
+  trainer_spec.set_vocab_size(absl::GetFlag(FLAGS_vocab_size));
+  trainer_spec.set_hard_vocab_limit(false);
+  trainer_spec.set_num_threads(num_threads);
+  NormalizerSpec normalizer_spec, denormalizer_spec;
+  CHECK_OK(SentencePieceTrainer::PopulateNormalizerSpec(&normalizer_spec));
+  CHECK_OK(
+      SentencePieceTrainer::PopulateNormalizerSpec(&denormalizer_spec, true));
+
+  ResetPeakRss();
+  const auto start = std::chrono::steady_clock::now();
+  const std::clock_t cpu_start = std::clock();
+  ModelProto model_proto;
+  auto trainer =
+      TrainerFactory::Create(trainer_spec, normalizer_spec, denormalizer_spec);
+  CHECK_OK(trainer->Train(nullptr, &model_proto));
+  const std::chrono::duration<double> wall =
+      std::chrono::steady_clock::now() - start;
+  const double cpu =
+      static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+  const int64 peak_rss = PeakRssBytes();
+
+  // The phases of the same name, e.g. the EM iterations, are added up in
+  // the order of their first occurrence.
+  std::vector<std::string> names;
+  absl::flat_hash_map<std::string, TrainingMetrics::Phase> totals;
+  for (const auto &phase : trainer->metrics().phases()) {
+    auto it = totals.find(phase.name);
+    if (it == totals.end()) {
+      names.push_back(phase.name);
+      it = totals.emplace(phase.name, TrainingMetrics::Phase()).first;
+    }
+    it->second.wall_seconds += phase.wall_seconds;
+    it->second.cpu_seconds += phase.cpu_seconds;
+    it->second.items += phase.items;
+  }
+  for (const auto &name : names) {
+    const auto &total = totals[name];
+    printf("%-8s %7d %-22s %9.3f %9.3f %12.0f\n",
+           std::string(model_type).c_str(), num_threads, name.c_str(),
+           total.wall_seconds, total.cpu_seconds,
+           total.wall_seconds > 0.0 ? total.items / total.wall_seconds : 0.0);
+  }
+  printf("%-8s %7d %-22s %9.3f %9.3f %12s peak_rss=%lldMB pieces=%d\n",
+         std::string(model_type).c_str(), num_threads, "total", wall.count(),
+         cpu, "", static_cast<long long>(peak_rss >> 20),
+         model_proto.pieces_size());
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ScopedResourceDestructor cleaner;
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  std::vector<int> num_threads;
+  for (const auto &value :
+       sentencepiece::util::StrSplitAsCSV(absl::GetFlag(FLAGS_threads))) {
+    int n = 0;
+    CHECK(absl::SimpleAtoi(value, &n) && n > 0) << "Bad --threads: " << value;
+    num_threads.push_back(n);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const uint64 size = sentencepiece::GenerateCorpus();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("corpus=%s sentences=%lld bytes=%llu scripts=%s zipf=%g "
+         "mean_words=%g seed=%u (generated in %.1f sec)\n",
+         absl::GetFlag(FLAGS_corpus).c_str(),
+         static_cast<long long>(absl::GetFlag(FLAGS_sentences)),
+         static_cast<unsigned long long>(size),
+         absl::GetFlag(FLAGS_scripts).c_str(), absl::GetFlag(FLAGS_zipf),
+         absl::GetFlag(FLAGS_mean_words), absl::GetFlag(FLAGS_seed),
+         elapsed.count());
+
+  printf("%-8s %7s %-22s %9s %9s %12s\n", "model", "threads", "phase",
+         "wall_s", "cpu_s", "items/s");
+  for (const auto &model_type :
+       sentencepiece::util::StrSplitAsCSV(absl::GetFlag(FLAGS_model_types))) {
+    for (const int n : num_threads) {
+      sentencepiece::Train(model_type, n);
+      fflush(stdout);
+    }
+  }
+
+  return 0;
+}
@@ -20,8 +20,10 @@
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/flags/flag.h"
 #include "third_party/absl/strings/ascii.h"
+#include "third_party/absl/strings/numbers.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_split.h"
+#include "trace.h"
 #include "util.h"
 
 using sentencepiece::NormalizerSpec;
@@ -34,7 +36,7 @@ static sentencepiece::NormalizerSpec kDefaultNormalizerSpec;
 
 ABSL_FLAG(std::string, input, "", "comma separated list of input sentences");
 ABSL_FLAG(std::string, input_format, kDefaultTrainerSpec.input_format(),
-          "Input format. Supported format is `text` or `tsv`.");
+          "Input format. Supported format is `text`, `tsv` or `counts`.");
 ABSL_FLAG(std::string, model_prefix, "", "output model prefix");
 ABSL_FLAG(std::string, model_type, "unigram",
           "model algorithm: unigram, bpe, word or char");
@@ -148,6 +150,64 @@ ABSL_FLAG(bool, train_extremely_large_corpus,
           "Increase bit depth for unigram tokenization.");
 ABSL_FLAG(uint32, random_seed, static_cast<uint32>(-1),
           "Seed value for random generator.");
+ABSL_FLAG(std::string, checkpoint_path, "",
+          "File to which the training state is saved periodically.");
+ABSL_FLAG(int32, checkpoint_interval, 0,
+          "Number of EM rounds (unigram) or merges (bpe) between checkpoints. "
+          "0 uses 1 round or 1000 merges.");
+ABSL_FLAG(std::string, resume_from, "",
+          "Checkpoint file from which training is resumed.");
+ABSL_FLAG(std::string, distributed_dir, "",
+          "Directory shared by the processes of a distributed unigram job.");
+ABSL_FLAG(int32, num_shards, 1,
+          "Number of processes of a distributed unigram job.");
+ABSL_FLAG(int32, shard_id, 0,
+          "Index of this process in a distributed unigram job. Shard 0 "
+          "coordinates the job and saves the model.");
+ABSL_FLAG(std::string, metrics_report, "",
+          "File to which the wall time, CPU time and peak memory of the "
+          "training phases are written as JSON.");
+ABSL_FLAG(std::string, trace_output, "",
+          "File to which the spans of the training phases and the worker "
+          "tasks are written as Chrome trace JSON. Needs a build with "
+          "SPM_ENABLE_TRACING.");
+ABSL_FLAG(double, em_tolerance, 0.0,
+          "Relative change of the objective below which the remaining EM "
+          "sub-iterations of a round are skipped (unigram). 0 runs all.");
+ABSL_FLAG(int32, em_num_batches, 1,
+          "Number of slices of the sentences processed in turn by the E steps "
+          "of stochastic EM before the last round (unigram). 1 disables it.");
+ABSL_FLAG(std::string, extra_vocab_sizes, "",
+          "Comma separated vocab sizes whose models are also saved as "
+          "<model_prefix>.<size>.model: larger than --vocab_size for unigram, "
+          "smaller for BPE.");
+ABSL_FLAG(std::string, base_model, "",
+          "Unigram model extended with --num_new_pieces pieces trained on "
+          "--input, keeping its pieces and their ids.");
+ABSL_FLAG(int32, num_new_pieces, 0,
+          "Number of pieces added to --base_model.");
+ABSL_FLAG(std::string, corpus_cache_dir, "",
+          "Directory where the loaded and normalized corpus is cached for the "
+          "later runs with the same input and options.");
+ABSL_FLAG(std::string, external_memory_dir, "",
+          "Directory where the unigram trainer keeps the sentences of the EM "
+          "training in a mapped file instead of in memory.");
+ABSL_FLAG(double, em_step_decay, 0.7,
+          "Decay of the step size (t + 2)^-decay of stochastic EM, in "
+          "(0.5, 1].");
+ABSL_FLAG(std::string, suffix_array_backend, "sais",
+          "Builder of the suffix array of the seed pieces (unigram): \"sais\" "
+          "or \"doubling\", which runs on the worker threads.");
+ABSL_FLAG(std::uint64_t, lattice_cache_size, 0,
+          "Bytes of the lattices of the sentences kept between the E steps "
+          "of EM (unigram). 0 disables the cache.");
+ABSL_FLAG(bool, bpe_word_engine, false,
+          "Merges the pairs over the distinct words as arrays of symbol ids "
+          "(BPE with --split_by_whitespace). It does not write checkpoints.");
+ABSL_FLAG(std::string, estep_accumulator, "float",
+          "Sums of the expected counts of the E steps (unigram): \"float\", "
+          "\"double\" or \"kahan\", which are more precise on large "
+          "corpora.");
 
 // DP related.
 ABSL_FLAG(bool, enable_differential_privacy, false,
@@ -180,7 +240,7 @@ int main(int argc, char *argv[]) {
     std::vector<std::string> lines;
     auto input = sentencepiece::filesystem::NewReadableFile(filename);
     CHECK_OK(input->status());
-    std::string line;
+    absl::string_view line;
     while (input->ReadLine(&line)) lines.emplace_back(line);
     return lines;
   };
@@ -279,8 +339,62 @@ int main(int argc, char *argv[]) {
   CHECK_OK(sentencepiece::SentencePieceTrainer::PopulateModelTypeFromString(
       absl::GetFlag(FLAGS_model_type), &trainer_spec));
 
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetCheckpointForTraining(
+      absl::GetFlag(FLAGS_checkpoint_path),
+      absl::GetFlag(FLAGS_checkpoint_interval),
+      absl::GetFlag(FLAGS_resume_from)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetDistributedTraining(
+      absl::GetFlag(FLAGS_distributed_dir), absl::GetFlag(FLAGS_num_shards),
+      absl::GetFlag(FLAGS_shard_id)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetMetricsReportForTraining(
+      absl::GetFlag(FLAGS_metrics_report)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetEMConvergenceForTraining(
+      absl::GetFlag(FLAGS_em_tolerance)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetStochasticEMForTraining(
+      absl::GetFlag(FLAGS_em_num_batches), absl::GetFlag(FLAGS_em_step_decay)));
+  std::vector<int> extra_vocab_sizes;
+  if (!absl::GetFlag(FLAGS_extra_vocab_sizes).empty()) {
+    for (const auto &v : sentencepiece::util::StrSplitAsCSV(
+             absl::GetFlag(FLAGS_extra_vocab_sizes))) {
+      int size = 0;
+      CHECK(absl::SimpleAtoi(v, &size)) << "Invalid vocab size: " << v;
+      extra_vocab_sizes.push_back(size);
+    }
+  }
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetExtraVocabSizesForTraining(
+      extra_vocab_sizes));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetBaseModelForTraining(
+      absl::GetFlag(FLAGS_base_model), absl::GetFlag(FLAGS_num_new_pieces)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetCorpusCacheForTraining(
+      absl::GetFlag(FLAGS_corpus_cache_dir)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetExternalMemoryForTraining(
+      absl::GetFlag(FLAGS_external_memory_dir)));
+  CHECK_OK(
+      sentencepiece::SentencePieceTrainer::SetSuffixArrayBackendForTraining(
+          absl::GetFlag(FLAGS_suffix_array_backend)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetLatticeCacheForTraining(
+      absl::GetFlag(FLAGS_lattice_cache_size)));
+  CHECK_OK(sentencepiece::SentencePieceTrainer::SetBPEWordEngineForTraining(
+      absl::GetFlag(FLAGS_bpe_word_engine)));
+  CHECK_OK(
+      sentencepiece::SentencePieceTrainer::SetEStepAccumulatorForTraining(
+          absl::GetFlag(FLAGS_estep_accumulator)));
+
+  const std::string trace_output = absl::GetFlag(FLAGS_trace_output);
+  if (!trace_output.empty()) {
+    CHECK(sentencepiece::trace::kCompiledIn)
+        << "--trace_output needs a build with SPM_ENABLE_TRACING.";
+    sentencepiece::trace::SetThreadName("main");
+    sentencepiece::trace::Start();
+  }
+
   CHECK_OK(sentencepiece::SentencePieceTrainer::Train(
       trainer_spec, normalizer_spec, denormalizer_spec));
 
+  if (!trace_output.empty()) {
+    sentencepiece::trace::Stop();
+    CHECK_OK(sentencepiece::trace::WriteChromeTrace(trace_output));
+  }
+
   return 0;
 }
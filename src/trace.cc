@@ -0,0 +1,160 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "trace.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/strings/str_join.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace trace {
+namespace {
+
+struct Event {
+  std::string name;
+  int tid = 0;
+  Clock::time_point begin;
+  Clock::time_point end;
+};
+
+// The spans of all the threads. A span is appended once it ends, so the
+// lock is taken once per span and only while recording.
+struct Recorder {
+  std::atomic<bool> recording{false};
+  std::mutex mutex;
+  Clock::time_point origin;
+  std::vector<Event> events;
+  std::map<int, std::string> thread_names;
+};
+
+Recorder *GetRecorder() {
+  // Leaked, so that the threads still running at exit can use it.
+  static Recorder *recorder = new Recorder;
+  return recorder;
+}
+
+// Small ids of the threads in the order they first record a span or set
+// their name, which the trace viewers show as the rows.
+int ThreadId() {
+  static std::atomic<int> next_id{1};
+  thread_local const int id = next_id.fetch_add(1);
+  return id;
+}
+
+std::string EscapeJson(absl::string_view text) {
+  std::string escaped;
+  for (const char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped.push_back('\\');
+      escaped.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      escaped.append(absl::StrFormat("\\u%04x", c));
+    } else {
+      escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+double Microseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+}  // namespace
+
+void Start() {
+  auto *recorder = GetRecorder();
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  recorder->events.clear();
+  recorder->origin = Clock::now();
+  recorder->recording = true;
+}
+
+void Stop() { GetRecorder()->recording = false; }
+
+bool IsRecording() { return GetRecorder()->recording; }
+
+void RecordSpan(absl::string_view name, Clock::time_point begin,
+                Clock::time_point end) {
+  auto *recorder = GetRecorder();
+  if (!recorder->recording) return;
+  Event event;
+  event.name = std::string(name);
+  event.tid = ThreadId();
+  event.begin = begin;
+  event.end = end;
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  recorder->events.push_back(std::move(event));
+}
+
+void SetThreadName(absl::string_view name) {
+  auto *recorder = GetRecorder();
+  const int tid = ThreadId();
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  recorder->thread_names[tid] = std::string(name);
+}
+
+std::string ToChromeTraceJson() {
+  auto *recorder = GetRecorder();
+  std::lock_guard<std::mutex> lock(recorder->mutex);
+  std::vector<std::string> events;
+  for (const auto &it : recorder->thread_names) {
+    events.push_back(absl::StrFormat(
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+        "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+        it.first, EscapeJson(it.second).c_str()));
+  }
+  for (const auto &event : recorder->events) {
+    // A span which began before Start() is cut at the origin.
+    const auto begin = std::max(event.begin, recorder->origin);
+    events.push_back(absl::StrFormat(
+        "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+        "\"ts\": %.3f, \"dur\": %.3f}",
+        EscapeJson(event.name).c_str(), event.tid,
+        Microseconds(begin - recorder->origin),
+        Microseconds(std::max(event.end, begin) - begin)));
+  }
+  return absl::StrCat("{\"traceEvents\": [\n  ",
+                      absl::StrJoin(events, ",\n  "),
+                      "],\n \"displayTimeUnit\": \"ms\"}\n");
+}
+
+util::Status WriteChromeTrace(absl::string_view filename) {
+  auto output = filesystem::NewWritableFile(filename);
+  RETURN_IF_ERROR(output->status());
+  CHECK_OR_RETURN(output->Write(ToChromeTraceJson()))
+      << "Failed to write " << filename;
+  return util::OkStatus();
+}
+
+Span::Span(absl::string_view name)
+    : name_(name), recording_(IsRecording()) {
+  if (recording_) begin_ = Clock::now();
+}
+
+Span::~Span() {
+  if (recording_) RecordSpan(name_, begin_, Clock::now());
+}
+
+}  // namespace trace
+}  // namespace sentencepiece
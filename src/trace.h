@@ -0,0 +1,108 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <chrono>
+#include <string>
+
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+// Spans of the threads of the trainer and the processor, written as Chrome
+// trace event JSON, which chrome://tracing and ui.perfetto.dev open. Unlike
+// TrainingMetrics, which adds up the phases, the trace shows when each
+// thread ran what, e.g. the workers idle at the end of an E step.
+//
+// The instrumentation is compiled out unless the library is built with
+// SPM_ENABLE_TRACING:
+//
+//   void RunEStep() {
+//     SPM_TRACE_SPAN("e_step");
+//     ...
+//   }
+//
+//   trace::Start();
+//   RunEStep();
+//   trace::Stop();
+//   CHECK_OK(trace::WriteChromeTrace("/tmp/trace.json"));
+#ifdef SPM_ENABLE_TRACING
+#define SPM_TRACE_CONCAT_INTERNAL(a, b) a##b
+#define SPM_TRACE_CONCAT(a, b) SPM_TRACE_CONCAT_INTERNAL(a, b)
+#define SPM_TRACE_SPAN(name) \
+  ::sentencepiece::trace::Span SPM_TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define SPM_TRACE_THREAD_NAME(name) \
+  ::sentencepiece::trace::SetThreadName(name)
+#else
+#define SPM_TRACE_SPAN(name)
+#define SPM_TRACE_THREAD_NAME(name)
+#endif
+
+namespace sentencepiece {
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+// True when the instrumentation is compiled in.
+#ifdef SPM_ENABLE_TRACING
+constexpr bool kCompiledIn = true;
+#else
+constexpr bool kCompiledIn = false;
+#endif
+
+// Starts recording the spans of all the threads. The spans recorded
+// before are dropped.
+void Start();
+
+// Stops recording. The recorded spans are kept until the next Start().
+void Stop();
+
+// Returns true between Start() and Stop().
+bool IsRecording();
+
+// Records the span `name` of the calling thread from `begin` to `end`,
+// when recording.
+void RecordSpan(absl::string_view name, Clock::time_point begin,
+                Clock::time_point end);
+
+// Names the calling thread in the trace, e.g. "worker 3".
+void SetThreadName(absl::string_view name);
+
+// Returns the recorded spans as a JSON object {"traceEvents": [...]} of
+// complete events, with the timestamps in microseconds since Start().
+std::string ToChromeTraceJson();
+
+// Writes ToChromeTraceJson() to `filename`.
+util::Status WriteChromeTrace(absl::string_view filename);
+
+// Records the span `name` from its construction to its destruction.
+// `name` must outlive the span.
+class Span {
+ public:
+  explicit Span(absl::string_view name);
+  ~Span();
+
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+ private:
+  absl::string_view name_;
+  bool recording_ = false;
+  Clock::time_point begin_;
+};
+
+}  // namespace trace
+}  // namespace sentencepiece
+#endif  // TRACE_H_
@@ -0,0 +1,115 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "trace.h"
+
+#include <string>
+#include <thread>
+
+#include "filesystem.h"
+#include "testharness.h"
+#include "third_party/absl/strings/match.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace trace {
+namespace {
+
+int CountOf(absl::string_view text, absl::string_view pattern) {
+  int count = 0;
+  for (size_t pos = text.find(pattern); pos != absl::string_view::npos;
+       pos = text.find(pattern, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+TEST(TraceTest, SpanTest) {
+  EXPECT_FALSE(IsRecording());
+  { Span span("before_start"); }
+
+  Start();
+  EXPECT_TRUE(IsRecording());
+  {
+    Span outer("outer");
+    Span inner("inner");
+  }
+  std::thread([]() {
+    SetThreadName("helper \"1\"");
+    Span span("on_helper");
+  }).join();
+  const auto now = Clock::now();
+  RecordSpan("recorded", now - std::chrono::hours(1), now);
+  Stop();
+  EXPECT_FALSE(IsRecording());
+  { Span span("after_stop"); }
+
+  const std::string json = ToChromeTraceJson();
+  EXPECT_TRUE(absl::StartsWith(json, "{\"traceEvents\": ["));
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"outer\", \"ph\": \"X\""));
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"inner\", \"ph\": \"X\""));
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"on_helper\""));
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"helper \\\"1\\\"\""));
+  // The span which began before Start() is cut at the origin.
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"recorded\", \"ph\": \"X\", "
+                             "\"pid\": 1, \"tid\": "));
+  EXPECT_EQ(0, CountOf(json, "\"ts\": -"));
+  EXPECT_EQ(0, CountOf(json, "before_start"));
+  EXPECT_EQ(0, CountOf(json, "after_stop"));
+  EXPECT_EQ(4, CountOf(json, "\"ph\": \"X\""));
+
+  // Start() drops the spans recorded before.
+  Start();
+  Stop();
+  EXPECT_EQ(0, CountOf(ToChromeTraceJson(), "\"ph\": \"X\""));
+}
+
+TEST(TraceTest, ThreadPoolTest) {
+  Start();
+  {
+    ThreadPool pool(2);
+    pool.ParallelFor(100, 1, [](int32, int64, int64) { Span span("chunk"); });
+  }
+  Stop();
+  const std::string json = ToChromeTraceJson();
+  EXPECT_EQ(100, CountOf(json, "\"name\": \"chunk\""));
+  if (kCompiledIn) {
+    EXPECT_GE(CountOf(json, "\"name\": \"parallel_for\""), 1);
+    EXPECT_GE(CountOf(json, "\"name\": \"worker 1\""), 1);
+  } else {
+    EXPECT_EQ(0, CountOf(json, "\"name\": \"parallel_for\""));
+  }
+}
+
+TEST(TraceTest, WriteChromeTraceTest) {
+  Start();
+  { Span span("written"); }
+  Stop();
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "trace.json");
+  ASSERT_TRUE(WriteChromeTrace(filename).ok());
+  std::string json;
+  {
+    auto input = filesystem::NewReadableFile(filename);
+    ASSERT_TRUE(input->ReadAll(&json));
+  }
+  EXPECT_EQ(ToChromeTraceJson(), json);
+  EXPECT_EQ(1, CountOf(json, "\"name\": \"written\""));
+
+  EXPECT_FALSE(WriteChromeTrace("/__UNKNOWN_DIR__/trace.json").ok());
+}
+
+}  // namespace
+}  // namespace trace
+}  // namespace sentencepiece
@@ -15,25 +15,40 @@
 #include "trainer_interface.h"
 
 #include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <random>
 #include <set>
 #include <string>
+#include <system_error>
 #include <utility>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
 #include "filesystem.h"
+#include "memory_placement.h"
 #include "model_factory.h"
 #include "model_interface.h"
 #include "normalizer.h"
+#include "pretokenizer_for_training.h"
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/strings/numbers.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_format.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_split.h"
+#include "trace.h"
 #include "unicode_script.h"
 #include "util.h"
 
@@ -97,20 +112,22 @@ bool is_unicode_decimal_number(char32 c) {
   return (c >= 0x30 && c <= 0x39) || (c >= 0xff10 && c <= 0xff19);
 }
 
+// Sentences while they are loaded and preprocessed. They are moved to a
+// SentenceArena at the end of LoadSentences().
+using SentenceList = std::vector<TrainerInterface::Sentence>;
+
 class SentenceSelector {
  public:
-  using Sampler = random::ReservoirSampler<TrainerInterface::Sentence>;
+  using Sampler = random::PrioritySampler<TrainerInterface::Sentence>;
 
   static constexpr int64 kTooBigSentencesSize = 1000000;
+  static constexpr uint64 kSeed = 12345678;
 
-  SentenceSelector(TrainerInterface::Sentences *sentences,
-                   const TrainerSpec &spec)
+  SentenceSelector(SentenceList *sentences, const TrainerSpec &spec)
       : sentences_(sentences), spec_(&spec) {
     if (spec_->input_sentence_size() > 0) {
       if (spec_->shuffle_input_sentence()) {
-        constexpr size_t kSeed = 12345678;
-        sampler_ = std::make_unique<Sampler>(
-            sentences, spec_->input_sentence_size(), kSeed);
+        sampler_ = std::make_unique<Sampler>(spec_->input_sentence_size());
       } else {
         LOG(INFO)
             << "First " << spec_->input_sentence_size()
@@ -119,9 +136,14 @@ class SentenceSelector {
     }
   }
 
-  void Finish() const {
-    if (sentences_->size() > kTooBigSentencesSize) {
-      LOG(WARNING) << "Too many sentences are loaded! (" << sentences_->size()
+  void Finish() {
+    if (sampler_) sampler_->Finish(sentences_);
+    WarnIfTooMany(*sentences_);
+  }
+
+  static void WarnIfTooMany(const SentenceList &sentences) {
+    if (sentences.size() > kTooBigSentencesSize) {
+      LOG(WARNING) << "Too many sentences are loaded! (" << sentences.size()
                    << "), which may slow down training.";
       LOG(WARNING) << "Consider using "
                       "--input_sentence_size=<size> and "
@@ -131,12 +153,14 @@ class SentenceSelector {
     }
   }
 
-  bool Add(const std::pair<std::string, int64> &sentence) {
+  // `line_index` is the position of the sentence in the corpus, from which
+  // the key of the random sampling is derived.
+  bool Add(const std::pair<std::string, int64> &sentence, uint64 line_index) {
     if (spec_->input_sentence_size() == 0) {
       sentences_->emplace_back(sentence);
     } else {
       if (spec_->shuffle_input_sentence()) {
-        sampler_->Add(sentence);
+        sampler_->Add(random::PriorityKey(kSeed, line_index), sentence);
       } else {
         sentences_->emplace_back(sentence);
         if (sentences_->size() >= spec_->input_sentence_size()) return false;
@@ -155,10 +179,475 @@ class SentenceSelector {
   }
 
  private:
-  TrainerInterface::Sentences *sentences_ = nullptr;
+  SentenceList *sentences_ = nullptr;
   const TrainerSpec *spec_ = nullptr;
   std::unique_ptr<Sampler> sampler_;
 };
+
+// Parses the lines of the corpus and drops the ones which are not used for
+// training. Skipped lines are counted instead of logged one by one, so that
+// the filters of the parallel readers can be merged afterwards.
+class SentenceFilter {
+ public:
+  explicit SentenceFilter(const TrainerSpec &spec)
+      : spec_(&spec), is_tsv_(spec.input_format() == "tsv") {}
+
+  // Stores the sentence of `line` to `sentence`. `accepted` is set to false
+  // when the line is skipped.
+  util::Status Parse(absl::string_view line,
+                     TrainerInterface::Sentence *sentence, bool *accepted) {
+    int64 freq = 1;
+    absl::string_view text = line;
+
+    if (is_tsv_) {
+      const std::vector<absl::string_view> v = absl::StrSplit(line, '\t');
+      CHECK_EQ_OR_RETURN(v.size(), 2)
+          << "Input format must be: word <tab> freq. " << line;
+      text = v[0];
+      CHECK_OR_RETURN(absl::SimpleAtoi(v[1], &freq))
+          << "Could not parse the frequency";
+      CHECK_GE_OR_RETURN(freq, 1);
+    }
+
+    return Accept(text, freq, sentence, accepted);
+  }
+
+  // Stores `text` with `freq` to `sentence` unless it is skipped.
+  util::Status Accept(absl::string_view text, int64 freq,
+                      TrainerInterface::Sentence *sentence, bool *accepted) {
+    *accepted = false;
+    if (text.empty()) return util::OkStatus();
+
+    if (static_cast<int>(text.size()) > spec_->max_sentence_length()) {
+      ++too_long_lines_;
+      return util::OkStatus();
+    }
+
+    if (text.find(TrainerInterface::kUNKStr) != absl::string_view::npos) {
+      ++reserved_lines_;
+      return util::OkStatus();
+    }
+
+    sentence->first.assign(text.data(), text.size());
+    sentence->second = freq;
+    *accepted = true;
+    return util::OkStatus();
+  }
+
+  void Merge(const SentenceFilter &other) {
+    too_long_lines_ += other.too_long_lines_;
+    reserved_lines_ += other.reserved_lines_;
+  }
+
+  int too_long_lines() const { return too_long_lines_; }
+  int reserved_lines() const { return reserved_lines_; }
+
+ private:
+  const TrainerSpec *spec_ = nullptr;
+  bool is_tsv_ = false;
+  int too_long_lines_ = 0;
+  int reserved_lines_ = 0;
+};
+
+// Normalizes the sentences for training. The user defined meta pieces are
+// replaced with kUPPBoundaryStr, so that they never appear inside a piece.
+class SentenceNormalizer {
+ public:
+  SentenceNormalizer(const NormalizerSpec &normalizer_spec,
+                     const TrainerSpec &trainer_spec,
+                     const std::set<absl::string_view> &meta_pieces)
+      : normalizer_(normalizer_spec, trainer_spec),
+        meta_pieces_matcher_(meta_pieces) {}
+
+  std::string Normalize(absl::string_view sentence) const {
+    std::string normalized = normalizer_.Normalize(sentence);
+    meta_pieces_matcher_.GlobalReplace(&normalized,
+                                       TrainerInterface::kUPPBoundaryStr);
+    return normalized;
+  }
+
+ private:
+  const normalizer::Normalizer normalizer_;
+  const normalizer::PrefixMatcher meta_pieces_matcher_;
+};
+
+using WordCounts = absl::flat_hash_map<std::string, int64>;
+
+// Adds the words of the normalized `sentence` to `words` in the same way as
+// TrainerInterface::SplitSentencesByWhitespace().
+util::Status CountWords(const TrainerSpec &spec, absl::string_view sentence,
+                        int64 freq, WordCounts *words) {
+  CHECK_OR_RETURN(sentence.find(" ") == absl::string_view::npos)
+      << "Normalized string must not include spaces";
+  for (const auto &w :
+       SplitIntoWords(sentence, spec.treat_whitespace_as_suffix(),
+                      spec.allow_whitespace_only_pieces())) {
+    (*words)[std::string(w)] += freq;
+  }
+  return util::OkStatus();
+}
+
+// Word counts of the slots of a pool, split into partitions by the hash of
+// the words: counts[slot][part]. The partitions are merged in parallel.
+using PartitionedWordCounts = std::vector<std::vector<WordCounts>>;
+
+PartitionedWordCounts MakePartitionedWordCounts(const ThreadPool &pool) {
+  return PartitionedWordCounts(pool.size(),
+                               std::vector<WordCounts>(pool.size()));
+}
+
+// Adds `freq` to `word` in the counts of a slot.
+void AddWord(absl::string_view word, int64 freq,
+             std::vector<WordCounts> *parts) {
+  const size_t part = std::hash<absl::string_view>()(word) % parts->size();
+  (*parts)[part][std::string(word)] += freq;
+}
+
+// Sums the counts of the slots and returns the words in the order of
+// Sorted(). `counts` is released.
+SentenceList MergeWordCounts(ThreadPool *pool, PartitionedWordCounts *counts) {
+  const int num_parts = counts->empty() ? 0 : counts->front().size();
+  std::vector<SentenceList> merged(num_parts);
+  pool->ParallelFor(num_parts, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 part = begin; part < end; ++part) {
+      WordCounts &words = (*counts)[0][part];
+      for (size_t slot = 1; slot < counts->size(); ++slot) {
+        for (const auto &it : (*counts)[slot][part]) {
+          words[it.first] += it.second;
+        }
+        WordCounts().swap((*counts)[slot][part]);
+      }
+      merged[part].assign(words.begin(), words.end());
+      WordCounts().swap(words);
+    }
+  });
+  PartitionedWordCounts().swap(*counts);
+
+  size_t size = 0;
+  for (const auto &words : merged) size += words.size();
+  SentenceList result;
+  result.reserve(size);
+  for (auto &words : merged) {
+    for (auto &w : words) result.push_back(std::move(w));
+    SentenceList().swap(words);
+  }
+  ParallelSort(pool, &result,
+               [](const TrainerInterface::Sentence &p1,
+                  const TrainerInterface::Sentence &p2) {
+                 return (p1.second > p2.second ||
+                         (p1.second == p2.second && p1.first < p2.first));
+               });
+  return result;
+}
+
+void AppendUInt64(uint64 value, std::string *output) {
+  string_util::AppendUInt32(static_cast<uint32>(value), output);
+  string_util::AppendUInt32(static_cast<uint32>(value >> 32), output);
+}
+
+bool ConsumeUInt64(absl::string_view *input, uint64 *value) {
+  uint32 low = 0, high = 0;
+  if (!string_util::ConsumeUInt32(input, &low) ||
+      !string_util::ConsumeUInt32(input, &high)) {
+    return false;
+  }
+  *value = static_cast<uint64>(high) << 32 | low;
+  return true;
+}
+
+// The "counts" input format is a sequence of records
+//   <word size (32)><word><count (64)>
+// with the integers in little-endian order, so that the files of a word
+// count job can be concatenated. Consumes a record from `input`.
+bool ConsumeWordCount(absl::string_view *input, absl::string_view *word,
+                      uint64 *count) {
+  uint32 size = 0;
+  if (!string_util::ConsumeUInt32(input, &size) || input->size() < size) {
+    return false;
+  }
+  *word = input->substr(0, size);
+  input->remove_prefix(size);
+  return ConsumeUInt64(input, count);
+}
+
+// Contiguous lines of the corpus read by one worker of LoadCorpusFiles().
+struct CorpusShard {
+  explicit CorpusShard(const TrainerSpec &spec)
+      : filter(spec),
+        sampler(spec.shuffle_input_sentence() ? spec.input_sentence_size()
+                                              : 0),
+        test_sampler(spec.self_test_sample_size()) {}
+
+  // Byte ranges of the input files. They never split a line, or a record
+  // of the "counts" format.
+  std::vector<absl::string_view> segments;
+
+  // Position of the first line of the shard in the whole corpus.
+  uint64 first_line = 0;
+
+  util::Status status;
+  SentenceFilter filter;
+
+  // Sentences in the corpus order. Not used with --shuffle_input_sentence.
+  SentenceList sentences;
+  // Words of the normalized sentences when they are counted while loading.
+  WordCounts words;
+  uint64 num_sentences = 0;
+  SentenceSelector::Sampler sampler;
+  random::PrioritySampler<std::string> test_sampler;
+};
+
+// Returns the beginning of the first line which starts at or after `pos`.
+size_t AlignToLine(absl::string_view data, size_t pos) {
+  if (pos == 0 || pos >= data.size()) return std::min(pos, data.size());
+  if (data[pos - 1] == '\n') return pos;
+  const size_t next = data.find('\n', pos);
+  return next == absl::string_view::npos ? data.size() : next + 1;
+}
+
+// Returns the number of lines in `segments`, as counted by std::getline().
+uint64 CountLines(const std::vector<absl::string_view> &segments) {
+  uint64 num_lines = 0;
+  for (const auto segment : segments) {
+    num_lines += std::count(segment.begin(), segment.end(), '\n');
+    if (!segment.empty() && segment.back() != '\n') ++num_lines;
+  }
+  return num_lines;
+}
+
+util::Status LoadCorpusShard(const TrainerSpec &spec, uint64 test_seed,
+                             const SentenceNormalizer *normalizer,
+                             CorpusShard *shard) {
+  const uint64 size = spec.input_sentence_size();
+  const bool shuffle = size > 0 && spec.shuffle_input_sentence();
+
+  const bool is_counts = spec.input_format() == "counts";
+
+  TrainerInterface::Sentence sentence;
+  uint64 line_index = shard->first_line;
+  for (absl::string_view segment : shard->segments) {
+    for (; !segment.empty(); ++line_index) {
+      bool accepted = false;
+      if (is_counts) {
+        // The records are verified by LoadCorpusFiles().
+        absl::string_view word;
+        uint64 count = 0;
+        ConsumeWordCount(&segment, &word, &count);
+        RETURN_IF_ERROR(shard->filter.Accept(word, count, &sentence,
+                                             &accepted));
+      } else {
+        const size_t pos = segment.find('\n');
+        const absl::string_view line = segment.substr(0, pos);
+        segment.remove_prefix(pos == absl::string_view::npos ? segment.size()
+                                                             : pos + 1);
+        RETURN_IF_ERROR(shard->filter.Parse(line, &sentence, &accepted));
+      }
+      if (!accepted) continue;
+
+      ++shard->num_sentences;
+      shard->test_sampler.Add(random::PriorityKey(test_seed, line_index),
+                              sentence.first);
+      if (normalizer != nullptr) {
+        RETURN_IF_ERROR(CountWords(spec, normalizer->Normalize(sentence.first),
+                                   sentence.second, &shard->words));
+      } else if (shuffle) {
+        shard->sampler.Add(
+            random::PriorityKey(SentenceSelector::kSeed, line_index),
+            sentence);
+      } else {
+        shard->sentences.emplace_back(std::move(sentence));
+        // Only the first input_sentence_size sentences can be selected.
+        if (size > 0 && shard->sentences.size() >= size) {
+          return util::OkStatus();
+        }
+      }
+    }
+  }
+
+  return util::OkStatus();
+}
+
+// Adds the records of `data`, a file of the "counts" format at byte `offset`
+// of the corpus, to the shards of the byte ranges they start in. The records
+// cannot be found from an arbitrary position, so they are skipped over one
+// by one, which also verifies them. `index` is the number of records before
+// the file and is advanced.
+util::Status SplitWordCounts(absl::string_view data, uint64 offset,
+                             uint64 corpus_size, uint64 *index,
+                             std::vector<CorpusShard> *shards) {
+  const uint64 num_shards = shards->size();
+  absl::string_view rest = data;
+  size_t begin = 0;
+  uint64 shard = num_shards;
+  while (!rest.empty()) {
+    const size_t pos = data.size() - rest.size();
+    const uint64 i =
+        std::min(num_shards - 1, (offset + pos) * num_shards / corpus_size);
+    if (i != shard) {
+      if (shard < num_shards) {
+        (*shards)[shard].segments.push_back(data.substr(begin, pos - begin));
+      }
+      if ((*shards)[i].segments.empty()) (*shards)[i].first_line = *index;
+      shard = i;
+      begin = pos;
+    }
+    absl::string_view word;
+    uint64 count = 0;
+    CHECK_OR_RETURN(ConsumeWordCount(&rest, &word, &count))
+        << "Truncated word count record at byte " << offset + pos;
+    CHECK_OR_RETURN(count >= 1 &&
+                    count <= std::numeric_limits<int64>::max())
+        << "Invalid count of the word count record at byte " << offset + pos;
+    ++*index;
+  }
+  if (shard < num_shards) {
+    (*shards)[shard].segments.push_back(data.substr(begin));
+  }
+  return util::OkStatus();
+}
+
+// Loads the sentences of spec.input() with `pool`. The corpus is split into
+// one contiguous byte range per worker, and the workers parse, filter and
+// sample their own lines. The random samples are keyed by line positions in
+// the corpus, so the sentences are the same as the ones of the serial reader
+// whatever the number of threads. Only the self-test samples may differ when
+// the first input_sentence_size sentences are taken, as the workers do not
+// stop at the same line as the serial reader.
+// When `normalizer` is given, the workers instead normalize the sentences and
+// count their words, and `sentences` receives the words with their total
+// frequencies in no particular order.
+util::Status LoadCorpusFiles(const TrainerSpec &spec, ThreadPool *pool,
+                             const SentenceNormalizer *normalizer,
+                             SentenceList *sentences,
+                             std::vector<std::string> *test_samples,
+                             SentenceFilter *filter, uint64 *total_size) {
+  std::vector<std::unique_ptr<filesystem::MappedFile>> files;
+  uint64 corpus_size = 0;
+  for (const auto &filename : spec.input()) {
+    LOG(INFO) << "Loading corpus: " << filename;
+    files.emplace_back(filesystem::NewMappedFile(filename));
+    RETURN_IF_ERROR(files.back()->status());
+    corpus_size += files.back()->data().size();
+  }
+
+  const int num_shards = std::max<int>(1, pool->size());
+  std::vector<CorpusShard> shards(num_shards, CorpusShard(spec));
+  const bool is_counts = spec.input_format() == "counts";
+  uint64 offset = 0, num_records = 0;
+  for (const auto &file : files) {
+    const absl::string_view data = file->data();
+    if (is_counts) {
+      RETURN_IF_ERROR(
+          SplitWordCounts(data, offset, corpus_size, &num_records, &shards));
+      offset += data.size();
+      continue;
+    }
+    for (int i = 0; i < num_shards; ++i) {
+      const uint64 begin = corpus_size * i / num_shards;
+      const uint64 end = corpus_size * (i + 1) / num_shards;
+      if (end <= offset || begin >= offset + data.size()) continue;
+      const size_t b = AlignToLine(data, begin > offset ? begin - offset : 0);
+      const size_t e = AlignToLine(data, end - offset);
+      if (b < e) shards[i].segments.emplace_back(data.substr(b, e - b));
+    }
+    offset += data.size();
+  }
+
+  // The line positions are only needed for the random sampling. The ones of
+  // the records are already known.
+  if (!is_counts &&
+      (spec.self_test_sample_size() > 0 ||
+       (spec.input_sentence_size() > 0 && spec.shuffle_input_sentence()))) {
+    std::vector<uint64> num_lines(num_shards, 0);
+    pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+      SPM_TRACE_SPAN("count_lines");
+      for (int64 i = begin; i < end; ++i) {
+        num_lines[i] = CountLines(shards[i].segments);
+      }
+    });
+    for (int i = 1; i < num_shards; ++i) {
+      shards[i].first_line = shards[i - 1].first_line + num_lines[i - 1];
+    }
+  }
+
+  const uint64 test_seed = GetRandomGeneratorSeed();
+  pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+    SPM_TRACE_SPAN("load_corpus_shard");
+    for (int64 i = begin; i < end; ++i) {
+      shards[i].status =
+          LoadCorpusShard(spec, test_seed, normalizer, &shards[i]);
+    }
+  });
+
+  for (const auto &shard : shards) RETURN_IF_ERROR(shard.status);
+
+  const uint64 size = spec.input_sentence_size();
+  auto &sampler = shards[0].sampler;
+  auto &test_sampler = shards[0].test_sampler;
+  auto &words = shards[0].words;
+  uint64 num_sentences = 0;
+  for (int i = 0; i < num_shards; ++i) {
+    filter->Merge(shards[i].filter);
+    num_sentences += shards[i].num_sentences;
+    if (i > 0) {
+      sampler.Merge(&shards[i].sampler);
+      test_sampler.Merge(&shards[i].test_sampler);
+      for (const auto &it : shards[i].words) words[it.first] += it.second;
+      WordCounts().swap(shards[i].words);
+    }
+    for (auto &sentence : shards[i].sentences) {
+      if (size > 0 && sentences->size() >= size) break;
+      sentences->emplace_back(std::move(sentence));
+    }
+  }
+
+  if (normalizer != nullptr) {
+    sentences->assign(words.begin(), words.end());
+    *total_size = num_sentences;
+  } else if (size > 0 && spec.shuffle_input_sentence()) {
+    sampler.Finish(sentences);
+    *total_size = sampler.total_size();
+  } else {
+    if (size > 0) {
+      LOG(INFO)
+          << "First " << size
+          << " sentences are selected. Remaining sentences are discarded.";
+    }
+    *total_size = sentences->size();
+  }
+
+  test_sampler.Finish(test_samples);
+
+  return util::OkStatus();
+}
+
+// Checkpoint file format. The integers are 32-bit little-endian.
+// <magic (8byte)><model type><step>
+// <number of pieces>(<piece size><piece><score bits>)*
+// <number of merges>(<left size><left><right size><right>)*
+constexpr char kCheckpointMagic[] = "SPMCKPT1";
+constexpr size_t kCheckpointMagicSize = 8;
+
+// Corpus cache file format. The integers are 32-bit little-endian, and the
+// 64-bit ones are written as their low and high halves.
+// <magic (8byte)><sentences are words><total size (64)>
+// <number of required chars>(<char><frequency (64)>)*
+// <number of test samples>(<sample size><sample>)*
+// <number of sentences (64)><number of bytes (64)>
+// (<sentence size><sentence><frequency (64)>)*
+constexpr char kCorpusCacheMagic[] = "SPMCORP1";
+constexpr size_t kCorpusCacheMagicSize = 8;
+
+// Fingerprint of `data`, taken 8 bytes at a time.
+uint64 FingerprintBytes(absl::string_view data) {
+  uint64 fp = data.size();
+  for (size_t i = 0; i < data.size(); i += sizeof(uint64)) {
+    uint64 chunk = 0;
+    memcpy(&chunk, data.data() + i, std::min(sizeof(uint64), data.size() - i));
+    fp = port::FingerprintCat(fp, chunk);
+  }
+  return fp;
+}
 }  // namespace
 
 MultiFileSentenceIterator::MultiFileSentenceIterator(
@@ -209,6 +698,317 @@ TrainerInterface::TrainerInterface(const TrainerSpec &trainer_spec,
 
 TrainerInterface::~TrainerInterface() {}
 
+void TrainerInterface::SetCheckpoint(absl::string_view checkpoint_path,
+                                     int checkpoint_interval,
+                                     absl::string_view resume_from) {
+  checkpoint_path_ = std::string(checkpoint_path);
+  checkpoint_interval_ = checkpoint_interval;
+  resume_from_ = std::string(resume_from);
+}
+
+void TrainerInterface::SetDistributed(absl::string_view directory,
+                                      int num_shards, int shard_id) {
+  distributed_dir_ = std::string(directory);
+  num_shards_ = num_shards;
+  shard_id_ = shard_id;
+}
+
+bool TrainerInterface::IsCheckpointStep(int64 step, int64 last_step,
+                                        int default_interval) const {
+  const int interval =
+      checkpoint_interval_ > 0 ? checkpoint_interval_ : default_interval;
+  return !checkpoint_path_.empty() && step - last_step >= interval;
+}
+
+util::Status SentenceArena::Spill(absl::string_view filename,
+                                  const std::vector<int64> &order) {
+  CHECK_EQ_OR_RETURN(order.size(), size());
+  std::vector<size_t> offsets = {0};
+  std::vector<int64> freqs;
+  offsets.reserve(size() + 1);
+  freqs.reserve(size());
+  {
+    auto output = filesystem::NewBufferedWritableFile(filename, true);
+    RETURN_IF_ERROR(output->status());
+    for (const int64 i : order) {
+      const auto w = (*this)[i];
+      CHECK_OR_RETURN(output->Write(w.first)) << "Cannot write " << filename;
+      offsets.push_back(offsets.back() + w.first.size());
+      freqs.push_back(w.second);
+    }
+    CHECK_OR_RETURN(output->Flush()) << "Cannot write " << filename;
+  }
+
+  std::shared_ptr<const filesystem::MappedFile> file =
+      filesystem::NewMappedFile(filename);
+  RETURN_IF_ERROR(file->status());
+  CHECK_EQ_OR_RETURN(file->data().size(), offsets.back());
+  // The mapping outlives the name on POSIX systems. Elsewhere the file was
+  // read into memory.
+  std::error_code error;
+  std::filesystem::remove(std::string(filename), error);
+
+  std::string().swap(buffer_);
+  file_ = std::move(file);
+  offsets_ = std::move(offsets);
+  freqs_ = std::move(freqs);
+  return util::OkStatus();
+}
+
+util::Status WriteFileAtomically(absl::string_view filename,
+                                 absl::string_view blob) {
+  const std::string tmp_filename = absl::StrCat(filename, ".tmp");
+  {
+    auto output = filesystem::NewWritableFile(tmp_filename, true);
+    RETURN_IF_ERROR(output->status());
+    CHECK_OR_RETURN(output->Write(blob)) << "Cannot write " << tmp_filename;
+  }
+  CHECK_OR_RETURN(std::rename(tmp_filename.c_str(),
+                              std::string(filename).c_str()) == 0)
+      << "Cannot rename " << tmp_filename << " to " << filename;
+  return util::OkStatus();
+}
+
+util::Status WriteCheckpointFile(absl::string_view filename,
+                                 const TrainerCheckpoint &checkpoint) {
+  std::string blob(kCheckpointMagic, kCheckpointMagicSize);
+  string_util::AppendUInt32(checkpoint.model_type, &blob);
+  string_util::AppendUInt32(checkpoint.step, &blob);
+  string_util::AppendUInt32(checkpoint.pieces.size(), &blob);
+  for (const auto &it : checkpoint.pieces) {
+    string_util::AppendBytes(it.first, &blob);
+    uint32 score = 0;
+    memcpy(&score, &it.second, sizeof(score));
+    string_util::AppendUInt32(score, &blob);
+  }
+  string_util::AppendUInt32(checkpoint.merges.size(), &blob);
+  for (const auto &it : checkpoint.merges) {
+    string_util::AppendBytes(it.first, &blob);
+    string_util::AppendBytes(it.second, &blob);
+  }
+  return WriteFileAtomically(filename, blob);
+}
+
+util::Status ReadCheckpointFile(absl::string_view filename,
+                                TrainerCheckpoint *checkpoint) {
+  auto input = filesystem::NewReadableFile(filename, true);
+  RETURN_IF_ERROR(input->status());
+  std::string blob;
+  CHECK_OR_RETURN(input->ReadAll(&blob)) << "Cannot read " << filename;
+
+  absl::string_view data(blob);
+  CHECK_OR_RETURN(data.substr(0, kCheckpointMagicSize) ==
+                  absl::string_view(kCheckpointMagic, kCheckpointMagicSize))
+      << filename << " is not a checkpoint file.";
+  data.remove_prefix(kCheckpointMagicSize);
+
+  uint32 model_type = 0, step = 0, size = 0;
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &model_type) &&
+                  string_util::ConsumeUInt32(&data, &step) &&
+                  TrainerSpec::ModelType_IsValid(model_type))
+      << "Checkpoint file is broken.";
+  checkpoint->model_type = static_cast<TrainerSpec::ModelType>(model_type);
+  checkpoint->step = step;
+
+  checkpoint->pieces.clear();
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &size))
+      << "Checkpoint file is broken.";
+  for (uint32 i = 0; i < size; ++i) {
+    std::string piece;
+    uint32 bits = 0;
+    CHECK_OR_RETURN(string_util::ConsumeBytes(&data, &piece) &&
+                    string_util::ConsumeUInt32(&data, &bits))
+        << "Checkpoint file is broken.";
+    float score = 0.0;
+    memcpy(&score, &bits, sizeof(score));
+    checkpoint->pieces.emplace_back(std::move(piece), score);
+  }
+
+  checkpoint->merges.clear();
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &size))
+      << "Checkpoint file is broken.";
+  for (uint32 i = 0; i < size; ++i) {
+    std::string left, right;
+    CHECK_OR_RETURN(string_util::ConsumeBytes(&data, &left) &&
+                    string_util::ConsumeBytes(&data, &right))
+        << "Checkpoint file is broken.";
+    checkpoint->merges.emplace_back(std::move(left), std::move(right));
+  }
+  CHECK_OR_RETURN(data.empty()) << "Checkpoint file is broken.";
+  return util::OkStatus();
+}
+
+namespace {
+int64 GetPeakRssBytes() {
+#if defined(_WIN32)
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+  return usage.ru_maxrss;  // bytes
+#else
+  return static_cast<int64>(usage.ru_maxrss) * 1024;  // kilobytes
+#endif
+#endif
+}
+}  // namespace
+
+TrainingMetrics::Scope::Scope(TrainingMetrics *metrics, absl::string_view name,
+                              int64 items)
+    : metrics_(metrics),
+      wall_start_(std::chrono::steady_clock::now()),
+      cpu_start_(std::clock()) {
+  phase_.name = std::string(name);
+  phase_.items = items;
+}
+
+TrainingMetrics::Scope::~Scope() {
+  const auto wall_end = std::chrono::steady_clock::now();
+#ifdef SPM_ENABLE_TRACING
+  // The phases are spans of the trace as well.
+  trace::RecordSpan(phase_.name, wall_start_, wall_end);
+#endif
+  const std::chrono::duration<double> wall = wall_end - wall_start_;
+  phase_.wall_seconds = wall.count();
+  phase_.cpu_seconds =
+      static_cast<double>(std::clock() - cpu_start_) / CLOCKS_PER_SEC;
+  phase_.peak_rss_bytes = GetPeakRssBytes();
+  metrics_->phases_.push_back(std::move(phase_));
+}
+
+void TrainingMetrics::LogSummary() const {
+  // Phases of the same name, e.g. the EM iterations, in the order of their
+  // first occurrence.
+  std::vector<std::string> names;
+  absl::flat_hash_map<std::string, Phase> totals;
+  for (const auto &phase : phases_) {
+    auto it = totals.find(phase.name);
+    if (it == totals.end()) {
+      names.push_back(phase.name);
+      it = totals.emplace(phase.name, Phase()).first;
+    }
+    it->second.wall_seconds += phase.wall_seconds;
+    it->second.cpu_seconds += phase.cpu_seconds;
+    it->second.peak_rss_bytes =
+        std::max(it->second.peak_rss_bytes, phase.peak_rss_bytes);
+    it->second.items += phase.items;
+  }
+  for (const auto &name : names) {
+    const Phase &total = totals[name];
+    LOG(INFO) << "Phase " << name << ": wall=" << total.wall_seconds
+              << " sec. cpu=" << total.cpu_seconds
+              << " sec. peak_rss=" << (total.peak_rss_bytes >> 20)
+              << " MB items=" << total.items;
+  }
+}
+
+std::string TrainingMetrics::ToJson() const {
+  // The names are identifiers of the trainers, which need no escaping.
+  std::vector<std::string> phases;
+  for (const auto &phase : phases_) {
+    const double items_per_second =
+        phase.wall_seconds > 0.0 ? phase.items / phase.wall_seconds : 0.0;
+    phases.push_back(absl::StrFormat(
+        "{\"name\": \"%s\", \"wall_seconds\": %.6f, "
+        "\"cpu_seconds\": %.6f, \"peak_rss_bytes\": %lld, "
+        "\"items\": %lld, \"items_per_second\": %.3f}",
+        phase.name.c_str(), phase.wall_seconds, phase.cpu_seconds,
+        static_cast<long long>(phase.peak_rss_bytes),
+        static_cast<long long>(phase.items), items_per_second));
+  }
+  return absl::StrCat("{\"phases\": [", absl::StrJoin(phases, ",\n  "),
+                      "]}\n");
+}
+
+util::Status TrainerInterface::SaveCheckpoint(
+    const TrainerCheckpoint &checkpoint) const {
+  // The file is replaced only once written, so that a job killed while
+  // writing keeps the previous checkpoint.
+  RETURN_IF_ERROR(WriteCheckpointFile(checkpoint_path_, checkpoint));
+  LOG(INFO) << "Saved checkpoint: " << checkpoint_path_
+            << " step=" << checkpoint.step;
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::LoadCheckpoint(
+    TrainerCheckpoint *checkpoint) const {
+  RETURN_IF_ERROR(ReadCheckpointFile(resume_from_, checkpoint));
+  CHECK_EQ_OR_RETURN(checkpoint->model_type, trainer_spec_.model_type())
+      << "Checkpoint was written for another model type.";
+  LOG(INFO) << "Resuming from checkpoint: " << resume_from_
+            << " step=" << checkpoint->step;
+  return util::OkStatus();
+}
+
+ThreadPool *TrainerInterface::GetThreadPool() const {
+  if (pool_ == nullptr) {
+    pool_ = std::make_unique<ThreadPool>(trainer_spec_.num_threads(),
+                                         placement::WorkerInitializer());
+  }
+  return pool_.get();
+}
+
+std::vector<std::vector<std::string>> TrainerInterface::PreTokenizeSentences(
+    const pretokenizer::PretokenizerForTrainingInterface &pretokenizer) const {
+  // Bounds the memory of a batch while amortizing the overhead of a call.
+  constexpr int64 kBatchSize = 1024;
+  std::vector<std::vector<std::string>> result(sentences_.size());
+  GetThreadPool()->ParallelFor(
+      sentences_.size(), 0, [&](int32, int64 begin, int64 end) {
+        std::vector<absl::string_view> texts;
+        for (int64 i = begin; i < end; i += kBatchSize) {
+          const int64 batch_end = std::min(end, i + kBatchSize);
+          texts.clear();
+          for (int64 j = i; j < batch_end; ++j) {
+            texts.push_back(sentences_[j].first);
+          }
+          auto tokens = pretokenizer.PreTokenize(texts);
+          for (int64 j = i; j < batch_end; ++j) {
+            result[j] = std::move(tokens[j - i]);
+          }
+        }
+      });
+  return result;
+}
+
+// static
+TrainerInterface::CharProperties TrainerInterface::ComputeCharProperties(
+    char32 c) {
+  if (c == kUNKChar ||  // UNK must not be included
+      c == 0x0000 ||    // NULL is not allowed for Darts (TRIE).
+      c == kUPPBoundaryChar || !string_util::IsValidCodepoint(c)) {
+    return kCharInvalid;
+  }
+  if (c == 0x0020) return kCharInvalid | kCharSpace;
+  if (c == kWSChar) return kCharWhitespace;
+
+  auto s = unicode_script::GetScript(c);
+  CharProperties flags = 0;
+  // Merge Hiragana/Katakana into Han.
+  if (s == unicode_script::U_Hiragana || s == unicode_script::U_Katakana ||
+      c == 0x30FC) {  // long vowel sound (Katakana) should be Katakana
+    s = unicode_script::U_Han;
+  } else if (s == unicode_script::U_Inherited) {
+    flags |= kCharInherited;
+  }
+  if (is_unicode_decimal_number(c)) flags |= kCharNumber;
+  return flags | static_cast<CharProperties>(s);
+}
+
+// static
+TrainerInterface::CharProperties TrainerInterface::GetCharProperties(
+    char32 c) {
+  static const auto *bmp = [] {
+    auto *table = new std::vector<CharProperties>(0x10000);
+    for (char32 c = 0; c < table->size(); ++c) {
+      (*table)[c] = ComputeCharProperties(c);
+    }
+    return table;
+  }();
+  return c < bmp->size() ? (*bmp)[c] : ComputeCharProperties(c);
+}
+
 bool TrainerInterface::IsValidSentencePiece(
     const string_util::UnicodeText &sentencepiece) const {
   // Returns false if the length of piece is invalid.
@@ -217,35 +1017,38 @@ bool TrainerInterface::IsValidSentencePiece(
           static_cast<size_t>(trainer_spec_.max_sentencepiece_length())) {
     return false;
   }
+  std::vector<CharProperties> properties(sentencepiece.size());
+  for (size_t pos = 0; pos < sentencepiece.size(); ++pos) {
+    properties[pos] = GetCharProperties(sentencepiece[pos]);
+  }
+  return IsValidSentencePiece(properties.data(), properties.size());
+}
+
+bool TrainerInterface::IsValidSentencePiece(const CharProperties *properties,
+                                            size_t size) const {
+  // Returns false if the length of piece is invalid.
+  if (size == 0 ||
+      size > static_cast<size_t>(trainer_spec_.max_sentencepiece_length())) {
+    return false;
+  }
 
-  constexpr unicode_script::ScriptType kAnyType =
-      static_cast<unicode_script::ScriptType>(-1);
+  constexpr int kAnyType = -1;
 
-  unicode_script::ScriptType prev_script = kAnyType;
-  bool all_whitespace_piece =
-      std::all_of(sentencepiece.begin(), sentencepiece.end(),
-                  [](char32 c) { return c == kWSChar; });
+  int prev_script = kAnyType;
+  const bool all_whitespace_piece =
+      std::all_of(properties, properties + size,
+                  [](CharProperties p) { return p & kCharWhitespace; });
 
-  for (size_t pos = 0; pos < sentencepiece.size(); ++pos) {
-    const char32 c = sentencepiece[pos];
-    if (c == kUNKChar) {  // UNK must not be included
-      return false;
-    }
-    if (c == 0x0000) {  // NULL is not allowed for Darts (TRIE).
-      return false;
-    }
-    if (c == kUPPBoundaryChar) {
-      return false;
-    }
-    if (c == 0x0020) {
-      LOG(WARNING) << "space must not be included in normalized string.";
-      return false;
-    }
-    if (!string_util::IsValidCodepoint(c)) {
+  for (size_t pos = 0; pos < size; ++pos) {
+    const CharProperties p = properties[pos];
+    if (p & kCharInvalid) {
+      if (p & kCharSpace) {
+        LOG(WARNING) << "space must not be included in normalized string.";
+      }
       return false;
     }
 
-    if (c == kWSChar) {
+    if (p & kCharWhitespace) {
       // Only allows whitespace to appear as a prefix of piece unless
       // allow_whitespace_only_pieces is True.
       // When split_by_whitespace is false, we allow whitespaces to
@@ -258,37 +1061,28 @@ bool TrainerInterface::IsValidSentencePiece(
       if (!trainer_spec_.allow_whitespace_only_pieces() ||
           !all_whitespace_piece) {
         if (trainer_spec_.treat_whitespace_as_suffix()) {
-          if ((trainer_spec_.split_by_whitespace() &&
-               pos < sentencepiece.size() - 1) ||
-              (!trainer_spec_.split_by_whitespace() &&
-               pos < sentencepiece.size() - 1 && pos == 0)) {
+          if ((trainer_spec_.split_by_whitespace() && pos < size - 1) ||
+              (!trainer_spec_.split_by_whitespace() && pos < size - 1 &&
+               pos == 0)) {
             return false;
           }
         } else {
           if ((trainer_spec_.split_by_whitespace() && pos > 0) ||
               (!trainer_spec_.split_by_whitespace() && pos > 0 &&
-               pos == sentencepiece.size() - 1)) {
+               pos == size - 1)) {
             return false;
           }
         }
       }
     } else {
-      auto s = unicode_script::GetScript(c);
-
-      // Merge Hiragana/Katakana into Han.
-      if (s == unicode_script::U_Hiragana || s == unicode_script::U_Katakana ||
-          c == 0x30FC) {  // long vowel sound (Katakana) should be Katakana
-        s = unicode_script::U_Han;
-      } else if (s == unicode_script::U_Inherited) {
-        s = prev_script;
-      }
+      int s = (p & kCharInherited) ? prev_script : (p & kCharScriptMask);
 
-      if (!trainer_spec_.split_by_number() && is_unicode_decimal_number(c)) {
+      if (!trainer_spec_.split_by_number() && (p & kCharNumber)) {
         s = kAnyType;
       }
 
-      if (trainer_spec_.split_digits() && is_unicode_decimal_number(c)) {
-        if (sentencepiece.size() > 1) return false;
+      if (trainer_spec_.split_digits() && (p & kCharNumber)) {
+        if (size > 1) return false;
       }
 
       // Do not allow a piece to include multiple Unicode scripts
@@ -305,8 +1099,8 @@ bool TrainerInterface::IsValidSentencePiece(
 }
 
 template <typename T>
-void AddDPNoise(const TrainerSpec &trainer_spec, std::mt19937 *generator,
-                T *to_update) {
+void AddDPNoise(const TrainerSpec &trainer_spec,
+                random::RandomGenerator *generator, T *to_update) {
   if (trainer_spec.differential_privacy_noise_level() > 0) {
     std::normal_distribution<float> dist(
         0.0f, trainer_spec.differential_privacy_noise_level());
@@ -322,12 +1116,14 @@ void AddDPNoise(const TrainerSpec &trainer_spec, std::mt19937 *generator,
 
 util::Status TrainerInterface::LoadSentences() {
   RETURN_IF_ERROR(status());
+  TrainingMetrics::Scope phase(&metrics_, "load_sentences");
   CHECK_OR_RETURN(sentences_.empty());
   CHECK_OR_RETURN(required_chars_.empty());
   CHECK_OR_RETURN(trainer_spec_.input_format().empty() ||
                   trainer_spec_.input_format() == "text" ||
-                  trainer_spec_.input_format() == "tsv")
-      << "Supported formats are 'text' and 'tsv'.";
+                  trainer_spec_.input_format() == "tsv" ||
+                  trainer_spec_.input_format() == "counts")
+      << "Supported formats are 'text', 'tsv' and 'counts'.";
 
   CHECK_OR_RETURN(
       (sentence_iterator_ != nullptr && trainer_spec_.input().empty()) ||
@@ -340,124 +1136,167 @@ util::Status TrainerInterface::LoadSentences() {
       (output_model_proto_ == nullptr && !trainer_spec_.model_prefix().empty()))
       << "ModelProto and trainer_spec.model_prefix() must be exclusive.";
 
-  const bool is_tsv = trainer_spec_.input_format() == "tsv";
-
-  SentenceSelector selector(&sentences_, trainer_spec_);
-  random::ReservoirSampler<std::string> test_sentence_sampler(
-      &self_test_samples_, trainer_spec_.self_test_sample_size());
+  SentenceFilter filter(trainer_spec_);
+  uint64 total_size = 0;
 
-  int too_long_lines = 0;
-
-  std::unique_ptr<SentenceIterator> sentence_iterator_impl;
-  if (sentence_iterator_ == nullptr) {
-    LOG(INFO) << "SentenceIterator is not specified. Using "
-                 "MultiFileSentenceIterator.";
-    sentence_iterator_impl =
-        std::make_unique<MultiFileSentenceIterator>(std::vector<std::string>(
-            trainer_spec_.input().begin(), trainer_spec_.input().end()));
-    sentence_iterator_ = sentence_iterator_impl.get();
+  std::set<absl::string_view> meta_pieces_set;
+  for (const auto &it : meta_pieces_) {
+    LOG(INFO) << "Adding meta_piece: " << it.second.first;
+    meta_pieces_set.insert(it.second.first);
+  }
+  const SentenceNormalizer normalizer(normalizer_spec_, trainer_spec_,
+                                      meta_pieces_set);
+
+  // Sampling and differential privacy work on the raw sentences.
+  sentences_are_words_ = split_by_whitespace_while_loading_ &&
+                         trainer_spec_.input_sentence_size() == 0 &&
+                         !trainer_spec_.enable_differential_privacy();
+  const SentenceNormalizer *word_normalizer =
+      sentences_are_words_ ? &normalizer : nullptr;
+
+  SentenceList sentences;
+  const bool from_files =
+      sentence_iterator_ == nullptr &&
+      std::none_of(trainer_spec_.input().begin(), trainer_spec_.input().end(),
+                   [](const std::string &file) { return file.empty(); });
+  CHECK_OR_RETURN(from_files || trainer_spec_.input_format() != "counts")
+      << "The 'counts' format is only read from input files.";
+
+  // The cache of a previous run with the same corpus and options replaces
+  // the loading.
+  const std::string cache_file = from_files ? CorpusCacheFile() : "";
+  if (!cache_file.empty() &&
+      filesystem::NewReadableFile(cache_file, true)->status().ok()) {
+    RETURN_IF_ERROR(ReadCorpusCache(cache_file, &total_size));
+    LOG(INFO) << "Loaded " << sentences_.size() << " sentences from the "
+              << "corpus cache " << cache_file;
+    LOG(INFO) << "Alphabet size=" << required_chars_.size();
+    phase.AddItems(total_size);
+    return CheckRequiredChars();
   }
 
-  for (; !sentence_iterator_->done(); sentence_iterator_->Next()) {
-    int64 freq = 1;
-    std::string sentence = sentence_iterator_->value();
-
-    if (is_tsv) {
-      const std::vector<std::string> v = absl::StrSplit(sentence, '\t');
-      CHECK_EQ_OR_RETURN(v.size(), 2)
-          << "Input format must be: word <tab> freq. " << sentence;
-      sentence = v[0];
-      CHECK_OR_RETURN(absl::SimpleAtoi(v[1], &freq))
-          << "Could not parse the frequency";
-      CHECK_GE_OR_RETURN(freq, 1);
+  if (from_files) {
+    LOG(INFO) << "Loading " << trainer_spec_.input_size()
+              << " corpus files with " << GetThreadPool()->size()
+              << " threads.";
+    RETURN_IF_ERROR(LoadCorpusFiles(trainer_spec_, GetThreadPool(),
+                                    word_normalizer, &sentences,
+                                    &self_test_samples_, &filter,
+                                    &total_size));
+    SentenceSelector::WarnIfTooMany(sentences);
+  } else {
+    SentenceSelector selector(&sentences, trainer_spec_);
+    random::PrioritySampler<std::string> test_sentence_sampler(
+        trainer_spec_.self_test_sample_size());
+    const uint64 test_seed = GetRandomGeneratorSeed();
+
+    // An empty file name reads the corpus from stdin. The files are read
+    // ahead on a background thread while the sentences are parsed.
+    std::unique_ptr<SentenceIterator> file_iterator;
+    std::unique_ptr<SentenceIterator> sentence_iterator_impl;
+    if (sentence_iterator_ == nullptr) {
+      LOG(INFO) << "SentenceIterator is not specified. Using "
+                   "MultiFileSentenceIterator.";
+      file_iterator =
+          std::make_unique<MultiFileSentenceIterator>(std::vector<std::string>(
+              trainer_spec_.input().begin(), trainer_spec_.input().end()));
+      sentence_iterator_impl =
+          std::make_unique<PrefetchingSentenceIterator>(file_iterator.get());
+      sentence_iterator_ = sentence_iterator_impl.get();
     }
 
-    if (sentence.empty()) continue;
-
-    if (static_cast<int>(sentence.size()) >
-        trainer_spec_.max_sentence_length()) {
-      if (too_long_lines == 0) {
-        LOG(WARNING) << "Found too long line (" << sentence.size() << " > "
-                     << trainer_spec_.max_sentence_length() << ").";
-        LOG(WARNING) << "Too long lines are skipped in the training.";
-        LOG(WARNING) << "The maximum length can be changed with "
-                        "--max_sentence_length=<size> flag.";
+    SPM_TRACE_SPAN("read_sentences");
+    Sentence sentence;
+    WordCounts words;
+    uint64 num_sentences = 0;
+    bool selecting = true;
+    for (uint64 line_index = 0; !sentence_iterator_->done();
+         sentence_iterator_->Next(), ++line_index) {
+      bool accepted = false;
+      RETURN_IF_ERROR(
+          filter.Parse(sentence_iterator_->value(), &sentence, &accepted));
+      if (!accepted) continue;
+      test_sentence_sampler.Add(random::PriorityKey(test_seed, line_index),
+                                sentence.first);
+      if (word_normalizer != nullptr) {
+        RETURN_IF_ERROR(CountWords(trainer_spec_,
+                                   word_normalizer->Normalize(sentence.first),
+                                   sentence.second, &words));
+        ++num_sentences;
+      } else if (!selector.Add(sentence, line_index)) {
+        selecting = false;
+        break;
       }
-      ++too_long_lines;
-      continue;
     }
 
-    if (sentence.find(kUNKStr) != std::string::npos) {
-      LOG(INFO) << "Reserved chars are found. Skipped: " << sentence;
-      continue;
-    }
+    if (selecting) RETURN_IF_ERROR(sentence_iterator_->status());
 
-    test_sentence_sampler.Add(sentence);
+    // Emits error message if any.
+    selector.Finish();
+    test_sentence_sampler.Finish(&self_test_samples_);
+    total_size = selector.total_size();
 
-    if (!selector.Add(std::make_pair(sentence, freq))) {
-      goto END;
+    if (word_normalizer != nullptr) {
+      sentences.assign(words.begin(), words.end());
+      total_size = num_sentences;
     }
   }
 
-  RETURN_IF_ERROR(sentence_iterator_->status());
-
-END:
-  // Emits error message if any.
-  selector.Finish();
-
-  if (sentences_.size() == selector.total_size()) {
-    LOG(INFO) << "Loaded all " << sentences_.size() << " sentences";
+  if (sentences_are_words_) {
+    LOG(INFO) << "Loaded " << total_size << " sentences into "
+              << sentences.size() << " words";
+  } else if (sentences.size() == total_size) {
+    LOG(INFO) << "Loaded all " << sentences.size() << " sentences";
   } else {
-    LOG(INFO) << "Sampled " << sentences_.size() << " sentences from "
-              << selector.total_size() << " sentences.";
+    LOG(INFO) << "Sampled " << sentences.size() << " sentences from "
+              << total_size << " sentences.";
   }
 
-  if (too_long_lines > 0)
-    LOG(INFO) << "Skipped " << too_long_lines << " too long sentences.";
+  if (filter.too_long_lines() > 0) {
+    LOG(WARNING) << "Found too long lines (> "
+                 << trainer_spec_.max_sentence_length() << ").";
+    LOG(WARNING) << "The maximum length can be changed with "
+                    "--max_sentence_length=<size> flag.";
+    LOG(INFO) << "Skipped " << filter.too_long_lines()
+              << " too long sentences.";
+  }
+  if (filter.reserved_lines() > 0)
+    LOG(INFO) << "Skipped " << filter.reserved_lines()
+              << " sentences including reserved chars.";
   if (self_test_samples_.size() > 0)
     LOG(INFO) << "Loaded " << self_test_samples_.size() << " test sentences";
 
   // Normalize and removes empty string.
-  {
-    const normalizer::Normalizer normalizer(normalizer_spec_, trainer_spec_);
-    std::set<absl::string_view> meta_pieces_set;
-    for (const auto &it : meta_pieces_) {
-      LOG(INFO) << "Adding meta_piece: " << it.second.first;
-      meta_pieces_set.insert(it.second.first);
-    }
-    const normalizer::PrefixMatcher meta_pieces_matcher(meta_pieces_set);
-
+  if (sentences_are_words_) {
+    CHECK_OR_RETURN(total_size > 0);
+  } else {
     LOG(INFO) << "Normalizing sentences...";
-    CHECK_OR_RETURN(!sentences_.empty());
-    {
-      auto pool = std::make_unique<ThreadPool>(trainer_spec_.num_threads());
-      pool->StartWorkers();
-      for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-        pool->Schedule([&, n]() {
-          for (size_t i = n; i < sentences_.size();
-               i += trainer_spec_.num_threads()) {
-            auto *s = &sentences_[i].first;
-            *s = meta_pieces_matcher.GlobalReplace(normalizer.Normalize(*s),
-                                                   kUPPBoundaryStr);
+    CHECK_OR_RETURN(!sentences.empty());
+    TrainingMetrics::Scope normalize_phase(&metrics_, "normalize",
+                                           sentences.size());
+    GetThreadPool()->ParallelFor(
+        sentences.size(), 0, [&](int32, int64 begin, int64 end) {
+          for (int64 i = begin; i < end; ++i) {
+            auto *s = &sentences[i].first;
+            *s = normalizer.Normalize(*s);
           }
         });
-      }
-    }
 
-    for (size_t i = 0; i < sentences_.size(); ++i) {
-      auto *s = &sentences_[i].first;
+    for (size_t i = 0; i < sentences.size(); ++i) {
+      auto *s = &sentences[i].first;
       CHECK_OR_RETURN(s->find(" ") == std::string::npos)
           << "Normalized string must not include spaces";
       if (s->empty()) {
-        std::swap(sentences_[i], sentences_[sentences_.size() - 1]);
-        sentences_.resize(sentences_.size() - 1);
+        std::swap(sentences[i], sentences[sentences.size() - 1]);
+        sentences.resize(sentences.size() - 1);
       }
     }
   }
 
   // If DP is required, add the noise/clip the input.
   if (trainer_spec_.enable_differential_privacy()) {
-    if (trainer_spec_.input_format() != "tsv") {
+    if (trainer_spec_.input_format() != "tsv" &&
+        trainer_spec_.input_format() != "counts") {
       LOG(ERROR)
           << "Dp version will not work correctly with text input format.";
     }
@@ -470,34 +1309,47 @@ END:
                       "infinity epsilon guarantees.";
     }
 
-    // Add noise to all the sentences via threadpool.
-
-    // This line is mainly for tests with small num of sentences.
-    const auto num_workers =
-        std::min<uint64>(trainer_spec_.num_threads(), sentences_.size() - 1);
-
-    {
-      auto pool = std::make_unique<ThreadPool>(num_workers);
-      pool->StartWorkers();
-      for (int n = 0; n < num_workers; ++n) {
-        pool->Schedule([&, n]() {
-          // One per thread generator.
-          auto *generator = random::GetRandomGenerator();
-          for (size_t i = n; i < sentences_.size(); i += num_workers) {
-            AddDPNoise<int64>(trainer_spec_, generator,
-                              &(sentences_[i].second));
-          }
-        });
+    // Add noise to all the sentences via threadpool. Each shard of
+    // kDPShardSize sentences draws its noise from its own stream of the
+    // seed, so that the noise depends neither on the number of threads nor
+    // on the scheduling.
+    constexpr int64 kDPShardSize = 1 << 12;
+    const uint64 dp_seed = GetRandomGeneratorSeed();
+    const int64 num_shards =
+        (sentences.size() + kDPShardSize - 1) / kDPShardSize;
+    const auto shard_end = [&](int64 shard) {
+      return std::min<int64>(sentences.size(), (shard + 1) * kDPShardSize);
+    };
+    // num_kept[k + 1] is the number of the sentences of the k-th shard
+    // whose frequency stays positive.
+    std::vector<int64> num_kept(num_shards + 1, 0);
+    auto *pool = GetThreadPool();
+    pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 k = begin; k < end; ++k) {
+        random::RandomGenerator generator(dp_seed, k);
+        for (int64 i = k * kDPShardSize; i < shard_end(k); ++i) {
+          AddDPNoise<int64>(trainer_spec_, &generator,
+                            &(sentences[i].second));
+          if (sentences[i].second > 0) ++num_kept[k + 1];
+        }
       }
-    }
-
-    // Remove zero freq elements.
-    const auto before_size = sentences_.size();
-    auto it = std::remove_if(sentences_.begin(), sentences_.end(),
-                             [](const Sentence &s) { return s.second <= 0; });
-    const auto new_size = std::distance(sentences_.begin(), it);
-    const int num_erased = before_size - new_size;
-    sentences_.erase(it, sentences_.end());
+    });
+
+    // Remove zero freq elements. Each shard moves its remaining sentences
+    // to its offset, keeping their order.
+    std::partial_sum(num_kept.begin(), num_kept.end(), num_kept.begin());
+    SentenceList kept(num_kept.back());
+    pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 k = begin; k < end; ++k) {
+        int64 out = num_kept[k];
+        for (int64 i = k * kDPShardSize; i < shard_end(k); ++i) {
+          if (sentences[i].second > 0) kept[out++] = std::move(sentences[i]);
+        }
+      }
+    });
+    const auto before_size = sentences.size();
+    const int num_erased = before_size - kept.size();
+    sentences = std::move(kept);
 
     LOG(INFO) << "DP noise resulted in " << 1.0 * num_erased / before_size
               << " fraction of sentences removed.";
@@ -517,23 +1369,71 @@ END:
     }
     chars_count[c].first = true;  // is_required_character.
   }
-  for (const auto &w : sentences_) {
-    for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
-      if (!string_util::IsValidCodepoint(c)) continue;
-      if (c == 0x0000) {
-        LOG(INFO)
-            << "Found null character. The corpus must be encoded in utf-8.";
-        continue;
-      }
-      if (c == 0x0020) {
-        // UTF8ToUnicodeText returns a white space if the text
-        // contains an interchange-invalid character.
-        CHECK_OR_RETURN(w.first.find(" ") == std::string::npos)
-            << "space must not be included in normalized string.";
-        continue;
+  {
+    // Each slot of the pool counts the BMP characters in a dense array,
+    // allocated on its first sentence, and the others in a small map. They
+    // are merged afterwards.
+    TrainingMetrics::Scope count_phase(&metrics_, "count_chars",
+                                       sentences.size());
+    auto *pool = GetThreadPool();
+    constexpr char32 kNumBMPChars = 0x10000;
+    std::vector<std::vector<int64>> bmp_counts(pool->size());
+    std::vector<absl::flat_hash_map<char32, int64>> other_counts(pool->size());
+    // Not std::vector<bool>, as the slots write neighbouring entries.
+    std::vector<uint8> has_null(pool->size(), false);
+    std::vector<uint8> has_space(pool->size(), false);
+    pool->ParallelFor(
+        sentences.size(), 0, [&](int32 slot, int64 begin, int64 end) {
+          auto &bmp = bmp_counts[slot];
+          if (bmp.empty()) bmp.resize(kNumBMPChars, 0);
+          for (int64 i = begin; i < end; ++i) {
+            const auto &w = sentences[i];
+            for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
+              if (!string_util::IsValidCodepoint(c)) continue;
+              if (c == 0x0000) {
+                has_null[slot] = true;
+                continue;
+              }
+              if (c == 0x0020) {
+                // UTF8ToUnicodeText returns a white space if the text
+                // contains an interchange-invalid character.
+                if (w.first.find(" ") != std::string::npos) {
+                  has_space[slot] = true;
+                }
+                continue;
+              }
+              if (c < kNumBMPChars) {
+                bmp[c] += w.second;
+              } else {
+                other_counts[slot][c] += w.second;
+              }
+            }
+          }
+        });
+
+    const auto any = [](const std::vector<uint8> &v) {
+      return std::find(v.begin(), v.end(), true) != v.end();
+    };
+    if (any(has_null)) {
+      LOG(INFO) << "Found null character. The corpus must be encoded in utf-8.";
+    }
+    CHECK_OR_RETURN(!any(has_space))
+        << "space must not be included in normalized string.";
+
+    std::vector<int64> bmp(kNumBMPChars, 0);
+    for (const auto &counts : bmp_counts) {
+      for (size_t c = 0; c < counts.size(); ++c) bmp[c] += counts[c];
+    }
+    for (char32 c = 0; c < kNumBMPChars; ++c) {
+      if (bmp[c] == 0) continue;
+      chars_count[c].second += bmp[c];
+      all_chars_count += bmp[c];
+    }
+    for (const auto &counts : other_counts) {
+      for (const auto &it : counts) {
+        chars_count[it.first].second += it.second;
+        all_chars_count += it.second;
       }
-      chars_count[c].second += w.second;
-      all_chars_count += w.second;
     }
   }
   LOG(INFO) << "all chars count=" << all_chars_count;
@@ -565,81 +1465,360 @@ END:
 
   // Replaces rare characters (characters not included in required_chars_)
   // with kUNKChar.
-  for (auto &w : sentences_) {
-    string_util::UnicodeText uw2;
-    for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
-      if (port::ContainsKey(required_chars_, c)) {
-        uw2.push_back(c);
-      } else {
-        uw2.push_back(kUNKChar);
-      }
-    }
-    w.first = string_util::UnicodeTextToUTF8(uw2);
+  GetThreadPool()->ParallelFor(
+      sentences.size(), 0, [&](int32, int64 begin, int64 end) {
+        for (int64 i = begin; i < end; ++i) {
+          auto &w = sentences[i];
+          // Most sentences have no rare character and are kept as they are.
+          string_util::UnicodeText uw = string_util::UTF8ToUnicodeText(w.first);
+          if (std::all_of(uw.begin(), uw.end(), [&](char32 c) {
+                return port::ContainsKey(required_chars_, c);
+              })) {
+            continue;
+          }
+          for (char32 &c : uw) {
+            if (!port::ContainsKey(required_chars_, c)) c = kUNKChar;
+          }
+          w.first = string_util::UnicodeTextToUTF8(uw);
+        }
+      });
+
+  // Rare characters may have merged some words. Aggregates them again and
+  // sorts the words in the same order as SplitSentencesByWhitespace().
+  if (sentences_are_words_) {
+    auto *pool = GetThreadPool();
+    auto counts = MakePartitionedWordCounts(*pool);
+    pool->ParallelFor(sentences.size(), 0,
+                      [&](int32 slot, int64 begin, int64 end) {
+                        for (int64 i = begin; i < end; ++i) {
+                          AddWord(sentences[i].first, sentences[i].second,
+                                  &counts[slot]);
+                        }
+                      });
+    sentences = MergeWordCounts(pool, &counts);
+  }
+
+  // Moves the sentences to the arena, releasing the strings one by one.
+  size_t num_bytes = 0;
+  for (const auto &w : sentences) num_bytes += w.first.size();
+  sentences_.reserve(sentences.size(), num_bytes);
+  for (auto &w : sentences) {
+    sentences_.emplace_back(w.first, w.second);
+    std::string().swap(w.first);
+  }
+  SentenceList().swap(sentences);
+
+  if (!cache_file.empty()) {
+    RETURN_IF_ERROR(WriteCorpusCache(cache_file, total_size));
   }
 
+  RETURN_IF_ERROR(CheckRequiredChars());
+
+  LOG(INFO) << "Done! preprocessed " << sentences_.size() << " sentences.";
+  phase.AddItems(total_size);
+
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::CheckRequiredChars() const {
   if (trainer_spec_.model_type() != TrainerSpec::WORD &&
       trainer_spec_.model_type() != TrainerSpec::CHAR) {
-    CHECK_LE_OR_RETURN(
-        static_cast<int>(required_chars_.size() + meta_pieces_.size()),
-        trainer_spec_.vocab_size())
+    int required_size = required_chars_.size() + meta_pieces_.size();
+    if (base_model_ != nullptr) {
+      // Only the characters missing from the base model need new pieces.
+      absl::flat_hash_set<absl::string_view> base;
+      for (const auto &piece : base_model_->pieces()) {
+        base.insert(piece.piece());
+      }
+      required_size = base_model_->pieces_size();
+      for (const auto &w : required_chars_) {
+        if (!base.count(string_util::UnicodeCharToUTF8(w.first))) {
+          ++required_size;
+        }
+      }
+    }
+    CHECK_LE_OR_RETURN(required_size, trainer_spec_.vocab_size())
         << "Vocabulary size is smaller than required_chars. "
-        << trainer_spec_.vocab_size() << " vs "
-        << required_chars_.size() + meta_pieces_.size() << ". "
+        << trainer_spec_.vocab_size() << " vs " << required_size << ". "
         << "Increase vocab_size or decrease character_coverage with "
         << "--character_coverage option.";
   }
+  return util::OkStatus();
+}
+
+std::string TrainerInterface::CorpusCacheFile() const {
+  if (corpus_cache_dir_.empty()) return "";
+
+  // The fields which do not change the loaded sentences are cleared, so
+  // that runs with different vocab sizes or model types share the cache.
+  TrainerSpec spec = trainer_spec_;
+  spec.clear_model_prefix();
+  spec.clear_model_type();
+  spec.clear_vocab_size();
+  spec.clear_num_threads();
+  spec.clear_num_sub_iterations();
+  spec.clear_shrinking_factor();
+  spec.clear_seed_sentencepiece_size();
+  spec.clear_seed_sentencepieces_file();
+  spec.clear_max_sentencepiece_length();
+  spec.clear_hard_vocab_limit();
+  spec.clear_vocabulary_output_piece_score();
+
+  std::string key(kCorpusCacheMagic, kCorpusCacheMagicSize);
+  string_util::AppendBytes(spec.SerializeAsString(), &key);
+  string_util::AppendBytes(normalizer_spec_.SerializeAsString(), &key);
+  string_util::AppendUInt32(split_by_whitespace_while_loading_, &key);
+
+  // The seed matters only to the random choices of the loading. Without a
+  // fixed seed, they differ on every run, and so does the key.
+  if (trainer_spec_.input_sentence_size() > 0 ||
+      trainer_spec_.self_test_sample_size() > 0 ||
+      trainer_spec_.enable_differential_privacy()) {
+    AppendUInt64(GetRandomGeneratorSeed(), &key);
+  }
 
-  LOG(INFO) << "Done! preprocessed " << sentences_.size() << " sentences.";
+  // The input files are identified by their names, sizes and modification
+  // times, so a changed file makes a new cache.
+  for (const auto &filename : trainer_spec_.input()) {
+    std::error_code error;
+    const std::filesystem::path path(filename);
+    const auto size = std::filesystem::file_size(path, error);
+    if (error) return "";
+    const auto time = std::filesystem::last_write_time(path, error);
+    if (error) return "";
+    string_util::AppendBytes(filename, &key);
+    AppendUInt64(size, &key);
+    AppendUInt64(time.time_since_epoch().count(), &key);
+  }
+
+  return util::JoinPath(
+      corpus_cache_dir_,
+      absl::StrCat("corpus.", string_util::IntToHex(FingerprintBytes(key)),
+                   ".cache"));
+}
+
+util::Status TrainerInterface::WriteCorpusCache(absl::string_view filename,
+                                                uint64 total_size) const {
+  TrainingMetrics::Scope phase(&metrics_, "write_corpus_cache");
+  std::string blob(kCorpusCacheMagic, kCorpusCacheMagicSize);
+  string_util::AppendUInt32(sentences_are_words_, &blob);
+  AppendUInt64(total_size, &blob);
+
+  // In the order of the characters, so the same corpus writes the same file.
+  std::vector<std::pair<char32, int64>> chars(required_chars_.begin(),
+                                              required_chars_.end());
+  std::sort(chars.begin(), chars.end());
+  string_util::AppendUInt32(chars.size(), &blob);
+  for (const auto &c : chars) {
+    string_util::AppendUInt32(c.first, &blob);
+    AppendUInt64(c.second, &blob);
+  }
+
+  string_util::AppendUInt32(self_test_samples_.size(), &blob);
+  for (const auto &sample : self_test_samples_) {
+    string_util::AppendBytes(sample, &blob);
+  }
 
+  size_t num_bytes = 0;
+  for (const auto &w : sentences_) num_bytes += w.first.size();
+  AppendUInt64(sentences_.size(), &blob);
+  AppendUInt64(num_bytes, &blob);
+  for (const auto &w : sentences_) {
+    string_util::AppendBytes(w.first, &blob);
+    AppendUInt64(w.second, &blob);
+  }
+
+  LOG(INFO) << "Saving the corpus cache " << filename;
+  return WriteFileAtomically(filename, blob);
+}
+
+util::Status TrainerInterface::ReadCorpusCache(absl::string_view filename,
+                                               uint64 *total_size) {
+  // The file is mapped, so the sentences are copied to the arena once.
+  auto input = filesystem::NewMappedFile(filename);
+  RETURN_IF_ERROR(input->status());
+  absl::string_view data = input->data();
+  CHECK_OR_RETURN(data.substr(0, kCorpusCacheMagicSize) ==
+                  absl::string_view(kCorpusCacheMagic, kCorpusCacheMagicSize))
+      << filename << " is not a corpus cache file.";
+  data.remove_prefix(kCorpusCacheMagicSize);
+
+  uint32 are_words = 0, size = 0;
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &are_words) &&
+                  ConsumeUInt64(&data, total_size))
+      << "Corpus cache file is broken.";
+  sentences_are_words_ = are_words;
+
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &size))
+      << "Corpus cache file is broken.";
+  for (uint32 i = 0; i < size; ++i) {
+    uint32 c = 0;
+    uint64 freq = 0;
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &c) &&
+                    ConsumeUInt64(&data, &freq))
+        << "Corpus cache file is broken.";
+    required_chars_.emplace(c, freq);
+  }
+
+  CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &size))
+      << "Corpus cache file is broken.";
+  self_test_samples_.resize(size);
+  for (auto &sample : self_test_samples_) {
+    CHECK_OR_RETURN(string_util::ConsumeBytes(&data, &sample))
+        << "Corpus cache file is broken.";
+  }
+
+  uint64 num_sentences = 0, num_bytes = 0;
+  CHECK_OR_RETURN(ConsumeUInt64(&data, &num_sentences) &&
+                  ConsumeUInt64(&data, &num_bytes))
+      << "Corpus cache file is broken.";
+  sentences_.reserve(num_sentences, num_bytes);
+  for (uint64 i = 0; i < num_sentences; ++i) {
+    uint32 length = 0;
+    uint64 freq = 0;
+    CHECK_OR_RETURN(string_util::ConsumeUInt32(&data, &length) &&
+                    data.size() >= length)
+        << "Corpus cache file is broken.";
+    const absl::string_view text = data.substr(0, length);
+    data.remove_prefix(length);
+    CHECK_OR_RETURN(ConsumeUInt64(&data, &freq))
+        << "Corpus cache file is broken.";
+    sentences_.emplace_back(text, freq);
+  }
+  CHECK_OR_RETURN(data.empty()) << "Corpus cache file is broken.";
   return util::OkStatus();
 }
 
 void TrainerInterface::SplitSentencesByWhitespace() {
+  // LoadSentences() has already split the sentences.
+  if (sentences_are_words_) return;
+
   LOG(INFO) << "Tokenizing input sentences with whitespace: "
             << sentences_.size();
-  absl::flat_hash_map<std::string, int64> tokens;
-  for (const auto &s : sentences_) {
-    for (const auto &w :
-         SplitIntoWords(s.first, trainer_spec_.treat_whitespace_as_suffix(),
-                        trainer_spec_.allow_whitespace_only_pieces())) {
-      tokens[std::string(w)] += s.second;
+  TrainingMetrics::Scope phase(&metrics_, "split_by_whitespace",
+                               sentences_.size());
+  auto *pool = GetThreadPool();
+  auto counts = MakePartitionedWordCounts(*pool);
+  pool->ParallelFor(sentences_.size(), 0,
+                    [&](int32 slot, int64 begin, int64 end) {
+                      for (int64 i = begin; i < end; ++i) {
+                        const auto s = sentences_[i];
+                        for (const auto &w : SplitIntoWords(
+                                 s.first,
+                                 trainer_spec_.treat_whitespace_as_suffix(),
+                                 trainer_spec_.allow_whitespace_only_pieces())) {
+                          AddWord(w, s.second, &counts[slot]);
+                        }
+                      }
+                    });
+  sentences_ = Sentences(MergeWordCounts(pool, &counts));
+  LOG(INFO) << "Done! " << sentences_.size();
+}
+
+void TrainerInterface::MergeDuplicatedSentences() {
+  if (sentences_are_words_) return;
+
+  // Index of the first occurrence of each sentence in `unique`. The keys
+  // point to the text of `sentences_`, which is kept until the end.
+  absl::flat_hash_map<absl::string_view, size_t> first_index;
+  std::vector<std::pair<absl::string_view, int64>> unique;
+  first_index.reserve(sentences_.size());
+  for (const auto &w : sentences_) {
+    const auto it = first_index.emplace(w.first, unique.size());
+    if (it.second) {
+      unique.emplace_back(w);
+    } else {
+      unique[it.first->second].second += w.second;
     }
   }
-  sentences_ = Sorted(tokens);
-  LOG(INFO) << "Done! " << sentences_.size();
+
+  LOG(INFO) << "Merged duplicated sentences: " << sentences_.size() << " -> "
+            << unique.size() << " (compression ratio="
+            << 1.0 * sentences_.size() / std::max<size_t>(1, unique.size())
+            << ")";
+  if (unique.size() == sentences_.size()) return;
+
+  first_index.clear();
+  Sentences merged(unique);
+  sentences_ = std::move(merged);
+}
+
+util::Status TrainerInterface::SpillSentences() {
+  if (external_memory_dir_.empty() || sentences_.spilled()) {
+    return util::OkStatus();
+  }
+  TrainingMetrics::Scope phase(&metrics_, "spill_sentences",
+                               sentences_.size());
+  std::vector<int64> order(sentences_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [this](int64 a, int64 b) {
+    return sentences_[a].first.size() > sentences_[b].first.size();
+  });
+  // A random name, so that several trainers can share the directory.
+  const std::string filename =
+      util::JoinPath(external_memory_dir_,
+                     absl::StrCat("spm_sentences.", std::random_device()()));
+  RETURN_IF_ERROR(sentences_.Spill(filename, order));
+  LOG(INFO) << "Spilled " << sentences_.size() << " sentences to "
+            << filename;
+  return util::OkStatus();
 }
 
 util::Status TrainerInterface::Serialize(ModelProto *model_proto) const {
   RETURN_IF_ERROR(status());
 
-  // Duplicated sentencepiece is not allowed.
-  std::set<std::string> dup;
-
   model_proto->Clear();
 
+  // Duplicated sentencepiece is not allowed. The keys point to the pieces
+  // owned by `model_proto`.
+  absl::flat_hash_set<absl::string_view> dup;
+  dup.reserve(trainer_spec_.vocab_size());
+
 #define CHECK_PIECE(piece)                                  \
   CHECK_OR_RETURN(string_util::IsStructurallyValid(piece)); \
   CHECK_OR_RETURN(!piece.empty());                          \
   CHECK_OR_RETURN(dup.insert(piece).second) << piece << " is already defined";
 
   size_t fid = 0;
-  for (int id = 0; id < trainer_spec_.vocab_size(); ++id) {
-    const auto it = meta_pieces_.find(id);
-    if (it != meta_pieces_.end()) {
+  if (base_model_ != nullptr) {
+    // The pieces of the base model keep their ids and types. Its normal
+    // pieces lead final_pieces_ in the same order, with their new scores,
+    // and the new pieces follow.
+    for (const auto &piece : base_model_->pieces()) {
       auto *sp = model_proto->add_pieces();
-      sp->set_piece(it->second.first);
-      sp->set_type(it->second.second);
-      sp->set_score(0.0);
-      CHECK_EQ_OR_RETURN(model_proto->pieces_size() - 1, it->first);
-      CHECK_NE_OR_RETURN(ModelProto::SentencePiece::NORMAL, sp->type());
+      *sp = piece;
+      if (piece.type() == ModelProto::SentencePiece::NORMAL) {
+        CHECK_LT_OR_RETURN(fid, final_pieces_.size());
+        CHECK_EQ_OR_RETURN(final_pieces_[fid].first, piece.piece());
+        sp->set_score(final_pieces_[fid++].second);
+      }
       CHECK_PIECE(sp->piece());
-    } else if (fid < final_pieces_.size()) {
-      const auto &w = final_pieces_[fid++];
+    }
+    for (; fid < final_pieces_.size(); ++fid) {
       auto *sp = model_proto->add_pieces();
-      sp->set_piece(w.first);
-      sp->set_score(w.second);
+      sp->set_piece(final_pieces_[fid].first);
+      sp->set_score(final_pieces_[fid].second);
       CHECK_PIECE(sp->piece());
     }
+  } else {
+    for (int id = 0; id < trainer_spec_.vocab_size(); ++id) {
+      const auto it = meta_pieces_.find(id);
+      if (it != meta_pieces_.end()) {
+        auto *sp = model_proto->add_pieces();
+        sp->set_piece(it->second.first);
+        sp->set_type(it->second.second);
+        sp->set_score(0.0);
+        CHECK_EQ_OR_RETURN(model_proto->pieces_size() - 1, it->first);
+        CHECK_NE_OR_RETURN(ModelProto::SentencePiece::NORMAL, sp->type());
+        CHECK_PIECE(sp->piece());
+      } else if (fid < final_pieces_.size()) {
+        const auto &w = final_pieces_[fid++];
+        auto *sp = model_proto->add_pieces();
+        sp->set_piece(w.first);
+        sp->set_score(w.second);
+        CHECK_PIECE(sp->piece());
+      }
+    }
   }
 
   CHECK_EQ_OR_RETURN(fid, final_pieces_.size());
@@ -667,16 +1846,25 @@ util::Status TrainerInterface::Serialize(ModelProto *model_proto) const {
                        static_cast<int32>(dup.size()));
   }
 
-  // Saves self-testing data.
+  // Saves self-testing data. The samples are encoded on the trainer pool.
   if (!self_test_samples_.empty()) {
     SentencePieceProcessor sp;
     RETURN_IF_ERROR(sp.Load(*model_proto));
-    for (const auto &input : self_test_samples_) {
+    const int64 size = self_test_samples_.size();
+    std::vector<std::string> expected(size);
+    std::vector<util::Status> statuses(size);
+    GetThreadPool()->ParallelFor(size, 0, [&](int32, int64 begin, int64 end) {
       std::vector<std::string> sps;
-      RETURN_IF_ERROR(sp.Encode(input, &sps));
+      for (int64 i = begin; i < end; ++i) {
+        statuses[i] = sp.Encode(self_test_samples_[i], &sps);
+        expected[i] = absl::StrJoin(sps, " ");
+      }
+    });
+    for (int64 i = 0; i < size; ++i) {
+      RETURN_IF_ERROR(statuses[i]);
       auto *sample = model_proto->mutable_self_test_data()->add_samples();
-      sample->set_input(input);
-      sample->set_expected(absl::StrJoin(sps, " "));
+      sample->set_input(self_test_samples_[i]);
+      sample->set_expected(std::move(expected[i]));
     }
   }
 
@@ -710,22 +1898,32 @@ util::Status TrainerInterface::SaveVocab(absl::string_view filename) const {
     }
   }
 
-  if (trainer_spec_.vocabulary_output_piece_score()) {
-    for (const auto &piece : model_proto.pieces()) {
-      std::ostringstream os;
-      os << piece.piece() << "\t" << piece.score();
-      CHECK_OR_RETURN(output->WriteLine(os.str()));
-    }
-  } else {
-    for (const auto &piece : model_proto.pieces()) {
-      CHECK_OR_RETURN(output->WriteLine(piece.piece()));
+  // The whole file is formatted into one buffer and written at once.
+  const bool with_score = trainer_spec_.vocabulary_output_piece_score();
+  size_t size = 0;
+  for (const auto &piece : model_proto.pieces()) {
+    size += piece.piece().size() + (with_score ? 16 : 1);
+  }
+  std::string buffer;
+  buffer.reserve(size);
+  for (const auto &piece : model_proto.pieces()) {
+    buffer.append(piece.piece());
+    if (with_score) {
+      // Same as the default formatting of std::ostream.
+      char score[32];
+      const int length =
+          std::snprintf(score, sizeof(score), "\t%g", piece.score());
+      buffer.append(score, length);
     }
+    buffer.push_back('\n');
   }
+  CHECK_OR_RETURN(output->Write(buffer));
 
   return util::OkStatus();
 }
 
 util::Status TrainerInterface::Save() const {
+  TrainingMetrics::Scope phase(&metrics_, "save");
   if (output_model_proto_) {
     RETURN_IF_ERROR(Serialize(output_model_proto_));
   } else {
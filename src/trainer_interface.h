@@ -16,6 +16,10 @@
 #define TRAINER_INTERFACE_H_
 
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <string>
@@ -28,6 +32,7 @@
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/strings/string_view.h"
 #include "util.h"
 
 namespace sentencepiece {
@@ -49,6 +54,169 @@ std::vector<std::pair<K, V>> Sorted(const absl::flat_hash_map<K, V> &m) {
   return Sorted(v);
 }
 
+// Sorts `v` with `comp` on `pool`. The vector is split into one block per
+// thread, the blocks are sorted concurrently and then merged pairwise. The
+// result equals that of std::sort for a strict total order `comp`.
+template <typename T, typename Compare>
+void ParallelSort(ThreadPool *pool, std::vector<T> *v, Compare comp) {
+  constexpr int64 kMinBlockSize = 1 << 14;
+  const int64 size = v->size();
+  const int64 num_blocks =
+      pool == nullptr
+          ? 1
+          : std::max<int64>(
+                1, std::min<int64>(pool->size() + 1, size / kMinBlockSize));
+  if (num_blocks == 1) {
+    std::sort(v->begin(), v->end(), comp);
+    return;
+  }
+
+  std::vector<int64> bounds(num_blocks + 1);
+  for (int64 i = 0; i <= num_blocks; ++i) bounds[i] = size * i / num_blocks;
+  const auto begin = v->begin();
+
+  pool->ParallelFor(num_blocks, 1, [&](int32, int64 b, int64 e) {
+    for (int64 i = b; i < e; ++i) {
+      std::sort(begin + bounds[i], begin + bounds[i + 1], comp);
+    }
+  });
+
+  for (int64 width = 1; width < num_blocks; width *= 2) {
+    const int64 num_merges = (num_blocks + 2 * width - 1) / (2 * width);
+    pool->ParallelFor(num_merges, 1, [&](int32, int64 b, int64 e) {
+      for (int64 i = b; i < e; ++i) {
+        const int64 lo = 2 * width * i;
+        const int64 mid = std::min(lo + width, num_blocks);
+        const int64 hi = std::min(lo + 2 * width, num_blocks);
+        if (mid < hi) {
+          std::inplace_merge(begin + bounds[lo], begin + bounds[mid],
+                             begin + bounds[hi], comp);
+        }
+      }
+    });
+  }
+}
+
+// Sentences with their frequencies. The text of all the sentences is stored
+// in one contiguous buffer, so that a corpus does not cost one heap
+// allocation per sentence and the per-sentence loops of the trainers read
+// memory sequentially. The elements are (text, frequency) pairs returned by
+// value, whose text is valid until the arena is modified. The text can be
+// moved to a file mapped into memory with Spill().
+class SentenceArena {
+ public:
+  using value_type = std::pair<absl::string_view, int64>;
+
+  class const_iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = SentenceArena::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = value_type;
+
+    const_iterator(const SentenceArena *arena, size_t index)
+        : arena_(arena), index_(index) {}
+
+    value_type operator*() const { return (*arena_)[index_]; }
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++index_;
+      return it;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    const SentenceArena *arena_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  SentenceArena() {}
+
+  template <typename K>
+  explicit SentenceArena(const std::vector<std::pair<K, int64>> &sentences) {
+    size_t num_bytes = 0;
+    for (const auto &w : sentences) num_bytes += w.first.size();
+    reserve(sentences.size(), num_bytes);
+    for (const auto &w : sentences) emplace_back(w.first, w.second);
+  }
+
+  void emplace_back(absl::string_view text, int64 freq) {
+    CHECK(file_ == nullptr) << "A spilled arena cannot be extended.";
+    buffer_.append(text.data(), text.size());
+    offsets_.push_back(buffer_.size());
+    freqs_.push_back(freq);
+  }
+
+  // Reserves the space of `num_sentences` sentences of `num_bytes` in total.
+  void reserve(size_t num_sentences, size_t num_bytes) {
+    buffer_.reserve(num_bytes);
+    offsets_.reserve(num_sentences + 1);
+    freqs_.reserve(num_sentences);
+  }
+
+  void clear() {
+    buffer_.clear();
+    file_.reset();
+    offsets_.assign(1, 0);
+    freqs_.clear();
+  }
+
+  // Writes the text of the sentences to `filename` in the order of `order`,
+  // a permutation of the indices, and reads it from the mapped file
+  // instead of the heap, so that the kernel pages it in and out as the
+  // sentences are read. The i-th sentence is then the order[i]-th one. The
+  // file is removed once mapped where the platform allows it. The arena
+  // cannot be extended afterwards until it is cleared.
+  util::Status Spill(absl::string_view filename,
+                     const std::vector<int64> &order);
+
+  // True when the text is in a file.
+  bool spilled() const { return file_ != nullptr; }
+
+  value_type operator[](size_t i) const {
+    return value_type(
+        absl::string_view(text() + offsets_[i], offsets_[i + 1] - offsets_[i]),
+        freqs_[i]);
+  }
+
+  size_t size() const { return freqs_.size(); }
+  bool empty() const { return freqs_.empty(); }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+  bool operator==(const SentenceArena &other) const {
+    return offsets_ == other.offsets_ && freqs_ == other.freqs_ &&
+           absl::string_view(text(), offsets_.back()) ==
+               absl::string_view(other.text(), other.offsets_.back());
+  }
+  bool operator!=(const SentenceArena &other) const {
+    return !(*this == other);
+  }
+
+ private:
+  const char *text() const {
+    return file_ != nullptr ? file_->data().data() : buffer_.data();
+  }
+
+  // The text, in buffer_ or in file_ when spilled.
+  std::string buffer_;
+  std::shared_ptr<const filesystem::MappedFile> file_;
+  // The i-th sentence is text()[offsets_[i], offsets_[i + 1]).
+  std::vector<size_t> offsets_ = {0};
+  std::vector<int64> freqs_;
+};
+
 class MultiFileSentenceIterator : public SentenceIterator {
  public:
   explicit MultiFileSentenceIterator(const std::vector<std::string> &files);
@@ -69,11 +237,85 @@ class MultiFileSentenceIterator : public SentenceIterator {
   std::unique_ptr<filesystem::ReadableFile> fp_;
 };
 
+// State of a training job, saved periodically so that a preempted job can
+// resume from it instead of starting over. See SaveCheckpoint().
+struct TrainerCheckpoint {
+  TrainerSpec::ModelType model_type = TrainerSpec::UNIGRAM;
+
+  // Completed EM rounds of unigram, or merges of BPE.
+  int64 step = 0;
+
+  // Unigram: the pieces and scores after the last completed round.
+  std::vector<std::pair<std::string, float>> pieces;
+
+  // BPE: the selected pairs, in order. A pair whose concatenation was
+  // already merged was dropped as a duplicate.
+  std::vector<std::pair<std::string, std::string>> merges;
+};
+
+// Writes `blob` to a temporary file renamed to `filename`, so that readers
+// of `filename` never see a partial file.
+util::Status WriteFileAtomically(absl::string_view filename,
+                                 absl::string_view blob);
+
+// Writes and reads `checkpoint` in a small binary format.
+util::Status WriteCheckpointFile(absl::string_view filename,
+                                 const TrainerCheckpoint &checkpoint);
+util::Status ReadCheckpointFile(absl::string_view filename,
+                                TrainerCheckpoint *checkpoint);
+
+// Wall time, CPU time and memory of the phases of a training job, in the
+// order they finished. A phase may run inside another one, e.g.
+// "normalize" inside "load_sentences".
+class TrainingMetrics {
+ public:
+  struct Phase {
+    std::string name;
+    double wall_seconds = 0.0;
+    // CPU time of all the threads of the process.
+    double cpu_seconds = 0.0;
+    // Peak resident memory of the process so far, or 0 when the platform
+    // does not report it.
+    int64 peak_rss_bytes = 0;
+    // Units of work done by the phase: sentences for the passes over the
+    // corpus, merges for the BPE merge batches. 0 when not applicable.
+    int64 items = 0;
+  };
+
+  // Records the phase `name` from its construction to its destruction.
+  class Scope {
+   public:
+    Scope(TrainingMetrics *metrics, absl::string_view name,
+          int64 items = 0);
+    ~Scope();
+
+    void AddItems(int64 items) { phase_.items += items; }
+
+   private:
+    TrainingMetrics *metrics_ = nullptr;
+    Phase phase_;
+    std::chrono::steady_clock::time_point wall_start_;
+    std::clock_t cpu_start_ = 0;
+  };
+
+  const std::vector<Phase> &phases() const { return phases_; }
+
+  // Logs the total time of the phases of each name.
+  void LogSummary() const;
+
+  // Returns the phases as a JSON object {"phases": [...]}. Each phase has
+  // the fields of Phase and items_per_second.
+  std::string ToJson() const;
+
+ private:
+  std::vector<Phase> phases_;
+};
+
 // Base trainer class
 class TrainerInterface {
  public:
   using Sentence = std::pair<std::string, int64>;
-  using Sentences = std::vector<Sentence>;
+  using Sentences = SentenceArena;
 
   static const char32 kWSChar;
   static const char32 kUNKChar;
@@ -101,11 +343,120 @@ class TrainerInterface {
 
   virtual util::Status status() const { return status_; }
 
+  // Writes the state of the training to `checkpoint_path` every
+  // `checkpoint_interval` steps, EM rounds or merges depending on the model
+  // type, when the path is not empty. Training resumes from the checkpoint
+  // file `resume_from` when it is not empty. The corpus is loaded again, and
+  // must be the same as the one of the checkpoint.
+  void SetCheckpoint(absl::string_view checkpoint_path, int checkpoint_interval,
+                     absl::string_view resume_from);
+
+  // Makes this trainer the shard `shard_id` of a distributed job of
+  // `num_shards` processes sharing `directory`. Only the unigram trainer
+  // supports it. Each shard loads its own corpus.
+  void SetDistributed(absl::string_view directory, int num_shards,
+                      int shard_id);
+
+  // Stops the EM sub-iterations of a round early once the objective changes
+  // by less than `tolerance` relative to the previous sub-iteration. 0 runs
+  // all of them. Only the unigram trainer uses it.
+  void SetEMTolerance(double tolerance) { em_tolerance_ = tolerance; }
+
+  // Runs stochastic EM in the rounds before the last one: each E step only
+  // processes one of `num_batches` slices of the sentences in turn, and its
+  // expected counts are interpolated with the previous ones with the step
+  // size (t + 2)^-`step_decay` at the t-th step. 1 runs the full E steps.
+  // Only the unigram trainer uses it.
+  void SetStochasticEM(int num_batches, double step_decay) {
+    em_num_batches_ = num_batches;
+    em_step_decay_ = step_decay;
+  }
+
+  // Also saves the models of `vocab_sizes` on the way to the vocab_size of
+  // the spec, as <model_prefix>.<size>.model and .vocab: the larger sizes
+  // for the unigram trainer, which prunes down to it, and the smaller ones
+  // for the BPE trainer, which merges up to it.
+  void SetExtraVocabSizes(const std::vector<int> &vocab_sizes) {
+    extra_vocab_sizes_ = vocab_sizes;
+  }
+
+  // Extends `base_model`, which must outlive the training, instead of
+  // training from scratch: its pieces keep their ids and types, and the new
+  // pieces up to the vocab_size of the spec follow them. Only the unigram
+  // trainer supports it.
+  void SetBaseModel(const ModelProto *base_model) { base_model_ = base_model; }
+
+  // Makes LoadSentences() keep the normalized sentences of a corpus read
+  // from files in `directory`, keyed by the input files and the options of
+  // the loading, and load them from there in the later runs. Empty
+  // disables it.
+  void SetCorpusCache(absl::string_view directory) {
+    corpus_cache_dir_ = std::string(directory);
+  }
+
+  // Keeps the text of the sentences of the EM training in a file in
+  // `directory`, mapped into memory, instead of on the heap. The sentences
+  // are stored longest first, so that the E steps read the file in order.
+  // Empty disables it. Only the unigram trainer uses it.
+  void SetExternalMemory(absl::string_view directory) {
+    external_memory_dir_ = std::string(directory);
+  }
+
+  // Builder of the suffix array of the seed pieces.
+  enum class SuffixArrayBackend {
+    kSais,              // Linear time SA-IS of esaxx, single-threaded.
+    kParallelDoubling,  // Prefix doubling on the worker threads.
+  };
+
+  // Selects the builder of the suffix array from which the seed pieces are
+  // extracted. Only the unigram trainer uses it.
+  void SetSuffixArrayBackend(SuffixArrayBackend backend) {
+    suffix_array_backend_ = backend;
+  }
+
+  // Keeps up to `size` bytes of the node spans of the lattices between the
+  // E steps of EM, trading memory for not looking up the trie again. 0
+  // disables the cache. Only the unigram trainer uses it.
+  void SetLatticeCacheSize(int64 size) { lattice_cache_size_ = size; }
+
+  // Merges the pairs over the distinct words as arrays of symbol ids when
+  // split_by_whitespace is true. Only the BPE trainer uses it.
+  void SetWordEngine(bool enabled) { use_word_engine_ = enabled; }
+
+  // Precision of the sums of the expected counts and the objective in the
+  // E step. The sums run over all the tokens of the corpus, so the float
+  // sums drift on large corpora; the results are float in any case.
+  enum class EStepAccumulator {
+    kFloat,   // Plain float sums, the fastest.
+    kDouble,  // Double sums, rounded to float at the end.
+    kKahan,   // Kahan compensated float sums.
+  };
+
+  // Selects the sums of the E step. Only the unigram trainer uses it.
+  void SetEStepAccumulator(EStepAccumulator accumulator) {
+    estep_accumulator_ = accumulator;
+  }
+
+  // Timing of the phases of the last training.
+  const TrainingMetrics &metrics() const { return metrics_; }
+
   FRIEND_TEST(TrainerInterfaceTest, IsValidSentencePieceTest);
+  FRIEND_TEST(TrainerInterfaceTest, CharPropertiesTest);
   FRIEND_TEST(TrainerInterfaceTest, OverrideSpecialPiecesTest);
   FRIEND_TEST(TrainerInterfaceTest, BytePiecesTest);
   FRIEND_TEST(TrainerInterfaceTest, SerializeTest);
   FRIEND_TEST(TrainerInterfaceTest, CharactersTest);
+  FRIEND_TEST(TrainerInterfaceTest, CharactersThreadsTest);
+  FRIEND_TEST(TrainerInterfaceTest, LoadCorpusFilesTest);
+  FRIEND_TEST(TrainerInterfaceTest, SplitByWhitespaceWhileLoadingTest);
+  FRIEND_TEST(TrainerInterfaceTest, CountsInputFormatTest);
+  FRIEND_TEST(TrainerInterfaceTest, DPNoiseThreadsTest);
+  FRIEND_TEST(TrainerInterfaceTest, SplitSentencesThreadsTest);
+  FRIEND_TEST(TrainerInterfaceTest, PreTokenizeSentencesTest);
+  FRIEND_TEST(TrainerInterfaceTest, MergeDuplicatedSentencesTest);
+  FRIEND_TEST(TrainerInterfaceTest, CheckpointTest);
+  FRIEND_TEST(TrainerInterfaceTest, CorpusCacheTest);
+  FRIEND_TEST(TrainerInterfaceTest, SpillSentencesTest);
 
   // Loads all sentences from spec.input() or SentenceIterator.
   // It loads at most input_sentence_size sentences.
@@ -117,6 +468,32 @@ class TrainerInterface {
   // max_sentencepiece_length, split_by_whiespace, split_by_unicode_script.
   bool IsValidSentencePiece(const string_util::UnicodeText &piece) const;
 
+  // Properties of a character which decide the pieces it may appear in:
+  // its script in kCharScriptMask, Hiragana and Katakana merged into Han,
+  // and the kChar* flags.
+  using CharProperties = uint16;
+  static constexpr CharProperties kCharScriptMask = 0xff;
+  // Never part of a piece.
+  static constexpr CharProperties kCharInvalid = 1 << 8;
+  // U+0020, which is invalid and should have been normalized away.
+  static constexpr CharProperties kCharSpace = 1 << 9;
+  static constexpr CharProperties kCharWhitespace = 1 << 10;  // kWSChar
+  static constexpr CharProperties kCharNumber = 1 << 11;      // decimal digit
+  // Takes the script of the previous character.
+  static constexpr CharProperties kCharInherited = 1 << 12;
+
+  // Returns the properties of |c|. They are read from a table for the BMP.
+  static CharProperties GetCharProperties(char32 c);
+
+  // Computes GetCharProperties(c) without the table.
+  static CharProperties ComputeCharProperties(char32 c);
+
+  // Same as IsValidSentencePiece(piece) for the piece of |size| characters
+  // with |properties|. Callers checking many substrings of the same text
+  // compute the properties of the text once.
+  bool IsValidSentencePiece(const CharProperties *properties,
+                            size_t size) const;
+
   // Splits all sentencecs by whitespaces and
   // replace the |sentences_| with tokenized string.
   // e.g.,
@@ -124,9 +501,44 @@ class TrainerInterface {
   //  [ ["hello", 1], ["hi", 1], ["world", 2] ]
   void SplitSentencesByWhitespace();
 
+  // Merges the identical sentences of |sentences_| into one entry whose
+  // frequency is the sum of theirs. The first occurrences keep their order.
+  // e.g.,
+  //  [ ["hello world", 1], ["hi", 2], ["hello world", 3] ] =>
+  //  [ ["hello world", 4], ["hi", 2] ]
+  void MergeDuplicatedSentences();
+
+  // Moves the text of |sentences_| to a file in external_memory_dir_,
+  // longest sentence first, when it is set. See SetExternalMemory().
+  util::Status SpillSentences();
+
+  // Applies `pretokenizer` to all sentences on the thread pool and returns
+  // the tokens of each sentence of |sentences_|. The sentences are passed
+  // to PretokenizerForTrainingInterface::TokenizeBatch() in batches.
+  std::vector<std::vector<std::string>> PreTokenizeSentences(
+      const pretokenizer::PretokenizerForTrainingInterface &pretokenizer)
+      const;
+
   // Save model files into spec.model_prefix().
   util::Status Save() const;
 
+  // Returns true when a checkpoint is due after `step` steps, the last one
+  // written after `last_step` steps. `default_interval` is used when no
+  // `checkpoint_interval` is set.
+  bool IsCheckpointStep(int64 step, int64 last_step,
+                        int default_interval) const;
+
+  // Atomically replaces the file at `checkpoint_path_` with `checkpoint`.
+  util::Status SaveCheckpoint(const TrainerCheckpoint &checkpoint) const;
+
+  // Reads the checkpoint file `resume_from_` into `checkpoint`, which must
+  // have been written for the model type of `trainer_spec_`.
+  util::Status LoadCheckpoint(TrainerCheckpoint *checkpoint) const;
+
+  // Returns the worker pool shared by all training phases.
+  // The pool has trainer_spec.num_threads() workers and is created lazily.
+  ThreadPool *GetThreadPool() const;
+
   // Set of characters which must be included in the final vocab.
   // The value of this map stores the frequency.
   absl::flat_hash_map<char32, int64> required_chars_;
@@ -137,6 +549,13 @@ class TrainerInterface {
   // All sentences.
   Sentences sentences_;
 
+  // When true, LoadSentences() normalizes the sentences and splits them by
+  // whitespace while reading the corpus, so that only the word frequencies
+  // are kept in memory. `sentences_` then holds the words, as if
+  // SplitSentencesByWhitespace() had been called. It is ignored with
+  // input_sentence_size or differential privacy, which need the sentences.
+  bool split_by_whitespace_while_loading_ = false;
+
   // Trainer spec.
   TrainerSpec trainer_spec_;
 
@@ -160,6 +579,51 @@ class TrainerInterface {
   // Emits model to this proto instead of file.
   ModelProto *output_model_proto_ = nullptr;
 
+  // Checkpoint options. See SetCheckpoint().
+  std::string checkpoint_path_;
+  int checkpoint_interval_ = 0;
+  std::string resume_from_;
+
+  // Distributed job options. See SetDistributed().
+  std::string distributed_dir_;
+  int num_shards_ = 1;
+  int shard_id_ = 0;
+
+  // Convergence threshold of EM. See SetEMTolerance().
+  double em_tolerance_ = 0.0;
+
+  // Stochastic EM options. See SetStochasticEM().
+  int em_num_batches_ = 1;
+  double em_step_decay_ = 0.7;
+
+  // See SetExtraVocabSizes().
+  std::vector<int> extra_vocab_sizes_;
+
+  // The model to extend. See SetBaseModel().
+  const ModelProto *base_model_ = nullptr;
+
+  // See SetCorpusCache().
+  std::string corpus_cache_dir_;
+
+  // See SetExternalMemory().
+  std::string external_memory_dir_;
+
+  // See SetSuffixArrayBackend().
+  SuffixArrayBackend suffix_array_backend_ = SuffixArrayBackend::kSais;
+
+  // See SetLatticeCacheSize().
+  int64 lattice_cache_size_ = 0;
+
+  // See SetWordEngine().
+  bool use_word_engine_ = false;
+
+  // See SetEStepAccumulator().
+  EStepAccumulator estep_accumulator_ = EStepAccumulator::kFloat;
+
+  // Phases recorded by the trainers. Mutable, as the const passes over the
+  // corpus record themselves too; only the training thread records them.
+  mutable TrainingMetrics metrics_;
+
  private:
   // Serialize final_pieces_ to |model_proto|.
   util::Status Serialize(ModelProto *model_proto) const;
@@ -176,8 +640,27 @@ class TrainerInterface {
   // Initializes `meta_pieces_` from TrainerSpec.
   util::Status InitMetaPieces();
 
+  // Checks that the vocabulary has room for required_chars_.
+  util::Status CheckRequiredChars() const;
+
+  // Returns the corpus cache file of the inputs and the options of the
+  // loading in corpus_cache_dir_, or an empty string when there is none.
+  std::string CorpusCacheFile() const;
+
+  // Writes and reads the loaded sentences, required_chars_ and the self-test
+  // samples to and from a corpus cache file.
+  util::Status WriteCorpusCache(absl::string_view filename,
+                                uint64 total_size) const;
+  util::Status ReadCorpusCache(absl::string_view filename, uint64 *total_size);
+
+  // True when `sentences_` holds the words of the sentences.
+  bool sentences_are_words_ = false;
+
   // Randomly sampled raw sentences for self-testing.
   std::vector<std::string> self_test_samples_;
+
+  // Worker pool returned by GetThreadPool().
+  mutable std::unique_ptr<ThreadPool> pool_;
 };
 }  // namespace sentencepiece
 #endif  // TRAINER_INTERFACE_H_
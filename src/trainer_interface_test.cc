@@ -14,12 +14,20 @@
 
 #include "trainer_interface.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <random>
 #include <utility>
 
 #include "filesystem.h"
+#include "pretokenizer_for_training.h"
 #include "testharness.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/strings/str_join.h"
+#include "unicode_script.h"
 #include "util.h"
 
 namespace sentencepiece {
@@ -199,6 +207,43 @@ TEST(TrainerInterfaceTest, IsValidSentencePieceTest) {
   EXPECT_FALSE(IsValid("２＊"));
 }
 
+TEST(TrainerInterfaceTest, CharPropertiesTest) {
+  using T = TrainerInterface;
+  EXPECT_EQ(T::kCharInvalid, T::GetCharProperties(0x0000));
+  EXPECT_EQ(T::kCharInvalid, T::GetCharProperties(T::kUNKChar));
+  EXPECT_EQ(T::kCharInvalid, T::GetCharProperties(T::kUPPBoundaryChar));
+  EXPECT_EQ(T::kCharInvalid, T::GetCharProperties(0xD800));
+  EXPECT_EQ(T::kCharInvalid | T::kCharSpace, T::GetCharProperties(0x0020));
+  EXPECT_EQ(T::kCharWhitespace, T::GetCharProperties(T::kWSChar));
+  EXPECT_EQ(unicode_script::U_Latin, T::GetCharProperties('a'));
+  EXPECT_EQ(T::kCharNumber | unicode_script::U_Common,
+            T::GetCharProperties('1'));
+  EXPECT_EQ(unicode_script::U_Han, T::GetCharProperties(0x3042));  // Hiragana
+  EXPECT_EQ(unicode_script::U_Han, T::GetCharProperties(0x30FC));
+  EXPECT_TRUE(T::GetCharProperties(0x0308) & T::kCharInherited);
+  EXPECT_EQ(unicode_script::U_Osage, T::GetCharProperties(0x104B0));
+
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+
+  // The properties of a text are checked by substrings.
+  const auto text = string_util::UTF8ToUnicodeText(WS "ab" WS "c12");
+  std::vector<T::CharProperties> properties;
+  for (const char32 c : text) properties.push_back(T::GetCharProperties(c));
+  for (size_t begin = 0; begin < text.size(); ++begin) {
+    for (size_t end = begin; end <= text.size(); ++end) {
+      const string_util::UnicodeText piece(text.begin() + begin,
+                                           text.begin() + end);
+      EXPECT_EQ(trainer.IsValidSentencePiece(piece),
+                trainer.IsValidSentencePiece(&properties[begin], end - begin));
+    }
+  }
+  EXPECT_TRUE(trainer.IsValidSentencePiece(&properties[0], 3));
+  EXPECT_FALSE(trainer.IsValidSentencePiece(&properties[1], 3));
+}
+
 TEST(TrainerInterfaceTest, OverrideSpecialPiecesTest) {
   TrainerSpec base_trainer_spec;
   NormalizerSpec normalizer_spec;
@@ -489,6 +534,33 @@ TEST(TrainerInterfaceTest, SerializeTest) {
       EXPECT_EQ(final_pieces[i - 3].second, model_proto.pieces(i).score());
     }
   }
+
+  {
+    trainer_spec.set_vocab_size(10);
+    trainer_spec.set_hard_vocab_limit(false);
+    TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.final_pieces_ = final_pieces;
+    trainer.final_pieces_.emplace_back("b", 0.0);
+    ModelProto model_proto;
+    EXPECT_FALSE(trainer.Serialize(&model_proto).ok());
+  }
+}
+
+TEST(TrainerInterfaceTest, ParallelSortTest) {
+  std::mt19937 mt(0);
+  std::uniform_int_distribution<int> dist(0, 1000);
+  for (const int size : {0, 1, 100, 100000}) {
+    std::vector<std::pair<int, int>> v(size);
+    for (int i = 0; i < size; ++i) v[i] = std::make_pair(dist(mt), i);
+    std::vector<std::pair<int, int>> expected = v;
+    std::sort(expected.begin(), expected.end());
+    for (const int num_threads : {1, 3, 8}) {
+      ThreadPool pool(num_threads);
+      std::vector<std::pair<int, int>> sorted = v;
+      ParallelSort(&pool, &sorted, std::less<std::pair<int, int>>());
+      EXPECT_EQ(expected, sorted);
+    }
+  }
 }
 
 TEST(TrainerInterfaceTest, CharactersTest) {
@@ -555,6 +627,645 @@ TEST(TrainerInterfaceTest, CharactersTest) {
   }
 }
 
+// The characters are counted by the threads, in and out of the BMP.
+TEST(TrainerInterfaceTest, CharactersThreadsTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "characters_threads_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    for (int i = 0; i < 1000; ++i) {
+      std::string line = "a";
+      if (i % 2 == 0) line += "あ";
+      if (i % 5 == 0) line += "\xf0\x9f\x98\x80";  // U+1F600
+      if (i == 0) line += "b";
+      output->WriteLine(line);
+    }
+  }
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  for (const int num_threads : {1, 4}) {
+    TrainerSpec trainer_spec;
+    trainer_spec.add_input(input_file);
+    trainer_spec.set_model_prefix("model");
+    trainer_spec.set_character_coverage(0.9995);
+    trainer_spec.set_num_threads(num_threads);
+    TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    EXPECT_OK(trainer.LoadSentences());
+    EXPECT_EQ(trainer.required_chars_,
+              (absl::flat_hash_map<char32, int64>(
+                  {{ToChar32(WS), 1000},
+                   {ToChar32("a"), 1000},
+                   {ToChar32("あ"), 500},
+                   {0x1F600, 200}})));
+  }
+}
+
+namespace {
+class VectorSentenceIterator : public SentenceIterator {
+ public:
+  explicit VectorSentenceIterator(const std::vector<std::string> &values)
+      : values_(values) {}
+
+  bool done() const override { return index_ >= values_.size(); }
+  void Next() override { ++index_; }
+  const std::string &value() const override { return values_[index_]; }
+  util::Status status() const override { return util::OkStatus(); }
+
+ private:
+  std::vector<std::string> values_;
+  size_t index_ = 0;
+};
+}  // namespace
+
+TEST(TrainerInterfaceTest, LoadCorpusFilesTest) {
+  std::vector<std::string> files;
+  std::vector<std::string> lines;
+  std::mt19937 mt(1);
+  for (int i = 0; i < 5; ++i) {
+    const std::string file = util::JoinPath(::testing::TempDir(),
+                                            absl::StrCat("corpus", i));
+    auto output = filesystem::NewWritableFile(file);
+    const int num_lines = i == 2 ? 0 : 50 + mt() % 100;
+    for (int n = 0; n < num_lines; ++n) {
+      std::string line(mt() % 30, 'a');
+      for (auto &c : line) c = "abc"[mt() % 3];
+      if (n % 17 == 0) line += TrainerInterface::kUNKStr;
+      lines.emplace_back(line);
+      // The last line of the last file has no trailing newline.
+      if (i == 4 && n == num_lines - 1) {
+        output->Write(line);
+      } else {
+        output->WriteLine(line);
+      }
+    }
+    files.push_back(file);
+  }
+
+  TrainerSpec base_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  base_spec.set_model_prefix("model");
+  base_spec.set_max_sentence_length(25);
+  base_spec.set_self_test_sample_size(10);
+
+  // Loads the same lines one by one with a SentenceIterator.
+  auto load_serial = [&](const TrainerSpec &spec) {
+    VectorSentenceIterator it(lines);
+    TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+    trainer.sentence_iterator_ = &it;
+    EXPECT_OK(trainer.LoadSentences());
+    return trainer.sentences_;
+  };
+
+  auto load_files = [&](TrainerSpec spec, int num_threads) {
+    for (const auto &file : files) spec.add_input(file);
+    spec.set_num_threads(num_threads);
+    TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+    EXPECT_OK(trainer.LoadSentences());
+    EXPECT_EQ(10, trainer.self_test_samples_.size());
+    return trainer.sentences_;
+  };
+
+  // Without sampling, all the sentences are loaded in the corpus order.
+  const auto all_sentences = load_serial(base_spec);
+  EXPECT_LT(0, all_sentences.size());
+  for (const int num_threads : {1, 3, 16}) {
+    EXPECT_EQ(all_sentences, load_files(base_spec, num_threads));
+  }
+
+  // Takes the first sentences.
+  TrainerSpec spec = base_spec;
+  spec.set_input_sentence_size(120);
+  spec.set_shuffle_input_sentence(false);
+  const auto first_sentences = load_serial(spec);
+  EXPECT_EQ(120, first_sentences.size());
+  for (const int num_threads : {1, 3, 16}) {
+    EXPECT_EQ(first_sentences, load_files(spec, num_threads));
+  }
+
+  // Random samples do not depend on the number of threads.
+  spec.set_shuffle_input_sentence(true);
+  const auto sampled = load_serial(spec);
+  EXPECT_EQ(120, sampled.size());
+  EXPECT_NE(first_sentences, sampled);
+  for (const auto &sentence : sampled) {
+    EXPECT_TRUE(std::find(all_sentences.begin(), all_sentences.end(),
+                          sentence) != all_sentences.end());
+  }
+  for (const int num_threads : {1, 3, 16}) {
+    EXPECT_EQ(sampled, load_files(spec, num_threads));
+  }
+
+  // Parse errors are reported by the workers.
+  spec = base_spec;
+  spec.set_input_format("tsv");
+  for (const auto &file : files) spec.add_input(file);
+  spec.set_num_threads(4);
+  TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+  EXPECT_FALSE(trainer.LoadSentences().ok());
+}
+
+TEST(TrainerInterfaceTest, CountsInputFormatTest) {
+  // The same words and counts in the "tsv" and the "counts" formats. The
+  // second counts file is empty.
+  std::vector<std::string> tsv_files, counts_files;
+  std::mt19937 mt(3);
+  for (int i = 0; i < 3; ++i) {
+    tsv_files.push_back(util::JoinPath(::testing::TempDir(),
+                                       absl::StrCat("counts", i) + ".tsv"));
+    counts_files.push_back(
+        util::JoinPath(::testing::TempDir(), absl::StrCat("counts", i)));
+    auto tsv = filesystem::NewWritableFile(tsv_files.back());
+    std::string records;
+    for (int n = 0; i != 1 && n < 200; ++n) {
+      std::string word(1 + mt() % 5, "abcde"[mt() % 5]);
+      // Skipped words.
+      if (n % 50 == 0) word += TrainerInterface::kUNKStr;
+      if (n % 70 == 0) word = std::string(30, 'a');
+      const uint64 count = 1 + mt() % 1000;
+      tsv->WriteLine(absl::StrCat(word, "\t", count));
+      string_util::AppendBytes(word, &records);
+      string_util::AppendUInt32(static_cast<uint32>(count), &records);
+      string_util::AppendUInt32(0, &records);
+    }
+    auto output = filesystem::NewWritableFile(counts_files.back(), true);
+    output->Write(records);
+  }
+
+  TrainerSpec base_spec;
+  base_spec.set_model_prefix("model");
+  base_spec.set_max_sentence_length(20);
+  base_spec.set_self_test_sample_size(10);
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  TrainerSpec spec = base_spec;
+  spec.set_input_format("tsv");
+  for (const auto &file : tsv_files) spec.add_input(file);
+  TrainerInterface expected(spec, normalizer_spec, denormalizer_spec);
+  ASSERT_TRUE(expected.LoadSentences().ok());
+  EXPECT_LT(0, expected.sentences_.size());
+
+  for (const int num_threads : {1, 3, 16}) {
+    spec = base_spec;
+    spec.set_input_format("counts");
+    spec.set_num_threads(num_threads);
+    for (const auto &file : counts_files) spec.add_input(file);
+    TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+    ASSERT_TRUE(trainer.LoadSentences().ok());
+    EXPECT_EQ(expected.sentences_, trainer.sentences_);
+    EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+    EXPECT_EQ(expected.self_test_samples_.size(),
+              trainer.self_test_samples_.size());
+  }
+
+  // A truncated record.
+  const std::string truncated =
+      util::JoinPath(::testing::TempDir(), "counts_truncated");
+  {
+    std::string records;
+    string_util::AppendBytes("abc", &records);
+    string_util::AppendUInt32(1, &records);
+    filesystem::NewWritableFile(truncated, true)->Write(records);
+  }
+  spec = base_spec;
+  spec.set_input_format("counts");
+  spec.add_input(truncated);
+  TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+  EXPECT_FALSE(trainer.LoadSentences().ok());
+}
+
+TEST(TrainerInterfaceTest, DPNoiseThreadsTest) {
+  const std::string input =
+      util::JoinPath(::testing::TempDir(), "dp_input.tsv");
+  {
+    auto output = filesystem::NewWritableFile(input);
+    std::mt19937 mt(5);
+    for (int n = 0; n < 20000; ++n) {
+      std::string word(1 + mt() % 8, "abcdefg"[mt() % 7]);
+      word += "abcdefg"[n % 7];
+      output->WriteLine(absl::StrCat(word, "\t", 1 + mt() % 20));
+    }
+  }
+
+  SetRandomGeneratorSeed(17);
+  TrainerSpec spec;
+  spec.set_model_prefix("model");
+  spec.set_input_format("tsv");
+  spec.add_input(input);
+  spec.set_enable_differential_privacy(true);
+  spec.set_differential_privacy_noise_level(5.0);
+  spec.set_differential_privacy_clipping_threshold(8);
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  spec.set_num_threads(1);
+  TrainerInterface expected(spec, normalizer_spec, denormalizer_spec);
+  ASSERT_TRUE(expected.LoadSentences().ok());
+  EXPECT_LT(0, expected.sentences_.size());
+  EXPECT_GT(20000, expected.sentences_.size());
+
+  for (const int num_threads : {3, 16}) {
+    spec.set_num_threads(num_threads);
+    TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+    ASSERT_TRUE(trainer.LoadSentences().ok());
+    EXPECT_EQ(expected.sentences_, trainer.sentences_);
+  }
+}
+
+TEST(TrainerInterfaceTest, SplitByWhitespaceWhileLoadingTest) {
+  std::vector<std::string> files;
+  std::vector<std::string> lines;
+  std::mt19937 mt(2);
+  for (int i = 0; i < 3; ++i) {
+    const std::string file = util::JoinPath(::testing::TempDir(),
+                                            absl::StrCat("words", i));
+    auto output = filesystem::NewWritableFile(file);
+    for (int n = 0; n < 100; ++n) {
+      std::string line;
+      for (int w = mt() % 6; w >= 0; --w) {
+        line += std::string(1 + mt() % 3, "abc"[mt() % 3]);
+        line += w > 0 ? "  " : "";
+      }
+      // A rare character, which is replaced with kUNKChar.
+      if (n % 40 == 0) line += "z";
+      lines.emplace_back(line);
+      output->WriteLine(line);
+    }
+    files.push_back(file);
+  }
+
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  for (const bool suffix : {false, true}) {
+    for (const bool use_iterator : {false, true}) {
+      TrainerSpec spec;
+      spec.set_model_prefix("model");
+      spec.set_treat_whitespace_as_suffix(suffix);
+      spec.set_character_coverage(0.98);
+      spec.set_num_threads(3);
+      if (!use_iterator) {
+        for (const auto &file : files) spec.add_input(file);
+      }
+
+      auto load = [&](bool split_while_loading, TrainerInterface *trainer) {
+        VectorSentenceIterator it(lines);
+        if (use_iterator) trainer->sentence_iterator_ = &it;
+        trainer->split_by_whitespace_while_loading_ = split_while_loading;
+        EXPECT_OK(trainer->LoadSentences());
+        trainer->SplitSentencesByWhitespace();
+      };
+
+      TrainerInterface expected(spec, normalizer_spec, denormalizer_spec);
+      load(false, &expected);
+      TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+      load(true, &trainer);
+
+      EXPECT_LT(0, trainer.sentences_.size());
+      EXPECT_EQ(expected.sentences_, trainer.sentences_);
+      EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+      EXPECT_FALSE(port::ContainsKey(trainer.required_chars_, 'z'));
+    }
+  }
+}
+
+TEST(TrainerInterfaceTest, SplitSentencesThreadsTest) {
+  std::vector<std::pair<std::string, int64>> sentences;
+  std::map<std::string, int64> words;
+  std::mt19937 mt(3);
+  for (int n = 0; n < 2000; ++n) {
+    const int64 freq = 1 + mt() % 5;
+    std::string line;
+    for (int w = mt() % 8; w >= 0; --w) {
+      const std::string word = WS + std::string(1 + mt() % 4, "abcd"[mt() % 4]);
+      words[word] += freq;
+      line += word;
+    }
+    sentences.emplace_back(line, freq);
+  }
+
+  std::vector<std::pair<std::string, int64>> expected(words.begin(),
+                                                      words.end());
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const std::pair<std::string, int64> &a,
+                      const std::pair<std::string, int64> &b) {
+                     return a.second > b.second;
+                   });
+
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  for (const int num_threads : {1, 4}) {
+    TrainerSpec trainer_spec;
+    trainer_spec.set_model_prefix("model");
+    trainer_spec.set_num_threads(num_threads);
+    TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.sentences_ = SentenceArena(sentences);
+    trainer.SplitSentencesByWhitespace();
+    EXPECT_EQ(SentenceArena(expected), trainer.sentences_);
+  }
+}
+
+namespace {
+// Puts a boundary after each "b" and counts the batches.
+class BoundaryPretokenizer
+    : public pretokenizer::PretokenizerForTrainingInterface {
+ public:
+  SentencePieceText Tokenize(absl::string_view text) const override {
+    SentencePieceText spt;
+    size_t begin = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (text[i] != 'b' && i + 1 < text.size()) continue;
+      auto *piece = spt.add_pieces();
+      piece->set_surface(std::string(text.substr(begin, i + 1 - begin)));
+      piece->set_begin(begin);
+      piece->set_end(i + 1);
+      begin = i + 1;
+    }
+    return spt;
+  }
+
+  std::vector<SentencePieceText> TokenizeBatch(
+      const std::vector<absl::string_view> &texts) const override {
+    ++num_batches_;
+    return PretokenizerForTrainingInterface::TokenizeBatch(texts);
+  }
+
+  util::Status status() const override { return util::OkStatus(); }
+
+  int num_batches() const { return num_batches_; }
+
+ private:
+  mutable std::atomic<int> num_batches_{0};
+};
+}  // namespace
+
+TEST(TrainerInterfaceTest, PreTokenizeSentencesTest) {
+  std::vector<std::pair<std::string, int64>> sentences;
+  std::mt19937 mt(4);
+  for (int n = 0; n < 5000; ++n) {
+    std::string line;
+    for (int c = mt() % 10; c >= 0; --c) line += "abc"[mt() % 3];
+    sentences.emplace_back(line, 1);
+  }
+
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  for (const int num_threads : {1, 4}) {
+    TrainerSpec trainer_spec;
+    trainer_spec.set_model_prefix("model");
+    trainer_spec.set_num_threads(num_threads);
+    TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.sentences_ = SentenceArena(sentences);
+    BoundaryPretokenizer pretokenizer;
+    const auto tokens = trainer.PreTokenizeSentences(pretokenizer);
+    // The sentences are passed in batches rather than one by one.
+    EXPECT_LT(pretokenizer.num_batches(), sentences.size() / 10);
+    ASSERT_EQ(sentences.size(), tokens.size());
+    for (size_t i = 0; i < sentences.size(); ++i) {
+      EXPECT_EQ(pretokenizer.PreTokenize(sentences[i].first), tokens[i]);
+      EXPECT_EQ(sentences[i].first, absl::StrJoin(tokens[i], ""));
+    }
+  }
+}
+
+TEST(TrainerInterfaceTest, SentenceArenaTest) {
+  const std::vector<std::pair<std::string, int64>> sentences = {
+      {"hello", 3}, {"", 1}, {"world", 2}};
+  SentenceArena arena(sentences);
+  EXPECT_EQ(3, arena.size());
+  EXPECT_FALSE(arena.empty());
+  for (size_t i = 0; i < sentences.size(); ++i) {
+    EXPECT_EQ(sentences[i].first, arena[i].first);
+    EXPECT_EQ(sentences[i].second, arena[i].second);
+  }
+
+  std::vector<std::pair<std::string, int64>> values;
+  for (const auto &w : arena) values.emplace_back(w.first, w.second);
+  EXPECT_EQ(sentences, values);
+
+  SentenceArena other;
+  for (const auto &w : sentences) other.emplace_back(w.first, w.second);
+  EXPECT_EQ(arena, other);
+  other.emplace_back("!", 1);
+  EXPECT_NE(arena, other);
+
+  other.clear();
+  EXPECT_TRUE(other.empty());
+  EXPECT_TRUE(other.begin() == other.end());
+}
+
+TEST(TrainerInterfaceTest, MergeDuplicatedSentencesTest) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.set_model_prefix("model");
+  trainer_spec.add_input("input");
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+
+  const std::vector<std::pair<std::string, int64>> sentences = {
+      {WS "a" WS "b", 1}, {WS "c", 2}, {WS "a" WS "b", 3}, {WS "a", 1},
+      {WS "c", 1}};
+  trainer.sentences_ = SentenceArena(sentences);
+  trainer.MergeDuplicatedSentences();
+
+  const std::vector<std::pair<std::string, int64>> expected = {
+      {WS "a" WS "b", 4}, {WS "c", 3}, {WS "a", 1}};
+  EXPECT_EQ(SentenceArena(expected), trainer.sentences_);
+
+  // Nothing changes without duplicates.
+  trainer.MergeDuplicatedSentences();
+  EXPECT_EQ(SentenceArena(expected), trainer.sentences_);
+}
+
+TEST(TrainerInterfaceTest, CheckpointTest) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.set_model_prefix("model");
+  trainer_spec.add_input("input");
+  const std::string path =
+      util::JoinPath(::testing::TempDir(), "checkpoint");
+
+  TrainerCheckpoint checkpoint;
+  checkpoint.step = 3;
+  checkpoint.pieces = {{WS "a", -1.5}, {"", 0.0}, {"b\tc", -1e-30}};
+  checkpoint.merges = {{"a", "b"}, {"ab", WS}};
+
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+  trainer.SetCheckpoint(path, 0, path);
+  EXPECT_FALSE(trainer.IsCheckpointStep(4, 3, 2));
+  EXPECT_TRUE(trainer.IsCheckpointStep(5, 3, 2));
+  ASSERT_TRUE(trainer.SaveCheckpoint(checkpoint).ok());
+
+  TrainerCheckpoint loaded;
+  ASSERT_TRUE(trainer.LoadCheckpoint(&loaded).ok());
+  EXPECT_EQ(TrainerSpec::UNIGRAM, loaded.model_type);
+  EXPECT_EQ(3, loaded.step);
+  EXPECT_EQ(checkpoint.pieces, loaded.pieces);
+  EXPECT_EQ(checkpoint.merges, loaded.merges);
+
+  // Checkpoints are not written without a path.
+  trainer.SetCheckpoint("", 1, "");
+  EXPECT_FALSE(trainer.IsCheckpointStep(5, 3, 2));
+
+  // A checkpoint of another model type is rejected.
+  trainer_spec.set_model_type(TrainerSpec::BPE);
+  TrainerInterface bpe_trainer(trainer_spec, normalizer_spec,
+                               denormalizer_spec);
+  bpe_trainer.SetCheckpoint("", 0, path);
+  EXPECT_FALSE(bpe_trainer.LoadCheckpoint(&loaded).ok());
+
+  // So is a truncated file.
+  {
+    auto output = filesystem::NewWritableFile(path, true);
+    output->Write("SPMCKPT1\x01");
+  }
+  trainer.SetCheckpoint("", 0, path);
+  EXPECT_FALSE(trainer.LoadCheckpoint(&loaded).ok());
+}
+
+TEST(TrainerInterfaceTest, SpillSentencesTest) {
+  const std::vector<std::pair<std::string, int64>> sentences = {
+      {"ab", 3}, {"abcd", 1}, {"", 5}, {"abc", 2}, {"xyzw", 4}};
+  const std::string filename =
+      util::JoinPath(::testing::TempDir(), "spilled_sentences");
+
+  SentenceArena arena(sentences);
+  EXPECT_FALSE(arena.spilled());
+  EXPECT_FALSE(arena.Spill(filename, {0, 1}).ok());
+  ASSERT_TRUE(arena.Spill(filename, {1, 4, 3, 0, 2}).ok());
+  EXPECT_TRUE(arena.spilled());
+  EXPECT_FALSE(filesystem::NewReadableFile(filename, true)->status().ok());
+  EXPECT_EQ(SentenceArena(std::vector<std::pair<std::string, int64>>(
+                {{"abcd", 1}, {"xyzw", 4}, {"abc", 2}, {"ab", 3}, {"", 5}})),
+            arena);
+  // A copy shares the file.
+  const SentenceArena copy = arena;
+  arena.clear();
+  EXPECT_EQ("xyzw", copy[1].first);
+  arena.emplace_back("a", 1);
+  EXPECT_FALSE(arena.spilled());
+  EXPECT_EQ("a", arena[0].first);
+
+  // The trainer spills the sentences longest first.
+  TrainerSpec spec;
+  spec.set_model_prefix("model");
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+  trainer.sentences_ = SentenceArena(sentences);
+  EXPECT_TRUE(trainer.SpillSentences().ok());
+  EXPECT_FALSE(trainer.sentences_.spilled());
+  trainer.SetExternalMemory(::testing::TempDir());
+  EXPECT_TRUE(trainer.SpillSentences().ok());
+  EXPECT_TRUE(trainer.sentences_.spilled());
+  EXPECT_EQ(copy, trainer.sentences_);
+}
+
+// A second run loads the same sentences from the cache of the first one.
+TEST(TrainerInterfaceTest, CorpusCacheTest) {
+  const std::string input =
+      util::JoinPath(::testing::TempDir(), "corpus_cache_input");
+  {
+    auto output = filesystem::NewWritableFile(input);
+    for (int i = 0; i < 50; ++i) {
+      output->WriteLine(absl::StrCat("hello world ", i % 7) +
+                        (i == 0 ? " z" : ""));
+    }
+  }
+
+  TrainerSpec spec;
+  spec.set_model_prefix("model");
+  spec.add_input(input);
+  spec.set_character_coverage(0.99);
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  TrainerInterface expected(spec, normalizer_spec, denormalizer_spec);
+  expected.SetCorpusCache(::testing::TempDir());
+  const std::string cache_file = expected.CorpusCacheFile();
+  ASSERT_FALSE(cache_file.empty());
+  std::remove(cache_file.c_str());
+  ASSERT_TRUE(expected.LoadSentences().ok());
+  ASSERT_TRUE(filesystem::NewReadableFile(cache_file, true)->status().ok());
+
+  // The vocab size does not change the loading.
+  spec.set_vocab_size(1000);
+  TrainerInterface trainer(spec, normalizer_spec, denormalizer_spec);
+  trainer.SetCorpusCache(::testing::TempDir());
+  EXPECT_EQ(cache_file, trainer.CorpusCacheFile());
+  ASSERT_TRUE(trainer.LoadSentences().ok());
+  EXPECT_EQ(expected.sentences_, trainer.sentences_);
+  EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+  EXPECT_FALSE(port::ContainsKey(trainer.required_chars_, 'z'));
+  for (const auto &phase : trainer.metrics().phases()) {
+    EXPECT_NE("normalize", phase.name);
+  }
+
+  // But the normalizer and the loading options do.
+  {
+    NormalizerSpec identity = normalizer_spec;
+    identity.set_name("identity");
+    TrainerInterface other(spec, identity, denormalizer_spec);
+    other.SetCorpusCache(::testing::TempDir());
+    EXPECT_NE(cache_file, other.CorpusCacheFile());
+  }
+  {
+    TrainerInterface other(spec, normalizer_spec, denormalizer_spec);
+    other.SetCorpusCache(::testing::TempDir());
+    other.split_by_whitespace_while_loading_ = true;
+    EXPECT_NE(cache_file, other.CorpusCacheFile());
+  }
+  {
+    TrainerSpec other_spec = spec;
+    other_spec.set_character_coverage(1.0);
+    TrainerInterface other(other_spec, normalizer_spec, denormalizer_spec);
+    other.SetCorpusCache(::testing::TempDir());
+    EXPECT_NE(cache_file, other.CorpusCacheFile());
+  }
+
+  // A broken cache is an error.
+  {
+    auto output = filesystem::NewWritableFile(cache_file, true);
+    output->Write("SPMCORP1\x01");
+  }
+  TrainerInterface broken(spec, normalizer_spec, denormalizer_spec);
+  broken.SetCorpusCache(::testing::TempDir());
+  EXPECT_FALSE(broken.LoadSentences().ok());
+  std::remove(cache_file.c_str());
+}
+
+TEST(TrainerInterfaceTest, TrainingMetricsTest) {
+  TrainingMetrics metrics;
+  {
+    TrainingMetrics::Scope outer(&metrics, "outer", 10);
+    TrainingMetrics::Scope inner(&metrics, "inner");
+    inner.AddItems(3);
+    inner.AddItems(4);
+  }
+
+  // The phases are in the order they finished.
+  ASSERT_EQ(2, metrics.phases().size());
+  EXPECT_EQ("inner", metrics.phases()[0].name);
+  EXPECT_EQ(7, metrics.phases()[0].items);
+  EXPECT_EQ("outer", metrics.phases()[1].name);
+  EXPECT_EQ(10, metrics.phases()[1].items);
+  for (const auto &phase : metrics.phases()) {
+    EXPECT_GE(phase.wall_seconds, 0.0);
+    EXPECT_GE(phase.cpu_seconds, 0.0);
+    EXPECT_GE(phase.peak_rss_bytes, 0);
+  }
+  EXPECT_GE(metrics.phases()[1].wall_seconds,
+            metrics.phases()[0].wall_seconds);
+
+  const std::string json = metrics.ToJson();
+  EXPECT_EQ(0, json.find("{\"phases\": [{\"name\": \"inner\", "
+                         "\"wall_seconds\": "));
+  EXPECT_NE(std::string::npos, json.find("\"items\": 7, "));
+  EXPECT_NE(std::string::npos, json.find("{\"name\": \"outer\""));
+  EXPECT_EQ("]}\n", json.substr(json.size() - 3));
+}
+
 TEST(TrainerInterfaceTest, MultiFileSentenceIteratorTest) {
   std::vector<std::string> files;
   std::vector<std::string> expected;
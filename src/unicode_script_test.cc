@@ -39,5 +39,20 @@ TEST(UnicodeScript, GetScriptTypeTest) {
   EXPECT_EQ(U_Common, GetScriptType("@"));
   EXPECT_EQ(U_Common, GetScriptType("-"));
 }
+
+TEST(UnicodeScript, GetScriptTest) {
+  EXPECT_EQ(U_Common, GetScript(0x0000));
+  EXPECT_EQ(U_Latin, GetScript(0x007A));
+  EXPECT_EQ(U_Osage, GetScript(0x104B0));
+  EXPECT_EQ(U_Osage, GetScript(0x104FB));
+  EXPECT_EQ(U_Common, GetScript(0x104FC));
+  EXPECT_EQ(U_Tangut, GetScript(0x187EC));
+  EXPECT_EQ(U_Common, GetScript(0x1F600));
+  EXPECT_EQ(U_Inherited, GetScript(0xE01EF));
+  EXPECT_EQ(U_Common, GetScript(0xE01F0));
+  EXPECT_EQ(U_Common, GetScript(0x10FFFF));
+  EXPECT_EQ(U_Common, GetScript(0x110000));
+  EXPECT_EQ(U_Common, GetScript(0xFFFFFFFF));
+}
 }  // namespace unicode_script
 }  // namespace sentencepiece
@@ -18,12 +18,16 @@
 #include <cfloat>
 #include <cmath>
 #include <complex>
+#include <cstring>
+#include <limits>
 #include <map>
 #include <queue>
+#include <random>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "fast_model.h"
 #include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/strings/str_split.h"
 #include "third_party/absl/strings/string_view.h"
@@ -39,22 +43,73 @@ constexpr size_t kPreallocateLatticeNodeSize = 1024;
 constexpr float kUnkPenalty = 10.0;
 constexpr float kEpsilon = 1e-7;
 
-// Returns log(exp(x) + exp(y)).
-// if init_mode is true, returns log(exp(y)) == y.
-// log(\sum_i exp(a[i])) can be computed as
-// for (int i = 0; i < a.size(); ++i)
-//   x = LogSumExp(x, a[i], i == 0);
-inline float LogSumExp(float x, float y, bool init_mode) {
-  if (init_mode) {
-    return y;
-  }
-  const float vmin = std::min(x, y);
-  const float vmax = std::max(x, y);
-  constexpr float kMinusLogEpsilon = 50;
-  if (vmax > vmin + kMinusLogEpsilon) {
-    return vmax;
+// Number of texts advanced in turn by Model::EncodeInterleaved().
+constexpr int kInterleavedLanes = 8;
+
+// Hints the CPU to load the cache line of `address`.
+inline void Prefetch(const void *address) {
+#if defined(__GNUC__)
+  __builtin_prefetch(address);
+#endif
+}
+
+// Prefetches the unit of the double-array `units` that
+// Darts::DoubleArray::traverse() reads for `label` from `node_pos`.
+inline void PrefetchTrieUnit(const uint32 *units, std::size_t node_pos,
+                             unsigned char label) {
+  // The same as Darts::Details::DoubleArrayUnit::offset().
+  const uint32 unit = units[node_pos];
+  const uint32 offset = (unit >> 10) << ((unit & (1U << 9)) >> 6);
+  Prefetch(units + (node_pos ^ offset ^ label));
+}
+
+// Returns an approximation of exp(x) for x <= 0 with a relative error of a
+// few ulps. Unlike std::exp, the loops calling this function are vectorized
+// by the compiler.
+inline float FastExp(float x) {
+  constexpr float kLog2e = 1.44269504088896341f;
+  constexpr float kLn2Hi = 0.693359375f;
+  constexpr float kLn2Lo = -2.12194440e-4f;
+  x = std::max(x, -87.0f);
+  const float n = std::floor(x * kLog2e + 0.5f);
+  const float r = x - n * kLn2Hi - n * kLn2Lo;
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  const float y = p * r * r + r + 1.0f;
+  const int32 bits = (static_cast<int32>(n) + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return y * scale;
+}
+
+// Returns log(\sum_i exp(v[i])) of |n| > 0 values. The maximum is
+// subtracted first so that the sum never overflows. With |approximate|,
+// the exponentials are computed by FastExp and summed in float.
+float BatchLogSumExp(const float *v, size_t n, bool approximate) {
+  float vmax = v[0];
+  for (size_t i = 1; i < n; ++i) vmax = std::max(vmax, v[i]);
+  if (approximate) {
+    float sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += FastExp(v[i] - vmax);
+    return vmax + std::log(sum);
+  }
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += std::exp(static_cast<double>(v[i] - vmax));
+  }
+  return vmax + std::log(sum);
+}
+
+// Sets out[i] = exp(v[i]). v[i] must be <= 0 with |approximate|.
+void BatchExp(const float *v, size_t n, bool approximate, float *out) {
+  if (approximate) {
+    for (size_t i = 0; i < n; ++i) out[i] = FastExp(v[i]);
   } else {
-    return vmax + log(std::exp(static_cast<double>(vmin - vmax)) + 1.0);
+    for (size_t i = 0; i < n; ++i) out[i] = std::exp(v[i]);
   }
 }
 
@@ -68,17 +123,39 @@ inline float Gumbel() {
 
   return noise;
 }
+
+// Appends the pieces of the Viterbi `path` to `result`. A run of unknown
+// pieces becomes one piece when `merge_unknowns`, as in
+// Model::EncodeOptimized().
+void AppendPath(const std::vector<Lattice::Node *> &path, int unk_id,
+                bool merge_unknowns, EncodeResult *result) {
+  for (const auto *node : path) {
+    if (merge_unknowns && node->id == unk_id && !result->empty() &&
+        result->back().second == unk_id) {
+      auto &run = result->back().first;
+      run = absl::string_view(run.data(), run.size() + node->piece.size());
+    } else {
+      result->emplace_back(node->piece, node->id);
+    }
+  }
+}
 }  // namespace
 
 Lattice::Lattice() : node_allocator_(kPreallocateLatticeNodeSize) {}
 Lattice::~Lattice() {}
 
-const std::vector<Lattice::Node *> &Lattice::begin_nodes(int pos) const {
-  return begin_nodes_[pos];
+Lattice::NodeList Lattice::begin_nodes(int pos) const {
+  BuildNodeLists();
+  const auto &offsets = arrays_.begin_offsets;
+  return NodeList(begin_nodes_.data() + offsets[pos],
+                  begin_nodes_.data() + offsets[pos + 1]);
 }
 
-const std::vector<Lattice::Node *> &Lattice::end_nodes(int pos) const {
-  return end_nodes_[pos];
+Lattice::NodeList Lattice::end_nodes(int pos) const {
+  BuildNodeLists();
+  const auto &offsets = arrays_.end_offsets;
+  return NodeList(end_nodes_.data() + offsets[pos],
+                  end_nodes_.data() + offsets[pos + 1]);
 }
 
 int Lattice::size() const {
@@ -92,22 +169,28 @@ const char *Lattice::sentence() const { return sentence_.data(); }
 
 const char *Lattice::surface(int pos) const { return surface_[pos]; }
 
-Lattice::Node *Lattice::bos_node() const { return end_nodes_[0][0]; }
+Lattice::Node *Lattice::bos_node() const { return nodes_[0]; }
 
-Lattice::Node *Lattice::eos_node() const { return begin_nodes_[size()][0]; }
+Lattice::Node *Lattice::eos_node() const { return nodes_[1]; }
 
 Lattice::Node *Lattice::NewNode() {
+  // The chunks are not cleared when the lattice is reused, so the node is
+  // initialized here.
   Node *node = node_allocator_.Allocate();
-  node->node_id = node_allocator_.size() - 1;
+  *node = Node();
+  node->node_id = nodes_.size();
+  nodes_.push_back(node);
+  lists_built_ = false;
   return node;
 }
 
 void Lattice::Clear() {
-  begin_nodes_.clear();
-  end_nodes_.clear();
+  // Keeps all the buffers for the next sentence.
   sentence_ = absl::string_view("");
   surface_.clear();
-  node_allocator_.Free();
+  nodes_.clear();
+  node_allocator_.Reset();
+  lists_built_ = false;
 }
 
 void Lattice::SetSentence(absl::string_view sentence) {
@@ -117,6 +200,11 @@ void Lattice::SetSentence(absl::string_view sentence) {
   surface_.reserve(sentence.size() + 1);
 
   while (!sentence.empty()) {
+    // Every byte of an ASCII run begins a character.
+    const size_t n = string_util::ASCIIPrefixLength(sentence);
+    for (size_t i = 0; i < n; ++i) surface_.push_back(sentence.data() + i);
+    sentence.remove_prefix(n);
+    if (sentence.empty()) break;
     const int mblen = std::min<int>(string_util::OneCharLen(sentence.data()),
                                     sentence.size());
     surface_.push_back(sentence.data());
@@ -125,24 +213,14 @@ void Lattice::SetSentence(absl::string_view sentence) {
   surface_.push_back(sentence.data());
 
   const int len = size();
-  begin_nodes_.resize(len + 1);
-  end_nodes_.resize(len + 1);
-
-  constexpr size_t kReservedNodeSize = 16;
-  for (int i = 0; i <= len; ++i) {
-    begin_nodes_[i].reserve(kReservedNodeSize);
-    end_nodes_[i].reserve(kReservedNodeSize);
-  }
 
   Node *bos = NewNode();
   bos->id = -1;
   bos->pos = 0;
-  end_nodes_[0].push_back(bos);
 
   Node *eos = NewNode();
   eos->id = -1;
   eos->pos = len;
-  begin_nodes_[len].push_back(eos);
 }
 
 Lattice::Node *Lattice::Insert(int pos, int length) {
@@ -152,42 +230,114 @@ Lattice::Node *Lattice::Insert(int pos, int length) {
   const int utf8_length =
       static_cast<int>(surface(pos + length) - surface(pos));
   node->piece = absl::string_view(surface(pos), utf8_length);
-  begin_nodes_[pos].push_back(node);
-  end_nodes_[pos + node->length].push_back(node);
 
   return node;
 }
 
+void Lattice::BuildNodeLists() const {
+  if (lists_built_) return;
+  const int len = size();
+  auto &a = arrays_;
+
+  // Stable counting sort of the nodes by `position(node)`, skipping the
+  // node `skip_id`, so that every position keeps the order of insertion.
+  auto group = [&](uint32 skip_id, auto position,
+                   std::vector<uint32> *offsets, std::vector<Node *> *list) {
+    offsets->assign(len + 2, 0);
+    for (const Node *node : nodes_) {
+      if (node->node_id != skip_id) ++(*offsets)[position(node) + 1];
+    }
+    for (int pos = 0; pos <= len; ++pos) {
+      (*offsets)[pos + 1] += (*offsets)[pos];
+    }
+    list_cursors_.assign(offsets->begin(), offsets->end() - 1);
+    list->resize(offsets->back());
+    for (Node *node : nodes_) {
+      if (node->node_id != skip_id) {
+        (*list)[list_cursors_[position(node)]++] = node;
+      }
+    }
+  };
+  // The bos node (node_id 0) only ends at 0 and the eos node (node_id 1)
+  // only begins at `len`.
+  group(
+      0, [](const Node *node) { return node->pos; }, &a.begin_offsets,
+      &begin_nodes_);
+  group(
+      1, [](const Node *node) { return node->pos + node->length; },
+      &a.end_offsets, &end_nodes_);
+
+  lists_built_ = true;
+}
+
+void Lattice::BuildNodeArrays() const {
+  BuildNodeLists();
+  const size_t num_nodes = nodes_.size();
+  auto &a = arrays_;
+
+  a.score.resize(num_nodes);
+  a.id.resize(num_nodes);
+  for (size_t i = 0; i < num_nodes; ++i) {
+    const Node *node = nodes_[i];
+    a.score[i] = node->score;
+    a.id[i] = node->id;
+  }
+
+  auto flatten = [](const std::vector<Node *> &nodes,
+                    std::vector<uint32> *ids) {
+    ids->resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) (*ids)[i] = nodes[i]->node_id;
+  };
+  flatten(begin_nodes_, &a.begin_ids);
+  flatten(end_nodes_, &a.end_ids);
+}
+
 Lattice::LatticePathWithScore Lattice::Viterbi() {
   const int len = size();
+  BuildNodeArrays();
+  const auto &a = arrays_;
+
+  auto &backtrace_scores = backtrace_scores_;
+  auto &prevs = backtrace_prevs_;
+  backtrace_scores.assign(a.score.size(), 0.0);
+  prevs.assign(a.score.size(), -1);
+  const uint32 bos_id = bos_node()->node_id;
+  backtrace_scores[bos_id] = bos_node()->backtrace_score;
 
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
+    const uint32 *lbegin = a.end_ids.data() + a.end_offsets[pos];
+    const uint32 *lend = a.end_ids.data() + a.end_offsets[pos + 1];
+    for (uint32 k = a.begin_offsets[pos]; k < a.begin_offsets[pos + 1]; ++k) {
+      const uint32 r = a.begin_ids[k];
+      Node *rnode = nodes_[r];
       rnode->prev = nullptr;
-      float best_score = 0.0;
-      Node *best_node = nullptr;
-      for (Node *lnode : end_nodes_[pos]) {
-        const float score = lnode->backtrace_score + rnode->score;
-        if (best_node == nullptr || score > best_score) {
-          best_node = lnode;
-          best_score = score;
-        }
-      }
-      if (best_node == nullptr) {
+      if (lbegin == lend) {
         LOG(ERROR) << "Failed to find the best path in Viterbi.";
         return {};
       }
-      rnode->prev = best_node;
+      const float rscore = a.score[r];
+      float best_score = backtrace_scores[*lbegin] + rscore;
+      uint32 best = *lbegin;
+      for (const uint32 *l = lbegin + 1; l < lend; ++l) {
+        const float score = backtrace_scores[*l] + rscore;
+        if (score > best_score) {
+          best = *l;
+          best_score = score;
+        }
+      }
+      prevs[r] = best;
+      backtrace_scores[r] = best_score;
+      rnode->prev = nodes_[best];
       rnode->backtrace_score = best_score;
     }
   }
 
   // backtrace
   std::vector<Node *> results;
-  float score = begin_nodes(len)[0]->backtrace_score;
-  for (Node *node = begin_nodes_[len][0]->prev; node->prev != nullptr;
-       node = node->prev) {
-    results.push_back(node);
+  const uint32 eos_id = eos_node()->node_id;
+  float score = backtrace_scores[eos_id];
+  for (int node = prevs[eos_id]; prevs[node] >= 0; node = prevs[node]) {
+    results.push_back(nodes_[node]);
   }
 
   std::reverse(results.begin(), results.end());
@@ -198,96 +348,212 @@ Lattice::LatticePathWithScore Lattice::Viterbi() {
 }
 
 std::vector<float> Lattice::ForwardAlgorithm(float inv_theta) const {
+  BuildNodeArrays();
+  return RunForwardAlgorithm(inv_theta);
+}
+
+std::vector<float> Lattice::BackwardAlgorithm(float inv_theta) const {
+  BuildNodeArrays();
+  return RunBackwardAlgorithm(inv_theta);
+}
+
+std::vector<float> Lattice::RunForwardAlgorithm(float inv_theta) const {
   const int len = size();
-  std::vector<float> alpha(node_allocator_.size(), 0.0);
+  const auto &a = arrays_;
+  std::vector<float> alpha(a.score.size(), 0.0);
+  auto &values = arrays_.values;
 
+  // alpha is the same for all the nodes beginning at |pos|, since they share
+  // the preceding nodes ending at |pos|.
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
-      for (Node *lnode : end_nodes_[pos]) {
-        alpha[rnode->node_id] =
-            LogSumExp(alpha[rnode->node_id],
-                      inv_theta * lnode->score + alpha[lnode->node_id],
-                      lnode == end_nodes_[pos][0]);
-      }
+    const uint32 lbegin = a.end_offsets[pos];
+    const uint32 lend = a.end_offsets[pos + 1];
+    if (lbegin == lend) continue;
+    values.resize(lend - lbegin);
+    for (uint32 j = lbegin; j < lend; ++j) {
+      const uint32 l = a.end_ids[j];
+      values[j - lbegin] = inv_theta * a.score[l] + alpha[l];
+    }
+    const float sum =
+        BatchLogSumExp(values.data(), values.size(), approximate_exp_);
+    for (uint32 k = a.begin_offsets[pos]; k < a.begin_offsets[pos + 1]; ++k) {
+      alpha[a.begin_ids[k]] = sum;
     }
   }
 
   return alpha;
 }
 
-std::vector<float> Lattice::BackwardAlgorithm(float inv_theta) const {
+std::vector<float> Lattice::RunBackwardAlgorithm(float inv_theta) const {
   const int len = size();
-  std::vector<float> beta(node_allocator_.size(), 0.0);
+  const auto &a = arrays_;
+  std::vector<float> beta(a.score.size(), 0.0);
+  auto &values = arrays_.values;
 
+  // beta is the same for all the nodes ending at |pos|.
   for (int pos = len; pos >= 0; --pos) {
-    for (Node *lnode : end_nodes_[pos]) {
-      for (Node *rnode : begin_nodes_[pos]) {
-        beta[lnode->node_id] =
-            LogSumExp(beta[lnode->node_id], rnode->score + beta[rnode->node_id],
-                      rnode == begin_nodes_[pos][0]);
-      }
+    const uint32 rbegin = a.begin_offsets[pos];
+    const uint32 rend = a.begin_offsets[pos + 1];
+    if (rbegin == rend) continue;
+    values.resize(rend - rbegin);
+    for (uint32 j = rbegin; j < rend; ++j) {
+      const uint32 r = a.begin_ids[j];
+      values[j - rbegin] = inv_theta * a.score[r] + beta[r];
+    }
+    const float sum =
+        BatchLogSumExp(values.data(), values.size(), approximate_exp_);
+    for (uint32 k = a.end_offsets[pos]; k < a.end_offsets[pos + 1]; ++k) {
+      beta[a.end_ids[k]] = sum;
     }
   }
 
   return beta;
 }
 
+template <typename Add>
+float Lattice::ForEachMarginal(Add add) const {
+  const int len = size();
+
+  // alpha and beta (accumulative log prob) in Forward Backward.
+  // the index of alpha/beta is Node::node_id.
+  BuildNodeArrays();
+  const auto &a = arrays_;
+  const auto alpha = RunForwardAlgorithm(1.0);
+  const auto beta = RunBackwardAlgorithm(1.0);
+
+  const float Z = alpha[a.begin_ids[a.begin_offsets[len]]];
+  for (uint32 k = 0; k < a.begin_offsets[len]; ++k) {
+    const uint32 n = a.begin_ids[k];
+    if (a.id[n] >= 0) {
+      // the index of |expected| is a Node::id, which is a vocabulary id.
+      add(a.id[n], std::exp(static_cast<double>(alpha[n] + a.score[n] +
+                                                beta[n] - Z)));
+    }
+  }
+
+  return Z;
+}
+
 float Lattice::PopulateMarginal(float freq,
                                 std::vector<float> *expected) const {
   if (expected == nullptr) return 0.0;
+  const float Z = ForEachMarginal(
+      [&](int id, double prob) { (*expected)[id] += freq * prob; });
+  return freq * Z;
+}
 
-  const int len = size();
+float Lattice::PopulateMarginal(float freq,
+                                std::vector<double> *expected) const {
+  if (expected == nullptr) return 0.0;
+  const float Z = ForEachMarginal(
+      [&](int id, double prob) { (*expected)[id] += freq * prob; });
+  return freq * Z;
+}
 
-  // alpha and beta (accumulative log prob) in Forward Backward.
-  // the index of alpha/beta is Node::node_id.
+float Lattice::PopulateMarginal(float freq, std::vector<float> *expected,
+                                std::vector<float> *compensation) const {
+  if (expected == nullptr || compensation == nullptr) return 0.0;
+  const float Z = ForEachMarginal([&](int id, double prob) {
+    const float y = static_cast<float>(freq * prob) - (*compensation)[id];
+    const float t = (*expected)[id] + y;
+    (*compensation)[id] = (t - (*expected)[id]) - y;
+    (*expected)[id] = t;
+  });
+  return freq * Z;
+}
 
-  const auto alpha = ForwardAlgorithm(1.0);
-  const auto beta = BackwardAlgorithm(1.0);
+float Lattice::CalculateEntropy(float inv_theta) const {
+  // alpha[node_id] is the marginal prob of sequence up to start of node
+  BuildNodeArrays();
+  return RunEntropy(inv_theta, RunForwardAlgorithm(inv_theta));
+}
 
-  const float Z = alpha[begin_nodes_[len][0]->node_id];
-  for (int pos = 0; pos < len; ++pos) {
-    for (Node *node : begin_nodes_[pos]) {
-      if (node->id >= 0) {
-        // the index of |expected| is a Node::id, which is a vocabulary id.
-        (*expected)[node->id] +=
-            freq *
-            std::exp(static_cast<double>(alpha[node->node_id] + node->score +
-                                         beta[node->node_id] - Z));
-      }
+float Lattice::CalculateEntropy(
+    float inv_theta, std::vector<std::pair<int, float>> *marginals) const {
+  BuildNodeArrays();
+  const auto alpha = RunForwardAlgorithm(inv_theta);
+  const float entropy = RunEntropy(inv_theta, alpha);
+  if (marginals == nullptr) return entropy;
+
+  const int len = size();
+  const auto &a = arrays_;
+  const auto beta = RunBackwardAlgorithm(inv_theta);
+  const float Z = alpha[a.begin_ids[a.begin_offsets[len]]];
+
+  // The marginal of node n is exp(alpha[n] + score[n] + beta[n] - Z), taken
+  // in one batch over the nodes of vocabulary pieces.
+  auto &values = arrays_.values;
+  auto &probs = arrays_.probs;
+  marginals->clear();
+  values.clear();
+  for (uint32 k = 0; k < a.begin_offsets[len]; ++k) {
+    const uint32 n = a.begin_ids[k];
+    if (a.id[n] < 0) continue;
+    marginals->emplace_back(a.id[n], 0.0);
+    values.push_back(alpha[n] + inv_theta * a.score[n] + beta[n] - Z);
+  }
+  probs.resize(values.size());
+  BatchExp(values.data(), values.size(), approximate_exp_, probs.data());
+  for (size_t i = 0; i < probs.size(); ++i) (*marginals)[i].second = probs[i];
+
+  // Sums up the marginals of the nodes with the same id.
+  std::sort(marginals->begin(), marginals->end(),
+            [](const std::pair<int, float> &x, const std::pair<int, float> &y) {
+              return x.first < y.first;
+            });
+  size_t size = 0;
+  for (const auto &m : *marginals) {
+    if (size > 0 && (*marginals)[size - 1].first == m.first) {
+      (*marginals)[size - 1].second += m.second;
+    } else {
+      (*marginals)[size++] = m;
     }
   }
+  marginals->resize(size);
 
-  return freq * Z;
+  return entropy;
 }
 
-float Lattice::CalculateEntropy(float inv_theta) const {
+float Lattice::RunEntropy(float inv_theta,
+                          const std::vector<float> &alpha) const {
   const int len = size();
 
-  // alpha[node_id] is the marginal prob of sequence up to start of node
   // H is entropy of sequence
   // the index of alpha/H is Node::node_id.
-  std::vector<float> H(node_allocator_.size(), 0.0);
+  const auto &a = arrays_;
+  std::vector<float> H(a.score.size(), 0.0);
 
-  // Populate the forward marginals to get the normalising constant
-  const auto alpha = ForwardAlgorithm(inv_theta);
-
-  // Now populate the forward entropies
+  // Now populate the forward entropies. As alpha, H is the same for all the
+  // nodes beginning at |pos|.
+  auto &values = arrays_.values;
+  auto &probs = arrays_.probs;
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
-      for (Node *lnode : end_nodes_[pos]) {
-        // Contribution each lnode makes = p(lnode) * (H(lnode) + log p(lnode))
+    const uint32 lbegin = a.end_offsets[pos];
+    const uint32 lend = a.end_offsets[pos + 1];
+    const uint32 rbegin = a.begin_offsets[pos];
+    const uint32 rend = a.begin_offsets[pos + 1];
+    if (lbegin == lend || rbegin == rend) continue;
+    const float ralpha = alpha[a.begin_ids[rbegin]];
+
+    // Contribution each lnode makes = p(lnode) * (H(lnode) + log p(lnode))
+    // We have to normalise p(lnode) by the marginal contribution it makes
+    values.resize(lend - lbegin);
+    probs.resize(lend - lbegin);
+    for (uint32 j = lbegin; j < lend; ++j) {
+      const uint32 l = a.end_ids[j];
+      values[j - lbegin] = (inv_theta * a.score[l]) + alpha[l] - ralpha;
+    }
+    BatchExp(values.data(), values.size(), approximate_exp_, probs.data());
 
-        // We have to normalise p(lnode) by the marginal contribution it makes
-        const float lnode_transition_prob =
-            ((inv_theta * lnode->score) + alpha[lnode->node_id] -
-             alpha[rnode->node_id]);
-        H[rnode->node_id] += std::exp(lnode_transition_prob) *
-                             (H[lnode->node_id] + lnode_transition_prob);
-      }
+    float entropy = 0.0;
+    for (uint32 j = lbegin; j < lend; ++j) {
+      const size_t i = j - lbegin;
+      entropy += probs[i] * (H[a.end_ids[j]] + values[i]);
     }
+    for (uint32 k = rbegin; k < rend; ++k) H[a.begin_ids[k]] = entropy;
   }
 
-  return -H[begin_nodes_[len][0]->node_id];
+  return -H[a.begin_ids[a.begin_offsets[len]]];
 }
 
 namespace {
@@ -386,7 +652,7 @@ std::vector<Lattice::LatticePathWithScore> Lattice::NBest(size_t nbest_size,
   eos->next = nullptr;
   eos->gx = 0.0;
 
-  std::vector<float> alpha(node_allocator_.size(), 0.0);
+  std::vector<float> alpha(nodes_.size(), 0.0);
 
   if (sample) {
     // Run forwards algorithm to get normalising constants
@@ -508,80 +774,341 @@ std::vector<Lattice::LatticePathWithScore> Lattice::NBest(size_t nbest_size,
   return results;
 }
 
+namespace {
+
+// A partial path of Lattice::StochasticBeamSample() from `node` to EOS.
+struct BeamHypothesis {
+  Lattice::Node *node;  // The left-most node.
+  int32 next;           // Index of the hypothesis of the rest, -1 for EOS.
+  float gx;             // Log marginal of the paths through the partial one.
+  float fx;             // Perturbed score.
+};
+
+// Moves the hypotheses reachable from `frontier` to the front of `pool`,
+// keeping their order, and updates the indices of `frontier`.
+void CompactHypotheses(std::vector<BeamHypothesis> *pool,
+                       std::vector<int32> *frontier) {
+  std::vector<int32> new_index(pool->size(), -1);
+  for (const int32 index : *frontier) {
+    for (int32 i = index; i >= 0 && new_index[i] < 0; i = (*pool)[i].next) {
+      new_index[i] = 0;
+    }
+  }
+  int32 size = 0;
+  for (size_t i = 0; i < pool->size(); ++i) {
+    if (new_index[i] < 0) continue;
+    new_index[i] = size;
+    auto &hyp = (*pool)[size++];
+    hyp = (*pool)[i];
+    // `next` is always an older hypothesis, which is already moved.
+    if (hyp.next >= 0) hyp.next = new_index[hyp.next];
+  }
+  pool->resize(size);
+  for (auto &index : *frontier) index = new_index[index];
+}
+
+}  // namespace
+
+std::vector<Lattice::LatticePathWithScore> Lattice::StochasticBeamSample(
+    size_t num_samples, float theta, size_t max_hypotheses) {
+  if (num_samples < 1) return {};
+
+  // The perturbed scores follow Lattice::NBest(): the children of a
+  // hypothesis get Gumbel perturbations of their log marginals, truncated at
+  // the perturbed score of the parent.
+  const std::vector<float> alpha = ForwardAlgorithm(theta);
+  std::vector<BeamHypothesis> pool;
+  pool.reserve(std::min<size_t>(max_hypotheses, 1024));
+  pool.push_back({eos_node(), -1, 0.0, Gumbel()});
+  std::vector<int32> frontier = {0}, next_frontier;
+  std::vector<float> probs, perturbed;
+  size_t compact_size = std::max<size_t>(max_hypotheses, 1);
+
+  for (int pos = size(); pos >= 0; --pos) {
+    next_frontier.clear();
+    const auto lnodes = end_nodes(pos);
+    for (const int32 index : frontier) {
+      const BeamHypothesis top = pool[index];
+      if (top.node->pos != pos || top.node == bos_node()) {
+        next_frontier.push_back(index);
+        continue;
+      }
+      const float Z = alpha[top.node->node_id];
+      probs.resize(lnodes.size());
+      perturbed.resize(lnodes.size());
+      float max_score = -1e8;
+      for (size_t i = 0; i < lnodes.size(); ++i) {
+        const Node *lnode = lnodes[i];
+        probs[i] = top.gx + alpha[lnode->node_id] + theta * lnode->score - Z;
+        perturbed[i] = probs[i] + Gumbel();
+        max_score = std::max(max_score, perturbed[i]);
+      }
+      for (size_t i = 0; i < lnodes.size(); ++i) {
+        const float v = top.fx - perturbed[i] +
+                        std::log1p(-std::exp(perturbed[i] - max_score));
+        const float fx = top.fx - std::max(0.0f, v) -
+                         std::log1p(std::exp(-std::abs(v)));
+        next_frontier.push_back(static_cast<int32>(pool.size()));
+        pool.push_back({lnodes[i], index, probs[i], fx});
+      }
+    }
+
+    if (next_frontier.size() > num_samples) {
+      std::nth_element(next_frontier.begin(),
+                       next_frontier.begin() + num_samples - 1,
+                       next_frontier.end(), [&pool](int32 a, int32 b) {
+                         return pool[a].fx > pool[b].fx;
+                       });
+      next_frontier.resize(num_samples);
+    }
+    frontier.swap(next_frontier);
+
+    if (pool.size() > compact_size) {
+      CompactHypotheses(&pool, &frontier);
+      compact_size = std::max(compact_size, 2 * pool.size());
+    }
+  }
+
+  std::sort(frontier.begin(), frontier.end(), [&pool](int32 a, int32 b) {
+    return pool[a].fx > pool[b].fx;
+  });
+  std::vector<LatticePathWithScore> results;
+  for (const int32 index : frontier) {
+    if (pool[index].node != bos_node()) continue;
+    results.emplace_back();
+    for (int32 i = pool[index].next; pool[i].next >= 0; i = pool[i].next) {
+      results.back().first.push_back(pool[i].node);
+    }
+    results.back().second = pool[index].fx;
+  }
+  return results;
+}
+
+namespace {
+
+// One of the ranked paths ending at a node in Lattice::LazyNBest(). The path
+// is the `rank`-th best path ending at `prev`, followed by the node.
+struct Derivation {
+  uint32 prev;
+  uint32 rank;
+  float score;
+};
+
+struct DerivationLess {
+  bool operator()(const Derivation &d1, const Derivation &d2) const {
+    return d1.score < d2.score;
+  }
+};
+
+// The paths ending at a node enumerated so far, and the candidates of the
+// next one as a max-heap.
+struct KBestState {
+  std::vector<Derivation> best;
+  std::vector<Derivation> candidates;
+  bool initialized = false;
+  bool exhausted = false;
+  // True after the successor of best.back() has been added to candidates.
+  bool advanced = true;
+};
+
+}  // namespace
+
+std::vector<Lattice::LatticePathWithScore> Lattice::LazyNBest(
+    size_t nbest_size) {
+  if (nbest_size < 1) {
+    LOG(WARNING) << "nbest_size >= 1. Returns empty result.";
+    return {};
+  }
+
+  // Fills backtrace_score, which is the score of the best path ending at
+  // each node.
+  const auto viterbi = Viterbi();
+  if (size() > 0 && viterbi.first.empty()) return {};  // No path.
+  if (nbest_size == 1) return {viterbi};
+
+  std::vector<KBestState> states(nodes_.size());
+  const uint32 bos_id = bos_node()->node_id;
+  const uint32 eos_id = eos_node()->node_id;
+  states[bos_id].best.push_back({bos_id, 0, 0.0});
+  states[bos_id].initialized = true;
+  states[bos_id].exhausted = true;
+
+  // Computes the `size` best paths ending at EOS. Computing the next path
+  // ending at a node may require the next path ending at its predecessor,
+  // so the recursion is unrolled with a stack of (node_id, size) requests.
+  std::vector<std::pair<uint32, size_t>> stack = {{eos_id, nbest_size}};
+  while (!stack.empty()) {
+    const uint32 v = stack.back().first;
+    const size_t size = stack.back().second;
+    KBestState &state = states[v];
+    const Node *node = nodes_[v];
+
+    if (!state.initialized) {
+      for (const Node *lnode : end_nodes(node->pos)) {
+        state.candidates.push_back(
+            {static_cast<uint32>(lnode->node_id), 0,
+             lnode->backtrace_score + node->score});
+      }
+      std::make_heap(state.candidates.begin(), state.candidates.end(),
+                     DerivationLess());
+      state.initialized = true;
+    }
+
+    if (state.best.size() >= size || state.exhausted) {
+      stack.pop_back();
+      continue;
+    }
+
+    if (!state.advanced) {
+      // The successor of the last path is the next ranked path ending at
+      // the same predecessor.
+      const Derivation last = state.best.back();
+      const KBestState &prev_state = states[last.prev];
+      if (prev_state.best.size() < last.rank + 2 && !prev_state.exhausted) {
+        stack.emplace_back(last.prev, last.rank + 2);
+        continue;
+      }
+      if (prev_state.best.size() >= last.rank + 2) {
+        state.candidates.push_back(
+            {last.prev, last.rank + 1,
+             prev_state.best[last.rank + 1].score + node->score});
+        std::push_heap(state.candidates.begin(), state.candidates.end(),
+                       DerivationLess());
+      }
+      state.advanced = true;
+    }
+
+    if (state.candidates.empty()) {
+      state.exhausted = true;
+      continue;
+    }
+
+    // The initial candidates are scored with backtrace_score, and the best
+    // path ending at their predecessor is computed only when they are used.
+    const KBestState &top_state = states[state.candidates.front().prev];
+    if (top_state.best.empty() && !top_state.exhausted) {
+      stack.emplace_back(state.candidates.front().prev, 1);
+      continue;
+    }
+
+    std::pop_heap(state.candidates.begin(), state.candidates.end(),
+                  DerivationLess());
+    if (!top_state.best.empty()) {
+      state.best.push_back(state.candidates.back());
+      state.advanced = false;
+    }
+    state.candidates.pop_back();
+  }
+
+  std::vector<LatticePathWithScore> results;
+  for (const auto &derivation : states[eos_id].best) {
+    results.emplace_back();
+    auto &path = results.back().first;
+    uint32 prev = derivation.prev;
+    uint32 rank = derivation.rank;
+    while (prev != bos_id) {
+      path.push_back(nodes_[prev]);
+      const Derivation &d = states[prev].best[rank];
+      prev = d.prev;
+      rank = d.rank;
+    }
+    std::reverse(path.begin(), path.end());
+    results.back().second = derivation.score;
+  }
+
+  return results;
+}
+
 std::vector<Lattice::Node *> Lattice::Sample(float inv_theta) {
-  const int len = size();
-  if (len == 0) return {};
+  return std::move(Sample(inv_theta, 1)[0]);
+}
 
-  std::vector<float> alpha(node_allocator_.size(), 0.0);
+std::vector<std::vector<Lattice::Node *>> Lattice::Sample(float inv_theta,
+                                                          int num_samples) {
+  std::vector<std::vector<Node *>> samples(std::max(num_samples, 0));
+  const int len = size();
+  if (len == 0) return samples;
 
-  alpha = ForwardAlgorithm(inv_theta);
+  const std::vector<float> alpha = ForwardAlgorithm(inv_theta);
 
   auto *mt = random::GetRandomGenerator();
 
-  std::vector<Node *> results;
   std::vector<float> probs;
+  for (auto &results : samples) {
+    float Z = alpha[eos_node()->node_id];
+    Node *node = eos_node();
+    while (true) {
+      probs.clear();
+      for (const Node *lnode : end_nodes(node->pos)) {
+        probs.push_back(std::exp(static_cast<double>(
+            alpha[lnode->node_id] + inv_theta * lnode->score - Z)));
+      }
+      std::discrete_distribution<int> dist(probs.begin(), probs.end());
+      node = end_nodes(node->pos)[dist(*mt)];
+      if (node == bos_node()) break;
 
-  float Z = alpha[eos_node()->node_id];
-  Node *node = eos_node();
-  while (true) {
-    probs.clear();
-    for (const Node *lnode : end_nodes_[node->pos]) {
-      probs.push_back(std::exp(static_cast<double>(
-          alpha[lnode->node_id] + inv_theta * lnode->score - Z)));
+      Z = alpha[node->node_id];
+      results.push_back(node);
     }
-    std::discrete_distribution<int> dist(probs.begin(), probs.end());
-    node = end_nodes_[node->pos][dist(*mt)];
-    if (node == bos_node()) break;
 
-    Z = alpha[node->node_id];
-    results.push_back(node);
+    std::reverse(results.begin(), results.end());
   }
-
-  std::reverse(results.begin(), results.end());
-  return results;
+  return samples;
 }
 
 // Model::Model() {}
 // Model::~Model() {}
 
 void Model::PopulateNodes(Lattice *lattice) const {
-  auto get_chars_length = [&lattice](int begin_pos, const char *end) {
-    int pos = begin_pos;
-    while (lattice->surface(pos) < end) ++pos;
-    return pos - begin_pos;
-  };
+  PopulateNodes(lattice, nullptr);
+}
 
+void Model::PopulateNodes(Lattice *lattice, std::vector<NodeSpan> *spans,
+                          const VocabularyRestriction *restriction) const {
   const float unk_score = min_score() - kUnkPenalty;
 
   const int len = lattice->size();
-  const char *end = lattice->sentence() + lattice->utf8_size();
-
-  // +1 just in case.
-  std::vector<Darts::DoubleArray::result_pair_type> trie_results(
-      trie_results_size_ + 1);
+  const char *sentence = lattice->sentence();
+  const std::size_t size = lattice->utf8_size();
 
   for (int begin_pos = 0; begin_pos < len; ++begin_pos) {
     const char *begin = lattice->surface(begin_pos);
+    const int starts_at = begin - sentence;
+    const int mblen = lattice->surface(begin_pos + 1) - begin;
 
-    // Finds all pieces which are prefix of surface(begin_pos).
-    const size_t num_nodes = trie_->commonPrefixSearch(
-        begin, trie_results.data(), trie_results.size(),
-        static_cast<int>(end - begin));
-    CHECK_LT(num_nodes, trie_results.size());
+    // Finds all pieces which are prefix of surface(begin_pos) by walking
+    // the trie one byte at a time, as in EncodeOptimized(). The matches
+    // come in the order of their lengths, so their lengths in characters
+    // are counted incrementally.
+    std::size_t node_pos = 0;
+    std::size_t key_pos = starts_at;
+    const std::size_t key_end =
+        std::min<std::size_t>(size, starts_at + max_piece_size_);
+    int length = 0;
 
     bool has_single_node = false;
 
     // Inserts pieces to the lattice.
-    for (size_t k = 0; k < num_nodes; ++k) {
-      const int length =
-          get_chars_length(begin_pos, begin + trie_results[k].length);
-      const int id = trie_results[k].value;
-      if (IsUnusedInlined(id)) continue;
+    while (key_pos < key_end) {
+      const int id =
+          TraverseTrie(sentence, starts_at, mblen, &node_pos, &key_pos);
+      if (id == -2) break;
+      if (id < 0) continue;
+      while (lattice->surface(begin_pos + length) < sentence + key_pos) {
+        ++length;
+      }
+      const PieceAttributes &attributes = piece_attributes_[id];
+      if (attributes.unused) continue;
+      if (restriction != nullptr && restriction->IsUnused(id)) continue;
       Lattice::Node *node = lattice->Insert(begin_pos, length);
       node->id = id;  // the value of Trie stores vocab_id.
+      if (spans != nullptr) {
+        spans->push_back({static_cast<uint32>(begin_pos),
+                          static_cast<uint32>(length), id});
+      }
       // User defined symbol receives extra bonus to always be selected.
-      node->score = IsUserDefinedInlined(id) ? (length * max_score_ - 0.1)
-                                             : GetScoreInlined(id);
+      node->score = attributes.user_defined ? (length * max_score_ - 0.1)
+                                            : attributes.score;
       if (!has_single_node && node->length == 1) {
         has_single_node = true;
       }
@@ -595,14 +1122,100 @@ void Model::PopulateNodes(Lattice *lattice) const {
   }
 }
 
-int Model::PieceToId(absl::string_view piece) const {
-  auto it = reserved_id_map_.find(piece);
-  if (it != reserved_id_map_.end()) {
-    return it->second;
+void Model::PopulateNodes(const NodeSpan *begin, const NodeSpan *end,
+                          Lattice *lattice) const {
+  const float unk_score = min_score() - kUnkPenalty;
+  const int len = lattice->size();
+  for (int begin_pos = 0; begin_pos < len; ++begin_pos) {
+    bool has_single_node = false;
+    for (; begin != end && begin->pos == begin_pos; ++begin) {
+      if (begin->id < 0) continue;
+      const PieceAttributes &attributes = piece_attributes_[begin->id];
+      Lattice::Node *node = lattice->Insert(begin_pos, begin->length);
+      node->id = begin->id;
+      node->score = attributes.user_defined
+                        ? (begin->length * max_score_ - 0.1)
+                        : attributes.score;
+      if (begin->length == 1) has_single_node = true;
+    }
+
+    if (!has_single_node) {
+      Lattice::Node *node = lattice->Insert(begin_pos, 1);
+      node->id = unk_id_;  // add UNK node.
+      node->score = unk_score;
+    }
+  }
+}
+
+void Model::SetFirstCharTable(bool enable) {
+  first_char_table_.clear();
+  if (!enable || !status().ok() || trie_ == nullptr) {
+    first_char_table_.shrink_to_fit();
+    return;
+  }
+
+  // U+0000 is not in the table, as the trie does not handle NUL in keys.
+  // Surrogates are not valid in utf-8 and keep the empty entries.
+  first_char_table_.resize(0x10000);
+  char utf8[4];
+  for (char32 c = 1; c < first_char_table_.size(); ++c) {
+    if (c >= 0xD800 && c <= 0xDFFF) continue;
+    const size_t length = string_util::EncodeUTF8(c, utf8);
+    std::size_t node_pos = 0;
+    std::size_t key_pos = 0;
+    int ret = -1;
+    while (key_pos < length) {
+      ret = trie_->traverse(utf8, node_pos, key_pos, key_pos + 1);
+      if (ret == -2) break;
+    }
+    if (ret != -2) {
+      first_char_table_[c].node_pos = node_pos;
+      first_char_table_[c].value = ret;
+    }
+  }
+}
+
+namespace {
+// Decodes the character of `mblen` (1-3) bytes at `begin`. Returns 0 if the
+// bytes are not the shortest utf-8 form of a character in U+0001..U+FFFF
+// other than the surrogates.
+inline char32 DecodeFirstChar(const char *begin, int mblen) {
+  const auto *s = reinterpret_cast<const unsigned char *>(begin);
+  switch (mblen) {
+    case 1:
+      return s[0] < 0x80 ? s[0] : 0;
+    case 2: {
+      if ((s[1] & 0xC0) != 0x80) return 0;
+      const char32 c = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+      return c >= 0x80 ? c : 0;
+    }
+    case 3: {
+      if ((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return 0;
+      const char32 c =
+          ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+      return c >= 0x800 && (c < 0xD800 || c > 0xDFFF) ? c : 0;
+    }
+    default:
+      return 0;
+  }
+}
+}  // namespace
+
+inline int Model::TraverseTrie(const char *key, int starts_at, int mblen,
+                               std::size_t *node_pos,
+                               std::size_t *key_pos) const {
+  if (*key_pos == static_cast<std::size_t>(starts_at) &&
+      !first_char_table_.empty()) {
+    const char32 c = DecodeFirstChar(key + starts_at, mblen);
+    if (c != 0) {
+      const FirstCharEntry &entry = first_char_table_[c];
+      *key_pos += mblen;
+      if (entry.node_pos == 0) return -2;
+      *node_pos = entry.node_pos;
+      return entry.value;
+    }
   }
-  int id = 0;
-  trie_->exactMatchSearch(piece.data(), id, piece.size());
-  return id == -1 ? unk_id_ : id;
+  return trie_->traverse(key, *node_pos, *key_pos, *key_pos + 1);
 }
 
 void Model::BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces) {
@@ -643,17 +1256,83 @@ void Model::BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces) {
     trie_results_size_ = std::max(trie_results_size_, num_nodes);
   }
 
-  pieces_.clear();
-
   if (trie_results_size_ == 0)
     status_ = util::InternalError("no entry is found in the trie.");
+
+  InitializePieceAttributes();
+  SetFirstCharTable(GetPieceSize() >= kFirstCharTableMinVocabSize);
 }
 
-Model::Model(const ModelProto &model_proto) {
-  model_proto_ = &model_proto;
+void Model::InitializePieceAttributes() {
+  piece_attributes_.resize(model_proto_->pieces_size());
+  max_piece_size_ = 0;
+  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
+    const auto &sp = model_proto_->pieces(i);
+    piece_attributes_[i].score = sp.score();
+    piece_attributes_[i].unused =
+        sp.type() == ModelProto::SentencePiece::UNUSED;
+    piece_attributes_[i].user_defined =
+        sp.type() == ModelProto::SentencePiece::USER_DEFINED;
+    max_piece_size_ = std::max<int>(max_piece_size_, sp.piece().size());
+  }
+  // The quantized scores are copies of the old attributes.
+  ClearQuantizedScores();
+}
 
-  InitializePieces();
+util::Status Model::QuantizeScores(
+    const std::vector<absl::string_view> &calibration, float max_deviation,
+    float *deviation) {
+  RETURN_IF_ERROR(status());
+  ClearQuantizedScores();
+
+  // The user defined symbols are scored from max_score() instead.
+  float max_abs = std::max(std::fabs(min_score() - kUnkPenalty),
+                           std::fabs(max_score()));
+  for (const auto &attributes : piece_attributes_) {
+    if (!attributes.user_defined) {
+      max_abs = std::max(max_abs, std::fabs(attributes.score));
+    }
+  }
+  const float scale = max_abs > 0.0 ? 32767.0 / max_abs : 1.0;
+  decltype(quantized_attributes_) quantized(piece_attributes_.size());
+  for (size_t i = 0; i < piece_attributes_.size(); ++i) {
+    const PieceAttributes &attributes = piece_attributes_[i];
+    quantized[i].score = static_cast<int16>(std::max<long>(
+        -32767, std::min<long>(32767, std::lround(attributes.score * scale))));
+    quantized[i].unused = attributes.unused;
+    quantized[i].user_defined = attributes.user_defined;
+  }
+  quantized_attributes_ = std::move(quantized);
+  score_scale_ = scale;
+
+  float largest = 0.0;
+  std::vector<BestPathNode> float_path;
+  std::vector<QuantizedPathNode> quantized_path;
+  EncodeResult result;
+  for (const auto text : calibration) {
+    if (text.empty() || text.size() > kMaxQuantizedTextSize) continue;
+    EncodeOptimized(text, &float_path, &result);
+    EncodeQuantized(text, &quantized_path, &result);
+    largest = std::max(largest, float_path[text.size()].best_path_score -
+                                    QuantizedPathScore(text, quantized_path));
+  }
+  if (deviation != nullptr) *deviation = largest;
+  if (largest > max_deviation) {
+    ClearQuantizedScores();
+    return util::StatusBuilder(util::StatusCode::kFailedPrecondition)
+           << "The quantized scores lose " << largest
+           << " of the best path score, more than " << max_deviation << ".";
+  }
+  return util::OkStatus();
+}
+
+void Model::ClearQuantizedScores() {
+  quantized_attributes_.clear();
+  quantized_attributes_.shrink_to_fit();
+  score_scale_ = 0.0;
+}
 
+void Model::InitializeScores() {
   min_score_ = FLT_MAX;
   max_score_ = FLT_MIN;
   for (const auto &sp : model_proto_->pieces()) {
@@ -662,18 +1341,127 @@ Model::Model(const ModelProto &model_proto) {
       max_score_ = std::max(max_score_, sp.score());
     }
   }
+}
+
+Model::Model(const ModelProto &model_proto) {
+  model_proto_ = &model_proto;
+
+  InitializePieces();
+  InitializeScores();
 
   std::vector<std::pair<absl::string_view, int>> pieces;
-  for (const auto &it : pieces_) pieces.emplace_back(it.first, it.second);
+  for (int id = 0; id < static_cast<int>(piece_info_.size()); ++id) {
+    if (IsNormalPieceType(piece_info_[id].type)) {
+      pieces.emplace_back(*piece_info_[id].piece, id);
+    }
+  }
 
   BuildTrie(&pieces);
 }
 
+Model::Model(const ModelProto &model_proto, absl::string_view trie_blob) {
+  model_proto_ = &model_proto;
+
+  InitializePieces();
+  InitializeScores();
+  if (!status().ok()) return;
+
+  uint32_t trie_results_size = 0;
+  if (trie_blob.size() <= sizeof(trie_results_size) ||
+      trie_blob.size() % sizeof(uint32_t) != 0 ||
+      !string_util::DecodePOD<uint32_t>(
+          absl::string_view(trie_blob.data(), sizeof(trie_results_size)),
+          &trie_results_size)) {
+    status_ = util::InternalError("Blob for the precompiled trie is broken.");
+    return;
+  }
+  trie_blob.remove_prefix(sizeof(trie_results_size));
+
+  const void *array = trie_blob.data();
+#ifdef IS_BIG_ENDIAN
+  trie_results_size = util::Swap32(trie_results_size);
+  trie_buffer_.assign(trie_blob.data(), trie_blob.size());
+  uint32_t *data = reinterpret_cast<uint32_t *>(trie_buffer_.data());
+  for (int i = 0; i < trie_buffer_.size() / 4; ++i)
+    data[i] = util::Swap32(data[i]);
+  array = trie_buffer_.data();
+#else
+  if (reinterpret_cast<uintptr_t>(array) % alignof(uint32_t) != 0) {
+    trie_buffer_.assign(trie_blob.data(), trie_blob.size());
+    array = trie_buffer_.data();
+  }
+#endif
+
+  if (!IsValidDoubleArray(array, trie_blob.size() / sizeof(uint32_t),
+                          piece_info_.size())) {
+    status_ = util::InternalError("Blob for the precompiled trie is broken.");
+    return;
+  }
+  trie_ = std::make_unique<Darts::DoubleArray>();
+  trie_->set_array(array, trie_blob.size() / trie_->unit_size());
+  trie_in_blob_ = array == trie_blob.data();
+  trie_results_size_ = trie_results_size;
+
+  if (std::none_of(piece_info_.begin(), piece_info_.end(),
+                   [](const PieceInfo &info) {
+                     return IsNormalPieceType(info.type);
+                   })) {
+    status_ = util::InternalError("no pieces are loaded.");
+    return;
+  }
+
+  if (trie_results_size_ <= 0) {
+    status_ = util::InternalError("no entry is found in the trie.");
+    return;
+  }
+
+  // The trie must return exactly the ids of the model.
+  for (int expected = 0; expected < static_cast<int>(piece_info_.size());
+       ++expected) {
+    if (!IsNormalPieceType(piece_info_[expected].type)) continue;
+    const std::string &piece = *piece_info_[expected].piece;
+    int id = -1;
+    trie_->exactMatchSearch(piece.data(), id, piece.size());
+    if (id != expected) {
+      status_ = util::InternalError(
+          "The precompiled trie does not match the model.");
+      return;
+    }
+  }
+
+  InitializePieceAttributes();
+  SetFirstCharTable(GetPieceSize() >= kFirstCharTableMinVocabSize);
+}
+
+std::string Model::SerializeTrie() const {
+  if (!status().ok() || trie_ == nullptr) return "";
+
+  std::string blob = string_util::EncodePOD<uint32_t>(trie_results_size_);
+  blob.append(static_cast<const char *>(trie_->array()),
+              trie_->total_size());
+
+#ifdef IS_BIG_ENDIAN
+  uint32_t *data = reinterpret_cast<uint32_t *>(blob.data());
+  for (int i = 0; i < blob.size() / 4; ++i) data[i] = util::Swap32(data[i]);
+#endif
+
+  return blob;
+}
+
 Model::~Model() {}
 
 EncodeResult Model::Encode(absl::string_view normalized) const {
   if (encoder_version_ == EncoderVersion::kOptimized) {
-    return EncodeOptimized(normalized);
+    EncodeResult results;
+    if (has_quantized_scores() &&
+        normalized.size() <= kMaxQuantizedTextSize) {
+      std::vector<QuantizedPathNode> best_path_ends_at;
+      EncodeQuantized(normalized, &best_path_ends_at, &results);
+    } else {
+      std::vector<BestPathNode> best_path_ends_at;
+      EncodeOptimized(normalized, &best_path_ends_at, &results);
+    }
+    return results;
   }
 
   if (!status().ok() || normalized.empty()) {
@@ -685,15 +1473,42 @@ EncodeResult Model::Encode(absl::string_view normalized) const {
   PopulateNodes(&lattice);
 
   EncodeResult results;
-  for (const auto *node : lattice.Viterbi().first) {
-    results.emplace_back(node->piece, node->id);
-  }
+  AppendPath(lattice.Viterbi().first, unk_id_, !ByteFallbackEnabled(),
+             &results);
 
   return results;
 }
 
+namespace {
+// The lattice kept across the calls taking a scratch, so that its nodes and
+// work buffers are reused.
+class LatticeScratch : public EncodeScratch {
+ public:
+  explicit LatticeScratch(const ModelInterface *model) : EncodeScratch(model) {}
+  Lattice lattice;
+};
+
+// Returns the lattice of `scratch`, replacing the scratch of another model
+// or kind.
+Lattice *GetScratchLattice(const ModelInterface *model,
+                           std::unique_ptr<EncodeScratch> *scratch) {
+  if (*scratch == nullptr || (*scratch)->owner() != model ||
+      dynamic_cast<LatticeScratch *>(scratch->get()) == nullptr) {
+    *scratch = std::make_unique<LatticeScratch>(model);
+  }
+  return &static_cast<LatticeScratch *>(scratch->get())->lattice;
+}
+}  // namespace
+
 NBestEncodeResult Model::NBestEncode(absl::string_view normalized,
                                      int nbest_size) const {
+  std::unique_ptr<EncodeScratch> scratch;
+  return NBestEncodeWithScratch(normalized, nbest_size, &scratch);
+}
+
+NBestEncodeResult Model::NBestEncodeWithScratch(
+    absl::string_view normalized, int nbest_size,
+    std::unique_ptr<EncodeScratch> *scratch) const {
   if (!status().ok() || normalized.empty()) {
     return {{{}, 0.0}};
   }
@@ -704,12 +1519,15 @@ NBestEncodeResult Model::NBestEncode(absl::string_view normalized,
     return {std::pair<EncodeResult, float>(Encode(normalized), 0.0)};
   }
 
-  Lattice lattice;
+  Lattice &lattice = *GetScratchLattice(this, scratch);
   lattice.SetSentence(normalized);
   PopulateNodes(&lattice);
 
+  const auto nbests = encoder_version_ == EncoderVersion::kOptimized
+                          ? lattice.LazyNBest(nbest_size)
+                          : lattice.NBest(nbest_size, false, 0.0);
   NBestEncodeResult nbest_results;
-  for (const auto &nbest : lattice.NBest(nbest_size, false, 0.0)) {
+  for (const auto &nbest : nbests) {
     EncodeResult results;
     for (const auto *node : nbest.first) {
       results.emplace_back(node->piece, node->id);
@@ -726,6 +1544,13 @@ EncodeResult Model::SampleEncode(absl::string_view normalized,
     return {};
   }
 
+  if (encoder_version_ == EncoderVersion::kOptimized) {
+    EncodeResult results;
+    SampleBuffers buffers;
+    SampleEncodeOptimized(normalized, inv_theta, &buffers, &results);
+    return results;
+  }
+
   Lattice lattice;
   lattice.SetSentence(normalized);
   PopulateNodes(&lattice);
@@ -738,15 +1563,56 @@ EncodeResult Model::SampleEncode(absl::string_view normalized,
   return results;
 }
 
+std::vector<EncodeResult> Model::SampleEncodeMany(absl::string_view normalized,
+                                                  float inv_theta,
+                                                  int num_samples) const {
+  std::vector<EncodeResult> results(std::max(num_samples, 0));
+  if (!status().ok() || normalized.empty()) {
+    return results;
+  }
+
+  // The backward sums or the forward scores are computed once, and only
+  // the sampling pass runs per sample.
+  if (encoder_version_ == EncoderVersion::kOptimized) {
+    SampleBuffers buffers;
+    ComputeSampleSums(normalized, inv_theta, &buffers);
+    for (auto &result : results) {
+      SampleFromSums(normalized, inv_theta, buffers, &result);
+    }
+    return results;
+  }
+
+  Lattice lattice;
+  lattice.SetSentence(normalized);
+  PopulateNodes(&lattice);
+
+  const auto paths = lattice.Sample(inv_theta, results.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    for (const auto *node : paths[i]) {
+      results[i].emplace_back(node->piece, node->id);
+    }
+  }
+
+  return results;
+}
+
 NBestEncodeResult Model::SampleEncodeAndScore(absl::string_view normalized,
                                               float inv_theta, int samples,
                                               bool wor,
                                               bool include_best) const {
+  std::unique_ptr<EncodeScratch> scratch;
+  return SampleEncodeAndScoreWithScratch(normalized, inv_theta, samples, wor,
+                                         include_best, &scratch);
+}
+
+NBestEncodeResult Model::SampleEncodeAndScoreWithScratch(
+    absl::string_view normalized, float inv_theta, int samples, bool wor,
+    bool include_best, std::unique_ptr<EncodeScratch> *scratch) const {
   if (!status().ok() || normalized.empty()) {
     return {};
   }
   NBestEncodeResult results;
-  Lattice lattice;
+  Lattice &lattice = *GetScratchLattice(this, scratch);
   lattice.SetSentence(normalized);
   PopulateNodes(&lattice);
 
@@ -770,7 +1636,7 @@ NBestEncodeResult Model::SampleEncodeAndScore(absl::string_view normalized,
 
   if (wor) {
     // Draw k+1 samples as we need perturbed score of k+1th element
-    auto nbest_samples = lattice.NBest(samples + 1, true, inv_theta);
+    auto nbest_samples = lattice.StochasticBeamSample(samples + 1, inv_theta);
 
     if (include_best) {
       std::vector<std::vector<Lattice::Node *>> nbest_paths(
@@ -826,14 +1692,12 @@ NBestEncodeResult Model::SampleEncodeAndScore(absl::string_view normalized,
       }
     }
   } else {
-    while (results.size() < samples) {
-      Lattice lattice;
-      lattice.SetSentence(normalized);
-      PopulateNodes(&lattice);
-
+    // Sampling does not change the lattice, so all the samples are drawn
+    // with one forward pass over it.
+    const int remaining = std::max<int>(0, samples - results.size());
+    for (const auto &sample : lattice.Sample(inv_theta, remaining)) {
       float score = 0.0;
       EncodeResult result;
-      const std::vector<Lattice::Node *> sample = lattice.Sample(inv_theta);
       for (const auto *node : sample) {
         result.emplace_back(node->piece, node->id);
         score += (inv_theta * node->score);
@@ -854,6 +1718,17 @@ float Model::CalculateEntropy(absl::string_view normalized,
   return lattice.CalculateEntropy(inv_theta);
 }
 
+float Model::CalculateEntropyAndMarginals(
+    absl::string_view normalized, float inv_theta,
+    std::vector<std::pair<int, float>> *marginals,
+    std::unique_ptr<EncodeScratch> *scratch) const {
+  Lattice &lattice = *GetScratchLattice(this, scratch);
+  lattice.SetSentence(normalized);
+  PopulateNodes(&lattice);
+
+  return lattice.CalculateEntropy(inv_theta, marginals);
+}
+
 bool Model::VerifyOutputsEquivalent(absl::string_view expected,
                                     absl::string_view actual) const {
   auto compute_unigram_model_score =
@@ -886,7 +1761,117 @@ bool Model::VerifyOutputsEquivalent(absl::string_view expected,
   return true;
 }
 
-EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
+namespace {
+// Buffers kept across EncodeWithScratch() calls.
+class OptimizedEncodeScratch : public EncodeScratch {
+ public:
+  explicit OptimizedEncodeScratch(const ModelInterface *model)
+      : EncodeScratch(model) {}
+  std::vector<Model::BestPathNode> best_path_ends_at;
+  std::vector<Model::QuantizedPathNode> quantized_best_path_ends_at;
+  // The buffers of the lanes of EncodeInterleaved().
+  std::vector<std::vector<Model::BestPathNode>> lane_buffers;
+};
+}  // namespace
+
+void Model::EncodeWithScratch(absl::string_view normalized,
+                              EncodeResult *result,
+                              std::unique_ptr<EncodeScratch> *scratch) const {
+  EncodeWithRestriction(normalized, nullptr, result, scratch);
+}
+
+void Model::EncodeRestricted(absl::string_view normalized,
+                             const VocabularyRestriction &restriction,
+                             EncodeResult *result,
+                             std::unique_ptr<EncodeScratch> *scratch) const {
+  EncodeWithRestriction(normalized, &restriction, result, scratch);
+}
+
+void Model::EncodeWithRestriction(
+    absl::string_view normalized, const VocabularyRestriction *restriction,
+    EncodeResult *result, std::unique_ptr<EncodeScratch> *scratch) const {
+  if (encoder_version_ != EncoderVersion::kOptimized) {
+    if (restriction == nullptr) {
+      *result = Encode(normalized);
+      return;
+    }
+    result->clear();
+    if (!status().ok() || normalized.empty()) return;
+    Lattice lattice;
+    lattice.SetSentence(normalized);
+    PopulateNodes(&lattice, nullptr, restriction);
+    AppendPath(lattice.Viterbi().first, unk_id_, !ByteFallbackEnabled(),
+               result);
+    return;
+  }
+  if (*scratch == nullptr || (*scratch)->owner() != this) {
+    *scratch = std::make_unique<OptimizedEncodeScratch>(this);
+  }
+  auto *buffers = static_cast<OptimizedEncodeScratch *>(scratch->get());
+  if (has_quantized_scores() && normalized.size() <= kMaxQuantizedTextSize) {
+    EncodeQuantized(normalized, &buffers->quantized_best_path_ends_at, result,
+                    restriction);
+    return;
+  }
+  EncodeOptimized(normalized, &buffers->best_path_ends_at, result,
+                  restriction);
+}
+
+void Model::RelocateTables(bool huge_pages) {
+  if (!status().ok() || trie_ == nullptr) return;
+  const auto *units = static_cast<const uint32 *>(trie_->array());
+  decltype(trie_units_) trie_units(
+      units, units + trie_->size(),
+      placement::TableAllocator<uint32>(huge_pages));
+  // set_array() releases the array built by the trie, if any.
+  trie_->set_array(trie_units.data(), trie_units.size());
+  trie_units_ = std::move(trie_units);
+  trie_buffer_.clear();
+  trie_buffer_.shrink_to_fit();
+  trie_in_blob_ = false;
+
+  piece_attributes_ = decltype(piece_attributes_)(
+      piece_attributes_.begin(), piece_attributes_.end(),
+      placement::TableAllocator<PieceAttributes>(huge_pages));
+  quantized_attributes_ = decltype(quantized_attributes_)(
+      quantized_attributes_.begin(), quantized_attributes_.end(),
+      placement::TableAllocator<QuantizedAttributes>(huge_pages));
+  first_char_table_ = decltype(first_char_table_)(
+      first_char_table_.begin(), first_char_table_.end(),
+      placement::TableAllocator<FirstCharEntry>(huge_pages));
+}
+
+void Model::GetMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::GetMemoryUsage(usage);
+  if (trie_ != nullptr && !trie_in_blob_) {
+    usage->model_tables += trie_->total_size();
+  }
+  usage->model_tables += port::VectorBytes(piece_attributes_) +
+                         port::VectorBytes(quantized_attributes_) +
+                         port::VectorBytes(first_char_table_);
+}
+
+void Model::EncodeMany(const std::vector<absl::string_view> &normalized,
+                       std::vector<EncodeResult> *results,
+                       std::unique_ptr<EncodeScratch> *scratch) const {
+  // The interleaved encoder reads the float scores.
+  if (encoder_version_ != EncoderVersion::kOptimized ||
+      word_cache() != nullptr || frequent_word_table() != nullptr ||
+      shared_word_cache() != nullptr || has_quantized_scores()) {
+    ModelInterface::EncodeMany(normalized, results, scratch);
+    return;
+  }
+  if (*scratch == nullptr || (*scratch)->owner() != this) {
+    *scratch = std::make_unique<OptimizedEncodeScratch>(this);
+  }
+  auto *buffers = static_cast<OptimizedEncodeScratch *>(scratch->get());
+  EncodeInterleaved(normalized, &buffers->lane_buffers, results);
+}
+
+void Model::EncodeOptimized(absl::string_view normalized,
+                            std::vector<BestPathNode> *best_path_ends_buffer,
+                            EncodeResult *results,
+                            const VocabularyRestriction *restriction) const {
   // An optimized Viterbi algorithm for unigram language models. Benchmarking
   // results show that it generates almost identical outputs and achieves 2.1x
   // speedup on average for 102 languages compared to the original
@@ -939,22 +1924,15 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
   // `Lattice::Node` used by the original encoder, but here in the optimized
   // encoder we only need to define 3 fields in `BestPathNode`.
 
+  results->clear();
   if (!status().ok() || normalized.empty()) {
-    return {};
+    return;
   }
-  // Represents the last node of the best path.
-  struct BestPathNode {
-    int id = -1;  // The vocab id. (maybe -1 for UNK)
-    float best_path_score =
-        0;  // The total score of the best path ending at this node.
-    int starts_at =
-        -1;  // The starting position (in utf-8) of this node. The entire best
-             // path can be constructed by backtracking along this link.
-  };
   const int size = normalized.size();
   const float unk_score = min_score() - kUnkPenalty;
-  // The ends are exclusive.
-  std::vector<BestPathNode> best_path_ends_at(size + 1);
+  // The ends are exclusive. assign() keeps the capacity of a reused buffer.
+  best_path_ends_buffer->assign(size + 1, BestPathNode());
+  auto &best_path_ends_at = *best_path_ends_buffer;
   // Generate lattice on-the-fly (not stored) and update best_path_ends_at.
   int starts_at = 0;
   while (starts_at < size) {
@@ -966,19 +1944,24 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
     const int mblen =
         std::min<int>(string_util::OneCharLen(normalized.data() + starts_at),
                       size - starts_at);
-    while (key_pos < size) {
-      const int ret =
-          trie_->traverse(normalized.data(), node_pos, key_pos, key_pos + 1);
+    // No piece is longer than max_piece_size_.
+    const std::size_t key_end =
+        std::min<std::size_t>(size, starts_at + max_piece_size_);
+    while (key_pos < key_end) {
+      const int ret = TraverseTrie(normalized.data(), starts_at, mblen,
+                                   &node_pos, &key_pos);
       if (ret == -2) break;
       if (ret >= 0) {
-        if (IsUnusedInlined(ret)) continue;
+        const PieceAttributes &attributes = piece_attributes_[ret];
+        if (attributes.unused) continue;
+        if (restriction != nullptr && restriction->IsUnused(ret)) continue;
         // Update the best path node.
         auto &target_node = best_path_ends_at[key_pos];
         const auto length = (key_pos - starts_at);
         // User defined symbol receives extra bonus to always be selected.
-        const auto score = IsUserDefinedInlined(ret)
+        const auto score = attributes.user_defined
                                ? (length * max_score_ - 0.1)
-                               : GetScoreInlined(ret);
+                               : attributes.score;
         const auto candidate_best_path_score =
             score + best_path_score_till_here;
         if (target_node.starts_at == -1 ||
@@ -1006,17 +1989,641 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
     // Move by one unicode character.
     starts_at += mblen;
   }
-  // Backtrack to identify the best path.
-  EncodeResult results;
-  int ends_at = size;
+  BacktrackBestPath(normalized, best_path_ends_at, results);
+}
+
+void Model::EncodeQuantized(
+    absl::string_view normalized,
+    std::vector<QuantizedPathNode> *best_path_ends_buffer,
+    EncodeResult *results, const VocabularyRestriction *restriction) const {
+  // The loops of EncodeOptimized(), with the sums in int32. A text of
+  // kMaxQuantizedTextSize bytes adds at most one piece per byte, each of
+  // about 2^15 or less, so the sums do not overflow.
+  results->clear();
+  if (!status().ok() || normalized.empty()) {
+    return;
+  }
+  const int size = normalized.size();
+  const int32 unk_score =
+      std::lround((min_score() - kUnkPenalty) * score_scale_);
+  best_path_ends_buffer->assign(size + 1, QuantizedPathNode());
+  auto &best_path_ends_at = *best_path_ends_buffer;
+  auto update = [](QuantizedPathNode *target_node, int id, int32 score,
+                   int starts_at) {
+    if (target_node->starts_at == -1 ||
+        score > target_node->best_path_score) {
+      target_node->best_path_score = score;
+      target_node->starts_at = starts_at;
+      target_node->id = id;
+    }
+  };
+  int starts_at = 0;
+  while (starts_at < size) {
+    std::size_t node_pos = 0;
+    std::size_t key_pos = starts_at;
+    const int32 best_path_score_till_here =
+        best_path_ends_at[starts_at].best_path_score;
+    bool has_single_node = false;
+    const int mblen =
+        std::min<int>(string_util::OneCharLen(normalized.data() + starts_at),
+                      size - starts_at);
+    const std::size_t key_end =
+        std::min<std::size_t>(size, starts_at + max_piece_size_);
+    while (key_pos < key_end) {
+      const int ret = TraverseTrie(normalized.data(), starts_at, mblen,
+                                   &node_pos, &key_pos);
+      if (ret == -2) break;
+      if (ret < 0) continue;
+      const QuantizedAttributes &attributes = quantized_attributes_[ret];
+      if (attributes.unused) continue;
+      if (restriction != nullptr && restriction->IsUnused(ret)) continue;
+      const auto length = (key_pos - starts_at);
+      const int32 score =
+          attributes.user_defined
+              ? std::lround((length * max_score_ - 0.1) * score_scale_)
+              : attributes.score;
+      update(&best_path_ends_at[key_pos], ret,
+             score + best_path_score_till_here, starts_at);
+      if (length == mblen) has_single_node = true;
+    }
+    if (!has_single_node) {
+      update(&best_path_ends_at[starts_at + mblen], unk_id_,
+             unk_score + best_path_score_till_here, starts_at);
+    }
+    starts_at += mblen;
+  }
+  BacktrackBestPath(normalized, best_path_ends_at, results);
+}
+
+float Model::QuantizedPathScore(
+    absl::string_view normalized,
+    const std::vector<QuantizedPathNode> &best_path_ends_at) const {
+  float score = 0.0;
+  for (int ends_at = normalized.size(); ends_at > 0;) {
+    const auto &node = best_path_ends_at[ends_at];
+    if (node.id == unk_id_) {
+      score += min_score() - kUnkPenalty;
+    } else if (piece_attributes_[node.id].user_defined) {
+      score += (ends_at - node.starts_at) * max_score_ - 0.1;
+    } else {
+      score += piece_attributes_[node.id].score;
+    }
+    ends_at = node.starts_at;
+  }
+  return score;
+}
+
+template <typename Node>
+void Model::BacktrackBestPath(absl::string_view normalized,
+                              const std::vector<Node> &best_path_ends_at,
+                              EncodeResult *results) const {
+  // Backtrack to identify the best path. A run of unknown characters
+  // becomes one piece, as SentencePieceProcessor merges it anyway, unless
+  // each unknown character is decomposed into its bytes.
+  const bool merge_unknowns = !ByteFallbackEnabled();
+  int ends_at = normalized.size();
   while (ends_at > 0) {
     const auto &node = best_path_ends_at[ends_at];
-    results.emplace_back(
-        normalized.substr(node.starts_at, ends_at - node.starts_at), node.id);
+    if (merge_unknowns && node.id == unk_id_ && !results->empty() &&
+        results->back().second == unk_id_) {
+      auto &run = results->back().first;
+      run = absl::string_view(normalized.data() + node.starts_at,
+                              run.size() + ends_at - node.starts_at);
+    } else {
+      results->emplace_back(
+          normalized.substr(node.starts_at, ends_at - node.starts_at),
+          node.id);
+    }
     ends_at = node.starts_at;
   }
-  std::reverse(results.begin(), results.end());
-  return results;
+  std::reverse(results->begin(), results->end());
+}
+
+void Model::EncodeInterleaved(const std::vector<absl::string_view> &normalized,
+                              std::vector<std::vector<BestPathNode>> *buffers,
+                              std::vector<EncodeResult> *results) const {
+  results->resize(normalized.size());
+  for (auto &result : *results) result.clear();
+  if (!status().ok()) return;
+
+  // The state of the Viterbi search of one text, which is the state of the
+  // loops of EncodeOptimized().
+  struct Lane {
+    size_t index = 0;
+    absl::string_view text;
+    std::vector<BestPathNode> *best_path_ends_at = nullptr;
+    int starts_at = 0;
+    int mblen = 0;
+    std::size_t key_end = 0;
+    std::size_t node_pos = 0;
+    std::size_t key_pos = 0;
+    float best_path_score_till_here = 0;
+    bool has_single_node = false;
+  };
+
+  const auto *units = static_cast<const uint32 *>(trie_->array());
+  const float unk_score = min_score() - kUnkPenalty;
+
+  // Starts the traversals from `lane->starts_at`.
+  auto start_position = [&](Lane *lane) {
+    const int size = lane->text.size();
+    const char *begin = lane->text.data() + lane->starts_at;
+    lane->mblen = std::min<int>(string_util::OneCharLen(begin),
+                                size - lane->starts_at);
+    lane->key_end =
+        std::min<std::size_t>(size, lane->starts_at + max_piece_size_);
+    lane->node_pos = 0;
+    lane->key_pos = lane->starts_at;
+    lane->best_path_score_till_here =
+        (*lane->best_path_ends_at)[lane->starts_at].best_path_score;
+    lane->has_single_node = false;
+    // The first transition reads first_char_table_ when the character is
+    // in the table, as in TraverseTrie().
+    const char32 c = first_char_table_.empty()
+                         ? 0
+                         : DecodeFirstChar(begin, lane->mblen);
+    if (c != 0) {
+      Prefetch(&first_char_table_[c]);
+    } else {
+      PrefetchTrieUnit(units, 0, *begin);
+    }
+  };
+
+  // Starts the next non-empty text in `lane`. Returns false if no text is
+  // left.
+  size_t next = 0;
+  auto start_text = [&](Lane *lane) {
+    while (next < normalized.size() && normalized[next].empty()) ++next;
+    if (next == normalized.size()) return false;
+    lane->index = next;
+    lane->text = normalized[next++];
+    lane->best_path_ends_at->assign(lane->text.size() + 1, BestPathNode());
+    lane->starts_at = 0;
+    start_position(lane);
+    return true;
+  };
+
+  // `score` is compared in its own type, as in EncodeOptimized().
+  auto update = [](BestPathNode *target_node, int id, auto score,
+                   int starts_at) {
+    if (target_node->starts_at == -1 ||
+        score > target_node->best_path_score) {
+      target_node->best_path_score = score;
+      target_node->starts_at = starts_at;
+      target_node->id = id;
+    }
+  };
+
+  buffers->resize(kInterleavedLanes);
+  Lane lanes[kInterleavedLanes];
+  int num_lanes = 0;
+  while (num_lanes < kInterleavedLanes) {
+    lanes[num_lanes].best_path_ends_at = &(*buffers)[num_lanes];
+    if (!start_text(&lanes[num_lanes])) break;
+    ++num_lanes;
+  }
+
+  while (num_lanes > 0) {
+    for (int l = 0; l < num_lanes;) {
+      Lane &lane = lanes[l];
+      auto &best_path_ends_at = *lane.best_path_ends_at;
+      if (lane.key_pos < lane.key_end) {
+        // One transition of the inner loop of EncodeOptimized().
+        const int ret = TraverseTrie(lane.text.data(), lane.starts_at,
+                                     lane.mblen, &lane.node_pos, &lane.key_pos);
+        if (ret != -2) {
+          if (ret >= 0 && !piece_attributes_[ret].unused) {
+            const PieceAttributes &attributes = piece_attributes_[ret];
+            const auto length = (lane.key_pos - lane.starts_at);
+            // User defined symbol receives extra bonus to always be selected.
+            const auto score = attributes.user_defined
+                                   ? (length * max_score_ - 0.1)
+                                   : attributes.score;
+            update(&best_path_ends_at[lane.key_pos], ret,
+                   score + lane.best_path_score_till_here, lane.starts_at);
+            if (length == lane.mblen) lane.has_single_node = true;
+          }
+          if (lane.key_pos < lane.key_end) {
+            PrefetchTrieUnit(units, lane.node_pos,
+                             lane.text[lane.key_pos]);
+            ++l;
+            continue;
+          }
+        }
+      }
+
+      // All the pieces starting at `starts_at` are visited.
+      if (!lane.has_single_node) {
+        update(&best_path_ends_at[lane.starts_at + lane.mblen], unk_id_,
+               unk_score + lane.best_path_score_till_here, lane.starts_at);
+      }
+      lane.starts_at += lane.mblen;
+      if (lane.starts_at < static_cast<int>(lane.text.size())) {
+        start_position(&lane);
+        ++l;
+        continue;
+      }
+
+      BacktrackBestPath(lane.text, best_path_ends_at,
+                        &(*results)[lane.index]);
+      if (start_text(&lane)) {
+        ++l;
+      } else {
+        // The last lane takes the place of the finished one.
+        lane = lanes[--num_lanes];
+      }
+    }
+  }
+}
+
+template <typename Func>
+void Model::ForEachNode(absl::string_view normalized, int starts_at,
+                        Func func) const {
+  const int size = normalized.size();
+  auto char_len = [&](int pos) {
+    return std::min<int>(string_util::OneCharLen(normalized.data() + pos),
+                         size - pos);
+  };
+  std::size_t node_pos = 0;
+  std::size_t key_pos = starts_at;
+  bool has_single_node = false;
+  const int mblen = char_len(starts_at);
+  const std::size_t key_end =
+      std::min<std::size_t>(size, starts_at + max_piece_size_);
+  while (key_pos < key_end) {
+    const int ret = TraverseTrie(normalized.data(), starts_at, mblen,
+                                 &node_pos, &key_pos);
+    if (ret == -2) break;
+    if (ret < 0 || piece_attributes_[ret].unused) continue;
+    float score = piece_attributes_[ret].score;
+    if (piece_attributes_[ret].user_defined) {
+      // User defined symbol receives extra bonus to always be selected.
+      // As in PopulateNodes(), the length is in characters.
+      int length = 0;
+      for (int pos = starts_at; pos < key_pos; pos += char_len(pos)) {
+        ++length;
+      }
+      score = length * max_score_ - 0.1;
+    }
+    func(static_cast<int>(key_pos), ret, score);
+    if (key_pos - starts_at == mblen) has_single_node = true;
+  }
+  if (!has_single_node) {
+    func(starts_at + mblen, unk_id_, min_score() - kUnkPenalty);
+  }
+}
+
+void Model::SampleEncodeOptimized(absl::string_view normalized,
+                                  float inv_theta, SampleBuffers *buffers,
+                                  EncodeResult *results) const {
+  results->clear();
+  if (!status().ok() || normalized.empty()) {
+    return;
+  }
+  ComputeSampleSums(normalized, inv_theta, buffers);
+  SampleFromSums(normalized, inv_theta, *buffers, results);
+}
+
+void Model::ComputeSampleSums(absl::string_view normalized, float inv_theta,
+                              SampleBuffers *buffers) const {
+  const int size = normalized.size();
+
+  // Returns the length of the character at `pos`.
+  auto char_len = [&](int pos) {
+    return std::min<int>(string_util::OneCharLen(normalized.data() + pos),
+                         size - pos);
+  };
+
+  // beta[pos] is the log-sum of the (inv_theta scaled) scores of all the
+  // paths from `pos` to the end. Only character boundaries are filled.
+  auto &b = buffers->beta;
+  auto &char_starts = buffers->char_starts;
+  b.assign(size + 1, 0.0);
+  char_starts.clear();
+  for (int pos = 0; pos < size; pos += char_len(pos)) {
+    char_starts.push_back(pos);
+  }
+  for (auto it = char_starts.rbegin(); it != char_starts.rend(); ++it) {
+    float vmax = -std::numeric_limits<float>::infinity();
+    double sum = 0.0;
+    ForEachNode(normalized, *it, [&](int ends_at, int, float score) {
+      const float v = inv_theta * score + b[ends_at];
+      if (v > vmax) {
+        sum = sum * std::exp(static_cast<double>(vmax - v)) + 1.0;
+        vmax = v;
+      } else {
+        sum += std::exp(static_cast<double>(v - vmax));
+      }
+    });
+    b[*it] = vmax + std::log(sum);
+  }
+}
+
+void Model::SampleFromSums(absl::string_view normalized, float inv_theta,
+                           const SampleBuffers &buffers,
+                           EncodeResult *results) const {
+  results->clear();
+  const int size = normalized.size();
+  const auto &b = buffers.beta;
+
+  // Samples the nodes from left to right. The probability of a node
+  // [starts_at, ends_at) is exp(inv_theta * score + beta[ends_at]) /
+  // exp(beta[starts_at]).
+  auto *mt = random::GetRandomGenerator();
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  int starts_at = 0;
+  while (starts_at < size) {
+    const double r = dist(*mt);
+    double cumulative = 0.0;
+    int sampled_ends_at = -1;
+    int sampled_id = -1;
+    ForEachNode(normalized, starts_at, [&](int ends_at, int id, float score) {
+      if (sampled_ends_at >= 0 && cumulative > r) return;
+      cumulative += std::exp(static_cast<double>(
+          inv_theta * score + b[ends_at] - b[starts_at]));
+      sampled_ends_at = ends_at;
+      sampled_id = id;
+    });
+    results->emplace_back(
+        normalized.substr(starts_at, sampled_ends_at - starts_at), sampled_id);
+    starts_at = sampled_ends_at;
+  }
+}
+
+bool Model::EncodeTwoBest(absl::string_view normalized,
+                          TwoBestBuffers *buffers, EncodeResult *best,
+                          EncodeResult *second) const {
+  best->clear();
+  second->clear();
+  if (!status().ok()) return false;
+  const int size = normalized.size();
+
+  using Path = TwoBestBuffers::Path;
+  constexpr float kMinusInf = -std::numeric_limits<float>::infinity();
+  auto &paths = buffers->paths;
+  paths.assign(2 * (size + 1), Path{kMinusInf, -1, -1, -1});
+  paths[0].score = 0.0;
+
+  // Every node extends the two best paths ending where it begins. The
+  // candidates are distinct paths, so the two best of them at each
+  // position are the two best paths ending there.
+  for (int starts_at = 0; starts_at < size;
+       starts_at += std::min<int>(
+           string_util::OneCharLen(normalized.data() + starts_at),
+           size - starts_at)) {
+    const Path *prevs = &paths[2 * starts_at];
+    ForEachNode(normalized, starts_at, [&](int ends_at, int id, float score) {
+      Path *top = &paths[2 * ends_at];
+      for (int rank = 0; rank < 2 && prevs[rank].score > kMinusInf; ++rank) {
+        const Path path = {prevs[rank].score + score, id, starts_at, rank};
+        if (path.score > top[0].score) {
+          top[1] = top[0];
+          top[0] = path;
+        } else if (path.score > top[1].score) {
+          top[1] = path;
+        }
+      }
+    });
+  }
+
+  auto backtrack = [&](int rank, EncodeResult *results) {
+    for (int ends_at = size; ends_at > 0;) {
+      const Path &path = paths[2 * ends_at + rank];
+      results->emplace_back(
+          normalized.substr(path.starts_at, ends_at - path.starts_at),
+          path.id);
+      rank = path.prev_rank;
+      ends_at = path.starts_at;
+    }
+    std::reverse(results->begin(), results->end());
+  };
+  backtrack(0, best);
+  if (paths[2 * size + 1].score == kMinusInf) return false;
+  backtrack(1, second);
+  return true;
+}
+
+void Model::PopulateForward(absl::string_view normalized,
+                            MarginalBuffers *buffers,
+                            std::vector<NodeSpan> *spans) const {
+  PopulateForward(normalized, false, nullptr, nullptr, spans, buffers);
+}
+
+void Model::PopulateForward(absl::string_view normalized,
+                            const NodeSpan *begin, const NodeSpan *end,
+                            MarginalBuffers *buffers) const {
+  PopulateForward(normalized, true, begin, end, nullptr, buffers);
+}
+
+void Model::PopulateForward(absl::string_view normalized, bool cached,
+                            const NodeSpan *begin, const NodeSpan *end,
+                            std::vector<NodeSpan> *spans,
+                            MarginalBuffers *buffers) const {
+  const float unk_score = min_score() - kUnkPenalty;
+  const char *sentence = normalized.data();
+  const int size = normalized.size();
+
+  // The character boundaries, as in Lattice::SetSentence().
+  auto &char_starts = buffers->char_starts;
+  char_starts.clear();
+  for (int pos = 0; pos < size;) {
+    char_starts.push_back(pos);
+    pos += std::min<int>(string_util::OneCharLen(sentence + pos), size - pos);
+  }
+  char_starts.push_back(size);
+  const int len = buffers->size();
+
+  auto &nodes = buffers->nodes;
+  auto &scores = buffers->scores;
+  auto &node_offsets = buffers->node_offsets;
+  auto &alpha = buffers->alpha;
+  auto &sums = buffers->sums;
+  auto &best_scores = buffers->best_scores;
+  auto &best_sizes = buffers->best_sizes;
+  nodes.clear();
+  scores.clear();
+  node_offsets.clear();
+
+  // Until the position is reached, alpha[pos] is the maximum of the scores
+  // of the paths ending there so far and sums[pos] is the sum of their
+  // exp(score - alpha[pos]), so one exp() is computed per node.
+  constexpr float kMinusInf = -std::numeric_limits<float>::infinity();
+  alpha.assign(len + 1, kMinusInf);
+  sums.assign(len + 1, 0.0);
+  best_scores.assign(len + 1, kMinusInf);
+  best_sizes.assign(len + 1, 0);
+  alpha[0] = 0.0;
+  sums[0] = 1.0;
+  best_scores[0] = 0.0;
+
+  int begin_pos = 0;
+  auto add_node = [&](int length, int id, float score) {
+    nodes.push_back({static_cast<uint32>(begin_pos),
+                     static_cast<uint32>(length), id});
+    scores.push_back(score);
+    const int end_pos = begin_pos + length;
+    const float v = alpha[begin_pos] + score;
+    if (v > alpha[end_pos]) {
+      sums[end_pos] =
+          sums[end_pos] * std::exp(static_cast<double>(alpha[end_pos] - v)) +
+          1.0;
+      alpha[end_pos] = v;
+    } else {
+      sums[end_pos] += std::exp(static_cast<double>(v - alpha[end_pos]));
+    }
+    // The first of the best paths wins, as in Lattice::Viterbi().
+    const float best_score = best_scores[begin_pos] + score;
+    if (best_score > best_scores[end_pos]) {
+      best_scores[end_pos] = best_score;
+      best_sizes[end_pos] = best_sizes[begin_pos] + 1;
+    }
+  };
+
+  for (; begin_pos < len; ++begin_pos) {
+    // All the nodes ending here have been added.
+    alpha[begin_pos] += std::log(sums[begin_pos]);
+    node_offsets.push_back(nodes.size());
+    bool has_single_node = false;
+
+    if (cached) {
+      for (; begin != end && begin->pos == begin_pos; ++begin) {
+        if (begin->id < 0) continue;
+        const PieceAttributes &attributes = piece_attributes_[begin->id];
+        add_node(begin->length, begin->id,
+                 attributes.user_defined ? (begin->length * max_score_ - 0.1)
+                                         : attributes.score);
+        if (begin->length == 1) has_single_node = true;
+      }
+    } else {
+      // Walks the trie as in PopulateNodes().
+      const int starts_at = char_starts[begin_pos];
+      const int mblen = char_starts[begin_pos + 1] - starts_at;
+      std::size_t node_pos = 0;
+      std::size_t key_pos = starts_at;
+      const std::size_t key_end =
+          std::min<std::size_t>(size, starts_at + max_piece_size_);
+      int length = 0;
+      while (key_pos < key_end) {
+        const int id =
+            TraverseTrie(sentence, starts_at, mblen, &node_pos, &key_pos);
+        if (id == -2) break;
+        if (id < 0) continue;
+        while (char_starts[begin_pos + length] < key_pos) ++length;
+        const PieceAttributes &attributes = piece_attributes_[id];
+        if (attributes.unused) continue;
+        if (spans != nullptr) {
+          spans->push_back({static_cast<uint32>(begin_pos),
+                            static_cast<uint32>(length), id});
+        }
+        // User defined symbol receives extra bonus to always be selected.
+        add_node(length, id,
+                 attributes.user_defined ? (length * max_score_ - 0.1)
+                                         : attributes.score);
+        if (length == 1) has_single_node = true;
+      }
+    }
+
+    if (!has_single_node) add_node(1, unk_id_, unk_score);
+  }
+  alpha[len] += std::log(sums[len]);
+  node_offsets.push_back(nodes.size());
+}
+
+template <typename Add>
+float Model::MarginalBuffers::ForEachMarginal(Add add) {
+  const int len = size();
+  const float Z = alpha[len];
+
+  // The nodes beginning at a position are visited after all the ones
+  // beginning later, so beta of their end positions is known, and their
+  // marginals are added in the same sweep as beta is computed.
+  beta.resize(len + 1);
+  beta[len] = 0.0;
+  for (int pos = len - 1; pos >= 0; --pos) {
+    float vmax = -std::numeric_limits<float>::infinity();
+    double sum = 0.0;
+    for (uint32 k = node_offsets[pos]; k < node_offsets[pos + 1]; ++k) {
+      const float v = scores[k] + beta[pos + nodes[k].length];
+      add(nodes[k].id, std::exp(static_cast<double>(alpha[pos] + v - Z)));
+      if (v > vmax) {
+        sum = sum * std::exp(static_cast<double>(vmax - v)) + 1.0;
+        vmax = v;
+      } else {
+        sum += std::exp(static_cast<double>(v - vmax));
+      }
+    }
+    beta[pos] = vmax + std::log(sum);
+  }
+
+  return Z;
+}
+
+float Model::MarginalBuffers::PopulateMarginal(float freq,
+                                               std::vector<float> *expected) {
+  if (expected == nullptr) return 0.0;
+  const float Z = ForEachMarginal(
+      [&](int id, double prob) { (*expected)[id] += freq * prob; });
+  return freq * Z;
+}
+
+float Model::MarginalBuffers::PopulateMarginal(float freq,
+                                               std::vector<double> *expected) {
+  if (expected == nullptr) return 0.0;
+  const float Z = ForEachMarginal(
+      [&](int id, double prob) { (*expected)[id] += freq * prob; });
+  return freq * Z;
+}
+
+float Model::MarginalBuffers::PopulateMarginal(
+    float freq, std::vector<float> *expected,
+    std::vector<float> *compensation) {
+  if (expected == nullptr || compensation == nullptr) return 0.0;
+  const float Z = ForEachMarginal([&](int id, double prob) {
+    const float y = static_cast<float>(freq * prob) - (*compensation)[id];
+    const float t = (*expected)[id] + y;
+    (*compensation)[id] = (t - (*expected)[id]) - y;
+    (*expected)[id] = t;
+  });
+  return freq * Z;
+}
+
+void Model::PackLattices(const std::vector<absl::string_view> &normalized,
+                         PackedLattice *packed) const {
+  std::vector<uint32> offsets, begins, ends;
+  std::vector<int32> ids;
+  std::vector<float> scores;
+  offsets.reserve(normalized.size() + 1);
+  for (const auto text : normalized) {
+    offsets.push_back(begins.size());
+    if (!status().ok()) continue;
+    const int size = text.size();
+    for (int pos = 0; pos < size;
+         pos += std::min<int>(string_util::OneCharLen(text.data() + pos),
+                              size - pos)) {
+      ForEachNode(text, pos, [&](int ends_at, int id, float score) {
+        begins.push_back(pos);
+        ends.push_back(ends_at);
+        ids.push_back(id);
+        scores.push_back(score);
+      });
+    }
+  }
+  offsets.push_back(begins.size());
+
+  packed->num_sentences = normalized.size();
+  packed->num_nodes = begins.size();
+  auto &buffer = packed->buffer;
+  buffer.resize(offsets.size() + 4 * begins.size());
+  uint32 *p = buffer.data();
+  auto append = [&p](const void *data, size_t size) {
+    std::memcpy(p, data, size * sizeof(*p));
+    p += size;
+  };
+  append(offsets.data(), offsets.size());
+  append(begins.data(), begins.size());
+  append(ends.data(), ends.size());
+  append(ids.data(), ids.size());
+  append(scores.data(), scores.size());
 }
 }  // namespace unigram
 }  // namespace sentencepiece
@@ -22,6 +22,7 @@
 
 #include "common.h"
 #include "freelist.h"
+#include "memory_placement.h"
 #include "model_interface.h"
 #include "sentencepiece_model.pb.h"
 #include "third_party/darts_clone/darts.h"
@@ -48,6 +49,24 @@ class Lattice {
     std::string DebugString() const;
   };
 
+  // Nodes of one position in the order of insertion. A view into the
+  // lattice, valid until the next Insert(), SetSentence() or Clear().
+  class NodeList {
+   public:
+    NodeList(Node *const *begin, Node *const *end) : begin_(begin), end_(end) {}
+
+    Node *const *begin() const { return begin_; }
+    Node *const *end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    Node *operator[](size_t i) const { return begin_[i]; }
+    Node *front() const { return *begin_; }
+
+   private:
+    Node *const *begin_;
+    Node *const *end_;
+  };
+
   // Returns bos node.
   Node *bos_node() const;
 
@@ -55,10 +74,10 @@ class Lattice {
   Node *eos_node() const;
 
   // Returns nodes starting at |pos|.
-  const std::vector<Node *> &begin_nodes(int pos) const;
+  NodeList begin_nodes(int pos) const;
 
   // Returns nodes ending at |pos|.
-  const std::vector<Node *> &end_nodes(int pos) const;
+  NodeList end_nodes(int pos) const;
 
   // Returns Unicode character length.
   int size() const;
@@ -96,14 +115,50 @@ class Lattice {
   std::vector<LatticePathWithScore> NBest(size_t nbest_size, bool sample,
                                           float theta);
 
+  // Returns the same n-best results as NBest(nbest_size, false, 0.0) with
+  // the lazy k-best enumeration of Huang and Chiang (2005). The i-th best
+  // path ending at a node is computed only when a path through the node is
+  // requested, from the candidates (preceding node, rank) of the node. The
+  // memory is O(nbest_size * #nodes) in the worst case, while the agenda of
+  // NBest() can grow exponentially with the sentence length.
+  std::vector<LatticePathWithScore> LazyNBest(size_t nbest_size);
+
+  // Draws `num_samples` distinct paths without replacement with the same
+  // distribution and scores as NBest(num_samples, true, theta), using a
+  // stochastic beam search over the forward scores. Partial paths are
+  // extended from EOS one start position at a time, and only the
+  // `num_samples` ones with the highest perturbed scores are kept. The
+  // partial paths reaching each position cover all the paths, so the result
+  // is exact. The hypotheses are kept in one pool, which is compacted to
+  // the live ones when it holds more than `max_hypotheses`.
+  std::vector<LatticePathWithScore> StochasticBeamSample(
+      size_t num_samples, float theta, size_t max_hypotheses = 1 << 16);
+
   // Samples one path from the lattice according to the
   // generation probability (Product of piece probabilities).
   // `theta` is a smoothing parameter.
   std::vector<Node *> Sample(float theta);
 
+  // Samples `num_samples` paths as above. The forward scores are computed
+  // once for all the samples.
+  std::vector<std::vector<Node *>> Sample(float theta, int num_samples);
+
   // Calculates the entropy of the lattice.
   float CalculateEntropy(float theta) const;
 
+  // Same as above, but also sets |marginals| to the expected count of every
+  // vocabulary piece in the same distribution, as (vocab id, count) pairs
+  // sorted by id. The pieces on no path are omitted. The forward scores are
+  // shared by the entropy and the marginals.
+  float CalculateEntropy(float theta,
+                         std::vector<std::pair<int, float>> *marginals) const;
+
+  // When |approximate| is true, ForwardAlgorithm(), BackwardAlgorithm(),
+  // PopulateMarginal() and CalculateEntropy() compute exp() with a
+  // polynomial approximation (relative error < 1e-6) that the compiler
+  // vectorizes. Default is false.
+  void SetApproximateExp(bool approximate) { approximate_exp_ = approximate; }
+
   // Populates marginal probability of every node in this lattice.
   // |freq| is the frequency of the sentence.
   //  for (auto *node : all_nodes_) {
@@ -112,29 +167,129 @@ class Lattice {
   // Returns the log-likelihood of this sentence.
   float PopulateMarginal(float freq, std::vector<float> *expected) const;
 
+  // Same as above, but adds the marginals in double precision.
+  float PopulateMarginal(float freq, std::vector<double> *expected) const;
+
+  // Same as above, but adds the marginals to |expected| with the Kahan
+  // compensated summation. |compensation| keeps the low-order parts lost
+  // by each addition and must be of the same size as |expected|.
+  float PopulateMarginal(float freq, std::vector<float> *expected,
+                         std::vector<float> *compensation) const;
+
  private:
+  // Runs the forward-backward algorithm and calls add(vocab_id, prob) with
+  // the marginal probability of every node of a vocabulary piece.
+  // Returns the log-likelihood of this sentence.
+  template <typename Add>
+  float ForEachMarginal(Add add) const;
+
+  // Structure-of-arrays copy of the nodes, indexed by Node::node_id. The
+  // nodes beginning at `pos` are begin_ids[begin_offsets[pos]] ..
+  // begin_ids[begin_offsets[pos + 1] - 1] in the order of begin_nodes(pos),
+  // and likewise for the end nodes. The offsets are shared with
+  // begin_nodes_ and end_nodes_. The dynamic programs run on this copy, so
+  // that their inner loops read contiguous memory.
+  struct NodeArrays {
+    std::vector<float> score;
+    std::vector<int> id;
+    std::vector<uint32> begin_offsets;
+    std::vector<uint32> begin_ids;
+    std::vector<uint32> end_offsets;
+    std::vector<uint32> end_ids;
+    // Scratch space of the batched log-sum-exp.
+    std::vector<float> values;
+    std::vector<float> probs;
+  };
+
   // Returns new node.
   // Lattice class has the ownership of the returned value.
   Node *NewNode();
 
+  // Groups the nodes by their begin and end positions into begin_nodes_,
+  // end_nodes_ and the offsets of `arrays_` with a counting sort, unless
+  // they are up to date.
+  void BuildNodeLists() const;
+
+  // Copies the current nodes to `arrays_`. Must be called again after the
+  // nodes or their scores are modified.
+  void BuildNodeArrays() const;
+
+  // Forward/backward algorithms on `arrays_`.
+  std::vector<float> RunForwardAlgorithm(float theta) const;
+  std::vector<float> RunBackwardAlgorithm(float theta) const;
+
+  // Returns the entropy from the forward scores `alpha` on `arrays_`.
+  float RunEntropy(float theta, const std::vector<float> &alpha) const;
+
   absl::string_view sentence_;
   std::vector<const char *> surface_;
-  std::vector<std::vector<Node *>> begin_nodes_;
-  std::vector<std::vector<Node *>> end_nodes_;
+  // The nodes are allocated in chunks, so that they never move, and are
+  // reused without clearing them. `nodes_` lists them by node_id; the bos
+  // and eos nodes come first.
   model::FreeList<Node> node_allocator_;
+  std::vector<Node *> nodes_;
+
+  // All the nodes grouped by position, see BuildNodeLists(). Every buffer
+  // keeps its capacity across sentences.
+  mutable std::vector<Node *> begin_nodes_;
+  mutable std::vector<Node *> end_nodes_;
+  mutable std::vector<uint32> list_cursors_;
+  mutable bool lists_built_ = false;
+
+  // Work buffers reused across calls.
+  mutable NodeArrays arrays_;
+  bool approximate_exp_ = false;
+  std::vector<float> backtrace_scores_;
+  std::vector<int> backtrace_prevs_;
 };
 
 class Model : public ModelInterface {
  public:
   explicit Model(const ModelProto &model_proto);
+
+  // Instantiates the model with a trie serialized by SerializeTrie() instead
+  // of building it from the pieces. `trie_blob` is not copied, so it must
+  // outlive this model. Every piece is looked up in the trie to validate it.
+  Model(const ModelProto &model_proto, absl::string_view trie_blob);
+
   Model() {}
   ~Model() override;
 
+  // Returns the double-array trie and its metadata as a binary blob.
+  // <trie_results_size (4byte)><double array trie>
+  std::string SerializeTrie() const;
+
   EncodeResult Encode(absl::string_view normalized) const override;
 
+  void EncodeWithScratch(
+      absl::string_view normalized, EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
+  void EncodeRestricted(
+      absl::string_view normalized, const VocabularyRestriction &restriction,
+      EncodeResult *result,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
+  // Copies the trie, the piece attributes and the first character table.
+  void RelocateTables(bool huge_pages) override;
+
+  // Adds the trie, unless it is read in place from a fast-model file, the
+  // piece attributes and the first character table.
+  void GetMemoryUsage(MemoryUsage *usage) const override;
+
+  // Encodes the texts with EncodeInterleaved() when the optimized encoder is
+  // in use and the word cache is disabled.
+  void EncodeMany(const std::vector<absl::string_view> &normalized,
+                  std::vector<EncodeResult> *results,
+                  std::unique_ptr<EncodeScratch> *scratch) const override;
+
   NBestEncodeResult NBestEncode(absl::string_view normalized,
                                 int nbest_size) const override;
 
+  NBestEncodeResult NBestEncodeWithScratch(
+      absl::string_view normalized, int nbest_size,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
   EncodeResult SampleEncode(absl::string_view normalized,
                             float theta) const override;
 
@@ -142,9 +297,23 @@ class Model : public ModelInterface {
                                          float theta, int samples, bool wor,
                                          bool include_best) const override;
 
+  NBestEncodeResult SampleEncodeAndScoreWithScratch(
+      absl::string_view normalized, float theta, int samples, bool wor,
+      bool include_best,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
   float CalculateEntropy(absl::string_view normalized,
                          float theta) const override;
 
+  float CalculateEntropyAndMarginals(
+      absl::string_view normalized, float theta,
+      std::vector<std::pair<int, float>> *marginals,
+      std::unique_ptr<EncodeScratch> *scratch) const override;
+
+  std::vector<EncodeResult> SampleEncodeMany(absl::string_view normalized,
+                                            float inv_theta,
+                                            int num_samples) const override;
+
   bool IsSampleEncodeAvailable() const override { return true; }
 
   bool IsSampleEncodeAndScoreAvailable() const override { return true; }
@@ -166,8 +335,71 @@ class Model : public ModelInterface {
   // best segmentation.
   void PopulateNodes(Lattice *lattice) const;
 
-  // Returns a vocab id of |piece|.
-  int PieceToId(absl::string_view piece) const override;
+  // A node inserted from the trie by PopulateNodes(), without its score.
+  struct NodeSpan {
+    uint32 pos;     // Unicode position in the sentence.
+    uint32 length;  // Unicode length.
+    int32 id;       // Vocab id.
+  };
+
+  // The same as PopulateNodes(lattice), but also appends the nodes found in
+  // the trie to |spans|. The UNK nodes are not recorded. The ids unused in
+  // |restriction| are skipped as the UNUSED pieces when it is given.
+  void PopulateNodes(Lattice *lattice, std::vector<NodeSpan> *spans,
+                     const VocabularyRestriction *restriction = nullptr) const;
+
+  // Inserts the nodes [begin, end) recorded by PopulateNodes() to |lattice|
+  // with the current scores, and the UNK nodes where no node of length 1
+  // begins. The spans must be sorted by position. Spans with a negative id
+  // are skipped, so a lattice can be rebuilt after some pieces have been
+  // removed, without looking up the trie.
+  void PopulateNodes(const NodeSpan *begin, const NodeSpan *end,
+                     Lattice *lattice) const;
+
+  void UpdatePieceTypes() override {
+    ModelInterface::UpdatePieceTypes();
+    InitializePieceAttributes();
+  }
+
+  // Builds or drops a direct lookup table from the first character of a
+  // token (up to U+FFFF) to the trie node after it. Each traversal then
+  // starts with one table lookup instead of walking the 1-3 bytes of the
+  // character through the double array, saving dependent cache misses for
+  // large vocabularies. The table takes 512KB and is built by default for
+  // models of kFirstCharTableMinVocabSize pieces or more.
+  void SetFirstCharTable(bool enable);
+
+  // Returns true if the first character table is in use.
+  bool has_first_char_table() const { return !first_char_table_.empty(); }
+
+  static constexpr int kFirstCharTableMinVocabSize = 65536;
+
+  // Builds an int16 fixed-point copy of the piece scores, which the
+  // optimized encoder then reads instead of the float ones. The table it
+  // reads takes 4 bytes per piece instead of 8, so more of it stays in the
+  // cache, and the path scores are summed in integers. The float scores are
+  // kept for the other encoders, so the model grows by the 4 bytes per
+  // piece of the copy. The scores are scaled so that the largest
+  // magnitude, including the score of UNK, maps to 32767.
+  //
+  // The quantized encoder is validated on the normalized `calibration`
+  // texts: the float score of the path it finds for each may fall short of
+  // the best float score by at most `max_deviation`. Otherwise an error is
+  // returned and the float scores stay in use. The largest shortfall is
+  // stored in `deviation` if it is not null. Texts longer than
+  // kMaxQuantizedTextSize bytes, whose sums could overflow, are encoded
+  // with the float scores.
+  util::Status QuantizeScores(const std::vector<absl::string_view> &calibration,
+                              float max_deviation,
+                              float *deviation = nullptr) override;
+
+  // Drops the quantized scores.
+  void ClearQuantizedScores();
+
+  // Returns true if the quantized scores are in use.
+  bool has_quantized_scores() const { return !quantized_attributes_.empty(); }
+
+  static constexpr int kMaxQuantizedTextSize = 1 << 15;
 
   // Verifies if two outputs are equivalent by comparing their scores.
   bool VerifyOutputsEquivalent(absl::string_view expected,
@@ -185,10 +417,159 @@ class Model : public ModelInterface {
   // Returns the current encoder version in use.
   EncoderVersion GetEncoderVersion() const { return encoder_version_; }
 
+  // Represents the last node of the best path in EncodeOptimized().
+  struct BestPathNode {
+    int id = -1;  // The vocab id. (maybe -1 for UNK)
+    float best_path_score =
+        0;  // The total score of the best path ending at this node.
+    int starts_at =
+        -1;  // The starting position (in utf-8) of this node. The entire best
+             // path can be constructed by backtracking along this link.
+  };
+
+  // BestPathNode of the quantized encoder. The score is in the fixed point
+  // of `score_scale_`.
+  struct QuantizedPathNode {
+    int id = -1;
+    int32 best_path_score = 0;
+    int starts_at = -1;
+  };
+
+  // The lattices of a batch of sentences packed in one buffer, so that the
+  // forward-backward algorithm or sampling can run on vectorized code or an
+  // accelerator without tokenizing again. `buffer` holds five arrays of
+  // 4-byte elements back to back:
+  //   uint32 offsets[num_sentences + 1]  The nodes of the i-th sentence are
+  //                                      [offsets[i], offsets[i + 1]).
+  //   uint32 begins[num_nodes]           Begin position (in utf-8) of the
+  //                                      node in its sentence.
+  //   uint32 ends[num_nodes]             End position (exclusive).
+  //   int32  ids[num_nodes]              Vocab id.
+  //   float  scores[num_nodes]           Score, as in the Lattice.
+  // The nodes of a sentence are sorted by begin position. They are the
+  // nodes PopulateNodes() would insert, including the UNK nodes.
+  struct PackedLattice {
+    int num_sentences = 0;
+    int num_nodes = 0;
+    std::vector<uint32> buffer;
+
+    const uint32 *offsets() const { return buffer.data(); }
+    const uint32 *begins() const { return offsets() + num_sentences + 1; }
+    const uint32 *ends() const { return begins() + num_nodes; }
+    const int32 *ids() const {
+      return reinterpret_cast<const int32 *>(ends() + num_nodes);
+    }
+    const float *scores() const {
+      return reinterpret_cast<const float *>(ids() + num_nodes);
+    }
+  };
+
+  // Packs the lattices of `normalized` into `packed`. Sentences are empty
+  // when the model is not ready.
+  void PackLattices(const std::vector<absl::string_view> &normalized,
+                    PackedLattice *packed) const;
+
+  // Work buffers of SampleEncodeOptimized().
+  struct SampleBuffers {
+    // The log-sum of the scores of the paths from each position to the end.
+    std::vector<float> beta;
+    // The positions (in utf-8) where a character begins.
+    std::vector<int> char_starts;
+  };
+
+  // Work buffers of the lattice-free forward-backward algorithm of the E
+  // step of training, filled by PopulateForward(). They stand for the
+  // Lattice of a sentence: the nodes are kept as (position, length, id)
+  // spans and the forward sums are computed while the nodes are
+  // enumerated, so no Lattice::Node is allocated. The buffers keep their
+  // capacity across the sentences.
+  struct MarginalBuffers {
+    // The positions (in utf-8) where a character begins, and the size of
+    // the sentence at the end.
+    std::vector<int> char_starts;
+    // The nodes sorted by position. The nodes beginning at the character
+    // `pos` are [node_offsets[pos], node_offsets[pos + 1]).
+    std::vector<NodeSpan> nodes;
+    std::vector<float> scores;
+    std::vector<uint32> node_offsets;
+    // alpha[pos] (beta[pos]) is the log-sum of the scores of all the paths
+    // from the beginning to the character `pos` (from `pos` to the end).
+    // `sums` holds the running sums of the forward pass.
+    std::vector<float> alpha;
+    std::vector<float> beta;
+    std::vector<double> sums;
+    // The score and the number of tokens of the best path to each position.
+    std::vector<float> best_scores;
+    std::vector<int> best_sizes;
+
+    // Returns the number of characters.
+    int size() const { return static_cast<int>(char_starts.size()) - 1; }
+
+    // Returns the number of tokens of the Viterbi path.
+    int viterbi_size() const { return best_sizes[size()]; }
+
+    // The same as Lattice::PopulateMarginal(): runs the backward algorithm
+    // and adds freq * the marginal probability of every node to
+    // |expected| in the same sweep. Returns freq * the log-likelihood.
+    float PopulateMarginal(float freq, std::vector<float> *expected);
+    float PopulateMarginal(float freq, std::vector<double> *expected);
+    float PopulateMarginal(float freq, std::vector<float> *expected,
+                           std::vector<float> *compensation);
+
+   private:
+    template <typename Add>
+    float ForEachMarginal(Add add);
+  };
+
+  // Work buffers of EncodeTwoBest().
+  struct TwoBestBuffers {
+    // A path ending at a position: its score, its last node, which begins
+    // at `starts_at` (in utf-8), and the rank of the path before the node
+    // among the two best ones ending at `starts_at`.
+    struct Path {
+      float score = 0.0;
+      int id = -1;
+      int starts_at = -1;
+      int prev_rank = -1;
+    };
+    // The best and the second best paths ending at each position (in
+    // utf-8) are paths[2 * pos] and paths[2 * pos + 1].
+    std::vector<Path> paths;
+  };
+
+  // Finds the best and the second best segmentations of |normalized| as
+  // Lattice::NBest(2, false, 0.0) does after PopulateNodes(), but with a
+  // Viterbi search keeping the two best paths to each position instead of
+  // the A* search over a Lattice. Returns false and leaves |second|
+  // empty if |normalized| has only one segmentation. |buffers| and the
+  // results are overwritten, keeping their capacity.
+  bool EncodeTwoBest(absl::string_view normalized, TwoBestBuffers *buffers,
+                     EncodeResult *best, EncodeResult *second) const;
+
+  // Enumerates the nodes PopulateNodes() would insert to a Lattice of
+  // |normalized| into |buffers|, and runs the forward algorithm and
+  // Viterbi on them as they are found in the trie. The nodes found in the
+  // trie are also appended to |spans| when it is given, as in
+  // PopulateNodes(lattice, spans).
+  void PopulateForward(absl::string_view normalized, MarginalBuffers *buffers,
+                       std::vector<NodeSpan> *spans = nullptr) const;
+
+  // The same as above, but the nodes are rebuilt from the spans [begin,
+  // end) recorded before, as PopulateNodes(begin, end, lattice) does.
+  void PopulateForward(absl::string_view normalized, const NodeSpan *begin,
+                       const NodeSpan *end, MarginalBuffers *buffers) const;
+
  protected:
   // Builds a Trie index.
   void BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces);
 
+  // Initializes `min_score_` and `max_score_` from the pieces.
+  void InitializeScores();
+
+  // Initializes `piece_attributes_` and `max_piece_size_` from the pieces.
+  // Called when the trie is built.
+  void InitializePieceAttributes();
+
   // The optimized Viterbi encode.
   // Main differences from the original function:
   // 1. Memorizes the best path at each postion so far,
@@ -198,18 +579,145 @@ class Model : public ModelInterface {
   // 5. Does not depend on `class Lattice` nor call `SetSentence()`,
   // `PopulateNodes()`, or `Viterbi()`. It does everything in one function.
   // For detailed explanations please see the comments inside the function body.
-  EncodeResult EncodeOptimized(absl::string_view normalized) const;
+  // `best_path_ends_at` and `results` are overwritten, keeping their capacity.
+  // The ids unused in `restriction` are skipped when it is given.
+  void EncodeOptimized(
+      absl::string_view normalized,
+      std::vector<BestPathNode> *best_path_ends_at, EncodeResult *results,
+      const VocabularyRestriction *restriction = nullptr) const;
+
+  // The same as EncodeOptimized() for each text of `normalized`, but
+  // kInterleavedLanes texts are advanced in turn, one trie transition at a
+  // time. The trie unit of the next transition of a text is prefetched
+  // before moving to the next text, so the cache misses of the traversals
+  // overlap instead of stalling one after another. `buffers` holds the
+  // best paths of the lanes.
+  void EncodeInterleaved(const std::vector<absl::string_view> &normalized,
+                         std::vector<std::vector<BestPathNode>> *buffers,
+                         std::vector<EncodeResult> *results) const;
+
+  // The same as EncodeOptimized(), but with the quantized scores. The text
+  // must not be longer than kMaxQuantizedTextSize.
+  void EncodeQuantized(
+      absl::string_view normalized,
+      std::vector<QuantizedPathNode> *best_path_ends_at, EncodeResult *results,
+      const VocabularyRestriction *restriction = nullptr) const;
+
+  // Returns the float score of the best path found by EncodeQuantized().
+  float QuantizedPathScore(
+      absl::string_view normalized,
+      const std::vector<QuantizedPathNode> &best_path_ends_at) const;
+
+  // Backtracks the best path found by EncodeOptimized() or
+  // EncodeQuantized() into `results`.
+  template <typename Node>
+  void BacktrackBestPath(absl::string_view normalized,
+                         const std::vector<Node> &best_path_ends_at,
+                         EncodeResult *results) const;
+
+  // EncodeWithScratch() and EncodeRestricted().
+  void EncodeWithRestriction(absl::string_view normalized,
+                             const VocabularyRestriction *restriction,
+                             EncodeResult *result,
+                             std::unique_ptr<EncodeScratch> *scratch) const;
+
+  // Samples a segmentation in the same distribution as Lattice::Sample(),
+  // but without building a Lattice. The nodes are enumerated from the trie
+  // on the fly, first in a backward pass that stores the log-sum of the
+  // paths from every position ("backward filtering") and then in a forward
+  // pass that samples one node at a time from the current position
+  // ("forward sampling"). Only the per-position sums are stored.
+  // `buffers` and `results` are overwritten, keeping their capacity.
+  void SampleEncodeOptimized(absl::string_view normalized, float inv_theta,
+                             SampleBuffers *buffers,
+                             EncodeResult *results) const;
+
+  // The two passes of SampleEncodeOptimized(). ComputeSampleSums() fills
+  // `buffers` for `normalized`, from which SampleFromSums() draws one
+  // segmentation per call.
+  void ComputeSampleSums(absl::string_view normalized, float inv_theta,
+                         SampleBuffers *buffers) const;
+  void SampleFromSums(absl::string_view normalized, float inv_theta,
+                      const SampleBuffers &buffers,
+                      EncodeResult *results) const;
+
+  // The same as trie_->traverse(key, *node_pos, *key_pos, *key_pos + 1),
+  // except that the character of `mblen` bytes at `starts_at` is consumed
+  // at once via `first_char_table_` when the traversal starts there.
+  int TraverseTrie(const char *key, int starts_at, int mblen,
+                   std::size_t *node_pos, std::size_t *key_pos) const;
+
+  // Calls `func(ends_at, id, score)` for every node beginning at `starts_at`
+  // (in utf-8), which are the nodes PopulateNodes() inserts to a Lattice,
+  // including the UNK node.
+  template <typename Func>
+  void ForEachNode(absl::string_view normalized, int starts_at,
+                   Func func) const;
+
+  // PopulateForward() from the trie, or from the spans [begin, end) when
+  // `cached`.
+  void PopulateForward(absl::string_view normalized, bool cached,
+                       const NodeSpan *begin, const NodeSpan *end,
+                       std::vector<NodeSpan> *spans,
+                       MarginalBuffers *buffers) const;
 
   float min_score_ = 0.0;
   float max_score_ = 0.0;
   std::unique_ptr<Darts::DoubleArray> trie_;
 
+  // The attributes of the pieces used in the encoders, indexed by id. They
+  // are packed in 8 bytes, so the loops over the trie matches read one
+  // small array instead of the SentencePiece messages in the ModelProto.
+  struct PieceAttributes {
+    float score = 0.0;
+    bool unused = false;
+    bool user_defined = false;
+  };
+  std::vector<PieceAttributes, placement::TableAllocator<PieceAttributes>>
+      piece_attributes_;
+
+  // `piece_attributes_` with the scores in int16 fixed point, built by
+  // QuantizeScores(). A float score s is round(s * score_scale_).
+  struct QuantizedAttributes {
+    int16 score = 0;
+    bool unused = false;
+    bool user_defined = false;
+  };
+  std::vector<QuantizedAttributes,
+              placement::TableAllocator<QuantizedAttributes>>
+      quantized_attributes_;
+  float score_scale_ = 0.0;
+
+  // The size of the longest piece in utf-8. The trie traversals stop there.
+  int max_piece_size_ = 0;
+
   // Maximum size of the return value of Trie, which corresponds
   // to the maximum size of shared common prefix in the sentence pieces.
   int trie_results_size_;
 
   // encoder version.
   EncoderVersion encoder_version_ = kOptimized;
+
+  // Copy of the precompiled trie, used when the blob is not aligned or must
+  // be byte-swapped.
+  std::string trie_buffer_;
+
+  // True if the units of `trie_` are the precompiled trie blob itself,
+  // which the model does not own.
+  bool trie_in_blob_ = false;
+
+  // Copy of the trie made by RelocateTables().
+  std::vector<uint32, placement::TableAllocator<uint32>> trie_units_;
+
+  // The trie node after the first character, indexed by the code point.
+  // node_pos == 0 if no piece starts with the character. `value` is the
+  // return value of trie_->traverse() for the character.
+  struct FirstCharEntry {
+    uint32 node_pos = 0;
+    int32 value = -2;
+  };
+  std::vector<FirstCharEntry, placement::TableAllocator<FirstCharEntry>>
+      first_char_table_;
 };
 
 }  // namespace unigram
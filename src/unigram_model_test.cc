@@ -14,9 +14,13 @@
 
 #include "unigram_model.h"
 
+#include <algorithm>
 #include <cmath>
 #include <map>
+#include <random>
+#include <set>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "sentencepiece_model.pb.h"
@@ -159,6 +163,54 @@ TEST(LatticeTest, InsertTest) {
   EXPECT_EQ(node[6], lattice.end_nodes(4)[1]);
 }
 
+TEST(LatticeTest, ReuseTest) {
+  Lattice lattice;
+
+  // The second sentence reuses the nodes of the first one, which must not
+  // leak into it.
+  lattice.SetSentence("ABCD");
+  for (int pos = 0; pos < 4; ++pos) {
+    for (int length = 1; pos + length <= 4; ++length) {
+      Lattice::Node *node = lattice.Insert(pos, length);
+      node->id = pos * 4 + length;
+      node->score = 1.0;
+    }
+  }
+  EXPECT_FALSE(lattice.Viterbi().first.empty());
+
+  lattice.SetSentence("AB");
+  EXPECT_EQ(-1, lattice.bos_node()->id);
+  EXPECT_EQ(0, lattice.bos_node()->length);
+  EXPECT_EQ(nullptr, lattice.eos_node()->prev);
+  EXPECT_EQ(2, lattice.eos_node()->pos);
+
+  Lattice::Node *a = lattice.Insert(0, 1);
+  EXPECT_EQ(0.0, a->score);
+  EXPECT_EQ(nullptr, a->prev);
+  a->id = 1;
+  a->score = 0.5;
+  Lattice::Node *ab = lattice.Insert(0, 2);
+  ab->id = 2;
+  ab->score = 0.0;
+  EXPECT_EQ(2, lattice.begin_nodes(0).size());
+  EXPECT_EQ(0, lattice.begin_nodes(1).size());
+  EXPECT_EQ(1, lattice.end_nodes(1).size());
+  EXPECT_EQ(1, lattice.end_nodes(2).size());
+
+  // The lists are updated after new insertions.
+  Lattice::Node *b = lattice.Insert(1, 1);
+  b->id = 3;
+  b->score = 0.5;
+  EXPECT_EQ(1, lattice.begin_nodes(1).size());
+  EXPECT_EQ(ab, lattice.end_nodes(2)[0]);
+  EXPECT_EQ(b, lattice.end_nodes(2)[1]);
+
+  const auto path = lattice.Viterbi().first;
+  ASSERT_EQ(2, path.size());
+  EXPECT_EQ(a, path[0]);
+  EXPECT_EQ(b, path[1]);
+}
+
 TEST(LatticeTest, ViterbiFromIncompleteLatticeTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -211,6 +263,46 @@ TEST(LatticeTest, ViterbiTest) {
   EXPECT_EQ("ABC", GetTokenized(lattice.Viterbi().first));
 }
 
+TEST(LatticeTest, ViterbiAfterUpdateTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScore(&lattice, 0, 1, 0.0);  // A
+  InsertWithScore(&lattice, 1, 1, 0.0);  // B
+  InsertWithScore(&lattice, 2, 1, 0.0);  // C
+  Lattice::Node *ab = lattice.Insert(0, 2);  // AB
+  ab->score = -1.0;
+  auto path = lattice.Viterbi();
+  EXPECT_EQ("A B C", GetTokenized(path.first));
+  EXPECT_NEAR(0.0, path.second, 0.001);
+  EXPECT_NEAR(0.0, lattice.eos_node()->backtrace_score, 0.001);
+  EXPECT_EQ(lattice.end_nodes(3)[0], lattice.eos_node()->prev);
+
+  // Scores modified in place are picked up by the next call.
+  ab->score = 1.0;
+  path = lattice.Viterbi();
+  EXPECT_EQ("AB C", GetTokenized(path.first));
+  EXPECT_NEAR(1.0, path.second, 0.001);
+  EXPECT_EQ(ab, lattice.end_nodes(3)[0]->prev);
+
+  // Reuses the lattice with a shorter sentence.
+  lattice.SetSentence("AB");
+  InsertWithScore(&lattice, 0, 1, 0.5);  // A
+  InsertWithScore(&lattice, 1, 1, 0.5);  // B
+  InsertWithScore(&lattice, 0, 2, 0.7);  // AB
+  path = lattice.Viterbi();
+  EXPECT_EQ("A B", GetTokenized(path.first));
+  EXPECT_NEAR(1.0, path.second, 0.001);
+
+  const std::vector<float> alpha = lattice.ForwardAlgorithm(1.0);
+  const std::vector<float> beta = lattice.BackwardAlgorithm(1.0);
+  EXPECT_EQ(5, alpha.size());
+  EXPECT_EQ(5, beta.size());
+  const float Z = std::log(std::exp(1.0) + std::exp(0.7));
+  EXPECT_NEAR(Z, alpha[lattice.eos_node()->node_id], 0.001);
+  EXPECT_NEAR(Z, beta[lattice.bos_node()->node_id], 0.001);
+}
+
 TEST(LatticeTest, NBestTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -237,6 +329,66 @@ TEST(LatticeTest, NBestTest) {
   EXPECT_EQ(nbests1.size(), 1);
 }
 
+TEST(LatticeTest, LazyNBestTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+  EXPECT_TRUE(lattice.LazyNBest(10).empty());  // Incomplete lattice.
+
+  InsertWithScore(&lattice, 0, 1, 0.0);  // A
+  InsertWithScore(&lattice, 1, 1, 0.0);  // B
+  InsertWithScore(&lattice, 2, 1, 0.0);  // C
+  InsertWithScore(&lattice, 0, 2, 2.0);  // AB
+  InsertWithScore(&lattice, 1, 2, 5.0);  // BC
+  InsertWithScore(&lattice, 0, 3, 10.0);  // ABC
+
+  const auto nbests = lattice.LazyNBest(10);
+  EXPECT_EQ(4, nbests.size());
+  EXPECT_EQ("ABC", GetTokenized(nbests[0].first));
+  EXPECT_EQ("A BC", GetTokenized(nbests[1].first));
+  EXPECT_EQ("AB C", GetTokenized(nbests[2].first));
+  EXPECT_EQ("A B C", GetTokenized(nbests[3].first));
+  EXPECT_NEAR(10.0, nbests[0].second, 0.001);
+  EXPECT_NEAR(5.0, nbests[1].second, 0.001);
+  EXPECT_NEAR(2.0, nbests[2].second, 0.001);
+  EXPECT_NEAR(0.0, nbests[3].second, 0.001);
+
+  EXPECT_EQ(1, lattice.LazyNBest(1).size());
+  EXPECT_TRUE(lattice.LazyNBest(0).empty());
+
+  lattice.SetSentence("");
+  EXPECT_EQ(1, lattice.LazyNBest(10).size());
+}
+
+TEST(LatticeTest, LazyNBestLongSentenceTest) {
+  const std::string sentence(30, 'a');
+  Lattice lattice;
+  lattice.SetSentence(sentence);
+  std::mt19937 mt(1);
+  std::uniform_real_distribution<float> dist(-10.0, 0.0);
+  for (int pos = 0; pos < lattice.size(); ++pos) {
+    for (int len = 1; len <= 4 && pos + len <= lattice.size(); ++len) {
+      InsertWithScore(&lattice, pos, len, dist(mt));
+    }
+  }
+
+  for (const size_t nbest_size : {2, 10, 64, 200}) {
+    const auto expected = lattice.NBest(nbest_size, false, 0.0);
+    const auto actual = lattice.LazyNBest(nbest_size);
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_NEAR(expected[i].second, actual[i].second, 1e-4);
+      // The order of (almost) tied paths depends on the rounding of the sums.
+      const float score = expected[i].second;
+      if ((i == 0 || expected[i - 1].second - score > 1e-4) &&
+          (i + 1 == expected.size() ||
+           score - expected[i + 1].second > 1e-4)) {
+        EXPECT_EQ(GetTokenized(expected[i].first),
+                  GetTokenized(actual[i].first));
+      }
+    }
+  }
+}
+
 TEST(LatticeTest, NBestSampleTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -296,26 +448,62 @@ TEST(LatticeTest, NBestSampleTest) {
 
     std::vector<int> kNumSamples = {1, 2};
 
+    // Lattice::StochasticBeamSample() draws from the same distribution.
     for (const auto num_samples : kNumSamples) {
-      std::map<std::string, int> counts;
-      for (int i = 0; i < kTrials; i++) {
-        auto nbests = lattice.NBest(num_samples, true, inv_theta);
-        for (const auto &nbest : nbests) {
-          counts[GetTokenized(nbest.first)]++;
+      for (const bool beam : {false, true}) {
+        std::map<std::string, int> counts;
+        for (int i = 0; i < kTrials; i++) {
+          auto nbests =
+              beam ? lattice.StochasticBeamSample(num_samples, inv_theta)
+                   : lattice.NBest(num_samples, true, inv_theta);
+          ASSERT_EQ(num_samples, nbests.size());
+          for (const auto &nbest : nbests) {
+            counts[GetTokenized(nbest.first)]++;
+          }
+        }
+
+        EXPECT_EQ(inclusion_probs.size(), counts.size());
+        // If we take multiple samples WOR, we have to use corrected probs.
+        std::map<std::string, float> probs_to_use =
+            (num_samples == 1 ? probs : inclusion_probs);
+
+        for (const auto &it : probs_to_use) {
+          EXPECT_NEAR(it.second,
+                      1.0 * counts[it.first] / (kTrials * num_samples), 0.02);
         }
       }
+    }
+  }
+}
 
-      EXPECT_EQ(inclusion_probs.size(), counts.size());
-      // If we take multiple samples WOR, we have to use corrected probs.
-      std::map<std::string, float> probs_to_use =
-          (num_samples == 1 ? probs : inclusion_probs);
+TEST(LatticeTest, StochasticBeamSampleTest) {
+  Lattice lattice;
+  const std::string sentence = "ABCDEFGHIJKL";
+  lattice.SetSentence(sentence);
+  for (int pos = 0; pos < lattice.size(); ++pos) {
+    for (int len = 1; len <= 3 && pos + len <= lattice.size(); ++len) {
+      InsertWithScore(&lattice, pos, len, -0.1 * len * (pos % 3 + 1));
+    }
+  }
 
-      for (const auto &it : probs_to_use) {
-        EXPECT_NEAR(it.second, 1.0 * counts[it.first] / (kTrials * num_samples),
-                    0.02);
+  // A tiny pool is compacted at every position.
+  for (const size_t max_hypotheses : {1, 1 << 16}) {
+    const auto samples = lattice.StochasticBeamSample(16, 0.5, max_hypotheses);
+    ASSERT_EQ(16, samples.size());
+    std::set<std::string> distinct;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      std::string surface;
+      for (const auto *node : samples[i].first) {
+        absl::StrAppend(&surface, node->piece);
       }
+      EXPECT_EQ(sentence, surface);
+      distinct.insert(GetTokenized(samples[i].first));
+      if (i > 0) EXPECT_GE(samples[i - 1].second, samples[i].second);
     }
+    EXPECT_EQ(16, distinct.size());
   }
+
+  EXPECT_TRUE(lattice.StochasticBeamSample(0, 0.5).empty());
 }
 
 TEST(LatticeTest, CalculateEntropyTest) {
@@ -354,6 +542,50 @@ TEST(LatticeTest, CalculateEntropyTest) {
   }
 }
 
+TEST(LatticeTest, ApproximateExpTest) {
+  const std::string sentence(64, 'a');
+  Lattice lattice;
+  lattice.SetSentence(sentence);
+  auto *mt = random::GetRandomGenerator();
+  std::uniform_real_distribution<float> dist(-15.0, 0.0);
+  int id = 0;
+  for (int pos = 0; pos < lattice.size(); ++pos) {
+    for (int len = 1; len <= 8 && pos + len <= lattice.size(); ++len) {
+      InsertWithScoreAndId(&lattice, pos, len, dist(*mt), id++);
+    }
+  }
+
+  for (const float inv_theta : {0.1, 0.5, 1.0}) {
+    lattice.SetApproximateExp(false);
+    const auto alpha = lattice.ForwardAlgorithm(inv_theta);
+    const auto beta = lattice.BackwardAlgorithm(inv_theta);
+    const float entropy = lattice.CalculateEntropy(inv_theta);
+    lattice.SetApproximateExp(true);
+    const auto fast_alpha = lattice.ForwardAlgorithm(inv_theta);
+    const auto fast_beta = lattice.BackwardAlgorithm(inv_theta);
+    const float fast_entropy = lattice.CalculateEntropy(inv_theta);
+
+    ASSERT_EQ(alpha.size(), fast_alpha.size());
+    ASSERT_EQ(beta.size(), fast_beta.size());
+    for (size_t i = 0; i < alpha.size(); ++i) {
+      EXPECT_NEAR(alpha[i], fast_alpha[i], 1e-3);
+      EXPECT_NEAR(beta[i], fast_beta[i], 1e-3);
+    }
+    EXPECT_NEAR(entropy, fast_entropy, 1e-3);
+  }
+
+  std::vector<float> expected(id, 0.0);
+  std::vector<float> fast_expected(id, 0.0);
+  lattice.SetApproximateExp(false);
+  const float logz = lattice.PopulateMarginal(1.0, &expected);
+  lattice.SetApproximateExp(true);
+  const float fast_logz = lattice.PopulateMarginal(1.0, &fast_expected);
+  EXPECT_NEAR(logz, fast_logz, 1e-3);
+  for (int i = 0; i < id; ++i) {
+    EXPECT_NEAR(expected[i], fast_expected[i], 1e-3);
+  }
+}
+
 TEST(LatticeTest, ForwardAlgorithmTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -426,6 +658,77 @@ TEST(LatticeTest, PopulateMarginalTest) {
   EXPECT_NEAR(std::log(static_cast<double>(Z)), logZ, 0.001);
 }
 
+TEST(LatticeTest, PopulateMarginalPrecisionTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, 0);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, 1);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 2.5, 2);  // C
+  InsertWithScoreAndId(&lattice, 0, 2, 3.0, 3);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 4.0, 4);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 2.0, 5);  // ABC
+
+  std::vector<float> probs(6, 0.0);
+  lattice.PopulateMarginal(1.0, &probs);
+
+  // Sums of 20000 sentences of frequency 10000, where the float sums lose
+  // the low-order digits of each addition.
+  constexpr int kSentences = 20000;
+  constexpr float kFreq = 10000.0;
+  std::vector<float> float_sums(6, 0.0);
+  std::vector<double> double_sums(6, 0.0);
+  std::vector<float> kahan_sums(6, 0.0), compensation(6, 0.0);
+  for (int i = 0; i < kSentences; ++i) {
+    const float logZ = lattice.PopulateMarginal(kFreq, &float_sums);
+    EXPECT_EQ(logZ, lattice.PopulateMarginal(kFreq, &double_sums));
+    EXPECT_EQ(logZ,
+              lattice.PopulateMarginal(kFreq, &kahan_sums, &compensation));
+  }
+
+  double float_error = 0.0;
+  for (int id = 0; id < 6; ++id) {
+    const double expected = static_cast<double>(kSentences) * kFreq * probs[id];
+    EXPECT_NEAR(expected, double_sums[id], expected * 1e-6);
+    EXPECT_NEAR(expected, kahan_sums[id] - compensation[id], expected * 1e-6);
+    float_error = std::max(float_error, std::abs(expected - float_sums[id]));
+  }
+  EXPECT_GT(float_error, 1.0);
+}
+
+TEST(LatticeTest, CalculateEntropyWithMarginalsTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, 0);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, 1);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 2.5, 0);  // C, the same id as A.
+  InsertWithScoreAndId(&lattice, 0, 2, 3.0, 3);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 4.0, 4);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 2.0, 5);  // ABC
+
+  for (const float inv_theta : {1.0, 0.5}) {
+    const float p1 = std::exp(inv_theta * (1.0 + 1.2 + 2.5));  // A B C
+    const float p2 = std::exp(inv_theta * (3.0 + 2.5));        // AB C
+    const float p3 = std::exp(inv_theta * (1.0 + 4.0));        // A BC
+    const float p4 = std::exp(inv_theta * 2.0);                // ABC
+    const float Z = p1 + p2 + p3 + p4;
+
+    std::vector<std::pair<int, float>> marginals;
+    const float entropy = lattice.CalculateEntropy(inv_theta, &marginals);
+    EXPECT_NEAR(lattice.CalculateEntropy(inv_theta), entropy, 1e-6);
+
+    ASSERT_EQ(5, marginals.size());
+    const std::vector<int> kIds = {0, 1, 3, 4, 5};
+    const std::vector<float> kExpected = {
+        (2 * p1 + p2 + p3) / Z, p1 / Z, p2 / Z, p3 / Z, p4 / Z};
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(kIds[i], marginals[i].first);
+      EXPECT_NEAR(kExpected[i], marginals[i].second, 0.001);
+    }
+  }
+}
+
 TEST(LatticeTest, SampleTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -462,6 +765,16 @@ TEST(LatticeTest, SampleTest) {
     for (const auto &it : probs) {
       EXPECT_NEAR(it.second, 1.0 * freq[it.first] / kTrial, 0.02);
     }
+
+    // The same distribution when all the samples are drawn at once.
+    freq.clear();
+    for (const auto &path : lattice.Sample(kInv_Theta[i], kTrial)) {
+      freq[GetTokenized(path)]++;
+    }
+    EXPECT_EQ(probs.size(), freq.size());
+    for (const auto &it : probs) {
+      EXPECT_NEAR(it.second, 1.0 * freq[it.first] / kTrial, 0.02);
+    }
   }
 }
 
@@ -777,6 +1090,334 @@ TEST_P(UnigramModelTest, ModelNBestTest) {
   EXPECT_EQ(0, sample.size());
   sample = model.SampleEncode("abc", 0.1);
   EXPECT_FALSE(sample.empty());
+
+  const auto samples = model.SampleEncodeMany("", 0.1, 3);
+  EXPECT_EQ(std::vector<EncodeResult>(3), samples);
+  EXPECT_EQ(3, model.SampleEncodeMany("abc", 0.1, 3).size());
+  EXPECT_TRUE(model.SampleEncodeMany("abc", 0.1, 0).empty());
+}
+
+TEST_P(UnigramModelTest, SampleEncodeDistributionTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "A", 0.0);    // 3
+  AddPiece(&model_proto, "B", 0.0);    // 4
+  AddPiece(&model_proto, "C", 0.1);    // 5
+  AddPiece(&model_proto, "AB", 0.2);   // 6
+  AddPiece(&model_proto, "BC", 0.5);   // 7
+  AddPiece(&model_proto, "ABC", 1.0);  // 8
+  AddPiece(&model_proto, "Cあ", 0.3);  // 9
+  AddPiece(&model_proto, "Bい", 0.0);  // 10
+  model_proto.mutable_pieces(10)->set_type(ModelProto::SentencePiece::UNUSED);
+
+  Model model(model_proto);
+  model.SetEncoderVersion(encoder_version_);
+
+  // "あ" is unknown when it does not follow "C".
+  const float unk = model.min_score() - 10.0;
+  for (const float inv_theta : {0.0, 0.5, 1.0}) {
+    std::map<std::string, float> probs;
+    probs["ABC あ"] = std::exp(inv_theta * (1.0 + unk));
+    probs["AB C あ"] = std::exp(inv_theta * (0.2 + 0.1 + unk));
+    probs["AB Cあ"] = std::exp(inv_theta * (0.2 + 0.3));
+    probs["A BC あ"] = std::exp(inv_theta * (0.0 + 0.5 + unk));
+    probs["A B C あ"] = std::exp(inv_theta * (0.0 + 0.0 + 0.1 + unk));
+    probs["A B Cあ"] = std::exp(inv_theta * (0.0 + 0.0 + 0.3));
+    double Z = 0.0;
+    for (const auto &it : probs) Z += it.second;
+
+    constexpr int kTrials = 20000;
+    std::map<std::string, int> counts;
+    for (int i = 0; i < kTrials; ++i) {
+      std::vector<std::string> pieces;
+      for (const auto &p : model.SampleEncode("ABCあ", inv_theta)) {
+        pieces.emplace_back(p.first);
+      }
+      ++counts[absl::StrJoin(pieces, " ")];
+    }
+
+    // SampleEncodeMany() draws from the same distribution.
+    std::map<std::string, int> many_counts;
+    const auto samples = model.SampleEncodeMany("ABCあ", inv_theta, kTrials);
+    EXPECT_EQ(kTrials, samples.size());
+    for (const auto &sample : samples) {
+      std::vector<std::string> pieces;
+      for (const auto &p : sample) pieces.emplace_back(p.first);
+      ++many_counts[absl::StrJoin(pieces, " ")];
+    }
+
+    for (auto *c : {&counts, &many_counts}) {
+      for (const auto &it : *c) EXPECT_EQ(1, probs.count(it.first));
+      for (const auto &it : probs) {
+        EXPECT_NEAR(it.second / Z,
+                    static_cast<float>((*c)[it.first]) / kTrials, 0.02);
+      }
+    }
+  }
+}
+
+TEST(UnigramModelTest, PackLatticesTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "a", -1.0);    // 3
+  AddPiece(&model_proto, "b", -2.0);    // 4
+  AddPiece(&model_proto, "ab", -0.5);   // 5
+  AddPiece(&model_proto, "bあ", -0.3);  // 6
+  AddPiece(&model_proto, "aa", -0.1);   // 7
+  AddPiece(&model_proto, "AB", 0.0);    // 8
+  model_proto.mutable_pieces(7)->set_type(ModelProto::SentencePiece::UNUSED);
+  model_proto.mutable_pieces(8)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+  const Model model(model_proto);
+
+  const std::vector<absl::string_view> sentences = {"abあa", "", "aaABb"};
+  Model::PackedLattice packed;
+  model.PackLattices(sentences, &packed);
+  EXPECT_EQ(3, packed.num_sentences);
+  EXPECT_EQ(packed.num_sentences + 1 + 4 * packed.num_nodes,
+            packed.buffer.size());
+  EXPECT_EQ(0, packed.offsets()[0]);
+  EXPECT_EQ(packed.num_nodes, packed.offsets()[3]);
+
+  // Compares with the nodes of the Lattice.
+  for (int i = 0; i < sentences.size(); ++i) {
+    Lattice lattice;
+    lattice.SetSentence(sentences[i]);
+    model.PopulateNodes(&lattice);
+    std::vector<std::tuple<uint32, uint32, int, float>> expected, actual;
+    for (int pos = 0; pos < lattice.size(); ++pos) {
+      for (const auto *node : lattice.begin_nodes(pos)) {
+        const uint32 begin = node->piece.data() - lattice.sentence();
+        expected.emplace_back(begin, begin + node->piece.size(), node->id,
+                              node->score);
+      }
+    }
+    for (uint32 n = packed.offsets()[i]; n < packed.offsets()[i + 1]; ++n) {
+      actual.emplace_back(packed.begins()[n], packed.ends()[n],
+                          packed.ids()[n], packed.scores()[n]);
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    EXPECT_EQ(expected, actual);
+  }
+  EXPECT_EQ(packed.offsets()[1], packed.offsets()[2]);  // Empty sentence.
+}
+
+TEST(UnigramModelTest, EncodeTwoBestTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "a", -1.0);    // 3
+  AddPiece(&model_proto, "b", -2.1);    // 4
+  AddPiece(&model_proto, "ab", -0.5);   // 5
+  AddPiece(&model_proto, "bあ", -0.3);  // 6
+  AddPiece(&model_proto, "aa", -0.1);   // 7
+  AddPiece(&model_proto, "AB", 0.0);    // 8
+  AddPiece(&model_proto, "aab", -1.65);  // 9
+  AddPiece(&model_proto, "あ", -3.3);    // 10
+  model_proto.mutable_pieces(7)->set_type(ModelProto::SentencePiece::UNUSED);
+  model_proto.mutable_pieces(8)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+  const Model model(model_proto);
+
+  // The same paths as Lattice::NBest(2, false, 0.0). The scores and the
+  // sentences have no two paths of the same score.
+  Model::TwoBestBuffers buffers;
+  EncodeResult best, second;
+  for (const absl::string_view sentence :
+       {"a", "ab", "abあa", "aaABb", "aabab\xffあいab", "ABaaab"}) {
+    Lattice lattice;
+    lattice.SetSentence(sentence);
+    model.PopulateNodes(&lattice);
+    const auto nbests = lattice.NBest(2, false, 0.0);
+    EXPECT_EQ(nbests.size() == 2,
+              model.EncodeTwoBest(sentence, &buffers, &best, &second));
+    std::vector<EncodeResult> expected(2);
+    for (size_t n = 0; n < nbests.size(); ++n) {
+      for (const auto *node : nbests[n].first) {
+        expected[n].emplace_back(node->piece, node->id);
+      }
+    }
+    EXPECT_EQ(expected[0], best);
+    EXPECT_EQ(expected[1], second);
+  }
+}
+
+TEST(UnigramModelTest, PopulateForwardTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "a", -1.0);    // 3
+  AddPiece(&model_proto, "b", -2.0);    // 4
+  AddPiece(&model_proto, "ab", -0.5);   // 5
+  AddPiece(&model_proto, "bあ", -0.3);  // 6
+  AddPiece(&model_proto, "aa", -0.1);   // 7
+  AddPiece(&model_proto, "AB", 0.0);    // 8
+  AddPiece(&model_proto, "aab", -1.5);  // 9
+  model_proto.mutable_pieces(7)->set_type(ModelProto::SentencePiece::UNUSED);
+  model_proto.mutable_pieces(8)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+  const Model model(model_proto);
+
+  // The lattice-free forward-backward gives the marginals, the likelihood
+  // and the Viterbi size of the Lattice, whether the nodes come from the
+  // trie or from the recorded spans.
+  Model::MarginalBuffers buffers;
+  for (const absl::string_view sentence :
+       {"abあa", "", "aaABb", "aabab\xffあいaab", "ABABaaaa"}) {
+    Lattice lattice;
+    lattice.SetSentence(sentence);
+    std::vector<Model::NodeSpan> expected_spans;
+    model.PopulateNodes(&lattice, &expected_spans);
+    std::vector<double> expected(model_proto.pieces_size(), 0.0);
+    const float expected_z = lattice.PopulateMarginal(2.0, &expected);
+    const int viterbi_size = lattice.Viterbi().first.size();
+
+    std::vector<Model::NodeSpan> spans;
+    model.PopulateForward(sentence, &buffers, &spans);
+    ASSERT_EQ(expected_spans.size(), spans.size());
+    for (size_t i = 0; i < spans.size(); ++i) {
+      EXPECT_EQ(expected_spans[i].pos, spans[i].pos);
+      EXPECT_EQ(expected_spans[i].length, spans[i].length);
+      EXPECT_EQ(expected_spans[i].id, spans[i].id);
+    }
+    EXPECT_EQ(lattice.size(), buffers.size());
+    EXPECT_EQ(viterbi_size, buffers.viterbi_size());
+    std::vector<double> actual(model_proto.pieces_size(), 0.0);
+    EXPECT_NEAR(expected_z, buffers.PopulateMarginal(2.0, &actual), 1e-5);
+    for (size_t id = 0; id < expected.size(); ++id) {
+      EXPECT_NEAR(expected[id], actual[id], 1e-5);
+    }
+
+    model.PopulateForward(sentence, spans.data(), spans.data() + spans.size(),
+                          &buffers);
+    EXPECT_EQ(viterbi_size, buffers.viterbi_size());
+    std::vector<float> cached(model_proto.pieces_size(), 0.0);
+    std::vector<float> compensation(model_proto.pieces_size(), 0.0);
+    EXPECT_NEAR(expected_z,
+                buffers.PopulateMarginal(2.0, &cached, &compensation), 1e-5);
+    for (size_t id = 0; id < expected.size(); ++id) {
+      EXPECT_NEAR(expected[id], cached[id] - compensation[id], 1e-5);
+    }
+  }
+}
+
+TEST(UnigramModelTest, FirstCharTableTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  const std::vector<std::string> chars = {
+      "a", "b", "あ", "い", "é", "\xF0\x9F\x98\x80", "\xC3", "\xFF", "\x80"};
+  // All the pieces up to 3 characters, except for the invalid bytes.
+  float score = -1.0;
+  for (int i = 0; i < 6; ++i) {
+    AddPiece(&model_proto, chars[i], score -= 0.1);
+    for (int j = 0; j < 6; ++j) {
+      AddPiece(&model_proto, chars[i] + chars[j], score -= 0.1);
+      if ((i + j) % 2 == 0) {
+        AddPiece(&model_proto, chars[i] + chars[j] + chars[i], score -= 0.1);
+      }
+    }
+  }
+  model_proto.mutable_pieces(5)->set_type(ModelProto::SentencePiece::UNUSED);
+  model_proto.mutable_pieces(9)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+
+  Model model(model_proto);
+  Model with_table(model_proto);
+  EXPECT_FALSE(model.has_first_char_table());
+  with_table.SetFirstCharTable(true);
+  EXPECT_TRUE(with_table.has_first_char_table());
+
+  auto *mt = random::GetRandomGenerator();
+  std::uniform_int_distribution<int> dist(0, chars.size() - 1);
+  std::vector<std::string> sentences;
+  for (int n = 0; n < 300; ++n) {
+    std::string text;
+    for (int i = 0; i < n % 20; ++i) text += chars[dist(*mt)];
+    if (n % 7 == 0) text += "x";  // Unknown character.
+    sentences.push_back(text);
+  }
+
+  std::vector<absl::string_view> views;
+  for (const auto &text : sentences) {
+    EXPECT_EQ(model.Encode(text), with_table.Encode(text));
+    views.emplace_back(text);
+  }
+  Model::PackedLattice expected, actual;
+  model.PackLattices(views, &expected);
+  with_table.PackLattices(views, &actual);
+  EXPECT_EQ(expected.num_nodes, actual.num_nodes);
+  EXPECT_EQ(expected.buffer, actual.buffer);
+
+  // The lattices are the same, including the order of the nodes.
+  Lattice lattice, lattice_with_table;
+  for (const auto &text : sentences) {
+    lattice.SetSentence(text);
+    model.PopulateNodes(&lattice);
+    lattice_with_table.SetSentence(text);
+    with_table.PopulateNodes(&lattice_with_table);
+    ASSERT_EQ(lattice.size(), lattice_with_table.size());
+    for (int pos = 0; pos < lattice.size(); ++pos) {
+      const auto nodes = lattice.begin_nodes(pos);
+      const auto nodes_with_table = lattice_with_table.begin_nodes(pos);
+      ASSERT_EQ(nodes.size(), nodes_with_table.size());
+      for (size_t i = 0; i < nodes.size(); ++i) {
+        EXPECT_EQ(nodes[i]->id, nodes_with_table[i]->id);
+        EXPECT_EQ(nodes[i]->length, nodes_with_table[i]->length);
+        EXPECT_EQ(nodes[i]->score, nodes_with_table[i]->score);
+      }
+    }
+  }
+
+  with_table.SetFirstCharTable(false);
+  EXPECT_FALSE(with_table.has_first_char_table());
+  EXPECT_EQ(model.Encode(sentences[19]), with_table.Encode(sentences[19]));
+}
+
+TEST(UnigramModelTest, QuantizedScoresTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "a", -1.0);
+  AddPiece(&model_proto, "b", -1.0);
+  AddPiece(&model_proto, "ab", -2.00001);  // Ties with "a b" when quantized.
+  AddPiece(&model_proto, "c", -3.0);
+  AddPiece(&model_proto, "bc", -3.5);
+  AddPiece(&model_proto, "<sep>");
+  model_proto.mutable_pieces(8)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+
+  Model model(model_proto);
+  EXPECT_FALSE(model.has_quantized_scores());
+  EXPECT_EQ(2, model.Encode("ab").size());
+
+  // "ab" loses 0.00001 to "a b".
+  float deviation = 0.0;
+  EXPECT_EQ(util::StatusCode::kFailedPrecondition,
+            model.QuantizeScores({"ab"}, 1e-6, &deviation).code());
+  EXPECT_NEAR(1e-5, deviation, 1e-6);
+  EXPECT_FALSE(model.has_quantized_scores());
+
+  const std::vector<absl::string_view> calibration = {
+      "ab", "abc", "bcab<sep>x", "", "cbbca", "bc<sep>c"};
+  EXPECT_TRUE(model.QuantizeScores(calibration, 1e-3, &deviation).ok());
+  EXPECT_TRUE(model.has_quantized_scores());
+  EXPECT_NEAR(1e-5, deviation, 1e-6);
+  EXPECT_EQ(EncodeResult({{"ab", 5}}), model.Encode("ab"));
+
+  // All the encoders of the optimized model read the quantized scores.
+  Model float_model(model_proto);
+  std::unique_ptr<EncodeScratch> scratch;
+  std::vector<EncodeResult> results;
+  model.EncodeMany(calibration, &results, &scratch);
+  for (size_t i = 0; i < calibration.size(); ++i) {
+    EncodeResult result;
+    model.EncodeWithScratch(calibration[i], &result, &scratch);
+    EXPECT_EQ(model.Encode(calibration[i]), result);
+    EXPECT_EQ(result, results[i]);
+    if (calibration[i].find("ab") == absl::string_view::npos) {
+      EXPECT_EQ(float_model.Encode(calibration[i]), result);
+    }
+  }
+
+  // The float scores are read again for texts whose sums could overflow.
+  const std::string long_text(Model::kMaxQuantizedTextSize + 2, 'b');
+  EXPECT_EQ(float_model.Encode(long_text), model.Encode(long_text));
+
+  model.ClearQuantizedScores();
+  EXPECT_FALSE(model.has_quantized_scores());
+  EXPECT_EQ(2, model.Encode("ab").size());
 }
 
 TEST_P(UnigramModelTest, EncodeTest) {
@@ -810,10 +1451,11 @@ TEST_P(UnigramModelTest, EncodeTest) {
   EXPECT_EQ(1, result.size());
   EXPECT_EQ("abc", result[0].first);
 
+  // A run of unknown characters is one piece.
   result = model.Encode("AB");
-  EXPECT_EQ(2, result.size());
-  EXPECT_EQ("A", result[0].first);
-  EXPECT_EQ("B", result[1].first);
+  EXPECT_EQ(1, result.size());
+  EXPECT_EQ("AB", result[0].first);
+  EXPECT_EQ(0, result[0].second);
 
   result = model.Encode("abcd");
   EXPECT_EQ(2, result.size());
@@ -837,12 +1479,8 @@ TEST_P(UnigramModelTest, EncodeTest) {
 
   // all unknown.
   result = model.Encode("xyz東京");
-  EXPECT_EQ(5, result.size());
-  EXPECT_EQ("x", result[0].first);
-  EXPECT_EQ("y", result[1].first);
-  EXPECT_EQ("z", result[2].first);
-  EXPECT_EQ("東", result[3].first);
-  EXPECT_EQ("京", result[4].first);
+  EXPECT_EQ(1, result.size());
+  EXPECT_EQ("xyz東京", result[0].first);
 
   // User defined
   result = model.Encode("ABC");
@@ -868,6 +1506,45 @@ TEST_P(UnigramModelTest, EncodeTest) {
   EXPECT_EQ("q", result[1].first);
   EXPECT_EQ("r", result[2].first);
   EXPECT_EQ("cd", result[3].first);
+
+  // The unknown characters are kept apart for the byte fallback.
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  for (int i = 0; i < 256; ++i) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(ByteToPiece(i));
+    sp->set_type(ModelProto::SentencePiece::BYTE);
+  }
+  Model byte_fallback_model(model_proto);
+  ASSERT_TRUE(byte_fallback_model.status().ok());
+  byte_fallback_model.SetEncoderVersion(encoder_version_);
+  result = byte_fallback_model.Encode("xy");
+  EXPECT_EQ(2, result.size());
+  EXPECT_EQ("x", result[0].first);
+  EXPECT_EQ("y", result[1].first);
+}
+
+TEST_P(UnigramModelTest, UpdatePieceTypesTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "abcd", 10.0);  // 3
+  AddPiece(&model_proto, "abc", 5.0);    // 4
+  AddPiece(&model_proto, "a", 0.0);      // 5
+  AddPiece(&model_proto, "b", 0.0);      // 6
+  AddPiece(&model_proto, "c", 0.0);      // 7
+  AddPiece(&model_proto, "d", 0.0);      // 8
+
+  Model model(model_proto);
+  model.SetEncoderVersion(encoder_version_);
+  EXPECT_EQ(EncodeResult({{"abcd", 3}}), model.Encode("abcd"));
+
+  // The model reads the types cached when the trie was built until
+  // UpdatePieceTypes() is called.
+  model_proto.mutable_pieces(3)->set_type(ModelProto::SentencePiece::UNUSED);
+  model.UpdatePieceTypes();
+  EXPECT_EQ(EncodeResult({{"abc", 4}, {"d", 8}}), model.Encode("abcd"));
+
+  model_proto.mutable_pieces(3)->set_type(ModelProto::SentencePiece::NORMAL);
+  model.UpdatePieceTypes();
+  EXPECT_EQ(EncodeResult({{"abcd", 3}}), model.Encode("abcd"));
 }
 
 TEST_P(UnigramModelTest, EncodeWithUnusedTest) {
@@ -950,6 +1627,135 @@ TEST_P(UnigramModelTest, VerifyOutputsEquivalent) {
   EXPECT_FALSE(model.VerifyOutputsEquivalent("ab", "a b"));
 }
 
+TEST_P(UnigramModelTest, PrecompiledTrieTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+
+  AddPiece(&model_proto, "abcd", 10.0);  // 3
+  AddPiece(&model_proto, "abc", 5.0);    // 4
+  AddPiece(&model_proto, "ab", 6.0);     // 5
+  AddPiece(&model_proto, "cd", 4.0);     // 6
+  AddPiece(&model_proto, "a", 4.0);      // 7
+  AddPiece(&model_proto, "b", 1.9);      // 8
+  AddPiece(&model_proto, "c", 2.0);      // 9
+  AddPiece(&model_proto, "d", 1.0);      // 10
+
+  const Model model(model_proto);
+  const std::string blob = model.SerializeTrie();
+  EXPECT_FALSE(blob.empty());
+
+  Model precompiled(model_proto, blob);
+  precompiled.SetEncoderVersion(encoder_version_);
+  EXPECT_TRUE(precompiled.status().ok());
+  EXPECT_EQ(model.min_score(), precompiled.min_score());
+  EXPECT_EQ(model.max_score(), precompiled.max_score());
+  for (const auto &sp : model_proto.pieces()) {
+    EXPECT_EQ(model.PieceToId(sp.piece()), precompiled.PieceToId(sp.piece()));
+  }
+  EXPECT_EQ(model.Encode("abcdabcxd"), precompiled.Encode("abcdabcxd"));
+
+  // The trie does not match the pieces.
+  ModelProto other_proto = model_proto;
+  other_proto.mutable_pieces(3)->set_piece("abce");
+  EXPECT_FALSE(Model(other_proto, blob).status().ok());
+
+  // Broken blobs.
+  EXPECT_FALSE(Model(model_proto, "").status().ok());
+  EXPECT_FALSE(Model(model_proto, blob.substr(0, 6)).status().ok());
+}
+
+TEST_P(UnigramModelTest, EncodeWithScratchTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+
+  AddPiece(&model_proto, "abcd", 10.0);  // 3
+  AddPiece(&model_proto, "abc", 5.0);    // 4
+  AddPiece(&model_proto, "ab", 6.0);     // 5
+  AddPiece(&model_proto, "cd", 4.0);     // 6
+  AddPiece(&model_proto, "a", 4.0);      // 7
+  AddPiece(&model_proto, "b", 1.9);      // 8
+
+  Model model(model_proto);
+  model.SetEncoderVersion(encoder_version_);
+  Model other(model_proto);
+  other.SetEncoderVersion(encoder_version_);
+
+  EncodeResult result;
+  std::unique_ptr<EncodeScratch> scratch;
+  for (const auto *text : {"abcdabcxd", "", "ab", "xxabcdxab", "a"}) {
+    model.EncodeWithScratch(text, &result, &scratch);
+    EXPECT_EQ(model.Encode(text), result);
+  }
+
+  // A scratch created by another model is replaced.
+  other.EncodeWithScratch("abcd", &result, &scratch);
+  EXPECT_EQ(other.Encode("abcd"), result);
+  if (scratch != nullptr) EXPECT_EQ(&other, scratch->owner());
+}
+
+TEST_P(UnigramModelTest, EncodeManyTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  const std::vector<std::string> chars = {"a", "b", "c", "あ", "い", "x"};
+  float score = -1.0;
+  for (int i = 0; i < 5; ++i) {
+    AddPiece(&model_proto, chars[i], score -= 0.1);
+    for (int j = 0; j < 5; ++j) {
+      AddPiece(&model_proto, chars[i] + chars[j], score -= 0.1);
+      if ((i + j) % 2 == 0) {
+        AddPiece(&model_proto, chars[i] + chars[j] + chars[i], score -= 0.1);
+      }
+    }
+  }
+  model_proto.mutable_pieces(5)->set_type(ModelProto::SentencePiece::UNUSED);
+  model_proto.mutable_pieces(9)->set_type(
+      ModelProto::SentencePiece::USER_DEFINED);
+
+  // More sentences than the lanes of the interleaved encoder, of various
+  // lengths, with empty ones and unknown characters ("x").
+  auto *mt = random::GetRandomGenerator();
+  std::uniform_int_distribution<int> dist(0, chars.size() - 1);
+  std::vector<std::string> sentences;
+  for (int n = 0; n < 100; ++n) {
+    std::string text;
+    for (int i = 0; i < (n * 7) % 31; ++i) text += chars[dist(*mt)];
+    sentences.push_back(text);
+  }
+  const std::vector<absl::string_view> views(sentences.begin(),
+                                             sentences.end());
+
+  for (const bool first_char_table : {false, true}) {
+    Model model(model_proto);
+    model.SetEncoderVersion(encoder_version_);
+    model.SetFirstCharTable(first_char_table);
+    std::vector<EncodeResult> results = {{{"stale", 0}}};
+    std::unique_ptr<EncodeScratch> scratch;
+    for (int trial = 0; trial < 2; ++trial) {
+      model.EncodeMany(views, &results, &scratch);
+      ASSERT_EQ(sentences.size(), results.size());
+      for (size_t i = 0; i < sentences.size(); ++i) {
+        EXPECT_EQ(model.Encode(sentences[i]), results[i]);
+      }
+    }
+  }
+}
+
+TEST_P(UnigramModelTest, RelocateTablesTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "a", -1.0);
+  AddPiece(&model_proto, "b", -2.0);
+  AddPiece(&model_proto, "ab", -0.5);
+  AddPiece(&model_proto, "bc", -1.5);
+  AddPiece(&model_proto, "c", -3.0);
+
+  Model model(model_proto);
+  model.SetEncoderVersion(encoder_version_);
+  const EncodeResult expected = model.Encode("abcabxbc");
+  for (const bool huge_pages : {true, false, true}) {
+    model.RelocateTables(huge_pages);
+    EXPECT_TRUE(model.status().ok());
+    EXPECT_EQ(expected, model.Encode("abcabxbc"));
+    EXPECT_EQ(5, model.PieceToId("ab"));
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(ParametrizedUnigramModelTests, UnigramModelTest,
                          test::ValuesIn(GetEncoderVersions()));
 
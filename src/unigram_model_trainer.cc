@@ -16,11 +16,17 @@
 
 #include <algorithm>
 #include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <numeric>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -29,10 +35,13 @@
 #include "pretokenizer_for_training.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/strings/numbers.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_replace.h"
 #include "third_party/absl/strings/str_split.h"
 #include "third_party/esaxx/esa.hxx"  // Suffix array library.
+#include "trace.h"
 #include "trainer_interface.h"
 #include "unicode_script.h"
 #include "util.h"
@@ -55,6 +64,45 @@ double Digamma(double x) {
   return result;
 }
 
+// Per-thread workload of a parallel pass over the sentences.
+class LoadStats {
+ public:
+  explicit LoadStats(int size) : seconds_(size, 0.0), sentences_(size, 0) {}
+
+  // Runs `func()` for `num_sentences` sentences on `slot` and records the
+  // elapsed time.
+  template <typename Func>
+  void Run(int slot, int64 num_sentences, Func &&func) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    seconds_[slot] += elapsed.count();
+    sentences_[slot] += num_sentences;
+  }
+
+  // Logs the busy time of the threads. `imbalance` is the ratio of the
+  // longest busy time to the average one.
+  void Log(absl::string_view name) const {
+    if (seconds_.size() <= 1) return;
+    const double total =
+        std::accumulate(seconds_.begin(), seconds_.end(), 0.0);
+    const auto minmax = std::minmax_element(seconds_.begin(), seconds_.end());
+    const double mean = total / seconds_.size();
+    const auto max_sentences =
+        std::max_element(sentences_.begin(), sentences_.end());
+    LOG(INFO) << name << " threads=" << seconds_.size()
+              << " busy_min=" << *minmax.first
+              << " busy_max=" << *minmax.second
+              << " max_sentences=" << *max_sentences << " imbalance="
+              << (mean > 0.0 ? *minmax.second / mean : 1.0);
+  }
+
+ private:
+  std::vector<double> seconds_;
+  std::vector<int64> sentences_;
+};
+
 template <typename IT>
 void ToLogProb(IT begin, IT end) {
   float sum = 0.0;
@@ -67,6 +115,10 @@ void ToLogProb(IT begin, IT end) {
   }
 }
 
+// Keeps the `size` elements of the highest scores among the pushed ones in
+// a heap whose top is the lowest kept element. Equal scores are ordered by
+// the smaller element first, so the kept elements do not depend on the order
+// of push(), and queues filled in parallel can be merged.
 template <class T>
 class BoundedPriorityQueue {
  public:
@@ -74,30 +126,364 @@ class BoundedPriorityQueue {
   ~BoundedPriorityQueue() = default;
 
   void push(T elem, int64 score) {
-    if (queue_.size() > 4 * size_) resize();
-    if (sorted && queue_.size() >= size_ && queue_[size_ - 1].second > score)
-      return;
-    queue_.emplace_back(elem, score);
+    if (size_ == 0) return;
+    const std::pair<T, int64> p(elem, score);
+    if (heap_.size() < size_) {
+      heap_.push_back(p);
+      std::push_heap(heap_.begin(), heap_.end(), Before);
+    } else if (Before(p, heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), Before);
+      heap_.back() = p;
+      std::push_heap(heap_.begin(), heap_.end(), Before);
+    }
+  }
+
+  // Pushes the elements kept by `other`.
+  void merge(const BoundedPriorityQueue &other) {
+    for (const auto &p : other.heap_) push(p.first, p.second);
   }
 
-  const std::vector<std::pair<T, int64>> &get() {
-    resize();
-    return queue_;
+  // Returns the kept elements in the descending order of the scores.
+  std::vector<std::pair<T, int64>> get() const {
+    std::vector<std::pair<T, int64>> result = heap_;
+    std::sort(result.begin(), result.end(), Before);
+    return result;
   }
 
  private:
-  void resize() {
-    std::sort(queue_.begin(), queue_.end(), [](const auto &p1, const auto &p2) {
-      return (p1.second > p2.second ||
-              (p1.second == p2.second && p1.first < p2.first));
-    });
-    sorted = true;
-    if (queue_.size() > size_) queue_.resize(size_);
+  // Returns true if `p1` ranks before `p2`.
+  static bool Before(const std::pair<T, int64> &p1,
+                     const std::pair<T, int64> &p2) {
+    return (p1.second > p2.second ||
+            (p1.second == p2.second && p1.first < p2.first));
   }
 
-  bool sorted = false;
   size_t size_ = 0;
-  std::vector<std::pair<T, int64>> queue_;
+  std::vector<std::pair<T, int64>> heap_;
+};
+
+// Builds the suffix array of `text` into `SA` by prefix doubling. Each round
+// sorts the suffixes by (rank[i], rank[i + h]) with a parallel merge sort and
+// doubles h until all the ranks are unique. It does O(n log n) work per round,
+// more than SA-IS, but the rounds scale with the number of threads.
+// `L`, `R` and `D` must have the size of `text` and are used as scratch, as
+// they are overwritten by suffixtree() afterwards anyway.
+template <typename T>
+void MakeSuffixArrayParallel(const std::vector<char32> &text,
+                             ThreadPool *pool, std::vector<T> *SA,
+                             std::vector<T> *L, std::vector<T> *R,
+                             std::vector<T> *D) {
+  const int64 n = text.size();
+  std::vector<T> *const output = SA;
+  std::vector<T> *rank = R;
+  std::vector<T> *next_rank = D;
+  std::vector<T> *buffer = L;
+  const int64 num_chunks = std::max<int64>(
+      1, std::min<int64>(pool->size(), n / 1024));
+  const int64 chunk_size = (n + num_chunks - 1) / num_chunks;
+
+  // Ranks are the first character at first, then the position of the first
+  // suffix of the group in the sorted order.
+  pool->ParallelFor(n, 0, [&](int32, int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      (*SA)[i] = i;
+      (*rank)[i] = text[i];
+    }
+  });
+
+  std::vector<int64> last_heads(num_chunks), num_heads(num_chunks);
+  for (int64 h = 1;; h *= 2) {
+    const auto key = [&](T i) {
+      return std::make_pair((*rank)[i], i + h < n ? (*rank)[i + h] : T(-1));
+    };
+    const auto less = [&](T a, T b) { return key(a) < key(b); };
+
+    pool->ParallelFor(num_chunks, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 c = begin; c < end; ++c) {
+        std::sort(SA->begin() + std::min(n, c * chunk_size),
+                  SA->begin() + std::min(n, (c + 1) * chunk_size), less);
+      }
+    });
+    for (int64 width = chunk_size; width < n; width *= 2) {
+      const int64 num_merges = (n + 2 * width - 1) / (2 * width);
+      pool->ParallelFor(num_merges, 1, [&](int32, int64 begin, int64 end) {
+        for (int64 m = begin; m < end; ++m) {
+          const int64 lo = m * 2 * width;
+          const int64 mid = std::min(n, lo + width);
+          const int64 hi = std::min(n, lo + 2 * width);
+          std::merge(SA->begin() + lo, SA->begin() + mid, SA->begin() + mid,
+                     SA->begin() + hi, buffer->begin() + lo, less);
+        }
+      });
+      std::swap(SA, buffer);
+    }
+
+    // A suffix starts a new group when its key differs from the previous
+    // one. The chunks are ranked in parallel after finding the last group
+    // head before each of them.
+    const auto is_head = [&](int64 j) {
+      return j == 0 || key((*SA)[j - 1]) != key((*SA)[j]);
+    };
+    pool->ParallelFor(num_chunks, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 c = begin; c < end; ++c) {
+        last_heads[c] = -1;
+        num_heads[c] = 0;
+        for (int64 j = c * chunk_size; j < std::min(n, (c + 1) * chunk_size);
+             ++j) {
+          if (is_head(j)) {
+            last_heads[c] = j;
+            ++num_heads[c];
+          }
+        }
+      }
+    });
+    const int64 total_heads =
+        std::accumulate(num_heads.begin(), num_heads.end(), int64(0));
+    for (int64 c = 1; c < num_chunks; ++c) {
+      last_heads[c] = std::max(last_heads[c], last_heads[c - 1]);
+    }
+    pool->ParallelFor(num_chunks, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 c = begin; c < end; ++c) {
+        int64 head = c == 0 ? 0 : last_heads[c - 1];
+        for (int64 j = c * chunk_size; j < std::min(n, (c + 1) * chunk_size);
+             ++j) {
+          if (is_head(j)) head = j;
+          (*next_rank)[(*SA)[j]] = head;
+        }
+      }
+    });
+    std::swap(rank, next_rank);
+    if (total_heads == n) break;
+  }
+
+  // The merge rounds may have left the final order in `L`.
+  if (SA != output) output->swap(*SA);
+}
+
+// Files of a distributed job. See Trainer::RunDistributedEStep().
+constexpr char kEStepRequest[] = "estep";
+constexpr char kPruneRequest[] = "prune";
+constexpr char kStatsMagic[] = "SPMSTAT1";
+constexpr size_t kStatsMagicSize = 8;
+
+std::string RequestFile(absl::string_view dir, int64 seq,
+                        absl::string_view kind) {
+  return util::JoinPath(
+      dir, absl::StrCat("request.", std::to_string(seq), ".", kind));
+}
+
+std::string ResultFile(absl::string_view dir, int64 seq, int shard) {
+  return util::JoinPath(
+      dir, absl::StrCat("result.", std::to_string(seq), ".", shard));
+}
+
+std::string DoneFile(absl::string_view dir) {
+  return util::JoinPath(dir, "done");
+}
+
+bool FileExists(absl::string_view filename) {
+  return filesystem::NewReadableFile(filename, true)->status().ok();
+}
+
+// How often the files of the other shards are looked for.
+constexpr auto kPollInterval = std::chrono::milliseconds(10);
+
+// Waits until `filename` is written, and reads it.
+util::Status WaitAndReadFile(absl::string_view filename, std::string *blob) {
+  while (!FileExists(filename)) std::this_thread::sleep_for(kPollInterval);
+  auto input = filesystem::NewReadableFile(filename, true);
+  RETURN_IF_ERROR(input->status());
+  CHECK_OR_RETURN(input->ReadAll(blob)) << "Cannot read " << filename;
+  return util::OkStatus();
+}
+
+void AppendFloat(float value, std::string *output) {
+  uint32 bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  string_util::AppendUInt32(bits, output);
+}
+
+bool ConsumeFloat(absl::string_view *input, float *value) {
+  uint32 bits = 0;
+  if (!string_util::ConsumeUInt32(input, &bits)) return false;
+  memcpy(value, &bits, sizeof(bits));
+  return true;
+}
+
+void AppendInt64(int64 value, std::string *output) {
+  string_util::AppendUInt32(static_cast<uint64>(value) & 0xffffffff, output);
+  string_util::AppendUInt32(static_cast<uint64>(value) >> 32, output);
+}
+
+bool ConsumeInt64(absl::string_view *input, int64 *value) {
+  uint32 low = 0, high = 0;
+  if (!string_util::ConsumeUInt32(input, &low) ||
+      !string_util::ConsumeUInt32(input, &high)) {
+    return false;
+  }
+  *value = static_cast<int64>(static_cast<uint64>(high) << 32 | low);
+  return true;
+}
+
+void AppendFloats(const std::vector<float> &values, std::string *output) {
+  string_util::AppendUInt32(values.size(), output);
+  for (const float value : values) AppendFloat(value, output);
+}
+
+bool ConsumeFloats(absl::string_view *input, std::vector<float> *values) {
+  uint32 size = 0;
+  if (!string_util::ConsumeUInt32(input, &size) ||
+      input->size() < static_cast<size_t>(size) * sizeof(uint32)) {
+    return false;
+  }
+  values->resize(size);
+  for (float &value : *values) ConsumeFloat(input, &value);
+  return true;
+}
+
+// Result files: <magic (8byte)> followed by the fields of the statistics.
+// The integers and floats are little-endian.
+std::string SerializeEStepStats(const EStepStats &stats) {
+  std::string blob(kStatsMagic, kStatsMagicSize);
+  AppendFloats(stats.expected, &blob);
+  AppendFloat(stats.objective, &blob);
+  AppendInt64(stats.num_tokens, &blob);
+  AppendInt64(stats.sentence_freq, &blob);
+  return blob;
+}
+
+std::string SerializePruneStats(const PruneStats &stats) {
+  std::string blob(kStatsMagic, kStatsMagicSize);
+  AppendFloat(stats.vsum, &blob);
+  AppendFloats(stats.freq, &blob);
+  AppendFloats(stats.sentence_freq, &blob);
+  return blob;
+}
+
+bool ConsumeStatsMagic(absl::string_view *input) {
+  if (input->substr(0, kStatsMagicSize) !=
+      absl::string_view(kStatsMagic, kStatsMagicSize)) {
+    return false;
+  }
+  input->remove_prefix(kStatsMagicSize);
+  return true;
+}
+
+util::Status ParseEStepStats(absl::string_view blob, EStepStats *stats) {
+  CHECK_OR_RETURN(ConsumeStatsMagic(&blob) &&
+                  ConsumeFloats(&blob, &stats->expected) &&
+                  ConsumeFloat(&blob, &stats->objective) &&
+                  ConsumeInt64(&blob, &stats->num_tokens) &&
+                  ConsumeInt64(&blob, &stats->sentence_freq) && blob.empty())
+      << "Broken E step statistics.";
+  return util::OkStatus();
+}
+
+util::Status ParsePruneStats(absl::string_view blob, PruneStats *stats) {
+  CHECK_OR_RETURN(ConsumeStatsMagic(&blob) &&
+                  ConsumeFloat(&blob, &stats->vsum) &&
+                  ConsumeFloats(&blob, &stats->freq) &&
+                  ConsumeFloats(&blob, &stats->sentence_freq) && blob.empty())
+      << "Broken pruning statistics.";
+  return util::OkStatus();
+}
+
+// Tells the workers of a distributed job to exit when it goes out of
+// scope, also when the coordinator fails.
+class ScopedDoneFile {
+ public:
+  explicit ScopedDoneFile(std::string filename)
+      : filename_(std::move(filename)) {}
+  ~ScopedDoneFile() {
+    if (!filename_.empty()) WriteFileAtomically(filename_, "").IgnoreError();
+  }
+
+ private:
+  std::string filename_;
+};
+
+// Partial sums of a partition of the E step in the precision T. Add()
+// populates the marginals of the nodes of a sentence, and Merge() adds the expected
+// counts [begin, end) of another partition.
+template <typename T>
+class PlainEStepSum {
+ public:
+  explicit PlainEStepSum(size_t size) : expected_(size, 0.0) {}
+
+  float Add(unigram::Model::MarginalBuffers *buffers, float freq) {
+    return buffers->PopulateMarginal(freq, &expected_);
+  }
+  void AddObjective(float value) { objective_ += value; }
+
+  void Merge(const PlainEStepSum &other, int64 begin, int64 end) {
+    for (int64 k = begin; k < end; ++k) expected_[k] += other.expected_[k];
+  }
+  void MergeObjective(const PlainEStepSum &other) {
+    objective_ += other.objective_;
+  }
+
+  size_t size() const { return expected_.size(); }
+  float objective() const { return objective_; }
+  std::vector<float> TakeExpected() {
+    if constexpr (std::is_same<T, float>::value) {
+      return std::move(expected_);
+    } else {
+      return std::vector<float>(expected_.begin(), expected_.end());
+    }
+  }
+
+ private:
+  std::vector<T> expected_;
+  T objective_ = 0.0;
+};
+
+// Partial sums of a partition of the E step with the Kahan compensated
+// summation in float. The compensation is subtracted at the end.
+class KahanEStepSum {
+ public:
+  explicit KahanEStepSum(size_t size)
+      : expected_(size, 0.0), compensation_(size, 0.0) {}
+
+  float Add(unigram::Model::MarginalBuffers *buffers, float freq) {
+    return buffers->PopulateMarginal(freq, &expected_, &compensation_);
+  }
+  void AddObjective(float value) {
+    KahanAdd(value, &objective_, &objective_compensation_);
+  }
+
+  void Merge(const KahanEStepSum &other, int64 begin, int64 end) {
+    for (int64 k = begin; k < end; ++k) {
+      KahanAdd(other.expected_[k], &expected_[k], &compensation_[k]);
+      KahanAdd(-other.compensation_[k], &expected_[k], &compensation_[k]);
+    }
+  }
+  void MergeObjective(const KahanEStepSum &other) {
+    KahanAdd(other.objective_, &objective_, &objective_compensation_);
+    KahanAdd(-other.objective_compensation_, &objective_,
+             &objective_compensation_);
+  }
+
+  size_t size() const { return expected_.size(); }
+  float objective() const { return objective_ - objective_compensation_; }
+  std::vector<float> TakeExpected() {
+    for (size_t k = 0; k < expected_.size(); ++k) {
+      expected_[k] -= compensation_[k];
+    }
+    return std::move(expected_);
+  }
+
+ private:
+  static void KahanAdd(float value, float *sum, float *compensation) {
+    const float y = value - *compensation;
+    const float t = *sum + y;
+    *compensation = (t - *sum) - y;
+    *sum = t;
+  }
+
+  std::vector<float> expected_;
+  std::vector<float> compensation_;
+  float objective_ = 0.0;
+  float objective_compensation_ = 0.0;
 };
 
 }  // namespace
@@ -113,10 +499,32 @@ const TrainerModel::SentencePieces &TrainerModel::GetSentencePieces() const {
 }
 
 void TrainerModel::SetSentencePieces(SentencePieces &&sentencepieces) {
+  CHECK(!sentencepieces.empty());
+  // The M steps mostly change the scores only. The trie and the piece
+  // strings are kept then, and the scores are updated in place.
+  const bool same_pieces =
+      trie_ && sentencepieces.size() == sentencepieces_.size() &&
+      std::equal(sentencepieces.begin(), sentencepieces.end(),
+                 sentencepieces_.begin(),
+                 [](const std::pair<std::string, float> &a,
+                    const std::pair<std::string, float> &b) {
+                   return a.first == b.first;
+                 });
   sentencepieces_ = std::move(sentencepieces);
-  CHECK(!sentencepieces_.empty());
 
   min_score_ = FLT_MAX;
+  if (same_pieces) {
+    for (size_t i = 0; i < sentencepieces_.size(); ++i) {
+      const float score = sentencepieces_[i].second;
+      CHECK(!std::isnan(score));
+      min_score_ = std::min(min_score_, score);
+      model_proto_data_.mutable_pieces(i)->set_score(score);
+      piece_info_[i].score = score;
+      piece_attributes_[i].score = score;
+    }
+    return;
+  }
+
   model_proto_data_.Clear();
   model_proto_ = &model_proto_data_;
   std::vector<std::pair<absl::string_view, int>> pieces;
@@ -132,6 +540,7 @@ void TrainerModel::SetSentencePieces(SentencePieces &&sentencepieces) {
     piece->set_score(score);
   }
 
+  InitializePieceInfo();
   BuildTrie(&pieces);
   CHECK(status().ok());
 }
@@ -142,6 +551,104 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePieces() {
              : MakeSeedSentencePiecesInternal<int32>();
 }
 
+template <typename node_int_type>
+std::vector<Trainer::SubstringCount> Trainer::ExtractFrequentSubstrings(
+    const std::vector<char32> &array) const {
+  CHECK_LE(array.size(),
+           static_cast<size_t>(std::numeric_limits<node_int_type>::max()))
+      << "Input corpus too large, try with train_extremely_large_corpus=true";
+  const node_int_type n = array.size();
+
+  std::vector<node_int_type> SA(n);  // suffix array
+  std::vector<node_int_type> L(n);   // left boundaries of internal node
+  std::vector<node_int_type> R(n);   // right boundaries of internal node
+  std::vector<node_int_type> D(n);   // depths of internal node
+
+  // Makes a suffix array to extract all sub strings occurring
+  // more than 2 times in the sentence.
+  constexpr node_int_type kAlphabetSize = 0x110000;  // All UCS4 range.
+  node_int_type node_num = 0;
+  LOG(INFO) << "Making suffix array...";
+  auto start = std::chrono::steady_clock::now();
+  const auto elapsed = [&start]() {
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    return seconds.count();
+  };
+  {
+    TrainingMetrics::Scope phase(&metrics_, "seed_suffix_array");
+    if (suffix_array_backend_ == SuffixArrayBackend::kParallelDoubling) {
+      MakeSuffixArrayParallel(array, GetThreadPool(), &SA, &L, &R, &D);
+      node_num = esaxx_private::suffixtree(array.begin(), SA.begin(),
+                                           L.begin(), R.begin(), D.begin(), n);
+    } else {
+      CHECK_EQ(0, esaxx(array.begin(), SA.begin(), L.begin(), R.begin(),
+                        D.begin(), n, kAlphabetSize, node_num));
+    }
+  }
+
+  LOG(INFO) << "Made suffix array in " << elapsed() << " sec. "
+            << "Extracting frequent sub strings... node_num=" << node_num;
+  const size_t seed_size =
+      static_cast<size_t>(trainer_spec_.seed_sentencepiece_size());
+  auto *pool = GetThreadPool();
+
+  // The properties of the characters are looked up once for the whole
+  // corpus rather than for every substring. A sentence boundary is an
+  // invalid character, so no substring spans two sentences.
+  std::vector<CharProperties> properties(array.size());
+  pool->ParallelFor(array.size(), 0, [&](int32, int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      properties[i] = GetCharProperties(array[i]);
+    }
+  });
+
+  // The internal nodes are scanned in parallel. Every worker keeps its own
+  // top seed_size nodes, identified by their index, and the queues are
+  // merged afterwards. The pieces are only made for the final nodes.
+  std::vector<BoundedPriorityQueue<node_int_type>> queues(
+      std::max<int32>(1, pool->size()),
+      BoundedPriorityQueue<node_int_type>(seed_size));
+  pool->ParallelFor(node_num, 0, [&](int32 slot, int64 begin, int64 end) {
+    auto &queue = queues[slot];
+    for (node_int_type i = begin; i < end; ++i) {
+      const node_int_type offset = SA[L[i]];
+      const node_int_type len = D[i];
+      if (len <= 1) {
+        continue;
+      }
+      if (!IsValidSentencePiece(&properties[offset], len)) {
+        continue;
+      }
+
+      // character-wise coverage is the default score.
+      const node_int_type freq = R[i] - L[i];
+      const node_int_type score = freq * len;
+      queue.push(i, score);
+    }
+  });
+  auto &queue = queues[0];
+  for (size_t k = 1; k < queues.size(); ++k) queue.merge(queues[k]);
+
+  std::vector<SubstringCount> substrings;
+  for (const auto &p : queue.get()) {
+    const node_int_type offset = SA[L[p.first]];
+    const node_int_type len = D[p.first];
+    CHECK_GT(len, 0);
+    const char32 *begin = &array[offset];
+    const char32 *end = &array[offset + len];
+    CHECK(IsValidSentencePiece(&properties[offset], len));  // just in case.
+    const UnicodeText uw(begin, end);
+    substrings.push_back({string_util::UnicodeTextToUTF8(uw), len,
+                          static_cast<int64>(R[p.first] - L[p.first])});
+  }
+  LOG(INFO) << "Extracted " << substrings.size() << " sub strings in "
+            << elapsed() << " sec.";
+
+  return substrings;
+}
+
 // Returns seed sentencepieces for EM training.
 template <typename node_int_type>
 TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
@@ -152,15 +659,25 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
   // Pretokenizer is used as a constraint of piece extractions.
   const auto *pretokenizer = SentencePieceTrainer::GetPretokenizerForTraining();
 
-  auto pretokenize_or_rewrite = [&](std::pair<std::string, int64> *w) {
+  // Sentences without the pretokenization delimiter, which replace
+  // `sentences_` for EM training.
+  Sentences rewritten;
+
+  // The pretokenizer runs on all sentences at once on the thread pool.
+  std::vector<std::vector<std::string>> tokens;
+  if (pretokenizer) tokens = PreTokenizeSentences(*pretokenizer);
+
+  auto pretokenize_or_rewrite = [&](size_t i) {
+    const auto w = sentences_[i];
     if (pretokenizer) {
       std::vector<char32> chars;
-      for (const auto &w : pretokenizer->PreTokenize(w->first)) {
+      for (const auto &w : tokens[i]) {
         for (const auto &c : string_util::UTF8ToUnicodeText(w)) {
           chars.push_back(c);
         }
         chars.push_back(kSentenceBoundary);
       }
+      std::vector<std::string>().swap(tokens[i]);
       return chars;
     } else if (!trainer_spec_.pretokenization_delimiter().empty()) {
       // When delimiter is specified, tokenize the input with the delimiter.
@@ -168,17 +685,18 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
       // rewrite the original sentence.
       std::vector<char32> chars;
       absl::string_view delimiter = trainer_spec_.pretokenization_delimiter();
-      for (const auto &w : absl::StrSplit(w->first, delimiter)) {
+      for (const auto &w : absl::StrSplit(w.first, delimiter)) {
         for (const auto &c : string_util::UTF8ToUnicodeText(w)) {
           chars.push_back(c);
         }
         chars.push_back(kSentenceBoundary);
       }
       // Removes the delimiter.
-      w->first = absl::StrReplaceAll(w->first, {{delimiter, ""}});
+      rewritten.emplace_back(absl::StrReplaceAll(w.first, {{delimiter, ""}}),
+                             w.second);
       return chars;
     }
-    return string_util::UTF8ToUnicodeText(w->first);
+    return string_util::UTF8ToUnicodeText(w.first);
   };
 
   // Merges all sentences into one array with 0x0000 delimiter.
@@ -187,12 +705,56 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
 
   const bool is_tsv = trainer_spec_.input_format() == "tsv";
 
-  for (auto &w : sentences_) {
-    const auto ut = pretokenize_or_rewrite(&w);
+  // When the array does not fit node_int_type, or is larger than
+  // seed_shard_size_, the frequent substrings are extracted from shards of
+  // the corpus with int32 suffix arrays, and their frequencies are summed.
+  // The byte size of the sentences bounds the number of characters.
+  int64 shard_size = seed_shard_size_;
+  if (shard_size == 0 && trainer_spec_.seed_sentencepieces_file().empty()) {
+    uint64 max_array_size = 0;
+    for (const auto &w : sentences_) {
+      max_array_size += (w.first.size() + 1) * (is_tsv ? 2 : 1);
+    }
+    if (max_array_size >
+        static_cast<uint64>(std::numeric_limits<node_int_type>::max())) {
+      shard_size = kSeedShardSize;
+    }
+  }
+  if (!trainer_spec_.seed_sentencepieces_file().empty()) shard_size = 0;
+
+  const size_t seed_size =
+      static_cast<size_t>(trainer_spec_.seed_sentencepiece_size());
+  // Summed frequencies and lengths of the substrings of the shards.
+  absl::flat_hash_map<std::string, std::pair<int64, int64>> shard_substrings;
+  size_t num_shards = 0;
+  auto extract_shard = [&]() {
+    LOG(INFO) << "Extracting seed pieces from shard " << num_shards++
+              << " of " << array.size() << " characters";
+    for (auto &s : ExtractFrequentSubstrings<int32>(array)) {
+      auto &entry = shard_substrings[s.piece];
+      entry.first += s.freq;
+      entry.second = s.length;
+    }
+    array.clear();
+    // Keeps the merged candidates bounded, dropping the lowest scores.
+    if (shard_substrings.size() > 4 * seed_size) {
+      std::vector<std::pair<std::string, int64>> scores;
+      for (const auto &it : shard_substrings) {
+        scores.emplace_back(it.first, it.second.first * it.second.second);
+      }
+      scores = Sorted(scores);
+      for (size_t i = 2 * seed_size; i < scores.size(); ++i) {
+        shard_substrings.erase(scores[i].first);
+      }
+    }
+  };
+
+  for (size_t i = 0; i < sentences_.size(); ++i) {
+    const auto ut = pretokenize_or_rewrite(i);
     for (const auto &c : ut) {
       array.push_back(c);
       if (c != kUNKChar && c != kSentenceBoundary) {
-        all_chars[string_util::UnicodeCharToUTF8(c)] += w.second;
+        all_chars[string_util::UnicodeCharToUTF8(c)] += sentences_[i].second;
       }
     }
     array.push_back(kSentenceBoundary);  // sentence boundary marker.
@@ -205,6 +767,16 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
       for (const auto &c : ut) array.push_back(c);
       array.push_back(kSentenceBoundary);
     }
+
+    if (shard_size > 0 && array.size() >= static_cast<size_t>(shard_size)) {
+      extract_shard();
+    }
+  }
+
+  if (shard_size > 0 && !array.empty()) extract_shard();
+
+  if (!pretokenizer && !trainer_spec_.pretokenization_delimiter().empty()) {
+    sentences_ = std::move(rewritten);
   }
 
   // all_chars must be included in the seed sentencepieces.
@@ -247,63 +819,23 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
 
     LOG(INFO) << "Initialized " << seed_sentencepieces.size()
               << " seed sentencepieces from file.";
-  } else {
-    CHECK_LE(array.size(),
-             static_cast<size_t>(std::numeric_limits<node_int_type>::max()))
-        << "Input corpus too large, try with train_extremely_large_corpus=true";
-    const node_int_type n = array.size();
-
-    std::vector<node_int_type> SA(n);  // suffix array
-    std::vector<node_int_type> L(n);   // left boundaries of internal node
-    std::vector<node_int_type> R(n);   // right boundaries of internal node
-    std::vector<node_int_type> D(n);   // depths of internal node
-
-    // Makes a suffix array to extract all sub strings occurring
-    // more than 2 times in the sentence.
-    constexpr node_int_type kAlphabetSize = 0x110000;  // All UCS4 range.
-    node_int_type node_num = 0;
-    LOG(INFO) << "Making suffix array...";
-    CHECK_EQ(0, esaxx(array.begin(), SA.begin(), L.begin(), R.begin(),
-                      D.begin(), n, kAlphabetSize, node_num));
-
-    LOG(INFO) << "Extracting frequent sub strings... node_num=" << node_num;
-    BoundedPriorityQueue<node_int_type> queue(
-        static_cast<size_t>(trainer_spec_.seed_sentencepiece_size()));
-
-    for (node_int_type i = 0; i < node_num; ++i) {
-      const node_int_type offset = SA[L[i]];
-      const node_int_type len = D[i];
-      if (len <= 1) {
-        continue;
-      }
-      const char32 *begin = &array[offset];
-      const char32 *end = &array[offset + len];
-      // Skips if a substring contains a sentence boundary.
-      if (std::find(begin, end, kSentenceBoundary) != end) {
-        continue;
-      }
-      const UnicodeText uw(begin, end);
-      if (!IsValidSentencePiece(uw)) {
-        continue;
-      }
-
-      // character-wise coverage is the default score.
-      const node_int_type freq = R[i] - L[i];
-      const node_int_type score = freq * len;
-      queue.push(i, score);
+  } else if (shard_size > 0) {
+    std::vector<std::pair<std::string, int64>> scores;
+    for (const auto &it : shard_substrings) {
+      scores.emplace_back(it.first, it.second.first * it.second.second);
     }
-
-    for (const auto &p : queue.get()) {
-      const node_int_type offset = SA[L[p.first]];
-      const node_int_type len = D[p.first];
-      CHECK_GT(len, 0);
-      const char32 *begin = &array[offset];
-      const char32 *end = &array[offset + len];
-      const UnicodeText uw(begin, end);
-      const std::string w = string_util::UnicodeTextToUTF8(uw);
-      CHECK(IsValidSentencePiece(uw));  // just in case.
-      CHECK(!port::ContainsKey(all_chars, w));
-      seed_sentencepieces.emplace_back(w, p.second);
+    shard_substrings.clear();
+    scores = Sorted(scores);
+    if (scores.size() > seed_size) scores.resize(seed_size);
+    for (auto &it : scores) {
+      CHECK(!port::ContainsKey(all_chars, it.first));
+      seed_sentencepieces.emplace_back(std::move(it.first), it.second);
+    }
+    LOG(INFO) << "Merged the seed pieces of " << num_shards << " shards";
+  } else {
+    for (auto &s : ExtractFrequentSubstrings<node_int_type>(array)) {
+      CHECK(!port::ContainsKey(all_chars, s.piece));
+      seed_sentencepieces.emplace_back(std::move(s.piece), s.freq * s.length);
     }
   }
 
@@ -315,71 +847,222 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePiecesInternal() {
   return seed_sentencepieces;
 }
 
+const std::vector<int64> &Trainer::GetSchedule() const {
+  if (schedule_.size() != sentences_.size()) {
+    schedule_.resize(sentences_.size());
+    std::iota(schedule_.begin(), schedule_.end(), 0);
+    std::stable_sort(schedule_.begin(), schedule_.end(),
+                     [this](int64 a, int64 b) {
+                       return sentences_[a].first.size() >
+                              sentences_[b].first.size();
+                     });
+  }
+  return schedule_;
+}
+
+void Trainer::LatticeCache::Resize(int num_partitions) {
+  if (partitions.size() == static_cast<size_t>(num_partitions)) return;
+  partitions.assign(num_partitions, Partition());
+  for (auto &partition : partitions) partition.offsets.push_back(0);
+}
+
+void Trainer::LatticeCache::PopulateNodes(const TrainerModel &model, int n,
+                                          size_t k, Lattice *lattice) {
+  auto &partition = partitions[n];
+  const auto &offsets = partition.offsets;
+  if (k + 1 < offsets.size()) {
+    model.PopulateNodes(partition.spans.data() + offsets[k],
+                        partition.spans.data() + offsets[k + 1], lattice);
+  } else if (k + 1 == offsets.size() &&
+             partition.spans.size() * sizeof(TrainerModel::NodeSpan) <
+                 size / partitions.size()) {
+    model.PopulateNodes(lattice, &partition.spans);
+    partition.offsets.push_back(partition.spans.size());
+  } else {
+    model.PopulateNodes(lattice);
+  }
+}
+
+void Trainer::LatticeCache::PopulateForward(
+    const TrainerModel &model, int n, size_t k, absl::string_view sentence,
+    TrainerModel::MarginalBuffers *buffers) {
+  auto &partition = partitions[n];
+  const auto &offsets = partition.offsets;
+  if (k + 1 < offsets.size()) {
+    model.PopulateForward(sentence, partition.spans.data() + offsets[k],
+                          partition.spans.data() + offsets[k + 1], buffers);
+  } else if (k + 1 == offsets.size() &&
+             partition.spans.size() * sizeof(TrainerModel::NodeSpan) <
+                 size / partitions.size()) {
+    model.PopulateForward(sentence, buffers, &partition.spans);
+    partition.offsets.push_back(partition.spans.size());
+  } else {
+    model.PopulateForward(sentence, buffers);
+  }
+}
+
+void Trainer::LatticeCache::Remap(
+    const TrainerModel::SentencePieces &pieces,
+    const TrainerModel::SentencePieces &new_pieces) {
+  absl::flat_hash_map<absl::string_view, int> new_ids;
+  for (size_t i = 0; i < new_pieces.size(); ++i) {
+    new_ids[new_pieces[i].first] = i;
+  }
+  std::vector<int> ids(pieces.size(), -1);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    const auto it = new_ids.find(pieces[i].first);
+    if (it != new_ids.end()) ids[i] = it->second;
+  }
+  for (auto &partition : partitions) {
+    for (auto &span : partition.spans) {
+      if (span.id >= 0) span.id = ids[span.id];
+    }
+  }
+}
+
 std::vector<float> Trainer::RunEStep(const TrainerModel &model, float *obj,
-                                     int64 *num_tokens) const {
-  std::vector<std::vector<float>> expected(trainer_spec_.num_threads());
-  std::vector<float> objs(trainer_spec_.num_threads(), 0.0);
-  std::vector<int64> ntokens(trainer_spec_.num_threads(), 0.0);
+                                     int64 *num_tokens, LatticeCache *cache,
+                                     int64 batch, int64 num_batches) const {
+  SPM_TRACE_SPAN("e_step");
+  switch (estep_accumulator_) {
+    case EStepAccumulator::kDouble:
+      return RunEStepInternal<PlainEStepSum<double>>(
+          model, obj, num_tokens, cache, batch, num_batches);
+    case EStepAccumulator::kKahan:
+      return RunEStepInternal<KahanEStepSum>(model, obj, num_tokens, cache,
+                                             batch, num_batches);
+    default:
+      return RunEStepInternal<PlainEStepSum<float>>(
+          model, obj, num_tokens, cache, batch, num_batches);
+  }
+}
 
-  auto pool = std::make_unique<ThreadPool>(trainer_spec_.num_threads());
-  pool->StartWorkers();
+template <typename Sum>
+std::vector<float> Trainer::RunEStepInternal(const TrainerModel &model,
+                                             float *obj, int64 *num_tokens,
+                                             LatticeCache *cache, int64 batch,
+                                             int64 num_batches) const {
+  auto *pool = GetThreadPool();
+  std::vector<Sum> sums(pool->size(), Sum(model.GetPieceSize()));
+  std::vector<int64> ntokens(pool->size(), 0.0);
+
+  // Executes E step in parallel. Partition n takes every num_partitions-th
+  // sentence of the longest-first schedule, which balances the lattice
+  // sizes and keeps the floating point sums independent of thread timing.
+  // A batch takes every num_batches-th sentence of each partition.
+  const auto &schedule = GetSchedule();
+  const int64 num_partitions = pool->size();
+  const int64 first = batch * num_partitions;
+  const int64 stride = num_partitions * num_batches;
 
   int64 all_sentence_freq = 0;
+  int64 batch_sentence_freq = 0;
   for (const auto &w : sentences_) {
     all_sentence_freq += w.second;
   }
-
-  // Executes E step in parallel
-  for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-    pool->Schedule([&, n]() {
-      Lattice lattice;
-      expected[n].resize(model.GetPieceSize(), 0.0);
-      for (size_t i = n; i < sentences_.size();
-           i += trainer_spec_.num_threads()) {
-        const std::string &w = sentences_[i].first;
-        const int64 freq = sentences_[i].second;
-        lattice.SetSentence(w);
-        model.PopulateNodes(&lattice);
-        const float Z = lattice.PopulateMarginal(freq, &expected[n]);
-        ntokens[n] += lattice.Viterbi().first.size();
-        CHECK(!std::isnan(Z))
-            << "likelihood is NAN. Input sentence may be too long";
-        objs[n] -= Z / all_sentence_freq;
-      }
-    });
+  for (int64 k = first; k < schedule.size(); k += stride) {
+    const int64 end = std::min<int64>(k + num_partitions, schedule.size());
+    for (int64 i = k; i < end; ++i) {
+      batch_sentence_freq += sentences_[schedule[i]].second;
+    }
   }
-  pool.reset(nullptr);
-
-  // Merges expectations
-  for (int n = 1; n < trainer_spec_.num_threads(); ++n) {
-    objs[0] += objs[n];
-    ntokens[0] += ntokens[n];
-    for (size_t k = 0; k < expected[0].size(); ++k) {
-      expected[0][k] += expected[n][k];
+  if (batch_sentence_freq == 0) batch_sentence_freq = 1;
+
+  if (cache != nullptr) cache->Resize(num_partitions);
+  LoadStats stats(num_partitions);
+  pool->ParallelFor(num_partitions, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 n = begin; n < end; ++n) {
+      const int64 num_sentences =
+          first + n < schedule.size()
+              ? (schedule.size() - first - n + stride - 1) / stride
+              : 0;
+      stats.Run(n, num_sentences, [&]() {
+        SPM_TRACE_SPAN("e_step_partition");
+        TrainerModel::MarginalBuffers buffers;
+        for (int64 k = first + n; k < schedule.size(); k += stride) {
+          const int64 i = schedule[k];
+          const absl::string_view w = sentences_[i].first;
+          const int64 freq = sentences_[i].second;
+          if (cache != nullptr) {
+            cache->PopulateForward(model, n, k / num_partitions, w, &buffers);
+          } else {
+            model.PopulateForward(w, &buffers);
+          }
+          const float Z = sums[n].Add(&buffers, freq);
+          ntokens[n] += buffers.viterbi_size();
+          CHECK(!std::isnan(Z))
+              << "likelihood is NAN. Input sentence may be too long";
+          sums[n].AddObjective(-Z / batch_sentence_freq);
+        }
+      });
     }
+  });
+  stats.Log("E step load:");
+
+  // Merges expectations. The threads sum disjoint ranges of piece ids, each
+  // in the order of the partitions, so the result does not depend on the
+  // number of threads touching it. The partials are released as soon as
+  // the sum is done.
+  for (int n = 1; n < pool->size(); ++n) {
+    sums[0].MergeObjective(sums[n]);
+    ntokens[0] += ntokens[n];
   }
+  pool->ParallelFor(sums[0].size(), 0, [&](int32, int64 begin, int64 end) {
+    SPM_TRACE_SPAN("e_step_merge");
+    for (int n = 1; n < pool->size(); ++n) {
+      sums[0].Merge(sums[n], begin, end);
+    }
+  });
+  sums.resize(1, Sum(0));
 
-  *obj = objs[0];
+  *obj = sums[0].objective();
   *num_tokens = ntokens[0];
   CHECK(!std::isnan(*obj));
 
-  return expected[0];
+  auto expected = sums[0].TakeExpected();
+  if (num_batches > 1) {
+    const double scale = 1.0 * all_sentence_freq / batch_sentence_freq;
+    for (auto &e : expected) e *= scale;
+    *num_tokens = static_cast<int64>(*num_tokens * scale);
+  }
+  return expected;
+}
+
+// static
+void Trainer::InterpolateExpected(
+    const TrainerModel::SentencePieces &pieces, float step,
+    absl::flat_hash_map<std::string, float> *running,
+    std::vector<float> *expected) {
+  CHECK_EQ(pieces.size(), expected->size());
+  absl::flat_hash_map<std::string, float> updated;
+  updated.reserve(pieces.size());
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    const auto it = running->find(pieces[i].first);
+    if (it != running->end()) {
+      (*expected)[i] = (1.0 - step) * it->second + step * (*expected)[i];
+    }
+    updated.emplace(pieces[i].first, (*expected)[i]);
+  }
+  *running = std::move(updated);
 }
 
 TrainerModel::SentencePieces Trainer::RunMStep(
     const TrainerModel &model, const std::vector<float> &expected) const {
+  SPM_TRACE_SPAN("m_step");
   const auto &sentencepieces = model.GetSentencePieces();
   CHECK_EQ(sentencepieces.size(), expected.size());
   TrainerModel::SentencePieces new_sentencepieces;
 
   float sum = 0.0;
   for (size_t i = 0; i < expected.size(); ++i) {
-    const float freq = expected[i];
+    float freq = expected[i];
 
-    // Filter infrequent sentencepieces here.
+    // Filter infrequent sentencepieces here. The pieces of the base model
+    // stay with the smallest frequency.
     constexpr float kExpectedFrequencyThreshold = 0.5;
     if (freq < kExpectedFrequencyThreshold) {
-      continue;
+      if (!base_pieces_.count(sentencepieces[i].first)) continue;
+      freq = kExpectedFrequencyThreshold;
     }
 
     new_sentencepieces.emplace_back(sentencepieces[i].first, freq);
@@ -399,11 +1082,124 @@ TrainerModel::SentencePieces Trainer::RunMStep(
 }
 
 TrainerModel::SentencePieces Trainer::PruneSentencePieces(
-    const TrainerModel &model) const {
+    const TrainerModel &model, LatticeCache *cache) const {
+  return PruneSentencePieces(model, ComputePruneStats(model, cache));
+}
+
+PruneStats Trainer::ComputePruneStats(const TrainerModel &model,
+                                      LatticeCache *cache) const {
+  SPM_TRACE_SPAN("prune_stats");
+  const auto &sentencepieces = model.GetSentencePieces();
+  auto *pool = GetThreadPool();
+
+  // Segments all sentences to compute likelihood
+  // with a unigram language model. inverted[inverted_offsets[i]] ...
+  // inverted[inverted_offsets[i + 1] - 1] are the sentence indices where
+  // the sentencepieces[i] appears, once per occurrence.
+  PruneStats stats;
+  std::vector<float> &freq = stats.freq;
+  freq.resize(sentencepieces.size(), 0.0);
+  std::vector<int64> inverted_offsets(sentencepieces.size() + 1, 0);
+  std::vector<int> inverted;
+  {
+    // Each partition records its (piece id, sentence index) occurrences in
+    // order and counts them per piece. The counts then become the starts of
+    // the partitions within each piece, so the lists are filled in parallel
+    // in the same order as a serial pass over the partitions.
+    std::vector<float> vsums(pool->size(), 0.0);
+    std::vector<std::vector<float>> freqs(pool->size());
+    std::vector<std::vector<int64>> counts(pool->size());
+    std::vector<std::vector<std::pair<int, int>>> occurrences(pool->size());
+    for (int n = 0; n < pool->size(); ++n) {
+      freqs[n].resize(sentencepieces.size(), 0.0);
+      counts[n].resize(sentencepieces.size(), 0);
+    }
+
+    // The same partitioning as RunEStep().
+    const auto &schedule = GetSchedule();
+    const int64 num_partitions = pool->size();
+    if (cache != nullptr) cache->Resize(num_partitions);
+    LoadStats load_stats(num_partitions);
+    pool->ParallelFor(num_partitions, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 n = begin; n < end; ++n) {
+        const int64 num_sentences =
+            (schedule.size() + num_partitions - 1 - n) / num_partitions;
+        load_stats.Run(n, num_sentences, [&]() {
+          Lattice lattice;
+          for (int64 k = n; k < schedule.size(); k += num_partitions) {
+            const int64 i = schedule[k];
+            const auto &w = sentences_[i];
+            lattice.SetSentence(w.first);
+            if (cache != nullptr) {
+              cache->PopulateNodes(model, n, k / num_partitions, &lattice);
+            } else {
+              model.PopulateNodes(&lattice);
+            }
+            vsums[n] += w.second;
+            for (const auto *node : lattice.Viterbi().first) {
+              if (node->id >= 0) {
+                freqs[n][node->id] += w.second;
+                ++counts[n][node->id];
+                occurrences[n].emplace_back(node->id, i);
+              }
+            }
+          }
+        });
+      }
+    });
+    load_stats.Log("Prune load:");
+
+    stats.vsum = std::accumulate(vsums.begin(), vsums.end(), stats.vsum);
+    pool->ParallelFor(sentencepieces.size(), 0,
+                      [&](int32, int64 begin, int64 end) {
+                        for (int n = 0; n < pool->size(); ++n) {
+                          for (int64 i = begin; i < end; ++i) {
+                            freq[i] += freqs[n][i];
+                            const int64 count = counts[n][i];
+                            counts[n][i] = inverted_offsets[i + 1];
+                            inverted_offsets[i + 1] += count;
+                          }
+                        }
+                      });
+    std::partial_sum(inverted_offsets.begin(), inverted_offsets.end(),
+                     inverted_offsets.begin());
+    inverted.resize(inverted_offsets.back());
+    pool->ParallelFor(num_partitions, 1, [&](int32, int64 begin, int64 end) {
+      for (int64 n = begin; n < end; ++n) {
+        for (const auto &p : occurrences[n]) {
+          inverted[inverted_offsets[p.first] + counts[n][p.first]++] =
+              p.second;
+        }
+      }
+    });
+  }
+
+  // Sums the frequencies of the sentences of each inverted list in order.
+  stats.sentence_freq.resize(sentencepieces.size(), 0.0);
+  pool->ParallelFor(sentencepieces.size(), 0,
+                    [&](int32, int64 begin, int64 end) {
+                      for (int64 i = begin; i < end; ++i) {
+                        float F = 0.0;
+                        for (int64 k = inverted_offsets[i];
+                             k < inverted_offsets[i + 1]; ++k) {
+                          F += sentences_[inverted[k]].second;
+                        }
+                        stats.sentence_freq[i] = F;
+                      }
+                    });
+  return stats;
+}
+
+TrainerModel::SentencePieces Trainer::PruneSentencePieces(
+    const TrainerModel &model, const PruneStats &stats) const {
+  SPM_TRACE_SPAN("prune_pieces");
   const auto &sentencepieces = model.GetSentencePieces();
+  const auto &freq = stats.freq;
+  CHECK_EQ(sentencepieces.size(), freq.size());
 
-  Lattice lattice;
-  std::vector<bool> always_keep(sentencepieces.size(), true);
+  auto *pool = GetThreadPool();
+  // Not std::vector<bool>, as the workers write neighbouring entries.
+  std::vector<uint8> always_keep(sentencepieces.size(), true);
   std::vector<std::vector<int>> alternatives(sentencepieces.size());
 
   // First, segments the current sentencepieces to know
@@ -411,72 +1207,27 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
   // from the vocabulary.
   // To do so, we take the second best segmentation of sentencepiece[i].
   // alternatives[i] stores the sequence of second best sentencepieces.
-  for (size_t i = 0; i < sentencepieces.size(); ++i) {
-    const auto &w = sentencepieces[i];
-    lattice.SetSentence(w.first);
-    model.PopulateNodes(&lattice);
-    const auto nbests = lattice.NBest(2, false, 0.0);
-    if (nbests.size() == 1) {
-      // No second-best result is found. always keep this sentencepiece.
-      always_keep[i] = true;
-      continue;
-    } else if (nbests[0].first.size() >= 2) {
-      // Can safely remove this sentencepiece if its Viterbi path is split.
-      always_keep[i] = false;
-    } else if (nbests[0].first.size() == 1) {
-      always_keep[i] = true;
-      for (const auto *node : nbests[1].first) {
-        alternatives[i].push_back(node->id);
-      }
-    }
-  }
-
-  // Second, segments all sentences to compute likelihood
-  // with a unigram language model. inverted[i] stores
-  // the set of sentence index where the sentencepieces[i] appears.
-  float vsum = 0.0;
-  std::vector<float> freq(sentencepieces.size(), 0.0);
-  std::vector<std::vector<int>> inverted(sentencepieces.size());
-  {
-    std::vector<float> vsums(trainer_spec_.num_threads(), 0.0);
-    std::vector<std::vector<float>> freqs(trainer_spec_.num_threads());
-    std::vector<std::vector<std::vector<int>>> inverteds(
-        trainer_spec_.num_threads());
-
-    auto pool = std::make_unique<ThreadPool>(trainer_spec_.num_threads());
-    pool->StartWorkers();
-    for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-      freqs[n].resize(sentencepieces.size(), 0.0);
-      inverteds[n].resize(sentencepieces.size());
-
-      pool->Schedule([&, n]() {
-        Lattice lattice;
-        for (size_t i = n; i < sentences_.size();
-             i += trainer_spec_.num_threads()) {
-          const auto &w = sentences_[i];
-          lattice.SetSentence(w.first);
-          model.PopulateNodes(&lattice);
-          vsums[n] += w.second;
-          for (const auto *node : lattice.Viterbi().first) {
-            if (node->id >= 0) {
-              freqs[n][node->id] += w.second;
-              inverteds[n][node->id].push_back(i);
-            }
-          }
+  pool->ParallelFor(sentencepieces.size(), 0, [&](int32, int64 begin,
+                                                  int64 end) {
+    TrainerModel::TwoBestBuffers buffers;
+    EncodeResult best, second;
+    for (int64 i = begin; i < end; ++i) {
+      const auto &w = sentencepieces[i];
+      if (!model.EncodeTwoBest(w.first, &buffers, &best, &second)) {
+        // No second-best result is found. always keep this sentencepiece.
+        always_keep[i] = true;
+        continue;
+      } else if (best.size() >= 2) {
+        // Can safely remove this sentencepiece if its Viterbi path is split.
+        always_keep[i] = false;
+      } else if (best.size() == 1) {
+        always_keep[i] = true;
+        for (const auto &piece : second) {
+          alternatives[i].push_back(piece.second);
         }
-      });
-    }
-    pool.reset(nullptr);
-
-    for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-      vsum += vsums[n];
-      for (size_t i = 0; i < sentencepieces.size(); ++i) {
-        freq[i] += freqs[n][i];
-        std::copy(inverteds[n][i].begin(), inverteds[n][i].end(),
-                  std::back_inserter(inverted[i]));
       }
     }
-  }
+  });
 
   const float sum = std::accumulate(freq.begin(), freq.end(), 0.0);
   const float logsum = std::log(static_cast<double>(sum));
@@ -489,18 +1240,19 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
   // loss approximately by assuming that all sentencepiece[i] in the sentences
   // are replaced with alternatives[i] when sentencepiece[i] is removed.
   for (size_t i = 0; i < sentencepieces.size(); ++i) {
-    if (freq[i] == 0 || !always_keep[i]) {
+    if (base_pieces_.count(sentencepieces[i].first)) {
+      // The pieces of the base model are never removed.
+      new_sentencepieces.push_back(sentencepieces[i]);
+    } else if (freq[i] == 0 || !always_keep[i]) {
       // not found in Viterbi path. Can remove this entry safely.
       continue;
     } else if (alternatives[i].empty()) {
       // no alternatives. Keeps this entry.
       new_sentencepieces.push_back(sentencepieces[i]);
     } else {
-      float F = 0.0;  // the frequency of sentencepieces[i].
-      for (const int n : inverted[i]) {
-        F += sentences_[n].second;
-      }
-      F /= vsum;  // normalizes by all sentence frequency.
+      // the frequency of sentencepieces[i], normalized by all sentence
+      // frequency.
+      const float F = stats.sentence_freq[i] / stats.vsum;
 
       // The logprob with the sentencepiece[i].
       const float logprob_sp = std::log(static_cast<double>(freq[i])) - logsum;
@@ -543,23 +1295,46 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
 
 TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
     const TrainerModel &model) const {
+  if (base_model_ != nullptr) return FinalizeExtendedPieces(model);
+
+  using Piece = std::pair<std::string, float>;
   const auto &sentencepieces = model.GetSentencePieces();
-  absl::flat_hash_map<std::string, float> final_sentencepieces;
-  absl::flat_hash_map<std::string, float> sp(sentencepieces.begin(),
-                                             sentencepieces.end());
+  const auto by_score = [](const Piece &p1, const Piece &p2) {
+    return (p1.second > p2.second ||
+            (p1.second == p2.second && p1.first < p2.first));
+  };
+
+  // The pieces are handled by their ids in `sentencepieces`; the only sort
+  // ranks the ids in the final order.
+  std::vector<int> order(sentencepieces.size());
+  std::iota(order.begin(), order.end(), 0);
+  ParallelSort(GetThreadPool(), &order, [&](int i, int j) {
+    return by_score(sentencepieces[i], sentencepieces[j]);
+  });
+
+  absl::flat_hash_map<absl::string_view, int> ids;
+  ids.reserve(sentencepieces.size());
+  for (size_t i = 0; i < sentencepieces.size(); ++i) {
+    ids.emplace(sentencepieces[i].first, i);
+  }
 
   // required_chars_ must be included in the final sentencepieces.
+  std::vector<bool> kept(sentencepieces.size(), false);
+  std::vector<Piece> added;
+  size_t num_kept = 0;
   float min_score_penalty = 0.0;
   constexpr float kMinScorePenaltyDelta = 0.0001;
   for (const auto &w : Sorted(required_chars_)) {
-    const std::string s = string_util::UnicodeCharToUTF8(w.first);
-    if (port::ContainsKey(sp, s)) {
-      final_sentencepieces[s] = sp[s];
+    std::string s = string_util::UnicodeCharToUTF8(w.first);
+    const auto it = ids.find(s);
+    if (it != ids.end()) {
+      kept[it->second] = true;
+      ++num_kept;
     } else {
       // Add penalty to avoid required pieces from having the same score.
       // Since the required_chars_ is sorted, frequent pieces have
       // less penalties.
-      final_sentencepieces[s] = model.min_score() + min_score_penalty;
+      added.emplace_back(std::move(s), model.min_score() + min_score_penalty);
       min_score_penalty += kMinScorePenaltyDelta;
     }
   }
@@ -568,17 +1343,225 @@ TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
   CHECK_GT(vocab_size_size, 0);
 
   // Then keeps sentencepieces with higher scores.
+  for (const int i : order) {
+    if (kept[i]) continue;
+    if (static_cast<size_t>(vocab_size_size) == num_kept + added.size()) {
+      break;
+    }
+    kept[i] = true;
+    ++num_kept;
+  }
+
+  // The added pieces are few, so they are merged into the kept ones, which
+  // are already in the final order.
+  std::vector<Piece> final_sentencepieces;
+  final_sentencepieces.reserve(num_kept);
+  for (const int i : order) {
+    if (kept[i]) final_sentencepieces.push_back(sentencepieces[i]);
+  }
+  std::sort(added.begin(), added.end(), by_score);
+  TrainerModel::SentencePieces result;
+  result.reserve(final_sentencepieces.size() + added.size());
+  std::merge(std::make_move_iterator(final_sentencepieces.begin()),
+             std::make_move_iterator(final_sentencepieces.end()),
+             std::make_move_iterator(added.begin()),
+             std::make_move_iterator(added.end()), std::back_inserter(result),
+             by_score);
+
+  return result;
+}
+
+TrainerModel::SentencePieces Trainer::FinalizeExtendedPieces(
+    const TrainerModel &model) const {
+  const auto &sentencepieces = model.GetSentencePieces();
+  absl::flat_hash_map<absl::string_view, float> scores;
+  scores.reserve(sentencepieces.size());
+  for (const auto &w : sentencepieces) scores.emplace(w.first, w.second);
+  const auto score_of = [&](absl::string_view piece) {
+    const auto it = scores.find(piece);
+    return it == scores.end() ? model.min_score() : it->second;
+  };
+
+  // All the pieces of the base model are taken.
+  absl::flat_hash_set<std::string> taken;
+  TrainerModel::SentencePieces result;
+  for (const auto &piece : base_model_->pieces()) {
+    taken.insert(piece.piece());
+    if (piece.type() == ModelProto::SentencePiece::NORMAL) {
+      result.emplace_back(piece.piece(), score_of(piece.piece()));
+    }
+  }
+
+  const size_t num_new_pieces =
+      std::max(0, trainer_spec_.vocab_size() - base_model_->pieces_size());
+  TrainerModel::SentencePieces added;
+  for (const auto &w : Sorted(required_chars_)) {
+    if (added.size() == num_new_pieces) break;
+    std::string s = string_util::UnicodeCharToUTF8(w.first);
+    if (!taken.insert(s).second) continue;
+    const float score = score_of(s);
+    added.emplace_back(std::move(s), score);
+  }
   for (const auto &w : Sorted(sentencepieces)) {
-    if (port::ContainsKey(final_sentencepieces, w.first)) {
-      continue;
+    if (added.size() == num_new_pieces) break;
+    if (taken.insert(w.first).second) added.push_back(w);
+  }
+
+  for (auto &w : Sorted(added)) result.push_back(std::move(w));
+  return result;
+}
+
+TrainerModel::SentencePieces Trainer::AddBasePieces(
+    TrainerModel::SentencePieces seed_sentencepieces) const {
+  absl::flat_hash_set<absl::string_view> base;
+  TrainerModel::SentencePieces result;
+  for (const auto &piece : base_model_->pieces()) {
+    base.insert(piece.piece());
+    if (piece.type() == ModelProto::SentencePiece::NORMAL) {
+      result.emplace_back(piece.piece(), piece.score());
     }
-    if (static_cast<size_t>(vocab_size_size) == final_sentencepieces.size()) {
-      break;
+  }
+  for (auto &w : seed_sentencepieces) {
+    if (!base.count(w.first)) result.push_back(std::move(w));
+  }
+  LOG(INFO) << "Extending " << base_pieces_.size() << " pieces of the base "
+            << "model with " << result.size() - base_pieces_.size()
+            << " seed pieces";
+  return result;
+}
+
+util::Status Trainer::RunDistributedEStep(const TrainerModel &model,
+                                          LatticeCache *cache,
+                                          EStepStats *stats) {
+  // The workers run while the coordinator does its own shard.
+  const int64 seq = num_requests_++;
+  TrainerCheckpoint request;
+  request.step = seq;
+  request.pieces = model.GetSentencePieces();
+  RETURN_IF_ERROR(WriteCheckpointFile(
+      RequestFile(distributed_dir_, seq, kEStepRequest), request));
+
+  stats->expected =
+      RunEStep(model, &stats->objective, &stats->num_tokens, cache);
+  stats->sentence_freq = 0;
+  for (const auto &w : sentences_) stats->sentence_freq += w.second;
+
+  // Sums the statistics in the order of the shards.
+  double objective =
+      static_cast<double>(stats->objective) * stats->sentence_freq;
+  for (int shard = 1; shard < num_shards_; ++shard) {
+    const std::string filename = ResultFile(distributed_dir_, seq, shard);
+    std::string blob;
+    RETURN_IF_ERROR(WaitAndReadFile(filename, &blob));
+    EStepStats shard_stats;
+    RETURN_IF_ERROR(ParseEStepStats(blob, &shard_stats));
+    CHECK_EQ_OR_RETURN(shard_stats.expected.size(), stats->expected.size());
+    for (size_t i = 0; i < stats->expected.size(); ++i) {
+      stats->expected[i] += shard_stats.expected[i];
     }
-    final_sentencepieces[w.first] = w.second;
+    objective +=
+        static_cast<double>(shard_stats.objective) * shard_stats.sentence_freq;
+    stats->num_tokens += shard_stats.num_tokens;
+    stats->sentence_freq += shard_stats.sentence_freq;
+    std::remove(filename.c_str());
+  }
+  if (stats->sentence_freq > 0) {
+    stats->objective = objective / stats->sentence_freq;
   }
+  std::remove(RequestFile(distributed_dir_, seq, kEStepRequest).c_str());
+  return util::OkStatus();
+}
 
-  return Sorted(final_sentencepieces);
+util::Status Trainer::RunDistributedPrune(const TrainerModel &model,
+                                          LatticeCache *cache,
+                                          PruneStats *stats) {
+  const int64 seq = num_requests_++;
+  TrainerCheckpoint request;
+  request.step = seq;
+  request.pieces = model.GetSentencePieces();
+  RETURN_IF_ERROR(WriteCheckpointFile(
+      RequestFile(distributed_dir_, seq, kPruneRequest), request));
+
+  *stats = ComputePruneStats(model, cache);
+
+  for (int shard = 1; shard < num_shards_; ++shard) {
+    const std::string filename = ResultFile(distributed_dir_, seq, shard);
+    std::string blob;
+    RETURN_IF_ERROR(WaitAndReadFile(filename, &blob));
+    PruneStats shard_stats;
+    RETURN_IF_ERROR(ParsePruneStats(blob, &shard_stats));
+    CHECK_OR_RETURN(shard_stats.freq.size() == stats->freq.size() &&
+                    shard_stats.sentence_freq.size() == stats->freq.size());
+    stats->vsum += shard_stats.vsum;
+    for (size_t i = 0; i < stats->freq.size(); ++i) {
+      stats->freq[i] += shard_stats.freq[i];
+      stats->sentence_freq[i] += shard_stats.sentence_freq[i];
+    }
+    std::remove(filename.c_str());
+  }
+  std::remove(RequestFile(distributed_dir_, seq, kPruneRequest).c_str());
+  return util::OkStatus();
+}
+
+util::Status Trainer::SaveIntermediateModel(const TrainerModel &model,
+                                            int vocab_size) {
+  TrainingMetrics::Scope phase(&metrics_, "intermediate_model");
+  const TrainerSpec trainer_spec = trainer_spec_;
+  trainer_spec_.set_vocab_size(vocab_size);
+  trainer_spec_.set_model_prefix(
+      absl::StrCat(trainer_spec.model_prefix(), ".", vocab_size));
+  LOG(INFO) << "Saving the model of vocab_size=" << vocab_size;
+  final_pieces_ = FinalizeSentencePieces(model);
+  const auto status = Save();
+  trainer_spec_ = trainer_spec;
+  final_pieces_.clear();
+  return status;
+}
+
+util::Status Trainer::RunShardWorker() {
+  TrainerModel model(trainer_spec_, normalizer_spec_);
+  RETURN_IF_ERROR(model.status());
+
+  LatticeCache lattice_cache;
+  lattice_cache.size = lattice_cache_size_;
+  LatticeCache *cache = lattice_cache_size_ > 0 ? &lattice_cache : nullptr;
+
+  for (int64 seq = 0;; ++seq) {
+    // Waits for the next request, or the end of the job.
+    std::string filename;
+    bool is_estep = false;
+    while (true) {
+      if (FileExists(DoneFile(distributed_dir_))) return util::OkStatus();
+      filename = RequestFile(distributed_dir_, seq, kEStepRequest);
+      if ((is_estep = FileExists(filename))) break;
+      filename = RequestFile(distributed_dir_, seq, kPruneRequest);
+      if (FileExists(filename)) break;
+      std::this_thread::sleep_for(kPollInterval);
+    }
+
+    TrainerCheckpoint request;
+    RETURN_IF_ERROR(ReadCheckpointFile(filename, &request));
+    // The pieces of a request are a subset of the previous ones.
+    if (cache != nullptr && model.GetPieceSize() > 0) {
+      cache->Remap(model.GetSentencePieces(), request.pieces);
+    }
+    model.SetSentencePieces(std::move(request.pieces));
+
+    std::string blob;
+    if (is_estep) {
+      EStepStats stats;
+      stats.expected =
+          RunEStep(model, &stats.objective, &stats.num_tokens, cache);
+      for (const auto &w : sentences_) stats.sentence_freq += w.second;
+      blob = SerializeEStepStats(stats);
+    } else {
+      blob = SerializePruneStats(ComputePruneStats(model, cache));
+    }
+    RETURN_IF_ERROR(WriteFileAtomically(
+        ResultFile(distributed_dir_, seq, shard_id_), blob));
+  }
+
+  return util::OkStatus();
 }
 
 util::Status Trainer::Train() {
@@ -590,48 +1573,208 @@ util::Status Trainer::Train() {
   TrainerModel model(trainer_spec_, normalizer_spec_);
 
   RETURN_IF_ERROR(model.status());
+
+  const bool is_distributed = num_shards_ > 1;
+  if (is_distributed) {
+    CHECK_OR_RETURN(!distributed_dir_.empty());
+    CHECK_OR_RETURN(shard_id_ >= 0 && shard_id_ < num_shards_);
+  }
+
+  base_pieces_.clear();
+  if (base_model_ != nullptr) {
+    for (const auto &piece : base_model_->pieces()) {
+      if (piece.type() == ModelProto::SentencePiece::NORMAL) {
+        base_pieces_.insert(piece.piece());
+      }
+    }
+  }
+
   RETURN_IF_ERROR(LoadSentences());
 
-  auto seed_sentencepieces = MakeSeedSentencePieces();
-  model.SetSentencePieces(std::move(seed_sentencepieces));
+  if (is_distributed && shard_id_ > 0) {
+    if (trainer_spec_.split_by_whitespace()) {
+      SplitSentencesByWhitespace();
+    } else {
+      MergeDuplicatedSentences();
+    }
+    RETURN_IF_ERROR(SpillSentences());
+    return RunShardWorker();
+  }
+  const ScopedDoneFile done_file(is_distributed ? DoneFile(distributed_dir_)
+                                                : "");
+
+  // A resumed job starts from the pieces of the last completed round
+  // instead of the seed pieces.
+  int64 round = 0, last_checkpoint = 0;
+  if (!resume_from_.empty()) {
+    TrainerCheckpoint checkpoint;
+    RETURN_IF_ERROR(LoadCheckpoint(&checkpoint));
+    CHECK_OR_RETURN(!checkpoint.pieces.empty())
+        << "Checkpoint has no pieces.";
+    round = last_checkpoint = checkpoint.step;
+    model.SetSentencePieces(std::move(checkpoint.pieces));
+  } else {
+    TrainingMetrics::Scope phase(&metrics_, "seed_pieces", sentences_.size());
+    auto seed_sentencepieces = MakeSeedSentencePieces();
+    if (base_model_ != nullptr) {
+      seed_sentencepieces = AddBasePieces(std::move(seed_sentencepieces));
+    }
+    model.SetSentencePieces(std::move(seed_sentencepieces));
+  }
 
+  // The seed pieces above count every occurrence of the sentences, but EM
+  // only needs each distinct sentence once with its total frequency.
   if (trainer_spec_.split_by_whitespace()) {
     SplitSentencesByWhitespace();
+  } else {
+    MergeDuplicatedSentences();
   }
 
   LOG(INFO) << "Using " << sentences_.size() << " sentences for EM training";
 
-  desired_vocab_size_ = static_cast<size_t>(trainer_spec_.vocab_size() * 1.1);
+  // The spilled sentences are in the order of the schedule of the E steps.
+  RETURN_IF_ERROR(SpillSentences());
+  schedule_.clear();
 
+  // The sizes of the models to make, in descending order. The model of
+  // trainer_spec_.vocab_size() is the last one. The pruning stops at the
+  // desired size of each of them in turn.
+  std::vector<int> vocab_sizes;
+  for (const int size : extra_vocab_sizes_) {
+    if (size > trainer_spec_.vocab_size()) vocab_sizes.push_back(size);
+  }
+  std::sort(vocab_sizes.rbegin(), vocab_sizes.rend());
+  vocab_sizes.erase(std::unique(vocab_sizes.begin(), vocab_sizes.end()),
+                    vocab_sizes.end());
+  vocab_sizes.push_back(trainer_spec_.vocab_size());
+  auto desired_size = [](int vocab_size) {
+    return static_cast<int>(vocab_size * 1.1);
+  };
+
+  // Skips the sizes the model has already passed, e.g. when resumed.
+  size_t next_size = 0;
+  while (next_size + 1 < vocab_sizes.size() &&
+         model.GetPieceSize() < desired_size(vocab_sizes[next_size])) {
+    LOG(WARNING) << "Skipping vocab_size=" << vocab_sizes[next_size]
+                 << " as the model has only " << model.GetPieceSize()
+                 << " pieces.";
+    ++next_size;
+  }
+  desired_vocab_size_ = desired_size(vocab_sizes[next_size]);
+
+  LatticeCache lattice_cache;
+  lattice_cache.size = lattice_cache_size_;
+  LatticeCache *cache = lattice_cache_size_ > 0 ? &lattice_cache : nullptr;
+
+  // Running expected counts and number of steps of stochastic EM.
+  absl::flat_hash_map<std::string, float> running_expected;
+  int64 num_stochastic_steps = 0;
+
+  num_skipped_sub_iterations_ = 0;
   while (true) {
+    // The round which reaches the desired size runs the full E steps.
+    const bool stochastic = em_num_batches_ > 1 && !is_distributed &&
+                            model.GetPieceSize() > desired_vocab_size_;
+
     // Sub-EM iteration.
+    float prev_objective = 0.0;
     for (int iter = 0; iter < trainer_spec_.num_sub_iterations(); ++iter) {
+      TrainingMetrics::Scope phase(&metrics_, "em_iteration",
+                                   sentences_.size());
+
       // Executes E step
       float objective = 0.0;
       int64 num_tokens = 0;
-      const auto expected = RunEStep(model, &objective, &num_tokens);
+      std::vector<float> expected;
+      if (is_distributed) {
+        EStepStats stats;
+        RETURN_IF_ERROR(RunDistributedEStep(model, cache, &stats));
+        expected = std::move(stats.expected);
+        objective = stats.objective;
+        num_tokens = stats.num_tokens;
+      } else if (stochastic) {
+        // Stepwise EM with the step size (t + 2)^-decay, which visits the
+        // batches in turn.
+        const int64 batch = num_stochastic_steps % em_num_batches_;
+        expected = RunEStep(model, &objective, &num_tokens, cache, batch,
+                            em_num_batches_);
+        const float step =
+            std::pow(num_stochastic_steps + 2.0, -em_step_decay_);
+        InterpolateExpected(model.GetSentencePieces(), step,
+                            &running_expected, &expected);
+        ++num_stochastic_steps;
+      } else {
+        expected = RunEStep(model, &objective, &num_tokens, cache);
+      }
 
       // Executes M step.
       auto new_sentencepieces = RunMStep(model, expected);
+      if (cache != nullptr) {
+        cache->Remap(model.GetSentencePieces(), new_sentencepieces);
+      }
       model.SetSentencePieces(std::move(new_sentencepieces));
 
       LOG(INFO) << "EM sub_iter=" << iter << " size=" << model.GetPieceSize()
                 << " obj=" << objective << " num_tokens=" << num_tokens
                 << " num_tokens/piece="
-                << 1.0 * num_tokens / model.GetPieceSize();
+                << 1.0 * num_tokens / model.GetPieceSize()
+                << (stochastic ? " (stochastic)" : "");
+
+      // The objectives of different batches are not comparable.
+      if (!stochastic && iter > 0 && em_tolerance_ > 0.0 &&
+          std::fabs(objective - prev_objective) <=
+              em_tolerance_ * std::fabs(prev_objective)) {
+        const int skipped = trainer_spec_.num_sub_iterations() - iter - 1;
+        if (skipped > 0) {
+          LOG(INFO) << "EM converged at sub_iter=" << iter << ", skipping "
+                    << skipped << " sub-iterations";
+          num_skipped_sub_iterations_ += skipped;
+        }
+        break;
+      }
+      prev_objective = objective;
     }  // end of Sub EM iteration
 
     // Stops the iteration when the size of sentences reaches to the
-    // desired symbol size.
+    // desired symbol size. The larger models are saved on the way.
     if (model.GetPieceSize() <= desired_vocab_size_) {
-      break;
+      if (next_size + 1 == vocab_sizes.size()) break;
+      RETURN_IF_ERROR(SaveIntermediateModel(model, vocab_sizes[next_size]));
+      desired_vocab_size_ = desired_size(vocab_sizes[++next_size]);
     }
 
     // Prunes pieces.
-    auto new_sentencepieces = PruneSentencePieces(model);
-    model.SetSentencePieces(std::move(new_sentencepieces));
+    {
+      TrainingMetrics::Scope phase(&metrics_, "prune", sentences_.size());
+      TrainerModel::SentencePieces new_sentencepieces;
+      if (is_distributed) {
+        PruneStats stats;
+        RETURN_IF_ERROR(RunDistributedPrune(model, cache, &stats));
+        new_sentencepieces = PruneSentencePieces(model, stats);
+      } else {
+        new_sentencepieces = PruneSentencePieces(model, cache);
+      }
+      if (cache != nullptr) {
+        cache->Remap(model.GetSentencePieces(), new_sentencepieces);
+      }
+      model.SetSentencePieces(std::move(new_sentencepieces));
+    }
+
+    if (IsCheckpointStep(++round, last_checkpoint, 1)) {
+      last_checkpoint = round;
+      TrainerCheckpoint checkpoint;
+      checkpoint.model_type = TrainerSpec::UNIGRAM;
+      checkpoint.step = round;
+      checkpoint.pieces = model.GetSentencePieces();
+      RETURN_IF_ERROR(SaveCheckpoint(checkpoint));
+    }
   }  // end of EM iteration
 
+  if (em_tolerance_ > 0.0) {
+    LOG(INFO) << "Skipped " << num_skipped_sub_iterations_
+              << " EM sub-iterations by convergence";
+  }
+
   // Finally, adjusts the size of sentencepices to be |vocab_size|.
   final_pieces_ = FinalizeSentencePieces(model);
 
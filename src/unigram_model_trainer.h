@@ -21,6 +21,8 @@
 #include <vector>
 
 #include "sentencepiece_model.pb.h"
+#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/strings/string_view.h"
 #include "trainer_interface.h"
 #include "unigram_model.h"
@@ -47,6 +49,8 @@ class TrainerModel : public Model {
 
   // Sets sentencepieces. The sentencepieces are moved.
   // The meta symbols, e.g., </s> are NOT included.
+  // When the pieces are the same as the current ones in the same order,
+  // only the scores are updated and the trie is not rebuilt.
   void SetSentencePieces(SentencePieces &&sentencepieces);
 
   EncodeResult Encode(absl::string_view normalized) const override {
@@ -60,6 +64,31 @@ class TrainerModel : public Model {
   ModelProto model_proto_data_;
 };
 
+// Statistics of the E step over a set of sentences. They are sums over the
+// sentences, so that the statistics of the shards of a distributed job add
+// up to the ones of the whole corpus.
+struct EStepStats {
+  // Expected count of every piece.
+  std::vector<float> expected;
+  // Negative log likelihood, normalized by `sentence_freq`.
+  float objective = 0.0;
+  // Number of tokens of the Viterbi paths.
+  int64 num_tokens = 0;
+  // Sum of the frequencies of the sentences.
+  int64 sentence_freq = 0;
+};
+
+// Viterbi statistics of a set of sentences used for pruning.
+struct PruneStats {
+  // Sum of the frequencies of the sentences.
+  float vsum = 0.0;
+  // Frequency of every piece in the Viterbi paths.
+  std::vector<float> freq;
+  // Sum of the frequencies of the sentences whose Viterbi path has the
+  // piece, once per occurrence.
+  std::vector<float> sentence_freq;
+};
+
 class Trainer : public TrainerInterface {
  public:
   Trainer(const TrainerSpec &trainer_spec,
@@ -74,6 +103,16 @@ class Trainer : public TrainerInterface {
 
  private:
   FRIEND_TEST(TrainerTest, IsValidSentencePieceTest);
+  FRIEND_TEST(UnigramTrainerTest, ShardedSeedSentencePiecesTest);
+  FRIEND_TEST(UnigramTrainerTest, ParallelSuffixArrayTest);
+  FRIEND_TEST(UnigramTrainerTest, ParallelSeedSelectionTest);
+  FRIEND_TEST(UnigramTrainerTest, EStepThreadsTest);
+  FRIEND_TEST(UnigramTrainerTest, LatticeCacheTest);
+  FRIEND_TEST(UnigramTrainerTest, ExternalMemoryTest);
+  FRIEND_TEST(UnigramTrainerTest, DistributedTest);
+  FRIEND_TEST(UnigramTrainerTest, EStepAccumulatorTest);
+  FRIEND_TEST(UnigramTrainerTest, EMToleranceTest);
+  FRIEND_TEST(UnigramTrainerTest, StochasticEMTest);
 
   // Makes seed pieces from the training corpus.
   // The size of seed pieces is determined by seed_sentencepiece_size.
@@ -82,13 +121,105 @@ class Trainer : public TrainerInterface {
   template <typename node_int_type>
   TrainerModel::SentencePieces MakeSeedSentencePiecesInternal();
 
+  // A substring of the corpus with its length in characters and frequency.
+  struct SubstringCount {
+    std::string piece;
+    int64 length = 0;
+    int64 freq = 0;
+  };
+
+  // Returns at most seed_sentencepiece_size valid substrings of `array`
+  // occurring twice or more, in the descending order of freq * length.
+  template <typename node_int_type>
+  std::vector<SubstringCount> ExtractFrequentSubstrings(
+      const std::vector<char32> &array) const;
+
+  // Number of characters of the shards used when the corpus is too large
+  // for the suffix array of MakeSeedSentencePieces().
+  static constexpr int64 kSeedShardSize = 1 << 28;
+
+  // When > 0, the seed pieces are always extracted from shards of this many
+  // characters. The default 0 only shards the corpora which exceed the
+  // range of node_int_type.
+  int64 seed_shard_size_ = 0;
+
+  // Number of EM sub-iterations skipped by SetEMTolerance() in the last
+  // training.
+  int64 num_skipped_sub_iterations_ = 0;
+
+  // Returns the indices of `sentences_` sorted by descending length.
+  // Parallel passes over the sentences hand out work in this order, so the
+  // expensive lattices are scheduled first and short ones fill the tail.
+  const std::vector<int64> &GetSchedule() const;
+
+  // Node spans of the lattices of the sentences, kept between the E steps
+  // as the pieces are only removed or rescored during EM. A cached lattice
+  // is rebuilt from its spans instead of looking up the trie.
+  struct LatticeCache {
+    // The spans of the first sentences of a partition of RunEStep(). The
+    // spans of its k-th sentence are [offsets[k], offsets[k + 1]).
+    struct Partition {
+      std::vector<TrainerModel::NodeSpan> spans;
+      std::vector<size_t> offsets;
+    };
+
+    // Maximum bytes of the spans.
+    int64 size = 0;
+    std::vector<Partition> partitions;
+
+    // Sets up `num_partitions` empty partitions unless they exist.
+    void Resize(int num_partitions);
+
+    // Populates `lattice` with the nodes of the k-th sentence of the
+    // partition `n`. They are rebuilt from the cache when they are there,
+    // or are recorded into it when it has room.
+    void PopulateNodes(const TrainerModel &model, int n, size_t k,
+                       Lattice *lattice);
+
+    // The same as PopulateNodes() for the lattice-free E step: populates
+    // `buffers` with the nodes of `sentence`, the k-th sentence of the
+    // partition `n`, and runs the forward algorithm on them.
+    void PopulateForward(const TrainerModel &model, int n, size_t k,
+                         absl::string_view sentence,
+                         TrainerModel::MarginalBuffers *buffers);
+
+    // Maps the ids of `pieces` to the ids of `new_pieces`, which must be a
+    // subset of them. The spans of the removed pieces get id -1.
+    void Remap(const TrainerModel::SentencePieces &pieces,
+               const TrainerModel::SentencePieces &new_pieces);
+  };
+
   // Executes the E step of EM and returns expected count.
   // The index of return array is the vocab id.
   // |objective| is a negative likelihood of the current model.
   // |num_token| is the number of total tokens to tokenize
   // training corpus.
+  // The marginals are computed by Model::PopulateForward() and
+  // MarginalBuffers::PopulateMarginal() without building a Lattice.
+  // When `cache` is given, the lattices of the sentences are recorded into
+  // it within its size, and rebuilt from it in the later calls.
+  // With `num_batches` > 1, only the sentences of the batch `batch`, one of
+  // `num_batches` interleaved slices of the schedule, are processed, and the
+  // expected counts and the number of tokens are scaled up to the whole
+  // corpus.
   std::vector<float> RunEStep(const TrainerModel &model, float *objective,
-                              int64 *num_tokens) const;
+                              int64 *num_tokens, LatticeCache *cache = nullptr,
+                              int64 batch = 0, int64 num_batches = 1) const;
+
+  // RunEStep() with the partial sums of the type `Sum`.
+  template <typename Sum>
+  std::vector<float> RunEStepInternal(const TrainerModel &model,
+                                      float *objective, int64 *num_tokens,
+                                      LatticeCache *cache, int64 batch,
+                                      int64 num_batches) const;
+
+  // Interpolates the expected counts of a batch with the running counts of
+  // stochastic EM, keyed by piece: expected = (1 - step) * running +
+  // step * expected. Then stores the result as the new running counts.
+  static void InterpolateExpected(
+      const TrainerModel::SentencePieces &pieces, float step,
+      absl::flat_hash_map<std::string, float> *running,
+      std::vector<float> *expected);
 
   // Executes the M step of EM with the expected frequency and
   // returns new pieces.
@@ -98,17 +229,73 @@ class Trainer : public TrainerInterface {
   // Heuristically prunes the current pieces.
   // This is called after each EM sub-iteration.
   TrainerModel::SentencePieces PruneSentencePieces(
-      const TrainerModel &model) const;
+      const TrainerModel &model, LatticeCache *cache = nullptr) const;
+
+  // Segments the sentences with the Viterbi algorithm for pruning.
+  PruneStats ComputePruneStats(const TrainerModel &model,
+                               LatticeCache *cache) const;
+
+  // Prunes the current pieces with the statistics of the whole corpus.
+  TrainerModel::SentencePieces PruneSentencePieces(
+      const TrainerModel &model, const PruneStats &stats) const;
+
+  // Distributed training. Shard 0 coordinates the job: it makes the seed
+  // pieces from its own sentences, and runs the M steps and the pruning
+  // with the statistics of all the shards. The requests and the statistics
+  // are exchanged as files in `distributed_dir_`, which must be empty when
+  // the job starts.
+  //
+  //   request.<seq>.<estep|prune>  the model, written by the coordinator
+  //   result.<seq>.<shard>         statistics, written by a worker
+  //   done                         written by the coordinator at the end
+  //
+  // Runs the E step on all the shards.
+  util::Status RunDistributedEStep(const TrainerModel &model,
+                                   LatticeCache *cache, EStepStats *stats);
+
+  // Computes the pruning statistics of all the shards.
+  util::Status RunDistributedPrune(const TrainerModel &model,
+                                   LatticeCache *cache, PruneStats *stats);
+
+  // Answers the requests of the coordinator until it is done. This is the
+  // Train() of the other shards.
+  util::Status RunShardWorker();
+
+  // Number of the requests sent by the coordinator.
+  int64 num_requests_ = 0;
 
   // Makes the final sentence pieces by incorporating the required characters
   // and control/user defined symbols.
   TrainerModel::SentencePieces FinalizeSentencePieces(
       const TrainerModel &model) const;
 
+  // The same as FinalizeSentencePieces() when extending base_model_: the
+  // normal pieces of the base model in their order, then the required
+  // characters and the pieces with the highest scores which are new.
+  TrainerModel::SentencePieces FinalizeExtendedPieces(
+      const TrainerModel &model) const;
+
+  // Adds the normal pieces of base_model_ with their scores to the seed
+  // pieces, from which the pieces of the base model are removed.
+  TrainerModel::SentencePieces AddBasePieces(
+      TrainerModel::SentencePieces seed_sentencepieces) const;
+
+  // The normal pieces of base_model_, which are never removed by the M
+  // steps and the pruning.
+  absl::flat_hash_set<std::string> base_pieces_;
+
+  // Finalizes `model` to `vocab_size` pieces and saves it as
+  // <model_prefix>.<vocab_size>.model and .vocab.
+  util::Status SaveIntermediateModel(const TrainerModel &model,
+                                     int vocab_size);
+
   // When the size of SentencePieces becomes less than desired_vocab_size_,
   // break the main training loop. desired_vocab_size_ = 1.1 * vocab_size_
   // for now.
   int desired_vocab_size_;
+
+  // Cache of GetSchedule(). Rebuilt when the number of sentences changes.
+  mutable std::vector<int64> schedule_;
 };
 }  // namespace unigram
 }  // namespace sentencepiece
@@ -14,7 +14,15 @@
 
 #include "unigram_model_trainer.h"
 
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "filesystem.h"
@@ -39,6 +47,38 @@ TEST(UnigramTrainerTest, TrainerModelTest) {
   EXPECT_EQ(EncodeResult(), model.Encode("test"));
 }
 
+TEST(UnigramTrainerTest, TrainerModelScoreUpdateTest) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  TrainerModel model(trainer_spec, normalizer_spec);
+
+  auto viterbi = [&model](absl::string_view text) {
+    Lattice lattice;
+    lattice.SetSentence(text);
+    model.PopulateNodes(&lattice);
+    std::vector<std::string> pieces;
+    for (const auto *node : lattice.Viterbi().first) {
+      pieces.emplace_back(node->piece);
+    }
+    return pieces;
+  };
+
+  model.SetSentencePieces({{"a", -1.0}, {"b", -1.0}, {"ab", -1.0}});
+  EXPECT_EQ(std::vector<std::string>({"ab"}), viterbi("ab"));
+
+  // Only the scores change.
+  model.SetSentencePieces({{"a", -1.0}, {"b", -1.0}, {"ab", -5.0}});
+  EXPECT_EQ(std::vector<std::string>({"a", "b"}), viterbi("ab"));
+  EXPECT_EQ(-5.0, model.GetScore(2));
+  EXPECT_EQ(-5.0, model.min_score());
+
+  // The pieces change.
+  model.SetSentencePieces({{"ab", -1.0}, {"b", -1.0}});
+  EXPECT_EQ(std::vector<std::string>({"ab"}), viterbi("ab"));
+  EXPECT_EQ("ab", model.IdToPiece(0));
+  EXPECT_EQ(2, model.GetPieceSize());
+}
+
 struct TrainerResult {
   std::string sentence_pieces;
   std::vector<std::pair<std::string, float>> seed_pieces_and_probs;
@@ -148,6 +188,567 @@ TEST(UnigramTrainerTest, BasicDPTest) {
   }
 }
 
+TEST(UnigramTrainerTest, ShardedSeedSentencePiecesTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "sharded_seed_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {"apple", "pineapple", "pen",
+                                            "banana", "bandana", "nanny"};
+    for (int i = 0; i < 200; ++i) {
+      std::string line;
+      for (int j = 0; j < 5; ++j) {
+        line += words[(i * 7 + j * 3 + i / 5) % words.size()] + " ";
+      }
+      output->WriteLine(line);
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(30);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "sharded_seed_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  auto make_seeds = [&](int64 shard_size) {
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.seed_shard_size_ = shard_size;
+    EXPECT_OK(trainer.LoadSentences());
+    std::map<std::string, float> seeds;
+    for (const auto& piece : trainer.MakeSeedSentencePieces()) {
+      seeds[piece.first] = piece.second;
+    }
+    return seeds;
+  };
+
+  // One shard covering the corpus gives the same seeds.
+  const auto seeds = make_seeds(0);
+  const auto one_shard = make_seeds(1 << 20);
+  EXPECT_EQ(seeds.size(), one_shard.size());
+  for (const auto& it : seeds) {
+    ASSERT_TRUE(one_shard.count(it.first));
+    EXPECT_NEAR(it.second, one_shard.at(it.first), 1e-5);
+  }
+
+  // Every word repeats in each shard, so the best seeds are kept.
+  const auto sharded = make_seeds(1000);
+  std::vector<std::pair<std::string, float>> best(seeds.begin(), seeds.end());
+  best = Sorted(best);
+  best.resize(10);
+  for (const auto& it : best) {
+    EXPECT_TRUE(sharded.count(it.first)) << it.first;
+  }
+}
+
+TEST(UnigramTrainerTest, ParallelSuffixArrayTest) {
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.set_num_threads(4);
+  trainer_spec.set_seed_sentencepiece_size(1000);
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+
+  // Random sentences over a small alphabet, with a long repeated block so
+  // that prefix doubling needs many rounds.
+  std::mt19937 mt(1);
+  std::vector<char32> array;
+  for (int i = 0; i < 2000; ++i) {
+    for (int j = mt() % 16; j >= 0; --j) array.push_back('a' + mt() % 3);
+    array.push_back(0);
+  }
+  const std::vector<char32> block(array.begin(), array.begin() + 3000);
+  array.insert(array.end(), block.begin(), block.end());
+  array.insert(array.end(), block.begin(), block.end());
+
+  for (int size : {1, 2, 100, static_cast<int>(array.size())}) {
+    const std::vector<char32> text(array.begin(), array.begin() + size);
+    trainer.SetSuffixArrayBackend(Trainer::SuffixArrayBackend::kSais);
+    const auto expected = trainer.ExtractFrequentSubstrings<int32>(text);
+    trainer.SetSuffixArrayBackend(
+        Trainer::SuffixArrayBackend::kParallelDoubling);
+    const auto actual = trainer.ExtractFrequentSubstrings<int32>(text);
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_EQ(expected[i].piece, actual[i].piece);
+      EXPECT_EQ(expected[i].length, actual[i].length);
+      EXPECT_EQ(expected[i].freq, actual[i].freq);
+    }
+  }
+}
+
+TEST(UnigramTrainerTest, ParallelSeedSelectionTest) {
+  std::mt19937 mt(1);
+  std::vector<char32> array;
+  for (int i = 0; i < 5000; ++i) {
+    for (int j = mt() % 16; j >= 0; --j) array.push_back('a' + mt() % 4);
+    array.push_back(0);
+  }
+
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  for (int seed_size : {1, 50, 1000}) {
+    std::vector<std::vector<std::pair<std::string, int64>>> results;
+    for (int num_threads : {1, 4}) {
+      TrainerSpec trainer_spec;
+      trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+      trainer_spec.set_num_threads(num_threads);
+      trainer_spec.set_seed_sentencepiece_size(seed_size);
+      Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+      results.emplace_back();
+      for (const auto &s : trainer.ExtractFrequentSubstrings<int32>(array)) {
+        results.back().emplace_back(s.piece, s.freq * s.length);
+      }
+    }
+    EXPECT_EQ(seed_size, results[0].size());
+    EXPECT_EQ(results[0], results[1]);
+    for (size_t i = 1; i < results[0].size(); ++i) {
+      EXPECT_GE(results[0][i - 1].second, results[0][i].second);
+    }
+  }
+}
+
+TEST(UnigramTrainerTest, EStepThreadsTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "estep_threads_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {"apple", "pineapple", "pen",
+                                            "banana", "bandana", "nanny"};
+    for (int i = 0; i < 300; ++i) {
+      output->WriteLine(words[i % words.size()] + " " +
+                        words[(i * 5 + i / 7) % words.size()]);
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(30);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "estep_threads_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  // The expectations summed over the threads match the serial ones.
+  auto run_e_step = [&](int num_threads, float *obj, int64 *num_tokens) {
+    trainer_spec.set_num_threads(num_threads);
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    EXPECT_OK(trainer.LoadSentences());
+    TrainerModel model(trainer_spec, normalizer_spec);
+    model.SetSentencePieces(trainer.MakeSeedSentencePieces());
+    return trainer.RunEStep(model, obj, num_tokens);
+  };
+
+  float obj = 0.0, threads_obj = 0.0;
+  int64 num_tokens = 0, threads_num_tokens = 0;
+  const auto expected = run_e_step(1, &obj, &num_tokens);
+  const auto threads_expected =
+      run_e_step(8, &threads_obj, &threads_num_tokens);
+  EXPECT_EQ(num_tokens, threads_num_tokens);
+  EXPECT_NEAR(obj, threads_obj, 1e-3);
+  ASSERT_EQ(expected.size(), threads_expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(expected[i], threads_expected[i], 1e-2);
+  }
+}
+
+TEST(UnigramTrainerTest, EStepAccumulatorTest) {
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(util::JoinPath(::testing::SrcDir(), "botchan.txt"));
+  trainer_spec.set_vocab_size(1000);
+  trainer_spec.set_num_threads(4);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "estep_accumulator_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  // All the accumulators compute the same expectations within float
+  // rounding errors.
+  using EStepAccumulator = Trainer::EStepAccumulator;
+  auto run_e_step = [&](EStepAccumulator accumulator, float *obj,
+                        int64 *num_tokens) {
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.SetEStepAccumulator(accumulator);
+    EXPECT_OK(trainer.LoadSentences());
+    TrainerModel model(trainer_spec, normalizer_spec);
+    model.SetSentencePieces(trainer.MakeSeedSentencePieces());
+    return trainer.RunEStep(model, obj, num_tokens);
+  };
+
+  float obj = 0.0, double_obj = 0.0, kahan_obj = 0.0;
+  int64 num_tokens = 0, double_num_tokens = 0, kahan_num_tokens = 0;
+  const auto expected =
+      run_e_step(EStepAccumulator::kFloat, &obj, &num_tokens);
+  const auto double_expected =
+      run_e_step(EStepAccumulator::kDouble, &double_obj, &double_num_tokens);
+  const auto kahan_expected =
+      run_e_step(EStepAccumulator::kKahan, &kahan_obj, &kahan_num_tokens);
+  EXPECT_EQ(num_tokens, double_num_tokens);
+  EXPECT_EQ(num_tokens, kahan_num_tokens);
+  EXPECT_NEAR(double_obj, obj, std::abs(double_obj) * 1e-4);
+  EXPECT_NEAR(double_obj, kahan_obj, std::abs(double_obj) * 1e-6);
+  ASSERT_EQ(expected.size(), double_expected.size());
+  ASSERT_EQ(expected.size(), kahan_expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(double_expected[i], expected[i],
+                1e-2 + double_expected[i] * 1e-4);
+    EXPECT_NEAR(double_expected[i], kahan_expected[i],
+                1e-3 + double_expected[i] * 1e-6);
+  }
+}
+
+TEST(UnigramTrainerTest, LatticeCacheTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "lattice_cache_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {
+        "apple",  "pineapple", "pen",    "banana", "bandana", "nanny",
+        "cherry", "berry",     "blue",   "bell",   "pepper",  "grape",
+        "orange", "range",     "melon",  "lemon",  "lime",    "time"};
+    std::mt19937 mt(1);
+    for (int i = 0; i < 500; ++i) {
+      std::string line;
+      for (int j = 0; j < 4; ++j) line += words[mt() % words.size()] + " ";
+      output->WriteLine(line);
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(60);
+  trainer_spec.set_hard_vocab_limit(false);
+  trainer_spec.set_split_by_whitespace(false);
+  trainer_spec.set_num_threads(2);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "lattice_cache_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  // The cached lattices give the same pieces and scores, whether all or
+  // only some of the sentences fit in the cache.
+  auto train = [&](int64 cache_size) {
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.SetLatticeCacheSize(cache_size);
+    EXPECT_OK(trainer.Train());
+    return trainer.final_pieces_;
+  };
+
+  const auto expected = train(0);
+  EXPECT_EQ(expected, train(200));
+  EXPECT_EQ(expected, train(1 << 20));
+}
+
+TEST(UnigramTrainerTest, ExternalMemoryTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "external_memory_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {
+        "apple",  "pineapple", "pen",    "banana", "bandana", "nanny",
+        "cherry", "berry",     "blue",   "bell",   "pepper",  "grape",
+        "orange", "range",     "melon",  "lemon",  "lime",    "time"};
+    std::mt19937 mt(1);
+    for (int i = 0; i < 500; ++i) {
+      std::string line;
+      for (int j = 0; j < 1 + i % 5; ++j) {
+        line += words[mt() % words.size()] + " ";
+      }
+      output->WriteLine(line);
+    }
+  }
+  const std::string directory =
+      util::JoinPath(::testing::TempDir(), "external_memory");
+  std::filesystem::create_directories(directory);
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(60);
+  trainer_spec.set_hard_vocab_limit(false);
+  trainer_spec.set_num_threads(3);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "external_memory_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  // The sentences read from the file give the same pieces and scores.
+  for (const bool split_by_whitespace : {true, false}) {
+    trainer_spec.set_split_by_whitespace(split_by_whitespace);
+    auto train = [&](absl::string_view external_memory_dir) {
+      Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+      trainer.SetExternalMemory(external_memory_dir);
+      EXPECT_OK(trainer.Train());
+      EXPECT_EQ(!external_memory_dir.empty(), trainer.sentences_.spilled());
+      return trainer.final_pieces_;
+    };
+    const auto expected = train("");
+    EXPECT_EQ(expected, train(directory));
+  }
+
+  // The file is removed once mapped.
+  EXPECT_TRUE(std::filesystem::is_empty(directory));
+}
+
+TEST(UnigramTrainerTest, EMToleranceTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "em_tolerance_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {
+        "apple",  "pineapple", "pen",    "banana", "bandana", "nanny",
+        "cherry", "berry",     "blue",   "bell",   "pepper",  "grape",
+        "orange", "range",     "melon",  "lemon",  "lime",    "time"};
+    std::mt19937 mt(1);
+    for (int i = 0; i < 500; ++i) {
+      std::string line;
+      for (int j = 0; j < 4; ++j) line += words[mt() % words.size()] + " ";
+      output->WriteLine(line);
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(60);
+  trainer_spec.set_hard_vocab_limit(false);
+  trainer_spec.set_num_sub_iterations(10);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "em_tolerance_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  auto train = [&](double tolerance, int64 *num_skipped) {
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.SetEMTolerance(tolerance);
+    EXPECT_OK(trainer.Train());
+    *num_skipped = trainer.num_skipped_sub_iterations_;
+    return trainer.final_pieces_;
+  };
+
+  // A tiny tolerance only skips the sub-iterations once EM has reached its
+  // fixed point, which does not change the model.
+  int64 num_skipped = 0;
+  const auto expected = train(0.0, &num_skipped);
+  EXPECT_EQ(0, num_skipped);
+  EXPECT_EQ(expected, train(1e-30, &num_skipped));
+
+  // A loose tolerance stops every round after two sub-iterations.
+  const auto converged = train(1.0, &num_skipped);
+  EXPECT_GT(num_skipped, 0);
+  EXPECT_EQ(0, num_skipped % 8);
+  EXPECT_EQ(expected.size(), converged.size());
+}
+
+TEST(UnigramTrainerTest, StochasticEMTest) {
+  const std::string input_file =
+      util::JoinPath(::testing::TempDir(), "stochastic_em_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    const std::vector<std::string> words = {
+        "apple",  "pineapple", "pen",    "banana", "bandana", "nanny",
+        "cherry", "berry",     "blue",   "bell",   "pepper",  "grape",
+        "orange", "range",     "melon",  "lemon",  "lime",    "time"};
+    std::mt19937 mt(1);
+    for (int i = 0; i < 2000; ++i) {
+      std::string line;
+      for (int j = 0; j < 4; ++j) line += words[mt() % words.size()] + " ";
+      output->WriteLine(line);
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_vocab_size(60);
+  trainer_spec.set_hard_vocab_limit(false);
+  trainer_spec.set_split_by_whitespace(false);
+  trainer_spec.set_num_threads(2);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(::testing::TempDir(), "stochastic_em_model"));
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+
+  {
+    // The batches split the sentences, and their expected counts are
+    // scaled up to the whole corpus.
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    EXPECT_OK(trainer.LoadSentences());
+    TrainerModel model(trainer_spec, normalizer_spec);
+    model.SetSentencePieces(trainer.MakeSeedSentencePieces());
+    float objective = 0.0;
+    int64 num_tokens = 0;
+    const auto expected = trainer.RunEStep(model, &objective, &num_tokens);
+    const double total = std::accumulate(expected.begin(), expected.end(), 0.0);
+    for (int batch = 0; batch < 4; ++batch) {
+      float batch_objective = 0.0;
+      int64 batch_num_tokens = 0;
+      const auto batch_expected = trainer.RunEStep(
+          model, &batch_objective, &batch_num_tokens, nullptr, batch, 4);
+      ASSERT_EQ(expected.size(), batch_expected.size());
+      EXPECT_NEAR(total,
+                  std::accumulate(batch_expected.begin(),
+                                  batch_expected.end(), 0.0),
+                  total * 0.2);
+      EXPECT_NEAR(objective, batch_objective, objective * 0.2);
+    }
+  }
+
+  // Stochastic EM makes a model of the same size, which has all the
+  // characters.
+  auto train = [&](int num_batches) {
+    Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.SetStochasticEM(num_batches, 0.7);
+    EXPECT_OK(trainer.Train());
+    std::set<std::string> pieces;
+    for (const auto &piece : trainer.final_pieces_) pieces.insert(piece.first);
+    return pieces;
+  };
+  const auto full = train(1);
+  const auto stochastic = train(4);
+  EXPECT_EQ(full.size(), stochastic.size());
+  for (const auto &piece : full) {
+    if (string_util::UTF8ToUnicodeText(piece).size() == 1) {
+      EXPECT_EQ(1, stochastic.count(piece));
+    }
+  }
+
+  // The step sizes interpolate the running counts by piece.
+  TrainerModel::SentencePieces pieces = {{"a", 0.0}, {"b", 0.0}};
+  absl::flat_hash_map<std::string, float> running;
+  std::vector<float> expected = {4.0, 2.0};
+  Trainer::InterpolateExpected(pieces, 1.0, &running, &expected);
+  EXPECT_EQ(std::vector<float>({4.0, 2.0}), expected);
+  pieces = {{"b", 0.0}, {"c", 0.0}};
+  expected = {6.0, 8.0};
+  Trainer::InterpolateExpected(pieces, 0.5, &running, &expected);
+  EXPECT_EQ(std::vector<float>({4.0, 8.0}), expected);
+  EXPECT_EQ(2, running.size());
+  EXPECT_EQ(4.0, running["b"]);
+}
+
+// The statistics of the shards of a distributed job add up to the ones of
+// the whole corpus, and the job makes a model.
+TEST(UnigramTrainerTest, DistributedTest) {
+  constexpr int kNumShards = 3;
+  const std::vector<std::string> words = {
+      "apple",  "pineapple", "pen",   "banana", "bandana", "nanny",
+      "cherry", "berry",     "blue",  "bell",   "pepper",  "grape",
+      "orange", "range",     "melon", "lemon",  "lime",    "time"};
+  std::vector<std::string> inputs;
+  for (int shard = 0; shard <= kNumShards; ++shard) {
+    inputs.push_back(util::JoinPath(::testing::TempDir(),
+                                    absl::StrCat("distributed_input", shard)));
+  }
+  {
+    // inputs[kNumShards] has all the sentences.
+    std::vector<std::unique_ptr<filesystem::WritableFile>> outputs;
+    for (const auto &input : inputs) {
+      outputs.push_back(filesystem::NewWritableFile(input));
+    }
+    std::mt19937 mt(1);
+    for (int i = 0; i < 600; ++i) {
+      const std::string line =
+          absl::StrCat(words[mt() % words.size()], " ",
+                       words[mt() % words.size()], words[mt() % words.size()]);
+      outputs[i % kNumShards]->WriteLine(line);
+      outputs[kNumShards]->WriteLine(line);
+    }
+  }
+
+  auto make_trainer = [&](int shard) {
+    TrainerSpec trainer_spec;
+    trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+    trainer_spec.add_input(inputs[shard]);
+    trainer_spec.set_vocab_size(60);
+    trainer_spec.set_character_coverage(1.0);
+    trainer_spec.set_hard_vocab_limit(false);
+    trainer_spec.set_model_prefix(util::JoinPath(
+        ::testing::TempDir(), absl::StrCat("distributed_model", shard)));
+    NormalizerSpec normalizer_spec;
+    normalizer_spec.set_name("identity");
+    NormalizerSpec denormalizer_spec;
+    auto trainer = std::make_unique<Trainer>(trainer_spec, normalizer_spec,
+                                             denormalizer_spec);
+    if (shard < kNumShards) {
+      trainer->SetDistributed(::testing::TempDir(), kNumShards, shard);
+    }
+    return trainer;
+  };
+
+  const std::string done = util::JoinPath(::testing::TempDir(), "done");
+  std::remove(done.c_str());
+  std::vector<util::Status> worker_status(kNumShards);
+  std::vector<std::thread> workers;
+  auto start_workers = [&]() {
+    for (int shard = 1; shard < kNumShards; ++shard) {
+      workers.emplace_back([&, shard]() {
+        worker_status[shard] = make_trainer(shard)->Train();
+      });
+    }
+  };
+  auto join_workers = [&]() {
+    for (auto &worker : workers) worker.join();
+    workers.clear();
+    for (int shard = 1; shard < kNumShards; ++shard) {
+      EXPECT_TRUE(worker_status[shard].ok());
+    }
+    std::remove(done.c_str());
+  };
+
+  auto full = make_trainer(kNumShards);
+  ASSERT_TRUE(full->LoadSentences().ok());
+  TrainerModel model(full->trainer_spec_, full->normalizer_spec_);
+  model.SetSentencePieces(full->MakeSeedSentencePieces());
+  full->SplitSentencesByWhitespace();
+
+  start_workers();
+  auto coordinator = make_trainer(0);
+  ASSERT_TRUE(coordinator->LoadSentences().ok());
+  coordinator->SplitSentencesByWhitespace();
+
+  float obj = 0.0;
+  int64 num_tokens = 0;
+  const auto expected = full->RunEStep(model, &obj, &num_tokens);
+  EStepStats stats;
+  ASSERT_TRUE(coordinator->RunDistributedEStep(model, nullptr, &stats).ok());
+  // The tokens are counted once per distinct sentence of a shard.
+  EXPECT_LE(num_tokens, stats.num_tokens);
+  EXPECT_NEAR(obj, stats.objective, 1e-3);
+  ASSERT_EQ(expected.size(), stats.expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_NEAR(expected[i], stats.expected[i], 1e-2);
+  }
+
+  const auto prune_expected = full->ComputePruneStats(model, nullptr);
+  PruneStats prune_stats;
+  ASSERT_TRUE(
+      coordinator->RunDistributedPrune(model, nullptr, &prune_stats).ok());
+  EXPECT_EQ(prune_expected.vsum, prune_stats.vsum);
+  EXPECT_EQ(prune_expected.freq, prune_stats.freq);
+  EXPECT_EQ(prune_expected.sentence_freq, prune_stats.sentence_freq);
+
+  ASSERT_TRUE(WriteFileAtomically(done, "").ok());
+  join_workers();
+
+  // A whole job.
+  start_workers();
+  coordinator = make_trainer(0);
+  EXPECT_TRUE(coordinator->Train().ok());
+  join_workers();
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(util::JoinPath(::testing::TempDir(),
+                                     "distributed_model0.model"))
+                  .ok());
+  EXPECT_GT(sp.GetPieceSize(), words.size());
+}
+
 namespace {
 
 static constexpr char kTestInputData[] = "wagahaiwa_nekodearu.txt";
@@ -202,6 +803,120 @@ TEST(UnigramTrainerTest, EndToEndTest) {
 #endif
 }
 
+// A job resumed from its last checkpoint skips the seeding and the
+// completed rounds, and makes the same model.
+TEST(UnigramTrainerTest, CheckpointTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+  const std::string checkpoint =
+      util::JoinPath(::testing::TempDir(), "unigram_checkpoint");
+
+  auto train = [&](absl::string_view name, absl::string_view checkpoint_path,
+                   absl::string_view resume_from) {
+    const std::string model_prefix =
+        util::JoinPath(::testing::TempDir(), name);
+    EXPECT_TRUE(SentencePieceTrainer::SetCheckpointForTraining(
+                    checkpoint_path, 0, resume_from)
+                    .ok());
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", model_prefix,
+                                 " --input=", input, " --vocab_size=1000"))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_prefix + ".model").ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  const auto expected = train("full_model", checkpoint, "");
+  ASSERT_TRUE(filesystem::NewReadableFile(checkpoint, true)->status().ok());
+  EXPECT_EQ(expected, train("resumed_model", "", checkpoint));
+}
+
+// The models of the larger sizes are saved on the way to the final one.
+TEST(UnigramTrainerTest, ExtraVocabSizesTest) {
+  const std::string input =
+      util::JoinPath(::testing::SrcDir(), "botchan.txt");
+  const std::string model_prefix =
+      util::JoinPath(::testing::TempDir(), "extra_vocab_sizes_model");
+
+  EXPECT_TRUE(
+      SentencePieceTrainer::SetExtraVocabSizesForTraining({2000, 500, 1500})
+          .ok());
+  EXPECT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", model_prefix,
+                               " --input=", input, " --vocab_size=1000"))
+                  .ok());
+  EXPECT_FALSE(SentencePieceTrainer::SetExtraVocabSizesForTraining({0}).ok());
+
+  for (const int size : {1000, 1500, 2000}) {
+    SentencePieceProcessor sp;
+    const std::string filename =
+        size == 1000 ? model_prefix : absl::StrCat(model_prefix, ".", size);
+    ASSERT_TRUE(sp.Load(filename + ".model").ok());
+    EXPECT_EQ(size, sp.GetPieceSize());
+    EXPECT_EQ(size, sp.model_proto().trainer_spec().vocab_size());
+    EXPECT_EQ(filename, sp.model_proto().trainer_spec().model_prefix());
+    EXPECT_FALSE(sp.EncodeAsIds("I am a cat.").empty());
+    EXPECT_TRUE(
+        filesystem::NewReadableFile(filename + ".vocab")->status().ok());
+  }
+  // Smaller than the final size.
+  EXPECT_FALSE(filesystem::NewReadableFile(model_prefix + ".500.model")
+                   ->status()
+                   .ok());
+}
+
+// A model extended on a new corpus keeps the pieces of the base model.
+TEST(UnigramTrainerTest, BaseModelTest) {
+  const std::string base_prefix =
+      util::JoinPath(::testing::TempDir(), "base_model");
+  const std::string model_prefix =
+      util::JoinPath(::testing::TempDir(), "extended_model");
+  EXPECT_TRUE(
+      SentencePieceTrainer::Train(
+          absl::StrCat("--model_prefix=", base_prefix, " --input=",
+                       util::JoinPath(::testing::SrcDir(), kTestInputData),
+                       " --vocab_size=4000 --user_defined_symbols=<sep>"))
+          .ok());
+
+  EXPECT_FALSE(
+      SentencePieceTrainer::SetBaseModelForTraining(base_prefix + ".model", 0)
+          .ok());
+  EXPECT_TRUE(
+      SentencePieceTrainer::SetBaseModelForTraining(base_prefix + ".model", 500)
+          .ok());
+  EXPECT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", model_prefix, " --input=",
+                               util::JoinPath(::testing::SrcDir(),
+                                              "botchan.txt"),
+                               " --normalization_rule_name=identity"))
+                  .ok());
+
+  SentencePieceProcessor base, extended;
+  ASSERT_TRUE(base.Load(base_prefix + ".model").ok());
+  ASSERT_TRUE(extended.Load(model_prefix + ".model").ok());
+  EXPECT_EQ(4500, extended.GetPieceSize());
+  EXPECT_EQ(base.model_proto().normalizer_spec().name(),
+            extended.model_proto().normalizer_spec().name());
+  for (int id = 0; id < base.GetPieceSize(); ++id) {
+    EXPECT_EQ(base.IdToPiece(id), extended.IdToPiece(id));
+    EXPECT_EQ(base.model_proto().pieces(id).type(),
+              extended.model_proto().pieces(id).type());
+  }
+  for (int id = base.GetPieceSize(); id < extended.GetPieceSize(); ++id) {
+    EXPECT_EQ(ModelProto::SentencePiece::NORMAL,
+              extended.model_proto().pieces(id).type());
+  }
+
+  // The new pieces cover the new corpus.
+  const std::string text = "I am a cat. I have no name yet.";
+  EXPECT_LT(extended.EncodeAsIds(text).size(), base.EncodeAsIds(text).size());
+}
+
 }  // namespace
 }  // namespace unigram
 }  // namespace sentencepiece
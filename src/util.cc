@@ -15,8 +15,24 @@
 #include "util.h"
 
 #include <atomic>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <mutex>
+
+#ifndef OS_WIN
+#include <pthread.h>
+#endif
+
+#include "cpu_features.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace sentencepiece {
 
@@ -30,6 +46,10 @@ void SetRandomGeneratorSeed(unsigned int seed) {
   if (seed != kDefaultSeed) g_seed.store(seed);
 }
 
+void SetThreadRandomGeneratorSeed(uint64_t seed, uint64_t stream) {
+  random::GetRandomGenerator()->Seed(seed, stream);
+}
+
 uint32 GetRandomGeneratorSeed() {
   try {
     return g_seed == kDefaultSeed ? std::random_device{}() : g_seed.load();
@@ -83,11 +103,82 @@ char32 DecodeUTF8(const char *begin, const char *end, size_t *mblen) {
   return kUnicodeError;
 }
 
+namespace {
+#ifdef SPM_X86_DISPATCH
+// Returns the first byte >= 0x80 in [p, end), or the end of the last full
+// block.
+SPM_TARGET_AVX2 const char *SkipASCIIAVX2(const char *p, const char *end) {
+  for (; p + 32 <= end; p += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    const uint32 mask = _mm256_movemask_epi8(v);
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  return p;
+}
+
+SPM_TARGET_AVX512 const char *SkipASCIIAVX512(const char *p,
+                                              const char *end) {
+  for (; p + 64 <= end; p += 64) {
+    const __m512i v = _mm512_loadu_si512(p);
+    const uint64 mask = _mm512_movepi8_mask(v);
+    if (mask != 0) return p + __builtin_ctzll(mask);
+  }
+  return p;
+}
+#endif  // SPM_X86_DISPATCH
+}  // namespace
+
+size_t ASCIIPrefixLength(absl::string_view str) {
+  const char *begin = str.data();
+  const char *end = str.data() + str.size();
+  const char *p = begin;
+  const cpu::SimdLevel level = cpu::GetSimdLevel();
+  static_cast<void>(level);  // Unused without SIMD.
+#if defined(__SSE2__) || defined(SPM_X86_DISPATCH)
+#ifdef SPM_X86_DISPATCH
+  if (level >= cpu::SimdLevel::kAVX512) {
+    p = SkipASCIIAVX512(p, end);
+  } else if (level >= cpu::SimdLevel::kAVX2) {
+    p = SkipASCIIAVX2(p, end);
+  }
+#endif  // SPM_X86_DISPATCH
+#if defined(__SSE2__)
+  if (level >= cpu::SimdLevel::kSSE2) {
+    for (; p + 16 <= end; p += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      // The mask has the top bit of every byte.
+      const int mask = _mm_movemask_epi8(v);
+      if (mask != 0) return p - begin + __builtin_ctz(mask);
+    }
+  }
+#endif  // __SSE2__
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  if (level == cpu::SimdLevel::kNEON) {
+    for (; p + 16 <= end; p += 16) {
+      const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+      if (vmaxvq_u8(v) >= 0x80) break;
+    }
+  }
+#endif
+  // Eight bytes at once, then one by one.
+  for (; p + 8 <= end; p += 8) {
+    uint64 v;
+    std::memcpy(&v, p, sizeof(v));
+    if (v & 0x8080808080808080ULL) break;
+  }
+  for (; p < end && static_cast<unsigned char>(*p) < 0x80; ++p) {
+  }
+  return p - begin;
+}
+
 bool IsStructurallyValid(absl::string_view str) {
   const char *begin = str.data();
   const char *end = str.data() + str.size();
   size_t mblen = 0;
   while (begin < end) {
+    // ASCII runs are valid as they are.
+    begin += ASCIIPrefixLength(absl::string_view(begin, end - begin));
+    if (begin == end) break;
     const char32 c = DecodeUTF8(begin, end, &mblen);
     if (c == kUnicodeError && mblen != 3) return false;
     if (!IsValidCodepoint(c)) return false;
@@ -137,9 +228,21 @@ std::string UnicodeCharToUTF8(const char32 c) { return UnicodeTextToUTF8({c}); }
 
 UnicodeText UTF8ToUnicodeText(absl::string_view utf8) {
   UnicodeText uc;
+  uc.reserve(utf8.size());
   const char *begin = utf8.data();
   const char *end = utf8.data() + utf8.size();
   while (begin < end) {
+    // ASCII runs are widened in bulk; the loop is vectorized by the compiler.
+    const size_t n = ASCIIPrefixLength(absl::string_view(begin, end - begin));
+    if (n > 0) {
+      const size_t size = uc.size();
+      uc.resize(size + n);
+      const auto *src = reinterpret_cast<const unsigned char *>(begin);
+      char32 *dst = uc.data() + size;
+      for (size_t i = 0; i < n; ++i) dst[i] = src[i];
+      begin += n;
+      if (begin == end) break;
+    }
     size_t mblen;
     const char32 c = DecodeUTF8(begin, end, &mblen);
     uc.push_back(c);
@@ -159,6 +262,32 @@ std::string UnicodeTextToUTF8(const UnicodeText &utext) {
 }
 }  // namespace string_util
 
+namespace port {
+namespace {
+inline uint64 SplitMix(uint64 z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+}  // namespace
+
+uint64 Fingerprint(absl::string_view data) {
+  uint64 hash = data.size() * 0x9E3779B97F4A7C15ULL;
+  for (; data.size() >= 8; data.remove_prefix(8)) {
+    uint64 word = 0;
+    for (int i = 7; i >= 0; --i) {
+      word = word << 8 | static_cast<uint8>(data[i]);
+    }
+    hash = SplitMix(hash ^ word);
+  }
+  uint64 word = 0;
+  for (int i = static_cast<int>(data.size()) - 1; i >= 0; --i) {
+    word = word << 8 | static_cast<uint8>(data[i]);
+  }
+  return SplitMix(hash ^ word ^ 0xFF);
+}
+}  // namespace port
+
 namespace random {
 #ifdef SPM_NO_THREADLOCAL
 namespace {
@@ -169,39 +298,33 @@ class RandomGeneratorStorage {
   }
   virtual ~RandomGeneratorStorage() { pthread_key_delete(key_); }
 
-  std::mt19937 *Get() {
-    auto *result = static_cast<std::mt19937 *>(pthread_getspecific(key_));
+  RandomGenerator *Get() {
+    auto *result = static_cast<RandomGenerator *>(pthread_getspecific(key_));
     if (result == nullptr) {
-      result = new std::mt19937(GetRandomGeneratorSeed());
+      result = new RandomGenerator(GetRandomGeneratorSeed());
       pthread_setspecific(key_, result);
     }
     return result;
   }
 
  private:
-  static void Delete(void *value) { delete static_cast<std::mt19937 *>(value); }
+  static void Delete(void *value) {
+    delete static_cast<RandomGenerator *>(value);
+  }
   pthread_key_t key_;
 };
 }  // namespace
 
-std::mt19937 *GetRandomGenerator() {
+RandomGenerator *GetRandomGenerator() {
   static RandomGeneratorStorage *storage = new RandomGeneratorStorage;
   return storage->Get();
 }
 #else
-std::mt19937 *GetRandomGenerator() {
-  // Thread-locals occupy stack space in every thread ever created by the
-  // program, even if that thread never uses the thread-local variable.
-  //
-  // https://maskray.me/blog/2021-02-14-all-about-thread-local-storage
-  //
-  // sizeof(std::mt19937) is several kilobytes, so it is safer to put that on
-  // the heap, leaving only a pointer to it in thread-local storage.  This must
-  // be a unique_ptr, not a raw pointer, so that the generator is not leaked on
-  // thread exit.
-  thread_local static auto mt =
-      std::make_unique<std::mt19937>(GetRandomGeneratorSeed());
-  return mt.get();
+RandomGenerator *GetRandomGenerator() {
+  // The generator is small enough to live in the thread-local storage
+  // itself, so a call is a plain TLS access.
+  thread_local static RandomGenerator generator(GetRandomGeneratorSeed());
+  return &generator;
 }
 #endif
 }  // namespace random
@@ -274,6 +397,176 @@ std::wstring Utf8ToWide(absl::string_view input) {
 #endif
 }  // namespace util
 
+namespace {
+// Incremented in the child of every fork() once a pool has started.
+std::atomic<uint64> fork_generation(0);
+
+void InstallForkHandler() {
+#ifndef OS_WIN
+  static std::once_flag once;
+  std::call_once(once, []() {
+    pthread_atfork(nullptr, nullptr, []() { ++fork_generation; });
+  });
+#endif
+}
+}  // namespace
+
+ThreadPool::ThreadPool(int32 n, std::function<void(int32)> init_worker)
+    : state_(std::make_unique<State>()) {
+  InstallForkHandler();
+  fork_generation_ = fork_generation.load();
+  size_ = std::max<int32>(1, n);
+  state_->queues.reserve(size_);
+  for (int32 i = 0; i < size_; ++i) {
+    state_->queues.emplace_back(std::make_unique<TaskQueue>());
+  }
+  state_->workers.reserve(size_);
+  for (int32 i = 0; i < size_; ++i) {
+    state_->workers.emplace_back([this, i, init_worker]() {
+      SPM_TRACE_THREAD_NAME(absl::StrCat("worker ", i));
+      if (init_worker) init_worker(i);
+      WorkerLoop(i);
+    });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  if (forked()) {
+    // The workers are not running, and the mutexes may be held by them.
+    state_.release();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->stopped = true;
+  }
+  state_->cond.notify_all();
+  for (auto &worker : state_->workers) {
+    worker.join();
+  }
+}
+
+bool ThreadPool::forked() const {
+  return fork_generation_ != fork_generation.load();
+}
+
+void ThreadPool::Schedule(std::function<void()> closure) {
+  auto &queues = state_->queues;
+  auto *queue = queues[state_->next_queue.fetch_add(1) % queues.size()].get();
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->tasks.emplace_back(std::move(closure));
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    ++state_->pending;
+  }
+  state_->cond.notify_one();
+}
+
+bool ThreadPool::PopTask(int32 index, std::function<void()> *task) {
+  const auto &queues = state_->queues;
+  {
+    auto *queue = queues[index].get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (!queue->tasks.empty()) {
+      *task = std::move(queue->tasks.front());
+      queue->tasks.pop_front();
+      return true;
+    }
+  }
+  for (size_t n = 1; n < queues.size(); ++n) {
+    auto *queue = queues[(index + n) % queues.size()].get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (!queue->tasks.empty()) {
+      *task = std::move(queue->tasks.back());
+      queue->tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::WorkerLoop(int32 index) {
+  auto *state = state_.get();
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->cond.wait(lock, [state]() {
+        return state->stopped || state->pending > 0;
+      });
+      // Drains the remaining closures before exiting.
+      if (state->pending == 0) return;
+    }
+    std::function<void()> task;
+    if (!PopTask(index, &task)) {
+      // Another worker took the task between the wakeup and the pop.
+      std::this_thread::yield();
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      --state->pending;
+    }
+    SPM_TRACE_SPAN("task");
+    task();
+  }
+}
+
+void ThreadPool::ParallelFor(
+    int64 size, int64 chunk_size,
+    const std::function<void(int32, int64, int64)> &func, int32 max_threads) {
+  if (size <= 0) return;
+  if (chunk_size <= 0) {
+    constexpr int64 kChunksPerWorker = 16;
+    chunk_size = size / (kChunksPerWorker * this->size());
+  }
+  chunk_size = std::max<int64>(1, chunk_size);
+  const int64 num_chunks = (size + chunk_size - 1) / chunk_size;
+  int32 num_slots = std::min<int64>(this->size(), num_chunks);
+  if (max_threads > 0) num_slots = std::min(num_slots, max_threads);
+
+  if (num_slots <= 1) {
+    func(0, 0, size);
+    return;
+  }
+
+  // Helpers may start after the loop has finished, so the shared state
+  // outlives this call. `func` is only touched while a chunk is available.
+  struct State {
+    std::atomic<int64> next{0};
+    std::mutex mutex;
+    std::condition_variable cond;
+    int32 active = 0;
+  };
+  auto state = std::make_shared<State>();
+  const auto *func_ptr = &func;
+
+  auto run = [state, size, chunk_size, func_ptr](int32 slot) {
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      ++state->active;
+    }
+    SPM_TRACE_SPAN("parallel_for");
+    int64 begin = 0;
+    while ((begin = state->next.fetch_add(chunk_size)) < size) {
+      (*func_ptr)(slot, begin, std::min(size, begin + chunk_size));
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (--state->active == 0) state->cond.notify_all();
+  };
+
+  for (int32 slot = 1; slot < num_slots; ++slot) {
+    Schedule([run, slot]() { run(slot); });
+  }
+  run(0);
+
+  // All chunks have been claimed here. Waits for the helpers still running.
+  SPM_TRACE_SPAN("parallel_for_wait");
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cond.wait(lock, [&state]() { return state->active == 0; });
+}
+
 namespace log_domain {
 double LogSum(const std::vector<double> &xs) {
   if (xs.empty()) {
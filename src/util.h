@@ -19,8 +19,13 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <string>
@@ -99,6 +104,42 @@ inline std::string EncodePOD(const T &value) {
   return s;
 }
 
+// Appends `value` to `output` as 4 bytes in little-endian order.
+inline void AppendUInt32(uint32 value, std::string *output) {
+#ifdef IS_BIG_ENDIAN
+  value = util::Swap32(value);
+#endif
+  output->append(EncodePOD<uint32>(value));
+}
+
+// Appends the size of `bytes` and `bytes` to `output`.
+inline void AppendBytes(absl::string_view bytes, std::string *output) {
+  AppendUInt32(bytes.size(), output);
+  output->append(bytes.data(), bytes.size());
+}
+
+// Reads a value written by AppendUInt32() from the front of `input`.
+inline bool ConsumeUInt32(absl::string_view *input, uint32 *value) {
+  if (input->size() < sizeof(uint32) ||
+      !DecodePOD<uint32>(input->substr(0, sizeof(uint32)), value)) {
+    return false;
+  }
+#ifdef IS_BIG_ENDIAN
+  *value = util::Swap32(*value);
+#endif
+  input->remove_prefix(sizeof(uint32));
+  return true;
+}
+
+// Reads bytes written by AppendBytes() from the front of `input`.
+inline bool ConsumeBytes(absl::string_view *input, std::string *bytes) {
+  uint32 size = 0;
+  if (!ConsumeUInt32(input, &size) || input->size() < size) return false;
+  bytes->assign(input->data(), size);
+  input->remove_prefix(size);
+  return true;
+}
+
 template <typename T>
 inline std::string IntToHex(T value) {
   std::ostringstream os;
@@ -162,6 +203,10 @@ inline bool IsValidCodepoint(char32 c) {
 
 bool IsStructurallyValid(absl::string_view str);
 
+// Returns the length of the longest prefix of `str` made of ASCII bytes
+// (< 0x80). Scans 16 bytes at once with SSE2 or NEON when available.
+size_t ASCIIPrefixLength(absl::string_view str);
+
 using UnicodeText = std::vector<char32>;
 
 char32 DecodeUTF8(const char *begin, const char *end, size_t *mblen);
@@ -282,11 +327,71 @@ inline uint64 FingerprintCat(uint64 x, uint64 y) {
   return y;
 }
 
+// Fingerprint of `data`, read 8 bytes at a time in little-endian and mixed
+// with splitmix64, so that it is the same on all platforms and builds.
+uint64 Fingerprint(absl::string_view data);
+
 }  // namespace port
 
 namespace random {
 
-std::mt19937 *GetRandomGenerator();
+// xoshiro256** (https://prng.di.unimi.it/). Its state is 32 bytes, so it is
+// much cheaper to keep per thread and to seed than std::mt19937. It meets
+// the UniformRandomBitGenerator requirements, so the std distributions
+// accept it.
+class Xoshiro256 {
+ public:
+  using result_type = uint64;
+
+  explicit Xoshiro256(uint64 seed, uint64 stream = 0) { Seed(seed, stream); }
+
+  // Restarts the sequence. The sequences of different `stream`s with the
+  // same `seed` are independent.
+  void Seed(uint64 seed, uint64 stream = 0) {
+    uint64 x = seed ^ Mix(stream + 0x9E3779B97F4A7C15ULL);
+    for (auto &s : s_) {
+      x += 0x9E3779B97F4A7C15ULL;
+      s = Mix(x);
+    }
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type{0}; }
+
+  result_type operator()() {
+    const uint64 result = Rotl(s_[1] * 5, 7) * 9;
+    const uint64 t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = Rotl(s_[3], 45);
+    return result;
+  }
+
+  // Returns a uniform sample from [0, 1) without a distribution object.
+  double UniformDouble() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+ private:
+  static uint64 Rotl(uint64 x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  // The splitmix64 finalizer.
+  static uint64 Mix(uint64 z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64 s_[4];
+};
+
+// The generator of the sampling functions.
+using RandomGenerator = Xoshiro256;
+
+// Returns the generator of the calling thread, seeded with
+// GetRandomGeneratorSeed() on the first call.
+RandomGenerator *GetRandomGenerator();
 
 template <typename T>
 class ReservoirSampler {
@@ -319,6 +424,74 @@ class ReservoirSampler {
   std::mt19937 engine_;
 };
 
+// Keeps the `size` items with the smallest keys. When the key of an item is
+// a hash of its position in the data, e.g. PriorityKey(seed, line_number),
+// the items form a uniform random sample which does not depend on the order
+// of Add() calls. Samplers filled from disjoint shards of the data, possibly
+// on different threads or machines, can then be merged into exactly the
+// sample a single sampler over all the data would keep.
+template <typename T>
+class PrioritySampler {
+ public:
+  explicit PrioritySampler(uint64 size) : size_(size) {}
+  virtual ~PrioritySampler() {}
+
+  // Returns true if an item with `key` would be kept now.
+  bool Accepts(uint64 key) const {
+    return size_ > 0 && (heap_.size() < size_ || key < heap_.front().first);
+  }
+
+  void Add(uint64 key, const T &item) {
+    ++total_;
+    if (Accepts(key)) Push(key, T(item));
+  }
+
+  // Moves the items of `other` to this sampler.
+  void Merge(PrioritySampler *other) {
+    total_ += other->total_;
+    for (auto &entry : other->heap_) {
+      if (Accepts(entry.first)) Push(entry.first, std::move(entry.second));
+    }
+    other->heap_.clear();
+    other->total_ = 0;
+  }
+
+  // Appends the kept items to `sampled` in ascending order of their keys.
+  void Finish(std::vector<T> *sampled) {
+    std::sort_heap(heap_.begin(), heap_.end(), KeyLess);
+    for (auto &entry : heap_) sampled->emplace_back(std::move(entry.second));
+    heap_.clear();
+  }
+
+  uint64 total_size() const { return total_; }
+
+ private:
+  using Entry = std::pair<uint64, T>;
+
+  static bool KeyLess(const Entry &a, const Entry &b) {
+    return a.first < b.first;
+  }
+
+  // Inserts the item, evicting the one with the largest key when full.
+  void Push(uint64 key, T &&item) {
+    if (heap_.size() == size_) {
+      std::pop_heap(heap_.begin(), heap_.end(), KeyLess);
+      heap_.pop_back();
+    }
+    heap_.emplace_back(key, std::move(item));
+    std::push_heap(heap_.begin(), heap_.end(), KeyLess);
+  }
+
+  uint64 size_ = 0;
+  uint64 total_ = 0;
+  std::vector<Entry> heap_;  // max-heap on the keys.
+};
+
+// Returns the sampling key of the `index`-th item for PrioritySampler.
+inline uint64 PriorityKey(uint64 seed, uint64 index) {
+  return port::FingerprintCat(seed, index);
+}
+
 }  // namespace random
 
 namespace util {
@@ -415,22 +588,110 @@ void STLDeleteElements(std::vector<T *> *vec) {
   }
   vec->clear();
 }
+
+// Estimated heap bytes of the standard containers for the memory usage
+// reports. The allocator overhead is not counted.
+template <typename T, typename A>
+size_t VectorBytes(const std::vector<T, A> &vec) {
+  return vec.capacity() * sizeof(T);
+}
+
+// A short string is held in the object and has no heap bytes.
+inline size_t StringBytes(const std::string &str) {
+  return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+// The buckets and the nodes, which hold the value, the next pointer and
+// the cached hash, of a node-based hash map or set.
+template <typename Map>
+size_t HashMapBytes(const Map &map) {
+  return map.bucket_count() * sizeof(void *) +
+         map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void *));
+}
 }  // namespace port
 
+// Work-stealing thread pool with a fixed number of persistent workers.
+// Each worker owns a task queue. Scheduled closures are distributed over the
+// queues in round-robin order; an idle worker first drains its own queue and
+// then steals from the back of the others, so uneven tasks are balanced
+// dynamically. The destructor waits until all scheduled closures have
+// finished.
+//
+// The workers do not survive a fork(). A pool made before the process
+// forked must not be used in the child, where forked() returns true, and
+// its destructor there releases nothing, as the mutexes and the threads of
+// the workers are in the state of the parent.
 class ThreadPool {
  public:
-  ThreadPool(int32 n) {}
-  virtual ~ThreadPool() {
-    for (auto &task : tasks_) {
-      task.join();
-    }
+  // Starts `n` workers. Each worker calls `init_worker(index)` first, e.g.
+  // to bind itself to a set of cpus, when it is given.
+  explicit ThreadPool(int32 n,
+                      std::function<void(int32)> init_worker = nullptr);
+  virtual ~ThreadPool();
+
+  void Schedule(std::function<void()> closure);
+
+  // Schedules `func` and returns a future holding its result.
+  template <typename Func>
+  auto Submit(Func &&func) -> std::future<decltype(func())> {
+    using Result = decltype(func());
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+        std::forward<Func>(func));
+    auto future = task->get_future();
+    Schedule([task]() { (*task)(); });
+    return future;
   }
 
-  void Schedule(std::function<void()> closure) { tasks_.emplace_back(closure); }
+  // Runs `func(slot, begin, end)` over [0, size) split into chunks of
+  // `chunk_size` elements. Chunks are handed out dynamically to the workers
+  // and the calling thread. `slot` is in [0, size()) and is never used by two
+  // threads at the same time, so it can index per-thread accumulators.
+  // When `chunk_size` <= 0, a few chunks per worker are used. When
+  // `max_threads` > 0, at most `max_threads` threads, including the calling
+  // one, run the chunks.
+  // Returns after all chunks have been processed.
+  void ParallelFor(int64 size, int64 chunk_size,
+                   const std::function<void(int32, int64, int64)> &func,
+                   int32 max_threads = 0);
+
+  // Workers are started in the constructor. Kept for compatibility.
   void StartWorkers() {}
 
+  // Returns the number of worker threads.
+  int32 size() const { return size_; }
+
+  // Returns true in the child of a fork() made after the pool started.
+  bool forked() const;
+
  private:
-  std::vector<std::thread> tasks_;
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  // The queues, the synchronization and the workers, which are leaked
+  // instead of destroyed in the child of a fork().
+  struct State {
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::atomic<uint32> next_queue{0};
+
+    // Guards `pending` and `stopped`. Idle workers sleep on `cond`.
+    std::mutex mutex;
+    std::condition_variable cond;
+    int64 pending = 0;
+    bool stopped = false;
+
+    std::vector<std::thread> workers;
+  };
+
+  // Pops a task from the queue of `index`, or steals one from another queue.
+  bool PopTask(int32 index, std::function<void()> *task);
+  void WorkerLoop(int32 index);
+
+  std::unique_ptr<State> state_;
+  int32 size_ = 0;
+  // The number of fork()s of the process when the pool started.
+  uint64 fork_generation_ = 0;
 };
 
 namespace log_domain {
@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <atomic>
+#include <future>
 #include <map>
 
 #include "filesystem.h"
@@ -19,6 +21,11 @@
 #include "third_party/absl/strings/str_cat.h"
 #include "util.h"
 
+#ifndef OS_WIN
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 namespace sentencepiece {
 namespace {
 constexpr int kMaxUnicode = 0x10FFFF;
@@ -284,6 +291,48 @@ TEST(UtilTest, IsStructurallyValidTest) {
   EXPECT_FALSE(string_util::IsStructurallyValid("\xf0\x83\xbe\xbd"));
 }
 
+TEST(UtilTest, ASCIIPrefixLengthTest) {
+  EXPECT_EQ(0, string_util::ASCIIPrefixLength(""));
+  EXPECT_EQ(4, string_util::ASCIIPrefixLength("abcd"));
+  EXPECT_EQ(2, string_util::ASCIIPrefixLength("ab\xc3\x81"));
+  EXPECT_EQ(0, string_util::ASCIIPrefixLength("\x80"));
+  // Every position across the 16 and 8 byte blocks.
+  for (size_t size = 1; size < 40; ++size) {
+    for (size_t pos = 0; pos <= size; ++pos) {
+      std::string str(size, 'a');
+      if (pos < size) str[pos] = '\xff';
+      EXPECT_EQ(pos, string_util::ASCIIPrefixLength(str));
+      // The view ends before the non-ASCII byte.
+      EXPECT_EQ(pos, string_util::ASCIIPrefixLength(
+                         absl::string_view(str.data(), pos)));
+    }
+  }
+}
+
+TEST(UtilTest, UTF8ScanTest) {
+  // Compares with the character by character decoding.
+  const std::vector<std::string> parts = {
+      "a", "bcdefgh", " ", "\xc3\x81", "\xe3\x81\x81", "\xf2\x82\x81\x84",
+      "\xef\xbf\xbd", "\x80", "\xc3", "\xed\xa0\x80", std::string(20, 'x')};
+  std::mt19937 mt(0);
+  std::uniform_int_distribution<int> dist(0, parts.size() - 1);
+  for (int n = 0; n < 1000; ++n) {
+    std::string str;
+    for (int i = 0; i < n % 30; ++i) str += parts[dist(mt)];
+    string_util::UnicodeText expected;
+    bool valid = true;
+    size_t mblen = 0;
+    for (const char *p = str.data(); p < str.data() + str.size(); p += mblen) {
+      const char32 c = string_util::DecodeUTF8(p, str.data() + str.size(),
+                                               &mblen);
+      if (c == kUnicodeError && mblen != 3) valid = false;
+      expected.push_back(c);
+    }
+    EXPECT_EQ(expected, string_util::UTF8ToUnicodeText(str));
+    EXPECT_EQ(valid, string_util::IsStructurallyValid(str));
+  }
+}
+
 TEST(UtilTest, UnicodeTextToUTF8Test) {
   string_util::UnicodeText ut;
 
@@ -414,6 +463,36 @@ TEST(UtilTest, JoinPathTest) {
   EXPECT_EQ("", util::JoinPath(""));
 }
 
+TEST(UtilTest, RandomGeneratorTest) {
+  auto draw = [](random::RandomGenerator *gen) {
+    std::vector<uint64> result;
+    for (int i = 0; i < 8; ++i) result.push_back((*gen)());
+    return result;
+  };
+  random::RandomGenerator a(1), b(1), c(2), d(1, 1);
+  const auto sampled = draw(&a);
+  EXPECT_EQ(sampled, draw(&b));
+  EXPECT_NE(sampled, draw(&c));
+  EXPECT_NE(sampled, draw(&d));
+
+  a.Seed(1);
+  EXPECT_EQ(sampled, draw(&a));
+
+  for (int i = 0; i < 1000; ++i) {
+    const double v = a.UniformDouble();
+    EXPECT_LE(0.0, v);
+    EXPECT_LT(v, 1.0);
+  }
+
+  // Reseeding the thread's generator makes its draws reproducible.
+  SetThreadRandomGeneratorSeed(3, 4);
+  const auto thread_sampled = draw(random::GetRandomGenerator());
+  SetThreadRandomGeneratorSeed(3, 4);
+  EXPECT_EQ(thread_sampled, draw(random::GetRandomGenerator()));
+  random::RandomGenerator e(3, 4);
+  EXPECT_EQ(thread_sampled, draw(&e));
+}
+
 TEST(UtilTest, ReservoirSamplerTest) {
   std::vector<int> sampled;
   random::ReservoirSampler<int> sampler(&sampled, 100);
@@ -424,6 +503,46 @@ TEST(UtilTest, ReservoirSamplerTest) {
   EXPECT_EQ(10000, sampler.total_size());
 }
 
+TEST(UtilTest, PrioritySamplerTest) {
+  random::PrioritySampler<int> sampler(100);
+  for (int i = 0; i < 10000; ++i) {
+    sampler.Add(random::PriorityKey(1, i), i);
+  }
+  EXPECT_EQ(10000, sampler.total_size());
+  std::vector<int> sampled;
+  sampler.Finish(&sampled);
+  EXPECT_EQ(100, sampled.size());
+
+  // Samplers of shards are merged into the same sample, whatever the order of
+  // the items.
+  std::vector<random::PrioritySampler<int>> shards(
+      7, random::PrioritySampler<int>(100));
+  for (int i = 9999; i >= 0; --i) {
+    shards[i % 7].Add(random::PriorityKey(1, i), i);
+  }
+  random::PrioritySampler<int> merged(100);
+  for (auto &shard : shards) merged.Merge(&shard);
+  EXPECT_EQ(10000, merged.total_size());
+  std::vector<int> merged_sampled;
+  merged.Finish(&merged_sampled);
+  EXPECT_EQ(sampled, merged_sampled);
+
+  // Another seed gives another sample.
+  random::PrioritySampler<int> other(100);
+  for (int i = 0; i < 10000; ++i) {
+    other.Add(random::PriorityKey(2, i), i);
+  }
+  std::vector<int> other_sampled;
+  other.Finish(&other_sampled);
+  EXPECT_NE(sampled, other_sampled);
+
+  random::PrioritySampler<int> empty(0);
+  empty.Add(1, 1);
+  std::vector<int> empty_sampled;
+  empty.Finish(&empty_sampled);
+  EXPECT_TRUE(empty_sampled.empty());
+}
+
 TEST(UtilTest, StrSplitAsCSVTest) {
   {
     const auto v = util::StrSplitAsCSV("foo,bar,buz");
@@ -448,4 +567,90 @@ TEST(UtilTest, StrSplitAsCSVTest) {
     EXPECT_EQ("1,2,3,4", v[1]);
   }
 }
+TEST(UtilTest, ThreadPoolTest) {
+  std::atomic<int> sum = 0;
+  {
+    ThreadPool pool(4);
+    EXPECT_EQ(4, pool.size());
+    for (int i = 1; i <= 1000; ++i) {
+      pool.Schedule([&sum, i]() { sum += i; });
+    }
+  }
+  EXPECT_EQ(500500, sum.load());
+
+  ThreadPool pool(0);
+  EXPECT_EQ(1, pool.size());
+}
+
+#ifndef OS_WIN
+TEST(UtilTest, ThreadPoolForkTest) {
+  ThreadPool pool(2);
+  EXPECT_FALSE(pool.forked());
+  pool.Submit([]() {}).get();
+  const pid_t pid = ::fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    // The pool of the parent is released without joining its workers.
+    std::atomic<int> sum = 0;
+    {
+      ThreadPool child_pool(2);
+      for (int i = 1; i <= 100; ++i) {
+        child_pool.Schedule([&sum, i]() { sum += i; });
+      }
+    }
+    ::_exit(pool.forked() && sum.load() == 5050 ? 0 : 1);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  EXPECT_FALSE(pool.forked());
+}
+#endif
+
+TEST(UtilTest, ThreadPoolSubmitTest) {
+  ThreadPool pool(3);
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 10; ++i) {
+    futures.emplace_back(pool.Submit([i]() { return i * i; }));
+  }
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(i * i, futures[i].get());
+  }
+}
+
+TEST(UtilTest, ThreadPoolParallelForTest) {
+  for (const int num_threads : {1, 4}) {
+    ThreadPool pool(num_threads);
+    for (const int64 chunk_size : {0, 1, 7, 1000}) {
+      std::vector<int> visited(1000, 0);
+      std::vector<int64> sums(pool.size(), 0);
+      pool.ParallelFor(visited.size(), chunk_size,
+                       [&](int32 slot, int64 begin, int64 end) {
+                         EXPECT_LT(slot, pool.size());
+                         EXPECT_LE(begin, end);
+                         for (int64 i = begin; i < end; ++i) {
+                           ++visited[i];
+                           sums[slot] += i;
+                         }
+                       });
+      EXPECT_EQ(std::vector<int>(1000, 1), visited);
+      int64 total = 0;
+      for (const auto sum : sums) total += sum;
+      EXPECT_EQ(499500, total);
+    }
+
+    int called = 0;
+    pool.ParallelFor(0, 1, [&](int32, int64, int64) { ++called; });
+    EXPECT_EQ(0, called);
+
+    // Slots of the threads beyond `max_threads` are never used.
+    std::vector<int> used(pool.size(), 0);
+    pool.ParallelFor(
+        1000, 1, [&](int32 slot, int64, int64) { used[slot] = 1; }, 2);
+    for (int32 slot = 2; slot < pool.size(); ++slot) {
+      EXPECT_EQ(0, used[slot]);
+    }
+  }
+}
 }  // namespace sentencepiece
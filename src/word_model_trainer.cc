@@ -13,7 +13,10 @@
 // limitations under the License.!
 
 #include <cmath>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/strings/string_view.h"
@@ -30,21 +33,59 @@ util::Status Trainer::Train() {
   CHECK_OR_RETURN(normalizer_spec_.escape_whitespaces());
   CHECK_EQ_OR_RETURN(TrainerSpec::WORD, trainer_spec_.model_type());
 
+  // The words are split with the default options of SplitIntoWords() below,
+  // which splitting while loading only reproduces with the same options.
+  split_by_whitespace_while_loading_ =
+      !trainer_spec_.treat_whitespace_as_suffix() &&
+      !trainer_spec_.allow_whitespace_only_pieces();
   RETURN_IF_ERROR(LoadSentences());
 
-  absl::flat_hash_map<std::string, uint64> freq;
-  for (const auto &it : sentences_) {
-    for (const auto &s : SplitIntoWords(it.first)) {
-      freq[std::string(s)] += it.second;
-    }
+  // The words are counted in parallel, keyed by views of the sentences,
+  // which are not modified below. Each slot of the pool splits its counts
+  // by the hash of the word into the shards, which are then merged one
+  // shard per task.
+  using WordCounts = absl::flat_hash_map<absl::string_view, uint64>;
+  auto *pool = GetThreadPool();
+  const int num_shards = pool->size();
+  std::vector<std::vector<WordCounts>> slot_counts(
+      pool->size(), std::vector<WordCounts>(num_shards));
+  {
+    TrainingMetrics::Scope count_phase(&metrics_, "count_words",
+                                       sentences_.size());
+    pool->ParallelFor(
+        sentences_.size(), 0, [&](int32 slot, int64 begin, int64 end) {
+          auto &shards = slot_counts[slot];
+          for (int64 i = begin; i < end; ++i) {
+            const auto it = sentences_[i];
+            for (const auto &s : SplitIntoWords(it.first)) {
+              shards[std::hash<absl::string_view>()(s) % num_shards][s] +=
+                  it.second;
+            }
+          }
+        });
   }
 
+  std::vector<WordCounts> shard_counts(num_shards);
+  pool->ParallelFor(num_shards, 1, [&](int32, int64 begin, int64 end) {
+    for (int64 k = begin; k < end; ++k) {
+      for (auto &shards : slot_counts) {
+        for (const auto &it : shards[k]) shard_counts[k][it.first] += it.second;
+        WordCounts().swap(shards[k]);
+      }
+    }
+  });
+
   const int vocab_size = trainer_spec_.vocab_size() - meta_pieces_.size();
   CHECK_GE_OR_RETURN(vocab_size, 0);
 
   uint64 sum = 0;
-  for (const auto &it : freq) {
-    sum += it.second;
+  std::vector<std::pair<absl::string_view, uint64>> freq;
+  for (auto &counts : shard_counts) {
+    for (const auto &it : counts) {
+      sum += it.second;
+      freq.emplace_back(it.first, it.second);
+    }
+    WordCounts().swap(counts);
   }
 
   const auto logsum = std::log(static_cast<float>(sum));
@@ -59,7 +100,8 @@ util::Status Trainer::Train() {
       break;
     }
     final_pieces_.emplace_back(
-        it.first, std::log(static_cast<float>(it.second)) - logsum);
+        std::string(it.first),
+        std::log(static_cast<float>(it.second)) - logsum);
   }
 
   if (trainer_spec_.use_all_vocab()) {
@@ -30,7 +30,8 @@ namespace {
 // Space symbol (U+2581)
 #define WS "\xE2\x96\x81"
 
-std::string RunTrainer(const std::vector<std::string> &input, int size) {
+std::string RunTrainer(const std::vector<std::string> &input, int size,
+                       int num_threads = 1) {
   const std::string input_file =
       util::JoinPath(::testing::TempDir(), "input");
   const std::string model_prefix =
@@ -47,6 +48,7 @@ std::string RunTrainer(const std::vector<std::string> &input, int size) {
   trainer_spec.add_input(input_file);
   trainer_spec.set_vocab_size(size - 3);  // remove <unk>, <s>, </s>
   trainer_spec.set_model_prefix(model_prefix);
+  trainer_spec.set_num_threads(num_threads);
 
   NormalizerSpec normalizer_spec;
   normalizer_spec.set_name("identity");
@@ -76,5 +78,16 @@ TEST(TrainerTest, BasicTest) {
   EXPECT_EQ(WS "I " WS "apple " WS "have " WS "pen",
             RunTrainer({"I have a pen", "I have an apple", "apple pen"}, 10));
 }
+
+TEST(TrainerTest, ParallelCountTest) {
+  std::vector<std::string> input;
+  for (int i = 0; i < 1000; ++i) {
+    input.push_back("w" + std::to_string(i % 37) + " w" +
+                    std::to_string(i % 11) + " w" + std::to_string(i % 5));
+  }
+  const std::string expected = RunTrainer(input, 30, 1);
+  EXPECT_EQ(expected, RunTrainer(input, 30, 4));
+  EXPECT_EQ(expected, RunTrainer(input, 30, 7));
+}
 }  // namespace word
 }  // namespace sentencepiece
@@ -28,5 +28,11 @@ inline bool ConsumePrefix(absl::string_view *str, absl::string_view expected) {
   return true;
 }
 
+inline bool ConsumeSuffix(absl::string_view *str, absl::string_view expected) {
+  if (!absl::EndsWith(*str, expected)) return false;
+  str->remove_suffix(expected.size());
+  return true;
+}
+
 }  // namespace absl
 #endif  // ABSL_STRINGS_STRIP_H